@@ -0,0 +1,722 @@
+/* -----------------------------------------------------------------------------
+ * sift3d_bench.c
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2015-2016 Blaine Rister et al., see LICENSE for details.
+ * -----------------------------------------------------------------------------
+ * Benchmark of the SIFT3D pipeline on synthetic and real volumes, reporting
+ * the time and throughput of each stage as JSON.
+ * -----------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include "immacros.h"
+#include "imutil.h"
+#include "sift.h"
+#include "reg.h"
+
+/* Options */
+#define SIZES 'a'
+#define UNITS 'b'
+#define THREADS 'c'
+#define REPEAT 'd'
+#define DATA 'e'
+#define OUT 'f'
+#define NO_SYNTH 'g'
+#define NO_DATA 'h'
+
+/* Maximum number of sizes and thread counts */
+#define MAX_LIST 16
+
+/* Number of blobs per 64^3 voxels in the synthetic volumes */
+#define BLOB_DENSITY 48
+
+/* Default directory of the real-data cases */
+#ifndef SIFT3D_BENCH_DATA_DIR
+#define SIFT3D_BENCH_DATA_DIR "."
+#endif
+
+/* Help message */
+const char help_msg[] =
+        "Usage: sift3d_bench [options] \n"
+        "\n"
+        "Times each stage of the SIFT3D pipeline on synthetic volumes and on "
+        "the \n"
+        "example data, at each thread count, and prints the results as "
+        "JSON. \n"
+        "\n"
+        "Each case registers a moving image to a fixed one. For synthetic "
+        "cases, the \n"
+        "moving image is the fixed one warped by a known affine "
+        "transformation. \n"
+        "\n"
+        "Example: \n"
+        " sift3d_bench --sizes 64,128,256 --threads 1,2,4,8 --out "
+        "bench.json \n"
+        "\n"
+        "Options: \n"
+        " --sizes [list] \n"
+        "       Comma-separated edge lengths of the synthetic volumes, in "
+        "voxels. \n"
+        "       The default is 64,128. \n"
+        " --units [ux,uy,uz] \n"
+        "       The voxel spacing of the synthetic volumes, for anisotropic "
+        "cases. \n"
+        "       The z dimension is scaled so the volume is roughly cubic in "
+        "world \n"
+        "       units. The default is 1,1,1. \n"
+        " --threads [list] \n"
+        "       Comma-separated thread counts. The default is 1, 2, 4, ... "
+        "up to \n"
+        "       the number of processors. \n"
+        " --repeat [value] \n"
+        "       The number of runs of each stage. The fastest is reported. "
+        "The \n"
+        "       default is 3. \n"
+        " --data [directory] \n"
+        "       The directory holding 1.nii.gz and 2.nii.gz. The default is "
+        "the \n"
+        "       examples/data directory of the source tree. \n"
+        " --out [file] \n"
+        "       Write the JSON to this file, rather than standard output. \n"
+        " --no_synthetic \n"
+        "       Skip the synthetic cases. \n"
+        " --no_data \n"
+        "       Skip the real-data cases. \n"
+        "\n";
+
+/* Stages of the pipeline. The detection stage includes building the
+ * Gaussian and DoG pyramids, finding the extrema and assigning their
+ * orientations. The first three of these are taken from the SIFT3D_Stats of
+ * the detection stage, and the orientation stage re-runs the last alone. */
+typedef enum _Stage {
+        STAGE_DETECT,
+        STAGE_GPYR,
+        STAGE_DOG,
+        STAGE_EXTREMA,
+        STAGE_ORIENT,
+        STAGE_DESCRIBE,
+        STAGE_MATCH,
+        STAGE_RANSAC,
+        STAGE_WARP,
+        NUM_STAGES
+} Stage;
+
+/* Stage names, indexed by Stage */
+static const char *const stage_names[] = {
+        "detect_keypoints",
+        "build_gpyr",
+        "build_dog",
+        "detect_extrema",
+        "assign_orientations",
+        "extract_descriptors",
+        "nn_match",
+        "find_tform_ransac",
+        "im_inv_transform"
+};
+
+/* Result of a stage */
+typedef struct _Stage_time {
+        double seconds; // Fastest wall time
+        long count; // Keypoints, descriptors or matches produced
+} Stage_time;
+
+/* A pair of images to register */
+typedef struct _Bench_case {
+        char name[64];
+        Image fixed, moving;
+} Bench_case;
+
+/* Options */
+typedef struct _Bench_opts {
+        int sizes[MAX_LIST];
+        int threads[MAX_LIST];
+        double units[IM_NDIMS];
+        int num_sizes, num_threads, repeat, synthetic, data;
+        const char *data_dir;
+        const char *out_path;
+} Bench_opts;
+
+/* Print an error message */
+static void err_msg(const char *msg) {
+        SIFT3D_ERR("sift3d_bench: %s \n"
+                "Use \"sift3d_bench --help\" for more information. \n", msg);
+}
+
+/* Get the wall time, in seconds */
+static double now(void) {
+
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double) ts.tv_sec + 1E-9 * (double) ts.tv_nsec;
+}
+
+/* Parse a comma-separated list of positive integers. Returns the number of
+ * elements, or -1 on error. */
+static int parse_int_list(const char *str, int *const list) {
+
+        char *end;
+        int num;
+
+        for (num = 0; num < MAX_LIST; num++) {
+
+                const long val = strtol(str, &end, 10);
+
+                if (end == str || val < 1 || val > 65536)
+                        return -1;
+                list[num] = (int) val;
+
+                if (*end == '\0')
+                        return num + 1;
+                if (*end != ',')
+                        return -1;
+                str = end + 1;
+        }
+
+        return -1;
+}
+
+/* Parse the voxel spacing. */
+static int parse_units(const char *str, double *const units) {
+
+        char *end;
+        int i;
+
+        for (i = 0; i < IM_NDIMS; i++) {
+                units[i] = strtod(str, &end);
+                if (end == str || !(units[i] > 0.0))
+                        return SIFT3D_FAILURE;
+                if (*end != (i < IM_NDIMS - 1 ? ',' : '\0'))
+                        return SIFT3D_FAILURE;
+                str = end + 1;
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Fill an image with anisotropic Gaussian blobs of random position, widths
+ * and intensity, plus a smooth background. The result depends only on seed. */
+static int make_blobs(const int nx, const int ny, const int nz,
+        const double *const units, const unsigned int seed, Image *const im) {
+
+        unsigned int state;
+        int x, y, z, i;
+
+        const double nvox = (double) nx * ny * nz;
+        const int num_blobs = (int) ceil(BLOB_DENSITY * nvox /
+                (64.0 * 64.0 * 64.0));
+
+        im->nx = nx;
+        im->ny = ny;
+        im->nz = nz;
+        im->nc = 1;
+        im->ux = units[0];
+        im->uy = units[1];
+        im->uz = units[2];
+        im_default_stride(im);
+        if (im_resize(im))
+                return SIFT3D_FAILURE;
+
+        // Smooth background
+        SIFT3D_IM_LOOP_START(im, x, y, z)
+                SIFT3D_IM_GET_VOX(im, x, y, z, 0) = 0.1f * (float) (
+                        sin(0.05 * x * units[0]) * cos(0.04 * y * units[1]) +
+                        sin(0.03 * z * units[2]));
+        SIFT3D_IM_LOOP_END
+
+        // Add the blobs, in world units so anisotropic volumes look alike
+        state = seed;
+        for (i = 0; i < num_blobs; i++) {
+
+                int x_start, x_end, y_start, y_end, z_start, z_end;
+
+#define RAND_UNIT() ((state = state * 1103515245u + 12345u), \
+        (double) ((state >> 8) & 0xffffff) / (double) 0x1000000)
+
+                const double cx = RAND_UNIT() * nx;
+                const double cy = RAND_UNIT() * ny;
+                const double cz = RAND_UNIT() * nz;
+                const double sx = 1.5 + 3.0 * RAND_UNIT();
+                const double sy = 1.5 + 3.0 * RAND_UNIT();
+                const double sz = 1.5 + 3.0 * RAND_UNIT();
+                const double amp = 0.5 + RAND_UNIT();
+#undef RAND_UNIT
+                const double rad = 3.0 * SIFT3D_MAX(SIFT3D_MAX(sx, sy), sz);
+
+                x_start = SIFT3D_MAX((int) (cx - rad / units[0]), 0);
+                y_start = SIFT3D_MAX((int) (cy - rad / units[1]), 0);
+                z_start = SIFT3D_MAX((int) (cz - rad / units[2]), 0);
+                x_end = SIFT3D_MIN((int) (cx + rad / units[0]), nx - 1);
+                y_end = SIFT3D_MIN((int) (cy + rad / units[1]), ny - 1);
+                z_end = SIFT3D_MIN((int) (cz + rad / units[2]), nz - 1);
+
+                SIFT3D_IM_LOOP_LIMITED_START(im, x, y, z, x_start, x_end,
+                        y_start, y_end, z_start, z_end)
+
+                        const double dx = (x - cx) * units[0] / sx;
+                        const double dy = (y - cy) * units[1] / sy;
+                        const double dz = (z - cz) * units[2] / sz;
+
+                        SIFT3D_IM_GET_VOX(im, x, y, z, 0) += (float) (amp *
+                                exp(-0.5 * (dx * dx + dy * dy + dz * dz)));
+
+                SIFT3D_IM_LOOP_END
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Make a synthetic case of edge length n. The moving image is the fixed one
+ * rotated slightly about z and shifted. */
+static int make_synthetic(const int n, const double *const units,
+        Bench_case *const bc) {
+
+        Affine aff;
+        Mat_rm A;
+        int i, j;
+
+        const double angle = 0.1;
+        const double shift[] = {2.0, -1.5, 1.0};
+        const int nz = SIFT3D_MAX((int) (n * units[0] / units[2] + 0.5), 8);
+
+        snprintf(bc->name, sizeof(bc->name), "synthetic_%dx%dx%d", n, n, nz);
+
+        if (make_blobs(n, n, nz, units, 1, &bc->fixed))
+                return SIFT3D_FAILURE;
+
+        // Form the transformation, about the center of the volume
+        if (init_Mat_rm(&A, IM_NDIMS, IM_NDIMS + 1, SIFT3D_DOUBLE,
+                SIFT3D_TRUE))
+                return SIFT3D_FAILURE;
+        if (init_Affine(&aff, IM_NDIMS)) {
+                cleanup_Mat_rm(&A);
+                return SIFT3D_FAILURE;
+        }
+        SIFT3D_MAT_RM_GET(&A, 0, 0, double) = cos(angle);
+        SIFT3D_MAT_RM_GET(&A, 0, 1, double) = -sin(angle);
+        SIFT3D_MAT_RM_GET(&A, 1, 0, double) = sin(angle);
+        SIFT3D_MAT_RM_GET(&A, 1, 1, double) = cos(angle);
+        SIFT3D_MAT_RM_GET(&A, 2, 2, double) = 1.0;
+        for (i = 0; i < IM_NDIMS; i++) {
+
+                const double c = 0.5 * (SIFT3D_IM_GET_DIMS(&bc->fixed)[i] - 1);
+
+                double t = c + shift[i];
+                for (j = 0; j < IM_NDIMS; j++) {
+                        t -= SIFT3D_MAT_RM_GET(&A, i, j, double) *
+                                0.5 * (SIFT3D_IM_GET_DIMS(&bc->fixed)[j] - 1);
+                }
+                SIFT3D_MAT_RM_GET(&A, i, IM_NDIMS, double) = t;
+        }
+
+        // Warp the fixed image
+        if (Affine_set_mat(&A, &aff) ||
+                im_inv_transform(&aff, &bc->fixed, LINEAR, SIFT3D_TRUE,
+                        &bc->moving)) {
+                cleanup_Mat_rm(&A);
+                cleanup_tform(&aff);
+                return SIFT3D_FAILURE;
+        }
+        memcpy(SIFT3D_IM_GET_UNITS(&bc->moving), units,
+                IM_NDIMS * sizeof(double));
+
+        cleanup_Mat_rm(&A);
+        cleanup_tform(&aff);
+        return SIFT3D_SUCCESS;
+}
+
+/* Copy a Keypoint_store */
+static int copy_Keypoint_store(const Keypoint_store *const src,
+        Keypoint_store *const dst) {
+
+        int i;
+
+        if (resize_Keypoint_store(dst, src->slab.num))
+                return SIFT3D_FAILURE;
+
+        for (i = 0; i < src->slab.num; i++) {
+                if (copy_Keypoint(src->buf + i, dst->buf + i))
+                        return SIFT3D_FAILURE;
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Print a JSON string, escaping the special characters */
+static void print_json_str(FILE *const out, const char *str) {
+
+        fputc('"', out);
+        for ( ; *str != '\0'; str++) {
+                if (*str == '"' || *str == '\\')
+                        fputc('\\', out);
+                fputc(*str, out);
+        }
+        fputc('"', out);
+}
+
+/* Run each stage of a case repeat times at the current thread count, saving
+ * the fastest time of each. */
+static int run_case(const Bench_case *const bc, const int repeat,
+        Stage_time *const times) {
+
+        SIFT3D sift3d;
+        SIFT3D_Stats stats;
+        Keypoint_store kp_fixed, kp_moving, kp_orient;
+        SIFT3D_Descriptor_store desc_fixed, desc_moving;
+        Mat_rm match_fixed, match_moving;
+        Affine aff;
+        Ransac ran;
+        Image warped;
+        double *conf;
+        int *matches;
+        double t;
+        int i, r, num_matches, ret;
+
+        // Initialize intermediates
+        ret = SIFT3D_FAILURE;
+        conf = NULL;
+        matches = NULL;
+        init_Keypoint_store(&kp_fixed);
+        init_Keypoint_store(&kp_moving);
+        init_Keypoint_store(&kp_orient);
+        init_SIFT3D_Descriptor_store(&desc_fixed);
+        init_SIFT3D_Descriptor_store(&desc_moving);
+        init_Ransac(&ran);
+        init_im(&warped);
+        init_SIFT3D_Stats(&stats);
+        if (init_SIFT3D(&sift3d))
+                return SIFT3D_FAILURE;
+        set_stats_SIFT3D(&sift3d, &stats);
+        if (init_Mat_rm(&match_fixed, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE) ||
+                init_Mat_rm(&match_moving, 0, 0, SIFT3D_DOUBLE,
+                        SIFT3D_FALSE) ||
+                init_Affine(&aff, IM_NDIMS))
+                goto run_case_quit;
+
+        for (i = 0; i < NUM_STAGES; i++) {
+                times[i].seconds = HUGE_VAL;
+                times[i].count = 0;
+        }
+
+#define TIME_STAGE(stage, count_expr, call) { \
+        t = now(); \
+        if (call) \
+                goto run_case_quit; \
+        t = now() - t; \
+        times[stage].seconds = SIFT3D_MIN(times[stage].seconds, t); \
+        times[stage].count = (long) (count_expr); \
+}
+
+        for (r = 0; r < repeat; r++) {
+
+                reset_SIFT3D_Stats(&stats);
+                TIME_STAGE(STAGE_DETECT, kp_fixed.slab.num,
+                        SIFT3D_detect_keypoints(&sift3d, &bc->fixed,
+                                &kp_fixed))
+
+                // Break down the detection stage
+                for (i = 0; i < 3; i++) {
+
+                        const SIFT3D_Stage_stats *const st = stats.stages +
+                                SIFT3D_STAGE_GPYR + i;
+                        Stage_time *const time = times + STAGE_GPYR + i;
+
+                        if (st->calls < 1)
+                                continue;
+                        time->seconds = SIFT3D_MIN(time->seconds,
+                                st->last_seconds);
+                        time->count = (long) st->count;
+                }
+
+                // Detection of the moving image is untimed
+                if (SIFT3D_detect_keypoints(&sift3d, &bc->moving,
+                        &kp_moving))
+                        goto run_case_quit;
+
+                // The later stages need keypoints in both images
+                if (kp_fixed.slab.num < 1 || kp_moving.slab.num < 1)
+                        break;
+
+                // Re-assign the orientations of a copy, keeping those of
+                // the detector for matching
+                if (copy_Keypoint_store(&kp_fixed, &kp_orient))
+                        goto run_case_quit;
+                TIME_STAGE(STAGE_ORIENT, kp_orient.slab.num,
+                        SIFT3D_assign_orientations(&sift3d, &bc->fixed,
+                                &kp_orient, &conf))
+                TIME_STAGE(STAGE_DESCRIBE, desc_fixed.num,
+                        SIFT3D_extract_descriptors(&sift3d, &kp_fixed,
+                                &desc_fixed))
+                if (SIFT3D_extract_descriptors(&sift3d, &kp_moving,
+                        &desc_moving))
+                        goto run_case_quit;
+
+                free(matches);
+                matches = NULL;
+                TIME_STAGE(STAGE_MATCH, 0,
+                        SIFT3D_nn_match(&desc_moving, &desc_fixed,
+                                (float) SIFT3D_nn_thresh_default, &matches))
+                if (SIFT3D_matches_to_Mat_rm(&desc_moving, &desc_fixed,
+                        matches, &match_moving, &match_fixed))
+                        goto run_case_quit;
+                num_matches = match_moving.num_rows;
+                times[STAGE_MATCH].count = num_matches;
+
+                // The orientations, and so the matches, may be too few
+                srand(1);
+                if (num_matches >= 2 * (IM_NDIMS + 1)) {
+                        TIME_STAGE(STAGE_RANSAC, num_matches,
+                                find_tform_ransac(&ran, &match_moving,
+                                        &match_fixed, &aff))
+                        TIME_STAGE(STAGE_WARP, 1,
+                                im_inv_transform(&aff, &bc->moving, LINEAR,
+                                        SIFT3D_TRUE, &warped))
+                }
+        }
+#undef TIME_STAGE
+        ret = SIFT3D_SUCCESS;
+
+run_case_quit:
+        if (ret)
+                SIFT3D_ERR("sift3d_bench: case %s failed \n", bc->name);
+        free(conf);
+        free(matches);
+        cleanup_SIFT3D(&sift3d);
+        cleanup_Keypoint_store(&kp_fixed);
+        cleanup_Keypoint_store(&kp_moving);
+        cleanup_Keypoint_store(&kp_orient);
+        cleanup_SIFT3D_Descriptor_store(&desc_fixed);
+        cleanup_SIFT3D_Descriptor_store(&desc_moving);
+        cleanup_Mat_rm(&match_fixed);
+        cleanup_Mat_rm(&match_moving);
+        cleanup_tform(&aff);
+        im_free(&warped);
+        return ret;
+}
+
+/* Run a case at each thread count and print its JSON object. A failed run
+ * is printed with null stages. */
+static int bench_case(FILE *const out, const Bench_opts *const opts,
+        const Bench_case *const bc, const int first) {
+
+        Stage_time times[NUM_STAGES];
+        int i, j, ret;
+
+        const double nvox = (double) bc->fixed.nx * bc->fixed.ny *
+                bc->fixed.nz;
+
+        fprintf(out, "%s    {\n      \"name\": ", first ? "" : ",\n");
+        print_json_str(out, bc->name);
+        fprintf(out, ",\n      \"dims\": [%d, %d, %d],\n"
+                "      \"units\": [%g, %g, %g],\n"
+                "      \"runs\": [\n", bc->fixed.nx, bc->fixed.ny,
+                bc->fixed.nz, bc->fixed.ux, bc->fixed.uy, bc->fixed.uz);
+
+        ret = SIFT3D_SUCCESS;
+        for (i = 0; i < opts->num_threads; i++) {
+
+                const int num_threads = opts->threads[i];
+
+                fprintf(out, "%s        {\n          \"threads\": %d,\n"
+                        "          \"stages\": ", i ? ",\n" : "",
+                        num_threads);
+
+                // Keep the output valid if this run fails
+                SIFT3D_set_num_threads(num_threads);
+                if (run_case(bc, opts->repeat, times)) {
+                        fputs("null\n        }", out);
+                        ret = SIFT3D_FAILURE;
+                        continue;
+                }
+
+                fputs("{\n", out);
+                for (j = 0; j < NUM_STAGES; j++) {
+
+                        const Stage_time *const st = times + j;
+                        const int ran = st->seconds != HUGE_VAL;
+
+                        fprintf(out, "            \"%s\": ", stage_names[j]);
+                        if (ran) {
+                                fprintf(out, "{\"seconds\": %.6f, "
+                                        "\"voxels_per_s\": %.6g, "
+                                        "\"count\": %ld}", st->seconds,
+                                        nvox / SIFT3D_MAX(st->seconds, 1E-9),
+                                        st->count);
+                        } else {
+                                fputs("null", out);
+                        }
+                        fputs(j < NUM_STAGES - 1 ? ",\n" : "\n", out);
+                }
+                fputs("          }\n        }", out);
+                fflush(out);
+        }
+        fputs("\n      ]\n    }", out);
+        SIFT3D_set_num_threads(0);
+
+        return ret;
+}
+
+/* Read a real-data case. Returns SIFT3D_SUCCESS on success,
+ * SIFT3D_WRAPPER_NOT_COMPILED if NIFTI is not supported, or SIFT3D_FAILURE
+ * otherwise. */
+static int read_data_case(const char *const dir, Bench_case *const bc) {
+
+        char fixed_path[1024], moving_path[1024];
+        int ret;
+
+        snprintf(bc->name, sizeof(bc->name), "examples_1_to_2");
+        snprintf(fixed_path, sizeof(fixed_path), "%s%c2.nii.gz", dir,
+                SIFT3D_FILE_SEP);
+        snprintf(moving_path, sizeof(moving_path), "%s%c1.nii.gz", dir,
+                SIFT3D_FILE_SEP);
+
+        if ((ret = im_read(fixed_path, &bc->fixed)))
+                return ret;
+        return im_read(moving_path, &bc->moving);
+}
+
+int main(int argc, char *argv[]) {
+
+        Bench_opts opts;
+        Bench_case bc;
+        FILE *out;
+        int c, i, first, ret, max_threads;
+
+	const struct option longopts[] = {
+		{"help", no_argument, NULL, 'H'},
+		{"sizes", required_argument, NULL, SIZES},
+		{"units", required_argument, NULL, UNITS},
+		{"threads", required_argument, NULL, THREADS},
+		{"repeat", required_argument, NULL, REPEAT},
+		{"data", required_argument, NULL, DATA},
+		{"out", required_argument, NULL, OUT},
+		{"no_synthetic", no_argument, NULL, NO_SYNTH},
+		{"no_data", no_argument, NULL, NO_DATA},
+		{0, 0, 0, 0}
+	};
+
+        // Default options
+        opts.sizes[0] = 64;
+        opts.sizes[1] = 128;
+        opts.num_sizes = 2;
+        opts.units[0] = opts.units[1] = opts.units[2] = 1.0;
+        opts.repeat = 3;
+        opts.synthetic = opts.data = SIFT3D_TRUE;
+        opts.data_dir = SIFT3D_BENCH_DATA_DIR;
+        opts.out_path = NULL;
+        max_threads = SIFT3D_team_size();
+        opts.num_threads = 0;
+        for (c = 1; c < max_threads && opts.num_threads < MAX_LIST - 1;
+                c *= 2) {
+                opts.threads[opts.num_threads++] = c;
+        }
+        opts.threads[opts.num_threads++] = max_threads;
+
+        // Parse the options
+        opterr = 1;
+        while ((c = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+                switch (c) {
+                case 'H':
+                        puts(help_msg);
+                        return 0;
+                case SIZES:
+                        if ((opts.num_sizes = parse_int_list(optarg,
+                                opts.sizes)) < 0) {
+                                err_msg("invalid --sizes");
+                                return 1;
+                        }
+                        break;
+                case UNITS:
+                        if (parse_units(optarg, opts.units)) {
+                                err_msg("invalid --units");
+                                return 1;
+                        }
+                        break;
+                case THREADS:
+                        if ((opts.num_threads = parse_int_list(optarg,
+                                opts.threads)) < 0) {
+                                err_msg("invalid --threads");
+                                return 1;
+                        }
+                        break;
+                case REPEAT:
+                        if ((opts.repeat = atoi(optarg)) < 1) {
+                                err_msg("invalid --repeat");
+                                return 1;
+                        }
+                        break;
+                case DATA:
+                        opts.data_dir = optarg;
+                        break;
+                case OUT:
+                        opts.out_path = optarg;
+                        break;
+                case NO_SYNTH:
+                        opts.synthetic = SIFT3D_FALSE;
+                        break;
+                case NO_DATA:
+                        opts.data = SIFT3D_FALSE;
+                        break;
+                case '?':
+                default:
+                        return 1;
+                }
+        }
+        if (optind < argc) {
+                err_msg("unexpected argument");
+                return 1;
+        }
+
+        // Open the output
+        if (opts.out_path == NULL) {
+                out = stdout;
+        } else if ((out = fopen(opts.out_path, "w")) == NULL) {
+                err_msg("failed to open the output file");
+                return 1;
+        }
+
+        fprintf(out, "{\n  \"benchmark\": \"sift3d_bench\",\n"
+                "  \"repeat\": %d,\n  \"cases\": [\n", opts.repeat);
+
+        // Run the cases
+        ret = 0;
+        first = SIFT3D_TRUE;
+        for (i = 0; opts.synthetic && i < opts.num_sizes; i++) {
+
+                init_im(&bc.fixed);
+                init_im(&bc.moving);
+                if (make_synthetic(opts.sizes[i], opts.units, &bc) ||
+                        bench_case(out, &opts, &bc, first))
+                        ret = 1;
+                first = SIFT3D_FALSE;
+                im_free(&bc.fixed);
+                im_free(&bc.moving);
+        }
+        if (opts.data) {
+
+                int read_ret;
+
+                init_im(&bc.fixed);
+                init_im(&bc.moving);
+                if ((read_ret = read_data_case(opts.data_dir, &bc)) ==
+                        SIFT3D_WRAPPER_NOT_COMPILED) {
+                        SIFT3D_ERR("sift3d_bench: skipping the real-data "
+                                "case, which requires NIFTI support \n");
+                } else if (read_ret || bench_case(out, &opts, &bc, first)) {
+                        ret = 1;
+                }
+                im_free(&bc.fixed);
+                im_free(&bc.moving);
+        }
+
+        fputs("\n  ]\n}\n", out);
+        if (out != stdout)
+                fclose(out);
+
+        return ret;
+}
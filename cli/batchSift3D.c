@@ -0,0 +1,274 @@
+/* -----------------------------------------------------------------------------
+ * batchSift3D.c
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2015-2016 Blaine Rister et al., see LICENSE for details.
+ * -----------------------------------------------------------------------------
+ * This file contains the CLI to extract SIFT3D keypoints and descriptors from
+ * a batch of images.
+ * -----------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include "immacros.h"
+#include "imutil.h"
+#include "sift.h"
+
+/* Options */
+#define WORKERS 'a'
+#define MEM_LIMIT 'b'
+
+/* Message buffer size */
+#define BUF_SIZE 1024
+
+/* Help message */
+const char help_msg[] =
+        "Usage: batchSift3D [manifest.txt] \n"
+        "\n"
+        "Detects SIFT3D keypoints and extracts their descriptors from a "
+        "batch of images.\n"
+        "\n"
+        "Each line of the manifest lists an input image and an output file, "
+        "separated \n"
+        "by whitespace. Blank lines and lines beginning with '#' are "
+        "ignored. The \n"
+        "keypoints and descriptors of each image are written together, as "
+        "with the \n"
+        "--features option of kpSift3D. \n"
+        "\n"
+        "Example: \n"
+        " batchSift3D --workers 8 --mem_limit 16000 manifest.txt \n"
+        "\n"
+        "Supported input formats: .dcm, .nii, .nii.gz, directory \n"
+        "Supported output formats: .sift3d \n"
+        "\n"
+        "Processing options: \n"
+        " --workers [value] \n"
+        "       The number of images to process in parallel. The default is "
+        "\n"
+        "       the number of processors. \n"
+        " --mem_limit [value] \n"
+        "       The memory budget, in megabytes. The number of workers is \n"
+        "       reduced to fit, based on the size of the first image. \n"
+        "\n";
+
+/* Print an error message */
+static void err_msg(const char *msg) {
+        SIFT3D_ERR("batchSift3D: %s \n"
+                "Use \"batchSift3D --help\" for more information. \n", msg);
+}
+
+/* Report an unexpected error. */
+static void err_msgu(const char *msg) {
+        err_msg(msg);
+        print_bug_msg();
+}
+
+/* Helper function to copy a string. */
+static char *copy_str(const char *const str) {
+
+        char *const copy = malloc(strlen(str) + 1);
+
+        if (copy != NULL)
+                strcpy(copy, str);
+
+        return copy;
+}
+
+/* Read a manifest of input and output paths. On success, *im_paths and
+ * *out_paths are newly-allocated arrays of *num newly-allocated strings.
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int read_manifest(const char *path, char ***const im_paths,
+        char ***const out_paths, int *const num) {
+
+        char line[BUF_SIZE];
+        FILE *file;
+        int line_num, cap;
+
+        // Open the file
+        if ((file = fopen(path, "r")) == NULL) {
+                SIFT3D_ERR("read_manifest: failed to open %s \n", path);
+                return SIFT3D_FAILURE;
+        }
+
+        *im_paths = *out_paths = NULL;
+        *num = cap = 0;
+        for (line_num = 1; fgets(line, BUF_SIZE, file) != NULL; line_num++) {
+
+                char *im_path, *out_path, *extra;
+
+                // Parse the line
+                im_path = strtok(line, " \t\r\n");
+                if (im_path == NULL || im_path[0] == '#')
+                        continue;
+                out_path = strtok(NULL, " \t\r\n");
+                extra = strtok(NULL, " \t\r\n");
+                if (out_path == NULL || extra != NULL) {
+                        SIFT3D_ERR("read_manifest: %s line %d: expected an "
+                                "input and an output path \n", path,
+                                line_num);
+                        goto read_manifest_quit;
+                }
+
+                // Make room for the paths
+                if (*num == cap) {
+
+                        char **im_new, **out_new;
+
+                        cap = SIFT3D_MAX(2 * cap, 64);
+                        if ((im_new = realloc(*im_paths,
+                                cap * sizeof(char *))) == NULL)
+                                goto read_manifest_quit;
+                        *im_paths = im_new;
+                        if ((out_new = realloc(*out_paths,
+                                cap * sizeof(char *))) == NULL)
+                                goto read_manifest_quit;
+                        *out_paths = out_new;
+                }
+
+                // Save the paths
+                (*im_paths)[*num] = copy_str(im_path);
+                (*out_paths)[*num] = copy_str(out_path);
+                (*num)++;
+                if ((*im_paths)[*num - 1] == NULL ||
+                        (*out_paths)[*num - 1] == NULL)
+                        goto read_manifest_quit;
+        }
+
+        fclose(file);
+        return SIFT3D_SUCCESS;
+
+read_manifest_quit:
+        fclose(file);
+        return SIFT3D_FAILURE;
+}
+
+/* Free the paths read by read_manifest. */
+static void cleanup_manifest(char **const im_paths, char **const out_paths,
+        const int num) {
+
+        int i;
+
+        for (i = 0; i < num; i++) {
+                free(im_paths[i]);
+                free(out_paths[i]);
+        }
+
+        free(im_paths);
+        free(out_paths);
+}
+
+/* CLI for batch processing */
+int main(int argc, char *argv[]) {
+
+	SIFT3D sift3d;
+        char **im_paths, **out_paths;
+        char *manifest_path;
+        size_t mem_limit;
+        int c, num_args, num_workers, num, num_failed;
+
+        const struct option longopts[] = {
+                {"workers", required_argument, NULL, WORKERS},
+                {"mem_limit", required_argument, NULL, MEM_LIMIT},
+                {0, 0, 0, 0}
+        };
+
+        // Parse the GNU standard options
+        switch (parse_gnu(argc, argv)) {
+                case SIFT3D_HELP:
+                        puts(help_msg);
+                        print_opts_SIFT3D();
+                        return 0;
+                case SIFT3D_VERSION:
+                        return 0;
+                case SIFT3D_FALSE:
+                        break;
+                default:
+                        err_msgu("Unexpected return from parse_gnu \n");
+                        return 1;
+        }
+
+	// Initialize the SIFT data
+	if (init_SIFT3D(&sift3d)) {
+		err_msgu("Failed to initialize SIFT data.");
+                return 1;
+        }
+
+        // Parse the SIFT3D options and increment the argument list
+        if ((argc = parse_args_SIFT3D(&sift3d, argc, argv, SIFT3D_FALSE)) < 0)
+                return 1;
+
+        // Parse the batchSift3D options
+        opterr = 1;
+        num_workers = SIFT3D_MAX((int) sysconf(_SC_NPROCESSORS_ONLN), 1);
+        mem_limit = 0;
+        while ((c = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+                switch (c) {
+                        case WORKERS:
+                                num_workers = atoi(optarg);
+                                if (num_workers < 1) {
+                                        err_msg("Invalid value for workers.");
+                                        return 1;
+                                }
+                                break;
+                        case MEM_LIMIT:
+                        {
+                                const double mb = atof(optarg);
+                                if (mb <= 0.0) {
+                                        err_msg("Invalid value for "
+                                                "mem_limit.");
+                                        return 1;
+                                }
+                                mem_limit = (size_t) (mb * 1024.0 * 1024.0);
+                                break;
+                        }
+                        case '?':
+                        default:
+                                return 1;
+                }
+        }
+
+        // Parse the required arguments
+        num_args = argc - optind;
+        if (num_args < 1) {
+                err_msg("Not enough arguments.");
+                return 1;
+        } else if (num_args > 1) {
+                err_msg("Too many arguments.");
+                return 1;
+        }
+        manifest_path = argv[optind];
+
+        // Read the manifest
+        if (read_manifest(manifest_path, &im_paths, &out_paths, &num)) {
+                err_msg("Could not read the manifest.");
+                return 1;
+        }
+
+        // Process the images
+        if (SIFT3D_extract_batch(&sift3d, (const char *const *) im_paths,
+                (const char *const *) out_paths, num, num_workers, mem_limit,
+                &num_failed)) {
+                err_msgu("Failed to process the batch.");
+                return 1;
+        }
+
+        cleanup_manifest(im_paths, out_paths, num);
+        cleanup_SIFT3D(&sift3d);
+
+        // Report failures of individual images
+        if (num_failed > 0) {
+
+                char msg[BUF_SIZE];
+
+                snprintf(msg, BUF_SIZE, "Failed to process %d of %d images.",
+                        num_failed, num);
+                err_msg(msg);
+                return 1;
+        }
+
+	return 0;
+}
@@ -9,14 +9,24 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <getopt.h>
 #include "immacros.h"
 #include "imutil.h"
 #include "sift.h"
 
 #define BUF_SIZE (1 << 10)
 
+/* Options */
+#define MASK 'a'
+#define SLAB_SIZE 'b'
+#define TYPE 'c'
+
+/* The extension of dense descriptor files */
+const char ext_dense[] = ".sift3dd";
+
 /* The log tag */
 const char tag[] = "denseSift3d";
 
@@ -29,6 +39,10 @@ const char help_msg[] =
         "histogram bin. The last '%' character in the output filename is \n"
         "replaced by the channel index.\n"
         "\n"
+        "If the output filename ends in \".sift3dd\", the descriptors are \n"
+        "instead written to a single dense descriptor file, one slab of \n"
+        "z-planes at a time, without holding the whole output in memory. \n"
+        "\n"
         "Supported image formats: \n"
 	"	.dcm (DICOM) \n"
         "	.nii (nifti-1) \n"
@@ -43,7 +57,29 @@ const char help_msg[] =
         "       -out1.nii.gz \n"
         "            ... \n"
         "       -out11.nii.gz \n"
+        "\n"
+        "Options: \n"
+        " --mask [filename] \n"
+        "       Zeroes the descriptors where this image is zero, skipping \n"
+        "       their computation when rotation invariance is enabled. It \n"
+        "       must have the same dimensions as the input image. \n"
+        " --slab_size [planes] \n"
+        "       Processes the image in slabs of this many z-planes, to save \n"
+        "       memory. The results are the same. By default, dense \n"
+        "       descriptor files are written in slabs of 32 planes, and \n"
+        "       images are processed whole. \n"
+        " --type [float32 | float16 | uint8] \n"
+        "       The element type of a dense descriptor file. uint8 \n"
+        "       quantizes over the range of the input intensities. \n"
+        "       (default: float32) \n"
         "\n";
+
+/* The default number of planes per slab of dense descriptor files */
+const int slab_size_default = 32;
+
+/* Dense descriptor file type names, indexed by dense_type */
+const char *const type_names[] = {"float32", "float16", "uint8"};
+#define NUM_TYPES ((int) (sizeof(type_names) / sizeof(type_names[0])))
           
 /* Print an error message. */      
 void err_msg(const char *msg) {
@@ -58,14 +94,38 @@ void err_msgu(const char *msg) {
         print_bug_msg();
 }
 
+/* Dense descriptor sink which copies each slab into an image. */
+static int copy_slab(void *const arg, const Image *const slab, 
+        const int z_start) {
+
+        int x, y, z, c;
+
+        Image *const desc = (Image *) arg;
+
+        SIFT3D_IM_LOOP_START_C(slab, x, y, z, c)
+                SIFT3D_IM_GET_VOX(desc, x, y, z + z_start, c) = 
+                        SIFT3D_IM_GET_VOX(slab, x, y, z, c);
+        SIFT3D_IM_LOOP_END_C
+
+        return SIFT3D_SUCCESS;
+}
+
 int main(int argc, char **argv) {
 
         char out_name[BUF_SIZE], chan_str[BUF_SIZE];
-        Image im, desc, chan;
+        Image im, mask, desc, chan;
         SIFT3D sift3d;
-        char *in_path, *out_path, *marker;
-        size_t len;
-        int c, marker_pos;
+        char *in_path, *out_path, *mask_path, *marker;
+        size_t len, ext_len;
+        dense_type type;
+        int c, i, opt, num_args, marker_pos, slab_size, is_dense;
+
+        const struct option longopts[] = {
+                {"mask", required_argument, NULL, MASK},
+                {"slab_size", required_argument, NULL, SLAB_SIZE},
+                {"type", required_argument, NULL, TYPE},
+                {0, 0, 0, 0}
+        };
 
         /* Parse the GNU standard options */
         switch (parse_gnu(argc, argv)) {
@@ -76,19 +136,65 @@ int main(int argc, char **argv) {
                         return 0;
         }
 
+        /* Parse the options */
+        opterr = 1;
+        mask_path = NULL;
+        slab_size = 0;
+        type = DENSE_FLOAT32;
+        while ((opt = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
+                switch (opt) {
+                        case MASK:
+                                mask_path = optarg;
+                                break;
+                        case SLAB_SIZE:
+                                slab_size = atoi(optarg);
+                                if (slab_size < 1) {
+                                        err_msg("invalid slab size");
+                                        return 1;
+                                }
+                                break;
+                        case TYPE:
+                                for (i = 0; i < NUM_TYPES; i++) {
+                                        if (!strcmp(optarg, type_names[i]))
+                                                break;
+                                }
+                                if (i == NUM_TYPES) {
+                                        err_msg("unrecognized type");
+                                        return 1;
+                                }
+                                type = (dense_type) i;
+                                break;
+                        case '?':
+                        default:
+                                return 1;
+                }
+        }
+
         /* Parse the arguments */
-        if (argc < 3) {
+        num_args = argc - optind;
+        if (num_args < 2) {
                 err_msg("Not enough arguments.");
                 return 1;
-        } else if (argc > 3) {
+        } else if (num_args > 2) {
                 err_msg("Too many arguments.");
                 return 1;
         }
-        in_path = argv[1];
-        out_path = argv[2];
+        in_path = argv[optind];
+        out_path = argv[optind + 1];
+
+        /* Check for a dense descriptor file */
+        len = strlen(out_path);
+        ext_len = strlen(ext_dense);
+        is_dense = len > ext_len && !strcmp(out_path + len - ext_len, 
+                ext_dense);
+        if (!is_dense && type != DENSE_FLOAT32) {
+                err_msg("--type requires a \".sift3dd\" output file.");
+                return 1;
+        }
 
         /* Initialize data */
         init_im(&im);
+        init_im(&mask);
         init_im(&desc);
         init_im(&chan);
         if (init_SIFT3D(&sift3d)) {
@@ -107,6 +213,31 @@ int main(int argc, char **argv) {
                 return 1;
         }
 
+        /* Optionally read the mask */
+        if (mask_path != NULL) {
+                if (im_read(mask_path, &mask)) {
+
+                        char msg[BUF_SIZE];
+
+                        snprintf(msg, BUF_SIZE, "Failed to read mask \"%s\".",
+                                mask_path);
+                        err_msg(msg);
+                        return 1;
+                }
+                set_mask_SIFT3D(&sift3d, &mask);
+        }
+
+        /* Write a dense descriptor file */
+        if (is_dense) {
+                if (SIFT3D_extract_dense_descriptors_file(&sift3d, &im, 
+                        slab_size > 0 ? slab_size : slab_size_default, type,
+                        out_path)) {
+                        err_msgu("Failed to extract descriptors.");
+                        return 1;
+                }
+                return 0;
+        }
+
         /* Ensure the output file name has a % character */
         if ((marker = strrchr(out_path, '%')) == NULL) {
                 err_msg("output filename must contain '%'.");
@@ -126,10 +257,18 @@ int main(int argc, char **argv) {
                 return 1;
         }
 
-        /* Extract the descriptors */
-        if (SIFT3D_extract_dense_descriptors(&sift3d, &im, &desc)) {
-                err_msgu("Failed to extract descriptors.");
-                return 1;
+        /* Extract the descriptors, optionally in slabs */
+        if (slab_size > 0) {
+                if (im_copy_dims(&im, &desc))
+                        goto extract_quit;
+                desc.nc = HIST_NUMEL;
+                im_default_stride(&desc);
+                if (im_resize(&desc) ||
+                        SIFT3D_extract_dense_descriptors_stream(&sift3d, &im,
+                                slab_size, copy_slab, &desc))
+                        goto extract_quit;
+        } else if (SIFT3D_extract_dense_descriptors(&sift3d, &im, &desc)) {
+                goto extract_quit;
         }
         
 
@@ -162,4 +301,8 @@ int main(int argc, char **argv) {
         }
 
         return 0;
+
+extract_quit:
+        err_msgu("Failed to extract descriptors.");
+        return 1;
 }
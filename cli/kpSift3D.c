@@ -9,6 +9,7 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <getopt.h>
 #include "immacros.h"
 #include "imutil.h"
@@ -18,6 +19,9 @@
 #define KEYS 'a'
 #define DESC 'b'
 #define DRAW 'c'
+#define FEATURES 'd'
+#define TILE_SIZE 'e'
+#define MASK 'f'
 
 /* Message buffer size */
 #define BUF_SIZE 1024
@@ -35,14 +39,30 @@ const char help_msg[] =
         "Output options: \n"
         " --keys [filename] \n"
         "       Specifies the output file name for the keypoints. \n"
-        "       Supported file formats: .csv, .csv.gz \n"
+        "       Supported file formats: .csv, .csv.gz, .sift3d \n"
         " --desc [filename] \n"
         "       Specifies the output file name for the descriptors. \n"
-        "       Supported file formats: .csv, .csv.gz \n"
+        "       Supported file formats: .csv, .csv.gz, .sift3d \n"
+        " --features [filename] \n"
+        "       Writes both the keypoints and descriptors to a single \n"
+        "       binary file, which is much faster to read and write. \n"
+        "       Supported file formats: .sift3d \n"
         " --draw [filename] \n"
         "       Draws the keypoints in image space. \n"
         "       Supported file formats: .dcm, .nii, .nii.gz, directory \n"
         "At least one of the output options must be specified. \n"
+        "\n"
+        "Processing options: \n"
+        " --tile_size [value] \n"
+        "       Processes the image in tiles of this size, in voxels, to \n"
+        "       reduce memory usage. The results are the same as without \n"
+        "       tiling. \n"
+        " --mask [filename] \n"
+        "       Detects keypoints only where this image is nonzero. It \n"
+        "       must have the same dimensions as the input image. Only the \n"
+        "       region of the mask is processed. Cannot be combined with \n"
+        "       --tile_size. \n"
+        "       Supported file formats: .dcm, .nii, .nii.gz, directory \n"
         "\n";
 
 /* Print an error message */
@@ -60,17 +80,21 @@ static void err_msgu(const char *msg) {
 /* CLI for 3D SIFT */
 int main(int argc, char *argv[]) {
 
-	Image im;
+	Image im, mask;
 	SIFT3D sift3d;
 	Keypoint_store kp;
 	SIFT3D_Descriptor_store desc;
-	char *im_path, *keys_path, *desc_path, *draw_path;
-        int c, num_args;
+	char *im_path, *keys_path, *desc_path, *draw_path, *features_path,
+                *mask_path;
+        int c, num_args, tile_size;
 
         const struct option longopts[] = {
                 {"keys", required_argument, NULL, KEYS},
                 {"desc", required_argument, NULL, DESC},
                 {"draw", required_argument, NULL, DRAW},
+                {"features", required_argument, NULL, FEATURES},
+                {"tile_size", required_argument, NULL, TILE_SIZE},
+                {"mask", required_argument, NULL, MASK},
                 {0, 0, 0, 0}
         };
 
@@ -101,7 +125,8 @@ int main(int argc, char *argv[]) {
 
         // Parse the kpSift3d options
         opterr = 1;
-        keys_path = desc_path = draw_path = NULL;
+        keys_path = desc_path = draw_path = features_path = mask_path = NULL;
+        tile_size = 0;
         while ((c = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
                 switch (c) {
                         case KEYS:
@@ -113,6 +138,20 @@ int main(int argc, char *argv[]) {
                         case DRAW:
                                 draw_path = optarg;
                                 break;
+                        case FEATURES:
+                                features_path = optarg;
+                                break;
+                        case TILE_SIZE:
+                                tile_size = atoi(optarg);
+                                if (tile_size < 1) {
+                                        err_msg("Invalid value for "
+                                                "tile_size.");
+                                        return 1;
+                                }
+                                break;
+                        case MASK:
+                                mask_path = optarg;
+                                break;
                         case '?':
                         default:
                                 return 1;
@@ -120,10 +159,15 @@ int main(int argc, char *argv[]) {
         }
 
         // Ensure we have at least one output
-        if (keys_path == NULL && desc_path == NULL && draw_path == NULL) {
+        if (keys_path == NULL && desc_path == NULL && draw_path == NULL &&
+                features_path == NULL) {
                 err_msg("No outputs specified.");
                 return 1;
         }
+        if (mask_path != NULL && tile_size > 0) {
+                err_msg("--mask cannot be combined with --tile_size.");
+                return 1;
+        }
 
         // Parse the required arguments
         num_args = argc - optind;
@@ -140,6 +184,7 @@ int main(int argc, char *argv[]) {
 	init_Keypoint_store(&kp); 
 	init_SIFT3D_Descriptor_store(&desc); 
 	init_im(&im);
+	init_im(&mask);
 
 	// Read the image
 	if (im_read(im_path, &im)) {
@@ -147,8 +192,23 @@ int main(int argc, char *argv[]) {
                 return 1;
         }
 
-	// Extract keypoints
-	if (SIFT3D_detect_keypoints(&sift3d, &im, &kp)) {
+        // Optionally read the mask
+        if (mask_path != NULL) {
+                if (im_read(mask_path, &mask)) {
+                        err_msg("Could not read mask.");
+                        return 1;
+                }
+                set_mask_SIFT3D(&sift3d, &mask);
+        }
+
+	// Extract keypoints, and in tiled mode, their descriptors
+        if (tile_size > 0) {
+                if (SIFT3D_extract_features_tiled(&sift3d, &im, tile_size, 
+                        &kp, &desc)) {
+                        err_msgu("Failed to extract features.");
+                        return 1;
+                }
+        } else if (SIFT3D_detect_keypoints(&sift3d, &im, &kp)) {
 		err_msgu("Failed to detect keypoints.");
                 return 1;
         }
@@ -165,16 +225,18 @@ int main(int argc, char *argv[]) {
         }
 
         // Optionally extract descriptors
-        if (desc_path != NULL) {
+        if (desc_path != NULL || features_path != NULL) {
 
                 // Extract descriptors
-	        if (SIFT3D_extract_descriptors(&sift3d, &kp,&desc)) {
+	        if (tile_size < 1 && 
+                        SIFT3D_extract_descriptors(&sift3d, &kp,&desc)) {
                         err_msgu("Failed to extract descriptors.");
                         return 1;
                 }
 
-                // Write the descriptors
-                if (write_SIFT3D_Descriptor_store(desc_path, &desc)) {
+                // Optionally write the descriptors
+                if (desc_path != NULL && 
+                        write_SIFT3D_Descriptor_store(desc_path, &desc)) {
 
                         char msg[BUF_SIZE];
 
@@ -183,6 +245,18 @@ int main(int argc, char *argv[]) {
                         err_msg(msg);
                         return 1;
                 }
+
+                // Optionally write the keypoints and descriptors together
+                if (features_path != NULL && 
+                        write_SIFT3D_features(features_path, &kp, &desc)) {
+
+                        char msg[BUF_SIZE];
+
+                        snprintf(msg, BUF_SIZE, "Failed to write the "
+				"features to \"%s\"", features_path);
+                        err_msg(msg);
+                        return 1;
+                }
         }
 
         // Optionally draw the keypoints
@@ -29,6 +29,15 @@
 #define NUM_ITER 'l'
 #define TYPE 'm' 
 #define RESAMPLE 'n'
+#define NN_CHECKS 'o'
+#define SRC_FEATURES 'p'
+#define REF_FEATURES 'q'
+#define CONFIDENCE 'r'
+#define PROSAC 's'
+#define STATS 't'
+#define SRC_MASK 'u'
+#define REF_MASK 'v'
+#define MATCH_RADIUS 'w'
 
 /* Message buffer size */
 #define BUF_SIZE 1024
@@ -64,6 +73,10 @@ static void print_help() {
         "       Supported file formats: .dcm, .nii, .nii.gz, directory \n"
         " --lines [filename] - Lines drawn between matching keypoints \n"
         "       Supported file formats: .dcm, .nii, .nii.gz, directory \n"
+        " --src_features [filename] - The source image descriptors. \n"
+        "       Supported file formats: .csv, .csv.gz, .sift3d \n"
+        " --ref_features [filename] - The reference image descriptors. \n"
+        "       Supported file formats: .csv, .csv.gz, .sift3d \n"
         "At least one output option must be specified. \n"
         "\n"
         "Other options: \n"
@@ -72,16 +85,34 @@ static void print_help() {
         " --err_thresh [value] - RANSAC inlier threshold, in the interval \n"
         "       (0, inf). This is a threshold on the squared Euclidean \n"
         "       distance in real-world units. (default: %.1f) \n"
-        " --num_iter [value] - Number of RANSAC iterations. (default: %d) \n"
+        " --num_iter [value] - Maximum number of RANSAC iterations. \n"
+        "       (default: %d) \n"
+        " --confidence [value] - Stop RANSAC early once an outlier-free \n"
+        "       sample has been drawn with this probability, in the \n"
+        "       interval [0, 1). Zero disables early stopping. \n"
+        "       (default: %.3f) \n"
+        " --prosac - Sample the best matches first, as in PROSAC. \n"
+        " --nn_checks [value] - Use approximate nearest neighbor matching, \n"
+        "       comparing each feature to at most this many others. Faster \n"
+        "       but less accurate than the default exhaustive search. \n"
+        " --match_radius [value] - Only match features within this \n"
+        "       distance of each other, in the units of the source image. \n"
+        "       Much faster for images which are roughly aligned. \n"
         " --type [value] - Type of transformation to be applied. \n"
         "       Supported arguments: \"affine\" (default: affine) \n"
 	" --resample - Internally resample the images to have the same \n"
 	"	physical resolution. This is slow. Use it when the images \n"
 	"	have very different resolutions, for example registering 5mm \n"
 	"	to 1mm slices. \n"
+        " --stats - Print the time and results of each stage to stderr. \n"
+        " --src_mask [filename] - Detect source features only where this \n"
+        "       image is nonzero. It must have the dimensions of the \n"
+        "       source image. Cannot be combined with --resample. \n"
+        " --ref_mask [filename] - The same as --src_mask, for the \n"
+        "       reference image. \n"
         "\n",
         SIFT3D_nn_thresh_default, SIFT3D_err_thresh_default, 
-        SIFT3D_num_iter_default);
+        SIFT3D_num_iter_default, SIFT3D_confidence_default);
         print_opts_SIFT3D();
 }
 
@@ -97,18 +128,42 @@ static void err_msgu(const char *msg) {
         print_bug_msg();
 }
 
+/* Print the statistics of each stage which was run */
+static void print_stats(const SIFT3D_Stats *const stats) {
+
+        int i;
+
+        SIFT3D_ERR("%-12s %6s %10s %10s %10s %12s \n", "stage", "calls", 
+                "seconds", "count", "aux", "peak_bytes");
+        for (i = 0; i < SIFT3D_NUM_STAGES; i++) {
+
+                const SIFT3D_Stage_stats *const st = stats->stages + i;
+
+                if (st->calls < 1)
+                        continue;
+
+                SIFT3D_ERR("%-12s %6ld %10.4f %10lu %10lu %12lu \n", 
+                        SIFT3D_stage_name((SIFT3D_stage) i), st->calls, 
+                        st->seconds, (unsigned long) st->count, 
+                        (unsigned long) st->aux, 
+                        (unsigned long) st->peak_bytes);
+        }
+}
+
 int main(int argc, char *argv[]) {
 
         Reg_SIFT3D reg;
         SIFT3D sift3d;
+        SIFT3D_Stats stats;
         Ransac ran;
-        Image src, ref;
+        Image src, ref, mask;
         Mat_rm match_src, match_ref;
         void *tform, *tform_arg;
         char *src_path, *ref_path, *warped_path, *match_path, *tform_path,
-                *concat_path, *keys_path, *lines_path;
+                *concat_path, *keys_path, *lines_path, *src_features_path,
+                *ref_features_path, *src_mask_path, *ref_mask_path;
         tform_type type;
-        int num_args, c, have_match, have_tform, resample;
+        int num_args, c, have_match, have_tform, resample, print;
 
         const struct option longopts[] = {
                 {"matches", required_argument, NULL, MATCHES},
@@ -120,8 +175,17 @@ int main(int argc, char *argv[]) {
                 {"nn_thresh", required_argument, NULL, NN_THRESH},
                 {"err_thresh", required_argument, NULL, ERR_THRESH},
                 {"num_iter", required_argument, NULL, NUM_ITER},
+                {"confidence", required_argument, NULL, CONFIDENCE},
+                {"prosac", no_argument, NULL, PROSAC},
                 {"type", required_argument, NULL, TYPE},
 		{"resample", no_argument, NULL, RESAMPLE},
+                {"nn_checks", required_argument, NULL, NN_CHECKS},
+                {"match_radius", required_argument, NULL, MATCH_RADIUS},
+                {"src_features", required_argument, NULL, SRC_FEATURES},
+                {"ref_features", required_argument, NULL, REF_FEATURES},
+                {"stats", no_argument, NULL, STATS},
+                {"src_mask", required_argument, NULL, SRC_MASK},
+                {"ref_mask", required_argument, NULL, REF_MASK},
                 {0, 0, 0, 0}
         };
 
@@ -144,8 +208,10 @@ int main(int argc, char *argv[]) {
         // Initialize the data
         init_im(&src);
         init_im(&ref);
+        init_im(&mask);
         init_Reg_SIFT3D(&reg);
         init_Ransac(&ran);
+        init_SIFT3D_Stats(&stats);
         if (init_SIFT3D(&sift3d) ||
                 init_Mat_rm(&match_src, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE) ||
                 init_Mat_rm(&match_ref, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE)) {
@@ -159,17 +225,17 @@ int main(int argc, char *argv[]) {
         // Parse the SIFT3D options
         if ((argc = parse_args_SIFT3D(&sift3d, argc, argv, SIFT3D_FALSE)) < 0)
                 return 1;
-        if (set_SIFT3D_Reg_SIFT3D(&reg, &sift3d) ||
-                set_Ransac_Reg_SIFT3D(&reg, &ran)) {
-                err_msgu("Failed to save the SIFT3D or Ransac parameters.");
+        if (set_SIFT3D_Reg_SIFT3D(&reg, &sift3d)) {
+                err_msgu("Failed to save the SIFT3D parameters.");
                 return 1;
         }
 
         // Parse the remaining options 
         opterr = 1;
-        have_match = have_tform = resample = SIFT3D_FALSE;
+        have_match = have_tform = resample = print = SIFT3D_FALSE;
         match_path = tform_path = warped_path = concat_path = keys_path =
-                lines_path = NULL;
+                lines_path = src_features_path = ref_features_path = 
+                src_mask_path = ref_mask_path = NULL;
         while ((c = getopt_long(argc, argv, "", longopts, NULL)) != -1) {
                 switch (c) {
                 case MATCHES:
@@ -240,17 +306,81 @@ int main(int argc, char *argv[]) {
                 case RESAMPLE:
                         resample = SIFT3D_TRUE;
                         break;
+                case STATS:
+                        print = SIFT3D_TRUE;
+                        break;
+                case SRC_FEATURES:
+                        src_features_path = optarg;
+                        have_match = SIFT3D_TRUE;
+                        break;
+                case REF_FEATURES:
+                        ref_features_path = optarg;
+                        have_match = SIFT3D_TRUE;
+                        break;
+                case CONFIDENCE:
+                {
+                        const double confidence = atof(optarg);
+                        if (set_confidence_Ransac(&ran, confidence)) {
+                                err_msg("Invalid value for confidence.");
+                                return 1;
+                        }
+                        break;
+                }
+                case PROSAC:
+                        set_prosac_Ransac(&ran, SIFT3D_TRUE);
+                        break;
+                case MATCH_RADIUS:
+                {
+                        const double radius = atof(optarg);
+                        if (radius <= 0.0 ||
+                                set_match_radius_Reg_SIFT3D(&reg, NULL, 
+                                        radius)) {
+                                err_msg("Invalid value for match_radius.");
+                                return 1;
+                        }
+                        break;
+                }
+                case SRC_MASK:
+                        src_mask_path = optarg;
+                        break;
+                case REF_MASK:
+                        ref_mask_path = optarg;
+                        break;
+                case NN_CHECKS:
+                {
+                        const int nn_checks = atoi(optarg);
+                        if (nn_checks < 1 ||
+                                set_nn_checks_Reg_SIFT3D(&reg, nn_checks)) {
+                                err_msg("Invalid value for nn_checks.");
+                                return 1;
+                        }
+                        break;
+                }
                 case '?':
                 default:
                         return 1;
                 }
         }
 
+        // Save the Ransac parameters
+        if (set_Ransac_Reg_SIFT3D(&reg, &ran)) {
+                err_msgu("Failed to save the Ransac parameters.");
+                return 1;
+        }
+
+        // Optionally record the statistics of each stage
+        if (print)
+                set_stats_Reg_SIFT3D(&reg, &stats);
+
         // Ensure that at least one output was specified
         if (!have_match && !have_tform) {
                 err_msg("No outputs were specified.");
                 return 1;
         }
+        if (resample && (src_mask_path != NULL || ref_mask_path != NULL)) {
+                err_msg("Masks cannot be combined with --resample.");
+                return 1;
+        }
 
         // Parse the required arguments
         num_args = argc - optind;
@@ -294,6 +424,29 @@ int main(int argc, char *argv[]) {
                 return 1;
         }
 
+        // Optionally read the masks, which are copied by reg
+        if (src_mask_path != NULL && (im_read(src_mask_path, &mask) ||
+                set_src_mask_Reg_SIFT3D(&reg, &mask))) {
+
+                char msg[BUF_SIZE];
+
+                snprintf(msg, BUF_SIZE, "Failed to read the source mask "
+			"\"%s\"", src_mask_path);
+                err_msg(msg);
+                return 1;
+        }
+        if (ref_mask_path != NULL && (im_read(ref_mask_path, &mask) ||
+                set_ref_mask_Reg_SIFT3D(&reg, &mask))) {
+
+                char msg[BUF_SIZE];
+
+                snprintf(msg, BUF_SIZE, "Failed to read the reference mask "
+			"\"%s\"", ref_mask_path);
+                err_msg(msg);
+                return 1;
+        }
+        im_free(&mask);
+
 	// Process the images	
 	tform_arg = have_tform ? tform : NULL;
 	if (resample) {
@@ -356,6 +509,28 @@ int main(int argc, char *argv[]) {
                 // Clean up
                 cleanup_Mat_rm(&matches);
         }
+        if (src_features_path != NULL && 
+                write_SIFT3D_Descriptor_store(src_features_path, 
+                        &reg.desc_src)) {
+
+                char msg[BUF_SIZE];
+
+                snprintf(msg, BUF_SIZE, "Failed to write the source "
+			"features \"%s\"", src_features_path);
+                err_msg(msg);
+                return 1;
+        }
+        if (ref_features_path != NULL && 
+                write_SIFT3D_Descriptor_store(ref_features_path, 
+                        &reg.desc_ref)) {
+
+                char msg[BUF_SIZE];
+
+                snprintf(msg, BUF_SIZE, "Failed to write the reference "
+			"features \"%s\"", ref_features_path);
+                err_msg(msg);
+                return 1;
+        }
         if (tform_path != NULL && write_tform(tform_path, tform)) {
 
                 char msg[BUF_SIZE];
@@ -370,6 +545,9 @@ int main(int argc, char *argv[]) {
         if (warped_path != NULL) {
 
                 Image warped;
+                double start;
+
+                SIFT3D_Stats *const rec = print ? &stats : NULL;
 
                 // Initialize intermediates
                 init_im(&warped);
@@ -381,11 +559,14 @@ int main(int argc, char *argv[]) {
                 }
 
                 // Warp
+                start = SIFT3D_STATS_START(rec);
                 if (im_inv_transform(tform, &src, interp, SIFT3D_FALSE, 
                         &warped)) {
                         err_msgu("Failed to warp the source image.");
                         return 1;
                 }
+                record_SIFT3D_Stats(rec, SIFT3D_STAGE_WARP, start, 
+                        warped.size, 0, warped.size * sizeof(float));
 
                 // Write the warped image
                 if (im_write(warped_path, &warped)) {
@@ -481,5 +662,8 @@ int main(int argc, char *argv[]) {
                 im_free(&lines);
         }
 
+        if (print)
+                print_stats(&stats);
+
 	return 0;
 }
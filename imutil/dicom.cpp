@@ -39,6 +39,9 @@ int write_dcm_dir(const char *path, const Image *const im,
         return dcm_error_message();
 }
 
+void im_set_dcm_cache(const int enable) {
+}
+
 #else
 
 /*----------------Include the very picky DCMTK----------------*/
@@ -83,6 +86,10 @@ int write_dcm_dir(const char *path, const Image *const im,
 #include <algorithm>
 #include <memory>
 #include <vector>
+#include <map>
+#include <mutex>
+#include <string>
+#include <cstring>
 #include <cmath>
 #include <cfloat>
 #include <stdint.h>
@@ -121,8 +128,15 @@ static void default_Dcm_meta(Dcm_meta *const meta);
 static int load_file(const char *path, DcmFileFormat &fileFormat);
 static int read_dcm_cpp(const char *path, Image *const im);
 static int read_dcm_img(const Dicom &dicom, Image *const im);
+static int read_dcm_pixels(const Dicom &dicom, const int off_z, 
+        Image *const im);
 static int read_dso(const char *imDir, Dicom &dso, 
                             Image *const mask);
+static int read_dcm_header(const std::string &path, Dicom &dicom);
+static void read_dcm_header_task(void *const arg, const int batch);
+static void read_dcm_pixels_task(void *const arg, const int batch);
+static void dcm_for_batches(const int num_files, SIFT3D_task_fn task_fn,
+        void *const arg);
 static int read_dcm_dir_meta(const char *path, std::vector<Dicom> &dicoms);
 static int read_dcm_dir_cpp(const char *path, Image *const im);
 static int write_dcm_cpp(const char *path, const Image *const im,
@@ -132,8 +146,6 @@ static int write_dcm_dir_cpp(const char *path, const Image *const im,
 static void set_meta_defaults(const Dcm_meta *const meta, 
         Dcm_meta *const meta_new);
 static int dcm_resize_im(const std::vector<Dicom> &dicoms, Image *const im);
-static int copy_slice(const Image *const slice, const int off_z, 
-        Image *const volume);
 
 /* Helper class to store DICOM data. */
 class Dicom {
@@ -228,6 +240,32 @@ public:
         }
 };
 
+/* Number of files read by each task of read_dcm_dir */
+const int dcm_batch_size = 8;
+
+/* Entry of the DICOM header cache. The entry is valid as long as the file 
+ * has the same size and modification time. */
+struct Dcm_cache_entry {
+        off_t size;
+        time_t mtime;
+        Dicom dicom;
+};
+
+/* Cache of the DICOM headers read by read_dcm_dir, keyed by path. Enabled by
+ * im_set_dcm_cache. */
+static std::map<std::string, Dcm_cache_entry> dcm_cache;
+static std::mutex dcm_cache_mutex;
+static bool dcm_cache_enabled = false;
+
+/* Arguments to the tasks of read_dcm_dir */
+struct Dcm_dir_task {
+        const std::vector<std::string> *paths; // Files to read
+        std::vector<Dicom> *dicoms; // The headers of each file
+        const std::vector<int> *off_z; // First slice of each file in im
+        Image *im; // The output volume
+        std::vector<int> *ret; // The return code of each file
+};
+
 /* Read a DICOM file with DCMTK. */
 static int load_file(const char *path, DcmFileFormat &fileFormat) {
 
@@ -242,7 +280,7 @@ static int load_file(const char *path, DcmFileFormat &fileFormat) {
         return SIFT3D_SUCCESS;
 }
 
-/* Load the data from a DICOM file */
+/* Load the metadata of a DICOM file, without decoding the pixel data */
 Dicom::Dicom(const char *path) : filename(path), valid(false) {
 
         // Read the file
@@ -385,36 +423,44 @@ Dicom::Dicom(const char *path) : filename(path), valid(false) {
                 }
         }
 
-        // Load the DicomImage object
-        DicomImage dicomImage(path);
-        if (dicomImage.getStatus() != EIS_Normal) {
-                SIFT3D_ERR("Dicom.Dicom: failed to open image %s (%s)\n",
-                        path, 
-                        DicomImage::getString(dicomImage.getStatus()));
+        // Check for color images
+        const char *photometricStr;
+        status = data->findAndGetString(DCM_PhotometricInterpretation, 
+                photometricStr);
+        if (status.bad() || photometricStr == NULL) {
+                SIFT3D_ERR("Dicom.Dicom: failed to get "
+                        "PhotometricInterpretation from file %s (%s)\n", path,
+                        status.text());
                 return;
         }
-
-        // Check for color images
-        if (!dicomImage.isMonochrome()) {
+        if (strncmp(photometricStr, "MONOCHROME", 10)) {
                 SIFT3D_ERR("Dicom.Dicom: reading of color DICOM images is "
                         "not supported at this time \n");
                 return;
         }
         nc = 1;
 
-        // Read the dimensions
-        nx = dicomImage.getWidth();
-        ny = dicomImage.getHeight();
-        nz = dicomImage.getFrameCount();
+        // Read the dimensions from the header. The pixel data is not loaded,
+        // since loadFile leaves large elements on disk until they are used.
+        Uint16 rows, columns;
+        Sint32 numFrames;
+        if (data->findAndGetUint16(DCM_Rows, rows).bad() ||
+                data->findAndGetUint16(DCM_Columns, columns).bad()) {
+                SIFT3D_ERR("Dicom.Dicom: failed to get the dimensions of "
+                        "file %s \n", path);
+                return;
+        }
+        if (data->findAndGetSint32(DCM_NumberOfFrames, numFrames).bad())
+                numFrames = 1;
+        nx = columns;
+        ny = rows;
+        nz = numFrames;
         if (nx < 1 || ny < 1 || nz < 1) {
                 SIFT3D_ERR("Dicom.Dicom: invalid dimensions for file %s "
                         "(%d, %d, %d)\n", path, nx, ny, nz);
                 return;
         }
 
-        // Set the window 
-        dicomImage.setMinMaxWindow();
-
         valid = true;
 }
 
@@ -523,23 +569,7 @@ static int read_dcm_cpp(const char *path, Image *const im) {
 /* Helper function to read DICOM image data */
 static int read_dcm_img(const Dicom &dicom, Image *const im) {
 
-        const void *data;
-        const DiMonoPixel *pixels;
-	uint32_t shift;
-	int x, y, z, depth;
-        const int bufNBits = 32;
-
-	// Initialize JPEG decoders
-	DJDecoderRegistration::registerCodecs();
-
-        // Initialize the DicomImage object
-        const char *path = dicom.name();
-	DicomImage dicomImage(path);
-        if (dicomImage.getStatus() != EIS_Normal) {
-                SIFT3D_ERR("read_dcm_cpp: failed to open image %s (%s)\n",
-                        path, DicomImage::getString(dicomImage.getStatus()));
-		goto read_dcm_img_quit;
-        }
+        int ret;
 
         // Initialize the image fields
         im->nx = dicom.getNx();
@@ -553,26 +583,76 @@ static int read_dcm_img(const Dicom &dicom, Image *const im) {
         // Resize the output
         im_default_stride(im);
         if (im_resize(im))
-		goto read_dcm_img_quit;
+                return SIFT3D_FAILURE;
+
+	// Initialize JPEG decoders
+	DJDecoderRegistration::registerCodecs();
+
+        ret = read_dcm_pixels(dicom, 0, im);
+
+	// Clean up
+	DJDecoderRegistration::cleanup();
+
+        return ret;
+}
+
+/* Helper function to decode the pixel data of a DICOM file into the slices 
+ * [off_z, off_z + dicom.getNz()) of im, which must already have the 
+ * dimensions of the file in x, y and c. The decoders must be registered. 
+ * This can be called concurrently for different slices of the same image. */
+static int read_dcm_pixels(const Dicom &dicom, const int off_z, 
+        Image *const im) {
+
+        const void *data;
+        const DiMonoPixel *pixels;
+	int x, y, z;
+
+        const char *path = dicom.name();
+        const int nz = dicom.getNz();
+
+        // Verify the dimensions
+        if (dicom.getNx() != im->nx || dicom.getNy() != im->ny || 
+                dicom.getNc() != im->nc || off_z < 0 || 
+                off_z + nz > im->nz) {
+                SIFT3D_ERR("read_dcm_pixels: file %s does not fit in the "
+                        "image \n", path);
+                return SIFT3D_FAILURE;
+        }
+
+        // Initialize the DicomImage object
+	DicomImage dicomImage(path);
+        if (dicomImage.getStatus() != EIS_Normal) {
+                SIFT3D_ERR("read_dcm_pixels: failed to open image %s (%s)\n",
+                        path, DicomImage::getString(dicomImage.getStatus()));
+                return SIFT3D_FAILURE;
+        }
+        if ((int) dicomImage.getWidth() != im->nx || 
+                (int) dicomImage.getHeight() != im->ny || 
+                (int) dicomImage.getFrameCount() != nz) {
+                SIFT3D_ERR("read_dcm_pixels: the pixel data of %s does not "
+                        "match its header \n", path);
+                return SIFT3D_FAILURE;
+        }
 
         // Get the vendor-independent intermediate pixel data
         pixels = (const DiMonoPixel *) dicomImage.getInterData();
         if (pixels == NULL) {
-                SIFT3D_ERR("read_dcm_img: failed to get intermediate data for "
-                        "%s\n", path);
-                goto read_dcm_img_quit;
+                SIFT3D_ERR("read_dcm_pixels: failed to get intermediate data "
+                        "for %s\n", path);
+                return SIFT3D_FAILURE;
         }
-        depth = pixels->getBits();
 
         // Macro to copy the data
 #define COPY_DATA(type) \
-        SIFT3D_IM_LOOP_START(im, x, y, z) \
+        for (z = 0; z < nz; z++) { \
+        for (y = 0; y < im->ny; y++) { \
+        for (x = 0; x < im->nx; x++) { \
                 const int y_stride = im->nx; \
                 const int z_stride = im->nx * im->ny; \
-                SIFT3D_IM_GET_VOX(im, x, y, z, 0) = \
+                SIFT3D_IM_GET_VOX(im, x, y, z + off_z, 0) = \
                         (float) *((type *) data + x + y * y_stride + \
                                 z * z_stride);\
-        SIFT3D_IM_LOOP_END
+        }}}
 
         // Choose the appropriate data type and copy the data
         data = pixels->getData(); 
@@ -596,74 +676,13 @@ static int read_dcm_img(const Dicom &dicom, Image *const im) {
                 COPY_DATA(int32_t)
                 break;
         default:
-                SIFT3D_ERR("read_dcm_img: unrecognized pixel representation "
-                        "for %s\n", path);
-                goto read_dcm_img_quit;
+                SIFT3D_ERR("read_dcm_pixels: unrecognized pixel "
+                        "representation for %s\n", path);
+                return SIFT3D_FAILURE;
         }
 #undef COPY_DATA
 
-#if 0
-        // Get the bit depth of the image
-        depth = dicomImage.Depth();
-        if (depth > bufNBits) 
-                SIFT3D_ERR("read_dcm_cpp: buffer is insufficiently wide "
-                        "for %d-bit data of image %s \n", depth, path);
-		goto read_dcm_img_quit;
-        }
-
-        // Get the number of bits by which we need to shift the 32-bit data, to
-        // recover the original resolution (DICOM uses Big-endian encoding)
-        shift = isLittleEndian() ? static_cast<uint32_t>(bufNBits - depth) : 0;
-
-        // Read each frame
-        for (int i = 0; i < im->nz; i++) { 
-
-                int x, y, z;
-
-                const int x_start = 0;
-                const int y_start = 0;
-                const int z_start = i;
-                const int x_end = im->nx - 1;
-                const int y_end = im->ny - 1;
-                const int z_end = z_start;
-
-                // Get a pointer to the data, rendered as a 32-bit int
-                const uint32_t *const frameData = 
-                        static_cast<const uint32_t *const>(
-                                dicomImage.getOutputData(
-                                        static_cast<int>(bufNBits), i));
-                if (frameData == NULL) {
-                        SIFT3D_ERR("read_dcm_cpp: could not get data from "
-                                "image %s frame %d (%s)\n", path, i, 
-                                DicomImage::getString(dicomImage.getStatus()));
-			goto read_dcm_img_quit;
-                }
-
-                // Copy the frame
-                SIFT3D_IM_LOOP_LIMITED_START(im, x, y, z, x_start, x_end,
-                        y_start, y_end, z_start, z_end)
-
-                        // Get the voxel and shift it to match the original
-                        // magnitude 
-                        const uint32_t vox =
-                                frameData[x + y * im->nx] >> shift;
-
-                        // Convert to float and write to the output image
-                        SIFT3D_IM_GET_VOX(im, x, y, z, 0) =
-                                static_cast<float>(vox);
-
-                SIFT3D_IM_LOOP_END
-        }
-#endif
-
-	// Clean up
-	DJDecoderRegistration::cleanup();
-
         return SIFT3D_SUCCESS;
-
-read_dcm_img_quit:
-	DJDecoderRegistration::cleanup();
-	return SIFT3D_FAILURE;
 }
 
 /* Read a DICOM Segmentation Object (DSO) mask. 
@@ -822,6 +841,111 @@ static int read_dso(const char *imDir, Dicom &dso,
         return SIFT3D_SUCCESS;
 }
 
+/* Enable or disable the cache of DICOM headers. When enabled, re-reading a
+ * series skips the header pass for files which have not changed since they
+ * were last read. Disabling the cache releases its contents. */
+void im_set_dcm_cache(const int enable) {
+
+        std::lock_guard<std::mutex> lock(dcm_cache_mutex);
+
+        dcm_cache_enabled = enable != 0;
+        if (!dcm_cache_enabled)
+                dcm_cache.clear();
+}
+
+/* Helper function to read the header of a DICOM file, using the cache if it
+ * is enabled. */
+static int read_dcm_header(const std::string &path, Dicom &dicom) {
+
+        struct stat st;
+
+        if (stat(path.c_str(), &st)) {
+                SIFT3D_ERR("read_dcm_header: cannot find file %s \n", 
+                        path.c_str());
+                return SIFT3D_FAILURE;
+        }
+
+        // Check the cache
+        {
+                std::lock_guard<std::mutex> lock(dcm_cache_mutex);
+
+                if (dcm_cache_enabled) {
+                        auto it = dcm_cache.find(path);
+                        if (it != dcm_cache.end() && 
+                                it->second.size == st.st_size &&
+                                it->second.mtime == st.st_mtime) {
+                                dicom = it->second.dicom;
+                                return SIFT3D_SUCCESS;
+                        }
+                }
+        }
+
+        // Read the file
+        dicom = Dicom(path.c_str());
+        if (!dicom.isValid())
+                return SIFT3D_FAILURE;
+
+        // Save the result
+        std::lock_guard<std::mutex> lock(dcm_cache_mutex);
+        if (dcm_cache_enabled) {
+                Dcm_cache_entry &entry = dcm_cache[path];
+                entry.size = st.st_size;
+                entry.mtime = st.st_mtime;
+                entry.dicom = dicom;
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Task to read the headers of a batch of DICOM files. */
+static void read_dcm_header_task(void *const arg, const int batch) {
+
+        Dcm_dir_task *const task = (Dcm_dir_task *) arg;
+        const int num_files = task->paths->size();
+        const int start = batch * dcm_batch_size;
+        const int end = SIFT3D_MIN(start + dcm_batch_size, num_files);
+
+        for (int i = start; i < end; i++) {
+                CATCH_EXCEPTIONS((*task->ret)[i], "read_dcm_dir_meta", 
+                        read_dcm_header, (*task->paths)[i], 
+                        (*task->dicoms)[i]);
+        }
+}
+
+/* Task to decode the pixel data of a batch of DICOM files, each directly into
+ * its slices of the output volume. */
+static void read_dcm_pixels_task(void *const arg, const int batch) {
+
+        Dcm_dir_task *const task = (Dcm_dir_task *) arg;
+        const int num_files = task->dicoms->size();
+        const int start = batch * dcm_batch_size;
+        const int end = SIFT3D_MIN(start + dcm_batch_size, num_files);
+
+        for (int i = start; i < end; i++) {
+                CATCH_EXCEPTIONS((*task->ret)[i], "read_dcm_dir_cpp", 
+                        read_dcm_pixels, (*task->dicoms)[i], 
+                        (*task->off_z)[i], task->im);
+        }
+}
+
+/* Run task_fn on each batch of dcm_batch_size files. The batches run in 
+ * parallel if DCMTK was built with thread support, otherwise serially, since
+ * DCMTK's global state is then not protected. */
+static void dcm_for_batches(const int num_files, SIFT3D_task_fn task_fn,
+        void *const arg) {
+
+        const int num_batches = (num_files + dcm_batch_size - 1) / 
+                dcm_batch_size;
+
+#ifdef SIFT3D_DCMTK_THREADS
+        SIFT3D_parallel_for(num_batches, task_fn, arg);
+#else
+        for (int i = 0; i < num_batches; i++) {
+                task_fn(arg, i);
+        }
+#endif
+}
+
 /* Helper function to read the metadata from a directory of DICOM files */
 static int read_dcm_dir_meta(const char *path, std::vector<Dicom> &dicoms) {
 
@@ -846,8 +970,8 @@ static int read_dcm_dir_meta(const char *path, std::vector<Dicom> &dicoms) {
                 return SIFT3D_FAILURE;
         }
 
-        // Get all of the .dcm files in the directory, ignoring DSOs
-        dicoms.clear();
+        // Get all of the .dcm files in the directory
+        std::vector<std::string> paths;
         while ((ent = readdir(dir)) != NULL) {
 
                 // Form the full file path
@@ -857,23 +981,37 @@ static int read_dcm_dir_meta(const char *path, std::vector<Dicom> &dicoms) {
                 if (im_get_format(fullfile.c_str()) != DICOM)
                         continue;
 
-                // Read the file
-                Dicom dicom(fullfile.c_str());
-                if (!dicom.isValid()) {
-                        closedir(dir);
-                        return SIFT3D_FAILURE;
-                }
-
-                // Ignore DSOs
-                if (dicom.isDSO())
-                        continue;
-
                 // Add the file to the list
-                dicoms.push_back(dicom);
+                paths.push_back(fullfile);
         }
 
         // Release the directory
         closedir(dir);
+
+        // Read the headers in batches
+        const int num_files = paths.size();
+        std::vector<Dicom> headers(num_files);
+        std::vector<int> status(num_files, SIFT3D_FAILURE);
+        Dcm_dir_task task;
+        task.paths = &paths;
+        task.dicoms = &headers;
+        task.off_z = NULL;
+        task.im = NULL;
+        task.ret = &status;
+        dcm_for_batches(num_files, read_dcm_header_task, &task);
+
+        // Check for errors and ignore DSOs
+        dicoms.clear();
+        for (int i = 0; i < num_files; i++) {
+
+                if (status[i])
+                        return SIFT3D_FAILURE;
+
+                if (headers[i].isDSO())
+                        continue;
+
+                dicoms.push_back(headers[i]);
+        }
         
         // Verify that dicom files were found
         if (dicoms.size() == 0) {
@@ -1003,31 +1141,9 @@ static int dcm_resize_im(const std::vector<Dicom> &dicoms, Image *const im) {
         return SIFT3D_SUCCESS;
 }
 
-/* Helper function to copy a slice into a larger volume. */
-static int copy_slice(const Image *const slice, const int off_z, 
-        Image *const volume) {
-
-        int x, y, z, c;
-
-        // Verify dimensions
-        if (volume->nz < slice->nz + off_z ||
-                volume->nx != slice->nx ||
-                volume->ny != slice->ny ||
-                volume->nc != slice->nc)
-                return SIFT3D_FAILURE;
-
-        // Copy the data
-        SIFT3D_IM_LOOP_START_C(slice, x, y, z, c)
-
-                SIFT3D_IM_GET_VOX(volume, x, y, z + off_z, c) =
-                        SIFT3D_IM_GET_VOX(slice, x, y, z, c);
-
-        SIFT3D_IM_LOOP_END_C
-
-        return SIFT3D_SUCCESS;
-}
-
-/* Helper function to read a directory of DICOM files using C++ */
+/* Helper function to read a directory of DICOM files using C++. The pixel 
+ * data of the files is decoded in batches, in parallel if DCMTK supports 
+ * it. */
 static int read_dcm_dir_cpp(const char *path, Image *const im) {
 
         int ret, i, off_z;
@@ -1041,25 +1157,37 @@ static int read_dcm_dir_cpp(const char *path, Image *const im) {
         if (ret = dcm_resize_im(dicoms, im))
                 return ret;
 
-        // Allocate a temporary image for the slices
-        Image slice;
-        init_im(&slice);
-
-        // Read the image data
-        off_z = 0;
+        // Compute the first slice of each file
         const int num_files = dicoms.size();
+        std::vector<int> offsets(num_files);
+        off_z = 0;
         for (i = 0; i < num_files; i++) {
+                offsets[i] = off_z;
+                off_z += dicoms[i].getNz();
+        }
+        assert(off_z == im->nz);
 
-                // Read and copy the slice data
-                if (read_dcm_img(dicoms[i], &slice) ||
-                        copy_slice(&slice, off_z, im)) {
-                        im_free(&slice);
+	// Initialize JPEG decoders
+	DJDecoderRegistration::registerCodecs();
+
+        // Read the image data
+        std::vector<int> status(num_files, SIFT3D_FAILURE);
+        Dcm_dir_task task;
+        task.paths = NULL;
+        task.dicoms = &dicoms;
+        task.off_z = &offsets;
+        task.im = im;
+        task.ret = &status;
+        dcm_for_batches(num_files, read_dcm_pixels_task, &task);
+
+	// Clean up
+	DJDecoderRegistration::cleanup();
+
+        // Check for errors
+        for (i = 0; i < num_files; i++) {
+                if (status[i])
                         return SIFT3D_FAILURE;
-                }
-                off_z += slice.nz;
         }
-        assert(off_z == im->nz);
-        im_free(&slice);
 
         return SIFT3D_SUCCESS;
 } 
@@ -37,6 +37,11 @@ extern "C" {
 #define SIFT3D_AZ_MAX_F (2 * (float) M_PI) // Maximum azimuth
 #define SIFT3D_PO_MAX_F ((float) M_PI) // Maximum polar angle
 
+// Get the start time of a stage recorded in a SIFT3D_Stats struct, skipping
+// the clock if stats is NULL. See record_SIFT3D_Stats.
+#define SIFT3D_STATS_START(stats) \
+        ((stats) == NULL ? 0.0 : SIFT3D_wall_time())
+
 // Compiler flags
 #ifdef __GNUC__
 #define SIFT3D_IGNORE_UNUSED __attribute__((unused))
@@ -62,6 +67,12 @@ extern "C" {
 #define SIFT3D_IM_GET_VOX(im, x, y, z, c) ((im)->data[ \
         SIFT3D_IM_GET_IDX((im), (x), (y), (z), (c))])
 
+// As SIFT3D_IM_GET_VOX, but reads a float from an image of any element type.
+// This cannot be assigned.
+#define SIFT3D_IM_GET_VOX_F(im, x, y, z, c) ((im)->type == IM_FLOAT32 ? \
+        SIFT3D_IM_GET_VOX(im, x, y, z, c) : \
+        im_load_vox((im), SIFT3D_IM_GET_IDX((im), (x), (y), (z), (c))))
+
 // Loop through an image in x, z, y order. Delmit with SIFT3D_IM_LOOP_END
 #define SIFT3D_IM_LOOP_START(im, x, y, z) \
 	for (z = 0; (z) < (im)->nz; (z)++) {	\
@@ -110,6 +121,22 @@ extern "C" {
 		(vd)->z = 0.5f * (SIFT3D_IM_GET_VOX(im, x, y, (z) + 1, c) - \
 			   SIFT3D_IM_GET_VOX(im, x, y, (z) - 1, c))
 
+/* As SIFT3D_IM_GET_GRAD, for an image of any element type. */
+#define SIFT3D_IM_GET_GRAD_F(im, x, y, z, c, vd) \
+        if ((im)->type == IM_FLOAT32) { \
+                SIFT3D_IM_GET_GRAD(im, x, y, z, c, vd); \
+        } else { \
+		(vd)->x = 0.5f * (im_load_vox(im, SIFT3D_IM_GET_IDX(im, \
+                        (x) + 1, y, z, c)) - im_load_vox(im, \
+                        SIFT3D_IM_GET_IDX(im, (x) - 1, y, z, c))); \
+		(vd)->y = 0.5f * (im_load_vox(im, SIFT3D_IM_GET_IDX(im, \
+                        x, (y) + 1, z, c)) - im_load_vox(im, \
+                        SIFT3D_IM_GET_IDX(im, x, (y) - 1, z, c))); \
+		(vd)->z = 0.5f * (im_load_vox(im, SIFT3D_IM_GET_IDX(im, \
+                        x, y, (z) + 1, c)) - im_load_vox(im, \
+                        SIFT3D_IM_GET_IDX(im, x, y, (z) - 1, c))); \
+        }
+
 /* Get the Hessian of an image at [x, y, z]. The voxel cannot be on the 
  * boundary. */
 #define SIFT3D_IM_GET_HESSIAN(im, x, y, z, c, H, type) \
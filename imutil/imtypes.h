@@ -8,6 +8,7 @@
  */
 
 #include <time.h>
+#include <stdint.h>
 
 #ifndef _IMTYPES_H
 #define _IMTYPES_H
@@ -114,6 +115,15 @@ typedef enum _Mat_rm_type {
 	SIFT3D_INT
 } Mat_rm_type;
 
+/* Element types of Image data. The computation is always in float32, so the
+ * other types only reduce the memory used to store an image. */
+typedef enum _im_type {
+        IM_FLOAT32,     // Single precision, the default
+        IM_FLOAT16,     // IEEE 754 half precision
+        IM_INT16,       // Signed 16-bit integers, e.g. CT
+        IM_UINT16       // Unsigned 16-bit integers, e.g. MRI
+} im_type;
+
 /* Struct to hold OpenCL programs for this library */
 typedef struct _kernels {
 	cl_kernel downsample_2x_3d;
@@ -152,13 +162,21 @@ typedef struct _Mat_rm {
  * where the bottom-left corner is [0 0 0], the x-stride is 1,
  * the y-stride is the width in x, and the z-stride is the
  * size of an xy plane. For convenience use the macros IM_GET_IDX, 
- * IM_GET_VOX, and IM_SET_VOX to manipulate this struct. */
+ * IM_GET_VOX, and IM_SET_VOX to manipulate this struct. 
+ *
+ * The elements of data have the given type, which is IM_FLOAT32 unless it
+ * is changed with im_set_type. IM_GET_VOX only accesses IM_FLOAT32 images. 
+ * For the other types, use SIFT3D_IM_GET_VOX_F, or the row conversions
+ * im_load_row and im_store_row. Functions which do not document otherwise
+ * require IM_FLOAT32 images. */
 typedef struct _Image {
 
 	float *data;		// Raster of voxel values ~16MB
 	cl_mem cl_image;	// Same-sized OpenCL image object
 	double s;		// scale-space location
 	size_t size;		// Total size in pixels
+	size_t capacity;	// Reserved size in pixels, see im_reserve
+        im_type type;           // Element type of data
 	int nx, ny, nz;		// Dimensions in x, y, and z
 	double ux, uy, uz;	// Real world dimensions in x, y, and z
         size_t xs, ys, zs;      // Stride in x, y, and z
@@ -193,6 +211,9 @@ typedef struct _GSS_filters {
 	Gauss_filter *gauss_octave;	// Array of kernels for one octave
 	int num_filters;		// Number of filters for one octave
 	int first_level;                // Index of the first scale level
+        double sigma0, sigma_n;         // Scale parameters of the filters
+        int num_kp_levels;              // Number of levels per octave
+        int first_octave;               // Octave of the filter scales
 
 } GSS_filters;
 
@@ -208,6 +229,7 @@ typedef struct _Pyramid {
 	
 	// Levels in all octaves
 	Image *levels;	
+        im_type type;   // Element type of the levels
 
 	// Scale-space parameters
 	double sigma_n;
@@ -240,6 +262,16 @@ typedef struct _Cvec {
 
 } Cvec;
 
+/* Struct to hold the contents of a file, mapped into memory if supported
+ * by the platform, or read otherwise */
+typedef struct _File_map {
+
+	void *addr;		// Contents of the file, read-only
+	size_t size;		// Size of the file, in bytes
+	int mapped;		// If TRUE, addr was mapped, otherwise allocated
+
+} File_map;
+
 /* Slab allocation struct */
 typedef struct _Slab {
 
@@ -285,6 +317,8 @@ typedef struct _Tri {
 typedef struct _Mesh {
 	Tri *tri; 	// Triangles
 	int num;	// Number of triangles
+        unsigned char *lut; // Direction-to-triangle lookup table, or NULL
+        int lut_res;    // Width of lut, in cells
 } Mesh;
 
 /* Struct defining a 3D SIFT descriptor */
@@ -304,6 +338,139 @@ typedef struct _SIFT3D_Descriptor_store {
 
 } SIFT3D_Descriptor_store;
 
+/* Element types of quantized SIFT3D descriptors */
+typedef enum _quant_type {
+        QUANT_UINT8,    // 8-bit scalar quantization
+        QUANT_FLOAT16   // IEEE 754 half precision
+} quant_type;
+
+/* Struct to hold quantized SIFT3D descriptors. The elements of descriptor i
+ * begin at element i * DESC_NUMEL of data, and its coordinates [x, y, z, 
+ * scale] begin at coords[4 * i]. */
+typedef struct _SIFT3D_Quant_store {
+
+	void *data;		// Quantized descriptor elements
+	double *coords;		// Sub-pixel [x, y, z], absolute scale
+	size_t num;		// Number of descriptors
+	int nx, ny, nz;		// Image dimensions
+	quant_type type;	// Element type
+
+} SIFT3D_Quant_store;
+
+/* Element types of dense descriptor files */
+typedef enum _dense_type {
+        DENSE_FLOAT32,  // Full precision
+        DENSE_FLOAT16,  // IEEE 754 half precision
+        DENSE_UINT8     // 8-bit affine quantization
+} dense_type;
+
+/* Callback receiving a slab of dense descriptors, which are the planes 
+ * [z_start, z_start + slab->nz) of the output of 
+ * SIFT3D_extract_dense_descriptors. The slab is only valid for the duration 
+ * of the call. Returns SIFT3D_SUCCESS to continue, SIFT3D_FAILURE to stop. */
+typedef int (*SIFT3D_dense_sink)(void *const arg, const Image *const slab,
+        const int z_start);
+
+/* Node of a k-d tree. Internal nodes split on the value of a single
+ * descriptor element. Leaves hold a range of descriptor indices. */
+typedef struct _Kd_node {
+
+	float val;		// Split value, unused for leaves
+	int dim;		// Split dimension, or -1 for leaves
+	int left, right;	// Children, or [begin, end) for leaves
+
+} Kd_node;
+
+/* Randomized k-d forest for approximate nearest neighbor search over a
+ * SIFT3D_Descriptor_store */
+typedef struct _SIFT3D_Descriptor_index {
+
+	const SIFT3D_Descriptor_store *store; // The indexed descriptors
+	Kd_node *nodes;		// Nodes of all trees, max_nodes per tree
+	int *idx;		// Permuted descriptor indices, num per tree
+	size_t num;		// Number of indexed descriptors
+	int max_nodes;		// Maximum number of nodes per tree
+	int num_trees;		// Number of randomized trees
+	int checks;		// Maximum descriptors compared per query
+
+} SIFT3D_Descriptor_index;
+
+/* Devices which can run the SIFT3D algorithms */
+typedef enum _SIFT3D_backend {
+        SIFT3D_BACKEND_CPU,     // Host processors
+        SIFT3D_BACKEND_OPENCL,  // OpenCL device, see sift_cl.c
+        SIFT3D_BACKEND_CUDA     // CUDA device, see sift_cuda.cu
+} SIFT3D_backend;
+
+/* Content-addressed cache of SIFT3D results. The descriptors of an image are
+ * stored under a hash of its voxel data, units and the detector parameters,
+ * in memory and optionally in a directory of binary feature files. */
+typedef struct _SIFT3D_Cache {
+
+        uint64_t *keys;         // Key of each entry
+        SIFT3D_Descriptor_store *stores; // Descriptors of each entry
+        char *dir;              // On-disk cache directory, or NULL
+        int num;                // Number of entries in memory
+        int capacity;           // Maximum number of entries in memory
+        int next;               // Next entry to replace, when full
+
+} SIFT3D_Cache;
+
+/* Stages of the SIFT3D pipeline, as reported by SIFT3D_Stats. The count and
+ * aux results of a call, and the storage tracked by peak_bytes, are:
+ *   GPYR - levels built, unused; the Gaussian pyramid
+ *   DOG - levels built, unused; the DoG pyramid
+ *   EXTREMA - candidates above the peak threshold, unused; the keypoints
+ *   ORIENT - keypoints kept, keypoints rejected; the keypoints
+ *   DESCRIPTOR - descriptors, unused; the descriptors
+ *   MATCH - matches, queries; the match array
+ *   RANSAC - inliers, iterations; unused
+ *   WARP - voxels, unused; the output images
+ * In fused detection and on the device backends, the time of the stages
+ * which cannot be separated is reported by the last of them. RANSAC is 
+ * recorded even if no model was found. */
+typedef enum _SIFT3D_stage {
+        SIFT3D_STAGE_GPYR,
+        SIFT3D_STAGE_DOG,
+        SIFT3D_STAGE_EXTREMA,
+        SIFT3D_STAGE_ORIENT,
+        SIFT3D_STAGE_DESCRIPTOR,
+        SIFT3D_STAGE_MATCH,
+        SIFT3D_STAGE_RANSAC,
+        SIFT3D_STAGE_WARP,
+        SIFT3D_NUM_STAGES
+} SIFT3D_stage;
+
+/* Profile of a single stage, see SIFT3D_stage */
+typedef struct _SIFT3D_Stage_stats {
+
+        double seconds;         // Total wall time
+        double last_seconds;    // Wall time of the last call
+        long calls;             // Number of calls
+        size_t count, aux;      // Results of the last call
+        size_t total_count;     // Sum of count over all calls
+        size_t peak_bytes;      // Peak bytes of the stage's output
+
+} SIFT3D_Stage_stats;
+
+struct _SIFT3D_Stats;
+
+/* Function called after each stage is recorded in a SIFT3D_Stats struct.
+ * Calls are serialized, and stats is consistent for their duration. The
+ * callback must not call library functions which record statistics. */
+typedef void (*SIFT3D_stats_fn)(void *const arg, const SIFT3D_stage stage,
+        const struct _SIFT3D_Stats *const stats);
+
+/* Wall time, call counts and results of each stage of the SIFT3D pipeline,
+ * accumulated over all calls using this struct. See set_stats_SIFT3D. */
+typedef struct _SIFT3D_Stats {
+
+        SIFT3D_Stage_stats stages[SIFT3D_NUM_STAGES]; // Indexed by stage
+        SIFT3D_stats_fn callback; // Called after each stage, or NULL
+        void *callback_arg;     // First argument of callback
+
+} SIFT3D_Stats;
+
 /* Struct to hold all parameters and internal data of the 
  * SIFT3D algorithms */
 typedef struct _SIFT3D {
@@ -330,6 +497,57 @@ typedef struct _SIFT3D {
 	double peak_thresh; // Keypoint peak threshold
 	double corner_thresh; // Keypoint corner threshold
         int dense_rotate; // If true, dense descriptors are rotation-invariant
+        int fused; // If true, the DoG pyramid is not stored during detection
+        im_type pyr_type; // Element type of the pyramids on the CPU backend
+
+        // DoG levels used for fused detection
+        Image dog_window[3];
+
+        // Temporary storage for filtering
+        Image filter_temp;
+
+        // Number of threads, or 0 for the library default
+        int num_threads;
+
+        // Device used for detection and description
+        SIFT3D_backend backend;
+
+        // Device state of each backend, or NULL if unused
+        struct _SIFT3D_cl *cl;
+        struct _SIFT3D_cuda *cuda;
+
+        // If true, the pyramids of the current image are in device memory,
+        // and gpyr and dog are only valid if pyr_host_stale is false
+        int pyr_on_device;
+        int pyr_host_stale;
+
+        // Result cache shared with copies of this struct, or NULL
+        SIFT3D_Cache *cache;
+
+        // Profiling statistics shared with copies of this struct, or NULL
+        SIFT3D_Stats *stats;
+
+        // If true, the gradients of each Gaussian level holding keypoints
+        // are computed once and reused by orientation and description
+        int grad_cache;
+
+        // Cached gradients, indexed as gpyr.levels, and whether each level
+        // is valid for the current pyramid
+        Image *grads;
+        unsigned char *grads_valid;
+        int num_grads;
+
+        // Foreground mask of the input image, which is not owned, or NULL
+        const Image *mask;
+
+        // The mask downsampled to each octave of the ROI
+        Image *octave_masks;
+        int num_octave_masks;
+
+        // If true, the pyramids cover only the ROI of the input, which
+        // starts at roi_start in an image of dimensions roi_dims
+        int roi_active;
+        int roi_start[IM_NDIMS], roi_dims[IM_NDIMS];
 
 } SIFT3D;
 
@@ -387,9 +605,20 @@ typedef struct _Tps {
 /* Struct to hold RANSAC parameters */
 typedef struct _Ransac {
  	double err_thresh; //error threshold for RANSAC inliers
-	int num_iter; //number of RANSAC iterations
+	double confidence; //stop once an all-inlier sample is this likely, or 0
+	int num_iter; //maximum number of RANSAC iterations
+	int prosac; //if true, the points are sorted by quality, best first
 } Ransac;
 
+/* A unit of parallel work, run by SIFT3D_parallel_for for each index i. */
+typedef void (*SIFT3D_task_fn)(void *const arg, const int i);
+
+/* A caller-supplied thread pool. Runs task(arg, i) for each i in [0, num), 
+ * possibly concurrently, and returns once all of them have finished. See
+ * SIFT3D_set_thread_pool. */
+typedef void (*SIFT3D_pool_fn)(void *const pool, const int num, 
+        SIFT3D_task_fn task, void *const arg);
+
 #ifdef __cplusplus
 }
 #endif
@@ -20,6 +20,7 @@
 #include <string.h>
 #include <stddef.h>
 #include <float.h>
+#include <time.h>
 #include <zlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -29,6 +30,31 @@
 #include "nifti.h"
 #include "imutil.h"
 
+/* Vectorized instruction sets for convolution */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIFT3D_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/* OpenMP runtime */
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/* Thread-local storage */
+#ifdef _MSC_VER
+#define SIFT3D_THREAD_LOCAL __declspec(thread)
+#else
+#define SIFT3D_THREAD_LOCAL __thread
+#endif
+
+/* Memory-mapped file I/O */
+#ifndef _WINDOWS
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
 /* Check for a version number */
 #if !defined(SIFT3D_VERSION_NUMBER)
 #error imutil.c: Must define the preprocessor macro SIFT3D_VERSION_NUMBER
@@ -52,6 +78,15 @@
 /* Implementation parameters */
 //#define SIFT3D_USE_OPENCL // Use OpenCL acceleration
 #define SIFT3D_RANSAC_REFINE	// Use least-squares refinement in RANSAC
+#define SIFT3D_CONV_TILE 512    // Number of floats per tile in convolve_sep_fast
+#define SIFT3D_WARP_TILE 8      // Number of rows per tile in im_inv_transform
+#define SIFT3D_WARP_CHUNK 256   // Number of voxels per batch of coordinates
+#define SIFT3D_TPS_GRID 4       // Voxels between points of the TPS grid
+#define SIFT3D_LANCZOS_RES 1024 // Lanczos table entries per unit distance
+#define SIFT3D_EIG3_BATCH 64    // Matrices per pass of eigen_sym3_batch
+#define SIFT3D_EIG3_TOL 1E-8    // Minimum null-space test for the closed form
+#define SIFT3D_EIG3_SWEEPS 32   // Maximum number of Jacobi sweeps
+#define SIFT3D_RANSAC_BLOCK 64  // RANSAC iterations between stopping checks
 
 /* Implement strnlen, if it's missing */
 #ifndef SIFT3D_HAVE_STRNLEN
@@ -101,6 +136,7 @@ const mode_t out_mode = 0755;
 /* Default parameters */
 const double SIFT3D_err_thresh_default = 5.0;
 const int SIFT3D_num_iter_default = 500;
+const double SIFT3D_confidence_default = 0.999;
 
 /* Declarations for the virtual function implementations */
 static int copy_Affine(const void *const src, void *const dst);
@@ -148,9 +184,68 @@ const Tform_vtable Tps_vtable = {
 #define TFORM_GET_VTABLE(arg) (((Affine *) arg)->tform.vtable)
 #define AFFINE_GET_DIM(affine) ((affine)->A.num_rows)
 
+/* Retries of a singular RANSAC sample, before the iteration is abandoned */
+#define RANSAC_MAX_SINGULAR 100
+
+/* Per-thread intermediates for RANSAC, allocated once per call to
+ * find_tform_ransac */
+typedef struct _Ransac_scratch {
+        Mat_rm src_rand, ref_rand; // The sampled points
+        void *tform; // The transformation fit to the sample
+        double *err_sq; // Squared error of each point
+        int *cset; // The consensus set
+        int *sample; // Indices of the sampled points
+} Ransac_scratch;
+
+/* Arguments to a task run on a caller-supplied thread pool */
+typedef struct _Pool_task {
+        SIFT3D_task_fn task;
+        void *arg;
+} Pool_task;
+
+/* Arguments to the slice-wise image operations */
+typedef struct _Im_slice_task {
+        const Image *src1, *src2; // The inputs
+        const Image *dst; // The output
+        float scalar; // A constant operand
+        float *slice_max; // The result of each slice, for im_max_abs
+} Im_slice_task;
+
+/* Arguments to the tiles of im_inv_transform */
+typedef struct _Warp_task {
+        const Image *src; // The input
+        const Image *dst; // The output
+        const void *tform; // The transformation
+        const Image *grid; // TPS coordinates on the coarse grid, for TPS
+        double A[IM_NDIMS][IM_NDIMS + 1]; // The matrix, for AFFINE
+        tform_type type; // The type of transformation
+        interp_type interp; // The type of interpolation
+        int tiles_per_slice; // Tiles of SIFT3D_WARP_TILE rows in each slice
+} Warp_task;
+
+/* Arguments to the slice-wise convolution kernels */
+typedef struct _Conv_task {
+        const Image *src; // The input
+        Image *dst; // The output
+        const Sep_FIR_filter *f; // The filter
+        int dim; // The dimension in which to convolve
+        int step; // Voxels between taps, for convolve_sep_fast
+        float unit_factor; // Tap spacing in voxels, for convolve_sep_gen
+        int start[IM_NDIMS]; // First interior voxel, for convolve_sep_gen
+        int end[IM_NDIMS]; // Last interior voxel, for convolve_sep_gen
+        int ret; // Set to SIFT3D_FAILURE if any slice fails
+} Conv_task;
+
 /* Global data */
 CL_data cl_data;
 
+/* Threading state. The thread count is set per calling thread, so that 
+ * concurrent callers may use different values. The pool is shared. */
+static SIFT3D_THREAD_LOCAL int num_threads_set = 0;
+static SIFT3D_THREAD_LOCAL int in_pool_task = SIFT3D_FALSE;
+static SIFT3D_pool_fn pool_fn_set = NULL;
+static void *pool_set = NULL;
+
 /* LAPACK declarations */
 #ifdef SIFT3D_MEX
 // Set the integer width to Matlab's defined width
@@ -197,10 +292,21 @@ extern void dsyevd_(const char *, const char *, const fortran_int *, double *,
 static char *read_file(const char *path);
 static int do_mkdir(const char *path, mode_t mode);
 static int cross_mkdir(const char *path, mode_t mode);
-static double resample_linear(const Image * const in, const double x,
-			      const double y, const double z, const int c);
-static double resample_lanczos2(const Image * const in, const double x,
-				const double y, const double z, const int c);
+static int make_tps_grid(const void *const tps, const Image *const dst, 
+        Image *const grid);
+static void make_tps_grid_slice(void *const arg, const int z);
+static void warp_coords(const Warp_task *const task, const int x_start, 
+        const int y, const int z, const int n, double *const xs, 
+        double *const ys, double *const zs);
+static void im_inv_transform_tile(void *const arg, const int i);
+static void warp_linear(const Image *const in, const double *const xs,
+        const double *const ys, const double *const zs, const int n, 
+        const int c, float *const out, const size_t out_stride);
+static void warp_lanczos2(const Image *const im, const double *const xs,
+        const double *const ys, const double *const zs, const int n, 
+        float *const out, const size_t out_stride);
+static void init_lanczos2_table(void);
+static double lanczos2_lookup(const double d);
 static double lanczos(double x, double a);
 static int check_cl_image_support(cl_context context, cl_mem_flags mem_flags,
 				  cl_image_format image_format,
@@ -210,7 +316,6 @@ static int compile_cl_program_from_source(cl_program * program,
 					  cl_device_id * devices,
 					  int num_devices, char **src,
 					  int num_str);
-static int n_choose_k(const int n, const int k, int **ret);
 static int make_spline_matrix(Mat_rm * src, Mat_rm * src_in, Mat_rm * sp_src,
 			      int K_terms, int *r, int dim);
 static int make_affine_matrix(const Mat_rm *const pts_in, const int dim, 
@@ -219,10 +324,27 @@ static Mat_rm *extract_ctrl_pts(void *tform, tform_type type);
 static Mat_rm *extract_ctrl_pts_Tps(Tps * tps);
 static int solve_system(const Mat_rm *const src, const Mat_rm *const ref, 
         void *const tform);
-static double tform_err_sq(const void *const tform, const Mat_rm *const src, 
-        const Mat_rm *const ref, const int i);
+static void tform_err_sq(const void *const tform, const Mat_rm *const src, 
+        const Mat_rm *const ref, double *const err_sq);
+static double eig3_null_vec(const double *const b, const double lambda, 
+        double *const v);
+static int eig3_jacobi(const double *const a, double *const L, 
+        double *const Q);
+static uint64_t ransac_rand(uint64_t *const state);
+static int init_Ransac_scratch(Ransac_scratch *const scratch, 
+        const void *const tform, const int num_pts, const int num_rand);
+static void cleanup_Ransac_scratch(Ransac_scratch *const scratch);
+static double *make_prosac_schedule(const int num_pts, const int num_rand,
+        const int num_iter);
+static void draw_sample(const double *const prosac_sched, const int num_pts,
+        const int num_rand, const int iter, uint64_t *const state, 
+        int *const sample);
+static int ransac_iter_limit(const double confidence, const int num_pts,
+        const int num_rand, const int len, const int num_iter);
 static int ransac(const Mat_rm *const src, const Mat_rm *const ref, 
-        const Ransac *const ran, void *tform, int **const cset, int *const len);
+        const Ransac *const ran, const double *const prosac_sched, 
+        const int iter, const uint64_t seed, Ransac_scratch *const scratch, 
+        int *const len);
 static int convolve_sep(const Image * const src,
 			Image * const dst, const Sep_FIR_filter * const f,
 			const int dim, const double unit);
@@ -235,7 +357,54 @@ static int convolve_sep_cl(const Image * const src,
 static int convolve_sep_sym(const Image * const src, Image * const dst,
 			    const Sep_FIR_filter * const f, const int dim,
                             const double unit);
+static int get_conv_step(const Image *const src, const int dim,
+                         const double unit);
+static int convolve_sep_fast(const Image * const src, Image * const dst,
+                             const Sep_FIR_filter * const f, const int dim,
+                             const int step);
+static void convolve_sep_gen_slice(void *const arg, const int z);
+static int get_conv_steps(const Image *const src, const double unit, 
+                          int *const steps);
+static int apply_Sep_FIR_filter_fast(const Image *const src, 
+        Image *const dst, const Sep_FIR_filter *const f, 
+        const int *const steps, Image *const temp);
+static int apply_Sep_FIR_filter_typed(const Image *const src, 
+        Image *const dst, Sep_FIR_filter *const f, const double unit, 
+        Image *const temp);
+static void convolve_sep_fast_slice(void *const arg, const int i);
+static int mirror_idx(int i, const int n);
+static int conv_boundary_idx(const int c, const int n, int *const idx, 
+                             float *const frac);
+static void run_pool_task(void *const arg, const int i);
+static void im_downsample_2x_slice(void *const arg, const int z);
+static void im_max_abs_slice(void *const arg, const int z);
+static uint64_t hash_mix(const uint64_t hash, const uint64_t word);
+static void im_scale_slice(void *const arg, const int z);
+static void im_subtract_slice(void *const arg, const int z);
+static void init_conv_lines(void);
+static void init_im_rows(void);
+static void half_to_float_row_c(const uint16_t *const src, float *const dst,
+                                const int n);
+static void float_to_half_row_c(const float *const src, uint16_t *const dst,
+                                const int n);
+#ifdef SIFT3D_X86_SIMD
+static void half_to_float_row_f16c(const uint16_t *const src, 
+                                   float *const dst, const int n);
+static void float_to_half_row_f16c(const float *const src, 
+                                   uint16_t *const dst, const int n);
+#endif
+static void im_convert_data(const Image *const src, Image *const dst);
+static void conv_lines_float(float *const out, const float *const *const rows, 
+                             const float *const kernel, const int width, 
+                             const int n);
+#ifdef SIFT3D_X86_SIMD
+static void conv_lines_avx2(float *const out, const float *const *const rows, 
+                            const float *const kernel, const int width, 
+                            const int n);
+#endif
 static const char *get_file_name(const char *path);
+static int im_read_with_type(const char *path, const int native, 
+                             Image *const im);
 static const char *get_file_ext(const char *name);
 
 /* Unfinished public routines */
@@ -260,6 +429,132 @@ void *SIFT3D_safe_realloc(void *ptr, size_t size) {
 
 }
 
+/* Set the number of threads used by the library on the calling thread. All
+ * parallel regions started by this thread use at most this many threads,
+ * including any OpenMP teams. Use 0 to restore the default, which is the
+ * OpenMP default, or 1 if a thread pool has been installed with 
+ * SIFT3D_set_thread_pool. Other threads are not affected.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE if num_threads is 
+ * negative. */
+int SIFT3D_set_num_threads(const int num_threads) {
+
+        if (num_threads < 0) {
+                SIFT3D_ERR("SIFT3D_set_num_threads: invalid number of "
+                        "threads: %d \n", num_threads);
+                return SIFT3D_FAILURE;
+        }
+
+        num_threads_set = num_threads;
+        return SIFT3D_SUCCESS;
+}
+
+/* Returns the number of threads set by SIFT3D_set_num_threads on the calling
+ * thread, or 0 if the default is in use. */
+int SIFT3D_get_num_threads(void) {
+        return num_threads_set;
+}
+
+/* Install a caller-supplied thread pool, to be used in place of OpenMP for
+ * the slice-wise image operations, including separable filtering. While a 
+ * pool is installed, the remaining OpenMP regions default to a single 
+ * thread, so that the library does not compete with the pool for cores. 
+ * Pass NULL for pool_fn to remove the pool.
+ *
+ * The pool is shared by all threads. This function is not thread-safe, and 
+ * should be called before using the library. pool_fn may be called 
+ * concurrently from multiple threads, and must not run the tasks on the
+ * calling thread while it holds a lock needed by the other tasks. */
+void SIFT3D_set_thread_pool(SIFT3D_pool_fn pool_fn, void *const pool) {
+        pool_fn_set = pool_fn;
+        pool_set = pool_fn == NULL ? NULL : pool;
+}
+
+/* Returns the number of threads to use in a parallel region started by the 
+ * calling thread. Use this in the num_threads clause of OpenMP pragmas. */
+int SIFT3D_team_size(void) {
+
+        // Tasks of the pool are not further divided
+        if (in_pool_task)
+                return 1;
+
+        if (num_threads_set > 0)
+                return num_threads_set;
+
+        if (pool_fn_set != NULL)
+                return 1;
+
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+}
+
+/* Helper function to run a task on the pool, marking the thread so that 
+ * nested parallel regions are serial. */
+static void run_pool_task(void *const arg, const int i) {
+
+        const Pool_task *const pool_task = (const Pool_task *) arg;
+        const int was_in_task = in_pool_task;
+
+        in_pool_task = SIFT3D_TRUE;
+        pool_task->task(pool_task->arg, i);
+        in_pool_task = was_in_task;
+}
+
+/* Run task(arg, i) for each i in [0, num), in parallel. This uses the thread
+ * pool installed by SIFT3D_set_thread_pool, if any, and otherwise an OpenMP 
+ * team of SIFT3D_team_size() threads. The tasks run serially on the calling 
+ * thread if the number of threads is 1, or if this is called from within 
+ * another task. Returns once all tasks have finished. */
+void SIFT3D_parallel_for(const int num, SIFT3D_task_fn task, 
+        void *const arg) {
+
+        int i;
+
+        if (num <= 0)
+                return;
+
+        // Use the pool
+        if (pool_fn_set != NULL && !in_pool_task && num_threads_set != 1 &&
+                num > 1) {
+
+                Pool_task pool_task;
+
+                pool_task.task = task;
+                pool_task.arg = arg;
+                pool_fn_set(pool_set, num, run_pool_task, &pool_task);
+                return;
+        }
+
+        // Use OpenMP, which is serial for a team size of 1
+#pragma omp parallel for schedule(dynamic) num_threads(SIFT3D_team_size()) \
+        if (num > 1)
+        for (i = 0; i < num; i++) {
+                task(arg, i);
+        }
+}
+
+/* Returns the wall time in seconds, measured from an arbitrary origin. Use 
+ * the difference of two calls to time an operation. */
+double SIFT3D_wall_time(void) {
+
+#ifdef _OPENMP
+        return omp_get_wtime();
+#elif defined(_WINDOWS)
+        struct timespec ts;
+
+        timespec_get(&ts, TIME_UTC);
+        return (double) ts.tv_sec + 1E-9 * (double) ts.tv_nsec;
+#else
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (double) ts.tv_sec + 1E-9 * (double) ts.tv_nsec;
+#endif
+}
+
 /* Finish all OpenCL command queues. */
 void clFinish_all()
 {
@@ -549,7 +844,9 @@ static int compile_cl_program_from_source(cl_program * program,
 void init_Mesh(Mesh * const mesh)
 {
 	mesh->tri = NULL;
+        mesh->lut = NULL;
 	mesh->num = -1;
+        mesh->lut_res = 0;
 }
 
 /* Release all memory associated with a triangle mesh. mesh cannot be reused
@@ -557,6 +854,7 @@ void init_Mesh(Mesh * const mesh)
 void cleanup_Mesh(Mesh * const mesh)
 {
 	free(mesh->tri);
+        free(mesh->lut);
 }
 
 /* Convert a matrix to a different type. in and out may be the same pointer.
@@ -1209,8 +1507,25 @@ im_format im_get_format(const char *path) {
  *      library was not compiled.
  * -SIFT3D_UNEVEN_SPACING 4 - The image slices are unevenly spaced.
  * -SIFT3D_FAILURE - Other error
+ *
+ * The image is converted to float32. See im_read_native to keep 16-bit 
+ * integer data without conversion.
  */
 int im_read(const char *path, Image *const im) {
+        return im_read_with_type(path, SIFT3D_FALSE, im);
+}
+
+/* As im_read, but NIFTI and Analyze images of 16-bit integers keep their 
+ * element type, IM_INT16 or IM_UINT16, which halves the memory of the image.
+ * Other images are converted to float32, as in im_read. */
+int im_read_native(const char *path, Image *const im) {
+        return im_read_with_type(path, SIFT3D_TRUE, im);
+}
+
+/* Helper function for im_read and im_read_native. If native is true, 
+ * NIFTI images of 16-bit integers are not converted. */
+static int im_read_with_type(const char *path, const int native, 
+                             Image *const im) {
 
         struct stat st;
         int ret;
@@ -1225,13 +1540,15 @@ int im_read(const char *path, Image *const im) {
         switch (im_get_format(path)) {
         case ANALYZE:
         case NIFTI:
-                ret = read_nii(path, im);
+                ret = read_nii(path, native, im);
                 break;
         case DICOM:
-                ret = read_dcm(path, im);
+                ret = im_set_type(im, IM_FLOAT32) ? SIFT3D_FAILURE : 
+                        read_dcm(path, im);
                 break;
         case DIRECTORY:
-                ret = read_dcm_dir(path, im);
+                ret = im_set_type(im, IM_FLOAT32) ? SIFT3D_FAILURE : 
+                        read_dcm_dir(path, im);
                 break;
         case FILE_ERROR:
                 ret = SIFT3D_FAILURE;
@@ -1257,15 +1574,35 @@ int im_read(const char *path, Image *const im) {
  * -SIFT3D_SUCCESS - Successfully wrote the image
  * -SIFT3D_UNSUPPORTED_FILE_TYPE - Cannot write this file type
  * -SIFT3D_FAILURE - Other error
+ *
+ * NIFTI files store 16-bit integer images in their own datatype. Otherwise,
+ * the image is written as float32.
  */
 int im_write(const char *path, const Image *const im) {
 
+        const im_format format = im_get_format(path);
+
+        // Write other element types to DICOM from a float32 copy
+        if (im->type != IM_FLOAT32 && (format == DICOM || 
+                format == DIRECTORY)) {
+
+                Image temp;
+                int ret;
+
+                init_im(&temp);
+                ret = im_copy_data(im, &temp) ? SIFT3D_FAILURE : 
+                        im_write(path, &temp);
+                im_free(&temp);
+
+                return ret;
+        }
+
 	// Create the path
 	if (mkpath(path, out_mode))
 		return SIFT3D_FAILURE;
 
         // Get the file format 
-        switch (im_get_format(path)) {
+        switch (format) {
         case ANALYZE:
         case NIFTI:
                 return write_nii(path, im);
@@ -1319,6 +1656,114 @@ static const char *get_file_ext(const char *name)
 	return dot == NULL || dot == name ? "" : dot + 1;
 }
 
+/* Ensure all parent directories of the file path exist, so that it can be
+ * opened for writing. */
+int make_path(const char *path) {
+        return mkpath(path, out_mode) ? SIFT3D_FAILURE : SIFT3D_SUCCESS;
+}
+
+/* Initialize a File_map for first use. */
+void init_File_map(File_map *const map) {
+        map->addr = NULL;
+        map->size = 0;
+        map->mapped = SIFT3D_FALSE;
+}
+
+/* Load the contents of a file into map, which must be initialized. Where 
+ * supported, the file is memory-mapped read-only, so that pages are only
+ * read as they are accessed. Otherwise, the file is read into memory. Any
+ * previous contents of map are released.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FILE_DOES_NOT_EXIST if the file
+ * could not be opened, and SIFT3D_FAILURE otherwise. */
+int map_file(const char *path, File_map *const map) {
+
+        // Release the previous contents
+        cleanup_File_map(map);
+        init_File_map(map);
+
+#ifndef _WINDOWS
+        {
+                struct stat st;
+                void *addr;
+                int fd;
+
+                // Open the file and get its size
+                if ((fd = open(path, O_RDONLY)) < 0) {
+                        SIFT3D_ERR("map_file: failed to open %s \n", path);
+                        return SIFT3D_FILE_DOES_NOT_EXIST;
+                }
+                if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+                        SIFT3D_ERR("map_file: failed to get the size of %s "
+                                "\n", path);
+                        close(fd);
+                        return SIFT3D_FAILURE;
+                }
+
+                // Map the file. The mapping persists after closing it.
+                addr = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE,
+                        fd, 0);
+                close(fd);
+                if (addr == MAP_FAILED) {
+                        SIFT3D_ERR("map_file: failed to map %s \n", path);
+                        return SIFT3D_FAILURE;
+                }
+
+                map->addr = addr;
+                map->size = (size_t) st.st_size;
+                map->mapped = SIFT3D_TRUE;
+        }
+#else
+        {
+                FILE *file;
+                long len;
+
+                // Read the whole file into memory
+                if ((file = fopen(path, "rb")) == NULL) {
+                        SIFT3D_ERR("map_file: failed to open %s \n", path);
+                        return SIFT3D_FILE_DOES_NOT_EXIST;
+                }
+                if (fseek(file, 0, SEEK_END) || (len = ftell(file)) <= 0 ||
+                        fseek(file, 0, SEEK_SET) ||
+                        (map->addr = malloc((size_t) len)) == NULL ||
+                        fread(map->addr, 1, (size_t) len, file) != 
+                                (size_t) len) {
+                        SIFT3D_ERR("map_file: failed to read %s \n", path);
+                        fclose(file);
+                        free(map->addr);
+                        map->addr = NULL;
+                        return SIFT3D_FAILURE;
+                }
+                fclose(file);
+
+                map->size = (size_t) len;
+                map->mapped = SIFT3D_FALSE;
+        }
+#endif
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Release the contents of a File_map. Any pointers into the file are 
+ * invalidated. */
+void cleanup_File_map(File_map *const map) {
+
+        if (map->addr == NULL)
+                return;
+
+#ifndef _WINDOWS
+        if (map->mapped) {
+                munmap(map->addr, map->size);
+        } else
+#endif
+        {
+                free(map->addr);
+        }
+
+        map->addr = NULL;
+        map->size = 0;
+}
+
 /* Get the parent directory of a file. The returned string must later be
  * freed. */
 char *im_get_parent_dir(const char *path) {
@@ -1553,8 +1998,14 @@ int im_resize(Image *const im)
                 return SIFT3D_SUCCESS;
 	im->size = size;
 
-	// Allocate new memory
-	im->data = SIFT3D_safe_realloc(im->data, size * sizeof(float));
+	// Allocate new memory, unless the reserved memory suffices. Reserved
+        // memory grows, but never shrinks.
+        if (size > im->capacity) {
+	        im->data = SIFT3D_safe_realloc(im->data, size * 
+                        im_type_get_size(im->type));
+                if (im->capacity > 0)
+                        im->capacity = size;
+        }
 
 #ifdef SIFT3D_USE_OPENCL
 	{
@@ -1603,6 +2054,346 @@ int im_resize(Image *const im)
 	return size != 0 && im->data == NULL ? SIFT3D_FAILURE : SIFT3D_SUCCESS;
 }
 
+/* Reserve memory for at least size pixels in an image. Afterwards, im_resize
+ * does not reallocate the image to any size which fits in this memory. This
+ * allows an image to be reused for a sequence of different sizes without 
+ * allocating memory. The memory is released by im_free, as usual.
+ *
+ * The image must be initialized. Its dimensions and data are unchanged.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int im_reserve(Image *const im, const size_t size)
+{
+        float *data;
+
+        // Do nothing if we already have enough memory
+        if (size <= im->capacity)
+                return SIFT3D_SUCCESS;
+
+        // Allocate at least enough for the current size
+        if (size > im->size) {
+                if ((data = SIFT3D_safe_realloc(im->data, 
+                        size * im_type_get_size(im->type))) == NULL)
+                        return SIFT3D_FAILURE;
+                im->data = data;
+        }
+        im->capacity = SIFT3D_MAX(size, im->size);
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Returns the size in bytes of an image element of the given type, or 0 if
+ * the type is unknown. */
+size_t im_type_get_size(const im_type type) {
+        switch (type) {
+        case IM_FLOAT32:
+                return sizeof(float);
+        case IM_FLOAT16:
+        case IM_INT16:
+        case IM_UINT16:
+                return sizeof(uint16_t);
+        default:
+                return 0;
+        }
+}
+
+/* Change the element type of an image, converting its data, if any. Values
+ * which the new type cannot represent are rounded to the nearest, and 
+ * integers saturate to their range. The reserved memory is kept.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int im_set_type(Image *const im, const im_type type) {
+
+        Image temp;
+
+        const size_t size_old = im_type_get_size(im->type);
+        const size_t size_new = im_type_get_size(type);
+
+        if (size_new == 0) {
+                SIFT3D_ERR("im_set_type: unknown type: %d \n", (int) type);
+                return SIFT3D_FAILURE;
+        }
+
+        // Select the row conversions before any image needs them
+        init_im_rows();
+
+        if (type == im->type)
+                return SIFT3D_SUCCESS;
+
+        // Convert the data into a new buffer of the same capacity in bytes
+        if (im->data != NULL && im->size > 0) {
+
+                init_im(&temp);
+                temp.type = type;
+                if (im_reserve(&temp, im->capacity * size_old / size_new) ||
+                        im_copy_data(im, &temp)) {
+                        im_free(&temp);
+                        return SIFT3D_FAILURE;
+                }
+
+                im_free(im);
+                im->data = temp.data;
+                im->capacity = temp.capacity;
+        } else {
+                im->capacity = im->capacity * size_old / size_new;
+        }
+        im->type = type;
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Convert a float to IEEE 754 half precision, rounding to the nearest 
+ * value. Values out of range saturate to infinity. */
+unsigned short SIFT3D_float_to_half(const float f) {
+
+
+        union { float f; unsigned int u; } conv;
+        unsigned int u, sign, mant;
+        int exp;
+
+        conv.f = f;
+        u = conv.u;
+        sign = (u >> 16) & 0x8000u;
+        exp = (int) ((u >> 23) & 0xff) - 127 + 15;
+        mant = u & 0x7fffffu;
+
+        // NaN and infinity
+        if (((u >> 23) & 0xff) == 0xff)
+                return (unsigned short) (sign | 0x7c00u | (mant ? 0x200u : 0));
+
+        // Overflow
+        if (exp >= 0x1f)
+                return (unsigned short) (sign | 0x7c00u);
+
+        // Subnormals and underflow
+        if (exp <= 0) {
+                unsigned int shift;
+                if (exp < -10)
+                        return (unsigned short) sign;
+                mant |= 0x800000u;
+                shift = (unsigned int) (14 - exp);
+                return (unsigned short) (sign | ((mant + (1u << (shift - 1)) - 
+                        1u + ((mant >> shift) & 1u)) >> shift));
+        }
+
+        // Normal numbers, rounding to nearest even. A carry out of the 
+        // mantissa correctly increments the exponent.
+        return (unsigned short) (sign | (((unsigned int) exp << 10) + 
+                ((mant + 0xfffu + ((mant >> 13) & 1u)) >> 13)));
+}
+
+/* Convert IEEE 754 half precision to a float. */
+float SIFT3D_half_to_float(const unsigned short h) {
+
+        union { float f; unsigned int u; } conv;
+
+        const unsigned int sign = ((unsigned int) h & 0x8000u) << 16;
+        const unsigned int exp = ((unsigned int) h >> 10) & 0x1f;
+        const unsigned int mant = (unsigned int) h & 0x3ffu;
+
+        if (exp == 0x1f) {
+                // NaN and infinity
+                conv.u = sign | 0x7f800000u | (mant << 13);
+        } else if (exp == 0) {
+                // Zero and subnormals
+                conv.f = ldexpf((float) mant, -24);
+                conv.u |= sign;
+        } else {
+                conv.u = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+        }
+
+        return conv.f;
+}
+
+
+/* The half precision row conversions of im_load_row and im_store_row, 
+ * selected by init_im_rows. */
+static void (*half_to_float_row)(const uint16_t *const src, float *const dst,
+                                 const int n) = half_to_float_row_c;
+static void (*float_to_half_row)(const float *const src, uint16_t *const dst,
+                                 const int n) = float_to_half_row_c;
+
+/* Helper function to select the fastest half precision row conversions 
+ * supported by the CPU. */
+static void init_im_rows(void) {
+
+#ifdef SIFT3D_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c")) {
+                half_to_float_row = half_to_float_row_f16c;
+                float_to_half_row = float_to_half_row_f16c;
+        }
+#endif
+}
+
+/* Convert n half precision values to floats. The portable version. */
+static void half_to_float_row_c(const uint16_t *const src, float *const dst,
+                                const int n) {
+
+        int i;
+
+        for (i = 0; i < n; i++) {
+                dst[i] = SIFT3D_half_to_float(src[i]);
+        }
+}
+
+/* Convert n floats to half precision. The portable version. */
+static void float_to_half_row_c(const float *const src, uint16_t *const dst,
+                                const int n) {
+
+        int i;
+
+        for (i = 0; i < n; i++) {
+                dst[i] = SIFT3D_float_to_half(src[i]);
+        }
+}
+
+#ifdef SIFT3D_X86_SIMD
+/* As half_to_float_row_c, using the F16C instructions. */
+__attribute__((target("avx2,f16c")))
+static void half_to_float_row_f16c(const uint16_t *const src, 
+                                   float *const dst, const int n) {
+
+        int i;
+
+        for (i = 0; i + 8 <= n; i += 8) {
+                _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(
+                        _mm_loadu_si128((const __m128i *) (src + i))));
+        }
+        for (; i < n; i++) {
+                dst[i] = SIFT3D_half_to_float(src[i]);
+        }
+}
+
+/* As float_to_half_row_c, using the F16C instructions. Both round to the 
+ * nearest even value, so the results are the same. */
+__attribute__((target("avx2,f16c")))
+static void float_to_half_row_f16c(const float *const src, 
+                                   uint16_t *const dst, const int n) {
+
+        int i;
+
+        for (i = 0; i + 8 <= n; i += 8) {
+                _mm_storeu_si128((__m128i *) (dst + i), _mm256_cvtps_ph(
+                        _mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+        }
+        for (; i < n; i++) {
+                dst[i] = SIFT3D_float_to_half(src[i]);
+        }
+}
+#endif
+
+/* Convert n elements of im, starting at index idx, to floats in dst. The
+ * elements must be contiguous. */
+void im_load_row(const Image *const im, const size_t idx, const int n,
+                 float *const dst) {
+
+        int i;
+
+        switch (im->type) {
+        case IM_FLOAT32:
+                memcpy(dst, im->data + idx, n * sizeof(float));
+                break;
+        case IM_FLOAT16:
+                half_to_float_row((const uint16_t *) im->data + idx, dst, n);
+                break;
+        case IM_INT16: {
+                const int16_t *const src = (const int16_t *) im->data + idx;
+                for (i = 0; i < n; i++) {
+                        dst[i] = (float) src[i];
+                }
+                break;
+        }
+        case IM_UINT16: {
+                const uint16_t *const src = (const uint16_t *) im->data + idx;
+                for (i = 0; i < n; i++) {
+                        dst[i] = (float) src[i];
+                }
+                break;
+        }
+        default:
+                assert(SIFT3D_FALSE);
+        }
+}
+
+/* Convert n floats from src to the type of im, storing them in the 
+ * contiguous elements starting at index idx. Integers are rounded to the
+ * nearest, and saturate to their range. */
+void im_store_row(Image *const im, const size_t idx, const int n,
+                  const float *const src) {
+
+        int i;
+
+        switch (im->type) {
+        case IM_FLOAT32:
+                memcpy(im->data + idx, src, n * sizeof(float));
+                break;
+        case IM_FLOAT16:
+                float_to_half_row(src, (uint16_t *) im->data + idx, n);
+                break;
+        case IM_INT16: {
+                int16_t *const dst = (int16_t *) im->data + idx;
+                for (i = 0; i < n; i++) {
+                        dst[i] = (int16_t) floorf(SIFT3D_MIN(SIFT3D_MAX(
+                                src[i], (float) INT16_MIN), 
+                                (float) INT16_MAX) + 0.5f);
+                }
+                break;
+        }
+        case IM_UINT16: {
+                uint16_t *const dst = (uint16_t *) im->data + idx;
+                for (i = 0; i < n; i++) {
+                        dst[i] = (uint16_t) floorf(SIFT3D_MIN(SIFT3D_MAX(
+                                src[i], 0.0f), (float) UINT16_MAX) + 0.5f);
+                }
+                break;
+        }
+        default:
+                assert(SIFT3D_FALSE);
+        }
+}
+
+/* As im_load_row, but returns a pointer to the elements if im has type
+ * IM_FLOAT32, in which case nothing is copied. Otherwise, the elements are
+ * converted into buf, which is returned. */
+const float *im_get_row(const Image *const im, const size_t idx, const int n,
+                        float *const buf) {
+
+        if (im->type == IM_FLOAT32)
+                return im->data + idx;
+
+        im_load_row(im, idx, n, buf);
+        return buf;
+}
+
+/* Returns element idx of im, converted to a float. For IM_FLOAT32 images, 
+ * SIFT3D_IM_GET_VOX is faster. */
+float im_load_vox(const Image *const im, const size_t idx) {
+
+        switch (im->type) {
+        case IM_FLOAT32:
+                return im->data[idx];
+        case IM_FLOAT16:
+                return SIFT3D_half_to_float(((const uint16_t *) im->data)[idx]);
+        case IM_INT16:
+                return (float) ((const int16_t *) im->data)[idx];
+        case IM_UINT16:
+                return (float) ((const uint16_t *) im->data)[idx];
+        default:
+                assert(SIFT3D_FALSE);
+                return 0.0f;
+        }
+}
+
+/* Convert val to the type of im, storing it in element idx. */
+void im_store_vox(Image *const im, const size_t idx, const float val) {
+
+        if (im->type == IM_FLOAT32)
+                im->data[idx] = val;
+        else
+                im_store_row(im, idx, 1, &val);
+}
+
 /* Concatenate two images in dimension dim, so that src1 comes before src2.
  * For example, if dim == 0, the images are horizontally concatenated in x,
  * so that src1 is on the left and src2 is on the right. Resizes dst. 
@@ -1736,11 +2527,12 @@ int im_upsample_2x(const Image *const src, Image *const dst)
 
 /* Downsample an image by a factor of 2 in each dimension.
  * This function initializes dst with the proper 
- * dimensions, and allocates memory. */
+ * dimensions, and allocates memory. The images may have any element 
+ * types. */
 int im_downsample_2x(const Image *const src, Image *const dst)
 {
 
-	int x, y, z, c;
+        Im_slice_task task;
 
 	// Initialize dst
 	dst->nx = (int)floor((double)src->nx / 2.0);
@@ -1752,17 +2544,47 @@ int im_downsample_2x(const Image *const src, Image *const dst)
 		return SIFT3D_FAILURE;
 
 	// Downsample
-	SIFT3D_IM_LOOP_START_C(dst, x, y, z, c)
+        task.src1 = src;
+        task.dst = dst;
+        SIFT3D_parallel_for(dst->nz, im_downsample_2x_slice, &task);
+
+	return SIFT3D_SUCCESS;
+}
+
+/* Helper function to downsample slice z of the image, for 
+ * im_downsample_2x. */
+static void im_downsample_2x_slice(void *const arg, const int z) {
+
+        const Im_slice_task *const task = (const Im_slice_task *) arg;
+        const Image *const src = task->src1;
+        const Image *const dst = task->dst;
+        int x, y, c;
+
+        const int src_z = z << 1;
+
+        // Convert the elements of other types 
+        if (src->type != IM_FLOAT32 || dst->type != IM_FLOAT32) {
+                for (y = 0; y < dst->ny; y++) {
+                for (x = 0; x < dst->nx; x++) {
+                for (c = 0; c < dst->nc; c++) {
+                        im_store_vox((Image *) dst, 
+                                SIFT3D_IM_GET_IDX(dst, x, y, z, c), 
+                                SIFT3D_IM_GET_VOX_F(src, x << 1, y << 1, 
+                                        src_z, c));
+                }}}
+                return;
+        }
+
+        for (y = 0; y < dst->ny; y++) {
+        for (x = 0; x < dst->nx; x++) {
+        for (c = 0; c < dst->nc; c++) {
 
 		const int src_x = x << 1;
 		const int src_y = y << 1;
-		const int src_z = z << 1;
 
 		SIFT3D_IM_GET_VOX(dst, x, y, z, c) =
 		    SIFT3D_IM_GET_VOX(src, src_x, src_y, src_z, c);
-	SIFT3D_IM_LOOP_END_C 
-
-	return SIFT3D_SUCCESS;
+        }}}
 }
 
 /* Same as im_downsample_2x, but with OpenCL acceleration. This function DOES NOT
@@ -1862,7 +2684,7 @@ int im_set_kernel_arg(cl_kernel kernel, int n, Image * im)
 }
 
 /* Copy an image's dimensions and stride into another. 
- * This function resizes dst.
+ * This function resizes dst, which keeps its element type.
  * 
  * @param src The source image.
  * @param dst The destination image.
@@ -1889,7 +2711,8 @@ int im_copy_dims(const Image * const src, Image * dst)
 
 /* Copy an image's data into another. This function
  * changes the dimensions and stride of dst,
- * and allocates memory. */
+ * and allocates memory. The data are converted to the element type of dst,
+ * as in im_set_type, so src may have any type. */
 int im_copy_data(const Image * const src, Image * const dst)
 {
 
@@ -1907,6 +2730,12 @@ int im_copy_data(const Image * const src, Image * const dst)
 	if (im_copy_dims(src, dst))
 		return SIFT3D_FAILURE;
 
+	// Convert the data of other types
+        if (src->type != IM_FLOAT32 || dst->type != IM_FLOAT32) {
+                im_convert_data(src, dst);
+                return SIFT3D_SUCCESS;
+        }
+
 	// Copy data
         SIFT3D_IM_LOOP_START_C(dst, x, y, z, c)
                 SIFT3D_IM_GET_VOX(dst, x, y, z, c) = 
@@ -1916,6 +2745,37 @@ int im_copy_data(const Image * const src, Image * const dst)
 	return SIFT3D_SUCCESS;
 }
 
+/* Helper function to copy the data of src into dst, which has the same 
+ * dimensions and stride, converting between their element types. 
+ * Contiguous images are converted in blocks of SIFT3D_CONV_TILE elements. */
+static void im_convert_data(const Image *const src, Image *const dst) {
+
+        float buf[SIFT3D_CONV_TILE];
+        size_t i;
+        int x, y, z, c;
+
+        const size_t size = src->size;
+
+        // Convert element-wise if the data are not contiguous
+        if (src->xs != (size_t) src->nc || 
+                src->ys != (size_t) src->nx * src->xs ||
+                src->zs != (size_t) src->ny * src->ys) {
+                SIFT3D_IM_LOOP_START_C(dst, x, y, z, c)
+                        const size_t idx = SIFT3D_IM_GET_IDX(dst, x, y, z, c);
+                        im_store_vox(dst, idx, im_load_vox(src, idx));
+                SIFT3D_IM_LOOP_END_C
+                return;
+        }
+
+        for (i = 0; i < size; i += SIFT3D_CONV_TILE) {
+
+                const int n = (int) SIFT3D_MIN(size - i, SIFT3D_CONV_TILE);
+
+                im_load_row(src, i, n, buf);
+                im_store_row(dst, i, n, buf);
+        }
+}
+
 /* Clean up memory for an Image */
 void im_free(Image * im)
 {
@@ -1953,29 +2813,115 @@ int im_channel(const Image * const src, Image * const dst,
 	SIFT3D_IM_LOOP_END return SIFT3D_SUCCESS;
 }
 
-/* Find the maximum absolute value of an image */
+/* Find the maximum absolute value of an image, of any element type */
 float im_max_abs(const Image *const im) {
 
+        Im_slice_task task;
         float max;
+        float *slice_max;
         int x, y, z, c;
 
-	max = 0.0f;
-	SIFT3D_IM_LOOP_START_C(im, x, y, z, c)
+        // Fall back to a serial search if we are out of memory
+        if ((slice_max = (float *) malloc(SIFT3D_MAX(im->nz, 1) * 
+                sizeof(float))) == NULL) {
 
-	        const float samp = fabsf(SIFT3D_IM_GET_VOX(im, x, y, z, c));
-                max = SIFT3D_MAX(max, samp);
+	        max = 0.0f;
+	        SIFT3D_IM_LOOP_START_C(im, x, y, z, c)
 
-	SIFT3D_IM_LOOP_END_C
+	                const float samp = fabsf(SIFT3D_IM_GET_VOX_F(im, x, y, 
+                                z, c));
+                        max = SIFT3D_MAX(max, samp);
+
+	        SIFT3D_IM_LOOP_END_C
+
+                return max;
+        }
+
+        // Find the maximum of each slice
+        task.src1 = im;
+        task.slice_max = slice_max;
+        SIFT3D_parallel_for(im->nz, im_max_abs_slice, &task);
+
+        // Reduce the slices
+        max = 0.0f;
+        for (z = 0; z < im->nz; z++) {
+                max = SIFT3D_MAX(max, slice_max[z]);
+        }
+
+        free(slice_max);
 
         return max;
 }
 
+/* Helper function to mix a 64-bit word into an FNV-1a hash */
+static uint64_t hash_mix(const uint64_t hash, const uint64_t word) {
+        return (hash ^ word) * 0x100000001b3ULL;
+}
+
+/* Hash the dimensions, units and voxel data of an image, starting from seed.
+ * The result does not depend on the strides, capacity or element type of im,
+ * so equal images have equal hashes. */
+uint64_t im_hash(const Image *const im, const uint64_t seed) {
+
+        uint64_t hash;
+        int x, y, z, c, i;
+
+        hash = seed ^ 0xcbf29ce484222325ULL;
+
+        // Hash the dimensions and units
+        for (i = 0; i < IM_NDIMS; i++) {
+
+                uint64_t bits;
+
+                const double unit = SIFT3D_IM_GET_UNITS(im)[i];
+
+                memcpy(&bits, &unit, sizeof(bits));
+                hash = hash_mix(hash, (uint64_t) SIFT3D_IM_GET_DIMS(im)[i]);
+                hash = hash_mix(hash, bits);
+        }
+        hash = hash_mix(hash, (uint64_t) im->nc);
+
+        // Hash the data
+        SIFT3D_IM_LOOP_START_C(im, x, y, z, c)
+
+                uint32_t bits;
+
+                const float val = SIFT3D_IM_GET_VOX_F(im, x, y, z, c);
+
+                memcpy(&bits, &val, sizeof(bits));
+                hash = hash_mix(hash, bits);
+
+        SIFT3D_IM_LOOP_END_C
+
+        return hash;
+}
+
+/* Helper function to find the maximum absolute value of slice z, for 
+ * im_max_abs. */
+static void im_max_abs_slice(void *const arg, const int z) {
+
+        const Im_slice_task *const task = (const Im_slice_task *) arg;
+        const Image *const im = task->src1;
+        float max;
+        int x, y, c;
+
+        max = 0.0f;
+        for (y = 0; y < im->ny; y++) {
+        for (x = 0; x < im->nx; x++) {
+        for (c = 0; c < im->nc; c++) {
+	        const float samp = fabsf(SIFT3D_IM_GET_VOX_F(im, x, y, z, c));
+                max = SIFT3D_MAX(max, samp);
+        }}}
+
+        task->slice_max[z] = max;
+}
+
 /* Scale an image to the [-1, 1] range, where
  * the largest absolute value is 1. */
 void im_scale(const Image *const im)
 {
 
-	int x, y, z, c;
+        Im_slice_task task;
 
         // Find the maximum absolute value
 	const float max = im_max_abs(im);
@@ -1983,19 +2929,33 @@ void im_scale(const Image *const im)
 	        return;
 
 	// Divide by the max 
-	SIFT3D_IM_LOOP_START_C(im, x, y, z, c)
-	        SIFT3D_IM_GET_VOX(im, x, y, z, c) /= max;
-        SIFT3D_IM_LOOP_END_C
+        task.dst = im;
+        task.scalar = max;
+        SIFT3D_parallel_for(im->nz, im_scale_slice, &task);
+}
+
+/* Helper function to divide slice z by the scalar, for im_scale. */
+static void im_scale_slice(void *const arg, const int z) {
+
+        const Im_slice_task *const task = (const Im_slice_task *) arg;
+        const Image *const im = task->dst;
+        int x, y, c;
+
+        for (y = 0; y < im->ny; y++) {
+        for (x = 0; x < im->nx; x++) {
+        for (c = 0; c < im->nc; c++) {
+	        SIFT3D_IM_GET_VOX(im, x, y, z, c) /= task->scalar;
+        }}}
 }
 
 /* Subtract src2 from src1, saving the result in
- * dst.
+ * dst. The images may have any element types.
  * Resizes dst. 
  */
 int im_subtract(Image * src1, Image * src2, Image * dst)
 {
 
-	int x, y, z, c;
+        Im_slice_task task;
 
 	// Verify inputs
 	if (src1->nx != src2->nx ||
@@ -2007,11 +2967,45 @@ int im_subtract(Image * src1, Image * src2, Image * dst)
 	if (im_copy_dims(src1, dst))
 		return SIFT3D_FAILURE;
 
-	SIFT3D_IM_LOOP_START_C(dst, x, y, z, c)
+        // Subtract
+        task.src1 = src1;
+        task.src2 = src2;
+        task.dst = dst;
+        SIFT3D_parallel_for(dst->nz, im_subtract_slice, &task);
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper function to subtract slice z, for im_subtract. */
+static void im_subtract_slice(void *const arg, const int z) {
+
+        const Im_slice_task *const task = (const Im_slice_task *) arg;
+        const Image *const src1 = task->src1;
+        const Image *const src2 = task->src2;
+        const Image *const dst = task->dst;
+        int x, y, c;
+
+        // Convert the elements of other types 
+        if (src1->type != IM_FLOAT32 || src2->type != IM_FLOAT32 || 
+                dst->type != IM_FLOAT32) {
+                for (y = 0; y < dst->ny; y++) {
+                for (x = 0; x < dst->nx; x++) {
+                for (c = 0; c < dst->nc; c++) {
+                        im_store_vox((Image *) dst, 
+                                SIFT3D_IM_GET_IDX(dst, x, y, z, c), 
+                                SIFT3D_IM_GET_VOX_F(src1, x, y, z, c) -
+                                SIFT3D_IM_GET_VOX_F(src2, x, y, z, c));
+                }}}
+                return;
+        }
+
+        for (y = 0; y < dst->ny; y++) {
+        for (x = 0; x < dst->nx; x++) {
+        for (c = 0; c < dst->nc; c++) {
 	    SIFT3D_IM_GET_VOX(dst, x, y, z, c) =
 	    SIFT3D_IM_GET_VOX(src1, x, y, z, c) -
 	    SIFT3D_IM_GET_VOX(src2, x, y, z, c);
-	SIFT3D_IM_LOOP_END_C return SIFT3D_SUCCESS;
+        }}}
 }
 
 /* Zero an image. */
@@ -2025,6 +3019,11 @@ void im_zero(Image * im)
 SIFT3D_IM_LOOP_END_C}
 
 /* Transform an image according to the inverse of the provided tform. 
+ *
+ * Affine transformations are evaluated incrementally along each row. Thin
+ * plate splines are evaluated on a grid of every SIFT3D_TPS_GRID voxels,
+ * and interpolated in between. The output is processed in tiles of
+ * SIFT3D_WARP_TILE rows, in parallel.
  * 
  * Paramters:
  *   tform: The transformation. 
@@ -2039,135 +3038,436 @@ int im_inv_transform(const void *const tform, const Image * const src,
 		     const interp_type interp, const int resize, 
                      Image *const dst)
 {
-	int x, y, z, c;
+        Warp_task task;
+        Image grid;
+        int i, j;
 
 	// Optionally resize the output image
 	if (resize && im_copy_dims(src, dst))
 		return SIFT3D_FAILURE;
 
-#define IMUTIL_RESAMPLE(arg) \
-    SIFT3D_IM_LOOP_START(dst, x, y, z) \
-\
-	double transx, transy, transz; \
-\
-        apply_tform_xyz(tform, (double)x, (double)y, (double)z, \
-            &transx, &transy, &transz); \
-                        \
-                for (c = 0; c < dst->nc; c++) { \
-                SIFT3D_IM_GET_VOX(dst, x, y, z, c) = resample_ ## arg(src, \
-                                transx, transy, transz, c); \
-                } \
-    SIFT3D_IM_LOOP_END
-
-	// Transform
+	// Verify the interpolation type
 	switch (interp) {
 	case LINEAR:
-		IMUTIL_RESAMPLE(linear)
-		    break;
+		break;
 	case LANCZOS2:
-		IMUTIL_RESAMPLE(lanczos2)
-		    break;
+                init_lanczos2_table();
+		break;
 	default:
 		SIFT3D_ERR("im_inv_transform: unrecognized "
 			"interpolation type");
 		return SIFT3D_FAILURE;
 	}
 
-#undef RESAMPLE
+        task.src = src;
+        task.dst = dst;
+        task.tform = tform;
+        task.grid = NULL;
+        task.interp = interp;
+        task.type = tform_get_type(tform);
+        task.tiles_per_slice = (dst->ny + SIFT3D_WARP_TILE - 1) / 
+                SIFT3D_WARP_TILE;
+
+        // Prepare the transformation
+        init_im(&grid);
+        switch (task.type) {
+        case AFFINE:
+        {
+                const Affine *const aff = (const Affine *) tform;
+
+                if (AFFINE_GET_DIM(aff) != IM_NDIMS) {
+                        SIFT3D_ERR("im_inv_transform: unsupported affine "
+                                "dimensionality: %d \n", AFFINE_GET_DIM(aff));
+                        return SIFT3D_FAILURE;
+                }
+
+                for (i = 0; i < IM_NDIMS; i++) {
+                        for (j = 0; j < IM_NDIMS + 1; j++) {
+                                task.A[i][j] = SIFT3D_MAT_RM_GET(&aff->A, i, 
+                                        j, double);
+                        }
+                }
+                break;
+        }
+        case TPS:
+                if (make_tps_grid(tform, dst, &grid))
+                        return SIFT3D_FAILURE;
+                task.grid = &grid;
+                break;
+        default:
+		SIFT3D_ERR("im_inv_transform: unrecognized "
+			"transformation type");
+		return SIFT3D_FAILURE;
+        }
+
+	// Transform
+        SIFT3D_parallel_for(dst->nz * task.tiles_per_slice, 
+                im_inv_transform_tile, &task);
+
+        im_free(&grid);
 
 	return SIFT3D_SUCCESS;
 }
 
-/* Helper routine for image transformation. Performs trilinear
- * interpolation, setting out-of-bounds voxels to zero. */
-static double resample_linear(const Image * const in, const double x,
-			      const double y, const double z, const int c)
-{
+/* Helper function to evaluate a thin plate spline on the coarse grid used by
+ * im_inv_transform. Grid point [i, j, k] is the transformation of voxel
+ * [i, j, k] * SIFT3D_TPS_GRID of dst, stored in three channels. The grid 
+ * extends one point past the image, so that every voxel lies in a cell. */
+static int make_tps_grid(const void *const tps, const Image *const dst, 
+        Image *const grid) {
 
-	// Detect out-of-bounds
-	if (x < 0 || x > in->nx - 1 ||
-	    y < 0 || y > in->ny - 1 || z < 0 || z > in->nz - 1)
-		return 0.0;
-
-	int fx = (int)floor(x);
-	int fy = (int)floor(y);
-	int fz = (int)floor(z);
-	int cx = (int)ceil(x);
-	int cy = (int)ceil(y);
-	int cz = (int)ceil(z);
-
-	double dist_x = x - fx;
-	double dist_y = y - fy;
-	double dist_z = z - fz;
-
-	double c0 = SIFT3D_IM_GET_VOX(in, fx, fy, fz, c);
-	double c1 = SIFT3D_IM_GET_VOX(in, fx, cy, fz, c);
-	double c2 = SIFT3D_IM_GET_VOX(in, cx, fy, fz, c);
-	double c3 = SIFT3D_IM_GET_VOX(in, cx, cy, fz, c);
-	double c4 = SIFT3D_IM_GET_VOX(in, fx, fy, cz, c);
-	double c5 = SIFT3D_IM_GET_VOX(in, fx, cy, cz, c);
-	double c6 = SIFT3D_IM_GET_VOX(in, cx, fy, cz, c);
-	double c7 = SIFT3D_IM_GET_VOX(in, cx, cy, cz, c);
-
-	double out = c0 * (1.0 - dist_x) * (1.0 - dist_y) * (1.0 - dist_z)
-	    + c1 * (1.0 - dist_x) * dist_y * (1.0 - dist_z)
-	    + c2 * dist_x * (1.0 - dist_y) * (1.0 - dist_z)
-	    + c3 * dist_x * dist_y * (1.0 - dist_z)
-	    + c4 * (1.0 - dist_x) * (1.0 - dist_y) * dist_z
-	    + c5 * (1.0 - dist_x) * dist_y * dist_z
-	    + c6 * dist_x * (1.0 - dist_y) * dist_z
-	    + c7 * dist_x * dist_y * dist_z;
-
-	return out;
-}
-
-/* Helper routine to resample an image at a point, using the Lanczos kernel */
-static double resample_lanczos2(const Image * const im, const double x,
-				const double y, const double z, const int c)
-{
+        Warp_task task;
+
+        grid->nx = (dst->nx - 1) / SIFT3D_TPS_GRID + 2;
+        grid->ny = (dst->ny - 1) / SIFT3D_TPS_GRID + 2;
+        grid->nz = (dst->nz - 1) / SIFT3D_TPS_GRID + 2;
+        grid->nc = IM_NDIMS;
+        im_default_stride(grid);
+        if (im_resize(grid))
+                return SIFT3D_FAILURE;
+
+        task.tform = tps;
+        task.grid = grid;
+        SIFT3D_parallel_for(grid->nz, make_tps_grid_slice, &task);
 
-	double val;
-	int xs, ys, zs;
+        return SIFT3D_SUCCESS;
+}
 
-	//TODO: faster separable implementation
+/* Helper function to evaluate slice z of the grid, for make_tps_grid. */
+static void make_tps_grid_slice(void *const arg, const int z) {
 
-	// Kernel parameter
-	const double a = 2;
+        const Warp_task *const task = (const Warp_task *) arg;
+        const Image *const grid = task->grid;
+        int x, y;
 
-	// Check bounds
-	const double xMin = 0;
-	const double yMin = 0;
-	const double zMin = 0;
-	const double xMax = im->nx - 1;
-	const double yMax = im->ny - 1;
-	const double zMax = im->nz - 1;
-	if (x < xMin || y < yMin || z < zMin ||
-	    x > xMax || y > yMax || z > zMax)
-		return 0.0;
+        for (y = 0; y < grid->ny; y++) {
+        for (x = 0; x < grid->nx; x++) {
 
-	// Window 
-	const int x_start = SIFT3D_MAX(floor(x) - a, xMin);
-	const int x_end = SIFT3D_MIN(floor(x) + a, xMax);
-	const int y_start = SIFT3D_MAX(floor(y) - a, yMin);
-	const int y_end = SIFT3D_MIN(floor(y) + a, yMax);
-	const int z_start = SIFT3D_MAX(floor(z) - a, zMin);
-	const int z_end = SIFT3D_MIN(floor(z) + a, zMax);
+                double xt, yt, zt;
 
-	// Iterate through the window 
-	val = 0.0;
-	SIFT3D_IM_LOOP_LIMITED_START(in, xs, ys, zs, x_start, x_end, y_start,
-				     y_end, z_start, z_end)
+                apply_tform_xyz(task->tform, (double) (x * SIFT3D_TPS_GRID), 
+                        (double) (y * SIFT3D_TPS_GRID), 
+                        (double) (z * SIFT3D_TPS_GRID), &xt, &yt, &zt);
+                SIFT3D_IM_GET_VOX(grid, x, y, z, 0) = (float) xt;
+                SIFT3D_IM_GET_VOX(grid, x, y, z, 1) = (float) yt;
+                SIFT3D_IM_GET_VOX(grid, x, y, z, 2) = (float) zt;
+        }}
+}
 
-        // Evalutate the kernel
-	const double xw = fabs((double)xs - x) + DBL_EPSILON;
-	const double yw = fabs((double)ys - y) + DBL_EPSILON;
-	const double zw = fabs((double)zs - z) + DBL_EPSILON;
-	const double kernel = lanczos(xw, a) * lanczos(yw, a) * lanczos(zw, a);
+/* Helper function to compute the input coordinates of n voxels of the
+ * output, starting at [x_start, y, z], for im_inv_transform. */
+static void warp_coords(const Warp_task *const task, const int x_start, 
+        const int y, const int z, const int n, double *const xs, 
+        double *const ys, double *const zs) {
 
-	// Accumulate
-	val += kernel * SIFT3D_IM_GET_VOX(im, xs, ys, zs, c);
+        int i;
 
-	SIFT3D_IM_LOOP_END return val;
+        switch (task->type) {
+        case AFFINE:
+        {
+                const double (*const A)[IM_NDIMS + 1] = task->A;
+
+                // The y and z terms are constant along the row. The sum is
+                // in the same order as apply_Affine_xyz, for the same 
+                // rounding.
+                const double xy = A[0][1] * y, xz = A[0][2] * z;
+                const double yy = A[1][1] * y, yz = A[1][2] * z;
+                const double zy = A[2][1] * y, zz = A[2][2] * z;
+
+#pragma omp simd
+                for (i = 0; i < n; i++) {
+                        const double x = (double) (x_start + i);
+                        xs[i] = A[0][0] * x + xy + xz + A[0][3];
+                        ys[i] = A[1][0] * x + yy + yz + A[1][3];
+                        zs[i] = A[2][0] * x + zy + zz + A[2][3];
+                }
+                break;
+        }
+        case TPS:
+        {
+                const Image *const grid = task->grid;
+
+                // Weights of the grid cell in y and z
+                const int gy = y / SIFT3D_TPS_GRID;
+                const int gz = z / SIFT3D_TPS_GRID;
+                const double wy = (double) (y % SIFT3D_TPS_GRID) / 
+                        SIFT3D_TPS_GRID;
+                const double wz = (double) (z % SIFT3D_TPS_GRID) / 
+                        SIFT3D_TPS_GRID;
+
+                for (i = 0; i < n; i++) {
+
+                        double coords[IM_NDIMS];
+                        int c;
+
+                        const int x = x_start + i;
+                        const int gx = x / SIFT3D_TPS_GRID;
+                        const double wx = (double) (x % SIFT3D_TPS_GRID) / 
+                                SIFT3D_TPS_GRID;
+
+                        for (c = 0; c < IM_NDIMS; c++) {
+#define GRID(dx, dy, dz) \
+        ((double) SIFT3D_IM_GET_VOX(grid, gx + (dx), gy + (dy), gz + (dz), c))
+                                coords[c] = 
+                                        (1.0 - wz) * ((1.0 - wy) * 
+                                        ((1.0 - wx) * GRID(0, 0, 0) + 
+                                        wx * GRID(1, 0, 0)) + wy * 
+                                        ((1.0 - wx) * GRID(0, 1, 0) + 
+                                        wx * GRID(1, 1, 0))) + wz * 
+                                        ((1.0 - wy) * 
+                                        ((1.0 - wx) * GRID(0, 0, 1) + 
+                                        wx * GRID(1, 0, 1)) + wy * 
+                                        ((1.0 - wx) * GRID(0, 1, 1) + 
+                                        wx * GRID(1, 1, 1)));
+#undef GRID
+                        }
+
+                        xs[i] = coords[0];
+                        ys[i] = coords[1];
+                        zs[i] = coords[2];
+                }
+                break;
+        }
+        default:
+                assert(SIFT3D_FALSE);
+        }
+}
+
+/* Helper function to transform tile i of the output, for im_inv_transform.
+ * Each tile consists of up to SIFT3D_WARP_TILE rows of a single slice. */
+static void im_inv_transform_tile(void *const arg, const int i) {
+
+        double xs[SIFT3D_WARP_CHUNK], ys[SIFT3D_WARP_CHUNK], 
+                zs[SIFT3D_WARP_CHUNK];
+        int x, y, c;
+
+        const Warp_task *const task = (const Warp_task *) arg;
+        const Image *const src = task->src;
+        const Image *const dst = task->dst;
+        const int z = i / task->tiles_per_slice;
+        const int y_start = (i % task->tiles_per_slice) * SIFT3D_WARP_TILE;
+        const int y_end = SIFT3D_MIN(y_start + SIFT3D_WARP_TILE, dst->ny);
+
+        for (y = y_start; y < y_end; y++) {
+                for (x = 0; x < dst->nx; x += SIFT3D_WARP_CHUNK) {
+
+                        const int n = SIFT3D_MIN(SIFT3D_WARP_CHUNK, 
+                                dst->nx - x);
+
+                        // Compute the input coordinates
+                        warp_coords(task, x, y, z, n, xs, ys, zs);
+
+                        // Resample
+                        switch (task->interp) {
+                        case LINEAR:
+                                for (c = 0; c < dst->nc; c++) {
+                                        warp_linear(src, xs, ys, zs, n, c,
+                                                &SIFT3D_IM_GET_VOX(dst, x, y, 
+                                                z, c), dst->xs);
+                                }
+                                break;
+                        case LANCZOS2:
+                                warp_lanczos2(src, xs, ys, zs, n, 
+                                        &SIFT3D_IM_GET_VOX(dst, x, y, z, 0), 
+                                        dst->xs);
+                                break;
+                        default:
+                                assert(SIFT3D_FALSE);
+                        }
+                }
+        }
+}
+
+/* Helper routine for image transformation. Samples channel c of the image at
+ * the n points [xs, ys, zs] with trilinear interpolation, setting 
+ * out-of-bounds voxels to zero. The results are written to out, spaced 
+ * out_stride apart. The loop is branch-free, clamping the indices of 
+ * out-of-bounds points, so that it can be vectorized. */
+static void warp_linear(const Image *const in, const double *const xs,
+        const double *const ys, const double *const zs, const int n, 
+        const int c, float *const out, const size_t out_stride) {
+
+        int i;
+
+        const double x_max = in->nx - 1;
+        const double y_max = in->ny - 1;
+        const double z_max = in->nz - 1;
+
+#pragma omp simd
+        for (i = 0; i < n; i++) {
+
+                // Detect out-of-bounds
+                const int in_bounds = xs[i] >= 0 && xs[i] <= x_max &&
+                        ys[i] >= 0 && ys[i] <= y_max && 
+                        zs[i] >= 0 && zs[i] <= z_max;
+                const double x = in_bounds ? xs[i] : 0.0;
+                const double y = in_bounds ? ys[i] : 0.0;
+                const double z = in_bounds ? zs[i] : 0.0;
+
+                // The coordinates are nonnegative, so truncation is floor
+                const int fx = (int) x;
+                const int fy = (int) y;
+                const int fz = (int) z;
+                const int cx = SIFT3D_MIN(fx + 1, in->nx - 1);
+                const int cy = SIFT3D_MIN(fy + 1, in->ny - 1);
+                const int cz = SIFT3D_MIN(fz + 1, in->nz - 1);
+
+                const double dist_x = x - fx;
+                const double dist_y = y - fy;
+                const double dist_z = z - fz;
+
+                const double c0 = SIFT3D_IM_GET_VOX(in, fx, fy, fz, c);
+                const double c1 = SIFT3D_IM_GET_VOX(in, fx, cy, fz, c);
+                const double c2 = SIFT3D_IM_GET_VOX(in, cx, fy, fz, c);
+                const double c3 = SIFT3D_IM_GET_VOX(in, cx, cy, fz, c);
+                const double c4 = SIFT3D_IM_GET_VOX(in, fx, fy, cz, c);
+                const double c5 = SIFT3D_IM_GET_VOX(in, fx, cy, cz, c);
+                const double c6 = SIFT3D_IM_GET_VOX(in, cx, fy, cz, c);
+                const double c7 = SIFT3D_IM_GET_VOX(in, cx, cy, cz, c);
+
+                const double val = 
+                    c0 * (1.0 - dist_x) * (1.0 - dist_y) * (1.0 - dist_z)
+                    + c1 * (1.0 - dist_x) * dist_y * (1.0 - dist_z)
+                    + c2 * dist_x * (1.0 - dist_y) * (1.0 - dist_z)
+                    + c3 * dist_x * dist_y * (1.0 - dist_z)
+                    + c4 * (1.0 - dist_x) * (1.0 - dist_y) * dist_z
+                    + c5 * (1.0 - dist_x) * dist_y * dist_z
+                    + c6 * dist_x * (1.0 - dist_y) * dist_z
+                    + c7 * dist_x * dist_y * dist_z;
+
+                out[i * out_stride] = in_bounds ? (float) val : 0.0f;
+        }
+}
+
+/* Helper routine for image transformation. Samples all channels of the image
+ * at the n points [xs, ys, zs] with the Lanczos kernel, setting 
+ * out-of-bounds voxels to zero. The results for point i are written to 
+ * out + i * out_stride. The kernel is separable, so the weights of each 
+ * dimension are looked up once per point, from the table of 
+ * init_lanczos2_table. */
+static void warp_lanczos2(const Image *const im, const double *const xs,
+        const double *const ys, const double *const zs, const int n, 
+        float *const out, const size_t out_stride) {
+
+        double wx[5], wy[5], wz[5];
+        int i, c, xi, yi, zi;
+
+        // Kernel parameter
+        const int a = 2;
+
+        const double xMax = im->nx - 1;
+        const double yMax = im->ny - 1;
+        const double zMax = im->nz - 1;
+
+        for (i = 0; i < n; i++) {
+
+                const double x = xs[i];
+                const double y = ys[i];
+                const double z = zs[i];
+                float *const out_vox = out + i * out_stride;
+
+                // Check bounds
+                if (x < 0 || y < 0 || z < 0 ||
+                    x > xMax || y > yMax || z > zMax) {
+                        for (c = 0; c < im->nc; c++) {
+                                out_vox[c] = 0.0f;
+                        }
+                        continue;
+                }
+
+                {
+                        // Window
+                        const int x_start = SIFT3D_MAX((int) x - a, 0);
+                        const int x_end = SIFT3D_MIN((int) x + a, im->nx - 1);
+                        const int y_start = SIFT3D_MAX((int) y - a, 0);
+                        const int y_end = SIFT3D_MIN((int) y + a, im->ny - 1);
+                        const int z_start = SIFT3D_MAX((int) z - a, 0);
+                        const int z_end = SIFT3D_MIN((int) z + a, im->nz - 1);
+
+                        // Evaluate the kernel in each dimension
+                        for (xi = x_start; xi <= x_end; xi++) {
+                                wx[xi - x_start] = lanczos2_lookup(
+                                        fabs((double) xi - x));
+                        }
+                        for (yi = y_start; yi <= y_end; yi++) {
+                                wy[yi - y_start] = lanczos2_lookup(
+                                        fabs((double) yi - y));
+                        }
+                        for (zi = z_start; zi <= z_end; zi++) {
+                                wz[zi - z_start] = lanczos2_lookup(
+                                        fabs((double) zi - z));
+                        }
+
+                        // Accumulate
+                        for (c = 0; c < im->nc; c++) {
+
+                                double val = 0.0;
+
+                                for (zi = z_start; zi <= z_end; zi++) {
+
+                                        double val_z = 0.0;
+
+                                        for (yi = y_start; yi <= y_end; yi++) {
+
+                                                double val_y = 0.0;
+
+                                                for (xi = x_start; xi <= x_end;
+                                                        xi++) {
+                                                        val_y += 
+                                                                wx[xi - 
+                                                                x_start] *
+                                                                SIFT3D_IM_GET_VOX(
+                                                                im, xi, yi, 
+                                                                zi, c);
+                                                }
+                                                val_z += wy[yi - y_start] * 
+                                                        val_y;
+                                        }
+                                        val += wz[zi - z_start] * val_z;
+                                }
+
+                                out_vox[c] = (float) val;
+                        }
+                }
+        }
+}
+
+/* Sampled Lanczos kernel, a = 2, for distances on [0, 3]. Initialized by
+ * init_lanczos2_table. */
+static double lanczos2_table[3 * SIFT3D_LANCZOS_RES + 2];
+static int lanczos2_table_ready = SIFT3D_FALSE;
+
+/* Tabulate the Lanczos kernel for lanczos2_lookup. The interpolation window 
+ * reaches up to 3 voxels from the sample, so the table extends past the 
+ * kernel support. */
+static void init_lanczos2_table(void) {
+
+        int i;
+
+        const double a = 2;
+
+        if (lanczos2_table_ready)
+                return;
+
+        for (i = 0; i < 3 * SIFT3D_LANCZOS_RES + 2; i++) {
+                lanczos2_table[i] = lanczos((double) i / SIFT3D_LANCZOS_RES + 
+                        DBL_EPSILON, a);
+        }
+
+        lanczos2_table_ready = SIFT3D_TRUE;
+}
+
+/* Evaluate the Lanczos kernel, a = 2, at distance d on [0, 3), by linear 
+ * interpolation in the table. */
+static double lanczos2_lookup(const double d) {
+
+        const double pos = d * SIFT3D_LANCZOS_RES;
+        const int i = (int) pos;
+        const double frac = pos - i;
+
+        assert(i >= 0 && i < 3 * SIFT3D_LANCZOS_RES + 1);
+        return (1.0 - frac) * lanczos2_table[i] + 
+                frac * lanczos2_table[i + 1];
 }
 
 /* Lanczos kernel function */
@@ -2273,24 +3573,19 @@ static int convolve_sep_gen(const Image * const src,
 			Image * const dst, const Sep_FIR_filter * const f,
 			const int dim, const double unit)
 {
-	register int x, y, z, c, d;
-
-	register const int half_width = f->width / 2;
-	register const int nx = src->nx;
-	register const int ny = src->ny;
-	register const int nz = src->nz;
-        register const float conv_eps = 0.1f;
-	register const int dim_end = SIFT3D_IM_GET_DIMS(src)[dim] - 1;
-        register const float unit_factor =  unit /
-                SIFT3D_IM_GET_UNITS(src)[dim];
-        register const int unit_half_width = 
-                (int) ceilf(half_width * unit_factor);
-        int start[] = {0, 0, 0};
-        int end[] = {nx - 1, ny - 1, nz - 1};
+        Conv_task task;
+
+	const int half_width = f->width / 2;
+        const float unit_factor =  unit / SIFT3D_IM_GET_UNITS(src)[dim];
+        const int unit_half_width = (int) ceilf(half_width * unit_factor);
 
         // Compute starting and ending points for the convolution dimension
-        start[dim] += unit_half_width;
-        end[dim] -= unit_half_width + 1;
+        task.start[0] = task.start[1] = task.start[2] = 0;
+        task.end[0] = src->nx - 1;
+        task.end[1] = src->ny - 1;
+        task.end[2] = src->nz - 1;
+        task.start[dim] += unit_half_width;
+        task.end[dim] -= unit_half_width + 1;
 
 	//TODO: Convert this to convolve_x, which only convolves in x,
 	// then make a wrapper to restride, transpose, convolve x, and transpose 
@@ -2306,16 +3601,54 @@ static int convolve_sep_gen(const Image * const src,
 	// Initialize the output to zeros
 	im_zero(dst);
 
-#define SAMP_AND_ACC(src, dst, tap, coords, c) \
+        // Convolve each slice
+        task.src = src;
+        task.dst = dst;
+        task.f = f;
+        task.dim = dim;
+        task.unit_factor = unit_factor;
+        task.ret = SIFT3D_SUCCESS;
+        SIFT3D_parallel_for(src->nz, convolve_sep_gen_slice, &task);
+
+        return task.ret;
+}
+
+/* Helper function to convolve slice z of the image, for convolve_sep_gen. 
+ * The interior and boundary voxels of a slice are disjoint, so each voxel is
+ * written by exactly one task. */
+static void convolve_sep_gen_slice(void *const arg, const int z) {
+
+        const Conv_task *const task = (const Conv_task *) arg;
+        const Image *const src = task->src;
+        Image *const dst = task->dst;
+        const Sep_FIR_filter *const f = task->f;
+        const int *const start = task->start;
+        const int *const end = task->end;
+	int x, y, c, d;
+
+        const int dim = task->dim;
+        const float unit_factor = task->unit_factor;
+	const int half_width = f->width / 2;
+        const float conv_eps = 0.1f;
+	const int dim_end = SIFT3D_IM_GET_DIMS(src)[dim] - 1;
+
+#define SAMP_AND_ACC(src, dst, tap, base, off, c) \
 { \
-        float frac; \
+        float frac, off_lo; \
 \
-        const int idx_lo[] = {(coords)[0], (coords)[1], (coords)[2]}; \
-        int idx_hi[] = {idx_lo[0], idx_lo[1], idx_lo[2]}; \
+        int idx_lo[] = {(base)[0], (base)[1], (base)[2]}; \
+        int idx_hi[IM_NDIMS]; \
 \
-        /* Convert the physical coordinates to integer indices*/ \
+        /* Split the coordinate base[dim] + off into integer and fractional 
+         * parts, rounding down. This only depends on the offset, so
+         * the result does not depend on the position in the image. */ \
+        off_lo = floorf(off); \
+        if (idx_lo[dim] + (int) off_lo < 0) \
+                off_lo = (float) -idx_lo[dim]; \
+        frac = (off) - off_lo; \
+        idx_lo[dim] += (int) off_lo; \
+        memcpy(idx_hi, idx_lo, IM_NDIMS * sizeof(int)); \
         idx_hi[dim] += 1; \
-        frac = (coords)[dim] - (float) idx_lo[dim]; \
 \
         /* Sample with linear interpolation */ \
         SIFT3D_IM_GET_VOX(dst, x, y, z, c) += (tap) * \
@@ -2326,32 +3659,28 @@ static int convolve_sep_gen(const Image * const src,
 }
 
 	// First pass: process the interior
-#pragma omp parallel for private(x) private(y) private(c)
-	SIFT3D_IM_LOOP_LIMITED_START_C(dst, x, y, z, c, start[0], end[0], 
-                start[1], end[1], start[2], end[2])
-
-                float coords[] = { x, y, z };
-
-                for (d = -half_width; d <= half_width; d++) {
+        if (z >= start[2] && z <= end[2]) {
+                for (y = start[1]; y <= end[1]; y++) {
+                for (x = start[0]; x <= end[0]; x++) {
+                for (c = 0; c < dst->nc; c++) {
 
-                        const float tap = f->kernel[d + half_width];
-                        const float step = d * unit_factor;
-
-                        // Adjust the sampling coordinates
-                        coords[dim] -= step;
+                        const int base[] = { x, y, z };
 
-                        // Sample
-                        SAMP_AND_ACC(src, dst, tap, coords, c);
+                        for (d = -half_width; d <= half_width; d++) {
 
-                        // Reset the sampling coordinates
-                        coords[dim] += step;
-                }
+                                const float tap = f->kernel[d + half_width];
+                                const float step = d * unit_factor;
 
-	SIFT3D_IM_LOOP_END_C
+                                // Sample
+                                SAMP_AND_ACC(src, dst, tap, base, -step, c);
+                        }
+                }}}
+        }
 
         // Second pass: process the boundaries
-#pragma omp parallel for private(x) private(y) private(c)
-        SIFT3D_IM_LOOP_START_C(dst, x, y, z, c)
+        for (y = 0; y < dst->ny; y++) {
+        for (x = 0; x < dst->nx; x++) {
+        for (c = 0; c < dst->nc; c++) {
 
                 const int i_coords[] = { x, y, z };
 
@@ -2362,32 +3691,34 @@ static int convolve_sep_gen(const Image * const src,
                 // Process the boundary pixel
                 for (d = -half_width; d <= half_width; d++) {
 
-                        float coords[] = { x, y, z };
+                        int base[] = { x, y, z };
+                        float off;
+
                         const float tap = f->kernel[d + half_width];
                         const float step = d * unit_factor;
-
-                        // Adjust the sampling coordinates
-                        coords[dim] -= step;
+                        const float coord = (float) i_coords[dim] - step;
+                        const float end_dist = (float) (i_coords[dim] - 
+                                dim_end) - step;
 
                         // Mirror coordinates
-                        if ((int) coords[dim] < 0) {
-                                coords[dim] = -coords[dim];
-                                assert((int) coords[dim] >= 0);
-                        } else if ((int) coords[dim] >= dim_end) {
-                                coords[dim] = 2.0f * dim_end - coords[dim] -    
-                                        conv_eps;
-                                assert((int) coords[dim] < dim_end);
+                        if ((int) coord < 0) {
+                                base[dim] = 0;
+                                off = -coord;
+                                assert((int) off >= 0);
+                        } else if (end_dist >= 0.0f) {
+                                base[dim] = dim_end;
+                                off = -end_dist - conv_eps;
+                                assert(off < 0.0f);
+                        } else {
+                                off = -step;
                         }
 
                         // Sample
-                        SAMP_AND_ACC(src, dst, tap, coords, c);
+                        SAMP_AND_ACC(src, dst, tap, base, off, c);
                 }
-
-	SIFT3D_IM_LOOP_END_C 
+        }}}
 
 #undef SAMP_AND_ACC
-
-        return SIFT3D_SUCCESS;
 }
 
 /* Same as convolve_sep, but with OpenCL acceleration. This does NOT
@@ -2459,6 +3790,458 @@ static int convolve_sep_sym(const Image * const src, Image * const dst,
 	return convolve_sep_gen(src, dst, f, dim, unit);
 }
 
+/* The line convolution kernel used by convolve_sep_fast, selected by 
+ * init_conv_lines. */
+static void (*conv_lines)(float *const out, const float *const *const rows, 
+        const float *const kernel, const int width, const int n) = NULL;
+
+/* Helper function to select the fastest conv_lines kernel supported by the
+ * CPU. Does nothing if a kernel was already selected. */
+static void init_conv_lines(void) {
+
+        if (conv_lines != NULL)
+                return;
+
+        conv_lines = conv_lines_float;
+
+#ifdef SIFT3D_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+                conv_lines = conv_lines_avx2;
+#endif
+}
+
+/* Computes out[i] = sum_j kernel[j] * rows[j][i], for i = 0, ..., n - 1. The
+ * portable version, which the compiler is expected to vectorize. */
+static void conv_lines_float(float *const out, const float *const *const rows, 
+                             const float *const kernel, const int width, 
+                             const int n) {
+
+        int i, j;
+
+        for (i = 0; i < n; i++) {
+                out[i] = 0.0f;
+        }
+
+        for (j = 0; j < width; j++) {
+
+                const float tap = kernel[j];
+                const float *const row = rows[j];
+
+                for (i = 0; i < n; i++) {
+                        out[i] += tap * row[i];
+                }
+        }
+}
+
+#ifdef SIFT3D_X86_SIMD
+/* As conv_lines_float, using AVX2 and FMA instructions. The outputs are 
+ * accumulated in registers over all of the taps. */
+__attribute__((target("avx2,fma")))
+static void conv_lines_avx2(float *const out, const float *const *const rows, 
+                            const float *const kernel, const int width, 
+                            const int n) {
+
+        int i, j;
+
+        for (i = 0; i + 16 <= n; i += 16) {
+
+                __m256 acc0, acc1;
+
+                acc0 = acc1 = _mm256_setzero_ps();
+                for (j = 0; j < width; j++) {
+                        const __m256 tap = _mm256_set1_ps(kernel[j]);
+                        acc0 = _mm256_fmadd_ps(tap, 
+                                _mm256_loadu_ps(rows[j] + i), acc0);
+                        acc1 = _mm256_fmadd_ps(tap, 
+                                _mm256_loadu_ps(rows[j] + i + 8), acc1);
+                }
+
+                _mm256_storeu_ps(out + i, acc0);
+                _mm256_storeu_ps(out + i + 8, acc1);
+        }
+
+        // Process the remainder with masked loads, so that every output is
+        // computed by the same operations regardless of its position
+        for (; i < n; i += 8) {
+
+                __m256 acc;
+
+                const __m256i mask = _mm256_cmpgt_epi32(
+                        _mm256_set1_epi32(n - i), 
+                        _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+
+                acc = _mm256_setzero_ps();
+                for (j = 0; j < width; j++) {
+                        acc = _mm256_fmadd_ps(_mm256_set1_ps(kernel[j]), 
+                                _mm256_maskload_ps(rows[j] + i, mask), acc);
+                }
+
+                _mm256_maskstore_ps(out + i, mask, acc);
+        }
+}
+#endif
+
+/* Mirror an index into the range [0, n - 1], reflecting about the first and
+ * last elements. */
+static int mirror_idx(int i, const int n) {
+
+        const int period = 2 * (n - 1);
+
+        if (n < 2)
+                return 0;
+
+        i %= period;
+        if (i < 0)
+                i += period;
+
+        return i < n ? i : period - i;
+}
+
+/* Maps the coordinate c of a filter tap to the samples of a line of n voxels,
+ * following the boundary rule of convolve_sep_gen. Coordinates in [0, n - 2]
+ * are sampled directly, and negative coordinates are reflected about 0. 
+ * Coordinates past n - 2 are reflected about n - 1, then shifted inwards by 
+ * conv_eps and linearly interpolated. Coordinates which would still fall 
+ * outside of the line are mirrored by mirror_idx.
+ *
+ * The sample is (1 - frac) * line[idx[0]] + frac * line[idx[1]]. Returns the
+ * number of voxels to interpolate, which is 1 if frac is zero. */
+static int conv_boundary_idx(const int c, const int n, int *const idx, 
+                             float *const frac) {
+
+        float off, off_lo;
+
+        const int e = c - (n - 1);
+        const float conv_eps = 0.1f;
+
+        *frac = 0.0f;
+
+        // Direct sampling and reflection about the first voxel
+        if (c >= 0 && e < 0) {
+                idx[0] = c;
+                return 1;
+        } else if (c < 0 && -c <= n - 1) {
+                idx[0] = -c;
+                return 1;
+        } else if (c < 0 || e > n - 2) {
+                idx[0] = mirror_idx(c, n);
+                return 1;
+        }
+
+        // Reflection about the last voxel, as in convolve_sep_gen
+        off = -(float) e - conv_eps;
+        off_lo = floorf(off);
+        *frac = off - off_lo;
+        idx[0] = (n - 1) + (int) off_lo;
+        idx[1] = idx[0] + 1;
+
+        return 2;
+}
+
+/* Returns the integer step between filter taps in dimension dim of src, or
+ * 0 if the taps do not fall on whole voxels, in which case the image must be
+ * resampled. This also returns 0 if src does not have the default stride. */
+static int get_conv_step(const Image *const src, const int dim,
+                         const double unit) {
+
+        const double unit_factor = unit / SIFT3D_IM_GET_UNITS(src)[dim];
+        const int step = (int) floor(unit_factor + 0.5);
+        const double step_eps = 1E-5;
+
+        // Check the stride
+        if (src->xs != (size_t) src->nc || 
+                src->ys != (size_t) src->nx * src->xs ||
+                src->zs != (size_t) src->ny * src->ys)
+                return 0;
+
+        return step >= 1 && fabs(unit_factor - step) < step_eps ? step : 0;
+}
+
+/* Convolve_sep for the case when the filter taps are a whole number of voxels
+ * apart, in any dimension. Each line is convolved with the vectorized 
+ * conv_lines kernel. The y and z passes operate directly on the strided 
+ * dimensions, in tiles of SIFT3D_CONV_TILE contiguous values, so that the 
+ * input lines of the filter window stay in cache. The boundaries are sampled
+ * as part of the main loop, with the same rule as convolve_sep_gen, so that 
+ * both give the same results.
+ *
+ * Parameters: 
+ * src - input image (initialized), with the default stride
+ * dst - output image (initialized) 
+ * f - filter to be applied
+ * dim - dimension in which to convolve
+ * step - the number of voxels between successive filter taps, as returned by
+ *      get_conv_step
+ *
+ * The x pass reads src of any element type. The other passes require a
+ * float32 src. If dst is src, or has another element type, the outputs are
+ * buffered, so that dst is written only after the inputs were read. 
+ */
+static int convolve_sep_fast(const Image * const src, Image * const dst,
+                             const Sep_FIR_filter * const f, const int dim,
+                             const int step) {
+
+        Conv_task task;
+        int num;
+
+        // Verify the element type
+        if (dim != 0 && src->type != IM_FLOAT32) {
+                SIFT3D_ERR("convolve_sep_fast: dimension %d requires a "
+                        "float32 input \n", dim);
+                return SIFT3D_FAILURE;
+        }
+
+        // Verify the dimension
+        switch (dim) {
+        case 0:
+        case 1:
+                num = src->nz;
+                break;
+        case 2:
+                num = src->ny;
+                break;
+        default:
+                SIFT3D_ERR("convolve_sep_fast: invalid dimension: %d \n", dim);
+                return SIFT3D_FAILURE;
+        }
+
+	// Resize the output, with the default stride
+        if (im_copy_dims(src, dst))
+                return SIFT3D_FAILURE;
+	im_default_stride(dst);
+	if (im_resize(dst))
+		return SIFT3D_FAILURE;
+
+        // Select the kernel before going parallel
+        init_conv_lines();
+
+        // Convolve each slice, in z for the x and y passes, otherwise in y
+        task.src = src;
+        task.dst = dst;
+        task.f = f;
+        task.dim = dim;
+        task.step = step;
+        task.ret = SIFT3D_SUCCESS;
+        SIFT3D_parallel_for(num, convolve_sep_fast_slice, &task);
+
+        if (task.ret != SIFT3D_SUCCESS)
+                SIFT3D_ERR("convolve_sep_fast: out of memory \n");
+
+        return task.ret;
+}
+
+/* Helper function to convolve slice i of the image, for convolve_sep_fast. 
+ * The slice is in z if task->dim is 0 or 1, otherwise it is in y. */
+static void convolve_sep_fast_slice(void *const arg, const int i) {
+
+        Conv_task *const task = (Conv_task *) arg;
+        const Image *const src = task->src;
+        Image *const dst = task->dst;
+        const Sep_FIR_filter *const f = task->f;
+        const float **rows;
+        float *buf, *out, *blend;
+        float frac;
+        int idx[2];
+        int x, y, z, c, j;
+
+        const int nx = src->nx;
+        const int ny = src->ny;
+        const int nz = src->nz;
+        const int nc = src->nc;
+        const int step = task->step;
+        const int width = f->width;
+        const int half_width = width / 2;
+        const int pad = half_width * step;
+        const int line = nx * nc;
+        const int direct = dst != src && dst->type == IM_FLOAT32;
+
+        buf = out = blend = NULL;
+        if ((rows = (const float **) malloc(width * sizeof(float *))) == NULL)
+                goto conv_fast_quit;
+
+        // Allocate the interpolated boundary lines of the y and z passes
+        if (task->dim != 0 && (blend = (float *) malloc((size_t) width * 
+                SIFT3D_CONV_TILE * sizeof(float))) == NULL)
+                goto conv_fast_quit;
+
+        switch (task->dim) {
+        case 0:
+                // Convert each row to a mirrored buffer, then convolve it.
+                // The row is read before the output is written, so this 
+                // also works in place.
+                z = i;
+                if ((buf = (float *) malloc((nx + 2 * pad) * nc * 
+                        sizeof(float))) == NULL ||
+                        (dst->type != IM_FLOAT32 && (out = (float *) 
+                        malloc(line * sizeof(float))) == NULL))
+                        goto conv_fast_quit;
+
+                for (j = 0; j < width; j++) {
+                        rows[j] = buf + (width - 1 - j) * step * nc;
+                }
+
+                for (y = 0; y < ny; y++) {
+
+                        float *const center = buf + pad * nc;
+
+                        im_load_row(src, SIFT3D_IM_GET_IDX(src, 0, y, z, 0),
+                                line, center);
+
+                        // Pad the start, then the end of the row. The end is
+                        // filled backwards, since the last voxel is replaced
+                        // by its interpolated value
+                        for (x = 0; x < pad; x++) {
+                                conv_boundary_idx(x - pad, nx, idx, &frac);
+                                memcpy(buf + x * nc, center + idx[0] * nc,
+                                        nc * sizeof(float));
+                        }
+                        for (x = nx - 1 + pad; x >= nx - 1; x--) {
+
+                                float *const dst_vox = center + x * nc;
+
+                                if (conv_boundary_idx(x, nx, idx, 
+                                        &frac) == 1) {
+                                        memcpy(dst_vox, center + idx[0] * nc,
+                                                nc * sizeof(float));
+                                        continue;
+                                }
+
+                                for (c = 0; c < nc; c++) {
+                                        dst_vox[c] = (1.0f - frac) * 
+                                                center[idx[0] * nc + c] +
+                                                frac * center[idx[1] * nc + c];
+                                }
+                        }
+
+                        if (out == NULL) {
+                                conv_lines(&SIFT3D_IM_GET_VOX(dst, 0, y, z, 
+                                        0), rows, f->kernel, width, line);
+                        } else {
+                                conv_lines(out, rows, f->kernel, width, line);
+                                im_store_row(dst, SIFT3D_IM_GET_IDX(dst, 0, 
+                                        y, z, 0), line, out);
+                        }
+                }
+                break;
+        case 1:
+                // Buffer the outputs of each tile, unless writing directly
+                z = i;
+                if (!direct && (out = (float *) malloc((size_t) ny * 
+                        SIFT3D_CONV_TILE * sizeof(float))) == NULL)
+                        goto conv_fast_quit;
+
+                for (x = 0; x < line; x += SIFT3D_CONV_TILE) {
+
+                        const int n = SIFT3D_MIN(SIFT3D_CONV_TILE, line - x);
+
+                        for (y = 0; y < ny; y++) {
+                                for (j = 0; j < width; j++) {
+
+                                        const float *lo, *hi;
+                                        float *const line_j = blend + j * n;
+
+                                        const int num_idx = conv_boundary_idx(
+                                                y + (half_width - j) * step,
+                                                ny, idx, &frac);
+
+                                        lo = &SIFT3D_IM_GET_VOX(src, 0, idx[0], z, 0) + x;
+                                        if (num_idx == 1) {
+                                                rows[j] = lo;
+                                                continue;
+                                        }
+
+                                        // Interpolate past the last voxel
+                                        hi = &SIFT3D_IM_GET_VOX(src, 0, idx[1], z, 0) + x;
+                                        for (c = 0; c < n; c++) {
+                                                line_j[c] = (1.0f - frac) * 
+                                                        lo[c] + frac * hi[c];
+                                        }
+                                        rows[j] = line_j;
+                                }
+                                conv_lines(out == NULL ? 
+                                        &SIFT3D_IM_GET_VOX(dst, 0, y, z, 0) + 
+                                        x : out + (size_t) y * n, rows, 
+                                        f->kernel, width, n);
+                        }
+
+                        for (y = 0; out != NULL && y < ny; y++) {
+                                im_store_row(dst, SIFT3D_IM_GET_IDX(dst, 0, 
+                                        y, z, 0) + x, n, out + (size_t) y * n);
+                        }
+                }
+                break;
+        case 2:
+                y = i;
+                if (!direct && (out = (float *) malloc((size_t) nz * 
+                        SIFT3D_CONV_TILE * sizeof(float))) == NULL)
+                        goto conv_fast_quit;
+
+                for (x = 0; x < line; x += SIFT3D_CONV_TILE) {
+
+                        const int n = SIFT3D_MIN(SIFT3D_CONV_TILE, line - x);
+
+                        for (z = 0; z < nz; z++) {
+                                for (j = 0; j < width; j++) {
+
+                                        const float *lo, *hi;
+                                        float *const line_j = blend + j * n;
+
+                                        const int num_idx = conv_boundary_idx(
+                                                z + (half_width - j) * step,
+                                                nz, idx, &frac);
+
+                                        lo = &SIFT3D_IM_GET_VOX(src, 0, y, idx[0], 0) + x;
+                                        if (num_idx == 1) {
+                                                rows[j] = lo;
+                                                continue;
+                                        }
+
+                                        // Interpolate past the last voxel
+                                        hi = &SIFT3D_IM_GET_VOX(src, 0, y, idx[1], 0) + x;
+                                        for (c = 0; c < n; c++) {
+                                                line_j[c] = (1.0f - frac) * 
+                                                        lo[c] + frac * hi[c];
+                                        }
+                                        rows[j] = line_j;
+                                }
+                                conv_lines(out == NULL ? 
+                                        &SIFT3D_IM_GET_VOX(dst, 0, y, z, 0) + 
+                                        x : out + (size_t) z * n, rows, 
+                                        f->kernel, width, n);
+                        }
+
+                        for (z = 0; out != NULL && z < nz; z++) {
+                                im_store_row(dst, SIFT3D_IM_GET_IDX(dst, 0, 
+                                        y, z, 0) + x, n, out + (size_t) z * n);
+                        }
+                }
+                break;
+        default:
+                assert(SIFT3D_FALSE);
+        }
+
+        free((void *) rows);
+        if (buf != NULL)
+                free(buf);
+        if (out != NULL)
+                free(out);
+        if (blend != NULL)
+                free(blend);
+        return;
+
+conv_fast_quit:
+        if (rows != NULL)
+                free((void *) rows);
+        if (buf != NULL)
+                free(buf);
+        if (out != NULL)
+                free(out);
+        if (blend != NULL)
+                free(blend);
+        task->ret = SIFT3D_FAILURE;
+}
+
 /* Permute the dimensions of an image.
  *
  * Arguments: 
@@ -3019,57 +4802,384 @@ int eigen_Mat_rm(Mat_rm * A, Mat_rm * Q, Mat_rm * L)
 	if (resize_Mat_rm(L))
 		return SIFT3D_FAILURE;
 
-	// Initialize intermediate matrices and buffers
-	work = NULL;
-	iwork = NULL;
-	if (init_Mat_rm(&A_trans, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE))
-		goto EIGEN_MAT_RM_QUIT;
+	// Initialize intermediate matrices and buffers
+	work = NULL;
+	iwork = NULL;
+	if (init_Mat_rm(&A_trans, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE))
+		goto EIGEN_MAT_RM_QUIT;
+
+	// Copy the input matrix (A = A')
+	if (copy_Mat_rm(A, &A_trans))
+		goto EIGEN_MAT_RM_QUIT;
+
+	// Query for the workspace sizes
+	dsyevd_(&jobz, &uplo, &n, A_trans.u.data_double, &lda, L->u.data_double,
+		&lwork_ret, &lwork_query, &liwork, &liwork_query, &info);
+
+	if ((int32_t) info) {
+		printf
+		    ("eigen_Mat_rm: LAPACK dsyevd workspace query error code %d",
+		     info);
+		goto EIGEN_MAT_RM_QUIT;
+	}
+	// Allocate work spaces 
+	lwork = (fortran_int) lwork_ret;
+	if ((work = (double *)malloc(lwork * sizeof(double))) == NULL ||
+	    (iwork =
+	     (fortran_int *) malloc(liwork * sizeof(fortran_int))) == NULL)
+		goto EIGEN_MAT_RM_QUIT;
+
+	// Compute the eigendecomposition
+	dsyevd_(&jobz, &uplo, &n, A_trans.u.data_double, &lda, L->u.data_double,
+		work, &lwork, iwork, &liwork, &info);
+
+	if ((int32_t) info) {
+		printf("eigen_Mat_rm: LAPACK dsyevd error code %d", (int) info);
+		goto EIGEN_MAT_RM_QUIT;
+	}
+	// Optionally return the eigenvectors
+	if (Q != NULL && transpose_Mat_rm(&A_trans, Q))
+		goto EIGEN_MAT_RM_QUIT;
+
+	free(work);
+	free(iwork);
+	cleanup_Mat_rm(&A_trans);
+	return SIFT3D_SUCCESS;
+
+ EIGEN_MAT_RM_QUIT:
+	if (work != NULL)
+		free(work);
+	if (iwork != NULL)
+		free(iwork);
+	cleanup_Mat_rm(&A_trans);
+	return SIFT3D_FAILURE;
+}
+
+/* Computes the eigendecomposition of a real symmetric [3x3] matrix, as in
+ * eigen_Mat_rm, but in closed form and without allocating memory. This is 
+ * eigen_sym3_batch for a single matrix.
+ *
+ * Parameters:
+ *   -a: The upper triangle of the matrix, [a00 a01 a02 a11 a12 a22].
+ *   -L: The three eigenvalues, in ascending order.
+ *   -Q: The [3x3] eigenvectors in row-major order, with the eigenvector of 
+ *      L[j] in column j.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE if a is not finite. */
+int eigen_sym3(const double *const a, double *const L, double *const Q) {
+        return eigen_sym3_batch(a, 1, L, Q);
+}
+
+/* Computes the eigendecomposition of num real symmetric [3x3] matrices. The
+ * layout of each matrix is as in eigen_sym3, so that matrix i is stored in
+ * a[6 * i], its eigenvalues in L[3 * i] and its eigenvectors in Q[9 * i].
+ *
+ * The matrices are processed in batches, by loops over the batch which the
+ * compiler may vectorize. The eigenvalues are the trigonometric solution of the
+ * characteristic polynomial. The eigenvectors of the largest and smallest 
+ * eigenvalues are taken as cross products of the rows of A - lambda * I, and
+ * the third is their cross product. This is ill-conditioned when two 
+ * eigenvalues are nearly equal, in which case the matrix is solved by Jacobi
+ * iteration instead.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE if a is not finite. */
+int eigen_sym3_batch(const double *const a, const int num, double *const L,
+        double *const Q) {
+
+        double scale[SIFT3D_EIG3_BATCH], q[SIFT3D_EIG3_BATCH], 
+                p[SIFT3D_EIG3_BATCH], r[SIFT3D_EIG3_BATCH], 
+                lambda[SIFT3D_EIG3_BATCH][IM_NDIMS];
+        int ok[SIFT3D_EIG3_BATCH];
+        int start;
+
+        const double third = 1.0 / 3.0;
+
+        for (start = 0; start < num; start += SIFT3D_EIG3_BATCH) {
+
+                int i;
+
+                const int n = SIFT3D_MIN(num - start, SIFT3D_EIG3_BATCH);
+                const double *const a_batch = a + 6 * start;
+                double *const L_batch = L + IM_NDIMS * start;
+                double *const Q_batch = Q + IM_NDIMS * IM_NDIMS * start;
+
+                // Reduce each matrix to the form B = (A - q * I) / p, scaled 
+                // by its largest entry
+#pragma omp simd
+                for (i = 0; i < n; i++) {
+
+                        double b[6], d[IM_NDIMS], off_sq, det, s;
+                        int k;
+
+                        const double *const ai = a_batch + 6 * i;
+
+                        s = 0.0;
+                        for (k = 0; k < 6; k++) {
+                                s = SIFT3D_MAX(s, fabs(ai[k]));
+                        }
+                        s = s > 0.0 ? s : 1.0;
+                        for (k = 0; k < 6; k++) {
+                                b[k] = ai[k] / s;
+                        }
+
+                        q[i] = (b[0] + b[3] + b[5]) * third;
+                        d[0] = b[0] - q[i];
+                        d[1] = b[3] - q[i];
+                        d[2] = b[5] - q[i];
+                        off_sq = b[1] * b[1] + b[2] * b[2] + b[4] * b[4];
+                        p[i] = sqrt((d[0] * d[0] + d[1] * d[1] + d[2] * d[2] +
+                                2.0 * off_sq) / 6.0);
+                        det = d[0] * (d[1] * d[2] - b[4] * b[4]) -
+                                b[1] * (b[1] * d[2] - b[4] * b[2]) +
+                                b[2] * (b[1] * b[4] - d[1] * b[2]);
+                        r[i] = p[i] > 0.0 ? 
+                                det / (2.0 * p[i] * p[i] * p[i]) : 0.0;
+                        r[i] = SIFT3D_MIN(SIFT3D_MAX(r[i], -1.0), 1.0);
+                        scale[i] = s;
+                }
+
+                // Solve the characteristic polynomial, in ascending order
+                for (i = 0; i < n; i++) {
+
+                        const double phi = acos(r[i]) * third;
+                        const double lambda_max = q[i] + 2.0 * p[i] * cos(phi);
+                        const double lambda_min = q[i] + 2.0 * p[i] * 
+                                cos(phi + 2.0 * M_PI * third);
+                        const double lambda_mid = 3.0 * q[i] - lambda_max - 
+                                lambda_min;
+
+                        lambda[i][0] = lambda_min;
+                        lambda[i][1] = SIFT3D_MIN(SIFT3D_MAX(lambda_mid, 
+                                lambda_min), lambda_max);
+                        lambda[i][2] = lambda_max;
+                }
+
+                // Compute the eigenvectors
+#pragma omp simd
+                for (i = 0; i < n; i++) {
+
+                        double b[6], v_min[IM_NDIMS], v_mid[IM_NDIMS], 
+                                v_max[IM_NDIMS];
+                        double n_min, n_mid, n_max, norm;
+                        int k;
+
+                        const double *const ai = a_batch + 6 * i;
+                        double *const Li = L_batch + IM_NDIMS * i;
+                        double *const Qi = Q_batch + IM_NDIMS * IM_NDIMS * i;
+                        const double inv_scale = 1.0 / scale[i];
+
+                        for (k = 0; k < 6; k++) {
+                                b[k] = ai[k] * inv_scale;
+                        }
+
+                        // Null vectors of the extreme eigenvalues
+                        n_min = eig3_null_vec(b, lambda[i][0], v_min);
+                        n_max = eig3_null_vec(b, lambda[i][2], v_max);
+                        norm = 1.0 / sqrt(n_max + DBL_MIN);
+                        v_max[0] *= norm;
+                        v_max[1] *= norm;
+                        v_max[2] *= norm;
+                        norm = 1.0 / sqrt(n_min + DBL_MIN);
+                        v_min[0] *= norm;
+                        v_min[1] *= norm;
+                        v_min[2] *= norm;
+
+                        // The middle eigenvector completes the basis
+                        v_mid[0] = v_max[1] * v_min[2] - v_max[2] * v_min[1];
+                        v_mid[1] = v_max[2] * v_min[0] - v_max[0] * v_min[2];
+                        v_mid[2] = v_max[0] * v_min[1] - v_max[1] * v_min[0];
+                        n_mid = v_mid[0] * v_mid[0] + v_mid[1] * v_mid[1] + 
+                                v_mid[2] * v_mid[2];
+                        norm = 1.0 / sqrt(n_mid + DBL_MIN);
+                        v_mid[0] *= norm;
+                        v_mid[1] *= norm;
+                        v_mid[2] *= norm;
+
+                        // Make the smallest orthogonal to the others
+                        v_min[0] = v_mid[1] * v_max[2] - v_mid[2] * v_max[1];
+                        v_min[1] = v_mid[2] * v_max[0] - v_mid[0] * v_max[2];
+                        v_min[2] = v_mid[0] * v_max[1] - v_mid[1] * v_max[0];
+
+                        ok[i] = n_min > SIFT3D_EIG3_TOL && 
+                                n_max > SIFT3D_EIG3_TOL && n_mid > 0.5;
+
+                        for (k = 0; k < IM_NDIMS; k++) {
+                                Li[k] = lambda[i][k] * scale[i];
+                                Qi[IM_NDIMS * k] = v_min[k];
+                                Qi[IM_NDIMS * k + 1] = v_mid[k];
+                                Qi[IM_NDIMS * k + 2] = v_max[k];
+                        }
+                }
+
+                // Fall back to Jacobi iteration for the rejected matrices
+                for (i = 0; i < n; i++) {
+
+                        if (ok[i])
+                                continue;
+
+                        if (eig3_jacobi(a_batch + 6 * i, 
+                                L_batch + IM_NDIMS * i, 
+                                Q_batch + IM_NDIMS * IM_NDIMS * i)) {
+                                SIFT3D_ERR("eigen_sym3_batch: matrix %d "
+                                        "is not finite \n", start + i);
+                                return SIFT3D_FAILURE;
+                        }
+                }
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper function for eigen_sym3_batch, computing a null vector of 
+ * B - lambda * I, where B is the upper triangle of a symmetric matrix. This is
+ * the largest cross product of two rows.
+ *
+ * Returns the squared norm of v, which is small if the null space has more
+ * than one dimension. */
+static double eig3_null_vec(const double *const b, const double lambda, 
+        double *const v) {
+
+        double c01[IM_NDIMS], c02[IM_NDIMS], c12[IM_NDIMS];
+        double n01, n02, n12, n;
+        int k;
+
+        const double r0[] = {b[0] - lambda, b[1], b[2]};
+        const double r1[] = {b[1], b[3] - lambda, b[4]};
+        const double r2[] = {b[2], b[4], b[5] - lambda};
+
+#define CROSS(u, w, c) \
+        (c)[0] = (u)[1] * (w)[2] - (u)[2] * (w)[1]; \
+        (c)[1] = (u)[2] * (w)[0] - (u)[0] * (w)[2]; \
+        (c)[2] = (u)[0] * (w)[1] - (u)[1] * (w)[0];
+        CROSS(r0, r1, c01)
+        CROSS(r0, r2, c02)
+        CROSS(r1, r2, c12)
+#undef CROSS
+
+        n01 = c01[0] * c01[0] + c01[1] * c01[1] + c01[2] * c01[2];
+        n02 = c02[0] * c02[0] + c02[1] * c02[1] + c02[2] * c02[2];
+        n12 = c12[0] * c12[0] + c12[1] * c12[1] + c12[2] * c12[2];
+
+        // Select the largest, without branching
+        n = n01;
+        for (k = 0; k < IM_NDIMS; k++) {
+                v[k] = c01[k];
+        }
+        for (k = 0; k < IM_NDIMS; k++) {
+                v[k] = n02 > n ? c02[k] : v[k];
+        }
+        n = SIFT3D_MAX(n, n02);
+        for (k = 0; k < IM_NDIMS; k++) {
+                v[k] = n12 > n ? c12[k] : v[k];
+        }
+        n = SIFT3D_MAX(n, n12);
+
+        return n;
+}
+
+/* Helper function for eigen_sym3_batch, computing the eigendecomposition by
+ * cyclic Jacobi iteration. The arguments are the same as eigen_sym3.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE if a is not finite. */
+static int eig3_jacobi(const double *const a, double *const L, 
+        double *const Q) {
+
+        double B[IM_NDIMS][IM_NDIMS];
+        int i, j, k, sweep;
+
+        // Verify inputs
+        for (k = 0; k < 6; k++) {
+                if (!isfinite(a[k]))
+                        return SIFT3D_FAILURE;
+        }
+
+        // Copy the matrix and initialize the eigenvectors
+        B[0][0] = a[0];
+        B[0][1] = B[1][0] = a[1];
+        B[0][2] = B[2][0] = a[2];
+        B[1][1] = a[3];
+        B[1][2] = B[2][1] = a[4];
+        B[2][2] = a[5];
+        for (i = 0; i < IM_NDIMS; i++) {
+                for (j = 0; j < IM_NDIMS; j++) {
+                        Q[IM_NDIMS * i + j] = i == j ? 1.0 : 0.0;
+                }
+        }
+
+        // Rotate away each off-diagonal element, until they vanish
+        for (sweep = 0; sweep < SIFT3D_EIG3_SWEEPS; sweep++) {
 
-	// Copy the input matrix (A = A')
-	if (copy_Mat_rm(A, &A_trans))
-		goto EIGEN_MAT_RM_QUIT;
+                int pq;
 
-	// Query for the workspace sizes
-	dsyevd_(&jobz, &uplo, &n, A_trans.u.data_double, &lda, L->u.data_double,
-		&lwork_ret, &lwork_query, &liwork, &liwork_query, &info);
+                const double off = B[0][1] * B[0][1] + B[0][2] * B[0][2] + 
+                        B[1][2] * B[1][2];
+                const double diag = B[0][0] * B[0][0] + B[1][1] * B[1][1] + 
+                        B[2][2] * B[2][2];
 
-	if ((int32_t) info) {
-		printf
-		    ("eigen_Mat_rm: LAPACK dsyevd workspace query error code %d",
-		     info);
-		goto EIGEN_MAT_RM_QUIT;
-	}
-	// Allocate work spaces 
-	lwork = (fortran_int) lwork_ret;
-	if ((work = (double *)malloc(lwork * sizeof(double))) == NULL ||
-	    (iwork =
-	     (fortran_int *) malloc(liwork * sizeof(fortran_int))) == NULL)
-		goto EIGEN_MAT_RM_QUIT;
+                if (off <= DBL_EPSILON * DBL_EPSILON * diag)
+                        break;
 
-	// Compute the eigendecomposition
-	dsyevd_(&jobz, &uplo, &n, A_trans.u.data_double, &lda, L->u.data_double,
-		work, &lwork, iwork, &liwork, &info);
+                for (pq = 0; pq < IM_NDIMS; pq++) {
 
-	if ((int32_t) info) {
-		printf("eigen_Mat_rm: LAPACK dsyevd error code %d", (int) info);
-		goto EIGEN_MAT_RM_QUIT;
-	}
-	// Optionally return the eigenvectors
-	if (Q != NULL && transpose_Mat_rm(&A_trans, Q))
-		goto EIGEN_MAT_RM_QUIT;
+                        double theta, t, c, s;
 
-	free(work);
-	free(iwork);
-	cleanup_Mat_rm(&A_trans);
-	return SIFT3D_SUCCESS;
+                        const int p = pq == 2 ? 1 : 0;
+                        const int q = pq == 0 ? 1 : 2;
 
- EIGEN_MAT_RM_QUIT:
-	if (work != NULL)
-		free(work);
-	if (iwork != NULL)
-		free(iwork);
-	cleanup_Mat_rm(&A_trans);
-	return SIFT3D_FAILURE;
+                        if (B[p][q] == 0.0)
+                                continue;
+
+                        theta = (B[q][q] - B[p][p]) / (2.0 * B[p][q]);
+                        t = (theta >= 0.0 ? 1.0 : -1.0) / 
+                                (fabs(theta) + sqrt(theta * theta + 1.0));
+                        c = 1.0 / sqrt(t * t + 1.0);
+                        s = t * c;
+
+                        // B = J' * B * J, Q = Q * J
+                        for (k = 0; k < IM_NDIMS; k++) {
+                                const double bkp = B[k][p], bkq = B[k][q];
+                                B[k][p] = c * bkp - s * bkq;
+                                B[k][q] = s * bkp + c * bkq;
+                        }
+                        for (k = 0; k < IM_NDIMS; k++) {
+                                const double bpk = B[p][k], bqk = B[q][k];
+                                B[p][k] = c * bpk - s * bqk;
+                                B[q][k] = s * bpk + c * bqk;
+                        }
+                        for (k = 0; k < IM_NDIMS; k++) {
+                                double *const row = Q + IM_NDIMS * k;
+                                const double qkp = row[p], qkq = row[q];
+                                row[p] = c * qkp - s * qkq;
+                                row[q] = s * qkp + c * qkq;
+                        }
+                }
+        }
+
+        // Sort the eigenvalues in ascending order
+        for (i = 0; i < IM_NDIMS; i++) {
+                L[i] = B[i][i];
+        }
+        for (i = 0; i < IM_NDIMS - 1; i++) {
+                for (j = 0; j < IM_NDIMS - 1 - i; j++) {
+
+                        double tmp;
+
+                        if (L[j] <= L[j + 1])
+                                continue;
+
+                        tmp = L[j];
+                        L[j] = L[j + 1];
+                        L[j + 1] = tmp;
+                        for (k = 0; k < IM_NDIMS; k++) {
+                                double *const row = Q + IM_NDIMS * k;
+                                tmp = row[j];
+                                row[j] = row[j + 1];
+                                row[j + 1] = tmp;
+                        }
+                }
+        }
+
+        return SIFT3D_SUCCESS;
 }
 
 /* Solves the system AX=B exactly. A must be a square matrix.
@@ -3457,9 +5567,32 @@ int det_symm_Mat_rm(Mat_rm * mat, void *det)
 int apply_Sep_FIR_filter(const Image * const src, Image * const dst,
 			 Sep_FIR_filter * const f, const double unit)
 {
-
 	Image temp;
+        int ret;
+
+	init_im(&temp);
+        ret = apply_Sep_FIR_filter_temp(src, dst, f, unit, &temp);
+	im_free(&temp);
+
+        return ret;
+}
+
+/* The same as apply_Sep_FIR_filter, but uses temp, an initialized image, for
+ * temporary storage. temp is resized as needed, and can be reused across 
+ * calls to avoid allocating memory. 
+ *
+ * src and dst may have any element types, while the filter is computed in 
+ * float32. If the taps fall on whole voxels in every dimension, the first
+ * pass converts src as it reads, the second is in place in temp, and the 
+ * last converts to dst as it writes. Otherwise, src and dst are converted 
+ * through float32 copies, unless they already have that type. */
+int apply_Sep_FIR_filter_temp(const Image * const src, Image * const dst,
+			 Sep_FIR_filter * const f, const double unit,
+                         Image * const temp)
+{
+
 	Image *cur_src, *cur_dst;
+        int steps[IM_NDIMS];
 	int i;
 
         const double unit_default = -1.0;
@@ -3471,27 +5604,34 @@ int apply_Sep_FIR_filter(const Image * const src, Image * const dst,
                 return SIFT3D_FAILURE;
         }
 
+        // Filter directly if no resampling is needed
+        if (get_conv_steps(src, unit, steps))
+                return apply_Sep_FIR_filter_fast(src, dst, f, steps, temp);
+
+        // Convert other element types to float32
+        if (src->type != IM_FLOAT32 || dst->type != IM_FLOAT32)
+                return apply_Sep_FIR_filter_typed(src, dst, f, unit, temp);
+
         // Resize the output
         if (im_copy_dims(src, dst))
                 return SIFT3D_FAILURE; 
 
-	// Allocate temporary storage
-	init_im(&temp);
-	if (im_copy_data(src, &temp))
-		goto apply_sep_f_quit;
+	// Resize the temporary storage
+	if (im_copy_dims(src, temp))
+		return SIFT3D_FAILURE;
 
 #define SWAP_BUFFERS \
-    if (cur_dst == &temp) { \
-    cur_src = &temp; \
+    if (cur_dst == temp) { \
+    cur_src = temp; \
     cur_dst = dst; \
     } else { \
     cur_src = dst; \
-    cur_dst = &temp; \
+    cur_dst = temp; \
     }
 
 	// Apply in n dimensions
 	cur_src = (Image *) src;
-	cur_dst = &temp;
+	cur_dst = temp;
 	for (i = 0; i < IM_NDIMS; i++) {
 
                 // Check for default parameters
@@ -3502,10 +5642,19 @@ int apply_Sep_FIR_filter(const Image * const src, Image * const dst,
                 convolve_sep(cur_src, cur_dst, f, i, unit_arg);
 		SWAP_BUFFERS
 #else
+                // Convolve directly if no resampling is needed
+                const int step = get_conv_step(cur_src, i, unit_arg);
+                if (step > 0) {
+                        if (convolve_sep_fast(cur_src, cur_dst, f, i, step))
+                                return SIFT3D_FAILURE;
+                        SWAP_BUFFERS
+                        continue;
+                }
+
                 // Transpose so that the filter dimension is x
                 if (i != 0) {
                         if (im_permute(cur_src, 0, i, cur_dst))
-				goto apply_sep_f_quit;
+				return SIFT3D_FAILURE;
                         SWAP_BUFFERS
                 }
 
@@ -3516,7 +5665,7 @@ int apply_Sep_FIR_filter(const Image * const src, Image * const dst,
                 // Transpose back
                 if (i != 0) {
 			if (im_permute(cur_src, 0, i, cur_dst))
-				goto apply_sep_f_quit;
+				return SIFT3D_FAILURE;
                         SWAP_BUFFERS
 
 		}
@@ -3530,15 +5679,80 @@ int apply_Sep_FIR_filter(const Image * const src, Image * const dst,
 
 	// Copy result to dst, if necessary
 	if (cur_dst != dst && im_copy_data(cur_dst, dst))
-		goto apply_sep_f_quit;
+		return SIFT3D_FAILURE;
 
-	// Clean up
-	im_free(&temp);
 	return SIFT3D_SUCCESS;
+}
 
-apply_sep_f_quit:
-	im_free(&temp);
-	return SIFT3D_FAILURE;
+/* Helper function to get the steps between taps of a filter in each 
+ * dimension of src, as in get_conv_step, for apply_Sep_FIR_filter_temp. 
+ * Returns SIFT3D_TRUE if every pass can be applied by convolve_sep_fast, 
+ * SIFT3D_FALSE otherwise. */
+static int get_conv_steps(const Image *const src, const double unit, 
+                          int *const steps) {
+
+#ifdef SIFT3D_USE_OPENCL
+        return SIFT3D_FALSE;
+#else
+        int i;
+
+        for (i = 0; i < IM_NDIMS; i++) {
+
+                const double unit_arg = unit < 0.0 ? 
+                        SIFT3D_IM_GET_UNITS(src)[i] : unit;
+
+                if ((steps[i] = get_conv_step(src, i, unit_arg)) < 1)
+                        return SIFT3D_FALSE;
+        }
+
+        return SIFT3D_TRUE;
+#endif
+}
+
+/* Helper function for apply_Sep_FIR_filter_temp, when the taps fall on whole
+ * voxels in every dimension. The passes read from src, then work in place in
+ * temp, which is converted to float32, and finally write to dst. */
+static int apply_Sep_FIR_filter_fast(const Image *const src, 
+        Image *const dst, const Sep_FIR_filter *const f, 
+        const int *const steps, Image *const temp) {
+
+        assert(src != temp && dst != temp);
+
+        if (im_set_type(temp, IM_FLOAT32) ||
+                convolve_sep_fast(src, temp, f, 0, steps[0]) ||
+                convolve_sep_fast(temp, temp, f, 1, steps[1]) ||
+                convolve_sep_fast(temp, dst, f, 2, steps[2]))
+                return SIFT3D_FAILURE;
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper function for apply_Sep_FIR_filter_temp, when the filter requires 
+ * resampling and src or dst is not of type IM_FLOAT32. The images are 
+ * converted through float32 copies. */
+static int apply_Sep_FIR_filter_typed(const Image *const src, 
+        Image *const dst, Sep_FIR_filter *const f, const double unit, 
+        Image *const temp) {
+
+        Image src_float, dst_float;
+        int ret;
+
+        const int convert_src = src->type != IM_FLOAT32;
+        const int convert_dst = dst->type != IM_FLOAT32;
+
+        init_im(&src_float);
+        init_im(&dst_float);
+
+        ret = (convert_src && im_copy_data(src, &src_float)) ||
+                apply_Sep_FIR_filter_temp(convert_src ? &src_float : src, 
+                        convert_dst ? &dst_float : dst, f, unit, temp) ||
+                (convert_dst && im_copy_data(&dst_float, dst)) ?
+                SIFT3D_FAILURE : SIFT3D_SUCCESS;
+
+        im_free(&src_float);
+        im_free(&dst_float);
+
+        return ret;
 }
 
 /* Initialize a separable FIR filter struct with the given parameters. If OpenCL
@@ -3639,6 +5853,8 @@ void init_im(Image *const im)
 	im->uz = 1;
 
 	im->size = 0;
+	im->capacity = 0;
+        im->type = IM_FLOAT32;
 	im->s = -1.0;
 	memset(SIFT3D_IM_GET_DIMS(im), 0, IM_NDIMS * sizeof(int));
 	memset(SIFT3D_IM_GET_STRIDES(im), 0, IM_NDIMS * sizeof(size_t));
@@ -3743,6 +5959,7 @@ void init_GSS_filters(GSS_filters * const gss)
 {
 	gss->num_filters = -1;
 	gss->gauss_octave = NULL;
+        gss->num_kp_levels = -1;
 }
 
 /* Create GSS filters to create the given scale-space 
@@ -3766,6 +5983,15 @@ int make_gss(GSS_filters * const gss, const Pyramid * const pyr)
 		return SIFT3D_FAILURE;
 	}
 
+        // Do nothing if the filters were already made for these parameters.
+        // They do not depend on the image dimensions.
+        if (gss->num_filters == num_filters && 
+                gss->first_level == first_level &&
+                gss->sigma0 == pyr->sigma0 && gss->sigma_n == pyr->sigma_n &&
+                gss->num_kp_levels == pyr->num_kp_levels && 
+                gss->first_octave == pyr->first_octave)
+                return SIFT3D_SUCCESS;
+
 	// Free all previous data, if any
 	cleanup_GSS_filters(gss);
 	init_GSS_filters(gss);
@@ -3796,6 +6022,12 @@ int make_gss(GSS_filters * const gss, const Pyramid * const pyr)
 			return SIFT3D_FAILURE;
 	}
 
+        // Save the parameters, to reuse the filters
+        gss->sigma0 = pyr->sigma0;
+        gss->sigma_n = pyr->sigma_n;
+        gss->num_kp_levels = pyr->num_kp_levels;
+        gss->first_octave = pyr->first_octave;
+
 	return SIFT3D_SUCCESS;
 }
 
@@ -3835,9 +6067,11 @@ void init_Pyramid(Pyramid * const pyr)
 	pyr->first_octave = 0;
 	pyr->num_octaves = 0;
         pyr->sigma0 = pyr->sigma_n = 0.0;
+        pyr->type = IM_FLOAT32;
 }
 
 /* Resize a scale-space pyramid according to the size of base image im.
+ * The levels are converted to the element type pyr->type.
  *
  * Parameters:
  *  -im: An image with the desired dimensions and units at octave 0
@@ -3927,7 +6161,7 @@ int resize_Pyramid(const Image *const im, const int first_level,
 	                im_default_stride(level);
 
                         // Re-size data memory
-                        if (im_resize(level))
+                        if (im_set_type(level, pyr->type) || im_resize(level))
                                 return SIFT3D_FAILURE;
 
 	        SIFT3D_PYR_LOOP_SCALE_END
@@ -4000,9 +6234,10 @@ int copy_Pyramid(const Pyramid * const src, Pyramid * const dst)
         // Initialize intermediates
         init_im(&dummy);
 
-        // Set the scale parameters
+        // Set the scale parameters and element type
         if (set_scales_Pyramid(src->sigma0, src->sigma_n, dst))
                 return SIFT3D_FAILURE;
+        dst->type = src->type;
 
         // Get the base image
 	if (src->levels == NULL || src->num_octaves <= 0 ||
@@ -4236,7 +6471,9 @@ int init_Tps(Tps * tps, int dim, int terms)
 void init_Ransac(Ransac *const ran)
 {
 	ran->err_thresh = SIFT3D_err_thresh_default;
+	ran->confidence = SIFT3D_confidence_default;
 	ran->num_iter = SIFT3D_num_iter_default;
+	ran->prosac = SIFT3D_FALSE;
 }
 
 /* Set the err_thresh parameter in a Ransac struct, checking for validity. */
@@ -4268,59 +6505,162 @@ int set_num_iter_Ransac(Ransac *const ran, int num_iter)
         return SIFT3D_SUCCESS;
 }
 
+/* Set the confidence parameter in a Ransac struct. RANSAC stops early once
+ * the probability of having drawn at least one sample free of outliers 
+ * reaches this value, judging by the best model found so far. A value of
+ * zero disables early termination, always running num_iter iterations. */
+int set_confidence_Ransac(Ransac *const ran, double confidence)
+{
+        if (confidence < 0.0 || confidence >= 1.0) {
+                SIFT3D_ERR("set_confidence_Ransac: invalid confidence, "
+                        "must be in the interval [0, 1): %f \n", confidence);
+                return SIFT3D_FAILURE;
+        }
+
+        ran->confidence = confidence;
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Set the prosac parameter in a Ransac struct. If true, find_tform_ransac 
+ * assumes the points are sorted by decreasing match quality, and samples
+ * the best points first, as in PROSAC. */
+int set_prosac_Ransac(Ransac *const ran, const int prosac)
+{
+        ran->prosac = prosac ? SIFT3D_TRUE : SIFT3D_FALSE;
+
+        return SIFT3D_SUCCESS;
+}
+
 /* Copy a Ransac struct from src to dst. */
 int copy_Ransac(const Ransac *const src, Ransac *const dst) {
         return set_num_iter_Ransac(dst, src->num_iter) ||
-                set_err_thresh_Ransac(dst, src->err_thresh);
+                set_err_thresh_Ransac(dst, src->err_thresh) ||
+                set_confidence_Ransac(dst, src->confidence) ||
+                set_prosac_Ransac(dst, src->prosac);
 }
 
-/* Returns an array of k integers, (uniformly) randomly chosen from the 
- * integers 0 through n - 1.
- *
- * The value of *ret must either be NULL, or a pointer to a previously
- * allocated block. On successful return, *ret contains the k random integers.
- *
- * Returns SIFT3D_SUCCESS on succes, SIFT3D_FAILURE otherwise. */
-static int n_choose_k(const int n, const int k, int **ret) {
+/* Returns a pseudo-random number, advancing the state. This is the 
+ * splitmix64 generator, which is reentrant, so each RANSAC iteration can 
+ * draw its own reproducible sequence from a seed. */
+static uint64_t ransac_rand(uint64_t *const state) {
 
-        int i;
+        uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
 
-        // Verify inputs
-        if (n < k || k < 1)
-                goto n_choose_k_fail;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        return z ^ (z >> 31);
+}
 
-        // Allocate the array of n elements
-        if ((*ret = malloc(n * sizeof(int))) == NULL)
-                goto n_choose_k_fail;
+/* Compute the PROSAC growth schedule. Element n of the returned array is the
+ * iteration at which sampling starts to use the first n + 1 points, for n in
+ * [num_rand - 1, num_pts - 1]. The schedule reaches all of the points after 
+ * roughly num_iter iterations, following Chum and Matas, "Matching with 
+ * PROSAC," CVPR 2005.
+ *
+ * Returns an array of num_pts elements, to be freed by the caller, or NULL
+ * on failure. */
+static double *make_prosac_schedule(const int num_pts, const int num_rand,
+        const int num_iter) {
+
+        double *sched;
+        double t_n;
+        int i, n;
+
+        if ((sched = malloc(num_pts * sizeof(double))) == NULL)
+                return NULL;
+
+        // Expected number of samples from the first num_rand points
+        t_n = (double) num_iter;
+        for (i = 0; i < num_rand; i++) {
+                t_n *= (double) (num_rand - i) / (num_pts - i);
+        }
 
-        // Initialize the array of indices
-        for (i = 0; i < n; i++) {
-                (*ret)[i] = i;
+        // Grow the subset, one point at a time
+        for (n = 0; n < num_rand; n++) {
+                sched[n] = 0.0;
         }
+        for (n = num_rand; n < num_pts; n++) {
 
-        // Randomize the first k indices using Knuth shuffles
-        for (i = 0; i < k; i++) {
+                const double t_next = t_n * n / (n - num_rand + 1);
 
-                int *const ints = *ret;
-                const int temp = ints[i]; 
-                const int rand_idx = i + rand() % (n - i);
+                sched[n] = sched[n - 1] + ceil(t_next - t_n);
+                t_n = t_next;
+        }
+
+        return sched;
+}
+
+/* Draw num_rand distinct indices from the integers 0 through num_pts - 1. 
+ * If prosac_sched is NULL, the indices are drawn uniformly. Otherwise, they 
+ * are drawn from the leading points according to iteration iter of the 
+ * schedule computed by make_prosac_schedule, always including the newest 
+ * point of the subset. */
+static void draw_sample(const double *const prosac_sched, const int num_pts,
+        const int num_rand, const int iter, uint64_t *const state, 
+        int *const sample) {
+
+        int i, num_drawn, num_subset;
+
+        // Find the subset of points available to this iteration
+        num_drawn = 0;
+        num_subset = num_pts;
+        if (prosac_sched != NULL) {
+
+                int lo = num_rand - 1;
+                int hi = num_pts - 1;
+
+                // Binary search for the last n with prosac_sched[n] <= iter
+                while (lo < hi) {
+                        const int mid = (lo + hi + 1) / 2;
+                        if (prosac_sched[mid] <= (double) iter)
+                                lo = mid;
+                        else
+                                hi = mid - 1;
+                }
+                num_subset = lo + 1;
 
-                ints[i] = ints[rand_idx];
-                ints[rand_idx] = temp;
+                // Always use the newest point, until all are available
+                if (num_subset < num_pts)
+                        sample[num_drawn++] = --num_subset;
         }
 
-        // Release unused memory
-        if ((*ret = SIFT3D_safe_realloc(*ret, k * sizeof(int))) == NULL)
-                goto n_choose_k_fail;
+        // Draw the rest of the points by rejection, as num_rand is small
+        while (num_drawn < num_rand) {
 
-        return SIFT3D_SUCCESS;
+                const int idx = (int) (ransac_rand(state) % 
+                        (uint64_t) num_subset);
 
-n_choose_k_fail:
-        if (*ret != NULL) {
-                free(*ret);
-                *ret = NULL;
+                for (i = 0; i < num_drawn; i++) {
+                        if (sample[i] == idx)
+                                break;
+                }
+                if (i == num_drawn)
+                        sample[num_drawn++] = idx;
         }
-        return SIFT3D_FAILURE;
+}
+
+/* Returns the number of RANSAC iterations needed to draw at least one sample
+ * of num_rand inliers with the given confidence, where the best model so far
+ * has len inliers out of num_pts. The result is at most num_iter. If 
+ * confidence is zero, returns num_iter. */
+static int ransac_iter_limit(const double confidence, const int num_pts,
+        const int num_rand, const int len, const int num_iter) {
+
+        double p_good, k;
+
+        if (confidence <= 0.0 || len <= 0)
+                return num_iter;
+
+        // Probability that a sample consists only of inliers
+        p_good = pow((double) len / num_pts, num_rand);
+        if (p_good >= 1.0)
+                return 1;
+        if (p_good <= 0.0)
+                return num_iter;
+
+        k = ceil(log(1.0 - confidence) / log(1.0 - p_good));
+        return k < (double) num_iter ? SIFT3D_MAX((int) k, 1) : num_iter;
 }
 
 //make the system matrix for spline
@@ -4569,37 +6909,128 @@ static int solve_system(const Mat_rm *const src, const Mat_rm *const ref,
 	return SIFT3D_FAILURE;
 }
 
-//Find the SSD error for the i'th point
-static double tform_err_sq(const void *const tform, const Mat_rm *const src, 
-        const Mat_rm *const ref, const int i)
+/* Compute the squared error of each point under a transformation. 
+ *
+ * Parameters:
+ *   tform - The transformation, mapping ref to src.
+ *   src - The [mx3] source points.
+ *   ref - The [mx3] reference points.
+ *   err_sq - An array of m elements receiving the squared errors. */
+static void tform_err_sq(const void *const tform, const Mat_rm *const src, 
+        const Mat_rm *const ref, double *const err_sq)
 {
+        int i;
+
+        const int num_pts = src->num_rows;
+        const double *const s = src->u.data_double;
+        const double *const r = ref->u.data_double;
+
+        // Apply other transformations one point at a time
+        if (tform_get_type(tform) != AFFINE) {
+                for (i = 0; i < num_pts; i++) {
+
+                        double x_out, y_out, z_out;
+
+                        apply_tform_xyz(tform, r[3 * i], r[3 * i + 1], 
+                                r[3 * i + 2], &x_out, &y_out, &z_out);
+                        err_sq[i] = 
+                                (s[3 * i] - x_out) * (s[3 * i] - x_out) +
+                                (s[3 * i + 1] - y_out) * 
+                                        (s[3 * i + 1] - y_out) +
+                                (s[3 * i + 2] - z_out) * 
+                                        (s[3 * i + 2] - z_out);
+                }
+                return;
+        }
+
+        // For affine transformations, hoist the matrix out of the point loop
+        // so it vectorizes
+        {
+                const Mat_rm *const A = &((const Affine *) tform)->A;
+                const double a00 = SIFT3D_MAT_RM_GET(A, 0, 0, double);
+                const double a01 = SIFT3D_MAT_RM_GET(A, 0, 1, double);
+                const double a02 = SIFT3D_MAT_RM_GET(A, 0, 2, double);
+                const double a03 = SIFT3D_MAT_RM_GET(A, 0, 3, double);
+                const double a10 = SIFT3D_MAT_RM_GET(A, 1, 0, double);
+                const double a11 = SIFT3D_MAT_RM_GET(A, 1, 1, double);
+                const double a12 = SIFT3D_MAT_RM_GET(A, 1, 2, double);
+                const double a13 = SIFT3D_MAT_RM_GET(A, 1, 3, double);
+                const double a20 = SIFT3D_MAT_RM_GET(A, 2, 0, double);
+                const double a21 = SIFT3D_MAT_RM_GET(A, 2, 1, double);
+                const double a22 = SIFT3D_MAT_RM_GET(A, 2, 2, double);
+                const double a23 = SIFT3D_MAT_RM_GET(A, 2, 3, double);
+
+                assert(AFFINE_GET_DIM((const Affine *) tform) == 3);
+
+#pragma omp simd
+                for (i = 0; i < num_pts; i++) {
+
+                        const double x = r[3 * i];
+                        const double y = r[3 * i + 1];
+                        const double z = r[3 * i + 2];
+                        const double dx = s[3 * i] - 
+                                (a00 * x + a01 * y + a02 * z + a03);
+                        const double dy = s[3 * i + 1] - 
+                                (a10 * x + a11 * y + a12 * z + a13);
+                        const double dz = s[3 * i + 2] - 
+                                (a20 * x + a21 * y + a22 * z + a23);
+
+                        err_sq[i] = dx * dx + dy * dy + dz * dz;
+                }
+        }
+}
 
-	double err = 0.0;
-	//Initialization
-	//in -- inputs coordinates of source points
-	//out -- registered points
-	//r -- reference points (ground truth)
-	double x_in, y_in, z_in, x_r, y_r, z_r, x_out, y_out, z_out;
+/* Initialize the per-thread intermediates of RANSAC, for the type of tform.
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int init_Ransac_scratch(Ransac_scratch *const scratch, 
+        const void *const tform, const int num_pts, const int num_rand) {
+
+        const tform_type type = tform_get_type(tform);
+
+        scratch->tform = NULL;
+        scratch->err_sq = NULL;
+        scratch->cset = scratch->sample = NULL;
+        if (init_Mat_rm(&scratch->src_rand, num_rand, IM_NDIMS, 
+                        SIFT3D_DOUBLE, SIFT3D_FALSE) ||
+                init_Mat_rm(&scratch->ref_rand, num_rand, IM_NDIMS, 
+                        SIFT3D_DOUBLE, SIFT3D_FALSE))
+                return SIFT3D_FAILURE;
+
+        if ((scratch->tform = malloc(tform_get_size(tform))) == NULL)
+                goto init_Ransac_scratch_quit;
+        if (init_tform(scratch->tform, type)) {
+                free(scratch->tform);
+                scratch->tform = NULL;
+                goto init_Ransac_scratch_quit;
+        }
 
-	//Find the source point
-	x_in = SIFT3D_MAT_RM_GET(ref, i, 0, double);
-	y_in = SIFT3D_MAT_RM_GET(ref, i, 1, double);
-	z_in = SIFT3D_MAT_RM_GET(ref, i, 2, double);
+        if ((scratch->err_sq = malloc(num_pts * sizeof(double))) == NULL ||
+                (scratch->cset = malloc(num_pts * sizeof(int))) == NULL ||
+                (scratch->sample = malloc(num_rand * sizeof(int))) == NULL)
+                goto init_Ransac_scratch_quit;
 
-	//Register
-	apply_tform_xyz(tform, x_in, y_in, z_in, &x_out, &y_out, &z_out);
+        return SIFT3D_SUCCESS;
 
-	//Find the reference point
-	x_r = SIFT3D_MAT_RM_GET(src, i, 0, double);
-	y_r = SIFT3D_MAT_RM_GET(src, i, 1, double);
-	z_r = SIFT3D_MAT_RM_GET(src, i, 2, double);
+init_Ransac_scratch_quit:
+        cleanup_Ransac_scratch(scratch);
+        return SIFT3D_FAILURE;
+}
 
-	//Find the SSD error
-	err = (x_r - x_out) * (x_r - x_out) + (y_r - y_out) * (y_r - y_out) +
-	    (z_r - z_out) * (z_r - z_out);
+/* Release the memory of a Ransac_scratch struct. */
+static void cleanup_Ransac_scratch(Ransac_scratch *const scratch) {
 
-	//return the result 
-	return err;
+        cleanup_Mat_rm(&scratch->src_rand);
+        cleanup_Mat_rm(&scratch->ref_rand);
+        if (scratch->tform != NULL) {
+                cleanup_tform(scratch->tform);
+                free(scratch->tform);
+        }
+        if (scratch->err_sq != NULL)
+                free(scratch->err_sq);
+        if (scratch->cset != NULL)
+                free(scratch->cset);
+        if (scratch->sample != NULL)
+                free(scratch->sample);
 }
 
 /* Perform one iteration of RANSAC. 
@@ -4607,118 +7038,84 @@ static double tform_err_sq(const void *const tform, const Mat_rm *const src,
  * Parameters:
  *  src - The source points.
  *  ref - The reference points.
- *  tform - The output transformation. Must be initialized.
- *  cset - An array in which to store the concensus set. The value *cset must
- *         either be NULL, or a pointer to a previously allocated block.
+ *  ran - The RANSAC parameters.
+ *  prosac_sched - The schedule from make_prosac_schedule, or NULL for 
+ *         uniform sampling.
+ *  iter - The index of this iteration. Together with seed, this determines
+ *         the sample, regardless of which thread runs it.
+ *  seed - The seed shared by all iterations.
+ *  scratch - Intermediates for this thread. On successful return, 
+ *         scratch->tform is the transformation and scratch->cset is the 
+ *         consensus set.
  *  len - A location in which to store the length of the cset. 
  *
- * Returns SIFT3D_SUCCESS on success, SIFT3D_SINGULAR if the system is 
- * near singular, and SIFT3D_FAILURE otherwise. */
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_SINGULAR if every sample drawn 
+ * was near singular, and SIFT3D_FAILURE otherwise. */
 static int ransac(const Mat_rm *const src, const Mat_rm *const ref, 
-        const Ransac *const ran, void *tform, int **const cset, int *const len)
+        const Ransac *const ran, const double *const prosac_sched, 
+        const int iter, const uint64_t seed, Ransac_scratch *const scratch, 
+        int *const len)
 {
-        int *rand_indices;
-	Mat_rm src_rand, ref_rand;
-	int i, j, num_rand, cset_len;
+        uint64_t state;
+	int i, j, attempt, cset_len;
 
 	const double err_thresh = ran->err_thresh;
 	const double err_thresh_sq = err_thresh * err_thresh;
 	const int num_pts = src->num_rows;
-        const int num_dim = src->num_cols;
-	const tform_type type = tform_get_type(tform);
+        const int num_rand = scratch->src_rand.num_rows;
+        Mat_rm *const src_rand = &scratch->src_rand;
+        Mat_rm *const ref_rand = &scratch->ref_rand;
+        void *const tform = scratch->tform;
 
-	// Verify inputs
-	if (src->type != SIFT3D_DOUBLE || src->type != ref->type) {
-		puts("ransac: all matrices must have type double \n");
-		return SIFT3D_FAILURE;
-	}
-	if (src->num_rows != ref->num_rows || src->num_cols != ref->num_cols) {
-		puts("ransac: src and ref must have the same dimensions \n");
-		return SIFT3D_FAILURE;
-	}
+        // Seed the generator for this iteration
+        state = seed ^ ((uint64_t) iter * 0xd1b54a32d192ed03ULL);
 
-        // Get the number of points for this transform
-	switch (type) {
-	case AFFINE:
-		num_rand = AFFINE_GET_DIM((Affine *const) tform) + 1;
-		break;
-	default:
-		printf("ransac: unknown transformation type \n");
-                return SIFT3D_FAILURE;
-	}
+        // Draw samples until one is not singular
+        for (attempt = 0; attempt < RANSAC_MAX_SINGULAR; attempt++) {
 
-	// Initialize intermediates
-        rand_indices = NULL;
-	init_Mat_rm(&src_rand, num_rand, num_dim, SIFT3D_DOUBLE, SIFT3D_FALSE);
-	init_Mat_rm(&ref_rand, num_rand, num_dim, SIFT3D_DOUBLE, SIFT3D_FALSE);
+                // Draw random point indices
+                draw_sample(prosac_sched, num_pts, num_rand, iter, &state,
+                        scratch->sample);
 
-        // Draw random point indices
-        if (n_choose_k(num_pts, num_rand, &rand_indices))
-                goto RANSAC_FAIL;
+                // Copy the random points
+                SIFT3D_MAT_RM_LOOP_START(src_rand, i, j)
 
-        // Copy the random points
-	SIFT3D_MAT_RM_LOOP_START(&src_rand, i, j)
+                        const int rand_idx = scratch->sample[i];
 
-                const int rand_idx = rand_indices[i];
+                        SIFT3D_MAT_RM_GET(src_rand, i, j, double) =
+                                SIFT3D_MAT_RM_GET(src, rand_idx, j, double);
+                        SIFT3D_MAT_RM_GET(ref_rand, i, j, double) =
+                                SIFT3D_MAT_RM_GET(ref, rand_idx, j, double);
 
-                SIFT3D_MAT_RM_GET(&src_rand, i, j, double) =
-                        SIFT3D_MAT_RM_GET(src, rand_idx, j, double);
-                SIFT3D_MAT_RM_GET(&ref_rand, i, j, double) =
-                        SIFT3D_MAT_RM_GET(ref, rand_idx, j, double);
+                SIFT3D_MAT_RM_LOOP_END
 
-        SIFT3D_MAT_RM_LOOP_END
+                // Fit a transform to the random points
+                switch (solve_system(src_rand, ref_rand, tform)) {
+                case SIFT3D_SUCCESS:
+                        goto ransac_solved;
+                case SIFT3D_SINGULAR:
+                        continue;
+                default:
+                        return SIFT3D_FAILURE;
+                }
+        }
+        return SIFT3D_SINGULAR;
 
-        // Fit a transform to the random points
-	switch (solve_system(&src_rand, &ref_rand, tform)) {
-	case SIFT3D_SUCCESS:
-		break;
-	case SIFT3D_SINGULAR:
-		goto RANSAC_SINGULAR;
-	default:
-		goto RANSAC_FAIL;
-	}
+ransac_solved:
+	// Compute the errors of all points
+        tform_err_sq(tform, src, ref, scratch->err_sq);
 
 	// Extract the consensus set
 	cset_len = 0;
 	for (i = 0; i < num_pts; i++) {
-
-		// Calculate the error
-		const double err_sq = tform_err_sq(tform, src, ref, i);
-
-		// Reject points below the error threshold
-		if (err_sq > err_thresh_sq)
-			continue;
-
-		// Add to the consensus set (++cset_len cannot be zero)
-		if ((*cset = SIFT3D_safe_realloc(*cset, 
-			++cset_len * sizeof(int))) == NULL)
-			goto RANSAC_FAIL;
-
-		(*cset)[cset_len - 1] = i;
+		if (scratch->err_sq[i] <= err_thresh_sq)
+		        scratch->cset[cset_len++] = i;
 	}
 
 	// Return the new length of cset
 	*len = cset_len;
 
-        if (rand_indices != NULL)
-                free(rand_indices);
-	cleanup_Mat_rm(&src_rand);
-	cleanup_Mat_rm(&ref_rand);
 	return SIFT3D_SUCCESS;
-
-RANSAC_SINGULAR:
-        if (rand_indices != NULL)
-                free(rand_indices);
-	cleanup_Mat_rm(&src_rand);
-	cleanup_Mat_rm(&ref_rand);
-	return SIFT3D_SINGULAR;
-
-RANSAC_FAIL:
-        if (rand_indices != NULL)
-                free(rand_indices);
-	cleanup_Mat_rm(&src_rand);
-	cleanup_Mat_rm(&ref_rand);
-	return SIFT3D_FAILURE;
 }
 
 //Resize spline struct based on number of selected points
@@ -4743,11 +7140,21 @@ int resize_Tps(Tps * tps, int num_pts, int dim)
 
 /* Fit a transformation from ref to src points, using random sample concensus 
  * (RANSAC).
+ *
+ * The iterations run in parallel, each drawing its sample from its own 
+ * generator. Iterations stop once enough have run to find an outlier-free 
+ * sample with probability ran->confidence, given the best inlier ratio so 
+ * far. The stopping rule is checked between blocks of SIFT3D_RANSAC_BLOCK 
+ * iterations, using only the models of the previous blocks, so the result 
+ * does not depend on the number of threads. If ran->prosac is true, the 
+ * points must be sorted by decreasing match quality, and the best ones are 
+ * sampled first.
+ * The generators are seeded from rand(), so srand() controls the results.
  * 
  * Parameters:
  *   ran - Struct storing RANSAC parameters.
- *   src - The [mxn] source points.
- *   ref - The [mxn] reference points.
+ *   src - The [mx3] source points.
+ *   ref - The [mx3] reference points.
  *   tform - The output transform. Must be initialized with init_from prior to 
  *           calling this function. 
  *
@@ -4756,19 +7163,67 @@ int find_tform_ransac(const Ransac *const ran, const Mat_rm *const src,
         const Mat_rm *const ref, void *const tform)
 {
 
+        const uint64_t seed = ((uint64_t) rand() << 32) ^ (uint64_t) rand();
+
+        return find_tform_ransac_seeded(ran, src, ref, seed, tform);
+}
+
+/* The same as find_tform_ransac, but the generators are seeded from seed,
+ * rather than rand(). Use this to get reproducible results when fitting 
+ * several transformations concurrently. */
+int find_tform_ransac_seeded(const Ransac *const ran, const Mat_rm *const src, 
+        const Mat_rm *const ref, const uint64_t seed, void *const tform)
+{
+        return find_tform_ransac_report(ran, src, ref, seed, tform, NULL, 
+                NULL);
+}
+
+/* The same as find_tform_ransac_seeded, but also reports the work done. If
+ * num_iter is not NULL, it is set to the number of iterations run, which is 
+ * less than ran->num_iter if the confidence was reached. If num_inliers is
+ * not NULL, it is set to the size of the best consensus set. Both are set
+ * even if no model was found. */
+int find_tform_ransac_report(const Ransac *const ran, const Mat_rm *const src, 
+        const Mat_rm *const ref, const uint64_t seed, void *const tform,
+        int *const num_iter_run, int *const num_inliers)
+{
+
 	Mat_rm ref_cset, src_cset;
 	void *tform_cur;
-	int *cset, *cset_best;
-	int i, j, dim, num_terms, ret, len, len_best, min_num_inliers;
+        double *prosac_sched;
+	int *cset_best;
+	int i, j, dim, num_terms, ret, len_best, iter_best, min_num_inliers,
+                iter_limit, block_end, num_run;
 
 	const int num_iter = ran->num_iter;
 	const int num_pts = src->num_rows;
 	const size_t tform_size = tform_get_size(tform);
 	const tform_type type = tform_get_type(tform);
 
+        // Report no work until the iterations are run
+        if (num_iter_run != NULL)
+                *num_iter_run = 0;
+        if (num_inliers != NULL)
+                *num_inliers = 0;
+
+	// Verify inputs
+	if (src->type != SIFT3D_DOUBLE || src->type != ref->type) {
+		SIFT3D_ERR("find_tform_ransac: all matrices must have type "
+                        "double \n");
+		return SIFT3D_FAILURE;
+	}
+	if (src->num_rows != ref->num_rows || src->num_cols != IM_NDIMS ||
+                ref->num_cols != IM_NDIMS) {
+		SIFT3D_ERR("find_tform_ransac: src and ref must both be "
+                        "[mx%d] \n", IM_NDIMS);
+		return SIFT3D_FAILURE;
+	}
+
 	// Initialize data structures
-	cset = cset_best = NULL;
+	cset_best = NULL;
+        prosac_sched = NULL;
 	len_best = 0;
+        num_run = 0;
 	if ((tform_cur = malloc(tform_size)) == NULL ||
 	    init_tform(tform_cur, type) ||
 	    init_Mat_rm(&src_cset, len_best, IM_NDIMS, SIFT3D_DOUBLE, 
@@ -4794,24 +7249,106 @@ int find_tform_ransac(const Ransac *const ran, const Mat_rm *const src,
 		printf("Not enough matched points \n");
 		goto find_tform_quit;
 	}
-	// Ransac iterations
-	for (i = 0; i < num_iter; i++) {
-		do {
-			ret = ransac(src, ref, ran, tform_cur, &cset, &len);
-		} while (ret == SIFT3D_SINGULAR);
 
-		if (ret == SIFT3D_FAILURE)
-			goto find_tform_quit;
+        // Allocate the best consensus set and the sampling schedule
+        if ((cset_best = malloc(num_pts * sizeof(int))) == NULL ||
+                (ran->prosac && (prosac_sched = make_prosac_schedule(num_pts,
+                        num_terms, num_iter)) == NULL))
+                goto find_tform_quit;
 
-		if (len > len_best) {
-			len_best = len;
-			if ((cset_best = (int *)SIFT3D_safe_realloc(cset_best,
-				len * sizeof(int))) == NULL || 
-				copy_tform(tform_cur, tform))
-				goto find_tform_quit;
-			memcpy(cset_best, cset, len * sizeof(int));
-		}
-	}
+	// Ransac iterations, in blocks of SIFT3D_RANSAC_BLOCK
+        ret = SIFT3D_SUCCESS;
+        iter_best = num_iter;
+        iter_limit = num_iter;
+        block_end = 0;
+#pragma omp parallel num_threads(SIFT3D_team_size())
+{
+        Ransac_scratch scratch;
+        int block_start;
+
+        const int have_scratch = init_Ransac_scratch(&scratch, tform, 
+                num_pts, num_terms) == SIFT3D_SUCCESS;
+
+        if (!have_scratch) {
+#pragma omp atomic write
+                ret = SIFT3D_FAILURE;
+        }
+
+        for (block_start = 0; ; block_start += SIFT3D_RANSAC_BLOCK) {
+
+                int iter;
+
+                // Update the number of iterations needed, using only the 
+                // models of the previous blocks 
+#pragma omp single
+{
+                iter_limit = ransac_iter_limit(ran->confidence, num_pts, 
+                        num_terms, len_best, num_iter);
+                block_end = ret == SIFT3D_FAILURE ? 0 : SIFT3D_MIN(
+                        block_start + SIFT3D_RANSAC_BLOCK, iter_limit);
+                num_run += SIFT3D_MAX(block_end - block_start, 0);
+}
+                if (block_start >= block_end)
+                        break;
+
+#pragma omp for schedule(dynamic)
+                for (iter = block_start; iter < block_end; iter++) {
+
+                        int status, len, len_cur;
+
+#pragma omp atomic read
+                        status = ret;
+                        if (!have_scratch || status == SIFT3D_FAILURE)
+                                continue;
+
+                        switch (ransac(src, ref, ran, prosac_sched, iter, 
+                                seed, &scratch, &len)) {
+                        case SIFT3D_SUCCESS:
+                                break;
+                        case SIFT3D_SINGULAR:
+                                continue;
+                        default:
+#pragma omp atomic write
+                                ret = SIFT3D_FAILURE;
+                                continue;
+                        }
+
+                        // Skip the critical section if this cannot be the 
+                        // best
+#pragma omp atomic read
+                        len_cur = len_best;
+                        if (len < len_cur)
+                                continue;
+
+#pragma omp critical (find_tform_ransac_best)
+{
+                        // Keep the largest set, breaking ties by the first 
+                        // iteration
+                        if (len > len_best || 
+                                (len == len_best && iter < iter_best)) {
+                                if (copy_tform(scratch.tform, tform)) {
+                                        ret = SIFT3D_FAILURE;
+                                } else {
+                                        memcpy(cset_best, scratch.cset, 
+                                                len * sizeof(int));
+#pragma omp atomic write
+                                        len_best = len;
+                                        iter_best = iter;
+                                }
+                        }
+}
+                }
+        }
+
+        if (have_scratch)
+                cleanup_Ransac_scratch(&scratch);
+}
+        if (num_iter_run != NULL)
+                *num_iter_run = num_run;
+        if (num_inliers != NULL)
+                *num_inliers = len_best;
+        if (ret == SIFT3D_FAILURE)
+                goto find_tform_quit;
 
 	// Check if the minimum number of inliers was found
 	if (len_best < min_num_inliers) {
@@ -4856,8 +7393,9 @@ int find_tform_ransac(const Ransac *const ran, const Mat_rm *const src,
 #endif
 
         // Clean up
-	free(cset);
 	free(cset_best);
+        if (prosac_sched != NULL)
+                free(prosac_sched);
 	cleanup_tform(tform_cur);
         cleanup_Mat_rm(&ref_cset);
         cleanup_Mat_rm(&src_cset);
@@ -4867,10 +7405,10 @@ int find_tform_ransac(const Ransac *const ran, const Mat_rm *const src,
 
 find_tform_quit:
         // Clean up and return an error
-	if (cset != NULL)
-		free(cset);
 	if (cset_best != NULL)
 		free(cset_best);
+        if (prosac_sched != NULL)
+                free(prosac_sched);
 	cleanup_tform(tform_cur);
 	if (tform_cur != NULL)
 		free(tform_cur);
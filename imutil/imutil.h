@@ -29,10 +29,23 @@ extern "C" {
 /* Parameters */
 const extern double SIFT3D_err_thresh_default;
 const extern int SIFT3D_num_iter_default;
+const extern double SIFT3D_confidence_default;
 
 /* Externally-visible routines */
 void *SIFT3D_safe_realloc(void *ptr, size_t size);
 
+int SIFT3D_set_num_threads(const int num_threads);
+
+int SIFT3D_get_num_threads(void);
+
+void SIFT3D_set_thread_pool(SIFT3D_pool_fn pool_fn, void *const pool);
+
+int SIFT3D_team_size(void);
+
+void SIFT3D_parallel_for(const int num, SIFT3D_task_fn task, void *const arg);
+
+double SIFT3D_wall_time(void);
+
 void clFinish_all();
 
 void check_cl_error(int err, const char *msg);
@@ -70,6 +83,11 @@ int resize_Mat_rm(Mat_rm *const mat);
 
 int eigen_Mat_rm(Mat_rm *A, Mat_rm *Q, Mat_rm *L);
 
+int eigen_sym3(const double *const a, double *const L, double *const Q);
+
+int eigen_sym3_batch(const double *const a, const int num, double *const L,
+        double *const Q);
+
 int solve_Mat_rm(const Mat_rm *const A, const Mat_rm *const B, 
         const double limit, Mat_rm *const X);
 
@@ -127,12 +145,24 @@ im_format im_get_format(const char *path);
 
 int im_read(const char *path, Image *const im);
 
+int im_read_native(const char *path, Image *const im);
+
 int im_write(const char *path, const Image *const im);
 
+void im_set_dcm_cache(const int enable);
+
 char *im_get_parent_dir(const char *path);
 
 int write_Mat_rm(const char *path, const Mat_rm *const mat);
 
+int make_path(const char *path);
+
+void init_File_map(File_map *const map);
+
+int map_file(const char *path, File_map *const map);
+
+void cleanup_File_map(File_map *const map);
+
 int init_im_with_dims(Image *const im, const int nx, const int ny, const int nz,
                         const int nc);
 
@@ -166,11 +196,36 @@ void im_default_stride(Image *const im);
 
 int im_resize(Image *const im);
 
+int im_reserve(Image *const im, const size_t size);
+
+size_t im_type_get_size(const im_type type);
+
+int im_set_type(Image *const im, const im_type type);
+
+void im_load_row(const Image *const im, const size_t idx, const int n,
+                 float *const dst);
+
+void im_store_row(Image *const im, const size_t idx, const int n,
+                  const float *const src);
+
+const float *im_get_row(const Image *const im, const size_t idx, const int n,
+                        float *const buf);
+
+float im_load_vox(const Image *const im, const size_t idx);
+
+void im_store_vox(Image *const im, const size_t idx, const float val);
+
+unsigned short SIFT3D_float_to_half(const float f);
+
+float SIFT3D_half_to_float(const unsigned short h);
+
 int im_concat(const Image *const src1, const Image *const src2, const int dim, 
 	      Image *const dst);
 
 float im_max_abs(const Image *const im);
 
+uint64_t im_hash(const Image *const im, const uint64_t seed);
+
 void im_scale(const Image *const im);
 
 int im_subtract(Image *src1, Image *src2, Image *dst);
@@ -200,6 +255,9 @@ int init_Sep_FIR_filter(Sep_FIR_filter *const f, const int dim, const int width,
 int apply_Sep_FIR_filter(const Image *const src, Image *const dst, 
         Sep_FIR_filter *const f, const double unit);
 
+int apply_Sep_FIR_filter_temp(const Image *const src, Image *const dst, 
+        Sep_FIR_filter *const f, const double unit, Image *const temp);
+
 void cleanup_Sep_FIR_filter(Sep_FIR_filter *const f);
 
 void cleanup_Gauss_filter(Gauss_filter *gauss);
@@ -240,11 +298,22 @@ int set_err_thresh_Ransac(Ransac *const ran, double err_thresh);
 
 int set_num_iter_Ransac(Ransac *const ran, int num_iter);
 
+int set_confidence_Ransac(Ransac *const ran, double confidence);
+
+int set_prosac_Ransac(Ransac *const ran, const int prosac);
+
 int copy_Ransac(const Ransac *const src, Ransac *const dst);
 
 int find_tform_ransac(const Ransac *const ran, const Mat_rm *const src, 
         const Mat_rm *const ref, void *const tform);
 
+int find_tform_ransac_seeded(const Ransac *const ran, const Mat_rm *const src, 
+        const Mat_rm *const ref, const uint64_t seed, void *const tform);
+
+int find_tform_ransac_report(const Ransac *const ran, const Mat_rm *const src, 
+        const Mat_rm *const ref, const uint64_t seed, void *const tform,
+        int *const num_iter_run, int *const num_inliers);
+
 int parse_gnu(const int argc, char *const *argv);
 
 void print_bug_msg();
@@ -21,7 +21,7 @@ static int nii_error_message() {
         return SIFT3D_WRAPPER_NOT_COMPILED;
 }
 
-int read_nii(const char *path, Image *const im) {
+int read_nii(const char *path, const int native, Image *const im) {
         return nii_error_message();
 }
 
@@ -35,22 +35,236 @@ int write_nii(const char *path, const Image *const im) {
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <zlib.h>
 
 /* Nifti includes */
 #include <nifti1_io.h>
 
+/* Size of the buffer used to stream voxel data, in bytes */
+#define NII_CHUNK_SIZE (1 << 20)
+
+/* Internal helper routines */
+static int nii_convert(const void *const src, const int datatype, 
+        const size_t num, float *const dst);
+static im_type nii_native_type(const int datatype);
+static int nii_store(const void *const src, const int datatype, 
+        const size_t num, Image *const im, const size_t pos);
+static int nii_read_data(const nifti_image *const nifti, Image *const im);
+
+/* Helper function to convert num voxels of the given NIFTI datatype to 
+ * float. Returns SIFT3D_FAILURE for unsupported datatypes. */
+static int nii_convert(const void *const src, const int datatype, 
+        const size_t num, float *const dst) {
+
+        size_t i;
+
+#define CONVERT_FROM_TYPE(type) { \
+        const type *const src_t = (const type *) src; \
+        for (i = 0; i < num; i++) { \
+                dst[i] = (float) src_t[i]; \
+        } \
+}
+
+	switch (datatype) {
+	case NIFTI_TYPE_UINT8:
+		CONVERT_FROM_TYPE(uint8_t);
+		break;
+	case NIFTI_TYPE_INT8:
+		CONVERT_FROM_TYPE(int8_t);
+		break;
+	case NIFTI_TYPE_UINT16:
+		CONVERT_FROM_TYPE(uint16_t);
+		break;
+	case NIFTI_TYPE_INT16:
+		CONVERT_FROM_TYPE(int16_t);
+		break;
+	case NIFTI_TYPE_UINT32:
+		CONVERT_FROM_TYPE(uint32_t);
+		break;
+	case NIFTI_TYPE_INT32:
+		CONVERT_FROM_TYPE(int32_t);
+		break;
+	case NIFTI_TYPE_UINT64:
+		CONVERT_FROM_TYPE(uint64_t);
+		break;
+	case NIFTI_TYPE_INT64:
+		CONVERT_FROM_TYPE(int64_t);
+		break;
+	case NIFTI_TYPE_FLOAT32:
+                memcpy(dst, src, num * sizeof(float));
+		break;
+	case NIFTI_TYPE_FLOAT64:
+		CONVERT_FROM_TYPE(double);
+		break;
+	case NIFTI_TYPE_FLOAT128:
+	case NIFTI_TYPE_COMPLEX128:
+	case NIFTI_TYPE_COMPLEX256:
+	case NIFTI_TYPE_COMPLEX64:
+	default:
+		SIFT3D_ERR("nii_convert: unsupported datatype %s \n",
+			nifti_datatype_string(datatype));
+                return SIFT3D_FAILURE;
+	}
+#undef CONVERT_FROM_TYPE
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper function to get the Image element type which holds the given NIFTI
+ * datatype without conversion. This is IM_FLOAT32 for the types other than
+ * 16-bit integers. */
+static im_type nii_native_type(const int datatype) {
+        switch (datatype) {
+        case NIFTI_TYPE_INT16:
+                return IM_INT16;
+        case NIFTI_TYPE_UINT16:
+                return IM_UINT16;
+        default:
+                return IM_FLOAT32;
+        }
+}
+
+/* Helper function to store num voxels of the given NIFTI datatype in im, 
+ * starting at element pos. The voxels are copied if im has their native 
+ * type, as given by nii_native_type, and otherwise converted to float. */
+static int nii_store(const void *const src, const int datatype, 
+        const size_t num, Image *const im, const size_t pos) {
+
+        if (im->type == IM_FLOAT32)
+                return nii_convert(src, datatype, num, im->data + pos);
+
+        if (im->type != nii_native_type(datatype)) {
+		SIFT3D_ERR("nii_store: cannot store datatype %s without "
+                        "conversion \n", nifti_datatype_string(datatype));
+                return SIFT3D_FAILURE;
+        }
+
+        memcpy((uint16_t *) im->data + pos, src, num * sizeof(uint16_t));
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper function to read the voxel data described by the header nifti 
+ * directly into im, which must already have its dimensions. Uncompressed 
+ * files are memory-mapped and converted in place, while compressed files 
+ * are inflated in chunks straight into im, so the data is never held twice
+ * in its native datatype. */
+static int nii_read_data(const nifti_image *const nifti, Image *const im) {
+
+        File_map map;
+        gzFile gz;
+        void *buf;
+        const char *src;
+        size_t pos, num_chunk, chunk_vox;
+        int ret;
+
+        const char *const path = nifti->iname;
+        const size_t nbyper = nifti->nbyper;
+        const size_t offset = nifti->iname_offset;
+        const size_t num = im->size;
+        const size_t bytes = num * nbyper;
+        const int swap = nbyper > 1 && 
+                nifti->byteorder != nifti_short_order();
+
+        // Verify the datatype and voxel count
+        if (nbyper < 1) {
+		SIFT3D_ERR("nii_read_data: unsupported datatype %s \n",
+			nifti_datatype_string(nifti->datatype));
+                return SIFT3D_FAILURE;
+        }
+        if ((size_t) nifti->nvox != num) {
+                SIFT3D_ERR("nii_read_data: file %s has %lu voxels, expected "
+                        "%lu \n", path, (unsigned long) nifti->nvox, 
+                        (unsigned long) num);
+                return SIFT3D_FAILURE;
+        }
+
+        init_File_map(&map);
+        gz = NULL;
+        buf = NULL;
+        ret = SIFT3D_FAILURE;
+
+        // Open the data
+        if (nifti_is_gzfile(path)) {
+                if ((gz = gzopen(path, "rb")) == NULL) {
+                        SIFT3D_ERR("nii_read_data: failed to open %s \n", 
+                                path);
+                        goto nii_read_data_quit;
+                }
+                gzbuffer(gz, NII_CHUNK_SIZE);
+                if (gzseek(gz, (z_off_t) offset, SEEK_SET) < 0) {
+                        SIFT3D_ERR("nii_read_data: failed to seek to the "
+                                "data of %s \n", path);
+                        goto nii_read_data_quit;
+                }
+                src = NULL;
+        } else {
+                if (map_file(path, &map))
+                        goto nii_read_data_quit;
+                if (map.size < offset + bytes) {
+                        SIFT3D_ERR("nii_read_data: file %s is truncated \n",
+                                path);
+                        goto nii_read_data_quit;
+                }
+                src = (const char *) map.addr + offset;
+
+                // Convert aligned, native-order data directly from the map
+                if (!swap && (uintptr_t) src % nbyper == 0) {
+                        ret = nii_store(src, nifti->datatype, num, im, 0);
+                        goto nii_read_data_quit;
+                }
+        }
+
+        // Otherwise stream the data through an aligned buffer
+        chunk_vox = NII_CHUNK_SIZE / nbyper;
+        if ((buf = malloc(chunk_vox * nbyper)) == NULL)
+                goto nii_read_data_quit;
+        for (pos = 0; pos < num; pos += num_chunk) {
+
+                num_chunk = SIFT3D_MIN(chunk_vox, num - pos);
+
+                // Read the chunk
+                if (gz != NULL) {
+                        if (gzread(gz, buf, (unsigned) (num_chunk * nbyper)) 
+                                != (int) (num_chunk * nbyper)) {
+                                SIFT3D_ERR("nii_read_data: failed to read "
+                                        "the data of %s \n", path);
+                                goto nii_read_data_quit;
+                        }
+                } else {
+                        memcpy(buf, src + pos * nbyper, num_chunk * nbyper);
+                }
+
+                // Convert it into im
+                if (swap)
+                        nifti_swap_Nbytes(num_chunk, (int) nbyper, buf);
+                if (nii_store(buf, nifti->datatype, num_chunk, im, pos))
+                        goto nii_read_data_quit;
+        }
+        ret = SIFT3D_SUCCESS;
+
+nii_read_data_quit:
+        if (buf != NULL)
+                free(buf);
+        if (gz != NULL)
+                gzclose(gz);
+        cleanup_File_map(&map);
+        return ret;
+}
+
 /* Helper function to read a NIFTI image (.nii, .nii.gz).
  * Prior to calling this function, use init_im(im).
- * This function allocates memory.
+ * This function allocates memory. If native is true, 16-bit integer data is
+ * kept in its own element type, otherwise im is converted to float32.
  */
-int read_nii(const char *path, Image *const im)
+int read_nii(const char *path, const int native, Image *const im)
 {
 
 	nifti_image *nifti;
-	int x, y, z, i, dim_counter;
+	int i, dim_counter;
 
-	// Read NIFTI file
-	if ((nifti = nifti_image_read(path, 1)) == NULL) {
+	// Read the NIFTI header. The voxel data is read by nii_read_data.
+	if ((nifti = nifti_image_read(path, 0)) == NULL) {
 		SIFT3D_ERR("read_nii: failure loading file %s", path);
                 return SIFT3D_FAILURE;
 	}
@@ -86,56 +300,13 @@ int read_nii(const char *path, Image *const im)
 	im->nz = nifti->nz;
 	im->nc = 1;
 	im_default_stride(im);
-	im_resize(im);
-
-#define IM_COPY_FROM_TYPE(type) \
-    SIFT3D_IM_LOOP_START(im, x, y, z)   \
-        SIFT3D_IM_GET_VOX(im, x, y, z, 0) = (float) ((type *)nifti->data)[ \
-        SIFT3D_IM_GET_IDX(im, x, y, z, 0)]; \
-    SIFT3D_IM_LOOP_END
+	if (im_set_type(im, native ? nii_native_type(nifti->datatype) : 
+                IM_FLOAT32) || im_resize(im))
+                goto read_nii_quit;
 
-	// Copy the data into im
-	switch (nifti->datatype) {
-	case NIFTI_TYPE_UINT8:
-		IM_COPY_FROM_TYPE(uint8_t);
-		break;
-	case NIFTI_TYPE_INT8:
-		IM_COPY_FROM_TYPE(int8_t);
-		break;
-	case NIFTI_TYPE_UINT16:
-		IM_COPY_FROM_TYPE(uint16_t);
-		break;
-	case NIFTI_TYPE_INT16:
-		IM_COPY_FROM_TYPE(int16_t);
-		break;
-	case NIFTI_TYPE_UINT32:
-		IM_COPY_FROM_TYPE(uint32_t);
-		break;
-	case NIFTI_TYPE_INT32:
-		IM_COPY_FROM_TYPE(int32_t);
-		break;
-	case NIFTI_TYPE_UINT64:
-		IM_COPY_FROM_TYPE(uint64_t);
-		break;
-	case NIFTI_TYPE_INT64:
-		IM_COPY_FROM_TYPE(int64_t);
-		break;
-	case NIFTI_TYPE_FLOAT32:
-		IM_COPY_FROM_TYPE(float);
-		break;
-	case NIFTI_TYPE_FLOAT64:
-		IM_COPY_FROM_TYPE(double);
-		break;
-	case NIFTI_TYPE_FLOAT128:
-	case NIFTI_TYPE_COMPLEX128:
-	case NIFTI_TYPE_COMPLEX256:
-	case NIFTI_TYPE_COMPLEX64:
-	default:
-		SIFT3D_ERR("read_nii: unsupported datatype %s \n",
-			nifti_datatype_string(nifti->datatype));
+	// Read the data into im
+        if (nii_read_data(nifti, im))
                 goto read_nii_quit;
-	}
-#undef IM_COPY_FROM_TYPE
 
 	// Clean up NIFTI data
 	nifti_free_extensions(nifti);
@@ -150,12 +321,14 @@ read_nii_quit:
 }
 
 /* Write a Image to the specified path, in NIFTI format.
- * The path extension must be one of (.nii, .nii.gz). */
+ * The path extension must be one of (.nii, .nii.gz). The data is written
+ * directly from im, without an intermediate copy, in the datatype of im. 
+ * Half precision images are written from a float32 copy. */
 int write_nii(const char *path, const Image *const im)
 {
 
 	nifti_image *nifti;
-	size_t i;
+        int datatype;
 
 	const int dims[] = { 3, im->nx, im->ny, im->nz, 0, 0, 0, 0 };
 
@@ -167,8 +340,33 @@ int write_nii(const char *path, const Image *const im)
 		return SIFT3D_FAILURE;
 	}
 
-	// Init a nifti struct and allocate memory
-	if ((nifti = nifti_make_new_nim(dims, DT_FLOAT32, 1))
+        // Get the datatype
+        switch (im->type) {
+        case IM_FLOAT32:
+                datatype = DT_FLOAT32;
+                break;
+        case IM_INT16:
+                datatype = DT_INT16;
+                break;
+        case IM_UINT16:
+                datatype = DT_UINT16;
+                break;
+        default: {
+
+                Image temp;
+                int ret;
+
+                init_im(&temp);
+                ret = im_copy_data(im, &temp) ? SIFT3D_FAILURE : 
+                        write_nii(path, &temp);
+                im_free(&temp);
+
+                return ret;
+        }
+        }
+
+	// Init a nifti struct, without allocating the data
+	if ((nifti = nifti_make_new_nim(dims, datatype, 0))
 	    == NULL)
 		goto write_nii_quit;
 
@@ -177,11 +375,6 @@ int write_nii(const char *path, const Image *const im)
         nifti->dy = im->uy;
         nifti->dz = im->uz;
 
-	// Copy the data
-	for (i = 0; i < im->size; i++) {
-		((float *)nifti->data)[i] = im->data[i];
-	}
-
 	if (nifti_set_filenames(nifti, path, 0, 1))
 		goto write_nii_quit;
 
@@ -189,7 +382,11 @@ int write_nii(const char *path, const Image *const im)
 	if (!nifti_nim_is_valid(nifti, 1))
 		goto write_nii_quit;
 
+	// Write the data from im, which has the same layout as the file. 
+        // nifti does not modify the data, but it must not free it either.
+        nifti->data = im->data;
 	nifti_image_write(nifti);
+        nifti->data = NULL;
 	nifti_free_extensions(nifti);
 	nifti_image_free(nifti);
 
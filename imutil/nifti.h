@@ -10,7 +10,7 @@
 #ifndef _NIFTI_H
 #define _NIFTI_H
 
-int read_nii(const char *path, Image *const im);
+int read_nii(const char *path, const int native, Image *const im);
 
 int write_nii(const char *path, const Image *const im);
 
@@ -23,13 +23,147 @@
 /* Default parameters */
 const double SIFT3D_nn_thresh_default = 0.8; // Default matching threshold
 
+/* A match and its quality, for sorting */
+typedef struct _Match_rank {
+        float ratio; // Nearest neighbor distance ratio
+        int row; // Row of the match in the coordinate matrices
+} Match_rank;
+
+/* Arguments to the tasks of register_SIFT3D_group and 
+ * register_SIFT3D_all_pairs. Pair i registers store src[i] to store ref[i], 
+ * or to desc_ref if it is not NULL. */
+typedef struct _Reg_group_task {
+        const Reg_SIFT3D *reg; // The registration parameters
+        const SIFT3D_Descriptor_store *const *descs; // Descriptor stores
+        const double *units; // [num_descs x IM_NDIMS] units of each store
+        SIFT3D_Descriptor_index *indices; // Index of each store, or NULL
+        const SIFT3D_Descriptor_store *desc_ref; // Shared reference, or NULL
+        const SIFT3D_Descriptor_index *index_ref; // Index of desc_ref
+        const double *ref_units; // Units of desc_ref
+        const int *src, *ref; // The stores of each pair
+        void *const *tforms; // The output transformation of each pair
+        uint64_t *seeds; // The RANSAC seed of each pair
+        int *ret; // The return code of each task
+} Reg_group_task;
+
 /* Internal helper routines */
+static int cmp_match_rank(const void *a, const void *b);
+static int sort_matches(const int *const matches, const float *const ratios,
+        const int num, Mat_rm *const match_src, Mat_rm *const match_ref);
 static void scale_SIFT3D(const double *const factors, 
 	SIFT3D_Descriptor_store *const d);
 static int im2mm(const Mat_rm *const im, const double *const units, 
         Mat_rm *const mm);
 static int mm2im(const double *const src_units, const double *const ref_units,
         void *const tform);
+static int register_desc(const Reg_SIFT3D *const reg,
+        const SIFT3D_Descriptor_store *const desc_src,
+        const SIFT3D_Descriptor_store *const desc_ref,
+        const SIFT3D_Descriptor_index *const index_src,
+        const SIFT3D_Descriptor_index *const index_ref,
+        const double *const src_units, const double *const ref_units,
+        const uint64_t seed, Mat_rm *const match_src, Mat_rm *const match_ref,
+        void *const tform);
+static int use_index(const Reg_SIFT3D *const reg);
+static int update_index(SIFT3D_Descriptor_index *const index, 
+        const SIFT3D_Descriptor_store *const store, int *const stale);
+static uint64_t draw_seed(void);
+static int init_group_index(const Reg_SIFT3D *const reg, 
+        SIFT3D_Descriptor_index *const index);
+static void build_index_task(void *const arg, const int i);
+static void register_pair_task(void *const arg, const int i);
+static int run_group(Reg_group_task *const task, const int num_descs, 
+        const int num_pairs, int *const status);
+
+/* Helper function to compare Match_rank structs by increasing ratio, breaking
+ * ties by row, for qsort. */
+static int cmp_match_rank(const void *a, const void *b) {
+
+        const Match_rank *const ra = a;
+        const Match_rank *const rb = b;
+
+        if (ra->ratio != rb->ratio)
+                return ra->ratio < rb->ratio ? -1 : 1;
+        return ra->row - rb->row;
+}
+
+/* Sort the rows of match_src and match_ref from the best match to the worst,
+ * as required for PROSAC.
+ *
+ * Parameters:
+ *   matches: The matches, as in SIFT3D_nn_match.
+ *   ratios: The match ratios, as in SIFT3D_nn_match_ratio.
+ *   num: The length of matches and ratios.
+ *   match_src, match_ref: The coordinate matrices, as computed by 
+ *      SIFT3D_matches_to_Mat_rm, sorted in place.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int sort_matches(const int *const matches, const float *const ratios,
+        const int num, Mat_rm *const match_src, Mat_rm *const match_ref) {
+
+        Mat_rm src_sorted, ref_sorted;
+        Match_rank *ranks;
+        int i, j, num_rows;
+
+        const int num_matches = match_src->num_rows;
+
+        if (num_matches < 1)
+                return SIFT3D_SUCCESS;
+
+        // Gather the ratios of the valid matches, in the order of the rows
+        if ((ranks = malloc(num_matches * sizeof(Match_rank))) == NULL)
+                return SIFT3D_FAILURE;
+        num_rows = 0;
+        for (i = 0; i < num; i++) {
+                if (matches[i] == -1)
+                        continue;
+                if (num_rows >= num_matches)
+                        break;
+                ranks[num_rows].ratio = ratios[i];
+                ranks[num_rows].row = num_rows;
+                num_rows++;
+        }
+
+        if (num_rows != num_matches) {
+                SIFT3D_ERR("sort_matches: the matches do not correspond to "
+                        "the coordinate matrices \n");
+                free(ranks);
+                return SIFT3D_FAILURE;
+        }
+
+        // Sort the matches
+        qsort(ranks, num_rows, sizeof(Match_rank), cmp_match_rank);
+
+        // Permute the rows
+        if (init_Mat_rm(&src_sorted, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE) ||
+                init_Mat_rm(&ref_sorted, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE)) {
+                free(ranks);
+                return SIFT3D_FAILURE;
+        }
+        if (copy_Mat_rm(match_src, &src_sorted) || 
+                copy_Mat_rm(match_ref, &ref_sorted))
+                goto sort_matches_quit;
+        SIFT3D_MAT_RM_LOOP_START(&src_sorted, i, j)
+                SIFT3D_MAT_RM_GET(&src_sorted, i, j, double) = 
+                        SIFT3D_MAT_RM_GET(match_src, ranks[i].row, j, double);
+                SIFT3D_MAT_RM_GET(&ref_sorted, i, j, double) = 
+                        SIFT3D_MAT_RM_GET(match_ref, ranks[i].row, j, double);
+        SIFT3D_MAT_RM_LOOP_END
+        if (copy_Mat_rm(&src_sorted, match_src) || 
+                copy_Mat_rm(&ref_sorted, match_ref))
+                goto sort_matches_quit;
+
+        free(ranks);
+        cleanup_Mat_rm(&src_sorted);
+        cleanup_Mat_rm(&ref_sorted);
+        return SIFT3D_SUCCESS;
+
+sort_matches_quit:
+        free(ranks);
+        cleanup_Mat_rm(&src_sorted);
+        cleanup_Mat_rm(&ref_sorted);
+        return SIFT3D_FAILURE;
+}
 
 /* Convert an [mxIM_NDIMS] coordinate matrix from image space to mm. 
  *
@@ -121,8 +255,16 @@ static int mm2im(const double *const src_units, const double *const ref_units,
 int init_Reg_SIFT3D(Reg_SIFT3D *const reg) {
 
         reg->nn_thresh = SIFT3D_nn_thresh_default;
+        reg->nn_checks = 0;
+        reg->match_radius = 0.0;
+        reg->tform_init = NULL;
 	init_SIFT3D_Descriptor_store(&reg->desc_src);
 	init_SIFT3D_Descriptor_store(&reg->desc_ref);
+        init_SIFT3D_Descriptor_index(&reg->index_src);
+        init_SIFT3D_Descriptor_index(&reg->index_ref);
+        reg->index_src_stale = reg->index_ref_stale = SIFT3D_TRUE;
+        init_im(&reg->src_mask);
+        init_im(&reg->ref_mask);
 	init_Ransac(&reg->ran);
 	if (init_SIFT3D(&reg->sift3d) ||
                 init_Mat_rm(&reg->match_src, 0, 0, SIFT3D_DOUBLE, 
@@ -142,6 +284,11 @@ void cleanup_Reg_SIFT3D(Reg_SIFT3D *const reg) {
 
         cleanup_SIFT3D_Descriptor_store(&reg->desc_src);
         cleanup_SIFT3D_Descriptor_store(&reg->desc_ref);
+        cleanup_SIFT3D_Descriptor_index(&reg->index_src);
+        cleanup_SIFT3D_Descriptor_index(&reg->index_ref);
+        im_free(&reg->src_mask);
+        im_free(&reg->ref_mask);
+        set_match_radius_Reg_SIFT3D(reg, NULL, 0.0);
         cleanup_SIFT3D(&reg->sift3d); 
         cleanup_Mat_rm(&reg->match_src);
         cleanup_Mat_rm(&reg->match_ref);
@@ -160,6 +307,82 @@ int set_nn_thresh_Reg_SIFT3D(Reg_SIFT3D *const reg, const double nn_thresh) {
         return SIFT3D_SUCCESS;
 }
 
+/* Set the number of descriptors compared to each query in approximate 
+ * matching. If nn_checks is positive, register_SIFT3D uses 
+ * SIFT3D_nn_match_indexed, trading accuracy for speed. If zero, it uses
+ * the exhaustive search of SIFT3D_nn_match. This is the default. */
+int set_nn_checks_Reg_SIFT3D(Reg_SIFT3D *const reg, const int nn_checks) {
+
+        if (nn_checks < 0) {
+                SIFT3D_ERR("set_nn_checks_Reg_SIFT3D: invalid number of "
+                        "checks: %d \n", nn_checks);
+                return SIFT3D_FAILURE;
+        }
+
+        if (nn_checks > 0 && 
+                (set_checks_SIFT3D_Descriptor_index(&reg->index_src, 
+                        nn_checks) ||
+                set_checks_SIFT3D_Descriptor_index(&reg->index_ref, 
+                        nn_checks)))
+                return SIFT3D_FAILURE;
+
+        reg->nn_checks = nn_checks;
+        reg->index_src_stale = reg->index_ref_stale = SIFT3D_TRUE;
+        return SIFT3D_SUCCESS;
+}
+
+/* Restrict matching to features within a distance of radius, in the units of
+ * the source image, after mapping the reference features through tform_init,
+ * as in SIFT3D_nn_match_bounded_ratio. This is much faster than the 
+ * exhaustive search for images which are roughly aligned, for example as the
+ * fine stage after registering downsampled images. tform_init maps reference
+ * image coordinates to source image coordinates, as computed by 
+ * register_SIFT3D, and is copied. Use NULL for images which are already 
+ * aligned. The same transformation is used for every pair in 
+ * register_SIFT3D_group and register_SIFT3D_all_pairs. Bounded matching 
+ * takes precedence over set_nn_checks_Reg_SIFT3D. Use a radius of zero to 
+ * disable it, which is the default. */
+int set_match_radius_Reg_SIFT3D(Reg_SIFT3D *const reg, 
+        const void *const tform_init, const double radius) {
+
+        void *tform;
+
+        if (radius < 0.0) {
+                SIFT3D_ERR("set_match_radius_Reg_SIFT3D: invalid radius: "
+                        "%f \n", radius);
+                return SIFT3D_FAILURE;
+        }
+
+        // Copy the initial transformation
+        tform = NULL;
+        if (radius > 0.0 && tform_init != NULL) {
+                if ((tform = malloc(tform_get_size(tform_init))) == NULL) {
+                        SIFT3D_ERR("set_match_radius_Reg_SIFT3D: out of "
+                                "memory \n");
+                        return SIFT3D_FAILURE;
+                }
+                if (init_tform(tform, tform_get_type(tform_init))) {
+                        free(tform);
+                        return SIFT3D_FAILURE;
+                }
+                if (copy_tform(tform_init, tform)) {
+                        cleanup_tform(tform);
+                        free(tform);
+                        return SIFT3D_FAILURE;
+                }
+        }
+
+        // Replace the previous one
+        if (reg->tform_init != NULL) {
+                cleanup_tform(reg->tform_init);
+                free(reg->tform_init);
+        }
+        reg->tform_init = tform;
+        reg->match_radius = radius;
+
+        return SIFT3D_SUCCESS;
+}
+
 /* Set the Ransac parameters of the Reg_SIFT3D struct. */
 int set_Ransac_Reg_SIFT3D(Reg_SIFT3D *const reg, const Ransac *const ran) {
         return copy_Ransac(ran, &reg->ran);
@@ -171,83 +394,142 @@ int set_SIFT3D_Reg_SIFT3D(Reg_SIFT3D *const reg, const SIFT3D *const sift3d) {
         return copy_SIFT3D(sift3d, &reg->sift3d);
 }
 
+/* Set the result cache of the Reg_SIFT3D struct, so that setting an image 
+ * which was already processed with the same parameters skips detection and
+ * description. This is useful to register many images to the same 
+ * reference. The cache is not copied, see set_cache_SIFT3D. Since 
+ * set_SIFT3D_Reg_SIFT3D replaces the cache with that of its argument, call 
+ * this afterwards. */
+void set_cache_Reg_SIFT3D(Reg_SIFT3D *const reg, SIFT3D_Cache *const cache) {
+        set_cache_SIFT3D(&reg->sift3d, cache);
+}
+
+/* Set the struct where the stages of registration are recorded, including
+ * those of feature extraction. The statistics are not copied, see 
+ * set_stats_SIFT3D. As with set_cache_Reg_SIFT3D, call this after
+ * set_SIFT3D_Reg_SIFT3D. Use NULL to disable profiling, which is the 
+ * default. */
+void set_stats_Reg_SIFT3D(Reg_SIFT3D *const reg, SIFT3D_Stats *const stats) {
+        set_stats_SIFT3D(&reg->sift3d, stats);
+}
+
+/* Helper function for set_src_mask_Reg_SIFT3D and set_ref_mask_Reg_SIFT3D.
+ * Copies mask into dst, or frees dst if mask is NULL. */
+static int set_mask_Reg_SIFT3D(const Image *const mask, Image *const dst) {
+
+        if (mask != NULL)
+                return im_copy_data(mask, dst);
+
+        im_free(dst);
+        init_im(dst);
+        return SIFT3D_SUCCESS;
+}
+
+/* Set the foreground mask of the source image, so that features are detected
+ * only where it is nonzero, as in set_mask_SIFT3D. This makes a deep copy of
+ * the mask, and must be called before set_src_Reg_SIFT3D. Use NULL to 
+ * detect in the whole image, which is the default. */
+int set_src_mask_Reg_SIFT3D(Reg_SIFT3D *const reg, const Image *const mask) {
+        return set_mask_Reg_SIFT3D(mask, &reg->src_mask);
+}
+
+/* The same as set_src_mask_Reg_SIFT3D, but for the reference image. */
+int set_ref_mask_Reg_SIFT3D(Reg_SIFT3D *const reg, const Image *const mask) {
+        return set_mask_Reg_SIFT3D(mask, &reg->ref_mask);
+}
+
 /* Helper function for set_src_Reg_SIFT3D and set_ref_Reg_SIFT3D.
  * 
  * Parameters:
  *   reg - The Reg_SIFT3D struct.
  *   im - The image, either source or reference.
+ *   mask - The mask of im in Reg_SIFT3D, which is empty if unset, in 
+ *      which case that of reg->sift3d is used.
  *   units - The units array in Reg_SIFT3D to be modified.
  *   desc - The descriptor store in Reg_SIFT3D to be modified.
  * 
  * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
 static int set_im_Reg_SIFT3D(Reg_SIFT3D *const reg, const Image *const im,
-        double *const units, SIFT3D_Descriptor_store *const desc) {
+        const Image *const mask, double *const units, 
+        SIFT3D_Descriptor_store *const desc) {
 
-        Keypoint_store kp; 
+        int ret;
 
         SIFT3D *const sift3d = &reg->sift3d; 
-
-        /* Initialize intermediates */ 
-        init_Keypoint_store(&kp); 
+        const Image *const mask_old = sift3d->mask;
 
         /* Save the units */ 
         memcpy(units, SIFT3D_IM_GET_UNITS(im), IM_NDIMS * sizeof(double));
 
-        /* Detect keypoints */ 
-	if (SIFT3D_detect_keypoints(sift3d, im, &kp)) { 
-		SIFT3D_ERR("set_" SIFT3D_TO_STR(type)  
-                        "_Reg_SIFT3D: failed to detect keypoints\n"); 
-                goto set_im_quit; 
-        } 
-
-        /* Extract descriptors */ 
-	if (SIFT3D_extract_descriptors(sift3d, &kp, desc)) { 
-                SIFT3D_ERR("set_" SIFT3D_TO_STR(type) 
-                        "_Reg_SIFT3D: failed to extract descriptors \n"); 
-                goto set_im_quit; 
+        /* Detect keypoints and extract descriptors, or reuse the cached 
+         * result, within the mask if it is set */ 
+        if (mask->data != NULL)
+                set_mask_SIFT3D(sift3d, mask);
+        ret = SIFT3D_extract_descriptors_cached(sift3d, im, desc);
+        set_mask_SIFT3D(sift3d, mask_old);
+	if (ret) { 
+		SIFT3D_ERR("set_im_Reg_SIFT3D: failed to extract "
+                        "descriptors \n"); 
+                return SIFT3D_FAILURE;
         } 
 
-        /* Clean up */ 
-        cleanup_Keypoint_store(&kp); 
-
         return SIFT3D_SUCCESS; 
-
-set_im_quit: 
-        cleanup_Keypoint_store(&kp); 
-        return SIFT3D_FAILURE; 
 } 
 
 /* Set the source image. This makes a deep copy of the data, so you are free
  * to modify src after calling this function. */
 int set_src_Reg_SIFT3D(Reg_SIFT3D *const reg, const Image *const src) {
-        return set_im_Reg_SIFT3D(reg, src, reg->src_units, &reg->desc_src);
+        reg->index_src_stale = SIFT3D_TRUE;
+        return set_im_Reg_SIFT3D(reg, src, &reg->src_mask, reg->src_units, 
+                &reg->desc_src);
 }
 
 /* The same as set_source_Reg_SIFT3D, but sets the reference image. */
 int set_ref_Reg_SIFT3D(Reg_SIFT3D *const reg, const Image *const ref) {
-        return set_im_Reg_SIFT3D(reg, ref, reg->ref_units, &reg->desc_ref);
+        reg->index_ref_stale = SIFT3D_TRUE;
+        return set_im_Reg_SIFT3D(reg, ref, &reg->ref_mask, reg->ref_units, 
+                &reg->desc_ref);
 }
 
-/* Run the registration procedure. 
+/* Helper function returning true if reg matches features with the descriptor
+ * indices, rather than bounded or exhaustive search. */
+static int use_index(const Reg_SIFT3D *const reg) {
+        return reg->nn_checks > 0 && !(reg->match_radius > 0.0);
+}
+
+/* Helper function to match the descriptors of a source and reference image
+ * and fit a transformation to the matches. This uses the matching and RANSAC
+ * parameters of reg, which is not modified, so it can be called concurrently.
  *
- * Parameters: 
- *   reg: The struct holding registration state.
- *   tform: The output transformation. If NULL, this function only performs
+ * Parameters:
+ *   reg - The registration parameters.
+ *   desc_src, desc_ref - The source and reference descriptors.
+ *   index_src, index_ref - Indices built from desc_src and desc_ref, used if
+ *     use_index(reg) is true, otherwise ignored.
+ *   src_units, ref_units - The units of the source and reference images.
+ *   seed - The seed of the RANSAC generators.
+ *   match_src, match_ref - The output matched coordinates, in image space.
+ *   tform - The output transformation. If NULL, this function only performs
  *     feature matching.
  *
  * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
-int register_SIFT3D(Reg_SIFT3D *const reg, void *const tform) {
+static int register_desc(const Reg_SIFT3D *const reg,
+        const SIFT3D_Descriptor_store *const desc_src,
+        const SIFT3D_Descriptor_store *const desc_ref,
+        const SIFT3D_Descriptor_index *const index_src,
+        const SIFT3D_Descriptor_index *const index_ref,
+        const double *const src_units, const double *const ref_units,
+        const uint64_t seed, Mat_rm *const match_src, Mat_rm *const match_ref,
+        void *const tform) {
 
         Mat_rm match_src_mm, match_ref_mm;
-        int *matches;
-        int i, j;
+        double start;
+        float *ratios;
+        int *matches, ret, num_iter, num_inliers;
 
-        Ransac *const ran = &reg->ran;
-        Mat_rm *const match_src = &reg->match_src;
-        Mat_rm *const match_ref = &reg->match_ref;
+        SIFT3D_Stats *const stats = reg->sift3d.stats;
+        const Ransac *const ran = &reg->ran;
         const double nn_thresh = reg->nn_thresh;
-        SIFT3D_Descriptor_store *const desc_src = &reg->desc_src;
-        SIFT3D_Descriptor_store *const desc_ref = &reg->desc_ref;
 
 	// Verify inputs
 	if (desc_src->num <= 0) {
@@ -263,59 +545,450 @@ int register_SIFT3D(Reg_SIFT3D *const reg, void *const tform) {
 
         // Initialize intermediates
         matches = NULL;
+        ratios = NULL;
         if (init_Mat_rm(&match_src_mm, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE) ||
 	        init_Mat_rm(&match_ref_mm, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE)) {
                 SIFT3D_ERR("register_SIFT3D: failed initialization \n");
                 return SIFT3D_FAILURE;
         }
 
+        // Allocate the match ratios, which order the matches for PROSAC
+        if (ran->prosac && (ratios = malloc(desc_src->num * 
+                sizeof(float))) == NULL) {
+                SIFT3D_ERR("register_SIFT3D: out of memory \n");
+                goto register_desc_quit;
+        }
+
 	// Match features
-	if (SIFT3D_nn_match(desc_src, desc_ref, nn_thresh, &matches)) {
+        start = SIFT3D_STATS_START(stats);
+        if (reg->match_radius > 0.0) {
+                if (SIFT3D_nn_match_bounded_ratio(desc_src, desc_ref, 
+                        reg->tform_init, src_units, reg->match_radius,
+                        nn_thresh, &matches, ratios)) {
+                        SIFT3D_ERR("register_SIFT3D: failed to match "
+                                "descriptors within the radius \n");
+                        goto register_desc_quit;
+                }
+        } else if (reg->nn_checks > 0) {
+                if (SIFT3D_nn_match_indexed_ratio(index_src, index_ref, 
+                        nn_thresh, &matches, ratios)) {
+                        SIFT3D_ERR("register_SIFT3D: failed to match "
+                                "descriptors with the index \n");
+                        goto register_desc_quit;
+                }
+        } else if (SIFT3D_nn_match_ratio(desc_src, desc_ref, nn_thresh, 
+                &matches, ratios)) {
 		SIFT3D_ERR("register_SIFT3D: failed to match "
                         "descriptors \n");
-                goto register_SIFT3D_quit;
+                goto register_desc_quit;
         }
 
         // Convert matches to coordinate matrices
-	if (SIFT3D_matches_to_Mat_rm(desc_src, desc_ref, matches,
-				     match_src, match_ref)) {
+	if (SIFT3D_matches_to_Mat_rm((SIFT3D_Descriptor_store *) desc_src, 
+                (SIFT3D_Descriptor_store *) desc_ref, matches, match_src,
+                match_ref)) {
 		SIFT3D_ERR("register_SIFT3D: failed to extract "
                         "coordinate matrices \n");
-                goto register_SIFT3D_quit;
+                goto register_desc_quit;
         }
+        record_SIFT3D_Stats(stats, SIFT3D_STAGE_MATCH, start, 
+                match_src->num_rows, desc_src->num, 
+                desc_src->num * sizeof(int));
 
         // Quit if no tform was provided
         if (tform == NULL)
-                goto register_SIFT3D_success;
+                goto register_desc_success;
 
         // Convert the coordinate matrices to real-world units
-        if (im2mm(match_src, reg->src_units, &match_src_mm) ||
-            im2mm(match_ref, reg->ref_units, &match_ref_mm))
-                goto register_SIFT3D_quit;
-
-	// Find the transformation in real-world units
-	if (find_tform_ransac(ran, &match_src_mm, &match_ref_mm, tform))
-                goto register_SIFT3D_quit;
+        if (im2mm(match_src, src_units, &match_src_mm) ||
+            im2mm(match_ref, ref_units, &match_ref_mm))
+                goto register_desc_quit;
+
+        // Sort the matches by quality, for PROSAC
+        if (ran->prosac && sort_matches(matches, ratios, desc_src->num, 
+                &match_src_mm, &match_ref_mm))
+                goto register_desc_quit;
+
+	// Find the transformation in real-world units, recording the work 
+        // even if it fails
+        start = SIFT3D_STATS_START(stats);
+	ret = find_tform_ransac_report(ran, &match_src_mm, &match_ref_mm, seed,
+                tform, &num_iter, &num_inliers);
+        record_SIFT3D_Stats(stats, SIFT3D_STAGE_RANSAC, start, num_inliers, 
+                num_iter, 0);
+        if (ret)
+                goto register_desc_quit;
 
         // Convert the transformation back to image space
-        if (mm2im(reg->src_units, reg->ref_units, tform))
-                goto register_SIFT3D_quit;
+        if (mm2im(src_units, ref_units, tform))
+                goto register_desc_quit;
 
-register_SIFT3D_success:
+register_desc_success:
         // Clean up
         free(matches);
+        free(ratios);
         cleanup_Mat_rm(&match_src_mm);
         cleanup_Mat_rm(&match_ref_mm);
 
 	return SIFT3D_SUCCESS;
 
-register_SIFT3D_quit:
+register_desc_quit:
         free(matches);
+        free(ratios);
         cleanup_Mat_rm(&match_src_mm); 
         cleanup_Mat_rm(&match_ref_mm); 
         return SIFT3D_FAILURE;
 }
 
+/* Helper function to build an index of store, if *stale is true, that is if
+ * store or the index parameters changed since it was last built. */
+static int update_index(SIFT3D_Descriptor_index *const index, 
+        const SIFT3D_Descriptor_store *const store, int *const stale) {
+
+        if (!*stale)
+                return SIFT3D_SUCCESS;
+
+        if (build_SIFT3D_Descriptor_index(index, store))
+                return SIFT3D_FAILURE;
+
+        *stale = SIFT3D_FALSE;
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper function to draw a seed for the RANSAC generators from rand(). */
+static uint64_t draw_seed(void) {
+        return ((uint64_t) rand() << 32) ^ (uint64_t) rand();
+}
+
+/* Run the registration procedure. 
+ *
+ * Parameters: 
+ *   reg: The struct holding registration state.
+ *   tform: The output transformation. If NULL, this function only performs
+ *     feature matching.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int register_SIFT3D(Reg_SIFT3D *const reg, void *const tform) {
+
+        SIFT3D_Descriptor_store *const desc_src = &reg->desc_src;
+        SIFT3D_Descriptor_store *const desc_ref = &reg->desc_ref;
+
+        // Build the indices for approximate matching, unless they are 
+        // still valid from a previous call
+        if (use_index(reg) && desc_src->num > 0 && desc_ref->num > 0 &&
+                (update_index(&reg->index_src, desc_src, 
+                        &reg->index_src_stale) ||
+                update_index(&reg->index_ref, desc_ref, 
+                        &reg->index_ref_stale))) {
+                SIFT3D_ERR("register_SIFT3D: failed to build the descriptor "
+                        "indices \n");
+                return SIFT3D_FAILURE;
+        }
+
+        return register_desc(reg, desc_src, desc_ref, &reg->index_src, 
+                &reg->index_ref, reg->src_units, reg->ref_units, 
+                tform == NULL ? 0 : draw_seed(), &reg->match_src, 
+                &reg->match_ref, tform);
+}
+
+/* Helper function to initialize an index with the parameters of those in
+ * reg. */
+static int init_group_index(const Reg_SIFT3D *const reg, 
+        SIFT3D_Descriptor_index *const index) {
+
+        init_SIFT3D_Descriptor_index(index);
+
+        return set_num_trees_SIFT3D_Descriptor_index(index, 
+                        reg->index_ref.num_trees) ||
+                set_checks_SIFT3D_Descriptor_index(index, 
+                        reg->index_ref.checks);
+}
+
+/* Task to build the index of descriptor store i, for register_SIFT3D_group 
+ * and register_SIFT3D_all_pairs. */
+static void build_index_task(void *const arg, const int i) {
+
+        const Reg_group_task *const task = (const Reg_group_task *) arg;
+
+        // Empty stores are reported when they are registered
+        task->ret[i] = task->descs[i]->num > 0 ? 
+                build_SIFT3D_Descriptor_index(task->indices + i, 
+                        task->descs[i]) : SIFT3D_SUCCESS;
+}
+
+/* Task to register pair i, for register_SIFT3D_group and 
+ * register_SIFT3D_all_pairs. */
+static void register_pair_task(void *const arg, const int i) {
+
+        Mat_rm match_src, match_ref;
+
+        const Reg_group_task *const task = (const Reg_group_task *) arg;
+        const int src = task->src[i];
+        const int ref = task->ref[i];
+        const SIFT3D_Descriptor_store *const desc_ref = 
+                task->desc_ref != NULL ? task->desc_ref : task->descs[ref];
+        const SIFT3D_Descriptor_index *const index_src = 
+                task->indices != NULL ? task->indices + src : NULL;
+        const SIFT3D_Descriptor_index *const index_ref = 
+                task->desc_ref != NULL ? task->index_ref : 
+                task->indices != NULL ? task->indices + ref : NULL;
+        const double *const ref_units = 
+                task->ref_units != NULL ? task->ref_units : 
+                task->units + ref * IM_NDIMS;
+
+        if (init_Mat_rm(&match_src, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE) ||
+                init_Mat_rm(&match_ref, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE)) {
+                task->ret[i] = SIFT3D_FAILURE;
+                return;
+        }
+
+        task->ret[i] = register_desc(task->reg, task->descs[src], desc_ref,
+                index_src, index_ref, task->units + src * IM_NDIMS, 
+                ref_units, task->seeds[i], &match_src, &match_ref, 
+                task->tforms[i]);
+
+        cleanup_Mat_rm(&match_src);
+        cleanup_Mat_rm(&match_ref);
+}
+
+/* Helper function to run a set of registrations concurrently. Pair i
+ * registers store src[i] to store ref[i], or to the reference of task->reg
+ * if task->desc_ref is set. The seeds are drawn here, in order, so the 
+ * results do not depend on the number of threads. */
+static int run_group(Reg_group_task *const task, const int num_descs, 
+        const int num_pairs, int *const status) {
+
+        int i, ret;
+
+        const int approx = use_index(task->reg);
+
+        // Allocate intermediates
+        task->indices = NULL;
+        ret = SIFT3D_FAILURE;
+        if ((task->seeds = (uint64_t *) malloc(num_pairs * 
+                sizeof(uint64_t))) == NULL || 
+                (task->ret = (int *) malloc(SIFT3D_MAX(num_descs, num_pairs) *
+                        sizeof(int))) == NULL ||
+                (approx && (task->indices = (SIFT3D_Descriptor_index *) 
+                        malloc(num_descs * 
+                                sizeof(SIFT3D_Descriptor_index))) == NULL)) {
+                SIFT3D_ERR("register_SIFT3D_group: out of memory \n");
+                goto run_group_quit;
+        }
+
+        // Build the index of each store once
+        if (approx) {
+                for (i = 0; i < num_descs; i++) {
+                        if (init_group_index(task->reg, task->indices + i)) {
+                                while (i-- > 0)
+                                        cleanup_SIFT3D_Descriptor_index(
+                                                task->indices + i);
+                                free(task->indices);
+                                task->indices = NULL;
+                                goto run_group_quit;
+                        }
+                }
+                SIFT3D_parallel_for(num_descs, build_index_task, task);
+                for (i = 0; i < num_descs; i++) {
+                        if (task->ret[i]) {
+                                SIFT3D_ERR("register_SIFT3D_group: failed to "
+                                        "build the index of store %d \n", i);
+                                goto run_group_quit;
+                        }
+                }
+        }
+
+        // Draw the seeds in order
+        for (i = 0; i < num_pairs; i++) {
+                task->seeds[i] = draw_seed();
+        }
+
+        // Register the pairs
+        SIFT3D_parallel_for(num_pairs, register_pair_task, task);
+
+        // Collect the results
+        ret = SIFT3D_SUCCESS;
+        for (i = 0; i < num_pairs; i++) {
+                if (status != NULL)
+                        status[i] = task->ret[i];
+                if (task->ret[i])
+                        ret = SIFT3D_FAILURE;
+        }
+
+run_group_quit:
+        if (task->indices != NULL) {
+                for (i = 0; i < num_descs; i++) {
+                        cleanup_SIFT3D_Descriptor_index(task->indices + i);
+                }
+                free(task->indices);
+        }
+        free(task->seeds);
+        free(task->ret);
+        return ret;
+}
+
+/* Register a group of source images to the reference image of reg, as set 
+ * by set_ref_Reg_SIFT3D. The reference index is built once, and the sources 
+ * are matched and fitted concurrently, using the parameters of reg. The 
+ * results do not depend on the number of threads, and are the same as those
+ * of calling register_SIFT3D on each source in turn, after the same srand().
+ *
+ * Parameters:
+ *   reg - The struct holding the reference and the registration parameters.
+ *   descs - The descriptors of each source image, as from 
+ *     SIFT3D_extract_descriptors_cached.
+ *   units - A [num x IM_NDIMS] array of the units of each source image.
+ *   num - The number of source images.
+ *   tforms - The output transformation of each source image. Each must be
+ *     initialized, as for register_SIFT3D.
+ *   status - If not NULL, an array of num return codes, one for each source.
+ *
+ * Returns SIFT3D_SUCCESS if all sources were registered, SIFT3D_FAILURE 
+ * otherwise. */
+int register_SIFT3D_group(Reg_SIFT3D *const reg, 
+        const SIFT3D_Descriptor_store *const *const descs, 
+        const double *const units, const int num, void *const *const tforms,
+        int *const status) {
+
+        Reg_group_task task;
+        int *pairs;
+        int i, ret;
+
+        if (num < 1) {
+                SIFT3D_ERR("register_SIFT3D_group: invalid number of sources: "
+                        "%d \n", num);
+                return SIFT3D_FAILURE;
+        }
+	if (reg->desc_ref.num <= 0) {
+		SIFT3D_ERR("register_SIFT3D_group: no reference image "
+			"descriptors are available \n");
+		return SIFT3D_FAILURE;
+	}
+
+        // Build the reference index
+        if (use_index(reg) && update_index(&reg->index_ref, &reg->desc_ref,
+                &reg->index_ref_stale)) {
+                SIFT3D_ERR("register_SIFT3D_group: failed to build the "
+                        "reference index \n");
+                return SIFT3D_FAILURE;
+        }
+
+        // Pair each source with the reference
+        if ((pairs = (int *) malloc(num * sizeof(int))) == NULL) {
+                SIFT3D_ERR("register_SIFT3D_group: out of memory \n");
+                return SIFT3D_FAILURE;
+        }
+        for (i = 0; i < num; i++) {
+                pairs[i] = i;
+        }
+
+        task.reg = reg;
+        task.descs = descs;
+        task.units = units;
+        task.desc_ref = &reg->desc_ref;
+        task.index_ref = &reg->index_ref;
+        task.ref_units = reg->ref_units;
+        task.src = pairs;
+        task.ref = pairs;
+        task.tforms = tforms;
+        ret = run_group(&task, num, num, status);
+
+        free(pairs);
+        return ret;
+}
+
+/* Register every ordered pair of a group of images, for groupwise studies.
+ * The index of each store is built once and reused for all of its pairs.
+ * Otherwise this is the same as register_SIFT3D_group.
+ *
+ * Parameters:
+ *   reg - The struct holding the registration parameters. Its source and
+ *     reference images are not used.
+ *   descs - The descriptors of each image.
+ *   units - A [num x IM_NDIMS] array of the units of each image.
+ *   num - The number of images.
+ *   tforms - A [num x num] array of output transformations, where 
+ *     tforms[i * num + j] registers image i to image j. The diagonal is not
+ *     used and may be NULL.
+ *   status - If not NULL, a [num x num] array of return codes in the same 
+ *     layout as tforms. The diagonal is set to SIFT3D_SUCCESS.
+ *
+ * Returns SIFT3D_SUCCESS if all pairs were registered, SIFT3D_FAILURE 
+ * otherwise. */
+int register_SIFT3D_all_pairs(Reg_SIFT3D *const reg, 
+        const SIFT3D_Descriptor_store *const *const descs, 
+        const double *const units, const int num, void *const *const tforms,
+        int *const status) {
+
+        Reg_group_task task;
+        void **pair_tforms;
+        int *src, *ref, *pair_status;
+        int i, j, k, ret;
+
+        const int num_pairs = num * (num - 1);
+
+        if (num < 2) {
+                SIFT3D_ERR("register_SIFT3D_all_pairs: invalid number of "
+                        "images: %d \n", num);
+                return SIFT3D_FAILURE;
+        }
+
+        // List the off-diagonal pairs
+        ret = SIFT3D_FAILURE;
+        pair_tforms = NULL;
+        pair_status = NULL;
+        ref = NULL;
+        if ((src = (int *) malloc(num_pairs * sizeof(int))) == NULL ||
+                (ref = (int *) malloc(num_pairs * sizeof(int))) == NULL ||
+                (pair_tforms = (void **) malloc(num_pairs * sizeof(void *))) 
+                        == NULL ||
+                (pair_status = (int *) malloc(num_pairs * sizeof(int))) 
+                        == NULL) {
+                SIFT3D_ERR("register_SIFT3D_all_pairs: out of memory \n");
+                goto all_pairs_quit;
+        }
+        k = 0;
+        for (i = 0; i < num; i++) {
+                for (j = 0; j < num; j++) {
+                        if (i == j)
+                                continue;
+                        src[k] = i;
+                        ref[k] = j;
+                        pair_tforms[k] = tforms[i * num + j];
+                        k++;
+                }
+        }
+
+        task.reg = reg;
+        task.descs = descs;
+        task.units = units;
+        task.desc_ref = NULL;
+        task.index_ref = NULL;
+        task.ref_units = NULL;
+        task.src = src;
+        task.ref = ref;
+        task.tforms = pair_tforms;
+        ret = run_group(&task, num, num_pairs, pair_status);
+
+        // Expand the status to the full matrix
+        if (status != NULL) {
+                for (i = 0; i < num; i++) {
+                        status[i * num + i] = SIFT3D_SUCCESS;
+                }
+                for (k = 0; k < num_pairs; k++) {
+                        status[src[k] * num + ref[k]] = 
+                                pair_status[k];
+                }
+        }
+
+all_pairs_quit:
+        free(src);
+        free(ref);
+        free(pair_tforms);
+        free(pair_status);
+        return ret;
+}
+
 /* Helper function to scale the descriptors by the given factors */
 static void scale_SIFT3D(const double *const factors, 
 	SIFT3D_Descriptor_store *const d) {
@@ -369,8 +1042,11 @@ int register_SIFT3D_resample(Reg_SIFT3D *const reg, const Image *const src,
 	double units_min[IM_NDIMS], factors_src[IM_NDIMS], 
 		factors_ref[IM_NDIMS];
 	Image src_interp, ref_interp;
+        double start;
 	int i;
 
+        SIFT3D_Stats *const stats = reg->sift3d.stats;
+
 	// Check for the trivial case, when src and dst have the same units
 	if (!memcmp(SIFT3D_IM_GET_UNITS(src), SIFT3D_IM_GET_UNITS(ref), 
 		IM_NDIMS * sizeof(double))) {
@@ -399,9 +1075,13 @@ int register_SIFT3D_resample(Reg_SIFT3D *const reg, const Image *const src,
 	}
 
 	// Resample the images
+        start = SIFT3D_STATS_START(stats);
 	if (im_resample(src, units_min, interp, &src_interp) ||
 		im_resample(ref, units_min, interp, &ref_interp))
 		goto register_interp_quit;
+        record_SIFT3D_Stats(stats, SIFT3D_STAGE_WARP, start, 
+                src_interp.size + ref_interp.size, 0, 
+                (src_interp.size + ref_interp.size) * sizeof(float));
 
 	// Extract features from the interpolated images
 	if (set_src_Reg_SIFT3D(reg, &src_interp) ||
@@ -26,8 +26,14 @@ typedef struct _Reg_SIFT3D {
         SIFT3D sift3d;
         Ransac ran;
         SIFT3D_Descriptor_store desc_src, desc_ref;
+        SIFT3D_Descriptor_index index_src, index_ref;
+        int index_src_stale, index_ref_stale; // Whether to rebuild the index
+        Image src_mask, ref_mask; // Empty unless set
         Mat_rm match_src, match_ref;
         double nn_thresh;
+        int nn_checks; // If positive, use approximate matching
+        double match_radius; // If positive, use spatially bounded matching
+        void *tform_init; // Initial ref->src transformation, or NULL
         int verbose;
 
 } Reg_SIFT3D;
@@ -38,15 +44,38 @@ void cleanup_Reg_SIFT3D(Reg_SIFT3D *const reg);
 
 int register_SIFT3D(Reg_SIFT3D *const reg, void *const tform);
 
+int register_SIFT3D_group(Reg_SIFT3D *const reg, 
+        const SIFT3D_Descriptor_store *const *const descs, 
+        const double *const units, const int num, void *const *const tforms,
+        int *const status);
+
+int register_SIFT3D_all_pairs(Reg_SIFT3D *const reg, 
+        const SIFT3D_Descriptor_store *const *const descs, 
+        const double *const units, const int num, void *const *const tforms,
+        int *const status);
+
 int register_SIFT3D_resample(Reg_SIFT3D *const reg, const Image *const src,
 	const Image *const ref, const interp_type interp, void *const tform);
 
 int set_nn_thresh_Reg_SIFT3D(Reg_SIFT3D *const reg, const double nn_thresh);
 
+int set_nn_checks_Reg_SIFT3D(Reg_SIFT3D *const reg, const int nn_checks);
+
+int set_match_radius_Reg_SIFT3D(Reg_SIFT3D *const reg, 
+        const void *const tform_init, const double radius);
+
 int set_Ransac_Reg_SIFT3D(Reg_SIFT3D *const reg, const Ransac *const ran);
 
 int set_SIFT3D_Reg_SIFT3D(Reg_SIFT3D *const reg, const SIFT3D *const sift3d);
 
+void set_cache_Reg_SIFT3D(Reg_SIFT3D *const reg, SIFT3D_Cache *const cache);
+
+void set_stats_Reg_SIFT3D(Reg_SIFT3D *const reg, SIFT3D_Stats *const stats);
+
+int set_src_mask_Reg_SIFT3D(Reg_SIFT3D *const reg, const Image *const mask);
+
+int set_ref_mask_Reg_SIFT3D(Reg_SIFT3D *const reg, const Image *const mask);
+
 int set_src_Reg_SIFT3D(Reg_SIFT3D *const reg, const Image *const src);
 
 int set_ref_Reg_SIFT3D(Reg_SIFT3D *const reg, const Image *const ref);
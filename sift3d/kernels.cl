@@ -0,0 +1,756 @@
+/* -----------------------------------------------------------------------------
+ * kernels.cl
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2015-2016 Blaine Rister et al., see LICENSE for details.
+ * -----------------------------------------------------------------------------
+ * This file contains the OpenCL kernels of the SIFT3D GPU backend, see
+ * sift_cl.c. Each kernel reproduces the arithmetic of the corresponding CPU
+ * routine in sift.c or imutil.c, so that both backends find the same
+ * keypoints.
+ *
+ * The constants of sift.c are defined by the host when compiling this file:
+ * NHIST_PER_DIM, HIST_NUMEL, DESC_NUMEL, NUM_TRI, ORI_RAD_FCTR,
+ * ORI_GRAD_THRESH, MAX_EIG_RATIO, BARY_EPS, DESC_SIG_FCTR, DESC_RAD_FCTR and
+ * TRUNC_THRESH.
+ *
+ * Images are stored in buffers with the default stride, with one channel.
+ * Every image of a pyramid is stored in the same buffer, at the offset given
+ * by its Level struct.
+ * -----------------------------------------------------------------------------
+ */
+
+// Accumulate in double precision, if the device supports it
+#ifdef cl_khr_fp64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double acc_t;
+#define ACC_EPSILON DBL_EPSILON
+#else
+typedef float acc_t;
+#define ACC_EPSILON FLT_EPSILON
+#endif
+
+/* Geometry of a pyramid level. Must match Cl_level in sift_cl.c. */
+typedef struct _Level {
+        ulong offset;           // Index of the first voxel in the buffer
+        int nx, ny, nz, pad;    // Dimensions
+        float ux, uy, uz, s;    // Units and scale parameter
+} Level;
+
+/* A keypoint. Must match Cl_key in sift_cl.h. */
+typedef struct _Key {
+        float xd, yd, zd, sd;   // Position, in level voxels, and scale
+        int o, s, level, pad;   // Pyramid indices, and index of the Level
+        float R[9];             // Rotation matrix, in row-major order
+} Key;
+
+// Get the index of voxel [x, y, z] of an image
+#define VOX_IDX(off, nx, ny, x, y, z) \
+        ((off) + (ulong) (x) + (ulong) (nx) * ((ulong) (y) + \
+        (ulong) (ny) * (ulong) (z)))
+
+/* Mirror an index into the range [0, n - 1], as mirror_idx in imutil.c. */
+int mirror_idx(int i, const int n) {
+
+        const int period = 2 * (n - 1);
+
+        if (n < 2)
+                return 0;
+
+        i %= period;
+        if (i < 0)
+                i += period;
+
+        return i < n ? i : period - i;
+}
+
+/* Convolve dimension dim of an image with a filter whose taps are step
+ * voxels apart, mirroring the boundaries, as convolve_sep_fast in
+ * imutil.c. */
+kernel void conv_step(global const float *src, const ulong src_off,
+        global float *dst, const ulong dst_off, const int nx, const int ny,
+        const int nz, const int dim, global const float *taps,
+        const ulong taps_off, const int width, const int step) {
+
+        int c[3];
+        float acc;
+        int j;
+
+        const int x = get_global_id(0);
+        const int y = get_global_id(1);
+        const int z = get_global_id(2);
+        const int n[3] = {nx, ny, nz};
+        const int half_width = width / 2;
+
+        if (x >= nx || y >= ny || z >= nz)
+                return;
+
+        acc = 0.0f;
+        for (j = 0; j < width; j++) {
+                c[0] = x;
+                c[1] = y;
+                c[2] = z;
+                c[dim] = mirror_idx(c[dim] + (half_width - j) * step, n[dim]);
+                acc += taps[taps_off + j] * src[VOX_IDX(src_off, nx, ny,
+                        c[0], c[1], c[2])];
+        }
+
+        dst[VOX_IDX(dst_off, nx, ny, x, y, z)] = acc;
+}
+
+/* Sample src at base + off in dimension dim, with linear interpolation, as
+ * the SAMP_AND_ACC macro in imutil.c. */
+float conv_sample(global const float *src, const ulong src_off,
+        const int *const n, const int *const base, const int dim,
+        const float off) {
+
+        int lo[3], hi[3];
+        float off_lo, frac;
+        int i;
+
+        for (i = 0; i < 3; i++) {
+                lo[i] = base[i];
+        }
+
+        off_lo = floor(off);
+        if (lo[dim] + (int) off_lo < 0)
+                off_lo = (float) -lo[dim];
+        frac = off - off_lo;
+        lo[dim] += (int) off_lo;
+
+        // The upper sample has no weight at the last voxel
+        for (i = 0; i < 3; i++) {
+                hi[i] = lo[i];
+        }
+        hi[dim] = lo[dim] + 1 < n[dim] ? lo[dim] + 1 : lo[dim];
+
+        return (1.0f - frac) * src[VOX_IDX(src_off, n[0], n[1], lo[0], lo[1],
+                lo[2])] + frac * src[VOX_IDX(src_off, n[0], n[1], hi[0],
+                hi[1], hi[2])];
+}
+
+/* Convolve dimension dim of an image with a filter whose taps are
+ * unit_factor voxels apart, resampling with linear interpolation, as
+ * convolve_sep_gen in imutil.c. */
+kernel void conv_gen(global const float *src, const ulong src_off,
+        global float *dst, const ulong dst_off, const int nx, const int ny,
+        const int nz, const int dim, global const float *taps,
+        const ulong taps_off, const int width, const float unit_factor) {
+
+        int base[3];
+        float acc;
+        int d;
+
+        const int x = get_global_id(0);
+        const int y = get_global_id(1);
+        const int z = get_global_id(2);
+        const int n[3] = {nx, ny, nz};
+        const int coords[3] = {x, y, z};
+        const int half_width = width / 2;
+        const int unit_half_width = (int) ceil(half_width * unit_factor);
+        const int start = unit_half_width;
+        const int end = n[dim] - 1 - unit_half_width - 1;
+        const int dim_end = n[dim] - 1;
+        const float conv_eps = 0.1f;
+
+        if (x >= nx || y >= ny || z >= nz)
+                return;
+
+        acc = 0.0f;
+        for (d = -half_width; d <= half_width; d++) {
+
+                float off;
+
+                const float tap = taps[taps_off + d + half_width];
+                const float step = d * unit_factor;
+                const float coord = (float) coords[dim] - step;
+                const float end_dist = (float) (coords[dim] - dim_end) - step;
+
+                base[0] = x;
+                base[1] = y;
+                base[2] = z;
+
+                // Mirror the coordinates of the boundary voxels
+                if (coords[dim] >= start && coords[dim] <= end) {
+                        off = -step;
+                } else if ((int) coord < 0) {
+                        base[dim] = 0;
+                        off = -coord;
+                } else if (end_dist >= 0.0f) {
+                        base[dim] = dim_end;
+                        off = -end_dist - conv_eps;
+                } else {
+                        off = -step;
+                }
+
+                acc += tap * conv_sample(src, src_off, n, base, dim, off);
+        }
+
+        dst[VOX_IDX(dst_off, nx, ny, x, y, z)] = acc;
+}
+
+/* Downsample an image by a factor of 2 in each dimension, as
+ * im_downsample_2x in imutil.c. */
+kernel void downsample_2x(global const float *src, const ulong src_off,
+        const int src_nx, const int src_ny, global float *dst,
+        const ulong dst_off, const int nx, const int ny, const int nz) {
+
+        const int x = get_global_id(0);
+        const int y = get_global_id(1);
+        const int z = get_global_id(2);
+
+        if (x >= nx || y >= ny || z >= nz)
+                return;
+
+        dst[VOX_IDX(dst_off, nx, ny, x, y, z)] =
+                src[VOX_IDX(src_off, src_nx, src_ny, x << 1, y << 1, z << 1)];
+}
+
+/* Compute a DoG level as the difference of two Gaussian levels. */
+kernel void dog(global const float *gpyr, const ulong cur_off,
+        const ulong next_off, global float *dog, const ulong dog_off,
+        const ulong numel) {
+
+        const ulong i = get_global_id(0);
+
+        if (i >= numel)
+                return;
+
+        dog[dog_off + i] = gpyr[cur_off + i] - gpyr[next_off + i];
+}
+
+/* Compute the maximum absolute value of each row of an image. */
+kernel void max_abs_rows(global const float *im, const ulong off,
+        const int nx, const int num_rows, global float *row_max) {
+
+        float max;
+        int x;
+
+        const int row = get_global_id(0);
+
+        if (row >= num_rows)
+                return;
+
+        max = 0.0f;
+        for (x = 0; x < nx; x++) {
+                max = fmax(max, fabs(im[off + (ulong) row * nx + x]));
+        }
+
+        row_max[row] = max;
+}
+
+/* Reduce the row maxima of max_abs_rows, storing the result in max[idx].
+ * Runs in a single work-item. */
+kernel void max_reduce(global const float *row_max, const int num_rows,
+        global float *max, const int idx) {
+
+        float acc;
+        int i;
+
+        acc = 0.0f;
+        for (i = 0; i < num_rows; i++) {
+                acc = fmax(acc, row_max[i]);
+        }
+
+        max[idx] = acc;
+}
+
+/* Find the local extrema of the interior of a DoG level, as
+ * detect_extrema_level in sift.c, appending them to keys. If there are
+ * more than cap extrema, the rest are only counted. */
+kernel void detect_extrema(global const float *dog, const ulong prev_off,
+        const ulong cur_off, const ulong next_off, const int nx,
+        const int ny, const int nz, global const float *dogmax,
+        const int dog_idx, const float peak_thresh, const int o, const int s,
+        const int level, const float sd, global Key *keys,
+        volatile global int *count, const int cap) {
+
+        float pcur;
+        ulong i;
+        int is_max, is_min, idx;
+
+        const int x = get_global_id(0) + 1;
+        const int y = get_global_id(1) + 1;
+        const int z = get_global_id(2) + 1;
+        const ulong ys = (ulong) nx;
+        const ulong zs = (ulong) nx * ny;
+        const float thresh = peak_thresh * dogmax[dog_idx];
+
+        if (x >= nx - 1 || y >= ny - 1 || z >= nz - 1)
+                return;
+
+        i = VOX_IDX(0, nx, ny, x, y, z);
+        pcur = dog[cur_off + i];
+
+        // Apply the peak threshold
+        if (!(pcur > thresh || pcur < -thresh))
+                return;
+
+        // Compare to the neighbors in this level and the adjacent ones
+        is_max = pcur > dog[prev_off + i] && pcur > dog[next_off + i] &&
+                pcur > dog[cur_off + i + 1] && pcur > dog[cur_off + i - 1] &&
+                pcur > dog[cur_off + i + ys] && pcur > dog[cur_off + i - ys] &&
+                pcur > dog[cur_off + i + zs] && pcur > dog[cur_off + i - zs];
+        is_min = pcur < dog[prev_off + i] && pcur < dog[next_off + i] &&
+                pcur < dog[cur_off + i + 1] && pcur < dog[cur_off + i - 1] &&
+                pcur < dog[cur_off + i + ys] && pcur < dog[cur_off + i - ys] &&
+                pcur < dog[cur_off + i + zs] && pcur < dog[cur_off + i - zs];
+        if (!is_max && !is_min)
+                return;
+
+        // Append the keypoint
+        idx = atomic_inc(count);
+        if (idx >= cap)
+                return;
+        keys[idx].xd = (float) x;
+        keys[idx].yd = (float) y;
+        keys[idx].zd = (float) z;
+        keys[idx].sd = sd;
+        keys[idx].o = o;
+        keys[idx].s = s;
+        keys[idx].level = level;
+}
+
+/* Get the bounds of a spherical window in dimension i, as
+ * IM_LOOP_SPHERE_START in sift.c. */
+void sphere_bounds(const float center, const acc_t rad, const float unit,
+        const int n, int *const start, int *const end) {
+
+        const float lo = floor((float) (center - rad / unit));
+        const float hi = ceil((float) (center + rad / unit));
+
+        *start = lo > 1.0f ? (int) lo : 1;
+        *end = hi < (float) (n - 2) ? (int) hi : n - 2;
+}
+
+/* Get the isotropic gradient of an image at an interior voxel, as
+ * IM_GET_GRAD_ISO in sift.c. */
+void get_grad_iso(global const float *im, const Level *const lev,
+        const int x, const int y, const int z, float *const vd) {
+
+        const ulong ys = (ulong) lev->nx;
+        const ulong zs = (ulong) lev->nx * lev->ny;
+        const ulong i = VOX_IDX(lev->offset, lev->nx, lev->ny, x, y, z);
+
+        vd[0] = 0.5f * (im[i + 1] - im[i - 1]);
+        vd[1] = 0.5f * (im[i + ys] - im[i - ys]);
+        vd[2] = 0.5f * (im[i + zs] - im[i - zs]);
+        vd[0] *= 1.0f / lev->ux;
+        vd[1] *= 1.0f / lev->uy;
+        vd[2] *= 1.0f / lev->uz;
+}
+
+/* Eigendecomposition of a symmetric [3x3] matrix by the cyclic Jacobi method.
+ * On return, w holds the eigenvalues in ascending order, and the columns of
+ * the row-major matrix q hold the corresponding eigenvectors. a is
+ * overwritten. */
+void eig3_jacobi(acc_t *const a, acc_t *const q, acc_t *const w) {
+
+        int sweep, i, j, k, p, r;
+
+        const int max_sweeps = 50;
+
+        for (i = 0; i < 9; i++) {
+                q[i] = i % 4 == 0 ? 1.0 : 0.0;
+        }
+
+        for (sweep = 0; sweep < max_sweeps; sweep++) {
+
+                const acc_t off = a[1] * a[1] + a[2] * a[2] + a[5] * a[5];
+                const acc_t diag = a[0] * a[0] + a[4] * a[4] + a[8] * a[8];
+
+                if (off <= ACC_EPSILON * ACC_EPSILON * diag)
+                        break;
+
+                for (p = 0; p < 2; p++) {
+                for (r = p + 1; r < 3; r++) {
+
+                        acc_t theta, t, c, s;
+
+                        const acc_t apr = a[3 * p + r];
+
+                        if (apr == 0.0)
+                                continue;
+
+                        // Compute the rotation which zeros a[p][r]
+                        theta = (a[4 * r] - a[4 * p]) / (2.0 * apr);
+                        t = (theta >= 0.0 ? 1.0 : -1.0) /
+                                (fabs(theta) + sqrt(theta * theta + 1.0));
+                        c = 1.0 / sqrt(t * t + 1.0);
+                        s = t * c;
+
+                        // Apply it to the columns, rows and eigenvectors
+                        for (k = 0; k < 3; k++) {
+                                const acc_t akp = a[3 * k + p];
+                                const acc_t akr = a[3 * k + r];
+                                a[3 * k + p] = c * akp - s * akr;
+                                a[3 * k + r] = s * akp + c * akr;
+                        }
+                        for (k = 0; k < 3; k++) {
+                                const acc_t apk = a[3 * p + k];
+                                const acc_t ark = a[3 * r + k];
+                                a[3 * p + k] = c * apk - s * ark;
+                                a[3 * r + k] = s * apk + c * ark;
+                        }
+                        for (k = 0; k < 3; k++) {
+                                const acc_t qkp = q[3 * k + p];
+                                const acc_t qkr = q[3 * k + r];
+                                q[3 * k + p] = c * qkp - s * qkr;
+                                q[3 * k + r] = s * qkp + c * qkr;
+                        }
+                }}
+        }
+
+        // Sort in ascending order
+        for (i = 0; i < 3; i++) {
+                w[i] = a[4 * i];
+        }
+        for (i = 0; i < 2; i++) {
+        for (j = 0; j < 2 - i; j++) {
+
+                acc_t temp;
+
+                if (w[j] <= w[j + 1])
+                        continue;
+
+                temp = w[j];
+                w[j] = w[j + 1];
+                w[j + 1] = temp;
+                for (k = 0; k < 3; k++) {
+                        temp = q[3 * k + j];
+                        q[3 * k + j] = q[3 * k + j + 1];
+                        q[3 * k + j + 1] = temp;
+                }
+        }}
+}
+
+/* Assign an orientation to each keypoint, as assign_orientations in sift.c.
+ * Rejected keypoints are marked with negative coordinates. */
+kernel void assign_orientations(global const float *gpyr,
+        global const Level *levels, global Key *keys, const int num,
+        const float ori_sig_fctr, const float corner_thresh) {
+
+        acc_t A[9], Q[9], L[3];
+        float vd_win[3], v[2][3], vr[3];
+        acc_t sigma, win_radius;
+        float d, cos_ang, corner_score, sgn;
+        int x_start, x_end, y_start, y_end, z_start, z_end, x, y, z, i, j;
+
+        const int k = get_global_id(0);
+
+        if (k >= num)
+                return;
+
+        global Key *const key = keys + k;
+        const Level lev = levels[key->level];
+
+        sigma = (acc_t) ori_sig_fctr * key->sd;
+        win_radius = sigma * ORI_RAD_FCTR;
+
+        // Form the structure tensor and window gradient
+        for (i = 0; i < 9; i++) {
+                A[i] = 0.0;
+        }
+        for (i = 0; i < 3; i++) {
+                vd_win[i] = 0.0f;
+        }
+        sphere_bounds(key->xd, win_radius, lev.ux, lev.nx, &x_start, &x_end);
+        sphere_bounds(key->yd, win_radius, lev.uy, lev.ny, &y_start, &y_end);
+        sphere_bounds(key->zd, win_radius, lev.uz, lev.nz, &z_start, &z_end);
+        for (z = z_start; z <= z_end; z++) {
+        for (y = y_start; y <= y_end; y++) {
+        for (x = x_start; x <= x_end; x++) {
+
+                float vd[3];
+                float weight;
+
+                const float dx = ((float) x - key->xd) * lev.ux;
+                const float dy = ((float) y - key->yd) * lev.uy;
+                const float dz = ((float) z - key->zd) * lev.uz;
+                const float sq_dist = dx * dx + dy * dy + dz * dz;
+
+                if (sq_dist > win_radius * win_radius)
+                        continue;
+
+                // Compute Gaussian weighting, ignoring the constant factor
+                weight = exp((float) (-0.5 * sq_dist / (sigma * sigma)));
+
+                // Get the gradient
+                get_grad_iso(gpyr, &lev, x, y, z, vd);
+
+                // Update the structure tensor
+                A[0] += (acc_t) vd[0] * vd[0] * weight;
+                A[1] += (acc_t) vd[0] * vd[1] * weight;
+                A[2] += (acc_t) vd[0] * vd[2] * weight;
+                A[4] += (acc_t) vd[1] * vd[1] * weight;
+                A[5] += (acc_t) vd[1] * vd[2] * weight;
+                A[8] += (acc_t) vd[2] * vd[2] * weight;
+
+                // Update the window gradient
+                for (i = 0; i < 3; i++) {
+                        vd_win[i] += vd[i] * weight;
+                }
+        }}}
+        A[3] = A[1];
+        A[6] = A[2];
+        A[7] = A[5];
+
+        // Reject keypoints with weak gradient
+        if (vd_win[0] * vd_win[0] + vd_win[1] * vd_win[1] +
+                vd_win[2] * vd_win[2] < ORI_GRAD_THRESH)
+                goto assign_orientations_reject;
+
+        // Get the eigendecomposition, and test the eigenvectors for stability
+        eig3_jacobi(A, Q, L);
+        for (i = 0; i < 2; i++) {
+                if (fabs(L[i] / L[i + 1]) > MAX_EIG_RATIO)
+                        goto assign_orientations_reject;
+        }
+
+        // Assign signs to the first two eigenvectors, in descending order
+        corner_score = FLT_MAX;
+        for (i = 0; i < 2; i++) {
+
+                const int eig_idx = 2 - i;
+
+                for (j = 0; j < 3; j++) {
+                        vr[j] = (float) Q[3 * j + eig_idx];
+                }
+
+                // Get the directional derivative
+                d = vd_win[0] * vr[0] + vd_win[1] * vr[1] + vd_win[2] * vr[2];
+
+                // Get the cosine of the angle to the gradient
+                cos_ang = d / (sqrt(vr[0] * vr[0] + vr[1] * vr[1] +
+                        vr[2] * vr[2]) * sqrt(vd_win[0] * vd_win[0] +
+                        vd_win[1] * vd_win[1] + vd_win[2] * vd_win[2]));
+                corner_score = fmin(corner_score, fabs(cos_ang));
+
+                // Enforce positive directional derivative
+                sgn = d > 0.0f ? 1.0f : -1.0f;
+                for (j = 0; j < 3; j++) {
+                        v[i][j] = vr[j] * sgn;
+                        key->R[3 * j + i] = v[i][j];
+                }
+        }
+
+        // The last vector is the cross product of the first two
+        key->R[2] = v[0][1] * v[1][2] - v[0][2] * v[1][1];
+        key->R[5] = v[0][2] * v[1][0] - v[0][0] * v[1][2];
+        key->R[8] = v[0][0] * v[1][1] - v[0][1] * v[1][0];
+
+        if (corner_score < corner_thresh)
+                goto assign_orientations_reject;
+
+        return;
+
+assign_orientations_reject:
+        key->xd = key->yd = key->zd = -1.0f;
+}
+
+/* Convert a vector to barycentric coordinates in triangle tri, as cart2bary
+ * in sift.c. Returns nonzero on success. */
+int cart2bary(const float *const cart, global const float *const tri,
+        float *const bary, float *const k) {
+
+        float e1[3], e2[3], t[3], p[3], q[3];
+        float det, det_inv;
+        int i;
+
+        for (i = 0; i < 3; i++) {
+                e1[i] = tri[3 + i] - tri[i];
+                e2[i] = tri[6 + i] - tri[i];
+                t[i] = tri[i] * -1.0f;
+        }
+        p[0] = cart[1] * e2[2] - cart[2] * e2[1];
+        p[1] = cart[2] * e2[0] - cart[0] * e2[2];
+        p[2] = cart[0] * e2[1] - cart[1] * e2[0];
+        det = e1[0] * p[0] + e1[1] * p[1] + e1[2] * p[2];
+
+        // Reject unstable points
+        if (fabs(det) < BARY_EPS)
+                return 0;
+
+        det_inv = 1.0f / det;
+
+        q[0] = t[1] * e1[2] - t[2] * e1[1];
+        q[1] = t[2] * e1[0] - t[0] * e1[2];
+        q[2] = t[0] * e1[1] - t[1] * e1[0];
+
+        bary[1] = det_inv * (t[0] * p[0] + t[1] * p[1] + t[2] * p[2]);
+        bary[2] = det_inv * (cart[0] * q[0] + cart[1] * q[1] +
+                cart[2] * q[2]);
+        bary[0] = 1.0f - bary[1] - bary[2];
+
+        *k = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * det_inv;
+
+        return 1;
+}
+
+/* Normalize a descriptor, as normalize_desc in sift.c. */
+void normalize_desc(global float *const desc) {
+
+        acc_t norm;
+        float norm_inv;
+        int i;
+
+        norm = 0.0;
+        for (i = 0; i < DESC_NUMEL; i++) {
+                norm += (acc_t) desc[i] * desc[i];
+        }
+        norm = sqrt(norm) + ACC_EPSILON;
+        norm_inv = (float) (1.0 / norm);
+
+        for (i = 0; i < DESC_NUMEL; i++) {
+                desc[i] *= norm_inv;
+        }
+}
+
+/* Extract the descriptor of each keypoint, as extract_descrip in sift.c.
+ * The descriptor of keypoint k is written to elements
+ * [k * DESC_NUMEL, (k + 1) * DESC_NUMEL) of desc. The icosahedral mesh is
+ * given by the vertices of each triangle, tri_v, and the histogram bin of
+ * each vertex, tri_idx. */
+kernel void extract_descriptors(global const float *gpyr,
+        global const Level *levels, global const Key *keys, const int num,
+        global const float *tri_v, global const int *tri_idx,
+        global float *desc_buf) {
+
+        float Rt[9];
+        float sigma, win_radius, desc_half_width, desc_bin_fctr;
+        int x_start, x_end, y_start, y_end, z_start, z_end, x, y, z, i;
+
+        const int k = get_global_id(0);
+
+        if (k >= num)
+                return;
+
+        global const Key *const key = keys + k;
+        global float *const desc = desc_buf + (ulong) k * DESC_NUMEL;
+        const Level lev = levels[key->level];
+
+        // Compute basic parameters
+        sigma = key->sd * DESC_SIG_FCTR;
+        win_radius = DESC_RAD_FCTR * sigma;
+        desc_half_width = (float) (win_radius / sqrt((acc_t) 2.0));
+        desc_bin_fctr = 1.0f / (2.0f * desc_half_width / NHIST_PER_DIM);
+
+        // Invert the rotation matrix
+        for (i = 0; i < 9; i++) {
+                Rt[i] = key->R[3 * (i % 3) + i / 3];
+        }
+
+        // Zero the descriptor
+        for (i = 0; i < DESC_NUMEL; i++) {
+                desc[i] = 0.0f;
+        }
+
+        // Iterate over a sphere window in real-world coordinates
+        sphere_bounds(key->xd, win_radius, lev.ux, lev.nx, &x_start, &x_end);
+        sphere_bounds(key->yd, win_radius, lev.uy, lev.ny, &y_start, &y_end);
+        sphere_bounds(key->zd, win_radius, lev.uz, lev.nz, &z_start, &z_end);
+        for (z = z_start; z <= z_end; z++) {
+        for (y = y_start; y <= y_end; y++) {
+        for (x = x_start; x <= x_end; x++) {
+
+                float vim[3], vbins[3], dvbins[3], grad[3], grad_rot[3],
+                        bary[3];
+                float weight, mag, kk;
+                int bin, dx, dy, dz;
+
+                vim[0] = ((float) x - key->xd) * lev.ux;
+                vim[1] = ((float) y - key->yd) * lev.uy;
+                vim[2] = ((float) z - key->zd) * lev.uz;
+                const float sq_dist = vim[0] * vim[0] + vim[1] * vim[1] +
+                        vim[2] * vim[2];
+
+                if (sq_dist > win_radius * win_radius)
+                        continue;
+
+                // Rotate to keypoint space, and compute the spatial bins
+                for (i = 0; i < 3; i++) {
+                        const float vkp = Rt[3 * i] * vim[0] +
+                                Rt[3 * i + 1] * vim[1] + Rt[3 * i + 2] * vim[2];
+                        vbins[i] = (vkp + desc_half_width) * desc_bin_fctr;
+                }
+
+                // Reject points outside the rectangular descriptor
+                if (vbins[0] < 0 || vbins[1] < 0 || vbins[2] < 0 ||
+                        vbins[0] >= (float) NHIST_PER_DIM ||
+                        vbins[1] >= (float) NHIST_PER_DIM ||
+                        vbins[2] >= (float) NHIST_PER_DIM)
+                        continue;
+
+                // Take the gradient, apply a Gaussian window, and rotate it
+                // to keypoint space
+                get_grad_iso(gpyr, &lev, x, y, z, grad);
+                weight = exp(-0.5f * sq_dist / (sigma * sigma));
+                for (i = 0; i < 3; i++) {
+                        grad[i] = grad[i] * weight;
+                }
+                for (i = 0; i < 3; i++) {
+                        grad_rot[i] = Rt[3 * i] * grad[0] +
+                                Rt[3 * i + 1] * grad[1] +
+                                Rt[3 * i + 2] * grad[2];
+                }
+
+                // Find the intersecting face of the icosahedron
+                if (grad_rot[0] * grad_rot[0] + grad_rot[1] * grad_rot[1] +
+                        grad_rot[2] * grad_rot[2] < BARY_EPS)
+                        continue;
+                for (bin = 0; bin < NUM_TRI; bin++) {
+
+                        if (!cart2bary(grad_rot, tri_v + 9 * bin, bary, &kk))
+                                continue;
+
+                        if (bary[0] < -BARY_EPS || bary[1] < -BARY_EPS ||
+                                bary[2] < -BARY_EPS || kk < 0)
+                                continue;
+
+                        break;
+                }
+                if (bin == NUM_TRI)
+                        continue;
+                mag = sqrt(grad_rot[0] * grad_rot[0] +
+                        grad_rot[1] * grad_rot[1] + grad_rot[2] * grad_rot[2]);
+
+                // Accumulate by trilinear interpolation over the histograms,
+                // and barycentric interpolation over the vertices
+                for (i = 0; i < 3; i++) {
+                        dvbins[i] = vbins[i] - floor(vbins[i]);
+                }
+                for (dx = 0; dx < 2; dx++) {
+                for (dy = 0; dy < 2; dy++) {
+                for (dz = 0; dz < 2; dz++) {
+
+                        global float *hist;
+                        float w;
+
+                        const int hx = (int) vbins[0] + dx;
+                        const int hy = (int) vbins[1] + dy;
+                        const int hz = (int) vbins[2] + dz;
+
+                        if (hx < 0 || hx >= NHIST_PER_DIM ||
+                                hy < 0 || hy >= NHIST_PER_DIM ||
+                                hz < 0 || hz >= NHIST_PER_DIM)
+                                continue;
+
+                        hist = desc + HIST_NUMEL * (hx + hy * NHIST_PER_DIM +
+                                hz * NHIST_PER_DIM * NHIST_PER_DIM);
+
+                        w = ((dx == 0) ? (1.0f - dvbins[0]) : dvbins[0]) *
+                                ((dy == 0) ? (1.0f - dvbins[1]) : dvbins[1]) *
+                                ((dz == 0) ? (1.0f - dvbins[2]) : dvbins[2]);
+
+                        hist[tri_idx[3 * bin]] += mag * w * bary[0];
+                        hist[tri_idx[3 * bin + 1]] += mag * w * bary[1];
+                        hist[tri_idx[3 * bin + 2]] += mag * w * bary[2];
+                }}}
+        }}}
+
+        // Normalize, truncate and normalize again
+        normalize_desc(desc);
+        for (i = 0; i < DESC_NUMEL; i++) {
+                desc[i] = fmin(desc[i], TRUNC_THRESH);
+        }
+        normalize_desc(desc);
+}
@@ -15,11 +15,28 @@
 #include <math.h>
 #include <assert.h>
 #include <float.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <getopt.h>
 #include "imtypes.h"
 #include "immacros.h"
 #include "imutil.h"
 #include "sift.h"
+#ifdef SIFT3D_WITH_OPENCL
+#include "sift_cl.h"
+#endif
+#ifdef SIFT3D_WITH_CUDA
+#include "sift_cuda.h"
+#endif
+
+/* Vectorized instruction sets for descriptor matching */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIFT3D_X86_SIMD
+#include <immintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#define SIFT3D_NEON_SIMD
+#include <arm_neon.h>
+#endif
 
 /* Implementation options */
 //#define SIFT3D_ORI_SOLID_ANGLE_WEIGHT // Weight bins by solid angle
@@ -29,6 +46,23 @@
 /* Internal return codes */
 #define REJECT 1
 
+/* Binary feature file format */
+#define SIFT3D_FEATURES_VERSION 1 // Current version of the format
+#define FEATURES_ALIGNMENT 64 // Alignment of each section, in bytes
+#define FEATURES_ALIGN(x) \
+        (((x) + FEATURES_ALIGNMENT - 1) / FEATURES_ALIGNMENT * \
+        FEATURES_ALIGNMENT)
+
+/* Dense descriptor file format */
+#define SIFT3D_DENSE_VERSION 1 // Current version of the format
+
+/* Number of split dimension candidates per k-d tree node */
+#define KD_NUM_RAND_DIMS 5
+
+/* Number of descriptor elements between early termination checks in the
+ * vectorized SSD kernels. Must divide DESC_NUMEL and be a multiple of 32. */
+#define DESC_SSD_BLOCK (8 * HIST_NUMEL)
+
 /* Default SIFT3D parameters. These may be overriden by 
  * the calling appropriate functions. */
 const double peak_thresh_default = 0.1; // DoG peak threshold
@@ -43,20 +77,53 @@ const char opt_corner_thresh[] = "corner_thresh";
 const char opt_num_kp_levels[] = "num_kp_levels";
 const char opt_sigma_n[] = "sigma_n";
 const char opt_sigma0[] = "sigma0";
+const char opt_fused[] = "fused";
+const char opt_num_threads[] = "threads";
+const char opt_backend[] = "backend";
+const char opt_grad_cache[] = "grad_cache";
+const char opt_half_pyramid[] = "half_pyramid";
+
+/* Backend names, indexed by SIFT3D_backend */
+static const char *const backend_names[] = {"cpu", "opencl", "cuda"};
+#define NUM_BACKENDS ((int) (sizeof(backend_names) / sizeof(backend_names[0])))
+
+/* Stage names, indexed by SIFT3D_stage */
+static const char *const stage_names[] = {"gpyr", "dog", "extrema", 
+        "orientation", "descriptor", "match", "ransac", "warp"};
+
+/* Binary feature files */
+const char ext_features[] = ".sift3d"; // File extension
+const char features_magic[8] = "SIFT3DF"; // Identifies the file type
+const uint32_t features_byte_order = 0x01020304; // Detects the byte order
+
+/* Dense descriptor files */
+const char dense_magic[8] = "SIFT3DD"; // Identifies the file type
 
 /* Internal parameters */
 const double max_eig_ratio =  0.90;	// Maximum ratio of eigenvalue magnitudes
 const double ori_grad_thresh = 1E-10;   // Minimum norm of average gradient
 const double bary_eps = FLT_EPSILON * 1E1;	// Error tolerance for barycentric coordinates
+const double bary_lut_margin = 1E-3; // Smallest barycentric coordinate accepted from the lookup table
+const int icos_lut_res = 128; // Width of the icosahedral lookup table, in cells
 const double ori_sig_fctr = 1.5;        // Ratio of window parameter to keypoint scale
 const double ori_rad_fctr =  3.0; // Ratio of window radius to parameter
 const double desc_sig_fctr = 7.071067812; // See ori_sig_fctr, 5 * sqrt(2)
 const double desc_rad_fctr = 2.0;  // See ori_rad_fctr
 const double trunc_thresh = 0.2f * 128.0f / DESC_NUMEL; // Descriptor truncation threshold
+const double quant_scale = 512.0 * DESC_NUMEL / 128.0; // 8-bit descriptor scaling, see trunc_thresh
 
 /* Internal math constants */
 const double gr = 1.6180339887; // Golden ratio
 
+/* Internal parameters for the k-d forest */
+const int index_num_trees_default = 4; // Number of randomized trees
+const int index_checks_default = 128; // Descriptors compared per query
+const int kd_leaf_size = 4; // Maximum number of descriptors in a leaf
+const int kd_num_samples = 100; // Number of samples used to choose a split
+
+/* Internal parameters for the result cache */
+const int cache_capacity_default = 8; // Entries kept in memory
+
 /* Get the index of bin j from triangle i */
 #define MESH_GET_IDX(mesh, i, j) \
 	((mesh)->tri[i].idx[j])
@@ -148,66 +215,405 @@ const double gr = 1.6180339887; // Golden ratio
 
 // As SIFT3D_IM_GET_GRAD, but with physical units (1, 1, 1)
 #define IM_GET_GRAD_ISO(im, x, y, z, c, vd) { \
-        SIFT3D_IM_GET_GRAD(im, x, y, z, c, vd); \
+        SIFT3D_IM_GET_GRAD_F(im, x, y, z, c, vd); \
         (vd)->x *=  1.0f / (float) (im)->ux; \
         (vd)->y *= 1.0f / (float) (im)->uy; \
         (vd)->z *= 1.0f / (float) (im)->uz; \
 }
 
+// As IM_GET_GRAD_ISO for channel 0, but reads the gradient from grads, the 
+// output of prepare_grads_SIFT3D, unless it is NULL
+#define IM_GET_GRAD_ISO_CACHED(im, grads, x, y, z, vd) { \
+        if ((grads) == NULL) { \
+                IM_GET_GRAD_ISO(im, x, y, z, 0, vd); \
+        } else { \
+                (vd)->x = SIFT3D_IM_GET_VOX(grads, x, y, z, 0); \
+                (vd)->y = SIFT3D_IM_GET_VOX(grads, x, y, z, 1); \
+                (vd)->z = SIFT3D_IM_GET_VOX(grads, x, y, z, 2); \
+        } \
+}
+
+// Get the element i of a SIFT3D_Descriptor, viewed as a flat array of
+// DESC_NUMEL floats
+#define DESC_GET_EL(desc, i) (((const float *) (desc)->hists)[i])
+
+/* Branch of a k-d tree waiting to be searched */
+typedef struct _Kd_branch {
+        double dist;    // Lower bound on the distance to the query
+        int tree;       // Tree index
+        int node;       // Node index within the tree
+} Kd_branch;
+
+/* A voxel offset in a dense descriptor window, and its window weight */
+typedef struct _Dense_offset {
+        int dx, dy, dz; // Offset from the window center, in voxels
+        float weight;   // Gaussian window weight
+} Dense_offset;
+
+/* Per-thread scratch memory for searching a SIFT3D_Descriptor_index */
+typedef struct _Kd_search {
+        Kd_branch *heap;        // Priority queue of unexplored branches
+        int *visited;           // Query stamp of each visited descriptor
+        size_t heap_num, heap_cap; // Number of branches in, capacity of heap
+        int stamp;              // Stamp of the current query
+} Kd_search;
+
 /* Global variables */
 extern CL_data cl_data;
 
+/* The kernel used to compare descriptors, selected by init_desc_ssd */
+static double (*desc_ssd)(const SIFT3D_Descriptor *const, 
+        const SIFT3D_Descriptor *const, const double) = NULL;
+static const char *match_kernel_name = NULL;
+
+/* The device used for descriptor matching, selected by 
+ * SIFT3D_set_match_backend */
+static SIFT3D_backend match_backend = SIFT3D_BACKEND_CPU;
+#ifdef SIFT3D_WITH_CUDA
+static SIFT3D_cuda *match_cuda = NULL;
+
+/* Number of candidate matches found on the CUDA device for each descriptor,
+ * which are re-ranked exactly on the host */
+#define CUDA_MATCH_CANDIDATES 4
+#endif
+
+/* Descriptor element types in binary feature files */
+typedef enum _features_dtype {
+        FEATURES_DTYPE_FLOAT32 = 0,
+        FEATURES_DTYPE_UINT8 = 1,
+        FEATURES_DTYPE_FLOAT16 = 2
+} features_dtype;
+
+/* Header of a binary feature file. See write_SIFT3D_features. */
+typedef struct _Features_header {
+        char magic[8];          // features_magic
+        uint32_t version;       // SIFT3D_FEATURES_VERSION
+        uint32_t byte_order;    // features_byte_order, as written
+        uint32_t dtype;         // features_dtype of the descriptors
+        uint32_t desc_numel;    // DESC_NUMEL
+        uint32_t desc_size;     // Size of each descriptor record, in bytes
+        int32_t nx, ny, nz;     // Image dimensions
+        uint64_t num_keys;      // Number of keypoints
+        uint64_t num_desc;      // Number of descriptors
+        uint64_t keys_offset;   // Byte offset of the keypoints
+        uint64_t desc_offset;   // Byte offset of the descriptors
+        uint64_t coords_offset; // Offset of quantized coordinates, or 0
+} Features_header;
+
+/* Keypoint record of a binary feature file */
+typedef struct _Features_key {
+        double xd, yd, zd, sd;  // Coordinates and scale
+        float r_data[IM_NDIMS * IM_NDIMS]; // Orientation matrix
+        int32_t o, s;           // Pyramid indices
+        int32_t pad;            // Reserved
+} Features_key;
+
+/* Header of a dense descriptor file. See 
+ * SIFT3D_extract_dense_descriptors_file. */
+typedef struct _Dense_header {
+        char magic[8];          // dense_magic
+        uint32_t version;       // SIFT3D_DENSE_VERSION
+        uint32_t byte_order;    // features_byte_order, as written
+        uint32_t dtype;         // features_dtype of the elements
+        uint32_t nc;            // Number of channels, HIST_NUMEL
+        int32_t nx, ny, nz;     // Image dimensions
+        float lo, step;         // Element q of type uint8 is lo + q * step
+        double units[IM_NDIMS]; // Image units
+        uint64_t data_offset;   // Byte offset of the elements
+} Dense_header;
+
+/* State of the file sink of SIFT3D_extract_dense_descriptors_file */
+typedef struct _Dense_file {
+        FILE *file;             // The output file
+        void *buf;              // Converted elements of a slab
+        size_t buf_size;        // Size of buf, in bytes
+        features_dtype dtype;   // Element type
+        float lo, step;         // Quantization of uint8 elements
+} Dense_file;
+
+/* Extrema candidates found in a single z plane by detect_extrema_level */
+typedef struct _Extrema_plane {
+        unsigned char *mask;    // Scratch space for one row of comparisons
+        float *rows;            // Neighborhood rows of typed levels, or NULL
+        int *xy;                // Interleaved x, y coordinates of candidates
+        size_t num, cap;        // Number of candidates in, capacity of xy
+} Extrema_plane;
+
+/* Scratch memory for detect_extrema_level, reused across levels */
+typedef struct _Extrema_buf {
+        Extrema_plane *planes;  // One per z plane
+        int nx, nz;             // Maximum supported dimensions
+} Extrema_buf;
+
+/* A uniform grid of descriptor positions, for spatially bounded matching. 
+ * The descriptors in cell c are idx[start[c]] to idx[start[c + 1] - 1]. */
+typedef struct _Match_grid {
+        double *pos;            // [num x IM_NDIMS] positions, in mm
+        int *idx;               // Descriptor indices, sorted by cell
+        int *start;             // [num_cells + 1] offset of each cell in idx
+        double origin[IM_NDIMS]; // Lower corner of the grid, in mm
+        double cell;            // Cell edge length, in mm
+        int dims[IM_NDIMS];     // Number of cells in each dimension
+} Match_grid;
+
+/* The extent of a tile in tiled detection, in voxels of the input image */
+typedef struct _Tile {
+        int core_start[IM_NDIMS], core_end[IM_NDIMS]; // Owned by this tile
+        int start[IM_NDIMS], end[IM_NDIMS]; // Processed, including the halo
+} Tile;
+
+/* An image in the pipeline of a batch worker, and its results */
+typedef struct _Batch_slot {
+        Image im;
+        Keypoint_store kp;
+        SIFT3D_Descriptor_store desc;
+        int idx; // The index of the image, or -1 if the slot is empty
+        int status; // SIFT3D_SUCCESS if no stage has failed
+        int loaded; // If true, im was read before the pipeline started
+} Batch_slot;
+
+/* The structure tensors of a batch of orientation windows, and their
+ * eigendecompositions, in the layout of eigen_sym3_batch */
+typedef struct _Eig_ori_batch {
+        double *tensors;        // Upper triangles of the tensors, [num x 6]
+        double *evals;          // Eigenvalues, [num x 3]
+        double *evecs;          // Row-major eigenvectors, [num x 9]
+        Cvec *vd_win;           // Window gradients, [num]
+} Eig_ori_batch;
+
+/* Kernel used to compare quantized descriptors */
+typedef double (*quant_ssd_fn)(const void *const, const void *const, 
+        const double);
+
 /* Helper routines */
 static int init_geometry(SIFT3D *sift3d);
 static int set_im_SIFT3D(SIFT3D *const sift3d, const Image *const im);
 static int set_scales_SIFT3D(SIFT3D *const sift3d, const double sigma0,
         const double sigma_n);
 static int resize_SIFT3D(SIFT3D *const sift3d, const int num_kp_levels);
+static int get_num_octaves(const Image *const im, const int first_octave,
+        int *const num_octaves);
+static im_type get_pyr_type_SIFT3D(const SIFT3D *const sift3d);
+static int resize_SIFT3D_octaves(SIFT3D *const sift3d, 
+        const int num_kp_levels, const int num_octaves);
 static int build_gpyr(SIFT3D *sift3d);
+static int build_gpyr_level(SIFT3D *const sift3d, const int o, const int s);
 static int build_dog(SIFT3D *dog);
+static int build_dog_level(const Image *const gpyr_cur, 
+        const Image *const gpyr_next, Image *const dog_level, 
+        float *const dogmax);
+static int build_dog_level_typed(const Image *const gpyr_cur, 
+        const Image *const gpyr_next, Image *const dog_level, 
+        float *const dogmax);
 static int detect_extrema(SIFT3D *sift3d, Keypoint_store *kp);
+static int init_Extrema_buf(Extrema_buf *const buf, const Image *const im);
+static void cleanup_Extrema_buf(Extrema_buf *const buf);
+static void extrema_row(const float *const prev, const float *const cur, 
+        const float *const next, const ptrdiff_t ys, const ptrdiff_t zs, 
+        const float peak_thresh, const int nx, unsigned char *const mask);
+static void load_extrema_rows(const Image *const im, const int y, const int z,
+        const int full, const int is_cur, float *const rows);
+static int detect_extrema_level(const SIFT3D *const sift3d, 
+        const Image *const prev, const Image *const cur, 
+        const Image *const next, const float dogmax, const int o, const int s,
+        Extrema_buf *const buf, Keypoint_store *const kp, int *const num);
+static int detect_extrema_fused(SIFT3D *const sift3d, const int o_start,
+        const float *const dogmax_in, Keypoint_store *const kp);
+static int get_tile_halo(const SIFT3D *const sift3d, const Image *const im,
+        const int num_octaves, int *const halo);
+static int set_tile_SIFT3D(SIFT3D *const sift3d, const Image *const im,
+        const Tile *const tile, const float scale, const int num_octaves);
+static void get_tile_owned(const Tile *const tile, const Image *const level,
+        const int o, int *const lo, int *const hi);
+static void tile_dogmax(SIFT3D *const sift3d, const Tile *const tile, 
+        float *const dogmax);
+static void save_tile_level(const Tile *const tile, const Image *const src,
+        const int o, Image *const dst);
+static int detect_tile(SIFT3D *const sift3d, const Tile *const tile,
+        const int o_start, const float *const dogmax, 
+        Keypoint_store *const kp_tile,
+        SIFT3D_Descriptor_store *const desc_tile, Keypoint_store *const kp,
+        SIFT3D_Descriptor_store *const desc);
+static int cmp_keypoint_order(const void *a, const void *b);
+static void init_Batch_slot(Batch_slot *const slot);
+static void cleanup_Batch_slot(Batch_slot *const slot);
+static size_t batch_worker_mem(const SIFT3D *const sift3d, 
+        const Image *const im);
+static void batch_worker(SIFT3D *const sift3d, const char *const *im_paths,
+        const char *const *out_paths, const int num, int *const next, 
+        Batch_slot *const slots, int *const num_failed);
+static void batch_read(Batch_slot *const slot, const char *const *im_paths);
+static void batch_compute(SIFT3D *const sift3d, Batch_slot *const slot,
+        const char *const *im_paths);
+static void batch_write(Batch_slot *const slot, const char *const *out_paths,
+        int *const num_failed);
 static int assign_orientations(SIFT3D *const sift3d, Keypoint_store *const kp);
-static int assign_orientation_thresh(const Image *const im, 
-        const Cvec *const vcenter, const double sigma, const double thresh,
-        Mat_rm *const R);
-static int assign_eig_ori(const Image *const im, const Cvec *const vcenter,
-                          const double sigma, Mat_rm *const R, 
-                          double *const conf);
+static int init_Eig_ori_batch(Eig_ori_batch *const batch, const int num);
+static void cleanup_Eig_ori_batch(Eig_ori_batch *const batch);
+static int eig_ori_window(const Image *const im, const Image *const grads,
+                          const Cvec *const vcenter,
+                          const double sigma, double *const a, 
+                          Cvec *const vd_win);
+static int eig_ori_assign(const double *const L, const double *const Q,
+        const Cvec *const vd_win, Mat_rm *const R, double *const conf);
 static int Cvec_to_sbins(const Cvec * const vd, Svec * const bins);
 static void refine_Hist(Hist *hist);
 static int init_cl_SIFT3D(SIFT3D *sift3d);
 static int cart2bary(const Cvec * const cart, const Tri * const tri, 
 		      Cvec * const bary, float * const k);
+static int init_icos_lut(Mesh *const mesh);
+static int icos_lut_cell(const Mesh *const mesh, const Cvec *const x);
+static int icos_lut_check(const Mesh *const mesh, const Cvec *const x,
+        const int bin, Cvec *const bary);
+static int icos_hist_bin_scan(const Mesh *const mesh, const Cvec *const x, 
+        Cvec *const bary, int *const bin);
+static void icos_hist_bin_batch(const SIFT3D *const sift3d, 
+        const Cvec *const x, const int num, Cvec *const bary, int *const bin);
 static int scale_Keypoint(const Keypoint *const src, 
         const double *const factors, Keypoint *const dst);
 static int smooth_scale_raw_input(const SIFT3D *const sift3d, const Image *const src,
         Image *const dst);
-static int verify_keys(const Keypoint_store *const kp, const Image *const im);
+static int smooth_raw_input(const SIFT3D *const sift3d, 
+        const Image *const src, Image *const dst);
+static int verify_keys(const Keypoint_store *const kp, const Image *const im,
+        const int *const start);
+static int verify_mask_SIFT3D(const SIFT3D *const sift3d, 
+        const Image *const im);
+static const Image *get_octave_mask_SIFT3D(const SIFT3D *const sift3d, 
+        const int o);
+static int set_octave_masks_SIFT3D(SIFT3D *const sift3d, 
+        const Tile *const tile, const int num_octaves);
+static int detect_keypoints_roi(SIFT3D *const sift3d, const Image *const im,
+        Keypoint_store *const kp);
 static int keypoint2base(const Keypoint *const src, Keypoint *const dst);
+#if defined(SIFT3D_WITH_OPENCL) || defined(SIFT3D_WITH_CUDA)
+static int init_Dev_gpyr(const SIFT3D *const sift3d, Dev_gpyr *const layout);
+static void cleanup_Dev_gpyr(Dev_gpyr *const layout);
+#endif
+#ifdef SIFT3D_WITH_CUDA
+static int build_pyramids_cuda_SIFT3D(SIFT3D *const sift3d);
+static int nn_match_cuda(const SIFT3D_Descriptor_store *const d1,
+        const SIFT3D_Descriptor_store *const d2, const float nn_thresh,
+        int *const matches, float *const ratios);
+static int pack_Descriptor_store(const SIFT3D_Descriptor_store *const store,
+        float **const data);
+static int match_candidates(const SIFT3D_Descriptor *const desc,
+        const SIFT3D_Descriptor_store *const store, const int *const cand,
+        const float nn_thresh, float *const ratio);
+#endif
+#ifdef SIFT3D_WITH_OPENCL
+static int init_device_SIFT3D(SIFT3D *const sift3d);
+static void cleanup_device_SIFT3D(SIFT3D *const sift3d);
+static int sync_pyramids_SIFT3D(const SIFT3D *const sift3d, 
+        Pyramid *const gpyr, Pyramid *const dog);
+static int detect_keypoints_device(SIFT3D *const sift3d, 
+        Keypoint_store *const kp);
+static int extract_descriptors_device(SIFT3D *const sift3d, 
+        const Keypoint_store *const kp, SIFT3D_Descriptor_store *const desc,
+        SIFT3D_Quant_store *const quant);
+#endif
 static int _SIFT3D_extract_descriptors(SIFT3D *const sift3d, 
         const Pyramid *const gpyr, const Keypoint_store *const kp, 
+        SIFT3D_Descriptor_store *const desc, SIFT3D_Quant_store *const quant);
+static int _SIFT3D_assign_orientations(const SIFT3D *const sift3d, 
+        const Image *const im, Keypoint_store *const kp, double **const conf);
+static int _SIFT3D_detect_keypoints(SIFT3D *const sift3d, 
+        const Image *const im, Keypoint_store *const kp);
+static int _SIFT3D_extract_features_tiled(SIFT3D *const sift3d, 
+        const Image *const im, const int tile_size, Keypoint_store *const kp, 
+        SIFT3D_Descriptor_store *const desc);
+static int _SIFT3D_extract_raw_descriptors(SIFT3D *const sift3d, 
+        const Image *const im, const Keypoint_store *const kp, 
         SIFT3D_Descriptor_store *const desc);
+static int _SIFT3D_extract_dense_descriptors(SIFT3D *const sift3d, 
+        const Image *const in, Image *const desc);
+static int push_num_threads(const SIFT3D *const sift3d);
+static size_t Pyramid_bytes(const Pyramid *const pyr);
+static void free_grads_SIFT3D(SIFT3D *const sift3d);
+static int prepare_grads_SIFT3D(SIFT3D *const sift3d, 
+        const Keypoint_store *const kp);
+static const Image *get_grads_SIFT3D(const SIFT3D *const sift3d, 
+        const int o, const int s);
+static int resize_SIFT3D_Quant_store(SIFT3D_Quant_store *const store,
+        const int num);
+static size_t quant_type_get_size(const quant_type type);
+static void quantize_desc(const SIFT3D_Descriptor *const desc, 
+        SIFT3D_Quant_store *const store, const size_t i);
+static int is_features_path(const char *path);
+static int copy_SIFT3D_Descriptor_store(
+        const SIFT3D_Descriptor_store *const src, 
+        SIFT3D_Descriptor_store *const dst);
+static void clear_SIFT3D_Cache(SIFT3D_Cache *const cache);
+static uint64_t cache_key_SIFT3D(const SIFT3D *const sift3d, 
+        const Image *const im);
+static char *cache_path_SIFT3D(const SIFT3D_Cache *const cache, 
+        const uint64_t key);
 static void SIFT3D_desc_acc_interp(const SIFT3D * const sift3d, 
 				   const Cvec * const vbins, 
 				   const Cvec * const grad,
 				   SIFT3D_Descriptor * const desc);
 static int extract_descrip(SIFT3D *const sift3d, const Image *const im,
-	   const Keypoint *const key, SIFT3D_Descriptor *const desc);
+	   const Image *const grads, const Keypoint *const key, 
+           SIFT3D_Descriptor *const desc);
 static int argv_remove(const int argc, char **argv, 
                         const unsigned char *processed);
 static int extract_dense_descriptors_no_rotate(SIFT3D *const sift3d,
         const Image *const in, Image *const desc);
 static int extract_dense_descriptors_rotate(SIFT3D *const sift3d,
         const Image *const in, Image *const desc);
-static int extract_dense_descrip_rotate(SIFT3D *const sift3d, 
-           const Image *const im, const Cvec *const vcenter, 
-           const double sigma, const Mat_rm *const R, Hist *const hist);
+static int make_dense_window(const Image *const im, const double sigma, 
+        const double radius, Dense_offset **const offsets, int *const num);
+static int dense_grad_tensor(const SIFT3D *const sift3d, 
+        const Image *const in, Image *const grad, Image *const tensor);
+static void postproc_dense(const Image *const in, const Image *const mask,
+        Image *const desc, const int z_start, const int z_end);
+static int get_dense_halo(const SIFT3D *const sift3d, const Image *const in,
+        int *const halo);
+static int crop_planes(const Image *const src, const int z_start, 
+        const int z_end, Image *const dst);
+static int _SIFT3D_extract_dense_descriptors_stream(SIFT3D *const sift3d,
+        const Image *const in, const int slab_size, 
+        const SIFT3D_dense_sink sink, void *const arg);
+static int dense_file_sink(void *const arg, const Image *const slab,
+        const int z_start);
+static size_t dense_dtype_get_size(const features_dtype dtype);
+static int extract_dense_descrip_rotate(const SIFT3D *const sift3d, 
+           const Image *const grad, const int x, const int y, const int z, 
+           const Dense_offset *const offsets, const int num_offsets,
+           const Mat_rm *const R, Hist *const hist);
 static void vox2hist(const Image *const im, const int x, const int y,
         const int z, Hist *const hist);
 static void hist2vox(Hist *const hist, const Image *const im, const int x, 
         const int y, const int z);
 static int match_desc(const SIFT3D_Descriptor *const desc,
-        const SIFT3D_Descriptor_store *const store, const float nn_thresh);
+        const SIFT3D_Descriptor_store *const store, const float nn_thresh,
+        float *const ratio);
+static void init_Match_grid(Match_grid *const grid);
+static void cleanup_Match_grid(Match_grid *const grid);
+static int build_Match_grid(const SIFT3D_Descriptor_store *const store,
+        const void *const tform, const double *const units, 
+        const double radius, Match_grid *const grid);
+static int match_desc_bounded(const SIFT3D_Descriptor *const desc,
+        const double *const pos, const SIFT3D_Descriptor_store *const store,
+        const Match_grid *const grid, const double radius, 
+        const float nn_thresh, float *const ratio);
+static double desc_ssd_ref(const SIFT3D_Descriptor *const desc1,
+        const SIFT3D_Descriptor *const desc2, const double thresh);
+static double desc_ssd_float(const SIFT3D_Descriptor *const desc1,
+        const SIFT3D_Descriptor *const desc2, const double thresh);
+static void init_desc_ssd(void);
+static int build_kd_tree(SIFT3D_Descriptor_index *const index, 
+        const int tree, const int begin, const int end, int *const num_nodes,
+        double *const stats, unsigned int *const seed);
+static int init_Kd_search(Kd_search *const search, const size_t num);
+static void cleanup_Kd_search(Kd_search *const search);
+static int kd_descend(const SIFT3D_Descriptor_index *const index,
+        const SIFT3D_Descriptor *const desc, const int tree, int node, 
+        const double dist, Kd_search *const search, int *const num_checked,
+        int *const best, double *const ssd_best, double *const ssd_nearest);
+static int match_desc_indexed(const SIFT3D_Descriptor *const desc,
+        const SIFT3D_Descriptor_index *const index, const float nn_thresh,
+        Kd_search *const search, int *const match, float *const ratio);
 static int resize_SIFT3D_Descriptor_store(SIFT3D_Descriptor_store *const desc,
         const int num);
 
@@ -321,8 +727,80 @@ static int init_geometry(SIFT3D *sift3d) {
 		assert(fabsf(SIFT3D_CVEC_L2_NORM(&temp1) - 
                         SIFT3D_CVEC_L2_NORM(&temp3)) < 1E-10);
 	}	
+        mesh->num = ICOS_NFACES;
 	
-	return SIFT3D_SUCCESS;
+        // Tabulate the triangle intersected by each direction
+	return init_icos_lut(mesh);
+}
+
+/* Helper function to get the lookup table cell of a nonzero vector x. The
+ * direction of x is mapped to the square [-1, 1]^2 by the octahedral 
+ * parameterization: x is projected onto the unit octahedron, and the lower
+ * half is folded onto the corners of the square. */
+static int icos_lut_cell(const Mesh *const mesh, const Cvec *const x) {
+
+        float u, v, l1;
+        int i, j;
+
+        const int res = mesh->lut_res;
+
+        l1 = fabsf(x->x) + fabsf(x->y) + fabsf(x->z);
+        u = x->x / l1;
+        v = x->y / l1;
+        if (x->z < 0.0f) {
+                const float u_fold = copysignf(1.0f - fabsf(v), u);
+
+                v = copysignf(1.0f - fabsf(u), v);
+                u = u_fold;
+        }
+
+        i = (int) ((u + 1.0f) * 0.5f * (float) res);
+        j = (int) ((v + 1.0f) * 0.5f * (float) res);
+
+        return SIFT3D_MIN(SIFT3D_MAX(i, 0), res - 1) + 
+                SIFT3D_MIN(SIFT3D_MAX(j, 0), res - 1) * res;
+}
+
+/* Helper function to initialize the lookup table of mesh, storing the 
+ * triangle intersected by the direction at the center of each cell of
+ * icos_lut_cell. Cells which straddle an edge store one of their triangles,
+ * which is then rejected by icos_lut_check. */
+static int init_icos_lut(Mesh *const mesh) {
+
+        Cvec bary;
+        int i, j, bin;
+
+        const int res = icos_lut_res;
+
+        if ((mesh->lut = (unsigned char *) SIFT3D_safe_realloc(mesh->lut,
+                res * res * sizeof(unsigned char))) == NULL)
+                return SIFT3D_FAILURE;
+        mesh->lut_res = res;
+
+        for (j = 0; j < res; j++) {
+        for (i = 0; i < res; i++) {
+
+                Cvec dir;
+
+                const float u = ((float) i + 0.5f) * 2.0f / (float) res - 1.0f;
+                const float v = ((float) j + 0.5f) * 2.0f / (float) res - 1.0f;
+                const float z = 1.0f - fabsf(u) - fabsf(v);
+
+                // Unfold the square onto the octahedron
+                dir.z = z;
+                if (z < 0.0f) {
+                        dir.x = copysignf(1.0f - fabsf(v), u);
+                        dir.y = copysignf(1.0f - fabsf(u), v);
+                } else {
+                        dir.x = u;
+                        dir.y = v;
+                }
+
+                mesh->lut[i + j * res] = icos_hist_bin_scan(mesh, &dir, &bary,
+                        &bin) ? 0 : (unsigned char) bin;
+        }}
+
+        return SIFT3D_SUCCESS;
 }
 
 /* Convert Cartesian coordinates to barycentric. bary is set to all zeros if
@@ -579,9 +1057,283 @@ int set_sigma0_SIFT3D(SIFT3D *const sift3d,
         return set_scales_SIFT3D(sift3d, sigma0, sigma_n);
 }
 
+/* Sets whether keypoints are detected with the fused pipeline. If fused is
+ * SIFT3D_TRUE, each DoG level is computed as soon as its Gaussian levels are
+ * available, and extrema are found in a sliding window of three DoG levels.
+ * The full DoG pyramid is never stored, roughly halving the peak memory
+ * usage. The detected keypoints are the same in either case. */
+int set_fused_SIFT3D(SIFT3D *const sift3d, const int fused) {
+
+        sift3d->fused = fused ? SIFT3D_TRUE : SIFT3D_FALSE;
+
+        // Resize the DoG pyramid
+        return resize_SIFT3D(sift3d, sift3d->gpyr.num_kp_levels);
+}
+
+/* Sets the element type in which the pyramids are stored, either IM_FLOAT32,
+ * the default, or IM_FLOAT16, which halves their memory and the bandwidth 
+ * of building them, at a small cost in the accuracy of the keypoints and 
+ * descriptors. The filters, DoG and descriptors are still computed in 
+ * float32. Device backends always store float32 pyramids. Returns 
+ * SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int set_pyr_type_SIFT3D(SIFT3D *const sift3d, const im_type type) {
+
+        switch (type) {
+        case IM_FLOAT32:
+        case IM_FLOAT16:
+                break;
+        default:
+                SIFT3D_ERR("set_pyr_type_SIFT3D: unsupported type: %d \n",
+                        (int) type);
+                return SIFT3D_FAILURE;
+        }
+
+        sift3d->pyr_type = type;
+
+        // Convert the pyramids
+        return resize_SIFT3D(sift3d, sift3d->gpyr.num_kp_levels);
+}
+
+/* Sets the number of threads used by this struct. The calling thread's 
+ * setting, as in SIFT3D_set_num_threads, is overridden for the duration of
+ * each call taking this struct, including detection and descriptor 
+ * extraction. Use 0 to keep the calling thread's setting. Returns 
+ * SIFT3D_SUCCESS on success, SIFT3D_FAILURE if num_threads is negative. */
+int set_num_threads_SIFT3D(SIFT3D *const sift3d, const int num_threads) {
+
+        if (num_threads < 0) {
+                SIFT3D_ERR("SIFT3D num_threads must be nonnegative. "
+                        "Provided: %d \n", num_threads);
+                return SIFT3D_FAILURE;
+        }
+
+        sift3d->num_threads = num_threads;
+        return SIFT3D_SUCCESS;
+}
+
+/* Sets whether gradients are cached. If grad_cache is SIFT3D_TRUE, the 
+ * gradient of each Gaussian pyramid level holding keypoints is computed once,
+ * in parallel, the first time it is needed for orientation assignment or 
+ * descriptor extraction. Each keypoint then reads its window from the cache,
+ * rather than recomputing the gradients its window shares with its 
+ * neighbors. This is faster when keypoints are dense, at the cost of three 
+ * floats per voxel of each cached level. The results are the same in either
+ * case. Disabling the cache releases its memory. */
+void set_grad_cache_SIFT3D(SIFT3D *const sift3d, const int grad_cache) {
+
+        sift3d->grad_cache = grad_cache ? SIFT3D_TRUE : SIFT3D_FALSE;
+
+        if (!sift3d->grad_cache)
+                free_grads_SIFT3D(sift3d);
+}
+
+/* Set the foreground mask of the images processed by sift3d. Keypoints are 
+ * then detected only where the mask is nonzero, and the pyramids are built
+ * only for its bounding box, plus the margin needed to reproduce the 
+ * detections of the whole image. Dense descriptors are zeroed outside the 
+ * mask. The mask must have the same dimensions as the images, and a single
+ * channel. As with set_cache_SIFT3D, mask is not copied, it is shared with 
+ * the copies made by copy_SIFT3D, and it must remain valid until it is 
+ * replaced. Use NULL to process the whole image, which is the default. */
+void set_mask_SIFT3D(SIFT3D *const sift3d, const Image *const mask) {
+        sift3d->mask = mask;
+}
+
+/* Helper function to verify that the mask of sift3d, if any, can be used 
+ * with the image im. Returns SIFT3D_SUCCESS if so, SIFT3D_FAILURE 
+ * otherwise. */
+static int verify_mask_SIFT3D(const SIFT3D *const sift3d, 
+        const Image *const im) {
+
+        const Image *const mask = sift3d->mask;
+
+        if (mask == NULL)
+                return SIFT3D_SUCCESS;
+
+        if (mask->nc != 1) {
+                SIFT3D_ERR("SIFT3D: invalid number of mask channels: %d -- "
+                        "only single-channel masks are supported \n", 
+                        mask->nc);
+                return SIFT3D_FAILURE;
+        }
+        if (memcmp(SIFT3D_IM_GET_DIMS(mask), SIFT3D_IM_GET_DIMS(im), 
+                IM_NDIMS * sizeof(int))) {
+                SIFT3D_ERR("SIFT3D: mask dimensions (%d, %d, %d) do not "
+                        "match the image (%d, %d, %d) \n", mask->nx, 
+                        mask->ny, mask->nz, im->nx, im->ny, im->nz);
+                return SIFT3D_FAILURE;
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper function to get the mask of octave o of the pyramids of sift3d, or
+ * NULL if the pyramids cover the whole image. */
+static const Image *get_octave_mask_SIFT3D(const SIFT3D *const sift3d, 
+        const int o) {
+
+        return sift3d->roi_active ? 
+                sift3d->octave_masks + o - sift3d->gpyr.first_octave : NULL;
+}
+
+/* Helper function to apply the thread count of a SIFT3D struct to the
+ * calling thread, if it is set. Returns the previous setting, to be restored
+ * with SIFT3D_set_num_threads. */
+static int push_num_threads(const SIFT3D *const sift3d) {
+
+        const int num_threads = SIFT3D_get_num_threads();
+
+        if (sift3d->num_threads > 0)
+                SIFT3D_set_num_threads(sift3d->num_threads);
+
+        return num_threads;
+}
+
+/* Sets the device used for keypoint detection and descriptor extraction.
+ * With SIFT3D_BACKEND_OPENCL, the pyramids are built and kept in the memory
+ * of an OpenCL device, preferably a GPU, and only the keypoints and 
+ * descriptors are read back. The fused setting has no effect with this 
+ * backend. With SIFT3D_BACKEND_CUDA, the pyramids are built on the current
+ * CUDA device and read back, and the rest runs on the host. The DoG pyramid
+ * is always stored with this backend, so the fused setting saves no memory.
+ * The device is initialized here. Returns SIFT3D_SUCCESS on success, 
+ * SIFT3D_FAILURE if the backend is not available. */
+int set_backend_SIFT3D(SIFT3D *const sift3d, const SIFT3D_backend backend) {
+
+        const int resize = (sift3d->fused && 
+                (sift3d->backend == SIFT3D_BACKEND_CUDA) != 
+                (backend == SIFT3D_BACKEND_CUDA)) || 
+                (sift3d->pyr_type != IM_FLOAT32 &&
+                (sift3d->backend == SIFT3D_BACKEND_CPU) != 
+                (backend == SIFT3D_BACKEND_CPU));
+
+        // Initialize the device
+        switch (backend) {
+                case SIFT3D_BACKEND_CPU:
+                        break;
+                case SIFT3D_BACKEND_OPENCL:
+#ifdef SIFT3D_WITH_OPENCL
+                        if (sift3d->cl == NULL && init_device_SIFT3D(sift3d))
+                                return SIFT3D_FAILURE;
+                        break;
+#else
+                        SIFT3D_ERR("set_backend_SIFT3D: This version was not "
+                                "compiled with OpenCL \n");
+                        return SIFT3D_FAILURE;
+#endif
+                case SIFT3D_BACKEND_CUDA:
+#ifdef SIFT3D_WITH_CUDA
+                        if (sift3d->cuda == NULL && 
+                                init_SIFT3D_cuda(&sift3d->cuda))
+                                return SIFT3D_FAILURE;
+                        break;
+#else
+                        SIFT3D_ERR("set_backend_SIFT3D: This version was not "
+                                "compiled with CUDA \n");
+                        return SIFT3D_FAILURE;
+#endif
+                default:
+                        SIFT3D_ERR("set_backend_SIFT3D: unknown backend: "
+                                "%d \n", (int) backend);
+                        return SIFT3D_FAILURE;
+        }
+
+        // Release the other devices
+#ifdef SIFT3D_WITH_OPENCL
+        if (backend != SIFT3D_BACKEND_OPENCL) {
+                // Keep a host copy of the pyramids
+                if (sync_pyramids_SIFT3D(sift3d, &sift3d->gpyr, 
+                        &sift3d->dog))
+                        return SIFT3D_FAILURE;
+                cleanup_device_SIFT3D(sift3d);
+        }
+#endif
+#ifdef SIFT3D_WITH_CUDA
+        if (backend != SIFT3D_BACKEND_CUDA) {
+                cleanup_SIFT3D_cuda(sift3d->cuda);
+                sift3d->cuda = NULL;
+        }
+#endif
+
+        sift3d->backend = backend;
+
+        // Resize the pyramids, which depend on the backend if fused or 
+        // stored in another type
+        return resize ? resize_SIFT3D(sift3d, sift3d->gpyr.num_kp_levels) :
+                SIFT3D_SUCCESS;
+}
+
+/* Reserve memory for processing images of up to nx x ny x nz voxels. 
+ * Afterwards, SIFT3D_detect_keypoints does not reallocate the internal 
+ * image, pyramids or temporary images for any image which fits in these 
+ * dimensions, as long as it has the same number of octaves. The Gaussian 
+ * filters are only recomputed when the scale parameters change. This avoids
+ * allocation when processing a batch of images of similar sizes.
+ *
+ * The reserved pyramids are sized for the current parameters, so call this
+ * after setting them. This discards the current image, if any. 
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int reserve_SIFT3D(SIFT3D *const sift3d, const int nx, const int ny,
+        const int nz) {
+
+        const Image *base;
+        int o, s, i;
+
+        Image *const im = &sift3d->im;
+        Pyramid *const gpyr = &sift3d->gpyr;
+        Pyramid *const dog = &sift3d->dog;
+
+        // Verify inputs
+        if (nx < 1 || ny < 1 || nz < 1) {
+                SIFT3D_ERR("reserve_SIFT3D: invalid dimensions: "
+                        "[%d, %d, %d] \n", nx, ny, nz);
+                return SIFT3D_FAILURE;
+        }
+
+        // Reserve the internal image, which is left blank
+        im->nx = nx;
+        im->ny = ny;
+        im->nz = nz;
+        im->nc = 1;
+        im_default_stride(im);
+        if (im_reserve(im, (size_t) nx * ny * nz) || im_resize(im))
+                return SIFT3D_FAILURE;
+        im_zero(im);
+
+        // Allocate the pyramids at the maximum size
+        if (resize_SIFT3D(sift3d, gpyr->num_kp_levels))
+                return SIFT3D_FAILURE;
+
+        // Reserve the pyramid levels
+        SIFT3D_PYR_LOOP_START(gpyr, o, s)
+                Image *const level = SIFT3D_PYR_IM_GET(gpyr, o, s);
+                if (im_reserve(level, level->size))
+                        return SIFT3D_FAILURE;
+        SIFT3D_PYR_LOOP_END
+        SIFT3D_PYR_LOOP_START(dog, o, s)
+                Image *const level = SIFT3D_PYR_IM_GET(dog, o, s);
+                if (im_reserve(level, level->size))
+                        return SIFT3D_FAILURE;
+        SIFT3D_PYR_LOOP_END
+
+        // Reserve the temporary images
+        base = SIFT3D_PYR_IM_GET(gpyr, gpyr->first_octave, gpyr->first_level);
+        if (im_reserve(&sift3d->filter_temp, base->size))
+                return SIFT3D_FAILURE;
+        for (i = 0; sift3d->fused && i < 3; i++) {
+                if (im_reserve(sift3d->dog_window + i, base->size))
+                        return SIFT3D_FAILURE;
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
 /* Initialize a SIFT3D struct with the default parameters. */
 int init_SIFT3D(SIFT3D *sift3d) {
 
+        int i;
+
         Pyramid *const dog = &sift3d->dog;
         Pyramid *const gpyr = &sift3d->gpyr;
         GSS_filters *const gss = &sift3d->gss;
@@ -593,6 +1345,25 @@ int init_SIFT3D(SIFT3D *sift3d) {
 	const double sigma_n = sigma_n_default;
 	const double sigma0 = sigma0_default;
         const int dense_rotate = SIFT3D_FALSE;
+        const int fused = SIFT3D_FALSE;
+        const im_type pyr_type = IM_FLOAT32;
+        const int num_threads = 0;
+
+        // Start on the CPU, without device state
+        sift3d->backend = SIFT3D_BACKEND_CPU;
+        sift3d->cl = NULL;
+        sift3d->cuda = NULL;
+        sift3d->pyr_on_device = sift3d->pyr_host_stale = SIFT3D_FALSE;
+        sift3d->cache = NULL;
+        sift3d->stats = NULL;
+        sift3d->grad_cache = SIFT3D_FALSE;
+        sift3d->grads = NULL;
+        sift3d->grads_valid = NULL;
+        sift3d->num_grads = 0;
+        sift3d->mask = NULL;
+        sift3d->octave_masks = NULL;
+        sift3d->num_octave_masks = 0;
+        sift3d->roi_active = SIFT3D_FALSE;
 
 	// First-time pyramid initialization
         init_Pyramid(dog);
@@ -611,10 +1382,17 @@ int init_SIFT3D(SIFT3D *sift3d) {
 
 	// Initialize the image data
 	init_im(&sift3d->im);
+        for (i = 0; i < 3; i++) {
+                init_im(sift3d->dog_window + i);
+        }
+        init_im(&sift3d->filter_temp);
 
 	// Save data
 	dog->first_level = gpyr->first_level = -1;
         sift3d->dense_rotate = dense_rotate;
+        sift3d->fused = fused;
+        sift3d->pyr_type = pyr_type;
+        sift3d->num_threads = num_threads;
         if (set_sigma_n_SIFT3D(sift3d, sigma_n) ||
                 set_sigma0_SIFT3D(sift3d, sigma0) ||
                 set_peak_thresh_SIFT3D(sift3d, peak_thresh) ||
@@ -641,16 +1419,57 @@ int copy_SIFT3D(const SIFT3D *const src, SIFT3D *const dst) {
             set_num_kp_levels_SIFT3D(dst, src->gpyr.num_kp_levels))
                 return SIFT3D_FAILURE;
         dst->dense_rotate = src->dense_rotate;
+        dst->fused = src->fused;
+        dst->pyr_type = src->pyr_type;
+        dst->num_threads = src->num_threads;
+        dst->cache = src->cache;
+        dst->stats = src->stats;
+        dst->grad_cache = src->grad_cache;
+        dst->mask = src->mask;
+        if (set_backend_SIFT3D(dst, src->backend))
+                return SIFT3D_FAILURE;
 
         // Copy the image, if any
         if (src->im.data != NULL && set_im_SIFT3D(dst, &src->im))
                 return SIFT3D_FAILURE;
 
+        // Copy the region covered by the pyramids
+        if (src->roi_active) {
+
+                int o;
+
+                const int num_octaves = src->gpyr.num_octaves;
+
+                if ((dst->octave_masks = (Image *) malloc(num_octaves * 
+                        sizeof(Image))) == NULL)
+                        return SIFT3D_FAILURE;
+                dst->num_octave_masks = num_octaves;
+                for (o = 0; o < num_octaves; o++) {
+                        init_im(dst->octave_masks + o);
+                }
+                for (o = 0; o < num_octaves; o++) {
+                        if (im_copy_data(src->octave_masks + o, 
+                                dst->octave_masks + o))
+                                return SIFT3D_FAILURE;
+                }
+
+                dst->roi_active = SIFT3D_TRUE;
+                memcpy(dst->roi_start, src->roi_start, 
+                        IM_NDIMS * sizeof(int));
+                memcpy(dst->roi_dims, src->roi_dims, IM_NDIMS * sizeof(int));
+        }
+
         // Copy the pyramids, if any
         if (copy_Pyramid(&src->gpyr, &dst->gpyr) ||
             copy_Pyramid(&src->dog, &dst->dog))
                 return SIFT3D_FAILURE;
 
+#ifdef SIFT3D_WITH_OPENCL
+        // Read the pyramids from the device of src, which dst cannot share
+        if (sync_pyramids_SIFT3D(src, &dst->gpyr, &dst->dog))
+                return SIFT3D_FAILURE;
+#endif
+
         return SIFT3D_SUCCESS;
 }
 
@@ -658,19 +1477,46 @@ int copy_SIFT3D(const SIFT3D *const src, SIFT3D *const dst) {
  * unless it is reinitialized. */
 void cleanup_SIFT3D(SIFT3D *const sift3d) {
 
+        int i;
+
 	// Clean up the image copy
 	im_free(&sift3d->im);
 
+        // Clean up the temporary images
+        for (i = 0; i < 3; i++) {
+                im_free(sift3d->dog_window + i);
+        }
+        im_free(&sift3d->filter_temp);
+
         // Clean up the pyramids
         cleanup_Pyramid(&sift3d->gpyr);
         cleanup_Pyramid(&sift3d->dog);
 
+        // Clean up the gradient cache
+        free_grads_SIFT3D(sift3d);
+
+        // Clean up the octave masks
+        if (sift3d->octave_masks != NULL) {
+                for (i = 0; i < sift3d->num_octave_masks; i++) {
+                        im_free(sift3d->octave_masks + i);
+                }
+                free(sift3d->octave_masks);
+        }
+
         // Clean up the GSS filters
         cleanup_GSS_filters(&sift3d->gss);
 
         // Clean up the triangle mesh 
         cleanup_Mesh(&sift3d->mesh);
 
+#ifdef SIFT3D_WITH_OPENCL
+        // Release the device
+        cleanup_device_SIFT3D(sift3d);
+#endif
+#ifdef SIFT3D_WITH_CUDA
+        cleanup_SIFT3D_cuda(sift3d->cuda);
+#endif
+
 #ifdef USE_OPENCL
         // Clean up the OpenCL kernels
         cleanup_SIFT3D_cl_kernels(&sift3d->kernels);
@@ -718,12 +1564,34 @@ void print_opts_SIFT3D(void) {
                "        interval (0, inf). (default: %.2f) \n"
                " --%s [value] \n"
                "    The scale parameter of the first level of octave 0, on \n"
-               "        the interval (0, inf). (default: %.2f) \n",
+               "        the interval (0, inf). (default: %.2f) \n"
+               " --%s \n"
+               "    Detect keypoints without storing the DoG pyramid, \n"
+               "        reducing the memory usage. \n"
+               " --%s [value] \n"
+               "    The number of threads. Must be a nonnegative integer, \n"
+               "        where 0 uses the OpenMP default. (default: 0) \n"
+               " --%s [value] \n"
+               "    The device used for detection and description, either \n"
+               "        cpu, opencl or cuda. (default: %s) \n"
+               " --%s \n"
+               "    Cache the gradients of each pyramid level holding \n"
+               "        keypoints, trading memory for faster orientation \n"
+               "        assignment and description. \n"
+               " --%s \n"
+               "    Store the pyramids in half precision, halving their \n"
+               "        memory at a small cost in accuracy. Only used by \n"
+               "        the cpu backend. \n",
                opt_peak_thresh, peak_thresh_default,
                opt_corner_thresh, corner_thresh_default,
                opt_num_kp_levels, num_kp_levels_default,
                opt_sigma_n, sigma_n_default,
-               opt_sigma0, sigma0_default);
+               opt_sigma0, sigma0_default,
+               opt_fused,
+               opt_num_threads,
+               opt_backend, backend_names[SIFT3D_BACKEND_CPU],
+               opt_grad_cache,
+               opt_half_pyramid);
 
 }
 
@@ -741,6 +1609,12 @@ void print_opts_SIFT3D(void) {
  *    			candidates (int)
  * --sigma_n - base level of blurring assumed in data (double)
  * --sigma0 - level to blur base of pyramid (double)
+ * --fused - detect keypoints without storing the DoG pyramid (no argument)
+ * --threads - number of threads, or 0 for the default (int)
+ * --backend - device used for detection and description (cpu, opencl or cuda)
+ * --grad_cache - cache the gradients of each level holding keypoints 
+ *      (no argument)
+ * --half_pyramid - store the pyramids in half precision (no argument)
  *
  * Parameters:
  *      argc - The number of arguments
@@ -763,6 +1637,11 @@ int parse_args_SIFT3D(SIFT3D *const sift3d,
 #define NUM_KP_LEVELS 'c'
 #define SIGMA_N 'd'
 #define SIGMA0 'e'
+#define FUSED 'f'
+#define NUM_THREADS 'g'
+#define BACKEND 'h'
+#define GRAD_CACHE 'i'
+#define HALF_PYRAMID 'j'
 
         // Options
         const struct option longopts[] = {
@@ -771,6 +1650,11 @@ int parse_args_SIFT3D(SIFT3D *const sift3d,
                 {opt_num_kp_levels, required_argument, NULL, NUM_KP_LEVELS},
                 {opt_sigma_n, required_argument, NULL, SIGMA_N},
                 {opt_sigma0, required_argument, NULL, SIGMA0},
+                {opt_fused, no_argument, NULL, FUSED},
+                {opt_num_threads, required_argument, NULL, NUM_THREADS},
+                {opt_backend, required_argument, NULL, BACKEND},
+                {opt_grad_cache, no_argument, NULL, GRAD_CACHE},
+                {opt_half_pyramid, no_argument, NULL, HALF_PYRAMID},
                 {0, 0, 0, 0}
         };
 
@@ -841,6 +1725,52 @@ int parse_args_SIFT3D(SIFT3D *const sift3d,
                                 processed[idx - 1] = SIFT3D_TRUE;
                                 processed[idx] = SIFT3D_TRUE;
                                 break;
+                        case FUSED:
+                                if (set_fused_SIFT3D(sift3d, SIFT3D_TRUE))
+                                        goto parse_args_quit;
+
+                                processed[idx] = SIFT3D_TRUE;
+                                break;
+                        case NUM_THREADS:
+                                if (set_num_threads_SIFT3D(sift3d, ival))
+                                        goto parse_args_quit;
+
+                                processed[idx - 1] = SIFT3D_TRUE;
+                                processed[idx] = SIFT3D_TRUE;
+                                break;
+                        case BACKEND:
+                        {
+                                int i;
+
+                                for (i = 0; i < NUM_BACKENDS; i++) {
+                                        if (!strcmp(optarg, backend_names[i]))
+                                                break;
+                                }
+                                if (i == NUM_BACKENDS) {
+                                        SIFT3D_ERR("SIFT3D backend must be "
+                                                "cpu, opencl or cuda. "
+                                                "Provided: %s \n", optarg);
+                                        goto parse_args_quit;
+                                }
+
+                                if (set_backend_SIFT3D(sift3d, 
+                                        (SIFT3D_backend) i))
+                                        goto parse_args_quit;
+
+                                processed[idx - 1] = SIFT3D_TRUE;
+                                processed[idx] = SIFT3D_TRUE;
+                                break;
+                        }
+                        case GRAD_CACHE:
+                                set_grad_cache_SIFT3D(sift3d, SIFT3D_TRUE);
+                                processed[idx] = SIFT3D_TRUE;
+                                break;
+                        case HALF_PYRAMID:
+                                if (set_pyr_type_SIFT3D(sift3d, IM_FLOAT16))
+                                        goto parse_args_quit;
+
+                                processed[idx] = SIFT3D_TRUE;
+                                break;
                         case '?':
                         default:
                                 if (!check_err)
@@ -854,6 +1784,11 @@ int parse_args_SIFT3D(SIFT3D *const sift3d,
 #undef NUM_KP_LEVELS
 #undef SIGMA_N
 #undef SIGMA0
+#undef FUSED
+#undef NUM_THREADS
+#undef BACKEND
+#undef GRAD_CACHE
+#undef HALF_PYRAMID
 
         // Put all unprocessed options at the end
         argc_new = argv_remove(argc, argv, processed);
@@ -883,12 +1818,20 @@ parse_args_quit:
 static int set_im_SIFT3D(SIFT3D *const sift3d, const Image *const im) {
 
         int dims_old[IM_NDIMS];
-        int i;
+        int i, num_octaves;
 
 	const float *const data_old = sift3d->im.data;
         const Pyramid *const gpyr = &sift3d->gpyr;
         const int first_octave = sift3d->gpyr.first_octave;
         const int num_kp_levels = gpyr->num_kp_levels;
+        const int num_octaves_old = gpyr->num_octaves;
+
+        // The pyramids of the previous image are discarded, along with
+        // their cached gradients and region
+        sift3d->pyr_on_device = sift3d->pyr_host_stale = SIFT3D_FALSE;
+        if (sift3d->grads_valid != NULL)
+                memset(sift3d->grads_valid, 0, sift3d->num_grads);
+        sift3d->roi_active = SIFT3D_FALSE;
 
         // Make a temporary copy the previous image dimensions
         for (i = 0; i < IM_NDIMS; i++) {
@@ -902,8 +1845,11 @@ static int set_im_SIFT3D(SIFT3D *const sift3d, const Image *const im) {
         // Scale the input image to [-1, 1]
         im_scale(&sift3d->im);
 
-        // Resize the internal data, if necessary
-        if ((data_old == NULL || 
+        // Resize the internal data, if necessary. The pyramids of a region
+        // may have fewer octaves than its dimensions allow.
+        if (get_num_octaves(&sift3d->im, first_octave, &num_octaves))
+                return SIFT3D_FAILURE;
+        if ((data_old == NULL || num_octaves != num_octaves_old ||
                 memcmp(dims_old, SIFT3D_IM_GET_DIMS(&sift3d->im), 
                         IM_NDIMS * sizeof(int))) &&
                 resize_SIFT3D(sift3d, num_kp_levels))
@@ -939,39 +1885,80 @@ static int resize_SIFT3D(SIFT3D *const sift3d, const int num_kp_levels) {
 
         int num_octaves; 
 
+        const Image *const im = &sift3d->im;
+        const int first_octave = 0;
+
+	// Compute the meximum allowed number of octaves
+	if (im->data != NULL) {
+                if (get_num_octaves(im, first_octave, &num_octaves))
+                        return SIFT3D_FAILURE;
+	} else {
+                num_octaves = 0;
+        }
+
+        return resize_SIFT3D_octaves(sift3d, num_kp_levels, num_octaves);
+}
+
+/* Helper function to compute the maximum allowed number of octaves for an
+ * image. The minimum size of a pyramid level is 8 in any dimension. */
+static int get_num_octaves(const Image *const im, const int first_octave,
+        int *const num_octaves) {
+
+        const int last_octave = 
+                (int) log2((double) SIFT3D_MIN(SIFT3D_MIN(im->nx, im->ny), 
+                im->nz)) - 3 - first_octave;
+
+        // Verify octave parameters
+        if (last_octave < first_octave) {
+                SIFT3D_ERR("resize_SIFT3D: input image is too small: "
+                        "must have at least 8 voxels in each "
+                        "dimension \n");
+                return SIFT3D_FAILURE;
+        }
+
+        *num_octaves = last_octave - first_octave + 1;
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper function to get the element type of the pyramids. This is the type
+ * set by set_pyr_type_SIFT3D on the CPU backend, and IM_FLOAT32 otherwise. */
+static im_type get_pyr_type_SIFT3D(const SIFT3D *const sift3d) {
+        return sift3d->backend == SIFT3D_BACKEND_CPU ? sift3d->pyr_type : 
+                IM_FLOAT32;
+}
+
+/* As resize_SIFT3D, but with the given number of octaves. */
+static int resize_SIFT3D_octaves(SIFT3D *const sift3d, 
+        const int num_kp_levels, const int num_octaves) {
+
         const Image *const im = &sift3d->im;
         Pyramid *const gpyr = &sift3d->gpyr;
         Pyramid *const dog = &sift3d->dog;
+        int i;
+
 	const unsigned int num_dog_levels = num_kp_levels + 2;
 	const unsigned int num_gpyr_levels = num_dog_levels + 1;
         const int first_octave = 0;
         const int first_level = -1;
+        const im_type type = get_pyr_type_SIFT3D(sift3d);
 
-	// Compute the meximum allowed number of octaves
-	if (im->data != NULL) {
-                // The minimum size of a pyramid level is 8 in any dimension
-		const int last_octave = 
-                        (int) log2((double) SIFT3D_MIN(SIFT3D_MIN(im->nx, im->ny), 
-                        im->nz)) - 3 - first_octave;
-
-                // Verify octave parameters
-                if (last_octave < first_octave) {
-                        SIFT3D_ERR("resize_SIFT3D: input image is too small: "
-                                "must have at least 8 voxels in each "
-                                "dimension \n");
-                        return SIFT3D_FAILURE;
-                }
+        // The levels on the device no longer match
+        sift3d->pyr_on_device = sift3d->pyr_host_stale = SIFT3D_FALSE;
 
-                num_octaves = last_octave - first_octave + 1;
-	} else {
-                num_octaves = 0;
+        // Set the element type of the pyramids and the fused DoG window
+        gpyr->type = dog->type = type;
+        for (i = 0; i < 3; i++) {
+                if (im_set_type(sift3d->dog_window + i, type))
+                        return SIFT3D_FAILURE;
         }
 
 	// Resize the pyramid
 	if (resize_Pyramid(im, first_level, num_kp_levels,
                 num_gpyr_levels, first_octave, num_octaves, gpyr) ||
 	        resize_Pyramid(im, first_level, num_kp_levels, 
-                num_dog_levels, first_octave, num_octaves, dog))
+                num_dog_levels, first_octave, 
+                sift3d->fused && sift3d->backend != SIFT3D_BACKEND_CUDA ? 
+                0 : num_octaves, dog))
 		return SIFT3D_FAILURE;
 
         // Do nothing more if we have no image
@@ -985,105 +1972,508 @@ static int resize_SIFT3D(SIFT3D *const sift3d, const int num_kp_levels) {
 	return SIFT3D_SUCCESS;
 }
 
-/* Build the GSS pyramid on a single CPU thread */
-static int build_gpyr(SIFT3D *sift3d) {
+/* Build a single level of the GSS pyramid. The previous level of this octave, 
+ * or for the first level, the previous octave, must already be built. */
+static int build_gpyr_level(SIFT3D *const sift3d, const int o, const int s) {
 
         const Image *prev;
 	Sep_FIR_filter *f;
-	Image *cur;
-	int o, s;
 
 	Pyramid *const gpyr = &sift3d->gpyr;
 	const GSS_filters *const gss = &sift3d->gss;
-	const int s_start = gpyr->first_level + 1;
-	const int s_end = SIFT3D_PYR_LAST_LEVEL(gpyr);
-	const int o_start = gpyr->first_octave;
-	const int o_end = SIFT3D_PYR_LAST_OCTAVE(gpyr);
+	Image *const cur = SIFT3D_PYR_IM_GET(gpyr, o, s);
+	const int first_level = gpyr->first_level;
         const double unit = 1.0;
 
-	// Build the first image
-	cur = SIFT3D_PYR_IM_GET(gpyr, o_start, s_start - 1);
-	prev = &sift3d->im;
+        // Build the first image
+        if (o == gpyr->first_octave && s == first_level) {
+	        prev = &sift3d->im;
 #ifdef SIFT3D_USE_OPENCL
-	if (im_load_cl(cur, SIFT3D_FALSE))
-		return SIFT3D_FAILURE;	
+	        if (im_load_cl(cur, SIFT3D_FALSE))
+		        return SIFT3D_FAILURE;	
 #endif
+	        f = (Sep_FIR_filter *) &gss->first_gauss.f;
+	        return apply_Sep_FIR_filter_temp(prev, cur, f, unit, 
+                        &sift3d->filter_temp);
+        }
 
-	f = (Sep_FIR_filter *) &gss->first_gauss.f;
-	if (apply_Sep_FIR_filter(prev, cur, f, unit))
-		return SIFT3D_FAILURE;
+        // Downsample the previous octave
+        if (s == first_level) {
+
+                const int downsample_level = 
+                        SIFT3D_MAX(SIFT3D_PYR_LAST_LEVEL(gpyr) - 2, 
+                        first_level);
+
+                prev = SIFT3D_PYR_IM_GET(gpyr, o - 1, downsample_level);
+
+                assert(fabs(prev->s - cur->s) < FLT_EPSILON);
 
-	// Build the rest of the pyramid
-	SIFT3D_PYR_LOOP_LIMITED_START(o, s, o_start, o_end, s_start, s_end)
-			cur = SIFT3D_PYR_IM_GET(gpyr, o, s);
-			prev = SIFT3D_PYR_IM_GET(gpyr, o, s - 1);
-			f = &gss->gauss_octave[s].f;
-			if (apply_Sep_FIR_filter(prev, cur, f, unit))
-				return SIFT3D_FAILURE;
+                return im_downsample_2x(prev, cur);
+        }
+
+        // Blur the previous level
+        prev = SIFT3D_PYR_IM_GET(gpyr, o, s - 1);
+        f = &gss->gauss_octave[s].f;
+        if (apply_Sep_FIR_filter_temp(prev, cur, f, unit, 
+                &sift3d->filter_temp))
+                return SIFT3D_FAILURE;
 #ifdef SIFT3D_USE_OPENCL
-			if (im_read_back(cur, SIFT3D_FALSE))
-				return SIFT3D_FAILURE;
+	if (im_read_back(cur, SIFT3D_FALSE))
+		return SIFT3D_FAILURE;
 #endif
-		SIFT3D_PYR_LOOP_SCALE_END
-		// Downsample
-		if (o != o_end) {
 
-                        const int downsample_level = 
-                                SIFT3D_MAX(s_end - 2, gpyr->first_level);
+        return SIFT3D_SUCCESS;
+}
 
-			prev = SIFT3D_PYR_IM_GET(gpyr, o, downsample_level);
-			cur = SIFT3D_PYR_IM_GET(gpyr, o + 1, s_start - 1);
+/* Build the GSS pyramid on a single CPU thread */
+static int build_gpyr(SIFT3D *sift3d) {
 
-                        assert(fabs(prev->s - cur->s) < FLT_EPSILON);
+	int o, s;
 
-			if (im_downsample_2x(prev, cur))
-				return SIFT3D_FAILURE;
+	Pyramid *const gpyr = &sift3d->gpyr;
+        const double start = SIFT3D_STATS_START(sift3d->stats);
 
-		}
-	SIFT3D_PYR_LOOP_OCTAVE_END
+	SIFT3D_PYR_LOOP_START(gpyr, o, s)
+                if (build_gpyr_level(sift3d, o, s))
+                        return SIFT3D_FAILURE;
+	SIFT3D_PYR_LOOP_END
 
 #ifdef SIFT3D_USE_OPENCL
 	clFinish_all();
 #endif
 
+        record_SIFT3D_Stats(sift3d->stats, SIFT3D_STAGE_GPYR, start, 
+                gpyr->num_octaves * gpyr->num_levels, 0, 
+                Pyramid_bytes(gpyr));
+
 	return SIFT3D_SUCCESS;
 }
 
-static int build_dog(SIFT3D *sift3d) {
+/* Compute a DoG level as the difference of two Gaussian levels. If dogmax
+ * is not NULL, it is set to the maximum absolute value of the result. */
+static int build_dog_level(const Image *const gpyr_cur, 
+        const Image *const gpyr_next, Image *const dog_level, 
+        float *const dogmax) {
 
-	Image *gpyr_cur, *gpyr_next, *dog_level;
+        float max;
+        int x, y, z;
+
+	// Verify inputs
+	if (gpyr_cur->nx != gpyr_next->nx || gpyr_cur->ny != gpyr_next->ny ||
+	    gpyr_cur->nz != gpyr_next->nz || gpyr_cur->nc != 1 || 
+            gpyr_next->nc != 1)
+		return SIFT3D_FAILURE;
+
+        // Resize the output
+        if (im_copy_dims(gpyr_cur, dog_level) || im_resize(dog_level))
+                return SIFT3D_FAILURE;
+
+        // Reduced-precision levels are subtracted in float rows
+        if (gpyr_cur->type != IM_FLOAT32 || gpyr_next->type != IM_FLOAT32 ||
+                dog_level->type != IM_FLOAT32)
+                return build_dog_level_typed(gpyr_cur, gpyr_next, dog_level, 
+                        dogmax);
+
+        // Subtract, tracking the maximum
+        max = 0.0f;
+	SIFT3D_IM_LOOP_START(dog_level, x, y, z)
+
+                const float val = SIFT3D_IM_GET_VOX(gpyr_cur, x, y, z, 0) -
+                        SIFT3D_IM_GET_VOX(gpyr_next, x, y, z, 0);
+
+                SIFT3D_IM_GET_VOX(dog_level, x, y, z, 0) = val;
+                max = SIFT3D_MAX(max, fabsf(val));
+
+	SIFT3D_IM_LOOP_END
+
+        if (dogmax != NULL)
+                *dogmax = max;
+
+        return SIFT3D_SUCCESS;
+}
+
+/* As build_dog_level, for levels of any element type, computing each row
+ * in float. The input dimensions must already be verified. */
+static int build_dog_level_typed(const Image *const gpyr_cur, 
+        const Image *const gpyr_next, Image *const dog_level, 
+        float *const dogmax) {
+
+        float *buf;
+        float max;
+        int x, y, z;
+
+        const int nx = dog_level->nx;
+
+        if ((buf = (float *) malloc(3 * (size_t) nx * sizeof(float))) == NULL)
+                return SIFT3D_FAILURE;
+
+        // Subtract row by row, tracking the maximum
+        max = 0.0f;
+        for (z = 0; z < dog_level->nz; z++) {
+        for (y = 0; y < dog_level->ny; y++) {
+
+                const float *const cur = im_get_row(gpyr_cur, 
+                        SIFT3D_IM_GET_IDX(gpyr_cur, 0, y, z, 0), nx, buf);
+                const float *const next = im_get_row(gpyr_next, 
+                        SIFT3D_IM_GET_IDX(gpyr_next, 0, y, z, 0), nx, 
+                        buf + nx);
+                float *const out = buf + 2 * nx;
+
+                for (x = 0; x < nx; x++) {
+                        out[x] = cur[x] - next[x];
+                        max = SIFT3D_MAX(max, fabsf(out[x]));
+                }
+
+                im_store_row(dog_level, SIFT3D_IM_GET_IDX(dog_level, 0, y, z, 
+                        0), nx, out);
+        }}
+        free(buf);
+
+        if (dogmax != NULL)
+                *dogmax = max;
+
+        return SIFT3D_SUCCESS;
+}
+
+static int build_dog(SIFT3D *sift3d) {
+
+	Image *gpyr_cur, *gpyr_next, *dog_level;
 	int o, s;
 
 	Pyramid *const dog = &sift3d->dog;
 	Pyramid *const gpyr = &sift3d->gpyr;
+        const double start = SIFT3D_STATS_START(sift3d->stats);
 
 	SIFT3D_PYR_LOOP_START(dog, o, s)
 		gpyr_cur = SIFT3D_PYR_IM_GET(gpyr, o, s);
 		gpyr_next = SIFT3D_PYR_IM_GET(gpyr, o, s + 1);			
 		dog_level = SIFT3D_PYR_IM_GET(dog, o, s);
 		
-		if (im_subtract(gpyr_cur, gpyr_next, 
-						dog_level))
+		if (build_dog_level(gpyr_cur, gpyr_next, dog_level, NULL))
 			return SIFT3D_FAILURE;
 	SIFT3D_PYR_LOOP_END
 
+        record_SIFT3D_Stats(sift3d->stats, SIFT3D_STAGE_DOG, start, 
+                dog->num_octaves * dog->num_levels, 0, Pyramid_bytes(dog));
+
+	return SIFT3D_SUCCESS;
+}
+
+/* Allocate scratch memory for detecting extrema in im, or any smaller
+ * image. */
+static int init_Extrema_buf(Extrema_buf *const buf, const Image *const im) {
+
+        int z;
+
+        buf->nx = im->nx;
+        buf->nz = im->nz;
+        if ((buf->planes = (Extrema_plane *) calloc(buf->nz, 
+                sizeof(Extrema_plane))) == NULL)
+                goto init_Extrema_buf_quit;
+
+        for (z = 0; z < buf->nz; z++) {
+                if ((buf->planes[z].mask = (unsigned char *) malloc(
+                        buf->nx)) == NULL)
+                        goto init_Extrema_buf_quit;
+        }
+
+        return SIFT3D_SUCCESS;
+
+init_Extrema_buf_quit:
+        SIFT3D_ERR("init_Extrema_buf: out of memory \n");
+        cleanup_Extrema_buf(buf);
+        return SIFT3D_FAILURE;
+}
+
+/* Free the memory of an Extrema_buf. */
+static void cleanup_Extrema_buf(Extrema_buf *const buf) {
+
+        int z;
+
+        if (buf->planes == NULL)
+                return;
+
+        for (z = 0; z < buf->nz; z++) {
+                free(buf->planes[z].mask);
+                free(buf->planes[z].rows);
+                free(buf->planes[z].xy);
+        }
+        free(buf->planes);
+        buf->planes = NULL;
+}
+
+/* Compare one row of a DoG level to its neighbors, setting mask[x] to 1 for
+ * each extremum exceeding the peak threshold, or 0 otherwise. The row must 
+ * not be on the boundary of the image. The comparisons are evaluated without
+ * branches, so that the compiler can vectorize them across x.
+ *
+ * Parameters:
+ *  -prev, cur, next: Pointers to the start of the row in the DoG levels at
+ *      scales s - 1, s and s + 1, with unit x stride.
+ *  -ys, zs: The y and z strides of the levels.
+ *  -peak_thresh: The peak threshold.
+ *  -nx: The length of the row. Elements 0 and nx - 1 are not set.
+ *  -mask: The output. */
+static void extrema_row(const float *const prev, const float *const cur, 
+        const float *const next, const ptrdiff_t ys, const ptrdiff_t zs, 
+        const float peak_thresh, const int nx, unsigned char *const mask) {
+
+        int x;
+
+#define CMP_PLANE(im, x, CMP, IGNORESELF, val) ( \
+	((val) CMP (im)[(x) - ys] ) & \
+	((val) CMP (im)[(x) - 1 - ys]) & \
+	((val) CMP (im)[(x) + 1 - ys]) & \
+	(((val) CMP (im)[(x)]) | (IGNORESELF)) & \
+	((val) CMP (im)[(x) - 1]) & \
+	((val) CMP (im)[(x) + 1]) & \
+	((val) CMP (im)[(x) + ys]) & \
+	((val) CMP (im)[(x) - 1 + ys]) & \
+	((val) CMP (im)[(x) + 1 + ys]) )
+#ifdef CUBOID_EXTREMA
+#define CMP_PREV(im, x, CMP, val) ( \
+        CMP_PLANE((im) - zs, x, CMP, 0, val) & \
+        CMP_PLANE(im, x, CMP, 0, val) & \
+        CMP_PLANE((im) + zs, x, CMP, 0, val) \
+)
+#define CMP_CUR(im, x, CMP, val) ( \
+        CMP_PLANE((im) - zs, x, CMP, 0, val) & \
+        CMP_PLANE(im, x, CMP, 1, val) & \
+        CMP_PLANE((im) + zs, x, CMP, 0, val) \
+)
+#define CMP_NEXT(im, x, CMP, val) \
+        CMP_PREV(im, x, CMP, val)
+#else
+#define CMP_PREV(im, x, CMP, val) ( \
+        (val) CMP (im)[x] \
+)
+#define CMP_CUR(im, x, CMP, val) ( \
+	((val) CMP (im)[(x) + 1]) & \
+	((val) CMP (im)[(x) - 1]) & \
+	((val) CMP (im)[(x) + ys]) & \
+	((val) CMP (im)[(x) - ys]) & \
+	((val) CMP (im)[(x) - zs]) & \
+	((val) CMP (im)[(x) + zs]) \
+)
+#define CMP_NEXT(im, x, CMP, val) \
+        CMP_PREV(im, x, CMP, val)
+#endif
+
+        for (x = 1; x < nx - 1; x++) {
+
+                const float pcur = cur[x];
+
+                // Apply the peak threshold, and compare to the neighbors
+                mask[x] = (unsigned char) (
+                        ((pcur > peak_thresh) | (pcur < -peak_thresh)) & ((
+			CMP_PREV(prev, x, >, pcur) &
+			CMP_CUR(cur, x, >, pcur) &
+			CMP_NEXT(next, x, >, pcur)
+			) | (
+			CMP_PREV(prev, x, <, pcur) &
+			CMP_CUR(cur, x, <, pcur) &
+			CMP_NEXT(next, x, <, pcur))));
+        }
+
+#undef CMP_PLANE
+#undef CMP_PREV
+#undef CMP_CUR
+#undef CMP_NEXT
+}
+
+/* Convert the neighborhood of row (y, z) of a typed DoG level to float, for
+ * extrema_row. Row (y + dy, z + dz) is written to 
+ * rows + ((dz + 1) * 3 + dy + 1) * nx, for a buffer of 9 * nx floats. If full
+ * is false, only the rows compared by extrema_row are read: the center row 
+ * of prev and next, and the 6-connected rows of cur. */
+static void load_extrema_rows(const Image *const im, const int y, const int z,
+        const int full, const int is_cur, float *const rows) {
+
+        int dy, dz;
+
+        const int nx = im->nx;
+
+        for (dz = -1; dz <= 1; dz++) {
+        for (dy = -1; dy <= 1; dy++) {
+
+                if (!full && (is_cur ? dy != 0 && dz != 0 : dy != 0 || 
+                        dz != 0))
+                        continue;
+
+                im_load_row(im, SIFT3D_IM_GET_IDX(im, 0, y + dy, z + dz, 0), 
+                        nx, rows + ((dz + 1) * 3 + dy + 1) * nx);
+        }}
+}
+
+/* Detect local extrema in a single DoG level, appending them to kp. The z 
+ * planes are processed in parallel, and the candidates of each plane are 
+ * collected separately, then merged in the same order as a serial scan.
+ *
+ * Parameters:
+ *  -sift3d: The SIFT3D struct, for the parameters.
+ *  -prev, cur, next: The DoG levels at scales s - 1, s and s + 1.
+ *  -dogmax: The maximum absolute value of cur.
+ *  -o, s: The octave and level of cur.
+ *  -buf: Scratch memory, initialized for an image at least as large as cur.
+ *  -kp: The keypoint store.
+ *  -num: The number of keypoints in kp. This is updated on return. */
+static int detect_extrema_level(const SIFT3D *const sift3d, 
+        const Image *const prev, const Image *const cur, 
+        const Image *const next, const float dogmax, const int o, const int s,
+        Extrema_buf *const buf, Keypoint_store *const kp, int *const num) {
+
+        size_t total;
+	int x, y, z, ret;
+
+	const float peak_thresh = sift3d->peak_thresh * dogmax;
+        const ptrdiff_t ys = (ptrdiff_t) cur->ys;
+        const ptrdiff_t zs = (ptrdiff_t) cur->zs;
+        const Image *const mask = get_octave_mask_SIFT3D(sift3d, o);
+        const int nx = cur->nx;
+        const int typed = prev->type != IM_FLOAT32 || 
+                cur->type != IM_FLOAT32 || next->type != IM_FLOAT32;
+#ifdef CUBOID_EXTREMA
+        const int full = SIFT3D_TRUE;
+#else
+        const int full = SIFT3D_FALSE;
+#endif
+
+        // Verify inputs
+        assert(cur->nx <= buf->nx && cur->nz <= buf->nz);
+        assert(cur->xs == 1 && prev->ys == cur->ys && next->zs == cur->zs);
+
+        // Find the candidates in each z plane, skipping the boundaries
+        ret = SIFT3D_SUCCESS;
+#pragma omp parallel for schedule(dynamic) private(x) private(y) \
+        num_threads(SIFT3D_team_size())
+        for (z = 1; z < cur->nz - 1; z++) {
+
+                Extrema_plane *const plane = buf->planes + z;
+
+                // Reduced-precision levels are compared in float rows
+                plane->num = 0;
+                if (typed && plane->rows == NULL && (plane->rows = (float *) 
+                        malloc(27 * (size_t) buf->nx * sizeof(float))) == 
+                        NULL) {
+                        ret = SIFT3D_FAILURE;
+                        continue;
+                }
+
+                for (y = 1; y < cur->ny - 1; y++) {
+
+                        if (typed) {
+
+                                const size_t block = 9 * (size_t) nx;
+                                float *const rows = plane->rows;
+
+                                load_extrema_rows(prev, y, z, full, 0, rows);
+                                load_extrema_rows(cur, y, z, full, 1, 
+                                        rows + block);
+                                load_extrema_rows(next, y, z, full, 0, 
+                                        rows + 2 * block);
+                                extrema_row(rows + 4 * nx, 
+                                        rows + block + 4 * nx,
+                                        rows + 2 * block + 4 * nx, nx, 3 * nx,
+                                        peak_thresh, nx, plane->mask);
+                        } else {
+
+                                const size_t row = SIFT3D_IM_GET_IDX(cur, 0, 
+                                        y, z, 0);
+
+                                extrema_row(prev->data + row, cur->data + row,
+                                        next->data + row, ys, zs, peak_thresh,
+                                        nx, plane->mask);
+                        }
+
+                        for (x = 1; x < cur->nx - 1; x++) {
+
+                                if (!plane->mask[x])
+                                        continue;
+
+                                // Skip the background of the mask
+                                if (mask != NULL && SIFT3D_IM_GET_VOX(mask, 
+                                        x, y, z, 0) == 0.0f)
+                                        continue;
+
+                                // Make room for the candidate
+                                if (plane->num >= plane->cap) {
+
+                                        int *xy;
+
+                                        const size_t cap = 
+                                                SIFT3D_MAX(2 * plane->cap, 64);
+
+                                        if ((xy = (int *) realloc(plane->xy, 
+                                                2 * cap * sizeof(int))) == 
+                                                NULL) {
+                                                ret = SIFT3D_FAILURE;
+                                                break;
+                                        }
+                                        plane->xy = xy;
+                                        plane->cap = cap;
+                                }
+
+                                plane->xy[2 * plane->num] = x;
+                                plane->xy[2 * plane->num + 1] = y;
+                                plane->num++;
+                        }
+                }
+        }
+
+        if (ret != SIFT3D_SUCCESS) {
+                SIFT3D_ERR("detect_extrema_level: out of memory \n");
+                return SIFT3D_FAILURE;
+        }
+
+        // Count the candidates
+        total = 0;
+        for (z = 1; z < cur->nz - 1; z++) {
+                total += buf->planes[z].num;
+        }
+        if (total == 0)
+                return SIFT3D_SUCCESS;
+
+        // Add them to the keypoint store, in order
+        if (resize_Keypoint_store(kp, *num + total))
+                return SIFT3D_FAILURE;
+        for (z = 1; z < cur->nz - 1; z++) {
+
+                size_t i;
+
+                const Extrema_plane *const plane = buf->planes + z;
+
+                for (i = 0; i < plane->num; i++) {
+
+                        Keypoint *const key = kp->buf + (*num)++;
+
+                        if (init_Keypoint(key))
+                                return SIFT3D_FAILURE;
+                        key->o = o;
+                        key->s = s;
+                        key->sd = cur->s;
+			key->xd = (double) plane->xy[2 * i];
+			key->yd = (double) plane->xy[2 * i + 1];
+			key->zd = (double) z;
+                }
+        }
+
 	return SIFT3D_SUCCESS;
 }
 
 /* Detect local extrema */
 static int detect_extrema(SIFT3D *sift3d, Keypoint_store *kp) {
 
+        Extrema_buf buf;
 	Image *cur, *prev, *next;
-	Keypoint *key;
-	float pcur, dogmax, peak_thresh;
-	int o, s, x, y, z, x_start, x_end, y_start, y_end, z_start,
-		z_end, num;
+	float dogmax;
+	int o, s, num;
 
 	const Pyramid *const dog = &sift3d->dog;
 	const int o_start = dog->first_octave;
 	const int o_end = SIFT3D_PYR_LAST_OCTAVE(dog);
 	const int s_start = dog->first_level + 1;
 	const int s_end = SIFT3D_PYR_LAST_LEVEL(dog) - 1;
+        const double start = SIFT3D_STATS_START(sift3d->stats);
 
 	// Verify the inputs
 	if (dog->num_levels < 3) {
@@ -1098,57 +2488,9 @@ static int detect_extrema(SIFT3D *sift3d, Keypoint_store *kp) {
 	kp->ny = cur->ny;
 	kp->nz = cur->nz;
 
-#define CMP_CUBE(im, x, y, z, CMP, IGNORESELF, val) ( \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y),     (z) - 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) - 1, (y),     (z) - 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) + 1, (y),     (z) - 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y) - 1, (z) - 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y) + 1, (z) - 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) - 1, (y) - 1, (z) - 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) + 1, (y) - 1, (z) - 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) - 1, (y) + 1, (z) - 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) + 1, (y) + 1, (z) - 1, 0) && \
-	((val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y),    (z), 0   ) || \
-	    IGNORESELF) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) - 1, (y),     (z), 0    ) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) + 1, (y),     (z), 0    ) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y) - 1, (z), 0    ) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y) + 1, (z), 0    ) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) - 1, (y) - 1, (z), 0    ) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) + 1, (y) - 1, (z), 0    ) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) - 1, (y) + 1, (z), 0    ) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) + 1, (y) + 1, (z), 0    ) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y),     (z) + 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) - 1, (y),     (z) + 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) + 1, (y),     (z) + 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y) - 1, (z) + 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y) + 1, (z) + 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) - 1, (y) - 1, (z) + 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) + 1, (y) - 1, (z) + 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) - 1, (y) + 1, (z) + 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) + 1, (y) + 1, (z) + 1, 0) )
-#ifdef CUBOID_EXTREMA
-#define CMP_PREV(im, x, y, z, CMP, val) \
-        CMP_CUBE(im, x, y, z, CMP, SIFT3D_FALSE, val)
-#define CMP_CUR(im, x, y, z, CMP, val) \
-        CMP_CUBE(im, x, y, z, CMP, SIFT3D_TRUE, val)
-#define CMP_NEXT(im, x, y, z, CMP, val) \
-        CMP_CUBE(im, x, y, z, CMP, SIFT3D_FALSE, val)
-#else
-#define CMP_PREV(im, x, y, z, CMP, val) ( \
-        (val) CMP SIFT3D_IM_GET_VOX( (im), (x), (y), (z), 0) \
-)
-#define CMP_CUR(im, x, y, z, CMP, val) ( \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) + 1, (y),     (z), 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x) - 1, (y),     (z), 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y) + 1, (z), 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y) - 1, (z), 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y),     (z) - 1, 0) && \
-	(val) CMP SIFT3D_IM_GET_VOX( (im), (x),     (y),     (z) + 1, 0) \
-)
-#define CMP_NEXT(im, x, y, z, CMP, val) \
-        CMP_PREV(im, x, y, z, CMP, val)
-#endif
+        // Allocate scratch memory
+        if (init_Extrema_buf(&buf, cur))
+                return SIFT3D_FAILURE;
 
 	num = 0;
 	SIFT3D_PYR_LOOP_LIMITED_START(o, s, o_start, o_end, s_start, s_end)  
@@ -1159,56 +2501,119 @@ static int detect_extrema(SIFT3D *sift3d, Keypoint_store *kp) {
 		next = SIFT3D_PYR_IM_GET(dog, o, s + 1);
 
 		// Find maximum DoG value at this level
-		dogmax = 0.0f;
-		SIFT3D_IM_LOOP_START(cur, x, y, z)
-			dogmax = SIFT3D_MAX(dogmax, 
-                                fabsf(SIFT3D_IM_GET_VOX(cur, x, y, z, 0)));
-		SIFT3D_IM_LOOP_END
-
-		// Adjust threshold
-		peak_thresh = sift3d->peak_thresh * dogmax;
-
-		// Loop through all non-boundary pixels
-		x_start = y_start = z_start = 1;
-		x_end = cur->nx - 2;
-		y_end = cur->ny - 2;
-		z_end = cur->nz - 2;
-		SIFT3D_IM_LOOP_LIMITED_START(cur, x, y, z, x_start, x_end, y_start,
-							  y_end, z_start, z_end)
-			// Sample the center value
-			pcur = SIFT3D_IM_GET_VOX(cur, x, y, z, 0);
-
-			// Apply the peak threshold
-			if ((pcur > peak_thresh || pcur < -peak_thresh) && ((
-				// Compare to the neighbors
-				CMP_PREV(prev, x, y, z, >, pcur) &&
-				CMP_CUR(cur, x, y, z, >, pcur) &&
-				CMP_NEXT(next, x, y, z, >, pcur)
-				) || (
-				CMP_PREV(prev, x, y, z, <, pcur) &&
-				CMP_CUR(cur, x, y, z, <, pcur) &&
-				CMP_NEXT(next, x, y, z, <, pcur))))
-				{
-
-                                // Add a keypoint candidate
-                                num++;
-                                if (resize_Keypoint_store(kp, num))
-                                        return SIFT3D_FAILURE;
-                                key = kp->buf + num - 1;
-                                if (init_Keypoint(key))
-                                        return SIFT3D_FAILURE;
-                                key->o = o;
-                                key->s = s;
-                                key->sd = cur->s;
-				key->xd = (double) x;
-				key->yd = (double) y;
-				key->zd = (double) z;
-                        }
-		SIFT3D_IM_LOOP_END
+		dogmax = im_max_abs(cur);
+
+                // Detect the extrema
+                if (detect_extrema_level(sift3d, prev, cur, next, dogmax, o,
+                        s, &buf, kp, &num)) {
+                        cleanup_Extrema_buf(&buf);
+                        return SIFT3D_FAILURE;
+                }
+
+	SIFT3D_PYR_LOOP_END
+
+        cleanup_Extrema_buf(&buf);
+
+        record_SIFT3D_Stats(sift3d->stats, SIFT3D_STAGE_EXTREMA, start, num, 
+                0, kp->slab.buf_size);
+
+	return SIFT3D_SUCCESS;
+}
+
+/* Build the GSS pyramid and detect local extrema in a single pass, without
+ * storing the DoG pyramid. Each DoG level is computed as soon as its two
+ * Gaussian levels are built, and extrema are detected in a sliding window of
+ * three DoG levels. The results are the same as build_gpyr, build_dog and 
+ * detect_extrema. 
+ *
+ * Octaves before o_start are skipped, in which case the level of octave 
+ * o_start - 1 used for downsampling must already be built. If dogmax_in is 
+ * not NULL, it gives the maximum absolute value of each DoG level, indexed
+ * by (o - first_octave) * num_dog_levels + s - first_level, which is used in
+ * place of the maximum over the level. */
+static int detect_extrema_fused(SIFT3D *const sift3d, const int o_start,
+        const float *const dogmax_in, Keypoint_store *const kp) {
+
+        Extrema_buf buf;
+        float dogmax[3];
+        Image *cur;
+	int o, s, i, num;
+
+	Pyramid *const gpyr = &sift3d->gpyr;
+        Image *const window = sift3d->dog_window;
+	const int first_level = gpyr->first_level;
+	const int num_dog_levels = gpyr->num_levels - 1;
+        const double start = SIFT3D_STATS_START(sift3d->stats);
+
+	// Verify the inputs
+	if (num_dog_levels < 3) {
+		SIFT3D_ERR("detect_extrema_fused: Requires at least 3 levels per "
+                        "octave, provided only %d \n", num_dog_levels);
+		return SIFT3D_FAILURE;
+	}
+
+	// Initialize dimensions of keypoint store
+	cur = SIFT3D_PYR_IM_GET(gpyr, gpyr->first_octave, first_level + 1);
+	kp->nx = cur->nx;
+	kp->ny = cur->ny;
+	kp->nz = cur->nz;
+
+        // Allocate scratch memory
+        if (init_Extrema_buf(&buf, cur))
+                return SIFT3D_FAILURE;
+
+	num = 0;
+	SIFT3D_PYR_LOOP_LIMITED_START(o, s, o_start, 
+                SIFT3D_PYR_LAST_OCTAVE(gpyr), first_level, 
+                SIFT3D_PYR_LAST_LEVEL(gpyr))
+
+                Image *prev, *next;
+                int d;
+
+                // Build the Gaussian level
+                if (build_gpyr_level(sift3d, o, s))
+                        goto detect_extrema_fused_quit;
+
+                // Wait for two Gaussian levels
+                if (s == first_level)
+                        continue;
+
+                // Build the DoG level d, overwriting level d - 3
+                d = s - 1;
+                i = (d - first_level) % 3;
+                if (build_dog_level(SIFT3D_PYR_IM_GET(gpyr, o, d), 
+                        SIFT3D_PYR_IM_GET(gpyr, o, s), window + i, 
+                        dogmax + i))
+                        goto detect_extrema_fused_quit;
+                window[i].s = SIFT3D_PYR_IM_GET(gpyr, o, d)->s;
+
+                // Wait for three DoG levels
+                if (d < first_level + 2)
+                        continue;
+
+                // Detect extrema in DoG level d - 1
+                prev = window + (d - 2 - first_level) % 3;
+                cur = window + (d - 1 - first_level) % 3;
+                next = window + i;
+                if (detect_extrema_level(sift3d, prev, cur, next, 
+                        dogmax_in == NULL ? dogmax[cur - window] : 
+                        dogmax_in[(o - gpyr->first_octave) * num_dog_levels + 
+                        d - 1 - first_level], o, d - 1, &buf, kp, &num))
+                        goto detect_extrema_fused_quit;
+
 	SIFT3D_PYR_LOOP_END
-#undef CMP_NEIGHBORS
+
+        cleanup_Extrema_buf(&buf);
+
+        // The pyramid stages cannot be timed apart from this one
+        record_SIFT3D_Stats(sift3d->stats, SIFT3D_STAGE_EXTREMA, start, num, 
+                0, kp->slab.buf_size);
 
 	return SIFT3D_SUCCESS;
+
+detect_extrema_fused_quit:
+        cleanup_Extrema_buf(&buf);
+        return SIFT3D_FAILURE;
 }
 
 /* Bin a Cartesian gradient into Spherical gradient bins */
@@ -1264,43 +2669,72 @@ static void refine_Hist(Hist *hist) {
 static int assign_orientations(SIFT3D *const sift3d, 
 			       Keypoint_store *const kp) {
 
+        Eig_ori_batch batch;
 	Keypoint *kp_pos;
 	size_t num;
 	int i, err; 
 
-	// Iterate over the keypoints 
+        const size_t num_in = kp->slab.num;
+        const size_t bytes = kp->slab.buf_size;
+        const double start = SIFT3D_STATS_START(sift3d->stats);
+
+        // Compute the gradients of the levels holding keypoints, if enabled
+        if (prepare_grads_SIFT3D(sift3d, kp))
+                return SIFT3D_FAILURE;
+
+        // Allocate the structure tensors
+        if (init_Eig_ori_batch(&batch, kp->slab.num))
+                return SIFT3D_FAILURE;
+
+	// Form the structure tensor of each keypoint
         err = SIFT3D_SUCCESS;
-#pragma omp parallel for
+#pragma omp parallel for num_threads(SIFT3D_team_size())
 	for (i = 0; i < kp->slab.num; i++) {
 
 		Keypoint *const key = kp->buf + i;
 		const Image *const level = 
                         SIFT3D_PYR_IM_GET(&sift3d->gpyr, key->o, key->s);
-                Mat_rm *const R = &key->R;
                 const Cvec vcenter = {key->xd, key->yd, key->zd};
                 const double sigma = ori_sig_fctr * key->sd;
 
-		// Compute dominant orientations
+                if (eig_ori_window(level, 
+                        get_grads_SIFT3D(sift3d, key->o, key->s), &vcenter, 
+                        sigma, batch.tensors + 6 * i, batch.vd_win + i))
+                        err = SIFT3D_FAILURE;
+	}
+
+        // Decompose the tensors together
+        if (err || eigen_sym3_batch(batch.tensors, kp->slab.num, batch.evals,
+                batch.evecs))
+                goto assign_orientations_quit;
+
+	// Compute dominant orientations
+	for (i = 0; i < kp->slab.num; i++) {
+
+                double conf;
+
+		Keypoint *const key = kp->buf + i;
+                Mat_rm *const R = &key->R;
+
                 assert(R->u.data_float == key->r_data);
-		switch (assign_orientation_thresh(level, &vcenter, sigma,
-                                       sift3d->corner_thresh, R)) {
+                switch (eig_ori_assign(batch.evals + IM_NDIMS * i, 
+                        batch.evecs + IM_NDIMS * IM_NDIMS * i, 
+                        batch.vd_win + i, R, &conf)) {
 			case SIFT3D_SUCCESS:
-				// Continue processing this keypoint
-				break;
+				// Mark unconfident keypoints as invalid
+                                if (conf < sift3d->corner_thresh)
+                                        key->xd = key->yd = key->zd = -1.0;
+                                break;
 			case REJECT:
 				// Mark this keypoint as invalid
                                 key->xd = key->yd = key->zd = -1.0;
-                                continue;
+                                break;
 			default:
 				// Any other return value is an error
-                                err = SIFT3D_FAILURE;
-                                continue;
+                                goto assign_orientations_quit;
 		}
-		
 	}
-
-        // Check for errors
-        if (err) return err;
+        cleanup_Eig_ori_batch(&batch);
 
         // Rebuild the keypoint buffer in place
 	kp_pos = kp->buf;
@@ -1321,78 +2755,93 @@ static int assign_orientations(SIFT3D *const sift3d,
 
 	// Release unneeded keypoint memory
 	num = kp_pos - kp->buf;
-        return resize_Keypoint_store(kp, num);
+        if (resize_Keypoint_store(kp, num))
+                return SIFT3D_FAILURE;
+
+        record_SIFT3D_Stats(sift3d->stats, SIFT3D_STAGE_ORIENT, start, num, 
+                num_in - num, bytes);
+
+        return SIFT3D_SUCCESS;
+
+assign_orientations_quit:
+        cleanup_Eig_ori_batch(&batch);
+        return SIFT3D_FAILURE;
 }
 
-/* Helper function to call assign_eig_ori, and reject keypoints with
- * confidence below the parameter "thresh." All other parameters are the same.
- * All return values are the same, except REJECT is returned if 
- * conf < thresh. */
-static int assign_orientation_thresh(const Image *const im, 
-        const Cvec *const vcenter, const double sigma, const double thresh,
-        Mat_rm *const R) {
+/* Allocate the intermediates of orientation assignment for num windows. */
+static int init_Eig_ori_batch(Eig_ori_batch *const batch, const int num) {
 
-        double conf;
-        int ret;
+        const size_t num_alloc = (size_t) SIFT3D_MAX(num, 1);
 
-        ret = assign_eig_ori(im, vcenter, sigma, R, &conf);
+        batch->vd_win = NULL;
+        if ((batch->tensors = malloc(num_alloc * (6 + IM_NDIMS + 
+                IM_NDIMS * IM_NDIMS) * sizeof(double))) == NULL ||
+                (batch->vd_win = malloc(num_alloc * sizeof(Cvec))) == NULL) {
+                SIFT3D_ERR("init_Eig_ori_batch: out of memory \n");
+                cleanup_Eig_ori_batch(batch);
+                return SIFT3D_FAILURE;
+        }
+        batch->evals = batch->tensors + 6 * num_alloc;
+        batch->evecs = batch->evals + IM_NDIMS * num_alloc;
 
-        return ret == SIFT3D_SUCCESS ? 
-                (conf < thresh ? REJECT : SIFT3D_SUCCESS) : ret;
+        return SIFT3D_SUCCESS;
 }
 
+/* Release the memory of an Eig_ori_batch. */
+static void cleanup_Eig_ori_batch(Eig_ori_batch *const batch) {
 
-/* Assign an orientation to a point in an image.
+        if (batch->tensors != NULL)
+                free(batch->tensors);
+        if (batch->vd_win != NULL)
+                free(batch->vd_win);
+        batch->tensors = batch->evals = batch->evecs = NULL;
+        batch->vd_win = NULL;
+}
+
+/* Form the windowed structure tensor and gradient around a point in an 
+ * image, for orientation assignment.
  *
  * Parameters:
  *   -im: The image data.
+ *   -grads: The cached gradients of im, from get_grads_SIFT3D, or NULL to
+ *      compute them from im.
  *   -vcenter: The center of the window, in image space.
  *   -sigma: The scale parameter. The width of the window is a constant
  *      multiple of this.
- *   -R: The place to write the rotation matrix.
+ *   -a: The place to write the upper triangle of the [3x3] tensor, in the
+ *      layout of eigen_sym3.
+ *   -vd_win: The place to write the window gradient.
  */
-static int assign_eig_ori(const Image *const im, const Cvec *const vcenter,
-                          const double sigma, Mat_rm *const R, 
-                          double *const conf) {
-
-    Cvec v[2];
-    Mat_rm A, L, Q;
-    Cvec vd_win, vdisp, vr;
-    double d, cos_ang, abs_cos_ang, corner_score;
-    float weight, sq_dist, sgn;
-    int i, x, y, z, m;
+static int eig_ori_window(const Image *const im, const Image *const grads,
+                          const Cvec *const vcenter,
+                          const double sigma, double *const a, 
+                          Cvec *const vd_win) {
+
+    Cvec vdisp;
+    float weight, sq_dist;
+    int x, y, z, k;
   
     const double win_radius = sigma * ori_rad_fctr; 
 
     // Verify inputs
     if (!SIFT3D_IM_CONTAINS_CVEC(im, vcenter)) {
-        SIFT3D_ERR("assign_eig_ori: vcenter (%f, %f, %f) lies "
+        SIFT3D_ERR("eig_ori_window: vcenter (%f, %f, %f) lies "
                 "outside the boundaries of im [%d x %d x %d] \n", 
                 vcenter->x, vcenter->y, vcenter->z, im->nx, im->ny, im->nz);
         return SIFT3D_FAILURE;
     }
     if (sigma < 0) {
-        SIFT3D_ERR("assign_eig_ori: invalid sigma: %f \n", sigma);
+        SIFT3D_ERR("eig_ori_window: invalid sigma: %f \n", sigma);
         return SIFT3D_FAILURE;
     }
 
-    // Initialize the intermediates
-    if (init_Mat_rm(&A, 3, 3, SIFT3D_DOUBLE, SIFT3D_TRUE))
-        return SIFT3D_FAILURE;
-    if (init_Mat_rm(&L, 0, 0, SIFT3D_DOUBLE, SIFT3D_TRUE) ||
-	init_Mat_rm(&Q, 0, 0, SIFT3D_DOUBLE, SIFT3D_TRUE))
-	goto eig_ori_fail;
-
-    // Resize the output
-    R->num_rows = R->num_cols = IM_NDIMS;
-    R->type = SIFT3D_FLOAT;
-    if (resize_Mat_rm(R))
-        goto eig_ori_fail;
-
     // Form the structure tensor and window gradient
-    vd_win.x = 0.0f;
-    vd_win.y = 0.0f;
-    vd_win.z = 0.0f;
+    for (k = 0; k < 6; k++) {
+        a[k] = 0.0;
+    }
+    vd_win->x = 0.0f;
+    vd_win->y = 0.0f;
+    vd_win->z = 0.0f;
     IM_LOOP_SPHERE_START(im, x, y, z, vcenter, win_radius, &vdisp, sq_dist)
 
         Cvec vd;
@@ -1401,45 +2850,61 @@ static int assign_eig_ori(const Image *const im, const Cvec *const vcenter,
 	weight = expf(-0.5 * sq_dist / (sigma * sigma));		
 
 	// Get the gradient	
-	IM_GET_GRAD_ISO(im, x, y, z, 0, &vd);
+	IM_GET_GRAD_ISO_CACHED(im, grads, x, y, z, &vd);
 
 	// Update the structure tensor
-	SIFT3D_MAT_RM_GET(&A, 0, 0, double) += (double) vd.x * vd.x * weight;
-	SIFT3D_MAT_RM_GET(&A, 0, 1, double) += (double) vd.x * vd.y * weight;
-	SIFT3D_MAT_RM_GET(&A, 0, 2, double) += (double) vd.x * vd.z * weight;
-	SIFT3D_MAT_RM_GET(&A, 1, 1, double) += (double) vd.y * vd.y * weight;
-	SIFT3D_MAT_RM_GET(&A, 1, 2, double) += (double) vd.y * vd.z * weight;
-	SIFT3D_MAT_RM_GET(&A, 2, 2, double) += (double) vd.z * vd.z * weight;
+	a[0] += (double) vd.x * vd.x * weight;
+	a[1] += (double) vd.x * vd.y * weight;
+	a[2] += (double) vd.x * vd.z * weight;
+	a[3] += (double) vd.y * vd.y * weight;
+	a[4] += (double) vd.y * vd.z * weight;
+	a[5] += (double) vd.z * vd.z * weight;
 
 	// Update the window gradient
         SIFT3D_CVEC_SCALE(&vd, weight);
-	SIFT3D_CVEC_OP(&vd_win, &vd, +, &vd_win);
+	SIFT3D_CVEC_OP(vd_win, &vd, +, vd_win);
 
     IM_LOOP_SPHERE_END
 
-    // Fill in the remaining elements
-    SIFT3D_MAT_RM_GET(&A, 1, 0, double) = SIFT3D_MAT_RM_GET(&A, 0, 1, double);
-    SIFT3D_MAT_RM_GET(&A, 2, 0, double) = SIFT3D_MAT_RM_GET(&A, 0, 2, double);
-    SIFT3D_MAT_RM_GET(&A, 2, 1, double) = SIFT3D_MAT_RM_GET(&A, 1, 2, double);
+    return SIFT3D_SUCCESS;
+}
+
+/* Assign an orientation given the eigendecomposition of the windowed 
+ * structure tensor, from eigen_sym3, and the window gradient.
+ *
+ * Parameters:
+ *   -L: The eigenvalues, in ascending order.
+ *   -Q: The [3x3] row-major eigenvectors, in columns.
+ *   -vd_win: The window gradient.
+ *   -R: The place to write the rotation matrix. It is resized to [3x3] and of
+ *      type float.
+ *   -conf: If not NULL, the place to write the confidence score.
+ */
+static int eig_ori_assign(const double *const L, const double *const Q,
+        const Cvec *const vd_win, Mat_rm *const R, double *const conf) {
+
+    Cvec v[2];
+    Cvec vr;
+    double d, cos_ang, abs_cos_ang, corner_score;
+    float sgn;
+    int i;
+
+    const int m = IM_NDIMS;
 
     // Reject keypoints with weak gradient 
-    if (SIFT3D_CVEC_L2_NORM_SQ(&vd_win) < (float) ori_grad_thresh) {
+    if (SIFT3D_CVEC_L2_NORM_SQ(vd_win) < (float) ori_grad_thresh) {
 	goto eig_ori_reject;
     } 
 
-    // Get the eigendecomposition
-    if (eigen_Mat_rm(&A, &Q, &L))
-	goto eig_ori_fail;
-
-    // Ensure we have distinct eigenvalues
-    m = L.num_rows;
-    if (m != 3)
-	goto eig_ori_reject;
+    // Resize the output
+    R->num_rows = R->num_cols = IM_NDIMS;
+    R->type = SIFT3D_FLOAT;
+    if (resize_Mat_rm(R))
+        goto eig_ori_fail;
 
     // Test the eigenvectors for stability
     for (i = 0; i < m - 1; i++) {
-	if (fabs(SIFT3D_MAT_RM_GET(&L, i, 0, double) /
-		 SIFT3D_MAT_RM_GET(&L, i + 1, 0, double)) > max_eig_ratio)
+	if (fabs(L[i] / L[i + 1]) > max_eig_ratio)
 	    goto eig_ori_reject;
     }
 
@@ -1450,15 +2915,15 @@ static int assign_eig_ori(const Image *const im, const Cvec *const vcenter,
 	const int eig_idx = m - i - 1;
 
 	// Get an eigenvector, in descending order
-	vr.x = (float) SIFT3D_MAT_RM_GET(&Q, 0, eig_idx, double);
-	vr.y = (float) SIFT3D_MAT_RM_GET(&Q, 1, eig_idx, double);
-	vr.z = (float) SIFT3D_MAT_RM_GET(&Q, 2, eig_idx, double);
+	vr.x = (float) Q[eig_idx];
+	vr.y = (float) Q[IM_NDIMS + eig_idx];
+	vr.z = (float) Q[2 * IM_NDIMS + eig_idx];
 
 	// Get the directional derivative
-	d = SIFT3D_CVEC_DOT(&vd_win, &vr);
+	d = SIFT3D_CVEC_DOT(vd_win, &vr);
 
         // Get the cosine of the angle between the eigenvector and the gradient
-        cos_ang = d / (SIFT3D_CVEC_L2_NORM(&vr) * SIFT3D_CVEC_L2_NORM(&vd_win));
+        cos_ang = d / (SIFT3D_CVEC_L2_NORM(&vr) * SIFT3D_CVEC_L2_NORM(vd_win));
         abs_cos_ang = fabs(cos_ang);
 
         // Compute the corner confidence score
@@ -1491,25 +2956,16 @@ static int assign_eig_ori(const Image *const im, const Cvec *const vcenter,
     if (conf != NULL)
         *conf = corner_score;
 
-    cleanup_Mat_rm(&A);
-    cleanup_Mat_rm(&Q);
-    cleanup_Mat_rm(&L);
     return SIFT3D_SUCCESS; 
 
 eig_ori_reject:
     if (conf != NULL)
         *conf = 0.0;
-    cleanup_Mat_rm(&A);
-    cleanup_Mat_rm(&Q);
-    cleanup_Mat_rm(&L);
     return REJECT;
 
 eig_ori_fail:
     if (conf != NULL)
         *conf = 0.0;
-    cleanup_Mat_rm(&A);
-    cleanup_Mat_rm(&Q);
-    cleanup_Mat_rm(&L);
     return SIFT3D_FAILURE;
 }
 
@@ -1534,19 +2990,39 @@ eig_ori_fail:
 int SIFT3D_assign_orientations(const SIFT3D *const sift3d, 
         const Image *const im, Keypoint_store *const kp, double **const conf) {
 
+        int ret;
+
+        const double start = SIFT3D_STATS_START(sift3d->stats);
+        const int num_threads = push_num_threads(sift3d);
+        ret = _SIFT3D_assign_orientations(sift3d, im, kp, conf);
+        SIFT3D_set_num_threads(num_threads);
+
+        if (ret == SIFT3D_SUCCESS)
+                record_SIFT3D_Stats(sift3d->stats, SIFT3D_STAGE_ORIENT, start, 
+                        kp->slab.num, 0, kp->slab.buf_size);
+
+        return ret;
+}
+
+/* Helper function for SIFT3D_assign_orientations, using the thread count of
+ * the calling thread. */
+static int _SIFT3D_assign_orientations(const SIFT3D *const sift3d, 
+        const Image *const im, Keypoint_store *const kp, double **const conf) {
+
+        Eig_ori_batch batch;
         Image im_smooth;
-        Keypoint key_base;
-        int i;
+        int i, err;
 
         const int num = kp->slab.num;
 
         // Verify inputs 
-        if (verify_keys(kp, im))
+        if (verify_keys(kp, im, NULL))
                 return SIFT3D_FAILURE;
 
         // Initialize intermediates
         init_im(&im_smooth);
-        init_Keypoint(&key_base);
+        if (init_Eig_ori_batch(&batch, num))
+                return SIFT3D_FAILURE;
 
         // Resize conf (num cannot be zero)
         if ((*conf = SIFT3D_safe_realloc(*conf, num * sizeof(double))) == NULL)
@@ -1556,28 +3032,48 @@ int SIFT3D_assign_orientations(const SIFT3D *const sift3d,
         if (smooth_scale_raw_input(sift3d, im, &im_smooth))
                 goto assign_orientations_quit;
 
-        // Assign each orientation
+        // Form the structure tensor of each keypoint
+        err = SIFT3D_SUCCESS;
+#pragma omp parallel for num_threads(SIFT3D_team_size())
         for (i = 0; i < num; i++) {
 
+                Keypoint key_base;
                 Cvec vcenter;
-                int j;
 
-                Keypoint *const key = kp->buf + i;
-                double *const conf_ret = *conf + i;
-                Mat_rm *const R = &key->R;
+                const Keypoint *const key = kp->buf + i;
 
                 // Convert the keypoint to the base octave
-                if (keypoint2base(key, &key_base))
-                        goto assign_orientations_quit;
+                init_Keypoint(&key_base);
+                if (keypoint2base(key, &key_base)) {
+                        err = SIFT3D_FAILURE;
+                        continue;
+                }
 
                 // Convert the keypoint to a vector
                 vcenter.x = key_base.xd;
                 vcenter.y = key_base.yd;
                 vcenter.z = key_base.zd;
 
-                // Assign the orientation
-                switch (assign_eig_ori(&im_smooth, &vcenter, key_base.sd, R, 
-                                       conf_ret))
+                if (eig_ori_window(&im_smooth, NULL, &vcenter, key_base.sd,
+                        batch.tensors + 6 * i, batch.vd_win + i))
+                        err = SIFT3D_FAILURE;
+        }
+
+        // Decompose the tensors together
+        if (err || eigen_sym3_batch(batch.tensors, num, batch.evals, 
+                batch.evecs))
+                goto assign_orientations_quit;
+
+        // Assign each orientation
+        for (i = 0; i < num; i++) {
+
+                Keypoint *const key = kp->buf + i;
+                double *const conf_ret = *conf + i;
+                Mat_rm *const R = &key->R;
+
+                switch (eig_ori_assign(batch.evals + IM_NDIMS * i, 
+                        batch.evecs + IM_NDIMS * IM_NDIMS * i, 
+                        batch.vd_win + i, R, conf_ret))
                 {
                         case SIFT3D_SUCCESS:
                                 break;
@@ -1594,11 +3090,13 @@ int SIFT3D_assign_orientations(const SIFT3D *const sift3d,
         }
 
         // Clean up
+        cleanup_Eig_ori_batch(&batch);
         im_free(&im_smooth);
 
         return SIFT3D_SUCCESS;
 
 assign_orientations_quit:
+        cleanup_Eig_ori_batch(&batch);
         im_free(&im_smooth);
         return SIFT3D_FAILURE;
 }
@@ -1609,6 +3107,20 @@ assign_orientations_quit:
 int SIFT3D_detect_keypoints(SIFT3D *const sift3d, const Image *const im,
 			    Keypoint_store *const kp) {
 
+        int ret;
+
+        const int num_threads = push_num_threads(sift3d);
+        ret = _SIFT3D_detect_keypoints(sift3d, im, kp);
+        SIFT3D_set_num_threads(num_threads);
+
+        return ret;
+}
+
+/* Helper function for SIFT3D_detect_keypoints, using the thread count of the
+ * calling thread. */
+static int _SIFT3D_detect_keypoints(SIFT3D *const sift3d, 
+        const Image *const im, Keypoint_store *const kp) {
+
         // Verify inputs
         if (im->nc != 1) {
                 SIFT3D_ERR("SIFT3D_detect_keypoints: invalid number "
@@ -1617,20 +3129,54 @@ int SIFT3D_detect_keypoints(SIFT3D *const sift3d, const Image *const im,
                 return SIFT3D_FAILURE;
         }
 
+        // Process only the region of the mask, if any
+        if (sift3d->mask != NULL)
+                return detect_keypoints_roi(sift3d, im, kp);
+
         // Set the image       
         if (set_im_SIFT3D(sift3d, im))
                 return SIFT3D_FAILURE;
 
-	// Build the GSS pyramid
-	if (build_gpyr(sift3d))
-		return SIFT3D_FAILURE;
+#ifdef SIFT3D_WITH_OPENCL
+        // Run on the device, if requested, timing it as a single stage
+        if (sift3d->backend == SIFT3D_BACKEND_OPENCL) {
 
-	// Build the DoG pyramid
-	if (build_dog(sift3d))
-		return SIFT3D_FAILURE;
+                const double start = SIFT3D_STATS_START(sift3d->stats);
+
+                if (detect_keypoints_device(sift3d, kp))
+                        return SIFT3D_FAILURE;
+                record_SIFT3D_Stats(sift3d->stats, SIFT3D_STAGE_ORIENT, start,
+                        kp->slab.num, 0, kp->slab.buf_size);
+                return SIFT3D_SUCCESS;
+        }
+#endif
+
+#ifdef SIFT3D_WITH_CUDA
+        // Build the pyramids on the device, if requested, and detect extrema
+        // on the host
+        if (sift3d->backend == SIFT3D_BACKEND_CUDA) {
+
+                const double start = SIFT3D_STATS_START(sift3d->stats);
+
+                if (build_pyramids_cuda_SIFT3D(sift3d))
+                        return SIFT3D_FAILURE;
+                record_SIFT3D_Stats(sift3d->stats, SIFT3D_STAGE_DOG, start,
+                        sift3d->dog.num_octaves * sift3d->dog.num_levels, 0,
+                        Pyramid_bytes(&sift3d->dog));
+                if (detect_extrema(sift3d, kp) ||
+                        assign_orientations(sift3d, kp))
+                        return SIFT3D_FAILURE;
+                return SIFT3D_SUCCESS;
+        }
+#endif
 
-	// Detect extrema
-	if (detect_extrema(sift3d, kp))
+        // Build the GSS and DoG pyramids and detect extrema
+        if (sift3d->fused) {
+                if (detect_extrema_fused(sift3d, sift3d->gpyr.first_octave, 
+                        NULL, kp))
+                        return SIFT3D_FAILURE;
+        } else if (build_gpyr(sift3d) || build_dog(sift3d) ||
+                detect_extrema(sift3d, kp))
 		return SIFT3D_FAILURE;
 
 	// Assign orientations
@@ -1640,1592 +3186,6760 @@ int SIFT3D_detect_keypoints(SIFT3D *const sift3d, const Image *const im,
 	return SIFT3D_SUCCESS;
 }
 
-/* Get the bin and barycentric coordinates of a vector in the icosahedral 
- * histogram. */
-SIFT3D_IGNORE_UNUSED
-static int icos_hist_bin(const SIFT3D * const sift3d,
-			   const Cvec * const x, Cvec * const bary,
-			   int * const bin) { 
+/* Helper function for _SIFT3D_detect_keypoints, restricted to the mask of 
+ * sift3d. The pyramids are built only for the bounding box of the mask, 
+ * enlarged by the halo of get_tile_halo, so that the pyramid levels inside
+ * the box are the same as for the whole image. Extrema are kept only where
+ * the mask, downsampled to their octave, is nonzero. The keypoints are 
+ * returned in the coordinates of im, and SIFT3D_extract_descriptors accepts
+ * them as such. Note that the peak threshold is relative to the DoG maxima 
+ * of the region, rather than the whole image. */
+static int detect_keypoints_roi(SIFT3D *const sift3d, const Image *const im,
+        Keypoint_store *const kp) {
+
+        Tile tile;
+        int lo[IM_NDIMS], hi[IM_NDIMS], halo[IM_NDIMS];
+        int i, x, y, z, num_octaves, align;
+
+        const Image *const mask = sift3d->mask;
+        const int first_octave = sift3d->gpyr.first_octave;
 
-	float k;
-	int i;
+        // Verify inputs
+        if (verify_mask_SIFT3D(sift3d, im))
+                return SIFT3D_FAILURE;
+        if (sift3d->backend != SIFT3D_BACKEND_CPU) {
+                SIFT3D_ERR("SIFT3D_detect_keypoints: masks are only "
+                        "supported by the CPU backend \n");
+                return SIFT3D_FAILURE;
+        }
 
-	const Mesh * const mesh = &sift3d->mesh;
+        // Get the bounding box of the mask
+        for (i = 0; i < IM_NDIMS; i++) {
+                lo[i] = SIFT3D_IM_GET_DIMS(mask)[i];
+                hi[i] = 0;
+        }
+        SIFT3D_IM_LOOP_START(mask, x, y, z)
 
-	// Check for very small vectors
-	if (SIFT3D_CVEC_L2_NORM_SQ(x) < bary_eps)
-		return SIFT3D_FAILURE;
+                if (SIFT3D_IM_GET_VOX(mask, x, y, z, 0) == 0.0f)
+                        continue;
 
-	// Iterate through the faces
-	for (i = 0; i < ICOS_NFACES; i++) {
+                lo[0] = SIFT3D_MIN(lo[0], x);
+                lo[1] = SIFT3D_MIN(lo[1], y);
+                lo[2] = SIFT3D_MIN(lo[2], z);
+                hi[0] = SIFT3D_MAX(hi[0], x + 1);
+                hi[1] = SIFT3D_MAX(hi[1], y + 1);
+                hi[2] = SIFT3D_MAX(hi[2], z + 1);
 
-		const Tri * const tri = mesh->tri + i;
+        SIFT3D_IM_LOOP_END
 
-		// Convert to barycentric coordinates
-		if (cart2bary(x, tri, bary, &k))
-			continue;
+        // Nothing to detect in an empty mask
+        if (hi[0] <= lo[0]) {
+                kp->nx = im->nx;
+                kp->ny = im->ny;
+                kp->nz = im->nz;
+                return resize_Keypoint_store(kp, 0);
+        }
 
-		// Test for intersection
-		if (bary->x < -bary_eps || bary->y < -bary_eps ||
-		    bary->z < -bary_eps || k < 0)
-			continue;
+        // Keep the octaves of the whole image, and get the region which 
+        // reproduces them, as for a tile of SIFT3D_extract_features_tiled
+        if (get_num_octaves(im, first_octave, &num_octaves) ||
+                get_tile_halo(sift3d, im, num_octaves, halo))
+                return SIFT3D_FAILURE;
+        align = 1 << (num_octaves - 1);
+        for (i = 0; i < IM_NDIMS; i++) {
 
-		// Save the bin
-		*bin = i;
+                const int n = SIFT3D_IM_GET_DIMS(im)[i];
+                const int min_len = 8 * align;
+
+                tile.core_start[i] = lo[i];
+                tile.core_end[i] = hi[i];
+                tile.start[i] = SIFT3D_MAX(lo[i] - halo[i], 0) / align * 
+                        align;
+                tile.end[i] = SIFT3D_MIN(hi[i] + halo[i], n);
+
+                // Enlarge small regions to support all the octaves
+                if (tile.end[i] - tile.start[i] < min_len) {
+                        tile.start[i] = tile.end[i] >= min_len ?
+                                (tile.end[i] - min_len) / align * align : 0;
+                        tile.end[i] = SIFT3D_MAX(tile.end[i], 
+                                tile.start[i] + min_len);
+                }
+        }
 
-		// No other triangles will be intersected
-		return SIFT3D_SUCCESS;
-	}	
+        // Set the region as the image, and downsample the mask to its octaves
+        if (set_tile_SIFT3D(sift3d, im, &tile, im_max_abs(im), num_octaves) ||
+                set_octave_masks_SIFT3D(sift3d, &tile, num_octaves))
+                return SIFT3D_FAILURE;
+        sift3d->roi_active = SIFT3D_TRUE;
+        for (i = 0; i < IM_NDIMS; i++) {
+                sift3d->roi_start[i] = tile.start[i];
+                sift3d->roi_dims[i] = SIFT3D_IM_GET_DIMS(im)[i];
+        }
 
-	// Unreachable code
-	assert(SIFT3D_FALSE);
-	return SIFT3D_FAILURE;
+        // Build the GSS and DoG pyramids and detect extrema
+        if (sift3d->fused) {
+                if (detect_extrema_fused(sift3d, first_octave, NULL, kp))
+                        return SIFT3D_FAILURE;
+        } else if (build_gpyr(sift3d) || build_dog(sift3d) ||
+                detect_extrema(sift3d, kp))
+		return SIFT3D_FAILURE;
+
+	// Assign orientations
+	if (assign_orientations(sift3d, kp))
+		return SIFT3D_FAILURE;
+
+        // Translate the keypoints to the whole image
+        for (i = 0; i < kp->slab.num; i++) {
+
+                Keypoint *const key = kp->buf + i;
+
+                key->xd += (double) (tile.start[0] >> key->o);
+                key->yd += (double) (tile.start[1] >> key->o);
+                key->zd += (double) (tile.start[2] >> key->o);
+        }
+        kp->nx = im->nx;
+        kp->ny = im->ny;
+        kp->nz = im->nz;
+
+	return SIFT3D_SUCCESS;
 }
 
-/* Helper routine to interpolate over the histograms of a
- * SIFT3D descriptor. */
-void SIFT3D_desc_acc_interp(const SIFT3D * const sift3d, 
-				const Cvec * const vbins, 
-				const Cvec * const grad,
-				SIFT3D_Descriptor * const desc) {
+/* Helper function for detect_keypoints_roi, to downsample the mask of sift3d
+ * to each of num_octaves octaves of its pyramid, which covers the region of 
+ * tile. A voxel of an octave is in the foreground if any of the voxels it 
+ * covers in the mask are. */
+static int set_octave_masks_SIFT3D(SIFT3D *const sift3d, 
+        const Tile *const tile, const int num_octaves) {
 
-	Cvec dvbins;
-	Hist *hist;
-	float weight;
-	int dx, dy, dz, x, y, z;
+        int i, o, x, y, z;
 
-#ifdef ICOS_HIST
-	Cvec bary;
-	float mag;
-	int bin;	
-#else
-	Svec sbins, dsbins;
-	int da, dp, a, p;
-#endif
+        const Image *const mask = sift3d->mask;
+        const Pyramid *const gpyr = &sift3d->gpyr;
 
-	const int y_stride = NHIST_PER_DIM;
-	const int z_stride = NHIST_PER_DIM * NHIST_PER_DIM; 
+        // Allocate the masks
+        if (sift3d->num_octave_masks < num_octaves) {
 
-	// Compute difference from integer bin values
-	dvbins.x = vbins->x - floorf(vbins->x);
-	dvbins.y = vbins->y - floorf(vbins->y);
-	dvbins.z = vbins->z - floorf(vbins->z);
+                Image *masks;
 
-	// Compute the histogram bin
-#ifdef ICOS_HIST
-	const Mesh *const mesh = &sift3d->mesh;
+                if ((masks = (Image *) SIFT3D_safe_realloc(
+                        sift3d->octave_masks, 
+                        num_octaves * sizeof(Image))) == NULL)
+                        return SIFT3D_FAILURE;
+                for (i = sift3d->num_octave_masks; i < num_octaves; i++) {
+                        init_im(masks + i);
+                }
+                sift3d->octave_masks = masks;
+                sift3d->num_octave_masks = num_octaves;
+        }
+        for (o = 0; o < num_octaves; o++) {
 
-	// Get the index of the intersecting face 
-	if (icos_hist_bin(sift3d, grad, &bary, &bin))
-		return;
-	
-	// Get the magnitude of the vector
-	mag = SIFT3D_CVEC_L2_NORM(grad);
+                Image *const dst = sift3d->octave_masks + o;
 
-#else
-	if (Cvec_to_sbins(grad, &sbins))
-		return;
-	dsbins.az = sbins.az - floorf(sbins.az);
-	dsbins.po = sbins.po - floorf(sbins.po);
-#endif
-	
-	for (dx = 0; dx < 2; dx++) {
-	for (dy = 0; dy < 2; dy++) {
-        for (dz = 0; dz < 2; dz++) {
+                if (im_copy_dims(SIFT3D_PYR_IM_GET(gpyr, 
+                        gpyr->first_octave + o, gpyr->first_level), dst))
+                        return SIFT3D_FAILURE;
+                im_zero(dst);
+        }
 
-                x = (int) vbins->x + dx;
-                y = (int) vbins->y + dy;
-                z = (int) vbins->z + dz;
+        // Mark the voxels covering the foreground
+        SIFT3D_IM_LOOP_LIMITED_START(mask, x, y, z, 
+                tile->start[0], tile->end[0] - 1, 
+                tile->start[1], tile->end[1] - 1, 
+                tile->start[2], tile->end[2] - 1)
 
-                // Check boundaries
-                if (x < 0 || x >= NHIST_PER_DIM ||
-                        y < 0 || y >= NHIST_PER_DIM ||
-                        z < 0 || z >= NHIST_PER_DIM)
+                const int xr = x - tile->start[0];
+                const int yr = y - tile->start[1];
+                const int zr = z - tile->start[2];
+
+                if (SIFT3D_IM_GET_VOX(mask, x, y, z, 0) == 0.0f)
                         continue;
 
-                // Get the histogram
-                hist = desc->hists + x + y * y_stride + 
-                           z * z_stride;	
+                for (o = 0; o < num_octaves; o++) {
 
-                assert(x + y * y_stride + z * z_stride < DESC_NUM_TOTAL_HIST);
+                        Image *const dst = sift3d->octave_masks + o;
+                        const int xo = xr >> (gpyr->first_octave + o);
+                        const int yo = yr >> (gpyr->first_octave + o);
+                        const int zo = zr >> (gpyr->first_octave + o);
 
-                // Get the spatial interpolation weight
-                weight = ((dx == 0) ? (1.0f - dvbins.x) : dvbins.x) *
-                        ((dy == 0) ? (1.0f - dvbins.y) : dvbins.y) *
-                        ((dz == 0) ? (1.0f - dvbins.z) : dvbins.z);
+                        if (xo < dst->nx && yo < dst->ny && zo < dst->nz)
+                                SIFT3D_IM_GET_VOX(dst, xo, yo, zo, 0) = 1.0f;
+                }
+        SIFT3D_IM_LOOP_END
 
-                /* Add the value into the histogram */
-#ifdef ICOS_HIST
-                assert(HIST_NUMEL == ICOS_NVERT);
-                assert(bin >= 0 && bin < ICOS_NFACES);
+        return SIFT3D_SUCCESS;
+}
 
-                // Interpolate over three vertices
-                MESH_HIST_GET(mesh, hist, bin, 0) += mag * weight * bary.x;
-                MESH_HIST_GET(mesh, hist, bin, 1) += mag * weight * bary.y;
-                MESH_HIST_GET(mesh, hist, bin, 2) += mag * weight * bary.z; 
-#else
-                // Iterate over all angles
-                for (dp = 0; dp < 2; dp ++) {
-                for (da = 0; da < 2; da ++) {
+#if defined(SIFT3D_WITH_OPENCL) || defined(SIFT3D_WITH_CUDA)
+/* Helper function to describe the Gaussian pyramid of a SIFT3D struct to a
+ * device backend, after set_im_SIFT3D. The arrays of layout must be freed 
+ * with cleanup_Dev_gpyr. */
+static int init_Dev_gpyr(const SIFT3D *const sift3d, Dev_gpyr *const layout) {
 
-                        a = ((int) sbins.az + da) % NBINS_AZ;
-                        p = (int) sbins.po + dp;
-                        if (p >= NBINS_PO) {
-                                // See HIST_GET_PO
-                                a = (a + NBINS_AZ / 2) % NBINS_AZ;
-                                p = NBINS_PO - 1;
-                        }
-		
-                        assert(a >= 0);
-                        assert(a < NBINS_AZ);
-                        assert(p >= 0);
-                        assert(p < NBINS_PO);
+        Dev_geom *levels;
+        const float **kernels;
+        int *widths;
+        int i, o, s;
 
-                        HIST_GET(hist, a, p) += sbins.mag * weight *
-                                ((da == 0) ? (1.0f - dsbins.az) : dsbins.az) *
-                                ((dp == 0) ? (1.0f - dsbins.po) : dsbins.po);
-                }}
-#endif
-	}}}
+        const Pyramid *const gpyr = &sift3d->gpyr;
+        const GSS_filters *const gss = &sift3d->gss;
+        const Image *const im = &sift3d->im;
+        const int num_total = gpyr->num_octaves * gpyr->num_levels;
+
+        layout->levels = levels = 
+                (Dev_geom *) malloc(num_total * sizeof(Dev_geom));
+        layout->kernels = kernels = 
+                (const float **) malloc(num_total * sizeof(float *));
+        layout->widths = widths = (int *) malloc(num_total * sizeof(int));
+        if (levels == NULL || kernels == NULL || widths == NULL) {
+                cleanup_Dev_gpyr(layout);
+                return SIFT3D_FAILURE;
+        }
 
-}
+        i = 0;
+        SIFT3D_PYR_LOOP_START(gpyr, o, s)
+
+                const Image *const level = SIFT3D_PYR_IM_GET(gpyr, o, s);
+                const Sep_FIR_filter *const f = 
+                        o == gpyr->first_octave && s == gpyr->first_level ?
+                        &gss->first_gauss.f : s == gpyr->first_level ? NULL :
+                        &SIFT3D_GAUSS_GET(gss, s - 1)->f;
+
+                levels[i].nx = level->nx;
+                levels[i].ny = level->ny;
+                levels[i].nz = level->nz;
+                levels[i].ux = level->ux;
+                levels[i].uy = level->uy;
+                levels[i].uz = level->uz;
+                levels[i].s = level->s;
+                kernels[i] = f == NULL ? NULL : f->kernel;
+                widths[i] = f == NULL ? 0 : f->width;
+                i++;
+        SIFT3D_PYR_LOOP_END
+        layout->im.nx = im->nx;
+        layout->im.ny = im->ny;
+        layout->im.nz = im->nz;
+        layout->im.ux = im->ux;
+        layout->im.uy = im->uy;
+        layout->im.uz = im->uz;
+        layout->im.s = 0.0;
+        layout->first_octave = gpyr->first_octave;
+        layout->first_level = gpyr->first_level;
+        layout->num_octaves = gpyr->num_octaves;
+        layout->num_levels = gpyr->num_levels;
+        layout->downsample_level = SIFT3D_MAX(SIFT3D_PYR_LAST_LEVEL(gpyr) - 2,
+                gpyr->first_level) - gpyr->first_level;
 
-/* Normalize a descriptor */
-static void normalize_desc(SIFT3D_Descriptor * const desc) {
+        return SIFT3D_SUCCESS;
+}
 
-	double norm; 
-	int i, a, p;
+/* Helper function to free the arrays of a Dev_gpyr. */
+static void cleanup_Dev_gpyr(Dev_gpyr *const layout) {
+        free((void *) layout->levels);
+        free((void *) layout->kernels);
+        free((void *) layout->widths);
+}
+#endif
 
-	norm = 0.0;
-	for (i = 0; i < DESC_NUM_TOTAL_HIST; i++) { 
+#ifdef SIFT3D_WITH_CUDA
+/* Helper function for _SIFT3D_detect_keypoints to build the pyramids on the
+ * CUDA device, after set_im_SIFT3D, reading them into sift3d->gpyr and 
+ * sift3d->dog. */
+static int build_pyramids_cuda_SIFT3D(SIFT3D *const sift3d) {
 
-                const Hist *const hist = desc->hists + i;
+        Dev_gpyr layout;
+        float **gpyr_data, **dog_data;
+        int i, ret;
 
-		HIST_LOOP_START(a, p) 
-			const float el = HIST_GET(hist, a, p);
-			norm += (double) el * el;
-		HIST_LOOP_END 
-	}
+        const Pyramid *const gpyr = &sift3d->gpyr;
+        const Pyramid *const dog = &sift3d->dog;
+        const int num_gpyr = gpyr->num_octaves * gpyr->num_levels;
+        const int num_dog = dog->num_octaves * dog->num_levels;
 
-	norm = sqrt(norm) + DBL_EPSILON; 
+        if (init_Dev_gpyr(sift3d, &layout))
+                return SIFT3D_FAILURE;
 
-	for (i = 0; i < DESC_NUM_TOTAL_HIST; i++) {
+        gpyr_data = (float **) malloc(num_gpyr * sizeof(float *));
+        dog_data = (float **) malloc((num_dog + 1) * sizeof(float *));
+        if (gpyr_data == NULL || dog_data == NULL) {
+                ret = SIFT3D_FAILURE;
+                goto build_pyramids_cuda_SIFT3D_quit;
+        }
+        for (i = 0; i < num_gpyr; i++) {
+                gpyr_data[i] = gpyr->levels[i].data;
+        }
+        for (i = 0; i < num_dog; i++) {
+                dog_data[i] = dog->levels[i].data;
+        }
 
-                Hist *const hist = desc->hists + i;
-		const float norm_inv = 1.0f / norm; 
+        ret = build_pyramids_cuda(sift3d->cuda, &layout, sift3d->im.data, 
+                gpyr_data, dog_data);
 
-		HIST_LOOP_START(a, p) 
-			HIST_GET(hist, a, p) *= norm_inv; 
-		HIST_LOOP_END 
-	}
+build_pyramids_cuda_SIFT3D_quit:
+        cleanup_Dev_gpyr(&layout);
+        free(gpyr_data);
+        free(dog_data);
+        return ret;
 }
+#endif
 
-/* Set a histogram to zero */
-static void hist_zero(Hist *hist) {
+#ifdef SIFT3D_WITH_OPENCL
+/* Helper function to initialize the OpenCL device of a SIFT3D struct,
+ * compiling the kernels with the parameters of this file. */
+static int init_device_SIFT3D(SIFT3D *const sift3d) {
 
-        int a, p;
+        Cl_params params;
+        char options[1024];
+        float *tri_v;
+        int *tri_idx;
+        int i, j, ret;
 
-        HIST_LOOP_START(a, p)
-                HIST_GET(hist, a, p) = 0.0f;
-        HIST_LOOP_END
+        const Mesh *const mesh = &sift3d->mesh;
+
+        // Flatten the mesh
+        tri_v = (float *) malloc(ICOS_NFACES * 9 * sizeof(float));
+        tri_idx = (int *) malloc(ICOS_NFACES * 3 * sizeof(int));
+        if (tri_v == NULL || tri_idx == NULL) {
+                free(tri_v);
+                free(tri_idx);
+                return SIFT3D_FAILURE;
+        }
+        for (i = 0; i < ICOS_NFACES; i++) {
+                for (j = 0; j < 3; j++) {
+
+                        const Cvec *const v = mesh->tri[i].v + j;
+
+                        tri_v[9 * i + 3 * j] = v->x;
+                        tri_v[9 * i + 3 * j + 1] = v->y;
+                        tri_v[9 * i + 3 * j + 2] = v->z;
+                        tri_idx[3 * i + j] = MESH_GET_IDX(mesh, i, j);
+                }
+        }
+
+        // Define the constants of the kernels
+        snprintf(options, sizeof(options), 
+                "-DNHIST_PER_DIM=%d -DHIST_NUMEL=%d -DDESC_NUMEL=%d "
+                "-DNUM_TRI=%d -DORI_RAD_FCTR=%.9ef -DORI_GRAD_THRESH=%.9ef "
+                "-DMAX_EIG_RATIO=%.9ef -DBARY_EPS=%.9ef "
+                "-DDESC_SIG_FCTR=%.9ef -DDESC_RAD_FCTR=%.9ef "
+                "-DTRUNC_THRESH=%.9ef", NHIST_PER_DIM, HIST_NUMEL, DESC_NUMEL,
+                ICOS_NFACES, ori_rad_fctr, ori_grad_thresh, max_eig_ratio, 
+                bary_eps, desc_sig_fctr, desc_rad_fctr, trunc_thresh);
+
+        params.options = options;
+        params.tri_v = tri_v;
+        params.tri_idx = tri_idx;
+        params.num_tri = ICOS_NFACES;
+        params.desc_numel = DESC_NUMEL;
+        ret = init_SIFT3D_cl(&sift3d->cl, &params);
+
+        free(tri_v);
+        free(tri_idx);
+        return ret;
 }
 
-/* Helper routine to extract a single SIFT3D descriptor */
-static int extract_descrip(SIFT3D *const sift3d, const Image *const im,
-	   const Keypoint *const key, SIFT3D_Descriptor *const desc) {
+/* Helper function to release the OpenCL device of a SIFT3D struct, if any,
+ * discarding the pyramids stored there. */
+static void cleanup_device_SIFT3D(SIFT3D *const sift3d) {
 
-        float buf[IM_NDIMS * IM_NDIMS];
-        Mat_rm Rt;
-	Cvec vcenter, vim, vkp, vbins, grad, grad_rot;
-	Hist *hist;
-	float weight, sq_dist;
-	int i, x, y, z, a, p;
+        cleanup_SIFT3D_cl(sift3d->cl);
+        sift3d->cl = NULL;
+        sift3d->pyr_on_device = sift3d->pyr_host_stale = SIFT3D_FALSE;
+}
 
-	// Compute basic parameters 
-        const float sigma = key->sd * desc_sig_fctr;
-	const float win_radius = desc_rad_fctr * sigma;
-	const float desc_half_width = win_radius / sqrt(2);
-	const float desc_width = 2.0f * desc_half_width;
-        const float desc_hist_width = desc_width / NHIST_PER_DIM;
-	const float desc_bin_fctr = 1.0f / desc_hist_width;
-	const double coord_factor = ldexp(1.0, key->o);
+/* Helper function to read the pyramids of sift3d from the device into 
+ * gpyr and dog, which must have the same layout as sift3d->gpyr and 
+ * sift3d->dog. Does nothing unless the host copies are stale. The DoG 
+ * pyramid is skipped if it is empty, as with the fused setting. */
+static int sync_pyramids_SIFT3D(const SIFT3D *const sift3d, 
+        Pyramid *const gpyr, Pyramid *const dog) {
 
-        // Invert the rotation matrix
-        if (init_Mat_rm_p(&Rt, buf, IM_NDIMS, IM_NDIMS, SIFT3D_FLOAT, 
-		SIFT3D_FALSE) ||
-                transpose_Mat_rm(&key->R, &Rt))
+        float **gpyr_data, **dog_data;
+        int i, ret;
+
+        const int num_gpyr = gpyr->num_octaves * gpyr->num_levels;
+        const int num_dog = dog->num_octaves * dog->num_levels;
+
+        if (!sift3d->pyr_on_device || !sift3d->pyr_host_stale)
+                return SIFT3D_SUCCESS;
+
+        gpyr_data = (float **) malloc(num_gpyr * sizeof(float *));
+        dog_data = (float **) malloc((num_dog + 1) * sizeof(float *));
+        if (gpyr_data == NULL || dog_data == NULL) {
+                free(gpyr_data);
+                free(dog_data);
                 return SIFT3D_FAILURE;
+        }
+        for (i = 0; i < num_gpyr; i++) {
+                gpyr_data[i] = gpyr->levels[i].data;
+        }
+        for (i = 0; i < num_dog; i++) {
+                dog_data[i] = dog->levels[i].data;
+        }
 
-	// Zero the descriptor
-	for (i = 0; i < DESC_NUM_TOTAL_HIST; i++) {
-		hist = desc->hists + i;
-                hist_zero(hist);
-	}
+        ret = read_pyramids_cl(sift3d->cl, gpyr_data, 
+                num_dog > 0 ? dog_data : NULL);
 
-	// Iterate over a sphere window in real-world coordinates 
-	vcenter.x = key->xd;
-	vcenter.y = key->yd;
-	vcenter.z = key->zd;
-	IM_LOOP_SPHERE_START(im, x, y, z, &vcenter, win_radius, &vim, sq_dist)
+        free(gpyr_data);
+        free(dog_data);
+        return ret;
+}
 
-		// Rotate to keypoint space
-		SIFT3D_MUL_MAT_RM_CVEC(&Rt, &vim, &vkp);		
+/* Helper function for _SIFT3D_detect_keypoints to build the pyramids and 
+ * detect keypoints on the device, after set_im_SIFT3D. The pyramids are left
+ * on the device, for extract_descriptors_device. */
+static int detect_keypoints_device(SIFT3D *const sift3d, 
+        Keypoint_store *const kp) {
 
-		// Compute spatial bins
-		vbins.x = (vkp.x + desc_half_width) * desc_bin_fctr;
-		vbins.y = (vkp.y + desc_half_width) * desc_bin_fctr;
-		vbins.z = (vkp.z + desc_half_width) * desc_bin_fctr;
+        Dev_gpyr layout;
+        Cl_key *keys;
+        int i, num, ret;
 
-		// Reject points outside the rectangular descriptor 
-		if (vbins.x < 0 || vbins.y < 0 || vbins.z < 0 ||
-			vbins.x >= (float) NHIST_PER_DIM ||
-			vbins.y >= (float) NHIST_PER_DIM ||
-			vbins.z >= (float) NHIST_PER_DIM)
-			continue;
+        const Pyramid *const gpyr = &sift3d->gpyr;
+        const Image *const im = &sift3d->im;
+        const Image *const first = 
+                SIFT3D_PYR_IM_GET(gpyr, gpyr->first_octave, gpyr->first_level);
 
-		// Take the gradient
-		IM_GET_GRAD_ISO(im, x, y, z, 0, &grad);
+        // Describe the pyramid
+        if (init_Dev_gpyr(sift3d, &layout))
+                return SIFT3D_FAILURE;
 
-		// Apply a Gaussian window
-		weight = expf(-0.5f * sq_dist / (sigma * sigma));
-		SIFT3D_CVEC_SCALE(&grad, weight);
+        // Build the pyramids and detect the keypoints
+        if (build_pyramids_cl(sift3d->cl, &layout, im->data)) {
+                ret = SIFT3D_FAILURE;
+                goto detect_keypoints_device_quit;
+        }
+        sift3d->pyr_on_device = sift3d->pyr_host_stale = SIFT3D_TRUE;
+        if ((ret = detect_keypoints_cl(sift3d->cl, 
+                (float) sift3d->peak_thresh, (float) ori_sig_fctr,
+                (float) sift3d->corner_thresh, &keys, &num)))
+                goto detect_keypoints_device_quit;
+
+        // Copy the results
+        kp->nx = first->nx;
+        kp->ny = first->ny;
+        kp->nz = first->nz;
+        if ((ret = resize_Keypoint_store(kp, num)))
+                goto detect_keypoints_device_quit;
+        for (i = 0; i < num; i++) {
 
-                // Rotate the gradient to keypoint space
-		SIFT3D_MUL_MAT_RM_CVEC(&Rt, &grad, &grad_rot);
+                Keypoint *const key = kp->buf + i;
+                const Cl_key *const src = keys + i;
+                int j, k;
+
+                if ((ret = init_Keypoint(key)))
+                        goto detect_keypoints_device_quit;
+                key->o = src->o;
+                key->s = src->s;
+                key->sd = SIFT3D_PYR_IM_GET(gpyr, src->o, src->s)->s;
+                key->xd = src->xd;
+                key->yd = src->yd;
+                key->zd = src->zd;
+                for (j = 0; j < IM_NDIMS; j++) {
+                for (k = 0; k < IM_NDIMS; k++) {
+                        SIFT3D_MAT_RM_GET(&key->R, j, k, float) = 
+                                src->R[IM_NDIMS * j + k];
+                }}
+        }
 
-		// Finally, accumulate bins by 5x linear interpolation
-		SIFT3D_desc_acc_interp(sift3d, &vbins, &grad_rot, desc);
-	IM_LOOP_SPHERE_END
+detect_keypoints_device_quit:
+        cleanup_Dev_gpyr(&layout);
+        return ret;
+}
 
-	// Histogram refinement steps
-	for (i = 0; i < DESC_NUM_TOTAL_HIST; i++) {
-		refine_Hist(&desc->hists[i]);
-	}
+/* Helper function for _SIFT3D_extract_descriptors to extract descriptors
+ * from the pyramid on the device. The metadata and size of the output store
+ * must already be set. */
+static int extract_descriptors_device(SIFT3D *const sift3d, 
+        const Keypoint_store *const kp, SIFT3D_Descriptor_store *const desc,
+        SIFT3D_Quant_store *const quant) {
 
-	// Normalize the descriptor
-	normalize_desc(desc);
+        SIFT3D_Descriptor temp;
+        Cl_key *keys;
+        float *data;
+        int i, j, k;
 
-	// Truncate
-	for (i = 0; i < DESC_NUM_TOTAL_HIST; i++) {
-		hist = desc->hists + i;
-		HIST_LOOP_START(a, p)
-			HIST_GET(hist, a, p) = SIFT3D_MIN(HIST_GET(hist, a, p), 
-						   (float) trunc_thresh);
-		HIST_LOOP_END
-	}
+        const Pyramid *const gpyr = &sift3d->gpyr;
+        const int num = kp->slab.num;
 
-	// Normalize again
-	normalize_desc(desc);
+        if (num < 1)
+                return SIFT3D_SUCCESS;
 
-	// Save the descriptor location in the original image
-	// coordinates
-	desc->xd = key->xd * coord_factor;
-	desc->yd = key->yd * coord_factor;
-	desc->zd = key->zd * coord_factor;
-	desc->sd = key->sd;
+        keys = (Cl_key *) calloc(num, sizeof(Cl_key));
+        data = (float *) malloc((size_t) num * DESC_NUMEL * sizeof(float));
+        if (keys == NULL || data == NULL)
+                goto extract_descriptors_device_quit;
 
-        return SIFT3D_SUCCESS;
-}
+        // Convert the keypoints
+        for (i = 0; i < num; i++) {
 
-/* Check if the Gaussian scale-space pyramid in a SIFT3D struct is valid. This
- * shall return SIFT3D_TRUE if the struct was initialized, and 
- * SIFT3D_detect_keypoints has been successfully called on it since 
- * initialization. 
- *
- * Note: sift3d must be initialized before calling this function. */
-int SIFT3D_have_gpyr(const SIFT3D *const sift3d) {
+                const Keypoint *const key = kp->buf + i;
+                Cl_key *const dst = keys + i;
+
+                if (key->o < gpyr->first_octave || 
+                        key->o > SIFT3D_PYR_LAST_OCTAVE(gpyr) ||
+                        key->s < gpyr->first_level ||
+                        key->s > SIFT3D_PYR_LAST_LEVEL(gpyr)) {
+                        SIFT3D_ERR("extract_descriptors_device: keypoint %d "
+                                "is not in the pyramid \n", i);
+                        goto extract_descriptors_device_quit;
+                }
 
-        const Pyramid *const gpyr = &sift3d->gpyr;
+                dst->xd = (float) key->xd;
+                dst->yd = (float) key->yd;
+                dst->zd = (float) key->zd;
+                dst->sd = (float) key->sd;
+                dst->o = key->o;
+                dst->s = key->s;
+                dst->level = (int) (SIFT3D_PYR_IM_GET(gpyr, key->o, key->s) -
+                        gpyr->levels);
+                for (j = 0; j < IM_NDIMS; j++) {
+                for (k = 0; k < IM_NDIMS; k++) {
+                        dst->R[IM_NDIMS * j + k] = 
+                                SIFT3D_MAT_RM_GET(&key->R, j, k, float);
+                }}
+        }
 
-        return gpyr->levels != NULL && gpyr->num_levels != 0 && 
-                gpyr->num_octaves != 0;
-}
+        // Extract the descriptors
+        if (extract_descriptors_cl(sift3d->cl, keys, num, data))
+                goto extract_descriptors_device_quit;
 
-/* Helper function to scale keypoint coordinates.
- *
- * Parameters:
- *  -src: The source keypoints.
- *  -factors: An array of length IM_NDIMS specifying the scaling factors.
- *  -dst: The scaled keypoints.
- *
- * Return: SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
-static int scale_Keypoint(const Keypoint *const src, 
-        const double *const factors, Keypoint *const dst) {
+        // Copy the results, saving the locations in the original image
+        // coordinates, as extract_descrip
+        for (i = 0; i < num; i++) {
 
-        // Copy the source keypoint
-        if (copy_Keypoint(src, dst)) {
-                SIFT3D_ERR("scale_Keypoint: failed to convert keypoints \n");
-                return SIFT3D_FAILURE;
+                const Keypoint *const key = kp->buf + i;
+                SIFT3D_Descriptor *const descrip = desc == NULL ? &temp : 
+                        desc->buf + i;
+                const double coord_factor = ldexp(1.0, key->o);
+
+                memcpy(descrip->hists, data + (size_t) i * DESC_NUMEL,
+                        DESC_NUMEL * sizeof(float));
+                descrip->xd = key->xd * coord_factor;
+                descrip->yd = key->yd * coord_factor;
+                descrip->zd = key->zd * coord_factor;
+                descrip->sd = key->sd;
+
+                // Optionally quantize the result
+                if (desc == NULL)
+                        quantize_desc(descrip, quant, i);
         }
-      
-        // Scale the coordinates 
-        dst->xd *= factors[0];
-        dst->yd *= factors[1];
-        dst->zd *= factors[2];
 
+        free(keys);
+        free(data);
         return SIFT3D_SUCCESS;
+
+extract_descriptors_device_quit:
+        free(keys);
+        free(data);
+        return SIFT3D_FAILURE;
 }
+#endif
 
-/* Helper function to smooth and scale a "raw" input image, as if it were 
- * processed via SIFT3D_detect_keypoints.
- *
- * Parameters:
- *  -sift3d: Stores the parameters sigma_n and sigma0.
- *  -src: The input "raw" image.
- *  -dst: The output, smoothed image.
- *
- * Return: SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
-static int smooth_scale_raw_input(const SIFT3D *const sift3d, 
-        const Image *const src, Image *const dst) {
+/* Helper function to get the bin and barycentric coordinates of a vector in
+ * the icosahedral histogram by testing each triangle in order. */
+static int icos_hist_bin_scan(const Mesh *const mesh, const Cvec *const x, 
+        Cvec *const bary, int *const bin) {
 
-        Gauss_filter gauss;
+	float k;
+	int i;
 
-        const double sigma_n = sift3d->gpyr.sigma_n;
-        const double sigma0 = sift3d->gpyr.sigma0;
-        const double unit = 1.0;
+	// Iterate through the faces
+	for (i = 0; i < ICOS_NFACES; i++) {
 
-        // Initialize the smoothing filter        
-        if (init_Gauss_incremental_filter(&gauss, sigma_n, sigma0, IM_NDIMS))
-                return SIFT3D_FAILURE;
+		const Tri * const tri = mesh->tri + i;
 
-        // Smooth the input
-        if (apply_Sep_FIR_filter(src, dst, &gauss.f, unit))
-                goto smooth_scale_raw_input_quit;
+		// Convert to barycentric coordinates
+		if (cart2bary(x, tri, bary, &k))
+			continue;
 
-        // Scale the input to [-1, 1]
-        im_scale(dst);
+		// Test for intersection
+		if (bary->x < -bary_eps || bary->y < -bary_eps ||
+		    bary->z < -bary_eps || k < 0)
+			continue;
 
-        // Clean up
-        cleanup_Gauss_filter(&gauss);
-        
-        return SIFT3D_SUCCESS;
+		// Save the bin
+		*bin = i;
 
-smooth_scale_raw_input_quit:
-        cleanup_Gauss_filter(&gauss);
-        return SIFT3D_FAILURE;
+		// No other triangles will be intersected
+		return SIFT3D_SUCCESS;
+	}	
+
+	// Unreachable code
+	assert(SIFT3D_FALSE);
+	return SIFT3D_FAILURE;
 }
 
-/* Extract SIFT3D descriptors from a list of keypoints. Uses the Gaussian
- * scale-space pyramid from the previous call to SIFT3D_detect_keypoints on
- * this SIFT3D struct. To extract from an image, see 
- * SIFT3D_extract_raw_descriptors. 
- *
- * Note: To check if SIFT3D_detect_keypoints has been called on this struct,
- * use SIFT3D_have_gpyr.
- *
- * Parameters:
- *  sift3d - (initialized) struct defining the algorithm parameters. Must have
- *      been used in some previous call to SIFT3D_detect_keypoints.
- *  kp - keypoint list populated by a feature detector 
- *  desc - (initialized) struct to hold the descriptors
- *
- * Return value:
- *  Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise.
- */
-int SIFT3D_extract_descriptors(SIFT3D *const sift3d, 
-        const Keypoint_store *const kp, 
-        SIFT3D_Descriptor_store *const desc) {
+/* Helper function to test whether x lies well inside triangle bin, as found
+ * by the lookup table. This is true only if no other triangle accepts x 
+ * within bary_eps, so that icos_hist_bin_scan would find the same triangle
+ * and barycentric coordinates. Returns SIFT3D_TRUE if so, writing the 
+ * coordinates to bary, and SIFT3D_FALSE otherwise. */
+static int icos_lut_check(const Mesh *const mesh, const Cvec *const x,
+        const int bin, Cvec *const bary) {
 
-	// Verify inputs
-	if (verify_keys(kp, &sift3d->im))
+        float k;
+
+        return !cart2bary(x, mesh->tri + bin, bary, &k) && k >= 0 &&
+                bary->x >= bary_lut_margin && bary->y >= bary_lut_margin &&
+                bary->z >= bary_lut_margin;
+}
+
+/* Get the bin and barycentric coordinates of a vector in the icosahedral 
+ * histogram. The triangle is taken from the lookup table of the mesh, 
+ * falling back to testing each triangle near the edges. The result is the 
+ * same in either case. */
+SIFT3D_IGNORE_UNUSED
+static int icos_hist_bin(const SIFT3D * const sift3d,
+			   const Cvec * const x, Cvec * const bary,
+			   int * const bin) { 
+
+	const Mesh * const mesh = &sift3d->mesh;
+
+	// Check for very small vectors
+	if (SIFT3D_CVEC_L2_NORM_SQ(x) < bary_eps)
 		return SIFT3D_FAILURE;
 
-        // Check if a Gaussian scale-space pyramid is available for processing
-        if (!SIFT3D_have_gpyr(sift3d)) {
-                SIFT3D_ERR("SIFT3D_extract_descriptors: no Gaussian pyramid is "
-                        "available. Make sure SIFT3D_detect_keypoints was "
-                        "called prior to calling this function. \n");
-                return SIFT3D_FAILURE;
-        }
+        // Try the triangle from the lookup table
+        if (mesh->lut != NULL) {
 
-        // Extract features
-        if (_SIFT3D_extract_descriptors(sift3d, &sift3d->gpyr, kp, desc))
-                return SIFT3D_FAILURE;
+                const int lut_bin = mesh->lut[icos_lut_cell(mesh, x)];
 
-        return SIFT3D_SUCCESS;
+                if (icos_lut_check(mesh, x, lut_bin, bary)) {
+                        *bin = lut_bin;
+                        return SIFT3D_SUCCESS;
+                }
+        }
+
+        return icos_hist_bin_scan(mesh, x, bary, bin);
 }
 
-/* Verify that keypoints kp are valid in image im. Returns SIFT3D_SUCCESS if
- * valid, SIFT3D_FAILURE otherwise. */
-static int verify_keys(const Keypoint_store *const kp, const Image *const im) {
+/* As icos_hist_bin, for an array of num vectors. The lookup table cells are
+ * computed in a vectorized loop, then each triangle is checked. On return,
+ * bin[i] is the bin of x[i], or -1 if x[i] is too small to bin. */
+static void icos_hist_bin_batch(const SIFT3D *const sift3d, 
+        const Cvec *const x, const int num, Cvec *const bary, int *const bin) {
 
         int i;
 
-	const int num = kp->slab.num;
-
-	// Check the number of keypoints
-	if (num < 1) {
-		SIFT3D_ERR("verify_keys: invalid number of keypoints: "
-				"%d \n", num);
-		return SIFT3D_FAILURE;
-	}
+	const Mesh * const mesh = &sift3d->mesh;
+        const float res = (float) mesh->lut_res;
+        const int res_max = mesh->lut_res - 1;
+
+        // Find the cell of each vector, as in icos_lut_cell
+        if (mesh->lut != NULL) {
+#pragma omp simd
+                for (i = 0; i < num; i++) {
+
+                        float u, v;
+                        int ci, cj;
+
+                        const Cvec *const xi = x + i;
+                        const float l1 = fabsf(xi->x) + fabsf(xi->y) + 
+                                fabsf(xi->z) + FLT_MIN;
+                        const float u_top = xi->x / l1;
+                        const float v_top = xi->y / l1;
+                        const int fold = xi->z < 0.0f;
+
+                        u = fold ? copysignf(1.0f - fabsf(v_top), u_top) : 
+                                u_top;
+                        v = fold ? copysignf(1.0f - fabsf(u_top), v_top) : 
+                                v_top;
+
+                        ci = (int) ((u + 1.0f) * 0.5f * res);
+                        cj = (int) ((v + 1.0f) * 0.5f * res);
+                        ci = ci < 0 ? 0 : (ci > res_max ? res_max : ci);
+                        cj = cj < 0 ? 0 : (cj > res_max ? res_max : cj);
+
+                        bin[i] = ci + cj * mesh->lut_res;
+                }
+        }
 
-	// Check each keypoint
+        // Check each triangle, falling back to the search
         for (i = 0; i < num; i++) {
 
-                const Keypoint *key = kp->buf + i;
-
-                const double octave_factor = ldexp(1.0, key->o);
+                const Cvec *const xi = x + i;
 
-                if (key->xd < 0 ||
-                        key->yd < 0 ||
-                        key->zd < 0 ||
-                        key->xd * octave_factor >= (double) im->nx || 
-                        key->yd * octave_factor >= (double) im->ny || 
-                        key->zd * octave_factor >= (double) im->nz) {
-                        SIFT3D_ERR("verify_keys: keypoint %d (%f, %f, %f) "
-                                "octave %d exceeds image dimensions "
-                                "(%d, %d, %d) \n", i, key->xd, key->yd, key->zd,
-                                key->o, im->nx, im->ny, im->nz);
-                        return SIFT3D_FAILURE; 
+                if (SIFT3D_CVEC_L2_NORM_SQ(xi) < bary_eps) {
+                        bin[i] = -1;
+                        continue;
                 }
 
-                if (key->sd <= 0) {
-                        SIFT3D_ERR("verify_keys: keypoint %d has invalid "
-                                "scale %f \n", i, key->sd);
-                        return SIFT3D_FAILURE;
+                if (mesh->lut != NULL) {
+                        const int lut_bin = mesh->lut[bin[i]];
+
+                        if (icos_lut_check(mesh, xi, lut_bin, bary + i)) {
+                                bin[i] = lut_bin;
+                                continue;
+                        }
                 }
-        }
 
-        return SIFT3D_SUCCESS;
+                if (icos_hist_bin_scan(mesh, xi, bary + i, bin + i))
+                        bin[i] = -1;
+        }
 }
 
-/* Convert the keypoint src to the equivalent one at octave 0, stored in dst. */
-static int keypoint2base(const Keypoint *const src, Keypoint *const dst) {
-
-        double base_factors[IM_NDIMS];
-        int j;
-
-        const double octave_factor = ldexp(1.0, src->o);
-
-        // Convert the factors to the base octave
-        for (j = 0; j < IM_NDIMS; j++) {
-                base_factors[j] = octave_factor;
-        }
-
-        // Scale the keypoint
-        if (scale_Keypoint(src, base_factors, dst))
-                return SIFT3D_FAILURE;
+/* Helper routine to interpolate over the histograms of a
+ * SIFT3D descriptor. */
+void SIFT3D_desc_acc_interp(const SIFT3D * const sift3d, 
+				const Cvec * const vbins, 
+				const Cvec * const grad,
+				SIFT3D_Descriptor * const desc) {
 
-        // Assign the keypoint the base octave and scale level
-        dst->o = 0;
-        dst->s = 0;
+	Cvec dvbins;
+	Hist *hist;
+	float weight;
+	int dx, dy, dz, x, y, z;
 
-        return SIFT3D_SUCCESS;
-}
+#ifdef ICOS_HIST
+	Cvec bary;
+	float mag;
+	int bin;	
+#else
+	Svec sbins, dsbins;
+	int da, dp, a, p;
+#endif
 
-/* Extract SIFT3D descriptors from a list of keypoints and 
- * an image. To extract from a Gaussian scale-space pyramid, see
- * SIFT3D_extract_descriptors. 
- *
- * Parameters:
- *  sift3d - (initialized) struct defining the algorithm parameters
- *  im - Pointer to an Image struct. A copy of the image is smoothed from 
- *      sift3d->sigma_n to sift3d->sigma0 prior to descriptor extraction.
- *  kp - keypoint list populated by a feature detector 
- *  desc - (initialized) struct to hold the descriptors
- *
- * Return value:
- *  Returns  SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise.
- */
-int SIFT3D_extract_raw_descriptors(SIFT3D *const sift3d, 
-        const Image *const im, const Keypoint_store *const kp, 
-        SIFT3D_Descriptor_store *const desc) {
+	const int y_stride = NHIST_PER_DIM;
+	const int z_stride = NHIST_PER_DIM * NHIST_PER_DIM; 
 
-        Keypoint_store kp_base;
-        Pyramid pyr;
-        Image *level;
-        int i;
+	// Compute difference from integer bin values
+	dvbins.x = vbins->x - floorf(vbins->x);
+	dvbins.y = vbins->y - floorf(vbins->y);
+	dvbins.z = vbins->z - floorf(vbins->z);
 
-        const int first_octave = 0;
-        const int first_level = 0;
-        const int num_kp_levels = 1;
-        const int num_levels = 1;
-        const int num_octaves = 1;
-        const double sigma0 = sift3d->gpyr.sigma0;
-        const double sigma_n = sift3d->gpyr.sigma_n;
+	// Compute the histogram bin
+#ifdef ICOS_HIST
+	const Mesh *const mesh = &sift3d->mesh;
 
-        // Verify inputs
-        if (verify_keys(kp, im))
-                return SIFT3D_FAILURE;
+	// Get the index of the intersecting face 
+	if (icos_hist_bin(sift3d, grad, &bary, &bin))
+		return;
+	
+	// Get the magnitude of the vector
+	mag = SIFT3D_CVEC_L2_NORM(grad);
 
-        // Initialize intermediates
-        init_Pyramid(&pyr);
-        init_Keypoint_store(&kp_base);
+#else
+	if (Cvec_to_sbins(grad, &sbins))
+		return;
+	dsbins.az = sbins.az - floorf(sbins.az);
+	dsbins.po = sbins.po - floorf(sbins.po);
+#endif
+	
+	for (dx = 0; dx < 2; dx++) {
+	for (dy = 0; dy < 2; dy++) {
+        for (dz = 0; dz < 2; dz++) {
 
-        // Initialize the image pyramid
-        set_scales_Pyramid(sigma0, sigma_n, &pyr);
-        if (resize_Pyramid(im, first_level, num_kp_levels, num_levels,
-                first_octave, num_octaves, &pyr))
-                goto extract_raw_descriptors_quit;
+                x = (int) vbins->x + dx;
+                y = (int) vbins->y + dy;
+                z = (int) vbins->z + dz;
 
-        // Smooth the input image, storing the result in the pyramid
-        level = SIFT3D_PYR_IM_GET(&pyr, first_octave, first_level); 
-        if (smooth_scale_raw_input(sift3d, im, level))
-                goto extract_raw_descriptors_quit;
+                // Check boundaries
+                if (x < 0 || x >= NHIST_PER_DIM ||
+                        y < 0 || y >= NHIST_PER_DIM ||
+                        z < 0 || z >= NHIST_PER_DIM)
+                        continue;
 
-        // Allocate a temporary copy of the keypoints
-        if (resize_Keypoint_store(&kp_base, kp->slab.num))
-                goto extract_raw_descriptors_quit;
+                // Get the histogram
+                hist = desc->hists + x + y * y_stride + 
+                           z * z_stride;	
 
-        // Convert keypoints to the base scale and octave
-        for (i = 0; i < kp->slab.num; i++) {
+                assert(x + y * y_stride + z * z_stride < DESC_NUM_TOTAL_HIST);
 
-                const Keypoint *const src = kp->buf + i;
-                Keypoint *const dst = kp_base.buf + i; 
+                // Get the spatial interpolation weight
+                weight = ((dx == 0) ? (1.0f - dvbins.x) : dvbins.x) *
+                        ((dy == 0) ? (1.0f - dvbins.y) : dvbins.y) *
+                        ((dz == 0) ? (1.0f - dvbins.z) : dvbins.z);
 
-                if (keypoint2base(src, dst))
-                        goto extract_raw_descriptors_quit;
-        }
+                /* Add the value into the histogram */
+#ifdef ICOS_HIST
+                assert(HIST_NUMEL == ICOS_NVERT);
+                assert(bin >= 0 && bin < ICOS_NFACES);
 
-        // Extract the descriptors
-        if (_SIFT3D_extract_descriptors(sift3d, &pyr, &kp_base, desc))
-                goto extract_raw_descriptors_quit;
+                // Interpolate over three vertices
+                MESH_HIST_GET(mesh, hist, bin, 0) += mag * weight * bary.x;
+                MESH_HIST_GET(mesh, hist, bin, 1) += mag * weight * bary.y;
+                MESH_HIST_GET(mesh, hist, bin, 2) += mag * weight * bary.z; 
+#else
+                // Iterate over all angles
+                for (dp = 0; dp < 2; dp ++) {
+                for (da = 0; da < 2; da ++) {
 
-        // Clean up
-        cleanup_Pyramid(&pyr);
-        cleanup_Keypoint_store(&kp_base);
+                        a = ((int) sbins.az + da) % NBINS_AZ;
+                        p = (int) sbins.po + dp;
+                        if (p >= NBINS_PO) {
+                                // See HIST_GET_PO
+                                a = (a + NBINS_AZ / 2) % NBINS_AZ;
+                                p = NBINS_PO - 1;
+                        }
+		
+                        assert(a >= 0);
+                        assert(a < NBINS_AZ);
+                        assert(p >= 0);
+                        assert(p < NBINS_PO);
 
-        return SIFT3D_SUCCESS;
+                        HIST_GET(hist, a, p) += sbins.mag * weight *
+                                ((da == 0) ? (1.0f - dsbins.az) : dsbins.az) *
+                                ((dp == 0) ? (1.0f - dsbins.po) : dsbins.po);
+                }}
+#endif
+	}}}
 
-extract_raw_descriptors_quit:
-        cleanup_Pyramid(&pyr);
-        cleanup_Keypoint_store(&kp_base);
-        return SIFT3D_FAILURE;
 }
 
-/* Helper funciton to extract SIFT3D descriptors from a list of keypoints and 
- * an image. Called by SIFT3D_extract_descriptors and 
- * SIFT3D_extract_raw_descriptors.
- *
- * parameters:
- *  sift3d - (initialized) struct defining the algorithm parameters
- *  gpyr - A Gaussian Scale-Space pyramid containing the image data
- *  kp - keypoint list populated by a feature detector 
- *  desc - (initialized) struct to hold the descriptors
- *  use_gpyr - see im for details */
-static int _SIFT3D_extract_descriptors(SIFT3D *const sift3d, 
-        const Pyramid *const gpyr, const Keypoint_store *const kp, 
-        SIFT3D_Descriptor_store *const desc) {
-
-	int i, ret;
+/* Normalize a descriptor */
+static void normalize_desc(SIFT3D_Descriptor * const desc) {
 
-	const Image *const first_level = 
-                SIFT3D_PYR_IM_GET(gpyr, gpyr->first_octave, gpyr->first_level);
+	double norm; 
+	int i, a, p;
 
-	const int num = kp->slab.num;
+	norm = 0.0;
+	for (i = 0; i < DESC_NUM_TOTAL_HIST; i++) { 
 
-	// Initialize the metadata 
-	desc->nx = first_level->nx;	
-	desc->ny = first_level->ny;	
-	desc->nz = first_level->nz;	
+                const Hist *const hist = desc->hists + i;
 
-	// Resize the descriptor store
-        if (resize_SIFT3D_Descriptor_store(desc, num))
-                return SIFT3D_FAILURE;
+		HIST_LOOP_START(a, p) 
+			const float el = HIST_GET(hist, a, p);
+			norm += (double) el * el;
+		HIST_LOOP_END 
+	}
 
-        // Extract the descriptors
-        ret = SIFT3D_SUCCESS;
-#pragma omp parallel for
-	for (i = 0; i < desc->num; i++) {
+	norm = sqrt(norm) + DBL_EPSILON; 
 
-                const Keypoint *const key = kp->buf + i;
-		SIFT3D_Descriptor *const descrip = desc->buf + i;
-		const Image *const level = 
-                        SIFT3D_PYR_IM_GET(gpyr, key->o, key->s);
+	for (i = 0; i < DESC_NUM_TOTAL_HIST; i++) {
 
-		if (extract_descrip(sift3d, level, key, descrip)) {
-                        ret = SIFT3D_FAILURE;
-                }
-	}	
+                Hist *const hist = desc->hists + i;
+		const float norm_inv = 1.0f / norm; 
 
-	return ret;
+		HIST_LOOP_START(a, p) 
+			HIST_GET(hist, a, p) *= norm_inv; 
+		HIST_LOOP_END 
+	}
 }
 
-/* L2-normalize a histogram */
-static void normalize_hist(Hist *const hist) {
+/* Set a histogram to zero */
+static void hist_zero(Hist *hist) {
 
-        double norm;
-        float norm_inv;
         int a, p;
 
-        norm = 0.0;
         HIST_LOOP_START(a, p)
-                const float el = HIST_GET(hist, a, p);
-                norm += (double) el * el;
+                HIST_GET(hist, a, p) = 0.0f;
         HIST_LOOP_END
-
-        norm = sqrt(norm) + DBL_EPSILON;
-        norm_inv = 1.0f / norm; 
-
-        HIST_LOOP_START(a, p)
-                 HIST_GET(hist, a, p) *= norm_inv; 
-        HIST_LOOP_END 
 }
 
-/* Dense gradient histogram postprocessing steps */
-static void postproc_Hist(Hist *const hist, const float norm) {
-
-        int a, p;
+/* Helper routine to extract a single SIFT3D descriptor */
+static int extract_descrip(SIFT3D *const sift3d, const Image *const im,
+	   const Image *const grads, const Keypoint *const key, 
+           SIFT3D_Descriptor *const desc) {
 
-        const float hist_trunc = trunc_thresh * DESC_NUMEL / HIST_NUMEL;
+        float buf[IM_NDIMS * IM_NDIMS];
+        Mat_rm Rt;
+	Cvec vcenter, vim, vkp, vbins, grad, grad_rot;
+	Hist *hist;
+	float weight, sq_dist;
+	int i, x, y, z, a, p;
 
-	// Histogram refinement steps
-	refine_Hist(hist);
-
-	// Normalize the descriptor
-	normalize_hist(hist);
-
-	// Truncate
-	HIST_LOOP_START(a, p)
-		HIST_GET(hist, a, p) = SIFT3D_MIN(HIST_GET(hist, a, p), 
-					   hist_trunc);
-	HIST_LOOP_END
-
-	// Normalize again
-	normalize_hist(hist);
-
-        // Convert to the desired norm
-        HIST_LOOP_START(a, p)
-                HIST_GET(hist, a, p) *= norm;
-        HIST_LOOP_END
-}
-
-/* Helper routine to extract a single SIFT3D histogram, with rotation. */
-static int extract_dense_descrip_rotate(SIFT3D *const sift3d, 
-           const Image *const im, const Cvec *const vcenter, 
-           const double sigma, const Mat_rm *const R, Hist *const hist) {
-
-        float buf[IM_NDIMS * IM_NDIMS];
-        Mat_rm Rt;
-	Cvec grad, grad_rot, bary, vim;
-	float sq_dist, mag, weight;
-SIFT3D_IGNORE_UNUSED
-	int a, p, x, y, z, bin;
-
-        const Mesh *const mesh = &sift3d->mesh;
-	const float win_radius = desc_rad_fctr * sigma;
+	// Compute basic parameters 
+        const float sigma = key->sd * desc_sig_fctr;
+	const float win_radius = desc_rad_fctr * sigma;
+	const float desc_half_width = win_radius / sqrt(2);
+	const float desc_width = 2.0f * desc_half_width;
+        const float desc_hist_width = desc_width / NHIST_PER_DIM;
+	const float desc_bin_fctr = 1.0f / desc_hist_width;
+	const double coord_factor = ldexp(1.0, key->o);
 
         // Invert the rotation matrix
         if (init_Mat_rm_p(&Rt, buf, IM_NDIMS, IM_NDIMS, SIFT3D_FLOAT, 
 		SIFT3D_FALSE) ||
-                transpose_Mat_rm(R, &Rt))
+                transpose_Mat_rm(&key->R, &Rt))
                 return SIFT3D_FAILURE;
 
 	// Zero the descriptor
-        hist_zero(hist);
+	for (i = 0; i < DESC_NUM_TOTAL_HIST; i++) {
+		hist = desc->hists + i;
+                hist_zero(hist);
+	}
 
-	// Iterate over a sphere window in real-world coordinates
-	IM_LOOP_SPHERE_START(im, x, y, z, vcenter, win_radius, &vim, sq_dist)
+	// Iterate over a sphere window in real-world coordinates 
+	vcenter.x = key->xd;
+	vcenter.y = key->yd;
+	vcenter.z = key->zd;
+	IM_LOOP_SPHERE_START(im, x, y, z, &vcenter, win_radius, &vim, sq_dist)
 
-		// Take the gradient and rotate
-		IM_GET_GRAD_ISO(im, x, y, z, 0, &grad);
-		SIFT3D_MUL_MAT_RM_CVEC(&Rt, &grad, &grad_rot);
+		// Rotate to keypoint space
+		SIFT3D_MUL_MAT_RM_CVEC(&Rt, &vim, &vkp);		
 
-                // Get the index of the intersecting face
-                if (icos_hist_bin(sift3d, &grad_rot, &bary, &bin))
-                        continue;
+		// Compute spatial bins
+		vbins.x = (vkp.x + desc_half_width) * desc_bin_fctr;
+		vbins.y = (vkp.y + desc_half_width) * desc_bin_fctr;
+		vbins.z = (vkp.z + desc_half_width) * desc_bin_fctr;
 
-                // Get the magnitude of the vector
-                mag = SIFT3D_CVEC_L2_NORM(&grad);
+		// Reject points outside the rectangular descriptor 
+		if (vbins.x < 0 || vbins.y < 0 || vbins.z < 0 ||
+			vbins.x >= (float) NHIST_PER_DIM ||
+			vbins.y >= (float) NHIST_PER_DIM ||
+			vbins.z >= (float) NHIST_PER_DIM)
+			continue;
+
+		// Take the gradient
+		IM_GET_GRAD_ISO_CACHED(im, grads, x, y, z, &grad);
 
-		// Get the Gaussian window weight
+		// Apply a Gaussian window
 		weight = expf(-0.5f * sq_dist / (sigma * sigma));
+		SIFT3D_CVEC_SCALE(&grad, weight);
 
-                // Interpolate over three vertices
-                MESH_HIST_GET(mesh, hist, bin, 0) += mag * weight * bary.x;
-                MESH_HIST_GET(mesh, hist, bin, 1) += mag * weight * bary.y;
-                MESH_HIST_GET(mesh, hist, bin, 2) += mag * weight * bary.z;
+                // Rotate the gradient to keypoint space
+		SIFT3D_MUL_MAT_RM_CVEC(&Rt, &grad, &grad_rot);
 
+		// Finally, accumulate bins by 5x linear interpolation
+		SIFT3D_desc_acc_interp(sift3d, &vbins, &grad_rot, desc);
 	IM_LOOP_SPHERE_END
 
+	// Histogram refinement steps
+	for (i = 0; i < DESC_NUM_TOTAL_HIST; i++) {
+		refine_Hist(&desc->hists[i]);
+	}
+
+	// Normalize the descriptor
+	normalize_desc(desc);
+
+	// Truncate
+	for (i = 0; i < DESC_NUM_TOTAL_HIST; i++) {
+		hist = desc->hists + i;
+		HIST_LOOP_START(a, p)
+			HIST_GET(hist, a, p) = SIFT3D_MIN(HIST_GET(hist, a, p), 
+						   (float) trunc_thresh);
+		HIST_LOOP_END
+	}
+
+	// Normalize again
+	normalize_desc(desc);
+
+	// Save the descriptor location in the original image
+	// coordinates
+	desc->xd = key->xd * coord_factor;
+	desc->yd = key->yd * coord_factor;
+	desc->zd = key->zd * coord_factor;
+	desc->sd = key->sd;
+
         return SIFT3D_SUCCESS;
 }
 
-/* Get a descriptor with a single histogram at each voxel of an image.
- * The result is an image with HIST_NUMEL channels, where each channel is a
- * bin of the histogram.
+/* Check if the Gaussian scale-space pyramid in a SIFT3D struct is valid. This
+ * shall return SIFT3D_TRUE if the struct was initialized, and 
+ * SIFT3D_detect_keypoints has been successfully called on it since 
+ * initialization. 
  *
- * Parameters:
- * -sift3d Stores the algorithm parameters.
- * -in The input image.
- * -desc The output image of descriptors.
- */
-int SIFT3D_extract_dense_descriptors(SIFT3D *const sift3d, 
-        const Image *const in, Image *const desc) {
+ * Note: sift3d must be initialized before calling this function. */
+int SIFT3D_have_gpyr(const SIFT3D *const sift3d) {
 
-        int (*extract_fun)(SIFT3D *const, const Image *const, Image *const);
-        Image in_smooth;
-        int x, y, z;
+        const Pyramid *const gpyr = &sift3d->gpyr;
 
-        // Verify inputs
-        if (in->nc != 1) {
-                SIFT3D_ERR("SIFT3D_extract_dense_descriptors: invalid "
-                        "number of channels: %d. This function only supports "
-                        "single-channel images. \n", in->nc);
+        return gpyr->levels != NULL && gpyr->num_levels != 0 && 
+                gpyr->num_octaves != 0;
+}
+
+/* Helper function to scale keypoint coordinates.
+ *
+ * Parameters:
+ *  -src: The source keypoints.
+ *  -factors: An array of length IM_NDIMS specifying the scaling factors.
+ *  -dst: The scaled keypoints.
+ *
+ * Return: SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int scale_Keypoint(const Keypoint *const src, 
+        const double *const factors, Keypoint *const dst) {
+
+        // Copy the source keypoint
+        if (copy_Keypoint(src, dst)) {
+                SIFT3D_ERR("scale_Keypoint: failed to convert keypoints \n");
                 return SIFT3D_FAILURE;
         }
+      
+        // Scale the coordinates 
+        dst->xd *= factors[0];
+        dst->yd *= factors[1];
+        dst->zd *= factors[2];
 
-        // Select the appropriate subroutine
-        extract_fun = sift3d->dense_rotate ? 
-                extract_dense_descriptors_rotate :
-                extract_dense_descriptors_no_rotate;
+        return SIFT3D_SUCCESS;
+}
 
-        // Resize the output image
-        memcpy(SIFT3D_IM_GET_DIMS(desc), SIFT3D_IM_GET_DIMS(in), 
-                IM_NDIMS * sizeof(int));
-        desc->nc = HIST_NUMEL;
-        im_default_stride(desc);
-        if (im_resize(desc))
+/* Helper function to smooth and scale a "raw" input image, as if it were 
+ * processed via SIFT3D_detect_keypoints.
+ *
+ * Parameters:
+ *  -sift3d: Stores the parameters sigma_n and sigma0.
+ *  -src: The input "raw" image.
+ *  -dst: The output, smoothed image.
+ *
+ * Return: SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int smooth_scale_raw_input(const SIFT3D *const sift3d, 
+        const Image *const src, Image *const dst) {
+
+        // Smooth the input
+        if (smooth_raw_input(sift3d, src, dst))
                 return SIFT3D_FAILURE;
 
-        // Intialize intermediates
-        init_im(&in_smooth);
+        // Scale the input to [-1, 1]
+        im_scale(dst);
+        
+        return SIFT3D_SUCCESS;
+}
 
-        //TODO: Interpolate to be isotropic
+/* The same as smooth_scale_raw_input, but without scaling the result. */
+static int smooth_raw_input(const SIFT3D *const sift3d, 
+        const Image *const src, Image *const dst) {
 
-        // Smooth and scale the input image
-        if (smooth_scale_raw_input(sift3d, in, &in_smooth))
-                goto extract_dense_quit;
+        Gauss_filter gauss;
 
-        // Extract the descriptors
-        if (extract_fun(sift3d, &in_smooth, desc))
+        const double sigma_n = sift3d->gpyr.sigma_n;
+        const double sigma0 = sift3d->gpyr.sigma0;
+        const double unit = 1.0;
+
+        // Initialize the smoothing filter        
+        if (init_Gauss_incremental_filter(&gauss, sigma_n, sigma0, IM_NDIMS))
                 return SIFT3D_FAILURE;
 
-        // Post-process the descriptors
-        SIFT3D_IM_LOOP_START(desc, x, y, z)
+        // Smooth the input
+        if (apply_Sep_FIR_filter(src, dst, &gauss.f, unit)) {
+                cleanup_Gauss_filter(&gauss);
+                return SIFT3D_FAILURE;
+        }
 
-                Hist hist;
+        cleanup_Gauss_filter(&gauss);
+        return SIFT3D_SUCCESS;
+}
 
-                // Get the image intensity at this voxel 
-                const float val = SIFT3D_IM_GET_VOX(in, x, y, z, 0);
+/* Extract SIFT3D descriptors from a list of keypoints. Uses the Gaussian
+ * scale-space pyramid from the previous call to SIFT3D_detect_keypoints on
+ * this SIFT3D struct. To extract from an image, see 
+ * SIFT3D_extract_raw_descriptors. 
+ *
+ * Note: To check if SIFT3D_detect_keypoints has been called on this struct,
+ * use SIFT3D_have_gpyr.
+ *
+ * Parameters:
+ *  sift3d - (initialized) struct defining the algorithm parameters. Must have
+ *      been used in some previous call to SIFT3D_detect_keypoints.
+ *  kp - keypoint list populated by a feature detector 
+ *  desc - (initialized) struct to hold the descriptors
+ *
+ * Return value:
+ *  Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise.
+ */
+int SIFT3D_extract_descriptors(SIFT3D *const sift3d, 
+        const Keypoint_store *const kp, 
+        SIFT3D_Descriptor_store *const desc) {
 
-                // Copy to a Hist
-                vox2hist(desc, x, y, z, &hist);
+        double start;
+        int num_threads, ret;
 
-                // Post-process
-                postproc_Hist(&hist, val);
+	// Verify inputs, in the coordinates of the region of the pyramids
+	if (verify_keys(kp, &sift3d->im, sift3d->roi_active ? 
+                sift3d->roi_start : NULL))
+		return SIFT3D_FAILURE;
 
-                // Copy back to the image
-                hist2vox(&hist, desc, x, y, z);
+        // Check if a Gaussian scale-space pyramid is available for processing
+        if (!SIFT3D_have_gpyr(sift3d)) {
+                SIFT3D_ERR("SIFT3D_extract_descriptors: no Gaussian pyramid is "
+                        "available. Make sure SIFT3D_detect_keypoints was "
+                        "called prior to calling this function. \n");
+                return SIFT3D_FAILURE;
+        }
 
-        SIFT3D_IM_LOOP_END
+        // Extract features
+        start = SIFT3D_STATS_START(sift3d->stats);
+        num_threads = push_num_threads(sift3d);
+        ret = _SIFT3D_extract_descriptors(sift3d, &sift3d->gpyr, kp, desc, 
+                NULL);
+        SIFT3D_set_num_threads(num_threads);
+
+        if (ret == SIFT3D_SUCCESS)
+                record_SIFT3D_Stats(sift3d->stats, SIFT3D_STAGE_DESCRIPTOR, 
+                        start, desc->num, 0, 
+                        desc->num * sizeof(SIFT3D_Descriptor));
+
+        return ret;
+}
 
-        // TODO transform back to original space
+/* The same as SIFT3D_extract_descriptors, but quantizes each descriptor as
+ * it is extracted, so that the full-precision descriptors are never 
+ * stored. The element type is taken from quant, which must be 
+ * initialized. */
+int SIFT3D_extract_quant_descriptors(SIFT3D *const sift3d, 
+        const Keypoint_store *const kp, 
+        SIFT3D_Quant_store *const quant) {
 
-        // Clean up
-        im_free(&in_smooth);
+        double start;
+        int num_threads, ret;
 
-        return SIFT3D_SUCCESS;
+	// Verify inputs, in the coordinates of the region of the pyramids
+	if (verify_keys(kp, &sift3d->im, sift3d->roi_active ? 
+                sift3d->roi_start : NULL))
+		return SIFT3D_FAILURE;
 
-extract_dense_quit:
-        im_free(&in_smooth);
-        return SIFT3D_FAILURE;
+        // Check if a Gaussian scale-space pyramid is available for processing
+        if (!SIFT3D_have_gpyr(sift3d)) {
+                SIFT3D_ERR("SIFT3D_extract_quant_descriptors: no Gaussian "
+                        "pyramid is available. Make sure "
+                        "SIFT3D_detect_keypoints was called prior to calling "
+                        "this function. \n");
+                return SIFT3D_FAILURE;
+        }
+
+        // Extract features
+        start = SIFT3D_STATS_START(sift3d->stats);
+        num_threads = push_num_threads(sift3d);
+        ret = _SIFT3D_extract_descriptors(sift3d, &sift3d->gpyr, kp, NULL, 
+                quant);
+        SIFT3D_set_num_threads(num_threads);
+
+        if (ret == SIFT3D_SUCCESS)
+                record_SIFT3D_Stats(sift3d->stats, SIFT3D_STAGE_DESCRIPTOR, 
+                        start, quant->num, 0, quant->num * (DESC_NUMEL *
+                        quant_type_get_size(quant->type) + 
+                        4 * sizeof(double)));
+
+        return ret;
 }
 
-/* Helper function for SIFT3D_extract_dense_descriptors, without rotation 
- * invariance. This function is much faster than its rotation-invariant 
- * counterpart because histogram bins are pre-computed. */
-static int extract_dense_descriptors_no_rotate(SIFT3D *const sift3d,
-        const Image *const in, Image *const desc) {
+/* Helper function to compute the halo, in voxels of the input image, which 
+ * must surround each tile in order for tiled detection to reproduce the 
+ * results of processing the whole image. The halo covers the support of 
+ * the Gaussian filters, accumulated over the levels of each octave, plus the 
+ * orientation and descriptor windows. It is rounded up to a multiple of the
+ * coarsest octave's voxel size. */
+static int get_tile_halo(const SIFT3D *const sift3d, const Image *const im,
+        const int num_octaves, int *const halo) {
 
-        Image temp; 
         Gauss_filter gauss;
-	Cvec grad, bary;
-        int x, y, z, bin;
+        int *hw, *reach;
+        int o, s, i;
 
-        const int x_start = 1;
-        const int y_start = 1;
-        const int z_start = 1;
-        const int x_end = in->nx - 2;
-        const int y_end = in->ny - 2;
-        const int z_end = in->nz - 2;
+        const Pyramid *const gpyr = &sift3d->gpyr;
+        const int first_level = gpyr->first_level;
+        const int num_levels = gpyr->num_levels;
+        const int last_level = first_level + num_levels - 1;
+        const int num_kp_levels = gpyr->num_kp_levels;
+        const int downsample_level = SIFT3D_MAX(last_level - 2, first_level);
+        const int align = 1 << (num_octaves - 1);
+        const double win_fctr = SIFT3D_MAX(ori_rad_fctr * ori_sig_fctr,
+                desc_rad_fctr * desc_sig_fctr);
 
-        Mesh * const mesh = &sift3d->mesh;
-        const double sigma_win = sift3d->gpyr.sigma0 * desc_sig_fctr / 
-                                 NHIST_PER_DIM;
-        const double unit = 1.0;
+#define SCALE(o, s) \
+        (gpyr->sigma0 * pow(2.0, (o) + (double) (s) / num_kp_levels))
 
-        // Initialize the intermediate image
-        init_im(&temp);
-        if (im_copy_dims(desc, &temp))
+        // Allocate the filter widths and reach of each level
+        if ((hw = (int *) malloc(num_levels * sizeof(int))) == NULL)
                 return SIFT3D_FAILURE;
+        if ((reach = (int *) malloc(num_levels * sizeof(int))) == NULL) {
+                free(hw);
+                return SIFT3D_FAILURE;
+        }
 
-        // Initialize the filter
-        if (init_Gauss_filter(&gauss, sigma_win, 3)) {
-                im_free(&temp);
+        // Get the half-widths of the filters, as in make_gss. Entry 0 is the 
+        // first blur, entry s - first_level goes from level s - 1 to s.
+        for (s = first_level; s <= last_level; s++) {
+                if (s == first_level ?
+                        init_Gauss_incremental_filter(&gauss, gpyr->sigma_n, 
+                                SCALE(0, first_level), IM_NDIMS) :
+                        init_Gauss_incremental_filter(&gauss, SCALE(0, s - 1), 
+                                SCALE(0, s), IM_NDIMS)) {
+                        free(hw);
+                        free(reach);
+                        return SIFT3D_FAILURE;
+                }
+                hw[s - first_level] = gauss.f.width / 2;
+                cleanup_Gauss_filter(&gauss);
+        }
+
+        for (i = 0; i < IM_NDIMS; i++) {
+
+                int need;
+
+                const double unit = SIFT3D_IM_GET_UNITS(im)[i];
+
+                // The first blur, and one voxel for interpolation
+                reach[0] = (int) ceil(hw[0] / unit) + 1;
+
+                need = 0;
+                for (o = 0; o < num_octaves; o++) {
+
+                        const int vox = 1 << o;
+
+                        // Start from the downsampled level
+                        if (o > 0)
+                                reach[0] = reach[downsample_level - 
+                                        first_level];
+
+                        // Accumulate the filters in this octave
+                        for (s = first_level + 1; s <= last_level; s++) {
+                                const int idx = s - first_level;
+                                reach[idx] = reach[idx - 1] + vox * 
+                                        ((int) ceil(hw[idx] / (unit * vox)) + 
+                                        1);
+                        }
+
+                        // Extrema are compared to their neighbors
+                        need = SIFT3D_MAX(need, reach[num_levels - 1] + vox);
+
+                        // Windows around the keypoints
+                        for (s = first_level + 1; s < last_level - 1; s++) {
+                                const double rad = win_fctr * SCALE(o, s);
+                                need = SIFT3D_MAX(need, 
+                                        reach[s - first_level] + vox * 
+                                        ((int) ceil(rad / (unit * vox)) + 2));
+                        }
+                }
+
+                // Align to the coarsest octave
+                halo[i] = (need + align - 1) / align * align;
+        }
+
+#undef SCALE
+
+        free(hw);
+        free(reach);
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper routine to set a tile of im as the current image of sift3d. The
+ * tile is divided by scale, if nonzero, and the pyramid is resized to
+ * num_octaves octaves, as needed. */
+static int set_tile_SIFT3D(SIFT3D *const sift3d, const Image *const im,
+        const Tile *const tile, const float scale, const int num_octaves) {
+
+        int dims_old[IM_NDIMS];
+        int i, x, y, z;
+
+        Image *const tile_im = &sift3d->im;
+	const float *const data_old = tile_im->data;
+        const int num_kp_levels = sift3d->gpyr.num_kp_levels;
+
+        // The pyramids of the previous image are discarded, along with
+        // their cached gradients and region
+        sift3d->pyr_on_device = sift3d->pyr_host_stale = SIFT3D_FALSE;
+        if (sift3d->grads_valid != NULL)
+                memset(sift3d->grads_valid, 0, sift3d->num_grads);
+        sift3d->roi_active = SIFT3D_FALSE;
+
+        // Make a temporary copy the previous image dimensions
+        for (i = 0; i < IM_NDIMS; i++) {
+                dims_old[i] = SIFT3D_IM_GET_DIMS(tile_im)[i];
+        }
+
+        // Resize the tile image
+        for (i = 0; i < IM_NDIMS; i++) {
+                SIFT3D_IM_GET_DIMS(tile_im)[i] = tile->end[i] - tile->start[i];
+                SIFT3D_IM_GET_UNITS(tile_im)[i] = SIFT3D_IM_GET_UNITS(im)[i];
+        }
+        tile_im->nc = 1;
+        im_default_stride(tile_im);
+        if (im_resize(tile_im))
+                return SIFT3D_FAILURE;
+
+        // Copy the data, scaling as in set_im_SIFT3D
+        SIFT3D_IM_LOOP_START(tile_im, x, y, z)
+
+                const float val = SIFT3D_IM_GET_VOX_F(im, x + tile->start[0], 
+                        y + tile->start[1], z + tile->start[2], 0);
+
+                SIFT3D_IM_GET_VOX(tile_im, x, y, z, 0) = scale == 0.0f ? 
+                        val : val / scale;
+
+        SIFT3D_IM_LOOP_END
+
+        // Resize the internal data, if necessary
+        if ((data_old == NULL || sift3d->gpyr.num_octaves != num_octaves ||
+                memcmp(dims_old, SIFT3D_IM_GET_DIMS(tile_im), 
+                        IM_NDIMS * sizeof(int))) &&
+                resize_SIFT3D_octaves(sift3d, num_kp_levels, num_octaves))
                 return SIFT3D_FAILURE;
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Get the range [lo, hi) of voxels in a pyramid level of octave o which are 
+ * owned by a tile. */
+static void get_tile_owned(const Tile *const tile, const Image *const level,
+        const int o, int *const lo, int *const hi) {
+
+        int i;
+
+        const int vox = 1 << o;
+
+        for (i = 0; i < IM_NDIMS; i++) {
+                lo[i] = (tile->core_start[i] - tile->start[i]) >> o;
+                hi[i] = SIFT3D_MIN(SIFT3D_IM_GET_DIMS(level)[i],
+                        (tile->core_end[i] - tile->start[i] + vox - 1) >> o);
         }
+}
 
-        // Initialize the descriptors for each voxel
-        im_zero(&temp);
-        SIFT3D_IM_LOOP_LIMITED_START(in, x, y, z, x_start, x_end, y_start, 
-                y_end, z_start, z_end)
+/* Update the maximum absolute value of each DoG level, from the voxels owned
+ * by the current tile. The Gaussian pyramid must already be built. */
+static void tile_dogmax(SIFT3D *const sift3d, const Tile *const tile, 
+        float *const dogmax) {
 
-                // Take the gradient
-		IM_GET_GRAD_ISO(in, x, y, z, 0, &grad);
+        int o, s;
 
-                // Get the index of the intersecting face
-                if (icos_hist_bin(sift3d, &grad, &bary, &bin))
+        const Pyramid *const gpyr = &sift3d->gpyr;
+        const int num_dog_levels = gpyr->num_levels - 1;
+        const int first_level = gpyr->first_level;
+
+        SIFT3D_PYR_LOOP_START(gpyr, o, s)
+
+                int lo[IM_NDIMS], hi[IM_NDIMS];
+                float max;
+                int x, y, z;
+
+                const Image *const cur = SIFT3D_PYR_IM_GET(gpyr, o, s);
+                const Image *const next = SIFT3D_PYR_IM_GET(gpyr, o, s + 1);
+                float *const dst = dogmax + (o - gpyr->first_octave) * 
+                        num_dog_levels + s - first_level;
+
+                // Skip the last level, which has no DoG
+                if (s - first_level >= num_dog_levels)
                         continue;
 
-                // Initialize each vertex
-                SIFT3D_IM_GET_VOX(&temp, x, y, z, MESH_GET_IDX(mesh, bin, 0)) = 
-                        bary.x;
-                SIFT3D_IM_GET_VOX(&temp, x, y, z, MESH_GET_IDX(mesh, bin, 1)) = 
-                        bary.y;
-                SIFT3D_IM_GET_VOX(&temp, x, y, z, MESH_GET_IDX(mesh, bin, 2)) = 
-                        bary.z;
+                get_tile_owned(tile, cur, o, lo, hi);
+
+                max = *dst;
+                SIFT3D_IM_LOOP_LIMITED_START(cur, x, y, z, lo[0], hi[0] - 1, 
+                        lo[1], hi[1] - 1, lo[2], hi[2] - 1)
+                        max = SIFT3D_MAX(max, 
+                                fabsf(SIFT3D_IM_GET_VOX_F(cur, x, y, z, 0) -
+                                SIFT3D_IM_GET_VOX_F(next, x, y, z, 0)));
+                SIFT3D_IM_LOOP_END
+                *dst = max;
+
+        SIFT3D_PYR_LOOP_END
+}
+
+/* Copy the voxels of a pyramid level of octave o which are owned by a tile 
+ * into dst, a level of the same octave spanning the whole image. */
+static void save_tile_level(const Tile *const tile, const Image *const src,
+        const int o, Image *const dst) {
+
+        int lo[IM_NDIMS], hi[IM_NDIMS];
+        int x, y, z;
+
+        const int x_offset = tile->start[0] >> o;
+        const int y_offset = tile->start[1] >> o;
+        const int z_offset = tile->start[2] >> o;
 
+        get_tile_owned(tile, src, o, lo, hi);
+        SIFT3D_IM_LOOP_LIMITED_START(src, x, y, z, lo[0], hi[0] - 1, lo[1], 
+                hi[1] - 1, lo[2], hi[2] - 1)
+                im_store_vox(dst, SIFT3D_IM_GET_IDX(dst, x + x_offset, 
+                        y + y_offset, z + z_offset, 0), 
+                        SIFT3D_IM_GET_VOX_F(src, x, y, z, 0));
         SIFT3D_IM_LOOP_END
+}
 
-        // Filter the descriptors
-	if (apply_Sep_FIR_filter(&temp, desc, &gauss.f, unit))
-                goto dense_extract_quit;
+/* Detect keypoints and extract descriptors in the current tile, appending 
+ * those which it owns to kp and desc, in the coordinates of the whole image.
+ * o_start and dogmax are passed to detect_extrema_fused. kp_tile and 
+ * desc_tile are scratch space. desc may be NULL. */
+static int detect_tile(SIFT3D *const sift3d, const Tile *const tile,
+        const int o_start, const float *const dogmax, 
+        Keypoint_store *const kp_tile,
+        SIFT3D_Descriptor_store *const desc_tile, Keypoint_store *const kp,
+        SIFT3D_Descriptor_store *const desc) {
+
+        Keypoint *kp_pos;
+        size_t num_old;
+        int i, num;
+
+        const Pyramid *const gpyr = &sift3d->gpyr;
+
+        // Detect the extrema
+        if (resize_Keypoint_store(kp_tile, 0) ||
+                detect_extrema_fused(sift3d, o_start, dogmax, kp_tile))
+                return SIFT3D_FAILURE;
+
+        // Keep only the keypoints owned by this tile
+        kp_pos = kp_tile->buf;
+        for (i = 0; i < kp_tile->slab.num; i++) {
+
+                int lo[IM_NDIMS], hi[IM_NDIMS];
+
+                Keypoint *const key = kp_tile->buf + i;
+                const int x = (int) key->xd;
+                const int y = (int) key->yd;
+                const int z = (int) key->zd;
+
+                get_tile_owned(tile, SIFT3D_PYR_IM_GET(gpyr, key->o, key->s),
+                        key->o, lo, hi);
+                if (x < lo[0] || x >= hi[0] || y < lo[1] || y >= hi[1] ||
+                        z < lo[2] || z >= hi[2])
+                        continue;
+
+                if (copy_Keypoint(key, kp_pos))
+                        return SIFT3D_FAILURE;
+                kp_pos++;
+        }
+        if (resize_Keypoint_store(kp_tile, kp_pos - kp_tile->buf))
+                return SIFT3D_FAILURE;
+
+        // Assign orientations and extract the descriptors
+        if (assign_orientations(sift3d, kp_tile))
+                return SIFT3D_FAILURE;
+        num = kp_tile->slab.num;
+        if (num < 1)
+                return SIFT3D_SUCCESS;
+        if (desc != NULL && _SIFT3D_extract_descriptors(sift3d, gpyr, kp_tile,
+                desc_tile, NULL))
+                return SIFT3D_FAILURE;
+
+        // Append the keypoints, translating to the whole image
+        num_old = kp->slab.num;
+        if (resize_Keypoint_store(kp, num_old + num))
+                return SIFT3D_FAILURE;
+        for (i = 0; i < num; i++) {
+
+                const Keypoint *const src = kp_tile->buf + i;
+                Keypoint *const dst = kp->buf + num_old + i;
+
+                if (init_Keypoint(dst) || copy_Keypoint(src, dst))
+                        return SIFT3D_FAILURE;
+                dst->xd += (double) (tile->start[0] >> src->o);
+                dst->yd += (double) (tile->start[1] >> src->o);
+                dst->zd += (double) (tile->start[2] >> src->o);
+        }
+
+        // Append the descriptors
+        if (desc == NULL)
+                return SIFT3D_SUCCESS;
+        num_old = desc->num;
+        if (resize_SIFT3D_Descriptor_store(desc, num_old + num))
+                return SIFT3D_FAILURE;
+        for (i = 0; i < num; i++) {
+
+                SIFT3D_Descriptor *const dst = desc->buf + num_old + i;
+
+                *dst = desc_tile->buf[i];
+                dst->xd += (double) tile->start[0];
+                dst->yd += (double) tile->start[1];
+                dst->zd += (double) tile->start[2];
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Compare two pointers to keypoints, in the order produced by 
+ * SIFT3D_detect_keypoints: by octave, level, then z, y, x. */
+static int cmp_keypoint_order(const void *a, const void *b) {
+
+        const Keypoint *const k1 = *(const Keypoint *const *) a;
+        const Keypoint *const k2 = *(const Keypoint *const *) b;
+
+        if (k1->o != k2->o)
+                return k1->o < k2->o ? -1 : 1;
+        if (k1->s != k2->s)
+                return k1->s < k2->s ? -1 : 1;
+        if (k1->zd != k2->zd)
+                return k1->zd < k2->zd ? -1 : 1;
+        if (k1->yd != k2->yd)
+                return k1->yd < k2->yd ? -1 : 1;
+        if (k1->xd != k2->xd)
+                return k1->xd < k2->xd ? -1 : 1;
+        return 0;
+}
+
+/* Detect keypoints and extract descriptors, processing the image in 
+ * overlapping tiles. Only the pyramid of a single tile is held in memory at
+ * a time, so this uses much less memory than SIFT3D_detect_keypoints for
+ * large images. The results are the same as SIFT3D_detect_keypoints followed
+ * by SIFT3D_extract_descriptors.
+ *
+ * Each tile is surrounded by a halo, computed from the filter widths, 
+ * number of octaves and window sizes, so that the pyramid is correct within
+ * the tile. Keypoints are kept only by the tile containing them. The image
+ * is traversed twice, first to compute the maximum of each DoG level, which
+ * is used for the peak threshold, then to detect the keypoints. 
+ *
+ * Since the halo doubles with each octave, only the finest octaves are 
+ * processed in tiles, as many as permit a halo no larger than the tile. The 
+ * remaining octaves are processed on the whole image, starting from a 
+ * downsampled level assembled from the tiles.
+ *
+ * Parameters:
+ *  sift3d - (initialized) struct defining the algorithm parameters
+ *  im - The image, which must have a single channel.
+ *  tile_size - The side length of each tile, in voxels, excluding the halo.
+ *  kp - (initialized) struct to hold the keypoints
+ *  desc - (initialized) struct to hold the descriptors, or NULL to skip 
+ *      descriptor extraction
+ *
+ * Note that sift3d does not retain a pyramid after this function returns,
+ * so SIFT3D_extract_descriptors cannot be called on the results.
+ *
+ * Return value:
+ *  Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int SIFT3D_extract_features_tiled(SIFT3D *const sift3d, const Image *const im,
+        const int tile_size, Keypoint_store *const kp, 
+        SIFT3D_Descriptor_store *const desc) {
+
+        int ret;
+
+        const int num_threads = push_num_threads(sift3d);
+        ret = _SIFT3D_extract_features_tiled(sift3d, im, tile_size, kp, desc);
+        SIFT3D_set_num_threads(num_threads);
+
+        return ret;
+}
+
+/* Helper function for SIFT3D_extract_features_tiled, using the thread count of
+ * the calling thread. */
+static int _SIFT3D_extract_features_tiled(SIFT3D *const sift3d, 
+        const Image *const im, const int tile_size, Keypoint_store *const kp, 
+        SIFT3D_Descriptor_store *const desc) {
+
+        Keypoint_store kp_all, kp_tile;
+        SIFT3D_Descriptor_store desc_all, desc_tile;
+        Pyramid coarse, swap;
+        Tile tile;
+        int halo[IM_NDIMS], num_tiles[IM_NDIMS];
+        const Keypoint **order;
+        Image *coarse_base;
+        float *dogmax;
+        float scale;
+        int i, s, num_octaves, num_fine, align, core, pass, tx, ty, tz, num,
+                ret;
+
+        const int fused = sift3d->fused;
+        const int first_octave = sift3d->gpyr.first_octave;
+        const int first_level = sift3d->gpyr.first_level;
+        const int num_kp_levels = sift3d->gpyr.num_kp_levels;
+        const int num_levels = sift3d->gpyr.num_levels;
+        const int num_dog_levels = num_levels - 1;
+        const int downsample_level = SIFT3D_MAX(first_level + num_levels - 3,
+                first_level);
+
+        // Verify inputs
+        if (im->nc != 1) {
+                SIFT3D_ERR("SIFT3D_extract_features_tiled: invalid number "
+                        "of image channels: %d -- only single-channel images "
+                        "are supported \n", im->nc);
+                return SIFT3D_FAILURE;
+        }
+        if (tile_size < 1) {
+                SIFT3D_ERR("SIFT3D_extract_features_tiled: invalid tile "
+                        "size: %d \n", tile_size);
+                return SIFT3D_FAILURE;
+        }
+        if (sift3d->mask != NULL) {
+                SIFT3D_ERR("SIFT3D_extract_features_tiled: masks are not "
+                        "supported \n");
+                return SIFT3D_FAILURE;
+        }
+
+        // Choose the number of tiled octaves, and the tile size
+        if (get_num_octaves(im, first_octave, &num_octaves))
+                return SIFT3D_FAILURE;
+        for (num_fine = num_octaves; num_fine > 0; num_fine--) {
+
+                int halo_max;
+
+                if (get_tile_halo(sift3d, im, num_fine, halo))
+                        return SIFT3D_FAILURE;
+
+                align = 1 << (num_fine - 1);
+                core = (tile_size + align - 1) / align * align;
+
+                halo_max = SIFT3D_MAX(SIFT3D_MAX(halo[0], halo[1]), halo[2]);
+                if (halo_max <= core || num_fine == 1)
+                        break; 
+        }
+        for (i = 0; i < IM_NDIMS; i++) {
+                num_tiles[i] = (SIFT3D_IM_GET_DIMS(im)[i] + core - 1) / core;
+        }
+
+        // Initialize intermediates
+        order = NULL;
+        coarse_base = NULL;
+        if ((dogmax = (float *) calloc((size_t) num_fine * num_dog_levels, 
+                sizeof(float))) == NULL)
+                return SIFT3D_FAILURE;
+        init_Keypoint_store(&kp_all);
+        init_Keypoint_store(&kp_tile);
+        init_SIFT3D_Descriptor_store(&desc_all);
+        init_SIFT3D_Descriptor_store(&desc_tile);
+        desc_all.num = 0;
+        init_Pyramid(&coarse);
+        sift3d->fused = SIFT3D_TRUE;
+        scale = im_max_abs(im);
+        ret = SIFT3D_FAILURE;
+
+        // Allocate the coarse octaves, starting from the last tiled octave, 
+        // of which only the downsampling level is kept
+        if (num_fine < num_octaves) {
+
+                coarse.sigma0 = sift3d->gpyr.sigma0;
+                coarse.sigma_n = sift3d->gpyr.sigma_n;
+                coarse.type = get_pyr_type_SIFT3D(sift3d);
+                if (resize_Pyramid(im, first_level, num_kp_levels, num_levels,
+                        first_octave + num_fine - 1, 
+                        num_octaves - num_fine + 1, &coarse))
+                        goto extract_features_tiled_quit;
+
+                for (s = first_level; s < first_level + num_levels; s++) {
+
+                        Image *const level = SIFT3D_PYR_IM_GET(&coarse, 
+                                coarse.first_octave, s);
+
+                        if (s == downsample_level)
+                                continue;
+
+                        im_free(level);
+                        level->data = NULL;
+                }
+                coarse_base = SIFT3D_PYR_IM_GET(&coarse, coarse.first_octave,
+                        downsample_level);
+        }
+
+        // First pass: compute the DoG maxima. Second pass: detect features.
+        for (pass = 0; pass < 2; pass++) {
+        for (tz = 0; tz < num_tiles[2]; tz++) {
+        for (ty = 0; ty < num_tiles[1]; ty++) {
+        for (tx = 0; tx < num_tiles[0]; tx++) {
+
+                const int t[] = {tx, ty, tz};
+
+                // Get the tile extent
+                for (i = 0; i < IM_NDIMS; i++) {
+
+                        const int n = SIFT3D_IM_GET_DIMS(im)[i];
+                        const int min_len = 8 * align;
+
+                        tile.core_start[i] = t[i] * core;
+                        tile.core_end[i] = SIFT3D_MIN(tile.core_start[i] + 
+                                core, n);
+                        tile.start[i] = SIFT3D_MAX(tile.core_start[i] - 
+                                halo[i], 0);
+                        tile.end[i] = SIFT3D_MIN(tile.core_end[i] + halo[i], n);
+
+                        // Enlarge small tiles to support all the octaves
+                        if (tile.end[i] - tile.start[i] < min_len) {
+                                tile.start[i] = tile.end[i] >= min_len ?
+                                        (tile.end[i] - min_len) / align * 
+                                        align : 0;
+                                tile.end[i] = SIFT3D_MAX(tile.end[i], 
+                                        tile.start[i] + min_len);
+                        }
+                }
+
+                // Build the pyramid of this tile
+                if (set_tile_SIFT3D(sift3d, im, &tile, scale, num_fine))
+                        goto extract_features_tiled_quit;
+                if (pass == 0) {
+
+                        if (build_gpyr(sift3d))
+                                goto extract_features_tiled_quit;
+                        tile_dogmax(sift3d, &tile, dogmax);
+
+                        // Save the input to the coarse octaves
+                        if (coarse_base != NULL)
+                                save_tile_level(&tile, SIFT3D_PYR_IM_GET(
+                                        &sift3d->gpyr, coarse.first_octave, 
+                                        downsample_level), 
+                                        coarse.first_octave, coarse_base);
+                        continue;
+                }
+
+                // Detect the features
+                if (detect_tile(sift3d, &tile, first_octave, dogmax, &kp_tile,
+                        &desc_tile, &kp_all, desc == NULL ? NULL : &desc_all))
+                        goto extract_features_tiled_quit;
+        }}}}
+
+        // Process the coarse octaves as a single tile
+        if (coarse_base != NULL) {
+
+                for (i = 0; i < IM_NDIMS; i++) {
+                        tile.core_start[i] = tile.start[i] = 0;
+                        tile.core_end[i] = tile.end[i] = 
+                                SIFT3D_IM_GET_DIMS(im)[i];
+                }
+
+                swap = sift3d->gpyr;
+                sift3d->gpyr = coarse;
+                coarse = swap; 
+                if (detect_tile(sift3d, &tile, sift3d->gpyr.first_octave + 1,
+                        NULL, &kp_tile, &desc_tile, &kp_all, 
+                        desc == NULL ? NULL : &desc_all))
+                        goto extract_features_tiled_quit;
+        }
+
+        // Sort the features in the order of SIFT3D_detect_keypoints
+        num = kp_all.slab.num;
+        if (num > 0 && (order = (const Keypoint **) malloc(num * 
+                sizeof(const Keypoint *))) == NULL)
+                goto extract_features_tiled_quit;
+        for (i = 0; i < num; i++) {
+                order[i] = kp_all.buf + i;
+        }
+        qsort(order, num, sizeof(const Keypoint *), cmp_keypoint_order);
+
+        // Write the output
+        if (resize_Keypoint_store(kp, num))
+                goto extract_features_tiled_quit;
+        for (i = 0; i < num; i++) {
+                if (init_Keypoint(kp->buf + i) || 
+                        copy_Keypoint(order[i], kp->buf + i))
+                        goto extract_features_tiled_quit;
+        }
+        kp->nx = im->nx;
+        kp->ny = im->ny;
+        kp->nz = im->nz;
+        if (desc != NULL) {
+                if (num > 0) {
+                        if (resize_SIFT3D_Descriptor_store(desc, num))
+                                goto extract_features_tiled_quit;
+                        for (i = 0; i < num; i++) {
+                                desc->buf[i] = 
+                                        desc_all.buf[order[i] - kp_all.buf];
+                        }
+                } else {
+                        desc->num = 0;
+                }
+                desc->nx = im->nx;
+                desc->ny = im->ny;
+                desc->nz = im->nz;
+        }
+        ret = SIFT3D_SUCCESS;
+
+extract_features_tiled_quit:
+        // Release the pyramids
+        sift3d->fused = fused;
+        im_free(&sift3d->im);
+        init_im(&sift3d->im);
+        for (i = 0; i < 3; i++) {
+                im_free(sift3d->dog_window + i);
+                init_im(sift3d->dog_window + i);
+        }
+        im_free(&sift3d->filter_temp);
+        init_im(&sift3d->filter_temp);
+        if (resize_SIFT3D(sift3d, num_kp_levels))
+                ret = SIFT3D_FAILURE;
+
+        if (order != NULL)
+                free(order);
+        free(dogmax);
+        cleanup_Pyramid(&coarse);
+        cleanup_Keypoint_store(&kp_all);
+        cleanup_Keypoint_store(&kp_tile);
+        cleanup_SIFT3D_Descriptor_store(&desc_all);
+        cleanup_SIFT3D_Descriptor_store(&desc_tile);
+
+        return ret;
+}
+
+/* Verify that keypoints kp are valid in image im. If start is not NULL, im
+ * is a region of a larger image beginning at start, in whose coordinates the
+ * keypoints are given. Returns SIFT3D_SUCCESS if valid, SIFT3D_FAILURE 
+ * otherwise. */
+static int verify_keys(const Keypoint_store *const kp, const Image *const im,
+        const int *const start) {
+
+        int i;
+
+	const int num = kp->slab.num;
+
+	// Check the number of keypoints
+	if (num < 1) {
+		SIFT3D_ERR("verify_keys: invalid number of keypoints: "
+				"%d \n", num);
+		return SIFT3D_FAILURE;
+	}
+
+	// Check each keypoint
+        for (i = 0; i < num; i++) {
+
+                const Keypoint *key = kp->buf + i;
+
+                const double octave_factor = ldexp(1.0, key->o);
+                const double xd = start == NULL ? key->xd : 
+                        key->xd - (double) (start[0] >> key->o);
+                const double yd = start == NULL ? key->yd : 
+                        key->yd - (double) (start[1] >> key->o);
+                const double zd = start == NULL ? key->zd : 
+                        key->zd - (double) (start[2] >> key->o);
+
+                if (xd < 0 ||
+                        yd < 0 ||
+                        zd < 0 ||
+                        xd * octave_factor >= (double) im->nx || 
+                        yd * octave_factor >= (double) im->ny || 
+                        zd * octave_factor >= (double) im->nz) {
+                        SIFT3D_ERR("verify_keys: keypoint %d (%f, %f, %f) "
+                                "octave %d exceeds image dimensions "
+                                "(%d, %d, %d) \n", i, xd, yd, zd,
+                                key->o, im->nx, im->ny, im->nz);
+                        return SIFT3D_FAILURE; 
+                }
+
+                if (key->sd <= 0) {
+                        SIFT3D_ERR("verify_keys: keypoint %d has invalid "
+                                "scale %f \n", i, key->sd);
+                        return SIFT3D_FAILURE;
+                }
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Convert the keypoint src to the equivalent one at octave 0, stored in dst. */
+static int keypoint2base(const Keypoint *const src, Keypoint *const dst) {
+
+        double base_factors[IM_NDIMS];
+        int j;
+
+        const double octave_factor = ldexp(1.0, src->o);
+
+        // Convert the factors to the base octave
+        for (j = 0; j < IM_NDIMS; j++) {
+                base_factors[j] = octave_factor;
+        }
+
+        // Scale the keypoint
+        if (scale_Keypoint(src, base_factors, dst))
+                return SIFT3D_FAILURE;
+
+        // Assign the keypoint the base octave and scale level
+        dst->o = 0;
+        dst->s = 0;
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Extract SIFT3D descriptors from a list of keypoints and 
+ * an image. To extract from a Gaussian scale-space pyramid, see
+ * SIFT3D_extract_descriptors. 
+ *
+ * Parameters:
+ *  sift3d - (initialized) struct defining the algorithm parameters
+ *  im - Pointer to an Image struct. A copy of the image is smoothed from 
+ *      sift3d->sigma_n to sift3d->sigma0 prior to descriptor extraction.
+ *  kp - keypoint list populated by a feature detector 
+ *  desc - (initialized) struct to hold the descriptors
+ *
+ * Return value:
+ *  Returns  SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise.
+ */
+int SIFT3D_extract_raw_descriptors(SIFT3D *const sift3d, 
+        const Image *const im, const Keypoint_store *const kp, 
+        SIFT3D_Descriptor_store *const desc) {
+
+        int ret;
+
+        const double start = SIFT3D_STATS_START(sift3d->stats);
+        const int num_threads = push_num_threads(sift3d);
+        ret = _SIFT3D_extract_raw_descriptors(sift3d, im, kp, desc);
+        SIFT3D_set_num_threads(num_threads);
+
+        if (ret == SIFT3D_SUCCESS)
+                record_SIFT3D_Stats(sift3d->stats, SIFT3D_STAGE_DESCRIPTOR, 
+                        start, desc->num, 0, 
+                        desc->num * sizeof(SIFT3D_Descriptor));
+
+        return ret;
+}
+
+/* Helper function for SIFT3D_extract_raw_descriptors, using the thread count
+ * of the calling thread. */
+static int _SIFT3D_extract_raw_descriptors(SIFT3D *const sift3d, 
+        const Image *const im, const Keypoint_store *const kp, 
+        SIFT3D_Descriptor_store *const desc) {
+
+        Keypoint_store kp_base;
+        Pyramid pyr;
+        Image *level;
+        int i;
+
+        const int first_octave = 0;
+        const int first_level = 0;
+        const int num_kp_levels = 1;
+        const int num_levels = 1;
+        const int num_octaves = 1;
+        const double sigma0 = sift3d->gpyr.sigma0;
+        const double sigma_n = sift3d->gpyr.sigma_n;
+
+        // Verify inputs
+        if (verify_keys(kp, im, NULL))
+                return SIFT3D_FAILURE;
+
+        // Initialize intermediates
+        init_Pyramid(&pyr);
+        init_Keypoint_store(&kp_base);
+
+        // Initialize the image pyramid
+        set_scales_Pyramid(sigma0, sigma_n, &pyr);
+        if (resize_Pyramid(im, first_level, num_kp_levels, num_levels,
+                first_octave, num_octaves, &pyr))
+                goto extract_raw_descriptors_quit;
+
+        // Smooth the input image, storing the result in the pyramid
+        level = SIFT3D_PYR_IM_GET(&pyr, first_octave, first_level); 
+        if (smooth_scale_raw_input(sift3d, im, level))
+                goto extract_raw_descriptors_quit;
+
+        // Allocate a temporary copy of the keypoints
+        if (resize_Keypoint_store(&kp_base, kp->slab.num))
+                goto extract_raw_descriptors_quit;
+
+        // Convert keypoints to the base scale and octave
+        for (i = 0; i < kp->slab.num; i++) {
+
+                const Keypoint *const src = kp->buf + i;
+                Keypoint *const dst = kp_base.buf + i; 
+
+                if (keypoint2base(src, dst))
+                        goto extract_raw_descriptors_quit;
+        }
+
+        // Extract the descriptors
+        if (_SIFT3D_extract_descriptors(sift3d, &pyr, &kp_base, desc, NULL))
+                goto extract_raw_descriptors_quit;
+
+        // Clean up
+        cleanup_Pyramid(&pyr);
+        cleanup_Keypoint_store(&kp_base);
+
+        return SIFT3D_SUCCESS;
+
+extract_raw_descriptors_quit:
+        cleanup_Pyramid(&pyr);
+        cleanup_Keypoint_store(&kp_base);
+        return SIFT3D_FAILURE;
+}
+
+/* Helper funciton to extract SIFT3D descriptors from a list of keypoints and 
+ * an image. Called by SIFT3D_extract_descriptors,
+ * SIFT3D_extract_raw_descriptors and SIFT3D_extract_quant_descriptors.
+ *
+ * parameters:
+ *  sift3d - (initialized) struct defining the algorithm parameters
+ *  gpyr - A Gaussian Scale-Space pyramid containing the image data
+ *  kp - keypoint list populated by a feature detector 
+ *  desc - (initialized) struct to hold the descriptors, or NULL
+ *  quant - (initialized) struct to hold quantized descriptors, or NULL. 
+ *      Exactly one of desc and quant must be provided. */
+static int _SIFT3D_extract_descriptors(SIFT3D *const sift3d, 
+        const Pyramid *const gpyr, const Keypoint_store *const kp, 
+        SIFT3D_Descriptor_store *const desc, SIFT3D_Quant_store *const quant) {
+
+	int i, ret;
+
+	const Image *const first_level = 
+                SIFT3D_PYR_IM_GET(gpyr, gpyr->first_octave, gpyr->first_level);
+
+	const int num = kp->slab.num;
+        const int use_grads = gpyr == &sift3d->gpyr;
+        const int *const roi_start = use_grads && sift3d->roi_active ?
+                sift3d->roi_start : NULL;
+        const int *const dims = roi_start != NULL ? sift3d->roi_dims :
+                SIFT3D_IM_GET_DIMS(first_level);
+
+	// Initialize the metadata and resize the descriptor store
+        if (desc != NULL) {
+	        desc->nx = dims[0];	
+	        desc->ny = dims[1];	
+	        desc->nz = dims[2];	
+                if (resize_SIFT3D_Descriptor_store(desc, num))
+                        return SIFT3D_FAILURE;
+        } else {
+	        quant->nx = dims[0];	
+	        quant->ny = dims[1];	
+	        quant->nz = dims[2];	
+                if (resize_SIFT3D_Quant_store(quant, num))
+                        return SIFT3D_FAILURE;
+        }
+
+#ifdef SIFT3D_WITH_OPENCL
+        // Use the pyramid on the device, if it is there
+        if (gpyr == &sift3d->gpyr && sift3d->pyr_on_device)
+                return extract_descriptors_device(sift3d, kp, desc, quant);
+#endif
+
+        // Compute the gradients of the levels holding keypoints, if enabled.
+        // Other pyramids, as in SIFT3D_extract_raw_descriptors, are not 
+        // cached.
+        if (use_grads && prepare_grads_SIFT3D(sift3d, kp))
+                return SIFT3D_FAILURE;
+
+        // Extract the descriptors
+        ret = SIFT3D_SUCCESS;
+#pragma omp parallel for num_threads(SIFT3D_team_size())
+	for (i = 0; i < num; i++) {
+
+                SIFT3D_Descriptor temp;
+                Keypoint key;
+
+		SIFT3D_Descriptor *const descrip = desc == NULL ? &temp : 
+                        desc->buf + i;
+
+                // Translate the keypoint to the region of the pyramid
+                key = kp->buf[i];
+                if (roi_start != NULL) {
+                        key.xd -= (double) (roi_start[0] >> key.o);
+                        key.yd -= (double) (roi_start[1] >> key.o);
+                        key.zd -= (double) (roi_start[2] >> key.o);
+                }
+
+		if (extract_descrip(sift3d, SIFT3D_PYR_IM_GET(gpyr, key.o, 
+                        key.s), use_grads ? get_grads_SIFT3D(sift3d, key.o, 
+                        key.s) : NULL, &key, descrip)) {
+                        ret = SIFT3D_FAILURE;
+                        continue;
+                }
+                if (roi_start != NULL) {
+                        descrip->xd += (double) roi_start[0];
+                        descrip->yd += (double) roi_start[1];
+                        descrip->zd += (double) roi_start[2];
+                }
+
+                // Optionally quantize the result
+                if (desc == NULL)
+                        quantize_desc(descrip, quant, i);
+	}	
+
+	return ret;
+}
+
+/* L2-normalize a histogram */
+static void normalize_hist(Hist *const hist) {
+
+        double norm;
+        float norm_inv;
+        int a, p;
+
+        norm = 0.0;
+        HIST_LOOP_START(a, p)
+                const float el = HIST_GET(hist, a, p);
+                norm += (double) el * el;
+        HIST_LOOP_END
+
+        norm = sqrt(norm) + DBL_EPSILON;
+        norm_inv = 1.0f / norm; 
+
+        HIST_LOOP_START(a, p)
+                 HIST_GET(hist, a, p) *= norm_inv; 
+        HIST_LOOP_END 
+}
+
+/* Dense gradient histogram postprocessing steps */
+static void postproc_Hist(Hist *const hist, const float norm) {
+
+        int a, p;
+
+        const float hist_trunc = trunc_thresh * DESC_NUMEL / HIST_NUMEL;
+
+	// Histogram refinement steps
+	refine_Hist(hist);
+
+	// Normalize the descriptor
+	normalize_hist(hist);
+
+	// Truncate
+	HIST_LOOP_START(a, p)
+		HIST_GET(hist, a, p) = SIFT3D_MIN(HIST_GET(hist, a, p), 
+					   hist_trunc);
+	HIST_LOOP_END
+
+	// Normalize again
+	normalize_hist(hist);
+
+        // Convert to the desired norm
+        HIST_LOOP_START(a, p)
+                HIST_GET(hist, a, p) *= norm;
+        HIST_LOOP_END
+}
+
+/* Helper routine to extract a single SIFT3D histogram, with rotation. 
+ *
+ * Parameters:
+ *   -sift3d: Stores the histogram geometry.
+ *   -grad: The gradient image, from dense_grad_tensor.
+ *   -x, y, z: The window center.
+ *   -offsets, num_offsets: The window, from make_dense_window.
+ *   -R: The [3x3] rotation matrix of the window, of type float.
+ *   -hist: The output histogram. */
+static int extract_dense_descrip_rotate(const SIFT3D *const sift3d, 
+           const Image *const grad, const int x, const int y, const int z, 
+           const Dense_offset *const offsets, const int num_offsets,
+           const Mat_rm *const R, Hist *const hist) {
+
+        float buf[IM_NDIMS * IM_NDIMS];
+        Mat_rm Rt;
+	Cvec bary;
+	int i, bin;
+
+        const Mesh *const mesh = &sift3d->mesh;
+
+        // Invert the rotation matrix
+        if (init_Mat_rm_p(&Rt, buf, IM_NDIMS, IM_NDIMS, SIFT3D_FLOAT, 
+		SIFT3D_FALSE) ||
+                transpose_Mat_rm(R, &Rt))
+                return SIFT3D_FAILURE;
+
+	// Zero the descriptor
+        hist_zero(hist);
+
+	// Iterate over the window
+        for (i = 0; i < num_offsets; i++) {
+
+                Cvec vgrad, grad_rot;
+                float mag;
+
+                const Dense_offset *const off = offsets + i;
+                const int xs = x + off->dx;
+                const int ys = y + off->dy;
+                const int zs = z + off->dz;
+
+                // Skip voxels outside the image. The gradient is zero on 
+                // the boundary, so those are skipped below.
+                if (xs < 0 || ys < 0 || zs < 0 || xs >= grad->nx || 
+                        ys >= grad->ny || zs >= grad->nz)
+                        continue;
+
+		// Take the gradient and rotate
+                vgrad.x = SIFT3D_IM_GET_VOX(grad, xs, ys, zs, 0);
+                vgrad.y = SIFT3D_IM_GET_VOX(grad, xs, ys, zs, 1);
+                vgrad.z = SIFT3D_IM_GET_VOX(grad, xs, ys, zs, 2);
+		SIFT3D_MUL_MAT_RM_CVEC(&Rt, &vgrad, &grad_rot);
+
+                // Get the index of the intersecting face
+                if (icos_hist_bin(sift3d, &grad_rot, &bary, &bin))
+                        continue;
+
+                // Get the weighted magnitude of the vector
+                mag = SIFT3D_IM_GET_VOX(grad, xs, ys, zs, 3) * off->weight;
+
+                // Interpolate over three vertices
+                MESH_HIST_GET(mesh, hist, bin, 0) += mag * bary.x;
+                MESH_HIST_GET(mesh, hist, bin, 1) += mag * bary.y;
+                MESH_HIST_GET(mesh, hist, bin, 2) += mag * bary.z;
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper function to list the voxel offsets within a sphere, with their
+ * Gaussian weights, in the physical units of im. This is the window 
+ * traversed by IM_LOOP_SPHERE_START, centered at a voxel.
+ *
+ * Parameters:
+ *   -im: The image, which defines the units.
+ *   -sigma: The Gaussian window parameter.
+ *   -radius: The radius of the sphere.
+ *   -offsets: The output array, which must be freed by the caller.
+ *   -num: The number of elements in offsets.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int make_dense_window(const Image *const im, const double sigma, 
+        const double radius, Dense_offset **const offsets, int *const num) {
+
+        int dx, dy, dz, n;
+
+        const float uxf = (float) im->ux;
+        const float uyf = (float) im->uy;
+        const float uzf = (float) im->uz;
+        const float rad = (float) radius;
+        const int rx = (int) ceilf(rad / uxf);
+        const int ry = (int) ceilf(rad / uyf);
+        const int rz = (int) ceilf(rad / uzf);
+        const size_t max_num = (size_t) (2 * rx + 1) * (2 * ry + 1) * 
+                (2 * rz + 1);
+
+        if ((*offsets = malloc(max_num * sizeof(Dense_offset))) == NULL)
+                return SIFT3D_FAILURE;
+
+        n = 0;
+        for (dz = -rz; dz <= rz; dz++) {
+        for (dy = -ry; dy <= ry; dy++) {
+        for (dx = -rx; dx <= rx; dx++) {
+
+                Cvec vdisp;
+                float sq_dist;
+
+                Dense_offset *const off = *offsets + n;
+
+                vdisp.x = (float) dx * uxf;
+                vdisp.y = (float) dy * uyf;
+                vdisp.z = (float) dz * uzf;
+                sq_dist = SIFT3D_CVEC_L2_NORM_SQ(&vdisp);
+                if (sq_dist > rad * rad)
+                        continue;
+
+                off->dx = dx;
+                off->dy = dy;
+                off->dz = dz;
+                off->weight = expf(-0.5f * sq_dist / (sigma * sigma));
+                n++;
+        }
+        }
+        }
+
+        *num = n;
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper function for extract_dense_descriptors_rotate, computing the
+ * gradient of every voxel, and the windowed structure tensor used for
+ * orientation assignment.
+ *
+ * Parameters:
+ *   -sift3d: Stores the algorithm parameters.
+ *   -in: The input image.
+ *   -grad: The output gradient image, with channels [dx, dy, dz, magnitude],
+ *      in physical units. The gradient is zero on the image boundary, which
+ *      the sphere windows of the keypoint routines exclude.
+ *   -tensor: The output structure tensor image, with channels [xx, xy, xz, 
+ *      yy, yz, zz, x, y, z]. The first six are the upper triangle of the 
+ *      tensor, the last three are the window gradient, as in assign_eig_ori.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int dense_grad_tensor(const SIFT3D *const sift3d, 
+        const Image *const in, Image *const grad, Image *const tensor) {
+
+        Image outer;
+        Gauss_filter gauss;
+        double scale;
+        int x, y, z, c;
+
+        const double sigma = sift3d->gpyr.sigma0 * ori_sig_fctr;
+        const double unit = 1.0;
+
+        // Allocate the gradient and outer product images
+        init_im(&outer);
+        if (im_copy_dims(in, grad) || im_copy_dims(in, &outer))
+                return SIFT3D_FAILURE;
+        grad->nc = 4;
+        outer.nc = 9;
+        im_default_stride(grad);
+        im_default_stride(&outer);
+        if (im_resize(grad) || im_resize(&outer))
+                goto dense_grad_tensor_quit;
+        im_zero(grad);
+        im_zero(&outer);
+
+        // Compute the gradients and their outer products
+#pragma omp parallel for private(x) private(y) num_threads(SIFT3D_team_size())
+        SIFT3D_IM_LOOP_LIMITED_START(in, x, y, z, 1, in->nx - 2, 1, 
+                in->ny - 2, 1, in->nz - 2)
+
+                Cvec vd;
+
+                IM_GET_GRAD_ISO(in, x, y, z, 0, &vd);
+
+                SIFT3D_IM_GET_VOX(grad, x, y, z, 0) = vd.x;
+                SIFT3D_IM_GET_VOX(grad, x, y, z, 1) = vd.y;
+                SIFT3D_IM_GET_VOX(grad, x, y, z, 2) = vd.z;
+                SIFT3D_IM_GET_VOX(grad, x, y, z, 3) = 
+                        SIFT3D_CVEC_L2_NORM(&vd);
+
+                SIFT3D_IM_GET_VOX(&outer, x, y, z, 0) = vd.x * vd.x;
+                SIFT3D_IM_GET_VOX(&outer, x, y, z, 1) = vd.x * vd.y;
+                SIFT3D_IM_GET_VOX(&outer, x, y, z, 2) = vd.x * vd.z;
+                SIFT3D_IM_GET_VOX(&outer, x, y, z, 3) = vd.y * vd.y;
+                SIFT3D_IM_GET_VOX(&outer, x, y, z, 4) = vd.y * vd.z;
+                SIFT3D_IM_GET_VOX(&outer, x, y, z, 5) = vd.z * vd.z;
+                SIFT3D_IM_GET_VOX(&outer, x, y, z, 6) = vd.x;
+                SIFT3D_IM_GET_VOX(&outer, x, y, z, 7) = vd.y;
+                SIFT3D_IM_GET_VOX(&outer, x, y, z, 8) = vd.z;
+
+        SIFT3D_IM_LOOP_END
+
+        // Window with a separable Gaussian, in place of the sphere window of
+        // assign_eig_ori
+        if (init_Gauss_filter(&gauss, sigma, 3))
+                goto dense_grad_tensor_quit;
+        if (apply_Sep_FIR_filter(&outer, tensor, &gauss.f, unit)) {
+                cleanup_Gauss_filter(&gauss);
+                goto dense_grad_tensor_quit;
+        }
+        cleanup_Gauss_filter(&gauss);
+        im_free(&outer);
+
+        // The filter is normalized, while the sphere window is not. Restore
+        // the scale of the window sum, to which ori_grad_thresh applies.
+        scale = pow(2.0 * M_PI, 1.5) * sigma * sigma * sigma / 
+                (in->ux * in->uy * in->uz);
+#pragma omp parallel for private(x) private(y) private(c) \
+        num_threads(SIFT3D_team_size())
+        SIFT3D_IM_LOOP_START_C(tensor, x, y, z, c)
+                SIFT3D_IM_GET_VOX(tensor, x, y, z, c) *= (float) scale;
+        SIFT3D_IM_LOOP_END_C
+
+        return SIFT3D_SUCCESS;
+
+dense_grad_tensor_quit:
+        im_free(&outer);
+        return SIFT3D_FAILURE;
+}
+
+/* Get a descriptor with a single histogram at each voxel of an image.
+ * The result is an image with HIST_NUMEL channels, where each channel is a
+ * bin of the histogram.
+ *
+ * Parameters:
+ * -sift3d Stores the algorithm parameters.
+ * -in The input image.
+ * -desc The output image of descriptors.
+ */
+int SIFT3D_extract_dense_descriptors(SIFT3D *const sift3d, 
+        const Image *const in, Image *const desc) {
+
+        int ret;
+
+        const int num_threads = push_num_threads(sift3d);
+        ret = _SIFT3D_extract_dense_descriptors(sift3d, in, desc);
+        SIFT3D_set_num_threads(num_threads);
+
+        return ret;
+}
+
+/* Helper function for SIFT3D_extract_dense_descriptors, using the thread count
+ * of the calling thread. */
+static int _SIFT3D_extract_dense_descriptors(SIFT3D *const sift3d, 
+        const Image *const in, Image *const desc) {
+
+        int (*extract_fun)(SIFT3D *const, const Image *const, Image *const);
+        Image in_smooth;
+
+        // Verify inputs
+        if (in->nc != 1) {
+                SIFT3D_ERR("SIFT3D_extract_dense_descriptors: invalid "
+                        "number of channels: %d. This function only supports "
+                        "single-channel images. \n", in->nc);
+                return SIFT3D_FAILURE;
+        }
+        if (verify_mask_SIFT3D(sift3d, in))
+                return SIFT3D_FAILURE;
+
+        // Select the appropriate subroutine
+        extract_fun = sift3d->dense_rotate ? 
+                extract_dense_descriptors_rotate :
+                extract_dense_descriptors_no_rotate;
+
+        // Resize the output image
+        memcpy(SIFT3D_IM_GET_DIMS(desc), SIFT3D_IM_GET_DIMS(in), 
+                IM_NDIMS * sizeof(int));
+        desc->nc = HIST_NUMEL;
+        im_default_stride(desc);
+        if (im_resize(desc))
+                return SIFT3D_FAILURE;
+
+        // Intialize intermediates
+        init_im(&in_smooth);
+
+        //TODO: Interpolate to be isotropic
+
+        // Smooth and scale the input image
+        if (smooth_scale_raw_input(sift3d, in, &in_smooth))
+                goto extract_dense_quit;
+
+        // Extract the descriptors
+        if (extract_fun(sift3d, &in_smooth, desc))
+                goto extract_dense_quit;
+
+        // Post-process the descriptors
+        postproc_dense(in, sift3d->mask, desc, 0, desc->nz);
+
+        // TODO transform back to original space
+
+        // Clean up
+        im_free(&in_smooth);
+
+        return SIFT3D_SUCCESS;
+
+extract_dense_quit:
+        im_free(&in_smooth);
+        return SIFT3D_FAILURE;
+}
+
+/* Helper function to post-process the planes [z_start, z_end) of dense 
+ * descriptors, zeroing the background of the mask, if not NULL. in and mask
+ * have the same dimensions as desc. */
+static void postproc_dense(const Image *const in, const Image *const mask,
+        Image *const desc, const int z_start, const int z_end) {
+
+        int x, y, z;
+
+#pragma omp parallel for private(x) private(y) num_threads(SIFT3D_team_size())
+        SIFT3D_IM_LOOP_LIMITED_START(desc, x, y, z, 0, desc->nx - 1, 0, 
+                desc->ny - 1, z_start, z_end - 1)
+
+                Hist hist;
+
+                // Get the image intensity at this voxel 
+                const float val = SIFT3D_IM_GET_VOX_F(in, x, y, z, 0);
+
+                // Zero the background of the mask
+                if (mask != NULL && 
+                        SIFT3D_IM_GET_VOX(mask, x, y, z, 0) == 0.0f) {
+                        hist_zero(&hist);
+                        hist2vox(&hist, desc, x, y, z);
+                        continue;
+                }
+
+                // Copy to a Hist
+                vox2hist(desc, x, y, z, &hist);
+
+                // Post-process
+                postproc_Hist(&hist, val);
+
+                // Copy back to the image
+                hist2vox(&hist, desc, x, y, z);
+
+        SIFT3D_IM_LOOP_END
+}
+
+/* Helper function to compute the number of z-planes which must surround each
+ * slab of SIFT3D_extract_dense_descriptors_stream in order to reproduce the
+ * results of processing the whole image. The halo covers the smoothing of
+ * the input, the gradient, and the descriptor and orientation windows. */
+static int get_dense_halo(const SIFT3D *const sift3d, const Image *const in,
+        int *const halo) {
+
+        Gauss_filter gauss;
+        int reach_smooth, reach_win;
+
+        const double sigma0 = sift3d->gpyr.sigma0;
+        const double desc_sigma = sigma0 * desc_sig_fctr / NHIST_PER_DIM;
+        const double uz = in->uz;
+
+        // The smoothing filter, with taps spaced 1 / uz planes apart
+        if (init_Gauss_incremental_filter(&gauss, sift3d->gpyr.sigma_n, 
+                sigma0, IM_NDIMS))
+                return SIFT3D_FAILURE;
+        reach_smooth = (int) ceil((gauss.f.width / 2) / uz) + 1;
+        cleanup_Gauss_filter(&gauss);
+
+        // The window of each descriptor. Without rotation, the histograms
+        // are filtered in the default units of the output image.
+        if (init_Gauss_filter(&gauss, sift3d->dense_rotate ? 
+                sigma0 * ori_sig_fctr : desc_sigma, 3))
+                return SIFT3D_FAILURE;
+        reach_win = (int) ceil((gauss.f.width / 2) / 
+                (sift3d->dense_rotate ? uz : 1.0)) + 1;
+        cleanup_Gauss_filter(&gauss);
+        if (sift3d->dense_rotate)
+                reach_win = SIFT3D_MAX(reach_win, 
+                        (int) ceil(desc_rad_fctr * desc_sigma / uz) + 1);
+
+        // The gradient is zero on the outer planes, which are mirrored
+        *halo = reach_smooth + 1 + reach_win;
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper function to copy the planes [z_start, z_end) of src to dst, which
+ * must be initialized. */
+static int crop_planes(const Image *const src, const int z_start, 
+        const int z_end, Image *const dst) {
+
+        int x, y, z, c;
+
+        memcpy(SIFT3D_IM_GET_DIMS(dst), SIFT3D_IM_GET_DIMS(src), 
+                IM_NDIMS * sizeof(int));
+        memcpy(SIFT3D_IM_GET_UNITS(dst), SIFT3D_IM_GET_UNITS(src), 
+                IM_NDIMS * sizeof(double));
+        dst->nz = z_end - z_start;
+        dst->nc = src->nc;
+        im_default_stride(dst);
+        if (im_resize(dst))
+                return SIFT3D_FAILURE;
+
+        SIFT3D_IM_LOOP_START_C(dst, x, y, z, c)
+                SIFT3D_IM_GET_VOX(dst, x, y, z, c) = 
+                        SIFT3D_IM_GET_VOX_F(src, x, y, z + z_start, c);
+        SIFT3D_IM_LOOP_END_C
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Extract dense descriptors in slabs of z-planes, passing each slab to a 
+ * sink instead of storing the whole output. The results are identical to 
+ * those of SIFT3D_extract_dense_descriptors.
+ *
+ * Each slab is processed with a halo of planes covering the support of the 
+ * filters, so the memory required is proportional to the slab size plus 
+ * the halo, rather than the whole image. Since the input is scaled by its 
+ * maximum after smoothing, each slab is smoothed twice: once to find the 
+ * maximum, and again to extract the descriptors.
+ *
+ * Parameters:
+ * -sift3d Stores the algorithm parameters.
+ * -in The input image.
+ * -slab_size The number of z-planes in each slab. If not positive, the 
+ *      whole image is processed as one slab.
+ * -sink Receives the slabs, in order of increasing z. If it fails, 
+ *      extraction stops.
+ * -arg Passed to sink.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int SIFT3D_extract_dense_descriptors_stream(SIFT3D *const sift3d,
+        const Image *const in, const int slab_size, 
+        const SIFT3D_dense_sink sink, void *const arg) {
+
+        int ret;
+
+        const int num_threads = push_num_threads(sift3d);
+        ret = _SIFT3D_extract_dense_descriptors_stream(sift3d, in, slab_size,
+                sink, arg);
+        SIFT3D_set_num_threads(num_threads);
+
+        return ret;
+}
+
+/* Helper function for SIFT3D_extract_dense_descriptors_stream, using the
+ * thread count of the calling thread. */
+static int _SIFT3D_extract_dense_descriptors_stream(SIFT3D *const sift3d,
+        const Image *const in, const int slab_size, 
+        const SIFT3D_dense_sink sink, void *const arg) {
+
+        int (*extract_fun)(SIFT3D *const, const Image *const, Image *const);
+        Image crop, in_smooth, desc, mask_crop, slab;
+        float max;
+        int pass, halo, z0, x, y, z, c;
+
+        const Image *const mask = sift3d->mask;
+        const int size = slab_size > 0 ? SIFT3D_MIN(slab_size, in->nz) : 
+                in->nz;
+
+        // Verify inputs
+        if (in->nc != 1) {
+                SIFT3D_ERR("SIFT3D_extract_dense_descriptors_stream: invalid "
+                        "number of channels: %d. This function only supports "
+                        "single-channel images. \n", in->nc);
+                return SIFT3D_FAILURE;
+        }
+        if (verify_mask_SIFT3D(sift3d, in))
+                return SIFT3D_FAILURE;
+
+        // Select the appropriate subroutine
+        extract_fun = sift3d->dense_rotate ? 
+                extract_dense_descriptors_rotate :
+                extract_dense_descriptors_no_rotate;
+
+        // Get the halo of each slab
+        if (get_dense_halo(sift3d, in, &halo))
+                return SIFT3D_FAILURE;
+
+        // Initialize intermediates
+        init_im(&crop);
+        init_im(&in_smooth);
+        init_im(&desc);
+        init_im(&mask_crop);
+        if (mask != NULL)
+                sift3d->mask = &mask_crop;
+
+        // The first pass finds the maximum of the smoothed input, the 
+        // second extracts the descriptors
+        max = 0.0f;
+        for (pass = 0; pass < 2; pass++) {
+        for (z0 = 0; z0 < in->nz; z0 += size) {
+
+                const int z1 = SIFT3D_MIN(z0 + size, in->nz);
+                const int start = SIFT3D_MAX(z0 - halo, 0);
+                const int end = SIFT3D_MIN(z1 + halo, in->nz);
+                const int core_start = z0 - start;
+                const int core_end = z1 - start;
+
+                // Smooth the slab and its halo
+                if (crop_planes(in, start, end, &crop) ||
+                        smooth_raw_input(sift3d, &crop, &in_smooth))
+                        goto extract_dense_stream_quit;
+
+                // Take the maximum over the planes of the slab
+                if (pass == 0) {
+                        SIFT3D_IM_LOOP_LIMITED_START(&in_smooth, x, y, z, 0, 
+                                in_smooth.nx - 1, 0, in_smooth.ny - 1, 
+                                core_start, core_end - 1)
+                                max = SIFT3D_MAX(max, fabsf(SIFT3D_IM_GET_VOX(
+                                        &in_smooth, x, y, z, 0)));
+                        SIFT3D_IM_LOOP_END
+                        continue;
+                }
+
+                // Scale to [-1, 1], as in smooth_scale_raw_input
+                if (max != 0.0f) {
+                        SIFT3D_IM_LOOP_START_C(&in_smooth, x, y, z, c)
+                                SIFT3D_IM_GET_VOX(&in_smooth, x, y, z, c) /= 
+                                        max;
+                        SIFT3D_IM_LOOP_END_C
+                }
+
+                // Crop the mask
+                if (mask != NULL && crop_planes(mask, start, end, &mask_crop))
+                        goto extract_dense_stream_quit;
+
+                // Extract and post-process the descriptors
+                memcpy(SIFT3D_IM_GET_DIMS(&desc), 
+                        SIFT3D_IM_GET_DIMS(&in_smooth), IM_NDIMS * sizeof(int));
+                desc.nc = HIST_NUMEL;
+                im_default_stride(&desc);
+                if (im_resize(&desc) || 
+                        extract_fun(sift3d, &in_smooth, &desc))
+                        goto extract_dense_stream_quit;
+                postproc_dense(&crop, sift3d->mask, &desc, core_start, 
+                        core_end);
+
+                // Pass a view of the slab to the sink
+                slab = desc;
+                slab.data = desc.data + (size_t) core_start * desc.zs;
+                slab.nz = z1 - z0;
+                slab.size = slab.capacity = (size_t) slab.nz * desc.zs;
+                slab.cl_valid = SIFT3D_FALSE;
+                if (sink(arg, &slab, z0))
+                        goto extract_dense_stream_quit;
+        }}
+
+        // Clean up
+        sift3d->mask = mask;
+        im_free(&crop);
+        im_free(&in_smooth);
+        im_free(&desc);
+        im_free(&mask_crop);
+
+        return SIFT3D_SUCCESS;
+
+extract_dense_stream_quit:
+        sift3d->mask = mask;
+        im_free(&crop);
+        im_free(&in_smooth);
+        im_free(&desc);
+        im_free(&mask_crop);
+        return SIFT3D_FAILURE;
+}
+
+/* Helper function for SIFT3D_extract_dense_descriptors, without rotation 
+ * invariance. This function is much faster than its rotation-invariant 
+ * counterpart because histogram bins are pre-computed. */
+static int extract_dense_descriptors_no_rotate(SIFT3D *const sift3d,
+        const Image *const in, Image *const desc) {
+
+        Image temp; 
+        Gauss_filter gauss;
+        Cvec *grads, *barys;
+        int *bins;
+        int x, y, z;
+
+        const int x_start = 1;
+        const int y_start = 1;
+        const int z_start = 1;
+        const int x_end = in->nx - 2;
+        const int y_end = in->ny - 2;
+        const int z_end = in->nz - 2;
+
+        Mesh * const mesh = &sift3d->mesh;
+        const double sigma_win = sift3d->gpyr.sigma0 * desc_sig_fctr / 
+                                 NHIST_PER_DIM;
+        const double unit = 1.0;
+        const int row_len = SIFT3D_MAX(x_end - x_start + 1, 0);
+
+        // Initialize the intermediate image
+        init_im(&temp);
+        if (im_copy_dims(desc, &temp))
+                return SIFT3D_FAILURE;
+
+        // Initialize the filter
+        if (init_Gauss_filter(&gauss, sigma_win, 3)) {
+                im_free(&temp);
+                return SIFT3D_FAILURE;
+        }
+
+        // Allocate the gradients and bins of a row
+        grads = (Cvec *) malloc((row_len + 1) * sizeof(Cvec));
+        barys = (Cvec *) malloc((row_len + 1) * sizeof(Cvec));
+        bins = (int *) malloc((row_len + 1) * sizeof(int));
+        if (grads == NULL || barys == NULL || bins == NULL)
+                goto dense_extract_quit;
+
+        // Initialize the descriptors for each voxel, binning each row at once
+        im_zero(&temp);
+        for (z = z_start; z <= z_end; z++) {
+        for (y = y_start; y <= y_end; y++) {
+
+                // Take the gradients
+                for (x = x_start; x <= x_end; x++) {
+		        IM_GET_GRAD_ISO(in, x, y, z, 0, grads + x - x_start);
+                }
+
+                // Get the index of each intersecting face
+                icos_hist_bin_batch(sift3d, grads, row_len, barys, bins);
+
+                // Initialize each vertex
+                for (x = x_start; x <= x_end; x++) {
+
+                        const Cvec *const bary = barys + x - x_start;
+                        const int bin = bins[x - x_start];
+
+                        if (bin < 0)
+                                continue;
+
+                        SIFT3D_IM_GET_VOX(&temp, x, y, z, 
+                                MESH_GET_IDX(mesh, bin, 0)) = bary->x;
+                        SIFT3D_IM_GET_VOX(&temp, x, y, z, 
+                                MESH_GET_IDX(mesh, bin, 1)) = bary->y;
+                        SIFT3D_IM_GET_VOX(&temp, x, y, z, 
+                                MESH_GET_IDX(mesh, bin, 2)) = bary->z;
+                }
+        }}
+
+        // Filter the descriptors
+	if (apply_Sep_FIR_filter(&temp, desc, &gauss.f, unit))
+                goto dense_extract_quit;
+
+        // Clean up
+        im_free(&temp);
+        cleanup_Gauss_filter(&gauss);
+        free(grads);
+        free(barys);
+        free(bins);
+
+        return SIFT3D_SUCCESS;
+
+dense_extract_quit:
+        im_free(&temp);
+        cleanup_Gauss_filter(&gauss);
+        if (grads != NULL)
+                free(grads);
+        if (barys != NULL)
+                free(barys);
+        if (bins != NULL)
+                free(bins);
+        return SIFT3D_FAILURE;
+}
+
+/* Copy a voxel to a Hist. Does no bounds checking. */
+static void vox2hist(const Image *const im, const int x, const int y,
+        const int z, Hist *const hist) {
+
+        int c;
+
+        for (c = 0; c < HIST_NUMEL; c++) {
+                hist->bins[c] = SIFT3D_IM_GET_VOX(im, x, y, z, c);
+        }
+}
+
+/* Copy a Hist to a voxel. Does no bounds checking. */
+static void hist2vox(Hist *const hist, const Image *const im, const int x, 
+        const int y, const int z) {
+
+        int c;
+        
+        for (c = 0; c < HIST_NUMEL; c++) {
+                SIFT3D_IM_GET_VOX(im, x, y, z, c) = hist->bins[c];
+        }
+}
+
+/* As in extract_dense_descrip, but with rotation invariance. The gradients
+ * and the structure tensor are computed once for the whole image, and the 
+ * voxels are processed in parallel. */
+static int extract_dense_descriptors_rotate(SIFT3D *const sift3d,
+        const Image *const in, Image *const desc) {
+
+        Image grad, tensor;
+        Dense_offset *offsets;
+        int z, num_offsets, ret;
+
+        const double desc_sigma = sift3d->gpyr.sigma0 * 
+                desc_sig_fctr / NHIST_PER_DIM;
+        const double corner_thresh = sift3d->corner_thresh;
+        const Image *const mask = sift3d->mask;
+
+        // Initialize intermediates
+        init_im(&grad);
+        init_im(&tensor);
+        offsets = NULL;
+
+        // Compute the gradients, orientation windows and descriptor window
+        if (dense_grad_tensor(sift3d, in, &grad, &tensor) ||
+                make_dense_window(in, desc_sigma, desc_rad_fctr * desc_sigma,
+                        &offsets, &num_offsets))
+                goto dense_rotate_quit;
+
+        // Iterate over each voxel
+        ret = SIFT3D_SUCCESS;
+#pragma omp parallel num_threads(SIFT3D_team_size())
+{
+        Eig_ori_batch batch;
+        Mat_rm R, Id;
+        int *xs;
+        int i, y, have_batch, have_R, have_Id;
+
+        // Initialize the per-thread matrices, and the tensors of a row. These
+        // can be cleaned up even if their initialization fails, so all of 
+        // them are attempted.
+        have_batch = !init_Eig_ori_batch(&batch, in->nx);
+        xs = malloc(in->nx * sizeof(int));
+        have_R = !init_Mat_rm(&R, 3, 3, SIFT3D_FLOAT, SIFT3D_TRUE);
+        have_Id = !init_Mat_rm(&Id, 3, 3, SIFT3D_FLOAT, SIFT3D_TRUE);
+        if (have_batch && xs != NULL && have_R && have_Id) {
+                for (i = 0; i < 3; i++) {       
+                        SIFT3D_MAT_RM_GET(&Id, i, i, float) = 1.0f;
+                }
+        } else {
+#pragma omp atomic write
+                ret = SIFT3D_FAILURE;
+        }
+
+#pragma omp for schedule(dynamic)
+        for (z = 0; z < in->nz; z++) {
+                for (y = 0; y < in->ny; y++) {
+
+                        int x, j, num, status;
+
+#pragma omp atomic read
+                        status = ret;
+                        if (status == SIFT3D_FAILURE)
+                                break;
+
+                        // Read the structure tensors of the row, skipping 
+                        // the background of the mask, which is zeroed in 
+                        // post-processing
+                        num = 0;
+                        for (x = 0; x < in->nx; x++) {
+
+                                double *const a = batch.tensors + 6 * num;
+                                Cvec *const vd_win = batch.vd_win + num;
+
+                                if (mask != NULL && SIFT3D_IM_GET_VOX(mask, 
+                                        x, y, z, 0) == 0.0f)
+                                        continue;
+
+                                for (j = 0; j < 6; j++) {
+                                        a[j] = (double) SIFT3D_IM_GET_VOX(
+                                                &tensor, x, y, z, j);
+                                }
+                                vd_win->x = SIFT3D_IM_GET_VOX(&tensor, x, y, 
+                                        z, 6);
+                                vd_win->y = SIFT3D_IM_GET_VOX(&tensor, x, y, 
+                                        z, 7);
+                                vd_win->z = SIFT3D_IM_GET_VOX(&tensor, x, y, 
+                                        z, 8);
+                                xs[num++] = x;
+                        }
+
+                        // Decompose the tensors together
+                        if (eigen_sym3_batch(batch.tensors, num, batch.evals,
+                                batch.evecs)) {
+#pragma omp atomic write
+                                ret = SIFT3D_FAILURE;
+                                continue;
+                        }
+
+                        for (j = 0; j < num; j++) {
+
+                                Hist hist;
+                                const Mat_rm *ori;
+                                double conf;
+
+                                const int x = xs[j];
+
+                                // Attempt to assign an orientation
+                                switch (eig_ori_assign(batch.evals + 
+                                        IM_NDIMS * j, batch.evecs + 
+                                        IM_NDIMS * IM_NDIMS * j, 
+                                        batch.vd_win + j, &R, &conf)) {
+                                case SIFT3D_SUCCESS:
+                                        // Use the orientation, if confident
+                                        ori = conf < corner_thresh ? 
+                                                &Id : &R;
+                                        break;
+                                case REJECT:
+                                        // Default to identity
+                                        ori = &Id;
+                                        break;
+                                default:
+                                        // Unexpected error
+#pragma omp atomic write
+                                        ret = SIFT3D_FAILURE;
+                                        continue;
+                                }
+
+                                // Extract the descriptor
+                                if (extract_dense_descrip_rotate(sift3d, 
+                                        &grad, x, y, z, offsets, 
+                                        num_offsets, ori, &hist)) {
+#pragma omp atomic write
+                                        ret = SIFT3D_FAILURE;
+                                        continue;
+                                }
+
+                                // Copy the descriptor to the image channels
+                                hist2vox(&hist, desc, x, y, z);
+                        }
+                }
+        }
+
+        cleanup_Mat_rm(&R);
+        cleanup_Mat_rm(&Id);
+        cleanup_Eig_ori_batch(&batch);
+        if (xs != NULL)
+                free(xs);
+}
+        if (ret)
+                goto dense_rotate_quit;
+
+        // Clean up
+        free(offsets);
+        im_free(&grad);
+        im_free(&tensor);
+        return SIFT3D_SUCCESS;
+
+dense_rotate_quit:
+        // Clean up and return an error condition 
+        if (offsets != NULL)
+                free(offsets);
+        im_free(&grad);
+        im_free(&tensor);
+        return SIFT3D_FAILURE;
+}
+
+/* Convert a keypoint store to a matrix. 
+ * Output format:
+ *  [x1 y1 z1]
+ *  |   ...  |
+ *  [xn yn zn] 
+ * 
+ * mat must be initialized. */
+int Keypoint_store_to_Mat_rm(const Keypoint_store *const kp, Mat_rm *const mat) {
+
+    int i;
+
+    const int num = kp->slab.num;
+
+    // Resize mat
+    mat->num_rows = num;
+    mat->num_cols = IM_NDIMS;
+    mat->type = SIFT3D_DOUBLE;
+    if (resize_Mat_rm(mat))
+	return SIFT3D_FAILURE;
+
+    // Build the matrix
+    for (i = 0; i < num; i++) {
+
+        const Keypoint *const key = kp->buf + i;
+
+        // Adjust the coordinates to the base octave
+        const double coord_factor = ldexp(1.0, key->o);
+
+	SIFT3D_MAT_RM_GET(mat, i, 0, double) = coord_factor * key->xd;
+	SIFT3D_MAT_RM_GET(mat, i, 1, double) = coord_factor * key->yd;
+	SIFT3D_MAT_RM_GET(mat, i, 2, double) = coord_factor * key->zd;
+    }
+
+    return SIFT3D_SUCCESS;
+}
+
+/* Convert SIFT3D desriptors to a coordinate matrix. This function has the same
+ * output format as Keypoint_store_to_Mat_rm */
+int SIFT3D_Descriptor_coords_to_Mat_rm(
+        const SIFT3D_Descriptor_store *const store, 
+        Mat_rm *const mat) {
+
+        int i;
+
+	const int num_rows = store->num;
+        const int num_cols = IM_NDIMS;
+
+	// Verify inputs
+	if (num_rows < 1) {
+		printf("SIFT3D_Descriptor_coords_to_Mat_rm: invalid number of "
+		       "descriptors: %d \n", num_rows);
+		return SIFT3D_FAILURE;
+	}
+
+        // Resize the output
+        mat->type = SIFT3D_DOUBLE;
+        mat->num_rows = num_rows;
+        mat->num_cols = num_cols;
+        if (resize_Mat_rm(mat))
+                return SIFT3D_FAILURE;
+
+        // Copy the data
+        for (i = 0; i < num_rows; i++) {
+
+		const SIFT3D_Descriptor *const desc = store->buf + i;
+
+                SIFT3D_MAT_RM_GET(mat, i, 0, double) = desc->xd;
+                SIFT3D_MAT_RM_GET(mat, i, 1, double) = desc->yd;
+                SIFT3D_MAT_RM_GET(mat, i, 2, double) = desc->zd;
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Convert SIFT3D descriptors to a matrix.
+ *
+ * Output format:
+ *  [x y z el0 el1 ... el767]
+ * Each row is a feature descriptor. [x y z] are the coordinates in image
+ * space, and [el0 el1 ... el767 are the 768 dimensions of the descriptor.
+ *
+ * mat must be initialized prior to calling this function. mat will be resized.
+ * The type of mat will be changed to float.
+ */
+int SIFT3D_Descriptor_store_to_Mat_rm(const SIFT3D_Descriptor_store *const store, 
+				      Mat_rm *const mat) {
+	int i, j, a, p;
+
+	const int num_rows = store->num;
+	const int num_cols = IM_NDIMS + DESC_NUMEL;
+
+	// Verify inputs
+	if (num_rows < 1) {
+		printf("SIFT3D_Descriptor_store_to_Mat_rm: invalid number of "
+		       "descriptors: %d \n", num_rows);
+		return SIFT3D_FAILURE;
+	}
+
+	// Resize inputs
+	mat->type = SIFT3D_FLOAT;
+	mat->num_rows = num_rows;
+	mat->num_cols = num_cols;
+	if (resize_Mat_rm(mat))
+		return SIFT3D_FAILURE;
+
+	// Copy the data
+	for (i = 0; i < num_rows; i++) {
+
+		const SIFT3D_Descriptor *const desc = store->buf + i;
+
+		// Copy the coordinates
+		SIFT3D_MAT_RM_GET(mat, i, 0, float) = (float) desc->xd;
+		SIFT3D_MAT_RM_GET(mat, i, 1, float) = (float) desc->yd;
+		SIFT3D_MAT_RM_GET(mat, i, 2, float) = (float) desc->zd;
+
+		// Copy the feature vector
+		for (j = 0; j < DESC_NUM_TOTAL_HIST; j++) {
+			const Hist *const hist = desc->hists + j;
+			HIST_LOOP_START(a, p)
+                                const int col = DESC_MAT_GET_COL(j, a, p);
+				SIFT3D_MAT_RM_GET(mat, i, col, float) = 
+					HIST_GET(hist, a, p);
+			HIST_LOOP_END
+		}
+	}
+
+	return SIFT3D_SUCCESS;
+}
+
+/* Convert a Mat_rm to a descriptor store. See 
+ * SIFT3D_Descriptor_store_to_Mat_rm for the input format. */
+int Mat_rm_to_SIFT3D_Descriptor_store(const Mat_rm *const mat, 
+				      SIFT3D_Descriptor_store *const store) {
+
+	int i, j, a, p;
+
+	const int num_rows = mat->num_rows;
+	const int num_cols = mat->num_cols;
+
+	// Verify inputs
+	if (num_rows < 1 || num_cols != IM_NDIMS + DESC_NUMEL) {
+		SIFT3D_ERR("Mat_rm_to_SIFT3D_Descriptor_store: invalid matrix "
+		       "dimensions: [%d X %d] \n", num_rows, num_cols);
+		return SIFT3D_FAILURE;
+	}
+        if (mat->type != SIFT3D_FLOAT) {
+		SIFT3D_ERR("Mat_rm_to_SIFT3D_Descriptor_store: matrix must "
+                        "have type SIFT3D_FLOAT");
+		return SIFT3D_FAILURE;
+        }
+
+        /* Resize the descriptor store */
+        if (resize_SIFT3D_Descriptor_store(store, num_rows))
+                return SIFT3D_FAILURE;
+
+	// Copy the data
+	for (i = 0; i < num_rows; i++) {
+
+		SIFT3D_Descriptor *const desc = store->buf + i;
+
+		// Copy the coordinates
+		desc->xd = SIFT3D_MAT_RM_GET(mat, i, 0, float);
+		desc->yd = SIFT3D_MAT_RM_GET(mat, i, 1, float);
+		desc->zd = SIFT3D_MAT_RM_GET(mat, i, 2, float);
+                desc->sd = sigma0_default;
+
+		// Copy the feature vector
+		for (j = 0; j < DESC_NUM_TOTAL_HIST; j++) {
+			Hist *const hist = desc->hists + j;
+			HIST_LOOP_START(a, p)
+                                const int col = DESC_MAT_GET_COL(j, a, p);
+				HIST_GET(hist, a, p) = 
+                                        SIFT3D_MAT_RM_GET(mat, i, col, float);
+			HIST_LOOP_END
+		}
+	}
+	
+	return SIFT3D_SUCCESS;
+}
+
+/* Convert a list of matches to matrices of point coordinates.
+ * Only valid matches will be included in the output matrices.
+ *
+ * The format of "matches" is specified in SIFT3D_nn_match.
+ *
+ * All matrices must be initialized prior to calling this function.
+ *
+ * Output format:
+ *  m x 3 matrices [x11 y11 z11] [x21 y21 z21]
+ * 		   |x12 y12 z12| |x22 y22 z22|
+ *		        ...	      ...
+ * 		   [x1N y1N z1N] [x2N y2N z2N] 
+ *
+ * Where points on corresponding rows are matches. */
+int SIFT3D_matches_to_Mat_rm(SIFT3D_Descriptor_store *d1,
+			     SIFT3D_Descriptor_store *d2,
+			     const int *const matches,
+			     Mat_rm *const match1, 
+			     Mat_rm *const match2) {
+    int i, num_matches;
+
+    const int num = d1->num;
+
+    // Resize matrices 
+    match1->num_rows = match2->num_rows = d1->num;
+    match1->num_cols = match2->num_cols = 3;
+    match1->type = match2->type = SIFT3D_DOUBLE;
+    if (resize_Mat_rm(match1) || resize_Mat_rm(match2))
+	    return SIFT3D_FAILURE;
+
+    // Populate the matrices
+    num_matches = 0;
+    for (i = 0; i < num; i++) {
+
+	    const SIFT3D_Descriptor *const desc1 = d1->buf + i;
+	    const SIFT3D_Descriptor *const desc2 = d2->buf + matches[i];
+
+	    if (matches[i] == -1)
+		    continue;
+
+	    // Save the match
+	    SIFT3D_MAT_RM_GET(match1, num_matches, 0, double) = desc1->xd; 
+	    SIFT3D_MAT_RM_GET(match1, num_matches, 1, double) = desc1->yd; 
+	    SIFT3D_MAT_RM_GET(match1, num_matches, 2, double) = desc1->zd; 
+	    SIFT3D_MAT_RM_GET(match2, num_matches, 0, double) = desc2->xd; 
+	    SIFT3D_MAT_RM_GET(match2, num_matches, 1, double) = desc2->yd; 
+	    SIFT3D_MAT_RM_GET(match2, num_matches, 2, double) = desc2->zd; 
+	    num_matches++;
+    }
+
+    // Release extra memory
+    match1->num_rows = match2->num_rows = num_matches;
+    if (resize_Mat_rm(match1) || resize_Mat_rm(match2))
+	    return SIFT3D_FAILURE;
+    
+    return SIFT3D_SUCCESS;
+}
+
+/* Perform nearest neighbor matching on two sets of 
+ * SIFT descriptors. This is SIFT3D_nn_match_ratio, without the ratios. */
+int SIFT3D_nn_match(const SIFT3D_Descriptor_store *const d1,
+		    const SIFT3D_Descriptor_store *const d2,
+		    const float nn_thresh, int **const matches) {
+        return SIFT3D_nn_match_ratio(d1, d2, nn_thresh, matches, NULL);
+}
+
+/* Perform nearest neighbor matching on two sets of 
+ * SIFT descriptors.
+ *
+ * This function will reallocate *matches. As such, *matches must be either
+ * NULL or a pointer to previously-allocated array. Upon successful exit,
+ * *matches is an array of size d1->num.
+ * 
+ * On return, the ith element of matches contains the index in d2 of the match
+ * corresponding to the ith descriptor in d1, or -1 if no match was found.
+ *
+ * If ratios is not NULL, it must be an array of d1->num elements. On return,
+ * the ith element contains the ratio of the distances to the nearest and 
+ * second-nearest neighbors of the ith descriptor in d1, a measure of the 
+ * match quality, where lower is better. Unmatched elements are set to 1.
+ *
+ * You might consider using SIFT3D_matches_to_Mat_rm to convert the matches to
+ * coordinate matrices. */
+int SIFT3D_nn_match_ratio(const SIFT3D_Descriptor_store *const d1,
+		    const SIFT3D_Descriptor_store *const d2,
+		    const float nn_thresh, int **const matches, 
+                    float *const ratios) {
+
+	int i;
+
+	const int num = d1->num;
+
+        // Verify inputs
+	if (num < 1) {
+		SIFT3D_ERR("_SIFT3D_nn_match: invalid number of "
+			"descriptors in d1: %d \n", num);
+		return SIFT3D_FAILURE;
+	}
+
+	// Resize the matches array (num cannot be zero)
+	if ((*matches = (int *) SIFT3D_safe_realloc(*matches, 
+		num * sizeof(int))) == NULL) {
+	    SIFT3D_ERR("_SIFT3D_nn_match: out of memory! \n");
+	    return SIFT3D_FAILURE;
+	}
+
+	for (i = 0; i < d1->num; i++) {
+	    // Mark -1 to signal there is no match
+	    (*matches)[i] = -1;
+	}
+
+#ifdef SIFT3D_WITH_CUDA
+        // Match on the device, if requested
+        if (match_backend == SIFT3D_BACKEND_CUDA)
+                return nn_match_cuda(d1, d2, nn_thresh, *matches, ratios);
+#endif
+	
+        // Select the descriptor comparison kernel
+        init_desc_ssd();
+
+	// Exhaustive search for matches
+#pragma omp parallel for num_threads(SIFT3D_team_size())
+	for (i = 0; i < num; i++) {
+
+                const SIFT3D_Descriptor *const desc1 = d1->buf + i;
+                int *const match = *matches + i;
+
+                float *const ratio = ratios == NULL ? NULL : ratios + i;
+
+                // Forward matching pass
+                *match = match_desc(desc1, d2, nn_thresh, ratio);
+
+                // Check for forward-backward consistency
+                if (*match >= 0 && 
+                        match_desc(d2->buf + *match, d1, nn_thresh, NULL) != 
+                        i) {
+                        *match = -1;
+                }
+
+                // Unmatched descriptors get the worst ratio
+                if (*match < 0 && ratio != NULL)
+                        *ratio = 1.0f;
+        }
+
+	return SIFT3D_SUCCESS;
+}
+
+/* Perform nearest neighbor matching on two sets of SIFT descriptors, 
+ * comparing each descriptor only to those within a distance of radius. This
+ * is SIFT3D_nn_match_bounded_ratio, without the ratios. */
+int SIFT3D_nn_match_bounded(const SIFT3D_Descriptor_store *const d1,
+        const SIFT3D_Descriptor_store *const d2, const void *const tform,
+        const double *const units, const double radius, 
+        const float nn_thresh, int **const matches) {
+        return SIFT3D_nn_match_bounded_ratio(d1, d2, tform, units, radius, 
+                nn_thresh, matches, NULL);
+}
+
+/* The same as SIFT3D_nn_match_ratio, but each descriptor is compared only to 
+ * those within a distance of radius, for images which are roughly aligned. 
+ * The descriptors of d2 are mapped to the image space of d1 by tform, or 
+ * compared in place if tform is NULL. That is the direction of the 
+ * transformations computed by register_SIFT3D, with d1 as the source. 
+ * Distances are measured in the units of d1, given by the array units of 
+ * length IM_NDIMS, or in voxels if units is NULL.
+ *
+ * The descriptors are bucketed into uniform grids with cells of about the 
+ * size of radius, so that the cost of matching is roughly linear in the 
+ * number of descriptors, rather than quadratic. A descriptor with a single 
+ * candidate in range is matched to it, as in SIFT3D_nn_match_ratio with a 
+ * store of one descriptor. 
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int SIFT3D_nn_match_bounded_ratio(const SIFT3D_Descriptor_store *const d1,
+        const SIFT3D_Descriptor_store *const d2, const void *const tform,
+        const double *const units, const double radius, 
+        const float nn_thresh, int **const matches, float *const ratios) {
+
+        Match_grid grid1, grid2;
+	int i, ret;
+
+	const int num = d1->num;
+
+        // Verify inputs
+	if (num < 1) {
+		SIFT3D_ERR("SIFT3D_nn_match_bounded_ratio: invalid number of "
+			"descriptors in d1: %d \n", num);
+		return SIFT3D_FAILURE;
+	}
+        if (!(radius > 0.0)) {
+		SIFT3D_ERR("SIFT3D_nn_match_bounded_ratio: invalid radius: "
+			"%f \n", radius);
+		return SIFT3D_FAILURE;
+        }
+
+	// Resize the matches array (num cannot be zero)
+	if ((*matches = (int *) SIFT3D_safe_realloc(*matches, 
+		num * sizeof(int))) == NULL) {
+	    SIFT3D_ERR("SIFT3D_nn_match_bounded_ratio: out of memory! \n");
+	    return SIFT3D_FAILURE;
+	}
+	for (i = 0; i < num; i++) {
+	    (*matches)[i] = -1;
+	}
+
+        // Bucket both sets of descriptors, in the space of d1
+        init_Match_grid(&grid1);
+        init_Match_grid(&grid2);
+        ret = SIFT3D_FAILURE;
+        if (build_Match_grid(d1, NULL, units, radius, &grid1) ||
+                build_Match_grid(d2, tform, units, radius, &grid2)) {
+	        SIFT3D_ERR("SIFT3D_nn_match_bounded_ratio: out of memory! \n");
+                goto nn_match_bounded_quit;
+        }
+	
+        // Select the descriptor comparison kernel
+        init_desc_ssd();
+
+	// Search the neighborhood of each descriptor
+#pragma omp parallel for schedule(dynamic, 64) num_threads(SIFT3D_team_size())
+	for (i = 0; i < num; i++) {
+
+                int *const match = *matches + i;
+
+                float *const ratio = ratios == NULL ? NULL : ratios + i;
+
+                // Forward matching pass
+                *match = match_desc_bounded(d1->buf + i, 
+                        grid1.pos + IM_NDIMS * i, d2, &grid2, radius, 
+                        nn_thresh, ratio);
+
+                // Check for forward-backward consistency
+                if (*match >= 0 && 
+                        match_desc_bounded(d2->buf + *match, 
+                                grid2.pos + IM_NDIMS * *match, d1, &grid1, 
+                                radius, nn_thresh, NULL) != i) {
+                        *match = -1;
+                }
+
+                // Unmatched descriptors get the worst ratio
+                if (*match < 0 && ratio != NULL)
+                        *ratio = 1.0f;
+        }
+        ret = SIFT3D_SUCCESS;
+
+nn_match_bounded_quit:
+        cleanup_Match_grid(&grid1);
+        cleanup_Match_grid(&grid2);
+	return ret;
+}
+
+/* Initialize a Match_grid struct. */
+static void init_Match_grid(Match_grid *const grid) {
+        grid->pos = NULL;
+        grid->idx = NULL;
+        grid->start = NULL;
+}
+
+/* Free the memory of a Match_grid struct. */
+static void cleanup_Match_grid(Match_grid *const grid) {
+        free(grid->pos);
+        free(grid->idx);
+        free(grid->start);
+        init_Match_grid(grid);
+}
+
+/* Helper function for SIFT3D_nn_match_bounded_ratio, to bucket the 
+ * descriptors of store into grid. The coordinates are mapped by tform, if it
+ * is not NULL, then scaled by units, if it is not NULL. The cells are at 
+ * least radius wide, and enlarged as needed to keep the number of cells 
+ * proportional to the number of descriptors. */
+static int build_Match_grid(const SIFT3D_Descriptor_store *const store,
+        const void *const tform, const double *const units, 
+        const double radius, Match_grid *const grid) {
+
+        double hi[IM_NDIMS];
+        size_t num_cells;
+        int i, j;
+
+        const int num = store->num;
+        const size_t max_cells = 8 * (size_t) num + 64;
+
+        // Compute the positions and their bounding box
+        if ((grid->pos = (double *) malloc((size_t) SIFT3D_MAX(num, 1) * 
+                IM_NDIMS * sizeof(double))) == NULL)
+                return SIFT3D_FAILURE;
+        for (j = 0; j < IM_NDIMS; j++) {
+                grid->origin[j] = DBL_MAX;
+                hi[j] = -DBL_MAX;
+        }
+        for (i = 0; i < num; i++) {
+
+                const SIFT3D_Descriptor *const desc = store->buf + i;
+                double *const pos = grid->pos + IM_NDIMS * i;
+
+                if (tform == NULL) {
+                        pos[0] = desc->xd;
+                        pos[1] = desc->yd;
+                        pos[2] = desc->zd;
+                } else {
+                        apply_tform_xyz(tform, desc->xd, desc->yd, desc->zd,
+                                pos, pos + 1, pos + 2);
+                }
+
+                for (j = 0; j < IM_NDIMS; j++) {
+                        if (units != NULL)
+                                pos[j] *= units[j];
+                        grid->origin[j] = SIFT3D_MIN(grid->origin[j], pos[j]);
+                        hi[j] = SIFT3D_MAX(hi[j], pos[j]);
+                }
+        }
+        if (num < 1) {
+                for (j = 0; j < IM_NDIMS; j++) {
+                        grid->origin[j] = hi[j] = 0.0;
+                }
+        }
+
+        // Choose the cell size
+        grid->cell = radius;
+        do {
+                double cells;
+
+                cells = 1.0;
+                for (j = 0; j < IM_NDIMS; j++) {
+                        cells *= floor((hi[j] - grid->origin[j]) / 
+                                grid->cell) + 1.0;
+                }
+                if (cells <= (double) max_cells)
+                        break;
+                grid->cell *= 2.0;
+        } while (1);
+        num_cells = 1;
+        for (j = 0; j < IM_NDIMS; j++) {
+                grid->dims[j] = (int) floor((hi[j] - grid->origin[j]) / 
+                        grid->cell) + 1;
+                num_cells *= (size_t) grid->dims[j];
+        }
+
+        // Sort the descriptors by cell
+        if ((grid->start = (int *) calloc(num_cells + 1, sizeof(int))) == 
+                NULL ||
+                (grid->idx = (int *) malloc((size_t) SIFT3D_MAX(num, 1) * 
+                sizeof(int))) == NULL)
+                return SIFT3D_FAILURE;
+#define GRID_CELL(pos) \
+        (((size_t) ((int) (((pos)[2] - grid->origin[2]) / grid->cell)) * \
+                grid->dims[1] + \
+        (size_t) ((int) (((pos)[1] - grid->origin[1]) / grid->cell))) * \
+                grid->dims[0] + \
+        (size_t) ((int) (((pos)[0] - grid->origin[0]) / grid->cell)))
+        for (i = 0; i < num; i++) {
+                grid->start[GRID_CELL(grid->pos + IM_NDIMS * i) + 1]++;
+        }
+        for (i = 0; i < (int) num_cells; i++) {
+                grid->start[i + 1] += grid->start[i];
+        }
+        for (i = 0; i < num; i++) {
+
+                const size_t cell = GRID_CELL(grid->pos + IM_NDIMS * i);
+
+                grid->idx[grid->start[cell]++] = i;
+        }
+
+        // Each offset was advanced to the next cell, so shift them back
+        for (i = (int) num_cells; i > 0; i--) {
+                grid->start[i] = grid->start[i - 1];
+        }
+        grid->start[0] = 0;
+#undef GRID_CELL
+
+        return SIFT3D_SUCCESS;
+}
+
+/* As match_desc, but only compares desc, at position pos, to the 
+ * descriptors of store within a distance of radius, found in grid. */
+static int match_desc_bounded(const SIFT3D_Descriptor *const desc,
+        const double *const pos, const SIFT3D_Descriptor_store *const store,
+        const Match_grid *const grid, const double radius, 
+        const float nn_thresh, float *const ratio) {
+
+        int lo[IM_NDIMS], hi[IM_NDIMS];
+        double ssd_best, ssd_nearest;
+        int j, x, y, z, best;
+
+        const double radius_sq = radius * radius;
+
+        // Get the range of cells within reach
+        for (j = 0; j < IM_NDIMS; j++) {
+                lo[j] = SIFT3D_MAX((int) floor((pos[j] - radius - 
+                        grid->origin[j]) / grid->cell), 0);
+                hi[j] = SIFT3D_MIN((int) floor((pos[j] + radius - 
+                        grid->origin[j]) / grid->cell), grid->dims[j] - 1);
+        }
+
+        // Search the cells for the best and second-best SSD matches 
+        ssd_best = ssd_nearest = DBL_MAX;
+        best = -1;
+        for (z = lo[2]; z <= hi[2]; z++) {
+        for (y = lo[1]; y <= hi[1]; y++) {
+        for (x = lo[0]; x <= hi[0]; x++) {
+
+                int k;
+
+                const size_t cell = ((size_t) z * grid->dims[1] + y) * 
+                        grid->dims[0] + x;
+
+                for (k = grid->start[cell]; k < grid->start[cell + 1]; k++) {
+
+                        double dist_sq, ssd;
+
+                        const int i = grid->idx[k];
+                        const double *const pos2 = grid->pos + IM_NDIMS * i;
+
+                        // Check the spatial distance
+                        dist_sq = 0.0;
+                        for (j = 0; j < IM_NDIMS; j++) {
+                                const double d = pos2[j] - pos[j];
+                                dist_sq += d * d;
+                        }
+                        if (dist_sq > radius_sq)
+                                continue;
+
+                        // Compare to the best matches
+                        ssd = desc_ssd(desc, store->buf + i, ssd_nearest);
+                        if (ssd < ssd_best) {
+                                best = i;
+                                ssd_nearest = ssd_best;
+                                ssd_best = ssd;
+                        } else  {
+                                ssd_nearest = SIFT3D_MIN(ssd_nearest, ssd);
+                        }
+                }
+        }}}
+
+        // Reject a match if the nearest neighbor is too close
+        if (ratio != NULL)
+                *ratio = best < 0 ? 1.0f : (float) sqrt(ssd_best / ssd_nearest);
+        if (best < 0 || ssd_best / ssd_nearest > nn_thresh * nn_thresh)
+                return -1;
+
+        return best;
+}
+
+/* Helper function to match desc against the descriptors in store. Returns the
+ * index of the match, or -1 if none was found. If ratio is not NULL, the
+ * nearest neighbor distance ratio is written to it. */
+static int match_desc(const SIFT3D_Descriptor *const desc,
+        const SIFT3D_Descriptor_store *const store, const float nn_thresh,
+        float *const ratio) {
+
+	const SIFT3D_Descriptor *desc_best;
+        double ssd_best, ssd_nearest;
+        int i;
+
+#ifdef SIFT3D_MATCH_MAX_DIST
+        Cvec dims, dmatch;
+        double dist_match;
+				
+        // Compute spatial distance rejection threshold
+        dims.x = (float) store->nx;	
+        dims.y = (float) store->ny;	
+        dims.z = (float) store->nz;	
+        const double diag = SIFT3D_CVEC_L2_NORM(&dims);	
+        const double dist_thresh = diag * SIFT3D_MATCH_MAX_DIST;
+#endif
+
+        // Linear search for the best and second-best SSD matches 
+        ssd_best = ssd_nearest = DBL_MAX;
+        desc_best = NULL;
+        for (i = 0; i < store->num; i++) { 
+
+                const SIFT3D_Descriptor *const desc2 = store->buf + i;
+
+                // Compute the SSD of the two descriptors
+                const double ssd = desc_ssd(desc, desc2, ssd_nearest);
+
+                // Compare to the best matches
+                if (ssd < ssd_best) {
+                        desc_best = desc2; 
+                        ssd_nearest = ssd_best;
+                        ssd_best = ssd;
+                } else  {
+                        ssd_nearest = SIFT3D_MIN(ssd_nearest, ssd);
+                }
+        }
+
+        // Reject a match if the nearest neighbor is too close
+        if (ratio != NULL)
+                *ratio = (float) sqrt(ssd_best / ssd_nearest);
+        if (ssd_best / ssd_nearest > nn_thresh * nn_thresh)
+                        return -1;
+
+#ifdef SIFT3D_MATCH_MAX_DIST
+        // Compute the spatial distance of the match
+        dmatch.x = (float) desc_best->xd - desc1->xd; 
+        dmatch.y = (float) desc_best->yd - desc1->yd; 
+        dmatch.z = (float) desc_best->zd - desc1->zd; 
+        dist_match = (double) SIFT3D_CVEC_L2_NORM(&dmatch);
+
+        // Reject matches of great distance
+        if (dist_match > dist_thresh)
+                return -1;
+#endif
+        // The match was a success
+        return desc_best - store->buf;
+}
+
+#ifdef SIFT3D_WITH_CUDA
+/* Helper function for SIFT3D_nn_match_ratio to match on the CUDA device. 
+ * The nearest neighbors of each descriptor, in both directions, are found on
+ * the device by their single-precision distances, then the best 
+ * CUDA_MATCH_CANDIDATES of each are re-ranked on the host with 
+ * desc_ssd_ref. The results are the same as the reference kernel, unless 
+ * the device misses a true neighbor in a near tie. matches must be 
+ * initialized to -1. */
+static int nn_match_cuda(const SIFT3D_Descriptor_store *const d1,
+        const SIFT3D_Descriptor_store *const d2, const float nn_thresh,
+        int *const matches, float *const ratios) {
+
+        float *data1, *data2;
+        int *cand1, *cand2;
+        int i, ret;
+
+        const int k = CUDA_MATCH_CANDIDATES;
+        const int num1 = d1->num;
+        const int num2 = d2->num;
+
+        data1 = data2 = NULL;
+        cand1 = (int *) malloc((size_t) num1 * k * sizeof(int));
+        cand2 = (int *) malloc(((size_t) num2 * k + 1) * sizeof(int));
+        if (cand1 == NULL || cand2 == NULL || 
+                pack_Descriptor_store(d1, &data1) ||
+                pack_Descriptor_store(d2, &data2)) {
+                ret = SIFT3D_FAILURE;
+                goto nn_match_cuda_quit;
+        }
+
+        // Find the candidates in both directions. The device state is 
+        // shared by all threads.
+#pragma omp critical (nn_match_cuda)
+        ret = knn_cuda(match_cuda, data1, num1, data2, num2, DESC_NUMEL, k, 
+                        cand1) ||
+                knn_cuda(match_cuda, data2, num2, data1, num1, DESC_NUMEL, k,
+                        cand2) ? SIFT3D_FAILURE : SIFT3D_SUCCESS;
+        if (ret)
+                goto nn_match_cuda_quit;
+
+        // Re-rank the candidates, as match_desc
+#pragma omp parallel for num_threads(SIFT3D_team_size())
+	for (i = 0; i < num1; i++) {
+
+                int *const match = matches + i;
+                float *const ratio = ratios == NULL ? NULL : ratios + i;
+
+                // Forward matching pass
+                *match = match_candidates(d1->buf + i, d2, cand1 + i * k, 
+                        nn_thresh, ratio);
+
+                // Check for forward-backward consistency
+                if (*match >= 0 && 
+                        match_candidates(d2->buf + *match, d1, 
+                        cand2 + *match * k, nn_thresh, NULL) != i) {
+                        *match = -1;
+                }
+
+                // Unmatched descriptors get the worst ratio
+                if (*match < 0 && ratio != NULL)
+                        *ratio = 1.0f;
+        }
+
+nn_match_cuda_quit:
+        free(data1);
+        free(data2);
+        free(cand1);
+        free(cand2);
+        return ret;
+}
+
+/* Helper function to copy the histograms of a descriptor store to a 
+ * row-major matrix of [store->num x DESC_NUMEL] elements, allocated in 
+ * *data. */
+static int pack_Descriptor_store(const SIFT3D_Descriptor_store *const store,
+        float **const data) {
+
+        int i;
+
+        if ((*data = (float *) malloc(((size_t) store->num * DESC_NUMEL + 
+                1) * sizeof(float))) == NULL)
+                return SIFT3D_FAILURE;
+
+        for (i = 0; i < store->num; i++) {
+                memcpy(*data + (size_t) i * DESC_NUMEL, store->buf[i].hists,
+                        DESC_NUMEL * sizeof(float));
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* As match_desc, but only compares desc to the CUDA_MATCH_CANDIDATES 
+ * descriptors of store indexed by cand, which may contain -1. Ties go to the
+ * lowest index, as in a linear search. */
+static int match_candidates(const SIFT3D_Descriptor *const desc,
+        const SIFT3D_Descriptor_store *const store, const int *const cand,
+        const float nn_thresh, float *const ratio) {
+
+        double ssd_best, ssd_nearest;
+        int i, best;
+
+        ssd_best = ssd_nearest = DBL_MAX;
+        best = -1;
+        for (i = 0; i < CUDA_MATCH_CANDIDATES; i++) {
+
+                double ssd;
+
+                const int j = cand[i];
+
+                if (j < 0)
+                        continue;
+
+                ssd = desc_ssd_ref(desc, store->buf + j, DBL_MAX);
+                if (ssd < ssd_best || (ssd == ssd_best && j < best)) {
+                        ssd_nearest = ssd_best;
+                        ssd_best = ssd;
+                        best = j;
+                } else {
+                        ssd_nearest = SIFT3D_MIN(ssd_nearest, ssd);
+                }
+        }
+
+        // Reject a match if the nearest neighbor is too close
+        if (ratio != NULL)
+                *ratio = (float) sqrt(ssd_best / ssd_nearest);
+        if (best < 0 || ssd_best / ssd_nearest > nn_thresh * nn_thresh)
+                return -1;
+
+        return best;
+}
+#endif
+
+/* Helper function to compute the SSD between two descriptors in double
+ * precision. This is the reference implementation of desc_ssd. The 
+ * computation terminates early, after any histogram, once the SSD exceeds
+ * thresh. In that case the partial sum is returned. */
+static double desc_ssd_ref(const SIFT3D_Descriptor *const desc1,
+        const SIFT3D_Descriptor *const desc2, const double thresh) {
+
+        double ssd;
+        int j;
+
+        ssd = 0.0;
+        for (j = 0; j < DESC_NUM_TOTAL_HIST; j++) {
+
+                int a, p;
+
+                const Hist *const hist1 = desc1->hists + j;
+                const Hist *const hist2 = desc2->hists + j;
+
+                HIST_LOOP_START(a, p)
+                        const double diff = 
+                                (double) HIST_GET(hist1, a, p) -
+                                (double) HIST_GET(hist2, a, p);
+                                ssd += diff * diff;
+                HIST_LOOP_END
+
+                // Early termination
+                if (ssd > thresh)
+                        break;
+        }
+
+        return ssd;
+}
+
+/* As desc_ssd_ref, but accumulates each block of DESC_SSD_BLOCK elements in
+ * single precision, checking for early termination between blocks. The
+ * independent accumulators allow the compiler to vectorize the loop on
+ * any architecture. */
+static double desc_ssd_float(const SIFT3D_Descriptor *const desc1,
+        const SIFT3D_Descriptor *const desc2, const double thresh) {
+
+        double ssd;
+        int i, j, k;
+
+        const float *const f1 = (const float *) desc1->hists;
+        const float *const f2 = (const float *) desc2->hists;
+
+        ssd = 0.0;
+        for (i = 0; i < DESC_NUMEL; i += DESC_SSD_BLOCK) {
+
+                float acc[8] = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 
+                        0.0f};
+
+                for (j = i; j < i + DESC_SSD_BLOCK; j += 8) {
+                        for (k = 0; k < 8; k++) {
+                                const float diff = f1[j + k] - f2[j + k];
+                                acc[k] += diff * diff;
+                        }
+                }
+
+                ssd += (double) (((acc[0] + acc[1]) + (acc[2] + acc[3])) +
+                        ((acc[4] + acc[5]) + (acc[6] + acc[7])));
+
+                // Early termination
+                if (ssd > thresh)
+                        break;
+        }
+
+        return ssd;
+}
+
+#ifdef SIFT3D_X86_SIMD
+/* As desc_ssd_float, using AVX2 and FMA instructions. */
+__attribute__((target("avx2,fma")))
+static double desc_ssd_avx2(const SIFT3D_Descriptor *const desc1,
+        const SIFT3D_Descriptor *const desc2, const double thresh) {
+
+        double ssd;
+        int i, j;
+
+        const float *const f1 = (const float *) desc1->hists;
+        const float *const f2 = (const float *) desc2->hists;
+
+        ssd = 0.0;
+        for (i = 0; i < DESC_NUMEL; i += DESC_SSD_BLOCK) {
+
+                __m256 acc0, acc1;
+                __m128 sum;
+
+                acc0 = acc1 = _mm256_setzero_ps();
+                for (j = i; j < i + DESC_SSD_BLOCK; j += 16) {
+                        const __m256 diff0 = _mm256_sub_ps(
+                                _mm256_loadu_ps(f1 + j), 
+                                _mm256_loadu_ps(f2 + j));
+                        const __m256 diff1 = _mm256_sub_ps(
+                                _mm256_loadu_ps(f1 + j + 8), 
+                                _mm256_loadu_ps(f2 + j + 8));
+                        acc0 = _mm256_fmadd_ps(diff0, diff0, acc0);
+                        acc1 = _mm256_fmadd_ps(diff1, diff1, acc1);
+                }
+
+                // Horizontal sum
+                acc0 = _mm256_add_ps(acc0, acc1);
+                sum = _mm_add_ps(_mm256_castps256_ps128(acc0), 
+                        _mm256_extractf128_ps(acc0, 1));
+                sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+                sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+                ssd += (double) _mm_cvtss_f32(sum);
+
+                // Early termination
+                if (ssd > thresh)
+                        break;
+        }
+
+        return ssd;
+}
+
+/* As desc_ssd_float, using AVX-512 instructions. */
+__attribute__((target("avx512f")))
+static double desc_ssd_avx512(const SIFT3D_Descriptor *const desc1,
+        const SIFT3D_Descriptor *const desc2, const double thresh) {
+
+        double ssd;
+        int i, j;
+
+        const float *const f1 = (const float *) desc1->hists;
+        const float *const f2 = (const float *) desc2->hists;
+
+        ssd = 0.0;
+        for (i = 0; i < DESC_NUMEL; i += DESC_SSD_BLOCK) {
+
+                __m512 acc0, acc1;
+
+                acc0 = acc1 = _mm512_setzero_ps();
+                for (j = i; j < i + DESC_SSD_BLOCK; j += 32) {
+                        const __m512 diff0 = _mm512_sub_ps(
+                                _mm512_loadu_ps(f1 + j), 
+                                _mm512_loadu_ps(f2 + j));
+                        const __m512 diff1 = _mm512_sub_ps(
+                                _mm512_loadu_ps(f1 + j + 16), 
+                                _mm512_loadu_ps(f2 + j + 16));
+                        acc0 = _mm512_fmadd_ps(diff0, diff0, acc0);
+                        acc1 = _mm512_fmadd_ps(diff1, diff1, acc1);
+                }
+                ssd += (double) _mm512_reduce_add_ps(
+                        _mm512_add_ps(acc0, acc1));
+
+                // Early termination
+                if (ssd > thresh)
+                        break;
+        }
+
+        return ssd;
+}
+#endif
+
+#ifdef SIFT3D_NEON_SIMD
+/* As desc_ssd_float, using NEON instructions. */
+static double desc_ssd_neon(const SIFT3D_Descriptor *const desc1,
+        const SIFT3D_Descriptor *const desc2, const double thresh) {
+
+        double ssd;
+        int i, j;
+
+        const float *const f1 = (const float *) desc1->hists;
+        const float *const f2 = (const float *) desc2->hists;
+
+        ssd = 0.0;
+        for (i = 0; i < DESC_NUMEL; i += DESC_SSD_BLOCK) {
+
+                float32x4_t acc0, acc1;
+
+                acc0 = acc1 = vdupq_n_f32(0.0f);
+                for (j = i; j < i + DESC_SSD_BLOCK; j += 8) {
+                        const float32x4_t diff0 = vsubq_f32(vld1q_f32(f1 + j),
+                                vld1q_f32(f2 + j));
+                        const float32x4_t diff1 = vsubq_f32(
+                                vld1q_f32(f1 + j + 4), vld1q_f32(f2 + j + 4));
+                        acc0 = vfmaq_f32(acc0, diff0, diff0);
+                        acc1 = vfmaq_f32(acc1, diff1, diff1);
+                }
+                ssd += (double) vaddvq_f32(vaddq_f32(acc0, acc1));
+
+                // Early termination
+                if (ssd > thresh)
+                        break;
+        }
+
+        return ssd;
+}
+#endif
+
+/* Helper function to select the fastest desc_ssd kernel supported by the
+ * CPU. Does nothing if a kernel was already selected. */
+static void init_desc_ssd(void) {
+
+        if (desc_ssd != NULL)
+                return;
+
+        desc_ssd = desc_ssd_float;
+        match_kernel_name = "float";
+
+#if defined(SIFT3D_X86_SIMD)
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) {
+                desc_ssd = desc_ssd_avx512;
+                match_kernel_name = "avx512f";
+        } else if (__builtin_cpu_supports("avx2") && 
+                __builtin_cpu_supports("fma")) {
+                desc_ssd = desc_ssd_avx2;
+                match_kernel_name = "avx2";
+        }
+#elif defined(SIFT3D_NEON_SIMD)
+        desc_ssd = desc_ssd_neon;
+        match_kernel_name = "neon";
+#endif
+}
+
+/* Choose whether descriptor matching uses vectorized single-precision
+ * kernels, selected at runtime for the CPU. This is the default. If simd is
+ * SIFT3D_FALSE, matching uses the double-precision reference kernel, 
+ * reproducing the results of previous versions exactly. This setting is
+ * global, and should not be changed while matching is in progress. */
+void SIFT3D_set_match_simd(const int simd) {
+        desc_ssd = NULL;
+        if (simd) {
+                init_desc_ssd();
+        } else {
+                desc_ssd = desc_ssd_ref;
+                match_kernel_name = "reference";
+        }
+}
+
+/* Sets the device used for descriptor matching by SIFT3D_nn_match and 
+ * SIFT3D_nn_match_ratio. With SIFT3D_BACKEND_CUDA, the distances between 
+ * all pairs of descriptors are computed on the current CUDA device as a 
+ * matrix product, and the best candidates are compared exactly on the host.
+ * The device is initialized here. This setting is global, and should not be
+ * changed while matching is in progress. Returns SIFT3D_SUCCESS on success, 
+ * SIFT3D_FAILURE if the backend is not available for matching. */
+int SIFT3D_set_match_backend(const SIFT3D_backend backend) {
+
+        switch (backend) {
+                case SIFT3D_BACKEND_CPU:
+#ifdef SIFT3D_WITH_CUDA
+                        cleanup_SIFT3D_cuda(match_cuda);
+                        match_cuda = NULL;
+#endif
+                        break;
+                case SIFT3D_BACKEND_CUDA:
+#ifdef SIFT3D_WITH_CUDA
+                        if (match_cuda == NULL && init_SIFT3D_cuda(&match_cuda))
+                                return SIFT3D_FAILURE;
+                        break;
+#else
+                        SIFT3D_ERR("SIFT3D_set_match_backend: This version "
+                                "was not compiled with CUDA \n");
+                        return SIFT3D_FAILURE;
+#endif
+                default:
+                        SIFT3D_ERR("SIFT3D_set_match_backend: unsupported "
+                                "backend: %d \n", (int) backend);
+                        return SIFT3D_FAILURE;
+        }
+
+        match_backend = backend;
+        return SIFT3D_SUCCESS;
+}
+
+/* Returns the name of the kernel used to compare descriptors, e.g. "avx2"
+ * or "reference", or "cuda" if matching runs on the CUDA device. */
+const char *SIFT3D_get_match_kernel(void) {
+        if (match_backend == SIFT3D_BACKEND_CUDA)
+                return "cuda";
+        init_desc_ssd();
+        return match_kernel_name;
+}
+
+/* Initialize a SIFT3D_Descriptor_index for first use, with the default
+ * parameters. This does not need to be called to rebuild the index for a
+ * new descriptor store. */
+void init_SIFT3D_Descriptor_index(SIFT3D_Descriptor_index *const index) {
+        index->store = NULL;
+        index->nodes = NULL;
+        index->idx = NULL;
+        index->num = 0;
+        index->max_nodes = 0;
+        index->num_trees = index_num_trees_default;
+        index->checks = index_checks_default;
+}
+
+/* Free all memory associated with a SIFT3D_Descriptor_index. index cannot
+ * be used after calling this function, unless re-initialized. */
+void cleanup_SIFT3D_Descriptor_index(SIFT3D_Descriptor_index *const index) {
+        free(index->nodes);
+        free(index->idx);
+}
+
+/* Set the number of randomized trees in the index. Must be positive. This
+ * takes effect the next time build_SIFT3D_Descriptor_index is called. */
+int set_num_trees_SIFT3D_Descriptor_index(
+        SIFT3D_Descriptor_index *const index, const int num_trees) {
+
+        if (num_trees < 1) {
+                SIFT3D_ERR("set_num_trees_SIFT3D_Descriptor_index: invalid "
+                        "number of trees: %d \n", num_trees);
+                return SIFT3D_FAILURE;
+        }
+
+        index->num_trees = num_trees;
+        return SIFT3D_SUCCESS;
+}
+
+/* Set the maximum number of descriptors compared to each query. This
+ * trades speed for recall. The search is exact if checks is at least the
+ * number of indexed descriptors. Must be positive. */
+int set_checks_SIFT3D_Descriptor_index(SIFT3D_Descriptor_index *const index,
+        const int checks) {
+
+        if (checks < 1) {
+                SIFT3D_ERR("set_checks_SIFT3D_Descriptor_index: invalid "
+                        "number of checks: %d \n", checks);
+                return SIFT3D_FAILURE;
+        }
+
+        index->checks = checks;
+        return SIFT3D_SUCCESS;
+}
+
+/* Build a randomized k-d forest over the descriptors in store. The index
+ * keeps a pointer to store, which must not be modified or freed while the 
+ * index is in use. The index must be initialized prior to calling this 
+ * function. It can be rebuilt for a different store.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int build_SIFT3D_Descriptor_index(SIFT3D_Descriptor_index *const index,
+        const SIFT3D_Descriptor_store *const store) {
+
+        double *stats;
+        int i, t;
+
+        const int num = (int) store->num;
+        const int max_nodes = 2 * num;
+        const int num_trees = index->num_trees;
+
+        // Verify inputs
+        if (num < 1) {
+                SIFT3D_ERR("build_SIFT3D_Descriptor_index: invalid number "
+                        "of descriptors: %d \n", num);
+                return SIFT3D_FAILURE;
+        }
+
+        // Allocate memory
+        if ((index->nodes = (Kd_node *) SIFT3D_safe_realloc(index->nodes,
+                (size_t) num_trees * max_nodes * sizeof(Kd_node))) == NULL ||
+                (index->idx = (int *) SIFT3D_safe_realloc(index->idx,
+                (size_t) num_trees * num * sizeof(int))) == NULL ||
+                (stats = (double *) malloc(2 * DESC_NUMEL * 
+                        sizeof(double))) == NULL) {
+                SIFT3D_ERR("build_SIFT3D_Descriptor_index: out of memory \n");
+                index->store = NULL;
+                return SIFT3D_FAILURE;
+        }
+        index->store = store;
+        index->num = store->num;
+        index->max_nodes = max_nodes;
+
+        // Build each tree with its own random sequence
+        for (t = 0; t < num_trees; t++) {
+
+                int num_nodes;
+                unsigned int seed = (unsigned int) t + 1;
+
+                int *const idx = index->idx + (size_t) t * num;
+
+                for (i = 0; i < num; i++) {
+                        idx[i] = i;
+                }
+
+                num_nodes = 0;
+                build_kd_tree(index, t, 0, num, &num_nodes, stats, &seed);
+                assert(num_nodes <= max_nodes);
+        }
+
+        free(stats);
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper function to recursively build a k-d tree over the descriptors 
+ * idx[begin, end) of the given tree. Each node splits on the mean of a 
+ * dimension chosen at random from those of highest variance, estimated from 
+ * the first kd_num_samples descriptors.
+ *
+ * Parameters:
+ *   index - The index being built.
+ *   tree - The index of the tree.
+ *   begin, end - The range of descriptors to be split.
+ *   num_nodes - The number of nodes allocated so far, incremented.
+ *   stats - Scratch memory of length 2 * DESC_NUMEL.
+ *   seed - The state of the random number generator.
+ *
+ * Returns the index of the new node. */
+static int build_kd_tree(SIFT3D_Descriptor_index *const index, 
+        const int tree, const int begin, const int end, int *const num_nodes,
+        double *const stats, unsigned int *const seed) {
+
+        int cand[KD_NUM_RAND_DIMS];
+        double split;
+        int i, j, k, num_cand, dim, lo, hi, mid;
+
+        const SIFT3D_Descriptor *const buf = index->store->buf;
+        int *const idx = index->idx + (size_t) tree * index->num;
+        Kd_node *const nodes = index->nodes + (size_t) tree * index->max_nodes;
+        const int node = (*num_nodes)++;
+        const int num_samples = SIFT3D_MIN(end - begin, kd_num_samples);
+        double *const mean = stats;
+        double *const var = stats + DESC_NUMEL;
+
+        // Make a leaf from a small number of descriptors
+        if (end - begin <= kd_leaf_size) {
+                nodes[node].dim = -1;
+                nodes[node].left = begin;
+                nodes[node].right = end;
+                return node;
+        }
+
+        // Estimate the mean and variance of each dimension
+        memset(stats, 0, 2 * DESC_NUMEL * sizeof(double));
+        for (i = begin; i < begin + num_samples; i++) {
+                const SIFT3D_Descriptor *const desc = buf + idx[i];
+                for (j = 0; j < DESC_NUMEL; j++) {
+                        mean[j] += (double) DESC_GET_EL(desc, j);
+                }
+        }
+        for (j = 0; j < DESC_NUMEL; j++) {
+                mean[j] /= (double) num_samples;
+        }
+        for (i = begin; i < begin + num_samples; i++) {
+                const SIFT3D_Descriptor *const desc = buf + idx[i];
+                for (j = 0; j < DESC_NUMEL; j++) {
+                        const double diff = (double) DESC_GET_EL(desc, j) - 
+                                mean[j];
+                        var[j] += diff * diff;
+                }
+        }
+
+        // Keep the dimensions of highest variance, sorted in descending order
+        num_cand = 0;
+        for (j = 0; j < DESC_NUMEL; j++) {
+
+                if (num_cand == KD_NUM_RAND_DIMS && 
+                        var[j] <= var[cand[num_cand - 1]])
+                        continue;
+
+                if (num_cand < KD_NUM_RAND_DIMS)
+                        num_cand++;
+                for (k = num_cand - 1; k > 0 && var[cand[k - 1]] < var[j]; 
+                        k--) {
+                        cand[k] = cand[k - 1];
+                }
+                cand[k] = j;
+        }
+
+        // Choose the split dimension at random
+        *seed = *seed * 1103515245u + 12345u;
+        dim = cand[(*seed >> 16) % (unsigned int) num_cand];
+        split = mean[dim];
+
+        // Partition the descriptors about the split value
+        lo = begin;
+        hi = end - 1;
+        while (lo <= hi) {
+                if ((double) DESC_GET_EL(buf + idx[lo], dim) < split) {
+                        lo++;
+                } else {
+                        const int temp = idx[lo];
+                        idx[lo] = idx[hi];
+                        idx[hi--] = temp;
+                }
+        }
+        mid = lo;
+
+        // If all values are equal, split the range in half
+        if (mid == begin || mid == end)
+                mid = begin + (end - begin) / 2;
+
+        // Recursively build the children
+        nodes[node].dim = dim;
+        nodes[node].val = (float) split;
+        nodes[node].left = build_kd_tree(index, tree, begin, mid, num_nodes,
+                stats, seed);
+        nodes[node].right = build_kd_tree(index, tree, mid, end, num_nodes,
+                stats, seed);
+
+        return node;
+}
+
+/* Initialize scratch memory for searching indices of at most num 
+ * descriptors. */
+static int init_Kd_search(Kd_search *const search, const size_t num) {
+
+        search->heap = NULL;
+        search->heap_num = search->heap_cap = 0;
+        search->stamp = 0;
+        if ((search->visited = (int *) calloc(num, sizeof(int))) == NULL) {
+                SIFT3D_ERR("init_Kd_search: out of memory \n");
+                return SIFT3D_FAILURE;
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Free the memory in a Kd_search struct. */
+static void cleanup_Kd_search(Kd_search *const search) {
+        free(search->heap);
+        free(search->visited);
+}
+
+/* Helper function to descend a k-d tree from node to a leaf, pushing the
+ * unexplored branches onto the heap, and comparing desc to the unvisited 
+ * descriptors of the leaf. The best and second-best matches are updated in
+ * place.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int kd_descend(const SIFT3D_Descriptor_index *const index,
+        const SIFT3D_Descriptor *const desc, const int tree, int node, 
+        const double dist, Kd_search *const search, int *const num_checked,
+        int *const best, double *const ssd_best, double *const ssd_nearest) {
+
+        int i;
+
+        const Kd_node *const nodes = index->nodes + 
+                (size_t) tree * index->max_nodes;
+        const int *const idx = index->idx + (size_t) tree * index->num;
+
+        // Descend to a leaf
+        while (nodes[node].dim >= 0) {
+
+                Kd_branch *branch;
+                size_t child;
+
+                const Kd_node *const cur = nodes + node;
+                const double diff = (double) DESC_GET_EL(desc, cur->dim) - 
+                        (double) cur->val;
+                const int near = diff < 0.0 ? cur->left : cur->right;
+                const int far = diff < 0.0 ? cur->right : cur->left;
+                const double dist_far = dist + diff * diff;
+
+                node = near;
+
+                // Make room in the heap
+                if (search->heap_num == search->heap_cap) {
+                        search->heap_cap = SIFT3D_MAX(2 * search->heap_cap, 
+                                (size_t) 64);
+                        if ((search->heap = (Kd_branch *) SIFT3D_safe_realloc(
+                                search->heap, search->heap_cap * 
+                                sizeof(Kd_branch))) == NULL)
+                                return SIFT3D_FAILURE;
+                }
+
+                // Sift the far branch up the min-heap
+                child = search->heap_num++;
+                while (child > 0) {
+                        const size_t parent = (child - 1) / 2;
+                        if (search->heap[parent].dist <= dist_far)
+                                break;
+                        search->heap[child] = search->heap[parent];
+                        child = parent;
+                }
+                branch = search->heap + child;
+                branch->dist = dist_far;
+                branch->tree = tree;
+                branch->node = far;
+        }
+
+        // Compare to the descriptors in the leaf
+        for (i = nodes[node].left; i < nodes[node].right; i++) {
+
+                double ssd;
+
+                const int j = idx[i];
+
+                // Skip descriptors already visited in other trees
+                if (search->visited[j] == search->stamp)
+                        continue;
+                search->visited[j] = search->stamp;
+                (*num_checked)++;
+
+                ssd = desc_ssd(desc, index->store->buf + j, *ssd_nearest);
+
+                // Compare to the best matches
+                if (ssd < *ssd_best) {
+                        *best = j;
+                        *ssd_nearest = *ssd_best;
+                        *ssd_best = ssd;
+                } else {
+                        *ssd_nearest = SIFT3D_MIN(*ssd_nearest, ssd);
+                }
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Like match_desc, but searches a k-d forest for approximate nearest
+ * neighbors. The match index, or -1 if none was found, is written to 
+ * match. If ratio is not NULL, the distance ratio is written to it.
+ * 
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int match_desc_indexed(const SIFT3D_Descriptor *const desc,
+        const SIFT3D_Descriptor_index *const index, const float nn_thresh,
+        Kd_search *const search, int *const match, float *const ratio) {
+
+        double ssd_best, ssd_nearest;
+        int t, best, num_checked;
+
+        // Start a new query
+        search->stamp++;
+        search->heap_num = 0;
+        ssd_best = ssd_nearest = DBL_MAX;
+        best = -1;
+        num_checked = 0;
+
+        // Descend each tree to its nearest leaf
+        for (t = 0; t < index->num_trees; t++) {
+                if (kd_descend(index, desc, t, 0, 0.0, search, &num_checked,
+                        &best, &ssd_best, &ssd_nearest))
+                        return SIFT3D_FAILURE;
+        }
+
+        // Explore the remaining branches in order of increasing distance
+        while (search->heap_num > 0 && num_checked < index->checks) {
+
+                size_t parent;
+
+                const Kd_branch branch = search->heap[0];
+                const Kd_branch last = search->heap[--search->heap_num];
+
+                // Sift the last branch down from the root
+                parent = 0;
+                while (search->heap_num > 0) {
+                        size_t child = 2 * parent + 1;
+                        if (child >= search->heap_num)
+                                break;
+                        if (child + 1 < search->heap_num && 
+                                search->heap[child + 1].dist < 
+                                search->heap[child].dist)
+                                child++;
+                        if (last.dist <= search->heap[child].dist)
+                                break;
+                        search->heap[parent] = search->heap[child];
+                        parent = child;
+                }
+                if (search->heap_num > 0)
+                        search->heap[parent] = last;
+
+                if (kd_descend(index, desc, branch.tree, branch.node, 
+                        branch.dist, search, &num_checked, &best, &ssd_best, 
+                        &ssd_nearest))
+                        return SIFT3D_FAILURE;
+        }
+
+        // Reject a match if the nearest neighbor is too close
+        if (ratio != NULL)
+                *ratio = best < 0 ? 1.0f : (float) sqrt(ssd_best / ssd_nearest);
+        *match = best < 0 || ssd_best / ssd_nearest > nn_thresh * nn_thresh ? 
+                -1 : best;
+
+        return SIFT3D_SUCCESS;
+}
+
+/* SIFT3D_nn_match_indexed_ratio, without the ratios. */
+int SIFT3D_nn_match_indexed(const SIFT3D_Descriptor_index *const index1,
+        const SIFT3D_Descriptor_index *const index2, const float nn_thresh, 
+        int **const matches) {
+        return SIFT3D_nn_match_indexed_ratio(index1, index2, nn_thresh, 
+                matches, NULL);
+}
+
+/* Like SIFT3D_nn_match_ratio, but uses pre-built indices to search for 
+ * approximate nearest neighbors, instead of an exhaustive search. The
+ * ratio test and forward-backward consistency check are the same as in
+ * SIFT3D_nn_match. The results are exact if the checks parameter of each
+ * index is at least the number of descriptors in the other.
+ *
+ * Parameters:
+ *   index1 - An index built from the first set of descriptors, d1.
+ *   index2 - An index built from the second set of descriptors, d2.
+ *   nn_thresh - The matching threshold, as in SIFT3D_nn_match.
+ *   matches - As in SIFT3D_nn_match.
+ *   ratios - As in SIFT3D_nn_match_ratio.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int SIFT3D_nn_match_indexed_ratio(const SIFT3D_Descriptor_index *const index1,
+        const SIFT3D_Descriptor_index *const index2, const float nn_thresh, 
+        int **const matches, float *const ratios) {
+
+	int ret;
+
+        const SIFT3D_Descriptor_store *const d1 = index1->store;
+        const SIFT3D_Descriptor_store *const d2 = index2->store;
+
+        // Verify inputs
+        if (d1 == NULL || d2 == NULL) {
+                SIFT3D_ERR("SIFT3D_nn_match_indexed_ratio: the indices have not "
+                        "been built \n");
+                return SIFT3D_FAILURE;
+        }
+
+	// Resize the matches array (num cannot be zero)
+	if ((*matches = (int *) SIFT3D_safe_realloc(*matches, 
+		d1->num * sizeof(int))) == NULL) {
+	    SIFT3D_ERR("SIFT3D_nn_match_indexed_ratio: out of memory! \n");
+	    return SIFT3D_FAILURE;
+	}
+
+        // Select the descriptor comparison kernel
+        init_desc_ssd();
+
+        ret = SIFT3D_SUCCESS;
+#pragma omp parallel num_threads(SIFT3D_team_size())
+{
+        Kd_search search;
+        int i;
+
+        const int num = (int) d1->num;
+        const int have_search = init_Kd_search(&search, 
+                SIFT3D_MAX(d1->num, d2->num)) == SIFT3D_SUCCESS; 
+
+        if (!have_search)
+                ret = SIFT3D_FAILURE;
+
+#pragma omp for
+	for (i = 0; i < num; i++) {
+
+                int *const match = *matches + i;
+                float *const ratio = ratios == NULL ? NULL : ratios + i;
+
+                // Mark -1 to signal there is no match
+                *match = -1;
+                if (ratio != NULL)
+                        *ratio = 1.0f;
+                if (!have_search)
+                        continue;
+
+                // Forward matching pass
+                if (match_desc_indexed(d1->buf + i, index2, nn_thresh, 
+                        &search, match, ratio)) {
+                        ret = SIFT3D_FAILURE;
+                        continue;
+                }
+
+                // We are done if there was no match
+                if (*match < 0) {
+                        if (ratio != NULL)
+                                *ratio = 1.0f;
+                        continue;
+                }
+
+                // Check for forward-backward consistency
+                {
+                        int match_back;
+
+                        if (match_desc_indexed(d2->buf + *match, index1, 
+                                nn_thresh, &search, &match_back, NULL)) {
+                                ret = SIFT3D_FAILURE;
+                                continue;
+                        }
+
+                        if (match_back != i) {
+                                *match = -1;
+                                if (ratio != NULL)
+                                        *ratio = 1.0f;
+                        }
+                }
+        }
+
+        if (have_search)
+                cleanup_Kd_search(&search);
+}
+
+	return ret;
+}
+			
+/* Returns the size in bytes of a quantized descriptor element. */
+static size_t quant_type_get_size(const quant_type type) {
+        switch (type) {
+        case QUANT_UINT8:
+                return sizeof(unsigned char);
+        case QUANT_FLOAT16:
+                return sizeof(unsigned short);
+        default:
+                return 0;
+        }
+}
+
+/* Initialize a SIFT3D_Quant_store for first use, with elements of the given
+ * type. This does not need to be called to reuse the store for a new 
+ * image. */
+void init_SIFT3D_Quant_store(SIFT3D_Quant_store *const store, 
+        const quant_type type) {
+        store->data = NULL;
+        store->coords = NULL;
+        store->num = 0;
+        store->type = type;
+}
+
+/* Free all memory associated with a SIFT3D_Quant_store. store cannot be used
+ * after calling this function, unless re-initialized. */
+void cleanup_SIFT3D_Quant_store(SIFT3D_Quant_store *const store) {
+        free(store->data);
+        free(store->coords);
+}
+
+/* Resize a SIFT3D_Quant_store to hold num descriptors. Must be initialized
+ * prior to calling this function. num must be positive.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+static int resize_SIFT3D_Quant_store(SIFT3D_Quant_store *const store,
+        const int num) {
+
+        const size_t el_size = quant_type_get_size(store->type);
+
+        if (num < 1) {
+                SIFT3D_ERR("resize_SIFT3D_Quant_store: invalid size: %d \n",
+                        num);
+                return SIFT3D_FAILURE;
+        }
+        if (el_size == 0) {
+                SIFT3D_ERR("resize_SIFT3D_Quant_store: unknown type: %d \n",
+                        store->type);
+                return SIFT3D_FAILURE;
+        }
+
+        if ((store->data = SIFT3D_safe_realloc(store->data, 
+                (size_t) num * DESC_NUMEL * el_size)) == NULL ||
+                (store->coords = (double *) SIFT3D_safe_realloc(store->coords,
+                (size_t) num * 4 * sizeof(double))) == NULL)
+                return SIFT3D_FAILURE;
+
+        store->num = num;
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper function to quantize desc into element i of store, which must be
+ * large enough to hold it. */
+static void quantize_desc(const SIFT3D_Descriptor *const desc, 
+        SIFT3D_Quant_store *const store, const size_t i) {
+
+        int j;
+
+        double *const coords = store->coords + 4 * i;
+
+        // Quantize the elements
+        switch (store->type) {
+        case QUANT_UINT8:
+                {
+                        unsigned char *const data = 
+                                (unsigned char *) store->data + i * DESC_NUMEL;
+
+                        for (j = 0; j < DESC_NUMEL; j++) {
+                                const float q = DESC_GET_EL(desc, j) * 
+                                        (float) quant_scale + 0.5f;
+                                data[j] = q >= 255.0f ? 255 : 
+                                        (unsigned char) q;
+                        }
+                }
+                break;
+        case QUANT_FLOAT16:
+                {
+                        unsigned short *const data = 
+                                (unsigned short *) store->data + 
+                                i * DESC_NUMEL;
+
+                        for (j = 0; j < DESC_NUMEL; j++) {
+                                data[j] = SIFT3D_float_to_half(
+                                        DESC_GET_EL(desc, j));
+                        }
+                }
+                break;
+        }
+
+        // Copy the coordinates
+        coords[0] = desc->xd;
+        coords[1] = desc->yd;
+        coords[2] = desc->zd;
+        coords[3] = desc->sd;
+}
+
+/* Quantize the descriptors in src, writing the result to dst. The element 
+ * type is taken from dst, which must be initialized. Elements of type 
+ * QUANT_UINT8 are scaled by quant_scale, in the manner of 8-bit SIFT
+ * descriptors.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int quantize_SIFT3D_Descriptor_store(const SIFT3D_Descriptor_store *const src,
+        SIFT3D_Quant_store *const dst) {
+
+        int i;
+
+        const int num = (int) src->num;
+
+        if (resize_SIFT3D_Quant_store(dst, num))
+                return SIFT3D_FAILURE;
+
+        dst->nx = src->nx;
+        dst->ny = src->ny;
+        dst->nz = src->nz;
+
+#pragma omp parallel for num_threads(SIFT3D_team_size())
+        for (i = 0; i < num; i++) {
+                quantize_desc(src->buf + i, dst, i);
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Convert quantized descriptors back to floating point, writing the result
+ * to dst, which must be initialized. The result is approximate for elements
+ * of type QUANT_UINT8.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int dequantize_SIFT3D_Quant_store(const SIFT3D_Quant_store *const src,
+        SIFT3D_Descriptor_store *const dst) {
+
+        int i;
+
+        const int num = (int) src->num;
+        const float scale_inv = 1.0f / (float) quant_scale;
+
+        if (resize_SIFT3D_Descriptor_store(dst, num))
+                return SIFT3D_FAILURE;
+
+        dst->nx = src->nx;
+        dst->ny = src->ny;
+        dst->nz = src->nz;
+
+#pragma omp parallel for num_threads(SIFT3D_team_size())
+        for (i = 0; i < num; i++) {
+
+                int j;
+
+                SIFT3D_Descriptor *const desc = dst->buf + i;
+                float *const el = (float *) desc->hists;
+                const double *const coords = src->coords + 4 * i;
+
+                switch (src->type) {
+                case QUANT_UINT8:
+                        {
+                                const unsigned char *const data = 
+                                        (const unsigned char *) src->data + 
+                                        (size_t) i * DESC_NUMEL;
+
+                                for (j = 0; j < DESC_NUMEL; j++) {
+                                        el[j] = (float) data[j] * scale_inv;
+                                }
+                        }
+                        break;
+                case QUANT_FLOAT16:
+                        {
+                                const unsigned short *const data = 
+                                        (const unsigned short *) src->data + 
+                                        (size_t) i * DESC_NUMEL;
+
+                                for (j = 0; j < DESC_NUMEL; j++) {
+                                        el[j] = SIFT3D_half_to_float(data[j]);
+                                }
+                        }
+                        break;
+                }
+
+                desc->xd = coords[0];
+                desc->yd = coords[1];
+                desc->zd = coords[2];
+                desc->sd = coords[3];
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper function to compute the SSD between two 8-bit quantized 
+ * descriptors, with integer arithmetic. The early termination rule is the 
+ * same as in desc_ssd_float. */
+static double quant_ssd_uint8(const void *const q1, const void *const q2,
+        const double thresh) {
+
+        double ssd;
+        int i, j;
+
+        const unsigned char *const u1 = (const unsigned char *) q1;
+        const unsigned char *const u2 = (const unsigned char *) q2;
+
+        ssd = 0.0;
+        for (i = 0; i < DESC_NUMEL; i += DESC_SSD_BLOCK) {
+
+                int acc = 0;
+
+                for (j = i; j < i + DESC_SSD_BLOCK; j++) {
+                        const int diff = (int) u1[j] - (int) u2[j];
+                        acc += diff * diff;
+                }
+
+                ssd += (double) acc;
+
+                // Early termination
+                if (ssd > thresh)
+                        break;
+        }
+
+        return ssd;
+}
+
+/* As quant_ssd_uint8, but for descriptors in half precision. */
+static double quant_ssd_float16(const void *const q1, const void *const q2,
+        const double thresh) {
+
+        double ssd;
+        int i, j;
+
+        const unsigned short *const h1 = (const unsigned short *) q1;
+        const unsigned short *const h2 = (const unsigned short *) q2;
+
+        ssd = 0.0;
+        for (i = 0; i < DESC_NUMEL; i += DESC_SSD_BLOCK) {
+
+                float acc = 0.0f;
+
+                for (j = i; j < i + DESC_SSD_BLOCK; j++) {
+                        const float diff = SIFT3D_half_to_float(h1[j]) - 
+                                SIFT3D_half_to_float(h2[j]);
+                        acc += diff * diff;
+                }
+
+                ssd += (double) acc;
+
+                // Early termination
+                if (ssd > thresh)
+                        break;
+        }
+
+        return ssd;
+}
+
+#ifdef SIFT3D_X86_SIMD
+/* As quant_ssd_uint8, using AVX2 instructions. */
+__attribute__((target("avx2")))
+static double quant_ssd_uint8_avx2(const void *const q1, const void *const q2,
+        const double thresh) {
+
+        double ssd;
+        int i, j;
+
+        const unsigned char *const u1 = (const unsigned char *) q1;
+        const unsigned char *const u2 = (const unsigned char *) q2;
+
+        ssd = 0.0;
+        for (i = 0; i < DESC_NUMEL; i += DESC_SSD_BLOCK) {
+
+                __m256i acc;
+                __m128i sum;
+
+                acc = _mm256_setzero_si256();
+                for (j = i; j < i + DESC_SSD_BLOCK; j += 16) {
+                        const __m256i diff = _mm256_sub_epi16(
+                                _mm256_cvtepu8_epi16(_mm_loadu_si128(
+                                        (const __m128i *) (u1 + j))),
+                                _mm256_cvtepu8_epi16(_mm_loadu_si128(
+                                        (const __m128i *) (u2 + j))));
+                        acc = _mm256_add_epi32(acc, 
+                                _mm256_madd_epi16(diff, diff));
+                }
+
+                // Horizontal sum
+                sum = _mm_add_epi32(_mm256_castsi256_si128(acc), 
+                        _mm256_extracti128_si256(acc, 1));
+                sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+                sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+                ssd += (double) _mm_cvtsi128_si32(sum);
+
+                // Early termination
+                if (ssd > thresh)
+                        break;
+        }
+
+        return ssd;
+}
+
+/* As quant_ssd_float16, using F16C, AVX and FMA instructions. */
+__attribute__((target("avx2,fma,f16c")))
+static double quant_ssd_float16_f16c(const void *const q1, 
+        const void *const q2, const double thresh) {
+
+        double ssd;
+        int i, j;
+
+        const unsigned short *const h1 = (const unsigned short *) q1;
+        const unsigned short *const h2 = (const unsigned short *) q2;
+
+        ssd = 0.0;
+        for (i = 0; i < DESC_NUMEL; i += DESC_SSD_BLOCK) {
+
+                __m256 acc;
+                __m128 sum;
+
+                acc = _mm256_setzero_ps();
+                for (j = i; j < i + DESC_SSD_BLOCK; j += 8) {
+                        const __m256 diff = _mm256_sub_ps(
+                                _mm256_cvtph_ps(_mm_loadu_si128(
+                                        (const __m128i *) (h1 + j))),
+                                _mm256_cvtph_ps(_mm_loadu_si128(
+                                        (const __m128i *) (h2 + j))));
+                        acc = _mm256_fmadd_ps(diff, diff, acc);
+                }
+
+                // Horizontal sum
+                sum = _mm_add_ps(_mm256_castps256_ps128(acc), 
+                        _mm256_extractf128_ps(acc, 1));
+                sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+                sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+                ssd += (double) _mm_cvtss_f32(sum);
+
+                // Early termination
+                if (ssd > thresh)
+                        break;
+        }
+
+        return ssd;
+}
+#endif
+
+/* Helper function to select the quantized SSD kernel for the given type and
+ * CPU. Returns NULL if the type is unknown. */
+static quant_ssd_fn get_quant_ssd(const quant_type type) {
+
+#ifdef SIFT3D_X86_SIMD
+        __builtin_cpu_init();
+#endif
+
+        switch (type) {
+        case QUANT_UINT8:
+#ifdef SIFT3D_X86_SIMD
+                if (__builtin_cpu_supports("avx2"))
+                        return quant_ssd_uint8_avx2;
+#endif
+                return quant_ssd_uint8;
+        case QUANT_FLOAT16:
+#ifdef SIFT3D_X86_SIMD
+                if (__builtin_cpu_supports("avx2") && 
+                        __builtin_cpu_supports("fma") &&
+                        __builtin_cpu_supports("f16c"))
+                        return quant_ssd_float16_f16c;
+#endif
+                return quant_ssd_float16;
+        default:
+                return NULL;
+        }
+}
+
+/* Like match_desc, but for quantized descriptors, using the kernel ssd. */
+static int match_quant(const void *const q, 
+        const SIFT3D_Quant_store *const store, const quant_ssd_fn ssd_fn,
+        const float nn_thresh) {
+
+        double ssd_best, ssd_nearest;
+        int i, best;
+
+        const size_t stride = DESC_NUMEL * quant_type_get_size(store->type);
+
+        ssd_best = ssd_nearest = DBL_MAX;
+        best = -1;
+        for (i = 0; i < store->num; i++) {
+
+                const double ssd = ssd_fn(q, (const unsigned char *) 
+                        store->data + i * stride, ssd_nearest);
+
+                // Compare to the best matches
+                if (ssd < ssd_best) {
+                        best = i;
+                        ssd_nearest = ssd_best;
+                        ssd_best = ssd;
+                } else  {
+                        ssd_nearest = SIFT3D_MIN(ssd_nearest, ssd);
+                }
+        }
+
+        // Reject a match if the nearest neighbor is too close
+        if (best < 0 || ssd_best / ssd_nearest > nn_thresh * nn_thresh)
+                return -1;
+
+        return best;
+}
+
+/* Like SIFT3D_nn_match, but for quantized descriptors. Both stores must have
+ * the same element type.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int SIFT3D_nn_match_quant(const SIFT3D_Quant_store *const q1,
+        const SIFT3D_Quant_store *const q2, const float nn_thresh, 
+        int **const matches) {
+
+        quant_ssd_fn ssd_fn;
+        int i;
+
+        const int num = (int) q1->num;
+        const size_t stride = DESC_NUMEL * quant_type_get_size(q1->type);
+
+        // Verify inputs
+        if (num < 1) {
+                SIFT3D_ERR("SIFT3D_nn_match_quant: invalid number of "
+                        "descriptors in q1: %d \n", num);
+                return SIFT3D_FAILURE;
+        }
+        if (q1->type != q2->type) {
+                SIFT3D_ERR("SIFT3D_nn_match_quant: the stores have different "
+                        "element types \n");
+                return SIFT3D_FAILURE;
+        }
+        if ((ssd_fn = get_quant_ssd(q1->type)) == NULL) {
+                SIFT3D_ERR("SIFT3D_nn_match_quant: unknown element type: "
+                        "%d \n", q1->type);
+                return SIFT3D_FAILURE;
+        }
+
+	// Resize the matches array (num cannot be zero)
+	if ((*matches = (int *) SIFT3D_safe_realloc(*matches, 
+		num * sizeof(int))) == NULL) {
+	    SIFT3D_ERR("SIFT3D_nn_match_quant: out of memory! \n");
+	    return SIFT3D_FAILURE;
+	}
+
+	// Exhaustive search for matches
+#pragma omp parallel for num_threads(SIFT3D_team_size())
+	for (i = 0; i < num; i++) {
+
+                const void *const desc1 = (const unsigned char *) q1->data + 
+                        i * stride;
+                int *const match = *matches + i;
+
+                // Forward matching pass
+                *match = match_quant(desc1, q2, ssd_fn, nn_thresh);
+
+                // We are done if there was no match
+                if (*match < 0)
+                        continue;
+
+                // Check for forward-backward consistency
+                if (match_quant((const unsigned char *) q2->data + 
+                        *match * stride, q1, ssd_fn, nn_thresh) != i) {
+                        *match = -1;
+                }
+        }
+
+	return SIFT3D_SUCCESS;
+}
+
+/* Like SIFT3D_matches_to_Mat_rm, but for quantized descriptors. */
+int SIFT3D_quant_matches_to_Mat_rm(const SIFT3D_Quant_store *const q1,
+        const SIFT3D_Quant_store *const q2, const int *const matches,
+        Mat_rm *const match1, Mat_rm *const match2) {
+
+        int i, j, num_matches;
+
+        const int num = (int) q1->num;
+
+        // Resize matrices 
+        match1->num_rows = match2->num_rows = num;
+        match1->num_cols = match2->num_cols = IM_NDIMS;
+        match1->type = match2->type = SIFT3D_DOUBLE;
+        if (resize_Mat_rm(match1) || resize_Mat_rm(match2))
+                return SIFT3D_FAILURE;
+
+        // Populate the matrices
+        num_matches = 0;
+        for (i = 0; i < num; i++) {
+
+                if (matches[i] == -1)
+                        continue;
+
+                for (j = 0; j < IM_NDIMS; j++) {
+                        SIFT3D_MAT_RM_GET(match1, num_matches, j, double) = 
+                                q1->coords[4 * i + j];
+                        SIFT3D_MAT_RM_GET(match2, num_matches, j, double) = 
+                                q2->coords[4 * matches[i] + j];
+                }
+                num_matches++;
+        }
+
+        // Release extra memory
+        match1->num_rows = match2->num_rows = num_matches;
+        if (resize_Mat_rm(match1) || resize_Mat_rm(match2))
+                return SIFT3D_FAILURE;
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Draw the matches. 
+ * 
+ * Inputs:
+ * -left - lefthand-side image
+ * -right - righthand-side image
+ * -keys_left - Keypoints from "left" (can be NULL if keys is NULL) 
+ * -keys_right - Keypoints from "right" (can be NULL if keys is NULL)
+ * -match_left - Matches from "left" (can be NULL if lines is NULL)
+ * -match_right - Matches from "right" (can be NULL if lines is NULL)
+ * 
+ * Outputs:
+ * -concat - Concatenated image (NULL if not needed)
+ * -keys - Keypoints from concat (NULL is not needed)
+ * -lines - Lines between matching keypoints in concat (NULL if not needed)
+ * It is an error if all outputs are NULL.
+ *
+ * Return:
+ * SIFT3D_SUCCESS or SIFT3D_FAILURE
+ */
+int draw_matches(const Image *const left, const Image *const right,
+                 const Mat_rm *const keys_left, const Mat_rm *const keys_right,
+		 const Mat_rm *const match_left, 
+                 const Mat_rm *const match_right, Image *const concat, 
+                 Image *const keys, Image *const lines) {
+
+        Image concat_temp, left_padded, right_padded;
+	Mat_rm keys_right_draw, keys_left_draw, keys_draw, match_right_draw;
+	int i;
+
+        const double right_pad = (double) left->nx;
+        const int ny_pad = SIFT3D_MAX(right->ny, left->ny);
+	const int nz_pad = SIFT3D_MAX(right->nz, left->nz);
+
+        // Choose which image to use for concatenation 
+        Image *const concat_arg = concat == NULL ? &concat_temp : concat;
+
+        // Verify inputs
+        if (concat == NULL && keys == NULL && lines == NULL) {
+                SIFT3D_ERR("draw_matches: all outputs are NULL \n");
+                return SIFT3D_FAILURE;
+        }
+        if (keys_left == NULL && keys != NULL) {
+                SIFT3D_ERR("draw_matches: keys_left is NULL but keys is "
+                        "not \n");
+                return SIFT3D_FAILURE;
+        }
+        if (keys_right == NULL && keys != NULL) {
+                SIFT3D_ERR("draw_matches: keys_right is NULL but keys is "
+                        "not \n");
+                return SIFT3D_FAILURE;
+        }
+        if (match_left == NULL && lines != NULL) {
+                SIFT3D_ERR("draw_matches: match_left is NULL but lines "
+                        "is not \n");
+                return SIFT3D_FAILURE;
+        }
+        if (match_right == NULL && lines != NULL) {
+                SIFT3D_ERR("draw_matches: match_right is NULL but lines "
+                        "is not \n");
+                return SIFT3D_FAILURE;
+        }
+
+	// Initialize intermediates		
+        init_im(&concat_temp);
+        init_im(&left_padded);
+        init_im(&right_padded);
+        if (init_Mat_rm(&keys_right_draw, 0, 0, SIFT3D_DOUBLE, 
+		SIFT3D_FALSE) ||
+	        init_Mat_rm(&match_right_draw, 0, 0, SIFT3D_DOUBLE, 
+			SIFT3D_FALSE) ||
+                init_Mat_rm(&keys_left_draw, 0, 0, SIFT3D_DOUBLE, 
+			SIFT3D_FALSE) ||
+                init_Mat_rm(&keys_draw, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE))
+	        return SIFT3D_FAILURE;
+
+        // Pad the images to be the same in all dimensions but x
+	if (init_im_with_dims(&right_padded, right->nx, ny_pad, nz_pad, 1) || 
+	        init_im_with_dims(&left_padded, left->nx, ny_pad, nz_pad, 1) ||
+	   	im_pad(right, &right_padded) || 
+	    	im_pad(left, &left_padded)) {
+                SIFT3D_ERR("draw_matches: unable to pad images \n");
+                return SIFT3D_FAILURE;
+	}
+
+	// Draw a concatenated image
+	if (im_concat(&left_padded, &right_padded, 0, concat_arg)) {
+                SIFT3D_ERR("draw_matches: Could not concatenate the "
+                        "images \n");
+                goto draw_matches_quit;
+        }
+
+        // Optionally draw the keypoints
+        if (keys != NULL) { 
+
+                // Convert inputs to double
+                if (convert_Mat_rm(keys_right, &keys_right_draw, 
+			SIFT3D_DOUBLE) ||
+                        convert_Mat_rm(keys_left, &keys_left_draw, 
+				SIFT3D_DOUBLE))
+                        goto draw_matches_quit;
+       
+                // Pad the x-coordinate 
+                for (i = 0; i < keys_right->num_rows; i++) {
+                        SIFT3D_MAT_RM_GET(&keys_right_draw, i, 0, double) += 
+                                right_pad; 
+                }
+
+                // Concatenate the points
+                if (concat_Mat_rm(&keys_left_draw, &keys_right_draw,
+                        &keys_draw, 0))
+                        goto draw_matches_quit;
+
+                // Draw the points
+                if (draw_points(&keys_draw, SIFT3D_IM_GET_DIMS(concat_arg), 
+                        1, keys))
+                        goto draw_matches_quit;
+        }
+
+	// Optionally draw the lines 
+        if (lines != NULL) {
+
+                // Convert input to double
+                if (convert_Mat_rm(match_right, &match_right_draw, 
+			SIFT3D_DOUBLE))
+                        goto draw_matches_quit;
+
+                // Pad the x-coordinate 
+                for (i = 0; i < match_right->num_rows; i++) {
+                        SIFT3D_MAT_RM_GET(&match_right_draw, i, 0, double) += 
+                                right_pad;
+                }
+
+                // Draw the lines
+                if (draw_lines(match_left, &match_right_draw, 
+                        SIFT3D_IM_GET_DIMS(concat_arg), lines))
+                        goto draw_matches_quit;
+        }
+
+        // Clean up
+        im_free(&concat_temp);
+        im_free(&left_padded);
+        im_free(&right_padded); 
+        cleanup_Mat_rm(&keys_right_draw); 
+        cleanup_Mat_rm(&keys_left_draw); 
+        cleanup_Mat_rm(&keys_draw); 
+        cleanup_Mat_rm(&match_right_draw); 
+	return SIFT3D_SUCCESS;
+
+draw_matches_quit:
+        im_free(&concat_temp);
+        im_free(&left_padded);
+        im_free(&right_padded); 
+        cleanup_Mat_rm(&keys_right_draw);
+        cleanup_Mat_rm(&keys_left_draw); 
+        cleanup_Mat_rm(&keys_draw); 
+        cleanup_Mat_rm(&match_right_draw);
+        return SIFT3D_FAILURE;
+}
+
+/* Write a Keypoint_store to a text file. The keypoints are stored in a matrix
+ * (.csv, .csv.gz), where each keypoint is a row. The elements of each row are
+ * as follows:
+ *
+ * x y z o s ori11 ori12 ... orinn
+ *
+ * x - the x-coordinate
+ * y - the y-coordinate
+ * z - the z-coordinate
+ * o - the pyramid octave. To convert to image coordinates, multiply x,y,z by 
+ *      pow(2, o)
+ * s - the scale coordinate
+ * ori(ij) - the ith row, jth column of the orientation matrix 
+ *
+ * If the file extension is .sift3d, the keypoints are instead written to a 
+ * binary feature file. See write_SIFT3D_features. */
+int write_Keypoint_store(const char *path, const Keypoint_store *const kp) {
+
+        Mat_rm mat;
+	int i, i_R, j_R;
+
+        // Keypoint data format constants
+        const int kp_x = 0; // column of x-coordinate
+        const int kp_y = 1; // column of y-coordinate
+        const int kp_z = 2; // column of z-coordinate
+        const int kp_o = 3; // column of octave index
+        const int kp_s = 4; // column of s-coordinate
+        const int kp_ori = 5; // first column of the orientation matrix
+        const int ori_numel = IM_NDIMS * IM_NDIMS; // Number of orientation 
+                // elements
+        const int num_rows = kp->slab.num;
+        const int num_cols = kp_ori + ori_numel;
+
+        // Write binary feature files separately
+        if (is_features_path(path))
+                return write_SIFT3D_features(path, kp, NULL);
+
+        // Initialize the matrix
+        if (init_Mat_rm(&mat, num_rows, num_cols, SIFT3D_DOUBLE, 
+		SIFT3D_FALSE))
+                return SIFT3D_FAILURE;
+       
+        // Write the keypoints 
+        for (i = 0; i < num_rows; i++) {
+
+                const Keypoint *const key = kp->buf + i;
+                const Mat_rm *const R = &key->R;
+
+                // Write the coordinates 
+                SIFT3D_MAT_RM_GET(&mat, i, kp_x, double) = key->xd;
+                SIFT3D_MAT_RM_GET(&mat, i, kp_y, double) = key->yd; 
+                SIFT3D_MAT_RM_GET(&mat, i, kp_z, double) = key->zd; 
+                SIFT3D_MAT_RM_GET(&mat, i, kp_o, double) = key->o; 
+                SIFT3D_MAT_RM_GET(&mat, i, kp_s, double) = key->sd;
+
+                // Write the orientation matrix
+                SIFT3D_MAT_RM_LOOP_START(R, i_R, j_R)
+
+                        const int kp_idx = kp_ori + 
+                                SIFT3D_MAT_RM_GET_IDX(R, i_R, j_R);
+        
+                        SIFT3D_MAT_RM_GET(&mat, i, kp_idx, double) = 
+                                (double) SIFT3D_MAT_RM_GET(R, i_R, j_R, float);
+
+                SIFT3D_MAT_RM_LOOP_END
+        }
+
+        // Write the matrix 
+        if (write_Mat_rm(path, &mat))
+                goto write_kp_quit;
+
+        // Clean up
+        cleanup_Mat_rm(&mat);
+
+        return SIFT3D_SUCCESS;
+
+write_kp_quit:
+        cleanup_Mat_rm(&mat);
+        return SIFT3D_FAILURE;
+}
+
+/* Write SIFT3D descriptors to a text file.
+ * See SIFT3D_Descriptor_store_to_Mat_rm for the file format. If the file
+ * extension is .sift3d, the descriptors are instead written to a binary 
+ * feature file. See write_SIFT3D_features. */
+int write_SIFT3D_Descriptor_store(const char *path, 
+        const SIFT3D_Descriptor_store *const desc) {
+
+        Mat_rm mat;
+
+        // Write binary feature files separately
+        if (is_features_path(path))
+                return write_SIFT3D_features(path, NULL, desc);
+
+        // Initialize the matrix
+        if (init_Mat_rm(&mat, 0, 0, SIFT3D_FLOAT, SIFT3D_FALSE))
+                return SIFT3D_FAILURE;
+     
+        // Write the data into the matrix 
+        if (SIFT3D_Descriptor_store_to_Mat_rm(desc, &mat))
+                goto write_desc_quit;
+
+        // Write the matrix to the file
+        if (write_Mat_rm(path, &mat))
+                goto write_desc_quit;
 
         // Clean up
-        im_free(&temp);
-        cleanup_Gauss_filter(&gauss);
-
+        cleanup_Mat_rm(&mat);
         return SIFT3D_SUCCESS;
 
-dense_extract_quit:
-        im_free(&temp);
-        cleanup_Gauss_filter(&gauss);
+write_desc_quit:
+        cleanup_Mat_rm(&mat);
         return SIFT3D_FAILURE;
 }
 
-/* Copy a voxel to a Hist. Does no bounds checking. */
-static void vox2hist(const Image *const im, const int x, const int y,
-        const int z, Hist *const hist) {
+/* Helper function to check if path ends in the binary feature file 
+ * extension. */
+static int is_features_path(const char *path) {
 
-        int c;
+        const size_t len = strlen(path);
+        const size_t ext_len = strlen(ext_features);
 
-        for (c = 0; c < HIST_NUMEL; c++) {
-                hist->bins[c] = SIFT3D_IM_GET_VOX(im, x, y, z, c);
-        }
+        return len > ext_len && !strcmp(path + len - ext_len, ext_features);
 }
 
-/* Copy a Hist to a voxel. Does no bounds checking. */
-static void hist2vox(Hist *const hist, const Image *const im, const int x, 
-        const int y, const int z) {
+/* Helper function to write zeros to file until it reaches offset. */
+static int features_pad(FILE *const file, const uint64_t offset) {
 
-        int c;
-        
-        for (c = 0; c < HIST_NUMEL; c++) {
-                SIFT3D_IM_GET_VOX(im, x, y, z, c) = hist->bins[c];
+        long pos;
+
+        if ((pos = ftell(file)) < 0)
+                return SIFT3D_FAILURE;
+
+        for ( ; (uint64_t) pos < offset; pos++) {
+                if (fputc(0, file) == EOF)
+                        return SIFT3D_FAILURE;
         }
+
+        return SIFT3D_SUCCESS;
 }
 
-/* As in extract_dense_descrip, but with rotation invariance */
-static int extract_dense_descriptors_rotate(SIFT3D *const sift3d,
-        const Image *const in, Image *const desc) {
+/* Helper function to write a binary feature file. See 
+ * write_SIFT3D_features for the file format. Any of kp, desc and quant may
+ * be NULL, but at most one of desc and quant can be provided. */
+static int write_features(const char *path, const Keypoint_store *const kp, 
+        const SIFT3D_Descriptor_store *const desc,
+        const SIFT3D_Quant_store *const quant) {
 
-        Hist hist;
-        Mat_rm R, Id;
-        Mat_rm *ori;
-        int i, x, y, z;
+        Features_header header;
+        FILE *file;
+        uint64_t offset;
+        size_t i, num_desc, data_size;
 
-        // Initialize the identity matrix
-        if (init_Mat_rm(&Id, 3, 3, SIFT3D_FLOAT, SIFT3D_TRUE)) {
+        // Verify inputs
+        if (desc != NULL && quant != NULL) {
+                SIFT3D_ERR("write_features: cannot write both float and "
+                        "quantized descriptors \n");
                 return SIFT3D_FAILURE;
         }
-        for (i = 0; i < 3; i++) {       
-                SIFT3D_MAT_RM_GET(&Id, i, i, float) = 1.0f;
-        }
 
-        // Initialize the rotation matrix
-        if (init_Mat_rm(&R, 3, 3, SIFT3D_FLOAT, SIFT3D_TRUE)) {
-                cleanup_Mat_rm(&Id);
+        // Fill in the header
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, features_magic, sizeof(header.magic));
+        header.version = SIFT3D_FEATURES_VERSION;
+        header.byte_order = features_byte_order;
+        header.desc_numel = DESC_NUMEL;
+        header.num_keys = kp == NULL ? 0 : kp->slab.num;
+        if (quant != NULL) {
+                header.dtype = quant->type == QUANT_UINT8 ? 
+                        FEATURES_DTYPE_UINT8 : FEATURES_DTYPE_FLOAT16;
+                header.desc_size = DESC_NUMEL * 
+                        quant_type_get_size(quant->type);
+                num_desc = quant->num;
+                header.nx = quant->nx;
+                header.ny = quant->ny;
+                header.nz = quant->nz;
+        } else {
+                header.dtype = FEATURES_DTYPE_FLOAT32;
+                header.desc_size = sizeof(SIFT3D_Descriptor);
+                num_desc = desc == NULL ? 0 : desc->num;
+                if (desc != NULL) {
+                        header.nx = desc->nx;
+                        header.ny = desc->ny;
+                        header.nz = desc->nz;
+                } else if (kp != NULL) {
+                        header.nx = kp->nx;
+                        header.ny = kp->ny;
+                        header.nz = kp->nz;
+                }
+        }
+        header.num_desc = num_desc;
+        data_size = (size_t) header.desc_size * num_desc;
+
+        // Lay out the sections
+        offset = FEATURES_ALIGN(sizeof(header));
+        header.keys_offset = offset;
+        offset = FEATURES_ALIGN(offset + header.num_keys * 
+                sizeof(Features_key));
+        header.desc_offset = offset;
+        offset = FEATURES_ALIGN(offset + data_size);
+        header.coords_offset = quant == NULL ? 0 : offset;
+
+        // Open the file
+        if (make_path(path) || (file = fopen(path, "wb")) == NULL) {
+                SIFT3D_ERR("write_features: failed to open %s \n", path);
                 return SIFT3D_FAILURE;
         }
 
-        // Iterate over each voxel
-        SIFT3D_IM_LOOP_START(in, x, y, z)
+        // Write the header
+        if (fwrite(&header, sizeof(header), 1, file) != 1)
+                goto write_features_quit;
 
-                const Cvec vcenter = {x, y, z}; 
+        // Write the keypoints
+        if (features_pad(file, header.keys_offset))
+                goto write_features_quit;
+        for (i = 0; i < header.num_keys; i++) {
 
-                const double ori_sigma = sift3d->gpyr.sigma0 * ori_sig_fctr;
-                const double desc_sigma = sift3d->gpyr.sigma0 * 
-                        desc_sig_fctr / NHIST_PER_DIM;
+                Features_key rec;
+                int j, k;
 
-                // Attempt to assign an orientation
-                switch (assign_orientation_thresh(in, &vcenter, ori_sigma,
-                                      sift3d->corner_thresh, &R)) {
-                        case SIFT3D_SUCCESS:
-                                // Use the assigned orientation
-                                ori = &R;
-                                break;
-                        case REJECT:
-                                // Default to identity
-                                ori = &Id;
-                                break;
-                        default:
-                                // Unexpected error
-                                goto dense_rotate_quit;
-                }
+                const Keypoint *const key = kp->buf + i;
 
-                // Extract the descriptor
-                if (extract_dense_descrip_rotate(sift3d, in, &vcenter, 
-                        desc_sigma, ori, &hist))
-                        goto dense_rotate_quit;
+                memset(&rec, 0, sizeof(rec));
+                rec.xd = key->xd;
+                rec.yd = key->yd;
+                rec.zd = key->zd;
+                rec.sd = key->sd;
+                rec.o = key->o;
+                rec.s = key->s;
+                SIFT3D_MAT_RM_LOOP_START(&key->R, j, k)
+                        rec.r_data[SIFT3D_MAT_RM_GET_IDX(&key->R, j, k)] = 
+                                SIFT3D_MAT_RM_GET(&key->R, j, k, float);
+                SIFT3D_MAT_RM_LOOP_END
 
-                // Copy the descriptor to the image channels
-                hist2vox(&hist, desc, x, y, z);
+                if (fwrite(&rec, sizeof(rec), 1, file) != 1)
+                        goto write_features_quit;
+        }
 
-        SIFT3D_IM_LOOP_END
+        // Write the descriptors
+        if (features_pad(file, header.desc_offset))
+                goto write_features_quit;
+        if (num_desc > 0 && fwrite(quant == NULL ? (const void *) desc->buf :
+                quant->data, 1, data_size, file) != data_size)
+                goto write_features_quit;
+
+        // Write the coordinates of quantized descriptors
+        if (quant != NULL && (features_pad(file, header.coords_offset) ||
+                fwrite(quant->coords, 4 * sizeof(double), num_desc, file) != 
+                num_desc))
+                goto write_features_quit;
+
+        if (fclose(file)) {
+                SIFT3D_ERR("write_features: failed to close %s \n", path);
+                return SIFT3D_FAILURE;
+        }
 
-        // Clean up
-        cleanup_Mat_rm(&R);
-        cleanup_Mat_rm(&Id);
         return SIFT3D_SUCCESS;
 
-dense_rotate_quit:
-        // Clean up and return an error condition 
-        cleanup_Mat_rm(&R);
-        cleanup_Mat_rm(&Id);
+write_features_quit:
+        SIFT3D_ERR("write_features: failed to write %s \n", path);
+        fclose(file);
         return SIFT3D_FAILURE;
 }
 
-/* Convert a keypoint store to a matrix. 
- * Output format:
- *  [x1 y1 z1]
- *  |   ...  |
- *  [xn yn zn] 
- * 
- * mat must be initialized. */
-int Keypoint_store_to_Mat_rm(const Keypoint_store *const kp, Mat_rm *const mat) {
-
-    int i;
+/* Write keypoints and descriptors to a binary feature file. This is much
+ * faster to write and read than the text formats, and preserves the exact
+ * values. The file extension should be ".sift3d". Either of kp and desc may 
+ * be NULL. If both are provided, keypoint i should correspond to descriptor 
+ * i, as output by SIFT3D_extract_descriptors.
+ *
+ * File format (version 1), in the byte order of the writing machine:
+ *   Header: see the Features_header struct in sift.c, including the counts,
+ *      the image dimensions, the descriptor element type, and the byte
+ *      offset of each section.
+ *   Keypoints: num_keys records of [x y z scale R(9) octave level], the 
+ *      same as write_Keypoint_store.
+ *   Descriptors: for float descriptors, num_desc SIFT3D_Descriptor structs,
+ *      so that they can be used in place. For quantized descriptors, the
+ *      data of a SIFT3D_Quant_store, followed by its coordinates.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int write_SIFT3D_features(const char *path, const Keypoint_store *const kp, 
+        const SIFT3D_Descriptor_store *const desc) {
+        return write_features(path, kp, desc, NULL);
+}
 
-    const int num = kp->slab.num;
+/* The same as write_SIFT3D_features, but writes quantized descriptors. */
+int write_SIFT3D_Quant_features(const char *path, 
+        const Keypoint_store *const kp, const SIFT3D_Quant_store *const quant) {
+        return write_features(path, kp, NULL, quant);
+}
 
-    // Resize mat
-    mat->num_rows = num;
-    mat->num_cols = IM_NDIMS;
-    mat->type = SIFT3D_DOUBLE;
-    if (resize_Mat_rm(mat))
-	return SIFT3D_FAILURE;
+/* Helper function to validate the header of a binary feature file in map.
+ * Returns a pointer to the header on success, NULL otherwise. */
+static const Features_header *features_get_header(const File_map *const map,
+        const char *path) {
 
-    // Build the matrix
-    for (i = 0; i < num; i++) {
+        const Features_header *const header = 
+                (const Features_header *) map->addr;
 
-        const Keypoint *const key = kp->buf + i;
+        // Check the identity and version of the file
+        if (map->size < sizeof(Features_header) || 
+                memcmp(header->magic, features_magic, sizeof(header->magic))) {
+                SIFT3D_ERR("read_SIFT3D_features: %s is not a SIFT3D feature "
+                        "file \n", path);
+                return NULL;
+        }
+        if (header->version != SIFT3D_FEATURES_VERSION) {
+                SIFT3D_ERR("read_SIFT3D_features: %s has unsupported version "
+                        "%u \n", path, (unsigned int) header->version);
+                return NULL;
+        }
+        if (header->byte_order != features_byte_order) {
+                SIFT3D_ERR("read_SIFT3D_features: %s was written with a "
+                        "different byte order \n", path);
+                return NULL;
+        }
+        if (header->desc_numel != DESC_NUMEL) {
+                SIFT3D_ERR("read_SIFT3D_features: %s has descriptors of "
+                        "length %u, expected %d \n", path, 
+                        (unsigned int) header->desc_numel, DESC_NUMEL);
+                return NULL;
+        }
 
-        // Adjust the coordinates to the base octave
-        const double coord_factor = ldexp(1.0, key->o);
+        // Check the element type
+        switch (header->dtype) {
+        case FEATURES_DTYPE_FLOAT32:
+                if (header->desc_size == sizeof(SIFT3D_Descriptor))
+                        break;
+                SIFT3D_ERR("read_SIFT3D_features: %s has an incompatible "
+                        "descriptor layout \n", path);
+                return NULL;
+        case FEATURES_DTYPE_UINT8:
+        case FEATURES_DTYPE_FLOAT16:
+                if (header->desc_size == DESC_NUMEL * quant_type_get_size(
+                        header->dtype == FEATURES_DTYPE_UINT8 ? QUANT_UINT8 : 
+                        QUANT_FLOAT16) && (header->num_desc == 0 || 
+                        header->coords_offset != 0))
+                        break;
+                /* fall through */
+        default:
+                SIFT3D_ERR("read_SIFT3D_features: %s has invalid descriptor "
+                        "type %u \n", path, (unsigned int) header->dtype);
+                return NULL;
+        }
 
-	SIFT3D_MAT_RM_GET(mat, i, 0, double) = coord_factor * key->xd;
-	SIFT3D_MAT_RM_GET(mat, i, 1, double) = coord_factor * key->yd;
-	SIFT3D_MAT_RM_GET(mat, i, 2, double) = coord_factor * key->zd;
-    }
+        // Check that the sections fit in the file
+        if (header->keys_offset + header->num_keys * sizeof(Features_key) > 
+                map->size ||
+                header->desc_offset + header->num_desc * header->desc_size > 
+                map->size ||
+                (header->coords_offset != 0 && header->coords_offset + 
+                header->num_desc * 4 * sizeof(double) > map->size) ||
+                header->keys_offset % FEATURES_ALIGNMENT ||
+                header->desc_offset % FEATURES_ALIGNMENT ||
+                header->coords_offset % FEATURES_ALIGNMENT) {
+                SIFT3D_ERR("read_SIFT3D_features: %s is truncated or "
+                        "corrupt \n", path);
+                return NULL;
+        }
 
-    return SIFT3D_SUCCESS;
+        return header;
 }
 
-/* Convert SIFT3D desriptors to a coordinate matrix. This function has the same
- * output format as Keypoint_store_to_Mat_rm */
-int SIFT3D_Descriptor_coords_to_Mat_rm(
-        const SIFT3D_Descriptor_store *const store, 
-        Mat_rm *const mat) {
-
-        int i;
+/* Helper function to copy the keypoints from a mapped feature file. */
+static int features_read_keys(const Features_header *const header, 
+        Keypoint_store *const kp) {
 
-	const int num_rows = store->num;
-        const int num_cols = IM_NDIMS;
+        size_t i;
 
-	// Verify inputs
-	if (num_rows < 1) {
-		printf("SIFT3D_Descriptor_coords_to_Mat_rm: invalid number of "
-		       "descriptors: %d \n", num_rows);
-		return SIFT3D_FAILURE;
-	}
+        const Features_key *const recs = (const Features_key *) 
+                ((const char *) header + header->keys_offset);
 
-        // Resize the output
-        mat->type = SIFT3D_DOUBLE;
-        mat->num_rows = num_rows;
-        mat->num_cols = num_cols;
-        if (resize_Mat_rm(mat))
+        if (resize_Keypoint_store(kp, header->num_keys))
                 return SIFT3D_FAILURE;
+        kp->nx = header->nx;
+        kp->ny = header->ny;
+        kp->nz = header->nz;
 
-        // Copy the data
-        for (i = 0; i < num_rows; i++) {
+        for (i = 0; i < header->num_keys; i++) {
 
-		const SIFT3D_Descriptor *const desc = store->buf + i;
+                int j, k;
 
-                SIFT3D_MAT_RM_GET(mat, i, 0, double) = desc->xd;
-                SIFT3D_MAT_RM_GET(mat, i, 1, double) = desc->yd;
-                SIFT3D_MAT_RM_GET(mat, i, 2, double) = desc->zd;
+                const Features_key *const rec = recs + i;
+                Keypoint *const key = kp->buf + i;
+
+                key->xd = rec->xd;
+                key->yd = rec->yd;
+                key->zd = rec->zd;
+                key->sd = rec->sd;
+                key->o = rec->o;
+                key->s = rec->s;
+                SIFT3D_MAT_RM_LOOP_START(&key->R, j, k)
+                        SIFT3D_MAT_RM_GET(&key->R, j, k, float) = 
+                                rec->r_data[SIFT3D_MAT_RM_GET_IDX(&key->R, j, 
+                                        k)];
+                SIFT3D_MAT_RM_LOOP_END
         }
 
         return SIFT3D_SUCCESS;
 }
 
-/* Convert SIFT3D descriptors to a matrix.
+/* Helper function to point view at the descriptors in a mapped feature 
+ * file, without copying. desc or quant is filled in, depending on the type
+ * of the file. The other is left untouched. Either may be NULL, in which 
+ * case it is an error for the file to have that type. */
+static int features_view_desc(const Features_header *const header, 
+        const char *path, SIFT3D_Descriptor_store *const desc, 
+        SIFT3D_Quant_store *const quant) {
+
+        const char *const base = (const char *) header;
+
+        if (header->dtype == FEATURES_DTYPE_FLOAT32) {
+                if (desc == NULL) {
+                        SIFT3D_ERR("read_SIFT3D_features: %s contains float "
+                                "descriptors \n", path);
+                        return SIFT3D_FAILURE;
+                }
+                desc->buf = (SIFT3D_Descriptor *) (base + header->desc_offset);
+                desc->num = header->num_desc;
+                desc->nx = header->nx;
+                desc->ny = header->ny;
+                desc->nz = header->nz;
+        } else {
+                if (quant == NULL) {
+                        SIFT3D_ERR("read_SIFT3D_features: %s contains "
+                                "quantized descriptors \n", path);
+                        return SIFT3D_FAILURE;
+                }
+                quant->type = header->dtype == FEATURES_DTYPE_UINT8 ? 
+                        QUANT_UINT8 : QUANT_FLOAT16;
+                quant->data = (void *) (base + header->desc_offset);
+                quant->coords = (double *) (base + header->coords_offset);
+                quant->num = header->num_desc;
+                quant->nx = header->nx;
+                quant->ny = header->ny;
+                quant->nz = header->nz;
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Read a binary feature file, as written by write_SIFT3D_features, 
+ * copying its contents. Either of kp and desc may be NULL, in which case 
+ * that part of the file is ignored. kp and desc must be initialized. If the
+ * file contains quantized descriptors, they are converted to floating point.
  *
- * Output format:
- *  [x y z el0 el1 ... el767]
- * Each row is a feature descriptor. [x y z] are the coordinates in image
- * space, and [el0 el1 ... el767 are the 768 dimensions of the descriptor.
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int read_SIFT3D_features(const char *path, Keypoint_store *const kp, 
+        SIFT3D_Descriptor_store *const desc) {
+
+        File_map map;
+        SIFT3D_Descriptor_store view;
+        SIFT3D_Quant_store quant;
+        const Features_header *header;
+
+        init_File_map(&map);
+        if (map_file(path, &map) || 
+                (header = features_get_header(&map, path)) == NULL)
+                goto read_features_quit;
+
+        // Copy the keypoints
+        if (kp != NULL && features_read_keys(header, kp))
+                goto read_features_quit;
+
+        // Copy the descriptors. A file without any, such as the features of
+        // an image with no keypoints, gives an empty store.
+        if (desc != NULL && header->num_desc == 0) {
+                desc->num = 0;
+                desc->nx = header->nx;
+                desc->ny = header->ny;
+                desc->nz = header->nz;
+        } else if (desc != NULL) {
+                if (features_view_desc(header, path, &view, &quant))
+                        goto read_features_quit;
+                if (header->dtype == FEATURES_DTYPE_FLOAT32) {
+                        if (resize_SIFT3D_Descriptor_store(desc, view.num))
+                                goto read_features_quit;
+                        memcpy(desc->buf, view.buf, view.num * 
+                                sizeof(SIFT3D_Descriptor));
+                        desc->nx = view.nx;
+                        desc->ny = view.ny;
+                        desc->nz = view.nz;
+                } else if (dequantize_SIFT3D_Quant_store(&quant, desc)) {
+                        goto read_features_quit;
+                }
+        }
+
+        cleanup_File_map(&map);
+        return SIFT3D_SUCCESS;
+
+read_features_quit:
+        cleanup_File_map(&map);
+        return SIFT3D_FAILURE;
+}
+
+/* Map the descriptors of a binary feature file into memory, without 
+ * copying them. On success, desc is a read-only view into map, which must
+ * be initialized. The view remains valid until cleanup_File_map is called
+ * on map. Do not call cleanup_SIFT3D_Descriptor_store on the view. If kp is
+ * not NULL, the keypoints are copied into it. The file must contain float 
+ * descriptors. 
  *
- * mat must be initialized prior to calling this function. mat will be resized.
- * The type of mat will be changed to float.
- */
-int SIFT3D_Descriptor_store_to_Mat_rm(const SIFT3D_Descriptor_store *const store, 
-				      Mat_rm *const mat) {
-	int i, j, a, p;
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int map_SIFT3D_features(const char *path, File_map *const map,
+        Keypoint_store *const kp, SIFT3D_Descriptor_store *const desc) {
 
-	const int num_rows = store->num;
-	const int num_cols = IM_NDIMS + DESC_NUMEL;
+        const Features_header *header;
 
-	// Verify inputs
-	if (num_rows < 1) {
-		printf("SIFT3D_Descriptor_store_to_Mat_rm: invalid number of "
-		       "descriptors: %d \n", num_rows);
-		return SIFT3D_FAILURE;
-	}
+        if (map_file(path, map) || 
+                (header = features_get_header(map, path)) == NULL ||
+                (kp != NULL && features_read_keys(header, kp)) ||
+                features_view_desc(header, path, desc, NULL)) {
+                cleanup_File_map(map);
+                return SIFT3D_FAILURE;
+        }
 
-	// Resize inputs
-	mat->type = SIFT3D_FLOAT;
-	mat->num_rows = num_rows;
-	mat->num_cols = num_cols;
-	if (resize_Mat_rm(mat))
-		return SIFT3D_FAILURE;
+        return SIFT3D_SUCCESS;
+}
 
-	// Copy the data
-	for (i = 0; i < num_rows; i++) {
+/* The same as map_SIFT3D_features, but for a file containing quantized 
+ * descriptors. Do not call cleanup_SIFT3D_Quant_store on the view. */
+int map_SIFT3D_Quant_features(const char *path, File_map *const map,
+        Keypoint_store *const kp, SIFT3D_Quant_store *const quant) {
 
-		const SIFT3D_Descriptor *const desc = store->buf + i;
+        const Features_header *header;
 
-		// Copy the coordinates
-		SIFT3D_MAT_RM_GET(mat, i, 0, float) = (float) desc->xd;
-		SIFT3D_MAT_RM_GET(mat, i, 1, float) = (float) desc->yd;
-		SIFT3D_MAT_RM_GET(mat, i, 2, float) = (float) desc->zd;
+        if (map_file(path, map) || 
+                (header = features_get_header(map, path)) == NULL ||
+                (kp != NULL && features_read_keys(header, kp)) ||
+                features_view_desc(header, path, NULL, quant)) {
+                cleanup_File_map(map);
+                return SIFT3D_FAILURE;
+        }
 
-		// Copy the feature vector
-		for (j = 0; j < DESC_NUM_TOTAL_HIST; j++) {
-			const Hist *const hist = desc->hists + j;
-			HIST_LOOP_START(a, p)
-                                const int col = DESC_MAT_GET_COL(j, a, p);
-				SIFT3D_MAT_RM_GET(mat, i, col, float) = 
-					HIST_GET(hist, a, p);
-			HIST_LOOP_END
-		}
-	}
+        return SIFT3D_SUCCESS;
+}
 
-	return SIFT3D_SUCCESS;
+/* Returns the size in bytes of an element of a dense descriptor file, or 0
+ * if the type is unknown. */
+static size_t dense_dtype_get_size(const features_dtype dtype) {
+        switch (dtype) {
+        case FEATURES_DTYPE_FLOAT32:
+                return sizeof(float);
+        case FEATURES_DTYPE_UINT8:
+                return quant_type_get_size(QUANT_UINT8);
+        case FEATURES_DTYPE_FLOAT16:
+                return quant_type_get_size(QUANT_FLOAT16);
+        default:
+                return 0;
+        }
 }
 
-/* Convert a Mat_rm to a descriptor store. See 
- * SIFT3D_Descriptor_store_to_Mat_rm for the input format. */
-int Mat_rm_to_SIFT3D_Descriptor_store(const Mat_rm *const mat, 
-				      SIFT3D_Descriptor_store *const store) {
+/* Helper function for SIFT3D_extract_dense_descriptors_file, converting a 
+ * slab to the element type of the file and appending it. */
+static int dense_file_sink(void *const arg, const Image *const slab,
+        const int z_start) {
 
-	int i, j, a, p;
+        size_t i, size;
+        int x, y, z, c;
 
-	const int num_rows = mat->num_rows;
-	const int num_cols = mat->num_cols;
+        Dense_file *const dense = (Dense_file *) arg;
+        const size_t num = (size_t) slab->nx * slab->ny * slab->nz * slab->nc;
 
-	// Verify inputs
-	if (num_rows < 1 || num_cols != IM_NDIMS + DESC_NUMEL) {
-		SIFT3D_ERR("Mat_rm_to_SIFT3D_Descriptor_store: invalid matrix "
-		       "dimensions: [%d X %d] \n", num_rows, num_cols);
-		return SIFT3D_FAILURE;
-	}
-        if (mat->type != SIFT3D_FLOAT) {
-		SIFT3D_ERR("Mat_rm_to_SIFT3D_Descriptor_store: matrix must "
-                        "have type SIFT3D_FLOAT");
-		return SIFT3D_FAILURE;
+        // Resize the conversion buffer
+        size = num * dense_dtype_get_size(dense->dtype);
+        if (size > dense->buf_size) {
+                if ((dense->buf = SIFT3D_safe_realloc(dense->buf, size)) == 
+                        NULL) {
+                        dense->buf_size = 0;
+                        return SIFT3D_FAILURE;
+                }
+                dense->buf_size = size;
         }
 
-        /* Resize the descriptor store */
-        if (resize_SIFT3D_Descriptor_store(store, num_rows))
+        // Convert the elements, in raster order
+        i = 0;
+        SIFT3D_IM_LOOP_START_C(slab, x, y, z, c)
+
+                const float val = SIFT3D_IM_GET_VOX(slab, x, y, z, c);
+
+                switch (dense->dtype) {
+                case FEATURES_DTYPE_FLOAT32:
+                        ((float *) dense->buf)[i] = val;
+                        break;
+                case FEATURES_DTYPE_FLOAT16:
+                        ((unsigned short *) dense->buf)[i] = 
+                                SIFT3D_float_to_half(val);
+                        break;
+                case FEATURES_DTYPE_UINT8:
+                        {
+                                const float q = (val - dense->lo) / 
+                                        dense->step + 0.5f;
+                                ((unsigned char *) dense->buf)[i] = 
+                                        q <= 0.0f ? 0 : q >= 255.0f ? 255 : 
+                                        (unsigned char) q;
+                        }
+                        break;
+                }
+                i++;
+
+        SIFT3D_IM_LOOP_END_C
+
+        if (fwrite(dense->buf, 1, size, dense->file) != size) {
+                SIFT3D_ERR("dense_file_sink: failed to write planes starting "
+                        "at z = %d \n", z_start);
                 return SIFT3D_FAILURE;
+        }
 
-	// Copy the data
-	for (i = 0; i < num_rows; i++) {
+        return SIFT3D_SUCCESS;
+}
 
-		SIFT3D_Descriptor *const desc = store->buf + i;
+/* Extract dense descriptors in slabs, as in 
+ * SIFT3D_extract_dense_descriptors_stream, writing each slab to a file as 
+ * it is computed. The whole output is never held in memory. Read the file 
+ * with read_SIFT3D_dense_descriptors.
+ *
+ * Parameters:
+ * -sift3d Stores the algorithm parameters.
+ * -in The input image.
+ * -slab_size The number of z-planes in each slab. If not positive, the 
+ *      whole image is processed as one slab.
+ * -type The element type of the file. Type DENSE_FLOAT16 saturates at 
+ *      the largest half precision values. Type DENSE_UINT8 quantizes 
+ *      uniformly over the range of the input intensities, including 0, 
+ *      which bounds the descriptor elements.
+ * -path The output file, which should have the extension ".sift3dd".
+ *
+ * File format (version 1), in the byte order of the writing machine:
+ *   Header: see the Dense_header struct in sift.c, including the image
+ *      dimensions and units, the element type, the quantization of uint8
+ *      elements, and the byte offset of the elements.
+ *   Elements: the descriptor image in raster order, with the channels of 
+ *      each voxel stored contiguously, then x, y, and z.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int SIFT3D_extract_dense_descriptors_file(SIFT3D *const sift3d,
+        const Image *const in, const int slab_size, const dense_type type,
+        const char *path) {
+
+        Dense_header header;
+        Dense_file dense;
+        float lo, hi;
+        int x, y, z, ret;
+
+        // Get the element type
+        switch (type) {
+        case DENSE_FLOAT32:
+                dense.dtype = FEATURES_DTYPE_FLOAT32;
+                break;
+        case DENSE_FLOAT16:
+                dense.dtype = FEATURES_DTYPE_FLOAT16;
+                break;
+        case DENSE_UINT8:
+                dense.dtype = FEATURES_DTYPE_UINT8;
+                break;
+        default:
+                SIFT3D_ERR("SIFT3D_extract_dense_descriptors_file: unknown "
+                        "type: %d \n", type);
+                return SIFT3D_FAILURE;
+        }
 
-		// Copy the coordinates
-		desc->xd = SIFT3D_MAT_RM_GET(mat, i, 0, float);
-		desc->yd = SIFT3D_MAT_RM_GET(mat, i, 1, float);
-		desc->zd = SIFT3D_MAT_RM_GET(mat, i, 2, float);
-                desc->sd = sigma0_default;
+        // Each element is a unit histogram bin times the input intensity
+        lo = hi = 0.0f;
+        SIFT3D_IM_LOOP_START(in, x, y, z)
+                const float val = SIFT3D_IM_GET_VOX_F(in, x, y, z, 0);
+                lo = SIFT3D_MIN(lo, val);
+                hi = SIFT3D_MAX(hi, val);
+        SIFT3D_IM_LOOP_END
+        dense.lo = lo;
+        dense.step = hi > lo ? (hi - lo) / 255.0f : 1.0f;
+        dense.buf = NULL;
+        dense.buf_size = 0;
+
+        // Fill in the header
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, dense_magic, sizeof(header.magic));
+        header.version = SIFT3D_DENSE_VERSION;
+        header.byte_order = features_byte_order;
+        header.dtype = dense.dtype;
+        header.nc = HIST_NUMEL;
+        header.nx = in->nx;
+        header.ny = in->ny;
+        header.nz = in->nz;
+        header.lo = dense.lo;
+        header.step = dense.step;
+        memcpy(header.units, SIFT3D_IM_GET_UNITS(in), 
+                IM_NDIMS * sizeof(double));
+        header.data_offset = FEATURES_ALIGN(sizeof(header));
+
+        // Open the file and write the header
+        if (make_path(path) || (dense.file = fopen(path, "wb")) == NULL) {
+                SIFT3D_ERR("SIFT3D_extract_dense_descriptors_file: failed to "
+                        "open %s \n", path);
+                return SIFT3D_FAILURE;
+        }
+        if (fwrite(&header, sizeof(header), 1, dense.file) != 1 ||
+                features_pad(dense.file, header.data_offset)) {
+                SIFT3D_ERR("SIFT3D_extract_dense_descriptors_file: failed to "
+                        "write %s \n", path);
+                fclose(dense.file);
+                return SIFT3D_FAILURE;
+        }
+
+        // Extract the descriptors, writing each slab
+        ret = SIFT3D_extract_dense_descriptors_stream(sift3d, in, slab_size,
+                dense_file_sink, &dense);
+        if (dense.buf != NULL)
+                free(dense.buf);
+
+        if (fclose(dense.file)) {
+                SIFT3D_ERR("SIFT3D_extract_dense_descriptors_file: failed to "
+                        "close %s \n", path);
+                return SIFT3D_FAILURE;
+        }
 
-		// Copy the feature vector
-		for (j = 0; j < DESC_NUM_TOTAL_HIST; j++) {
-			Hist *const hist = desc->hists + j;
-			HIST_LOOP_START(a, p)
-                                const int col = DESC_MAT_GET_COL(j, a, p);
-				HIST_GET(hist, a, p) = 
-                                        SIFT3D_MAT_RM_GET(mat, i, col, float);
-			HIST_LOOP_END
-		}
-	}
-	
-	return SIFT3D_SUCCESS;
+        return ret;
 }
 
-/* Convert a list of matches to matrices of point coordinates.
- * Only valid matches will be included in the output matrices.
+/* Read a dense descriptor file, as written by 
+ * SIFT3D_extract_dense_descriptors_file, into desc, which must be 
+ * initialized. Quantized elements are converted to floating point.
  *
- * The format of "matches" is specified in SIFT3D_nn_match.
- *
- * All matrices must be initialized prior to calling this function.
- *
- * Output format:
- *  m x 3 matrices [x11 y11 z11] [x21 y21 z21]
- * 		   |x12 y12 z12| |x22 y22 z22|
- *		        ...	      ...
- * 		   [x1N y1N z1N] [x2N y2N z2N] 
- *
- * Where points on corresponding rows are matches. */
-int SIFT3D_matches_to_Mat_rm(SIFT3D_Descriptor_store *d1,
-			     SIFT3D_Descriptor_store *d2,
-			     const int *const matches,
-			     Mat_rm *const match1, 
-			     Mat_rm *const match2) {
-    int i, num_matches;
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int read_SIFT3D_dense_descriptors(const char *path, Image *const desc) {
+
+        File_map map;
+        const Dense_header *header;
+        const char *data;
+        size_t i, el_size;
+        int x, y, z, c;
+
+        init_File_map(&map);
+        if (map_file(path, &map))
+                goto read_dense_quit;
+        header = (const Dense_header *) map.addr;
+
+        // Check the identity and version of the file
+        if (map.size < sizeof(Dense_header) || 
+                memcmp(header->magic, dense_magic, sizeof(header->magic))) {
+                SIFT3D_ERR("read_SIFT3D_dense_descriptors: %s is not a dense "
+                        "descriptor file \n", path);
+                goto read_dense_quit;
+        }
+        if (header->version != SIFT3D_DENSE_VERSION) {
+                SIFT3D_ERR("read_SIFT3D_dense_descriptors: %s has unsupported "
+                        "version %u \n", path, (unsigned int) header->version);
+                goto read_dense_quit;
+        }
+        if (header->byte_order != features_byte_order) {
+                SIFT3D_ERR("read_SIFT3D_dense_descriptors: %s was written "
+                        "with a different byte order \n", path);
+                goto read_dense_quit;
+        }
+        if ((el_size = dense_dtype_get_size(
+                (features_dtype) header->dtype)) == 0) {
+                SIFT3D_ERR("read_SIFT3D_dense_descriptors: %s has invalid "
+                        "element type %u \n", path, 
+                        (unsigned int) header->dtype);
+                goto read_dense_quit;
+        }
 
-    const int num = d1->num;
+        // Check that the elements fit in the file
+        if (header->nx < 1 || header->ny < 1 || header->nz < 1 || 
+                header->nc < 1 || header->data_offset + (uint64_t) 
+                header->nx * header->ny * header->nz * header->nc * el_size >
+                map.size) {
+                SIFT3D_ERR("read_SIFT3D_dense_descriptors: %s is truncated "
+                        "or corrupt \n", path);
+                goto read_dense_quit;
+        }
 
-    // Resize matrices 
-    match1->num_rows = match2->num_rows = d1->num;
-    match1->num_cols = match2->num_cols = 3;
-    match1->type = match2->type = SIFT3D_DOUBLE;
-    if (resize_Mat_rm(match1) || resize_Mat_rm(match2))
-	    return SIFT3D_FAILURE;
+        // Resize the output
+        desc->nx = header->nx;
+        desc->ny = header->ny;
+        desc->nz = header->nz;
+        desc->nc = (int) header->nc;
+        memcpy(SIFT3D_IM_GET_UNITS(desc), header->units, 
+                IM_NDIMS * sizeof(double));
+        im_default_stride(desc);
+        if (im_resize(desc))
+                goto read_dense_quit;
+
+        // Convert the elements
+        data = (const char *) map.addr + header->data_offset;
+        i = 0;
+        SIFT3D_IM_LOOP_START_C(desc, x, y, z, c)
+
+                float val;
+
+                switch (header->dtype) {
+                case FEATURES_DTYPE_FLOAT32:
+                        val = ((const float *) data)[i];
+                        break;
+                case FEATURES_DTYPE_FLOAT16:
+                        val = SIFT3D_half_to_float(
+                                ((const unsigned short *) data)[i]);
+                        break;
+                case FEATURES_DTYPE_UINT8:
+                default:
+                        val = header->lo + header->step * 
+                                (float) ((const unsigned char *) data)[i];
+                        break;
+                }
+                SIFT3D_IM_GET_VOX(desc, x, y, z, c) = val;
+                i++;
 
-    // Populate the matrices
-    num_matches = 0;
-    for (i = 0; i < num; i++) {
+        SIFT3D_IM_LOOP_END_C
 
-	    const SIFT3D_Descriptor *const desc1 = d1->buf + i;
-	    const SIFT3D_Descriptor *const desc2 = d2->buf + matches[i];
+        cleanup_File_map(&map);
+        return SIFT3D_SUCCESS;
 
-	    if (matches[i] == -1)
-		    continue;
+read_dense_quit:
+        cleanup_File_map(&map);
+        return SIFT3D_FAILURE;
+}
 
-	    // Save the match
-	    SIFT3D_MAT_RM_GET(match1, num_matches, 0, double) = desc1->xd; 
-	    SIFT3D_MAT_RM_GET(match1, num_matches, 1, double) = desc1->yd; 
-	    SIFT3D_MAT_RM_GET(match1, num_matches, 2, double) = desc1->zd; 
-	    SIFT3D_MAT_RM_GET(match2, num_matches, 0, double) = desc2->xd; 
-	    SIFT3D_MAT_RM_GET(match2, num_matches, 1, double) = desc2->yd; 
-	    SIFT3D_MAT_RM_GET(match2, num_matches, 2, double) = desc2->zd; 
-	    num_matches++;
-    }
+/* Helper function to copy the contents of a SIFT3D_Descriptor_store, which
+ * may be empty. dst must be initialized. */
+static int copy_SIFT3D_Descriptor_store(
+        const SIFT3D_Descriptor_store *const src, 
+        SIFT3D_Descriptor_store *const dst) {
 
-    // Release extra memory
-    match1->num_rows = match2->num_rows = num_matches;
-    if (resize_Mat_rm(match1) || resize_Mat_rm(match2))
-	    return SIFT3D_FAILURE;
-    
-    return SIFT3D_SUCCESS;
+        dst->nx = src->nx;
+        dst->ny = src->ny;
+        dst->nz = src->nz;
+
+        if (src->num == 0) {
+                dst->num = 0;
+                return SIFT3D_SUCCESS;
+        }
+
+        if (resize_SIFT3D_Descriptor_store(dst, src->num))
+                return SIFT3D_FAILURE;
+        memcpy(dst->buf, src->buf, src->num * sizeof(SIFT3D_Descriptor));
+
+        return SIFT3D_SUCCESS;
 }
 
-/* Perform nearest neighbor matching on two sets of 
- * SIFT descriptors.
- *
- * This function will reallocate *matches. As such, *matches must be either
- * NULL or a pointer to previously-allocated array. Upon successful exit,
- * *matches is an array of size d1->num.
- * 
- * On return, the ith element of matches contains the index in d2 of the match
- * corresponding to the ith descriptor in d1, or -1 if no match was found.
- *
- * You might consider using SIFT3D_matches_to_Mat_rm to convert the matches to
- * coordinate matrices. */
-int SIFT3D_nn_match(const SIFT3D_Descriptor_store *const d1,
-		    const SIFT3D_Descriptor_store *const d2,
-		    const float nn_thresh, int **const matches) {
+/* Initialize a SIFT3D_Cache for first use. The cache is empty, holds up to
+ * cache_capacity_default entries in memory, and has no directory. */
+void init_SIFT3D_Cache(SIFT3D_Cache *const cache) {
+        cache->keys = NULL;
+        cache->stores = NULL;
+        cache->dir = NULL;
+        cache->num = 0;
+        cache->capacity = cache_capacity_default;
+        cache->next = 0;
+}
 
-	int i;
+/* Helper function to release the entries of a SIFT3D_Cache in memory. */
+static void clear_SIFT3D_Cache(SIFT3D_Cache *const cache) {
 
-	const int num = d1->num;
+        int i;
 
-        // Verify inputs
-	if (num < 1) {
-		SIFT3D_ERR("_SIFT3D_nn_match: invalid number of "
-			"descriptors in d1: %d \n", num);
-		return SIFT3D_FAILURE;
-	}
+        for (i = 0; i < cache->num; i++) {
+                cleanup_SIFT3D_Descriptor_store(cache->stores + i);
+        }
+        free(cache->keys);
+        free(cache->stores);
+        cache->keys = NULL;
+        cache->stores = NULL;
+        cache->num = cache->next = 0;
+}
 
-	// Resize the matches array (num cannot be zero)
-	if ((*matches = (int *) SIFT3D_safe_realloc(*matches, 
-		num * sizeof(int))) == NULL) {
-	    SIFT3D_ERR("_SIFT3D_nn_match: out of memory! \n");
-	    return SIFT3D_FAILURE;
-	}
+/* Free all memory associated with a SIFT3D_Cache. The files in its directory
+ * are kept. cache cannot be used after calling this function, unless 
+ * re-initialized. */
+void cleanup_SIFT3D_Cache(SIFT3D_Cache *const cache) {
+        clear_SIFT3D_Cache(cache);
+        free(cache->dir);
+        cache->dir = NULL;
+}
 
-	for (i = 0; i < d1->num; i++) {
-	    // Mark -1 to signal there is no match
-	    (*matches)[i] = -1;
-	}
-	
-	// Exhaustive search for matches
-#pragma omp parallel for
-	for (i = 0; i < num; i++) {
+/* Set the maximum number of entries kept in memory. When the cache is full,
+ * the oldest entry is replaced. Use 0 to keep entries only on disk. This 
+ * releases the current entries. Returns SIFT3D_SUCCESS on success, 
+ * SIFT3D_FAILURE if capacity is negative. */
+int set_capacity_SIFT3D_Cache(SIFT3D_Cache *const cache, const int capacity) {
 
-                const SIFT3D_Descriptor *const desc1 = d1->buf + i;
-                int *const match = *matches + i;
+        if (capacity < 0) {
+                SIFT3D_ERR("set_capacity_SIFT3D_Cache: invalid capacity: "
+                        "%d \n", capacity);
+                return SIFT3D_FAILURE;
+        }
 
-                // Forward matching pass
-                *match = match_desc(desc1, d2, nn_thresh);
+        clear_SIFT3D_Cache(cache);
+        cache->capacity = capacity;
+        return SIFT3D_SUCCESS;
+}
 
-                // We are done if there was no match
-                if (*match < 0)
-                        continue;
+/* Set the directory in which the cache stores its entries as binary feature
+ * files, as written by write_SIFT3D_features, so that they persist across
+ * processes. The directory is created when the first entry is written. Use 
+ * NULL to keep entries only in memory, which is the default. Returns 
+ * SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int set_dir_SIFT3D_Cache(SIFT3D_Cache *const cache, const char *const dir) {
 
-                // Check for forward-backward consistency
-                if (match_desc(d2->buf + *match, d1, nn_thresh) != i) {
-                        *match = -1;
-                }
+        char *copy;
+
+        if (dir == NULL) {
+                copy = NULL;
+        } else if ((copy = strdup(dir)) == NULL) {
+                SIFT3D_ERR("set_dir_SIFT3D_Cache: out of memory \n");
+                return SIFT3D_FAILURE;
         }
 
-	return SIFT3D_SUCCESS;
+        free(cache->dir);
+        cache->dir = copy;
+        return SIFT3D_SUCCESS;
 }
 
-/* Helper function to match desc against the descriptors in store. Returns the
- * index of the match, or -1 if none was found. */
-static int match_desc(const SIFT3D_Descriptor *const desc,
-        const SIFT3D_Descriptor_store *const store, const float nn_thresh) {
+/* Set the result cache used by SIFT3D_extract_descriptors_cached. The cache
+ * is not copied, and it is shared with the copies made by copy_SIFT3D. It
+ * must remain valid until it is replaced, or sift3d is cleaned up. Use NULL
+ * to disable caching, which is the default. */
+void set_cache_SIFT3D(SIFT3D *const sift3d, SIFT3D_Cache *const cache) {
+        sift3d->cache = cache;
+}
 
-	const SIFT3D_Descriptor *desc_best;
-        double ssd_best, ssd_nearest;
+/* Helper function to compute the cache key of an image, given the detector 
+ * parameters of sift3d. */
+static uint64_t cache_key_SIFT3D(const SIFT3D *const sift3d, 
+        const Image *const im) {
+
+        uint64_t seed;
         int i;
 
-#ifdef SIFT3D_MATCH_MAX_DIST
-        Cvec dims, dmatch;
-        double dist_match;
-				
-        // Compute spatial distance rejection threshold
-        dims.x = (float) store->nx;	
-        dims.y = (float) store->ny;	
-        dims.z = (float) store->nz;	
-        const double diag = SIFT3D_CVEC_L2_NORM(&dims);	
-        const double dist_thresh = diag * SIFT3D_MATCH_MAX_DIST;
-#endif
+        const double params[] = {
+                sift3d->peak_thresh,
+                sift3d->corner_thresh,
+                sift3d->gpyr.sigma0,
+                sift3d->gpyr.sigma_n,
+                (double) sift3d->gpyr.num_kp_levels,
+                (double) get_pyr_type_SIFT3D(sift3d),
+                (double) sizeof(SIFT3D_Descriptor)
+        };
+        const int num_params = sizeof(params) / sizeof(params[0]);
 
-        // Linear search for the best and second-best SSD matches 
-        ssd_best = ssd_nearest = DBL_MAX;
-        desc_best = NULL;
-        for (i = 0; i < store->num; i++) { 
+        seed = 0;
+        for (i = 0; i < num_params; i++) {
 
-                double ssd;
-                int j;
+                uint64_t bits;
 
-                const SIFT3D_Descriptor *const desc2 = store->buf + i;
+                memcpy(&bits, params + i, sizeof(bits));
+                seed = (seed ^ bits) * 0x100000001b3ULL;
+        }
 
-                // Compute the SSD of the two descriptors
-                ssd = 0.0;
-                for (j = 0; j < DESC_NUM_TOTAL_HIST; j++) {
+        // The mask restricts the detections
+        if (sift3d->mask != NULL)
+                seed = im_hash(sift3d->mask, seed);
+
+        return im_hash(im, seed);
+}
+
+/* Helper function to form the path of a cache entry on disk. The returned
+ * string must later be freed. */
+static char *cache_path_SIFT3D(const SIFT3D_Cache *const cache, 
+        const uint64_t key) {
+
+        char *path;
+        size_t len;
+
+        len = strlen(cache->dir) + 1 + 16 + strlen(ext_features) + 1;
+        if ((path = (char *) malloc(len)) == NULL)
+                return NULL;
+        snprintf(path, len, "%s%c%016llx%s", cache->dir, SIFT3D_FILE_SEP, 
+                (unsigned long long) key, ext_features);
 
-                        int a, p;
+        return path;
+}
+
+/* Detect keypoints in an image and extract their descriptors, reusing the
+ * result of a previous call if the image and detector parameters have not
+ * changed. The result is looked up in the cache of sift3d, in memory and then
+ * on disk, and computed and stored on a miss. Without a cache, this is the
+ * same as SIFT3D_detect_keypoints followed by SIFT3D_extract_descriptors.
+ * 
+ * On a hit, the pyramids of sift3d are not computed, so SIFT3D_have_gpyr 
+ * does not refer to im. This may be called concurrently for copies of a
+ * SIFT3D struct sharing the same cache.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int SIFT3D_extract_descriptors_cached(SIFT3D *const sift3d, 
+        const Image *const im, SIFT3D_Descriptor_store *const desc) {
 
-                        const Hist *const hist1 = desc->hists + j;
-                        const Hist *const hist2 = desc2->hists + j;
+        SIFT3D_Descriptor_store entry, old;
+        Keypoint_store kp;
+        FILE *file;
+        char *path;
+        uint64_t key;
+        int i, hit, ret;
 
-                        HIST_LOOP_START(a, p)
-                                const double diff = 
-                                        (double) HIST_GET(hist1, a, p) -
-                                        (double) HIST_GET(hist2, a, p);
-                                        ssd += diff * diff;
-                        HIST_LOOP_END
+        SIFT3D_Cache *const cache = sift3d->cache;
 
-                        // Early termination
-                        if (ssd > ssd_nearest)
+        // Initialize intermediates
+        path = NULL;
+        key = 0;
+        hit = SIFT3D_FALSE;
+        init_Keypoint_store(&kp);
+        init_SIFT3D_Descriptor_store(&entry);
+        init_SIFT3D_Descriptor_store(&old);
+
+        if (cache != NULL) {
+
+                // Look up the image in memory
+                key = cache_key_SIFT3D(sift3d, im);
+                ret = SIFT3D_SUCCESS;
+#pragma omp critical (SIFT3D_cache)
+                {
+                        for (i = 0; i < cache->num; i++) {
+                                if (cache->keys[i] != key)
+                                        continue;
+                                hit = SIFT3D_TRUE;
+                                ret = copy_SIFT3D_Descriptor_store(
+                                        cache->stores + i, desc);
                                 break;
+                        }
+                }
+                if (hit && ret)
+                        goto extract_cached_quit;
+                if (hit)
+                        goto extract_cached_success;
+
+                // Look up the image on disk
+                if (cache->dir != NULL) {
+                        if ((path = cache_path_SIFT3D(cache, key)) == NULL) {
+                                SIFT3D_ERR("SIFT3D_extract_descriptors_"
+                                        "cached: out of memory \n");
+                                goto extract_cached_quit;
+                        }
+                        if ((file = fopen(path, "rb")) != NULL) {
+                                fclose(file);
+                                hit = !read_SIFT3D_features(path, NULL, 
+                                        desc);
+                        }
                 }
+        }
 
-                // Compare to the best matches
-                if (ssd < ssd_best) {
-                        desc_best = desc2; 
-                        ssd_nearest = ssd_best;
-                        ssd_best = ssd;
-                } else  {
-                        ssd_nearest = SIFT3D_MIN(ssd_nearest, ssd);
+        // Compute the descriptors on a miss
+        if (!hit) {
+	        if (SIFT3D_detect_keypoints(sift3d, im, &kp) ||
+	                SIFT3D_extract_descriptors(sift3d, &kp, desc))
+                        goto extract_cached_quit;
+        }
+
+        // Quit if there is no cache
+        if (cache == NULL)
+                goto extract_cached_success;
+
+        // Write new results to disk. Failures only lose the entry.
+        if (path != NULL && !hit && write_SIFT3D_features(path, NULL, desc))
+                SIFT3D_ERR("SIFT3D_extract_descriptors_cached: WARNING--"
+                        "failed to write cache entry %s \n", path);
+
+        // Store a copy of the result in memory, replacing the oldest entry
+        // if the cache is full
+        if (copy_SIFT3D_Descriptor_store(desc, &entry))
+                goto extract_cached_quit;
+        ret = SIFT3D_SUCCESS;
+#pragma omp critical (SIFT3D_cache)
+        {
+                if (cache->capacity > 0 && cache->keys == NULL) {
+                        cache->keys = (uint64_t *) malloc(cache->capacity * 
+                                sizeof(uint64_t));
+                        cache->stores = (SIFT3D_Descriptor_store *) malloc(
+                                cache->capacity * 
+                                sizeof(SIFT3D_Descriptor_store));
+                        if (cache->keys == NULL || cache->stores == NULL) {
+                                free(cache->keys);
+                                free(cache->stores);
+                                cache->keys = NULL;
+                                cache->stores = NULL;
+                                ret = SIFT3D_FAILURE;
+                        }
+                }
+                if (cache->keys != NULL) {
+                        if (cache->num < cache->capacity) {
+                                i = cache->num++;
+                        } else {
+                                i = cache->next;
+                                cache->next = (i + 1) % cache->capacity;
+                                old = cache->stores[i];
+                        }
+                        cache->keys[i] = key;
+                        cache->stores[i] = entry;
+                        init_SIFT3D_Descriptor_store(&entry);
                 }
         }
+        if (ret) {
+                SIFT3D_ERR("SIFT3D_extract_descriptors_cached: out of "
+                        "memory \n");
+                goto extract_cached_quit;
+        }
 
-        // Reject a match if the nearest neighbor is too close
-        if (ssd_best / ssd_nearest > nn_thresh * nn_thresh)
-                        return -1;
+extract_cached_success:
+        free(path);
+        cleanup_Keypoint_store(&kp);
+        cleanup_SIFT3D_Descriptor_store(&entry);
+        cleanup_SIFT3D_Descriptor_store(&old);
+        return SIFT3D_SUCCESS;
 
-#ifdef SIFT3D_MATCH_MAX_DIST
-        // Compute the spatial distance of the match
-        dmatch.x = (float) desc_best->xd - desc1->xd; 
-        dmatch.y = (float) desc_best->yd - desc1->yd; 
-        dmatch.z = (float) desc_best->zd - desc1->zd; 
-        dist_match = (double) SIFT3D_CVEC_L2_NORM(&dmatch);
+extract_cached_quit:
+        free(path);
+        cleanup_Keypoint_store(&kp);
+        cleanup_SIFT3D_Descriptor_store(&entry);
+        cleanup_SIFT3D_Descriptor_store(&old);
+        return SIFT3D_FAILURE;
+}
 
-        // Reject matches of great distance
-        if (dist_match > dist_thresh)
-                return -1;
-#endif
-        // The match was a success
-        return desc_best - store->buf;
+/* Initialize an empty Batch_slot. */
+static void init_Batch_slot(Batch_slot *const slot) {
+        init_im(&slot->im);
+        init_Keypoint_store(&slot->kp);
+        init_SIFT3D_Descriptor_store(&slot->desc);
+        slot->desc.num = 0;
+        slot->idx = -1;
+        slot->status = SIFT3D_SUCCESS;
+        slot->loaded = SIFT3D_FALSE;
 }
-			
-/* Draw the matches. 
- * 
- * Inputs:
- * -left - lefthand-side image
- * -right - righthand-side image
- * -keys_left - Keypoints from "left" (can be NULL if keys is NULL) 
- * -keys_right - Keypoints from "right" (can be NULL if keys is NULL)
- * -match_left - Matches from "left" (can be NULL if lines is NULL)
- * -match_right - Matches from "right" (can be NULL if lines is NULL)
- * 
- * Outputs:
- * -concat - Concatenated image (NULL if not needed)
- * -keys - Keypoints from concat (NULL is not needed)
- * -lines - Lines between matching keypoints in concat (NULL if not needed)
- * It is an error if all outputs are NULL.
+
+/* Free the memory of a Batch_slot. */
+static void cleanup_Batch_slot(Batch_slot *const slot) {
+        im_free(&slot->im);
+        cleanup_Keypoint_store(&slot->kp);
+        cleanup_SIFT3D_Descriptor_store(&slot->desc);
+}
+
+/* Helper function to estimate the memory used by a batch worker to process
+ * an image, in bytes. This includes the images in each stage of the 
+ * pipeline, the copy in sift3d, and the pyramids. */
+static size_t batch_worker_mem(const SIFT3D *const sift3d, 
+        const Image *const im) {
+
+        const size_t num_vox = (size_t) im->nx * im->ny * im->nz;
+        const int num_levels = sift3d->gpyr.num_levels;
+        const int num_dog_levels = sift3d->fused ? 3 : num_levels - 1;
+        const size_t pyr_size = im_type_get_size(
+                get_pyr_type_SIFT3D(sift3d));
+
+        // Count the 3 pipeline images, in their element type, and the copy 
+        // in sift3d and the filtering buffer, in float. The octaves of a 
+        // pyramid sum to 8 / 7 of the first.
+        return num_vox * (3 * im_type_get_size(im->type) + 
+                2 * sizeof(float)) + num_vox * pyr_size * 
+                ((size_t) (num_levels + num_dog_levels) * 8) / 7;
+}
+
+/* Helper routine to run one batch worker. The worker repeatedly claims the 
+ * next image from *next, and processes it in a three-stage pipeline with 
+ * the two previous images: while one image is read, the one before it is 
+ * processed, and the results of the one before that are written. The 
+ * stages run as concurrent tasks.
  *
- * Return:
- * SIFT3D_SUCCESS or SIFT3D_FAILURE
- */
-int draw_matches(const Image *const left, const Image *const right,
-                 const Mat_rm *const keys_left, const Mat_rm *const keys_right,
-		 const Mat_rm *const match_left, 
-                 const Mat_rm *const match_right, Image *const concat, 
-                 Image *const keys, Image *const lines) {
+ * slots must have 3 initialized entries, and slots[0] may already hold an
+ * image claimed by this worker. */
+static void batch_worker(SIFT3D *const sift3d, const char *const *im_paths,
+        const char *const *out_paths, const int num, int *const next, 
+        Batch_slot *const slots, int *const num_failed) {
+
+        int step;
+
+        for (step = 0; ; step++) {
+
+                Batch_slot *const slot_read = slots + step % 3;
+                Batch_slot *const slot_compute = slots + (step + 2) % 3;
+                Batch_slot *const slot_write = slots + (step + 1) % 3;
+
+                // Claim the next image
+                if (!slot_read->loaded) {
+#pragma omp atomic capture
+                        slot_read->idx = (*next)++;
+                        if (slot_read->idx >= num)
+                                slot_read->idx = -1;
+                }
+
+                // Stop when the pipeline is empty
+                if (slot_read->idx < 0 && slot_compute->idx < 0 && 
+                        slot_write->idx < 0)
+                        break;
+
+#pragma omp task
+                batch_read(slot_read, im_paths);
+#pragma omp task
+                batch_compute(sift3d, slot_compute, im_paths);
+#pragma omp task
+                batch_write(slot_write, out_paths, num_failed);
+#pragma omp taskwait
+
+        }
+}
+
+/* Batch pipeline stage: read the image in a slot. */
+static void batch_read(Batch_slot *const slot, const char *const *im_paths) {
+
+        if (slot->idx < 0)
+                return;
 
-        Image concat_temp, left_padded, right_padded;
-	Mat_rm keys_right_draw, keys_left_draw, keys_draw, match_right_draw;
-	int i;
+        slot->status = slot->loaded ? SIFT3D_SUCCESS : 
+                im_read_native(im_paths[slot->idx], &slot->im);
+        slot->loaded = SIFT3D_FALSE;
+        if (slot->status)
+                SIFT3D_ERR("SIFT3D_extract_batch: failed to read %s \n",
+                        im_paths[slot->idx]);
+}
 
-        const double right_pad = (double) left->nx;
-        const int ny_pad = SIFT3D_MAX(right->ny, left->ny);
-	const int nz_pad = SIFT3D_MAX(right->nz, left->nz);
+/* Batch pipeline stage: detect keypoints and extract descriptors from the
+ * image in a slot. */
+static void batch_compute(SIFT3D *const sift3d, Batch_slot *const slot,
+        const char *const *im_paths) {
+
+        if (slot->idx < 0 || slot->status)
+                return;
+
+        slot->status = SIFT3D_detect_keypoints(sift3d, &slot->im, &slot->kp);
+        if (slot->status == SIFT3D_SUCCESS) {
+                if (slot->kp.slab.num > 0) {
+                        slot->status = SIFT3D_extract_descriptors(sift3d, 
+                                &slot->kp, &slot->desc);
+                } else {
+                        slot->desc.num = 0;
+                        slot->desc.nx = slot->im.nx;
+                        slot->desc.ny = slot->im.ny;
+                        slot->desc.nz = slot->im.nz;
+                }
+        }
+        if (slot->status)
+                SIFT3D_ERR("SIFT3D_extract_batch: failed to extract features "
+                        "from %s \n", im_paths[slot->idx]);
+}
 
-        // Choose which image to use for concatenation 
-        Image *const concat_arg = concat == NULL ? &concat_temp : concat;
+/* Batch pipeline stage: write the results in a slot, then release it. */
+static void batch_write(Batch_slot *const slot, const char *const *out_paths,
+        int *const num_failed) {
 
-        // Verify inputs
-        if (concat == NULL && keys == NULL && lines == NULL) {
-                SIFT3D_ERR("draw_matches: all outputs are NULL \n");
-                return SIFT3D_FAILURE;
+        if (slot->idx < 0)
+                return;
+
+        if (slot->status == SIFT3D_SUCCESS &&
+                (slot->status = write_SIFT3D_features(out_paths[slot->idx], 
+                        &slot->kp, &slot->desc)))
+                SIFT3D_ERR("SIFT3D_extract_batch: failed to write %s \n",
+                        out_paths[slot->idx]);
+
+        if (slot->status) {
+#pragma omp atomic
+                (*num_failed)++;
         }
-        if (keys_left == NULL && keys != NULL) {
-                SIFT3D_ERR("draw_matches: keys_left is NULL but keys is "
-                        "not \n");
+
+        slot->idx = -1;
+}
+
+/* Detect keypoints and extract descriptors from a batch of images, writing
+ * the results for each image to a binary feature file, as in 
+ * write_SIFT3D_features. 
+ *
+ * The images are processed by a pool of workers, each with its own copy of 
+ * sift3d. Each worker runs a three-stage pipeline, so that reading the next
+ * image and writing the previous results overlap with processing the 
+ * current image. The number of workers is limited so that the estimated 
+ * memory usage, based on the size of the first image, fits in mem_limit.
+ *
+ * A failure to process one image does not stop the others. 
+ *
+ * Parameters:
+ *  sift3d - (initialized) struct defining the algorithm parameters
+ *  im_paths - The paths of the images, as in im_read.
+ *  out_paths - The paths of the output files, one per image.
+ *  num - The number of images.
+ *  num_workers - The maximum number of workers, typically the number of 
+ *      processor cores.
+ *  mem_limit - The memory budget, in bytes, or 0 for no limit.
+ *  num_failed - If not NULL, set to the number of images which could not be
+ *      processed.
+ *
+ * Return value:
+ *  Returns SIFT3D_SUCCESS if the batch ran, regardless of the failures of 
+ *  individual images. Returns SIFT3D_FAILURE on invalid inputs, or if the 
+ *  workers could not be initialized. */
+int SIFT3D_extract_batch(const SIFT3D *const sift3d, 
+        const char *const *im_paths, const char *const *out_paths, 
+        const int num, const int num_workers, const size_t mem_limit,
+        int *const num_failed) {
+
+        Batch_slot first;
+        size_t mem;
+        int i, num_run, next, failed, ret;
+
+        // Verify inputs
+        if (num < 0 || num_workers < 1) {
+                SIFT3D_ERR("SIFT3D_extract_batch: invalid number of images "
+                        "(%d) or workers (%d) \n", num, num_workers);
                 return SIFT3D_FAILURE;
         }
-        if (keys_right == NULL && keys != NULL) {
-                SIFT3D_ERR("draw_matches: keys_right is NULL but keys is "
-                        "not \n");
-                return SIFT3D_FAILURE;
+
+        failed = 0;
+        if (num_failed != NULL)
+                *num_failed = 0;
+        if (num == 0)
+                return SIFT3D_SUCCESS;
+
+        // Read the first image, to estimate the memory per worker
+        init_Batch_slot(&first);
+        first.idx = 0;
+        batch_read(&first, im_paths);
+        if (first.status)
+                batch_write(&first, out_paths, &failed);
+        first.loaded = first.idx == 0;
+        next = 1;
+
+        // Choose the number of workers
+        num_run = num_workers;
+        if (mem_limit > 0 && first.loaded) {
+                mem = batch_worker_mem(sift3d, &first.im);
+                num_run = (int) SIFT3D_MIN((size_t) num_workers, 
+                        SIFT3D_MAX(mem_limit / mem, 1));
         }
-        if (match_left == NULL && lines != NULL) {
-                SIFT3D_ERR("draw_matches: match_left is NULL but lines "
-                        "is not \n");
-                return SIFT3D_FAILURE;
+        num_run = SIFT3D_MIN(num_run, num);
+
+        // Run the workers, with enough threads for all of their stages
+        ret = SIFT3D_SUCCESS;
+#pragma omp parallel num_threads(3 * num_run)
+#pragma omp single
+        for (i = 0; i < num_run; i++) {
+#pragma omp task firstprivate(i)
+        {
+                SIFT3D worker;
+                Batch_slot slots[3];
+                int j;
+
+                for (j = 0; j < 3; j++) {
+                        init_Batch_slot(slots + j);
+                }
+                if (i == 0 && first.loaded) 
+                        slots[0] = first;
+
+                // Process images with a private copy of the parameters, 
+                // reserving memory for images like the first one
+                if (init_SIFT3D(&worker) || copy_SIFT3D(sift3d, &worker) ||
+                        (first.loaded && reserve_SIFT3D(&worker, first.im.nx,
+                                first.im.ny, first.im.nz))) {
+                        SIFT3D_ERR("SIFT3D_extract_batch: failed to "
+                                "initialize worker %d \n", i);
+                        if (slots[0].loaded) {
+#pragma omp atomic
+                                failed++;
+                        }
+                        ret = SIFT3D_FAILURE;
+                } else {
+                        batch_worker(&worker, im_paths, out_paths, num, &next,
+                                slots, &failed);
+                }
+
+                cleanup_SIFT3D(&worker);
+                for (j = 0; j < 3; j++) {
+                        cleanup_Batch_slot(slots + j);
+                }
         }
-        if (match_right == NULL && lines != NULL) {
-                SIFT3D_ERR("draw_matches: match_right is NULL but lines "
-                        "is not \n");
-                return SIFT3D_FAILURE;
         }
 
-	// Initialize intermediates		
-        init_im(&concat_temp);
-        init_im(&left_padded);
-        init_im(&right_padded);
-        if (init_Mat_rm(&keys_right_draw, 0, 0, SIFT3D_DOUBLE, 
-		SIFT3D_FALSE) ||
-	        init_Mat_rm(&match_right_draw, 0, 0, SIFT3D_DOUBLE, 
-			SIFT3D_FALSE) ||
-                init_Mat_rm(&keys_left_draw, 0, 0, SIFT3D_DOUBLE, 
-			SIFT3D_FALSE) ||
-                init_Mat_rm(&keys_draw, 0, 0, SIFT3D_DOUBLE, SIFT3D_FALSE))
-	        return SIFT3D_FAILURE;
+        // Release the first image, unless it was handed to a worker
+        if (!first.loaded)
+                cleanup_Batch_slot(&first);
 
-        // Pad the images to be the same in all dimensions but x
-	if (init_im_with_dims(&right_padded, right->nx, ny_pad, nz_pad, 1) || 
-	        init_im_with_dims(&left_padded, left->nx, ny_pad, nz_pad, 1) ||
-	   	im_pad(right, &right_padded) || 
-	    	im_pad(left, &left_padded)) {
-                SIFT3D_ERR("draw_matches: unable to pad images \n");
-                return SIFT3D_FAILURE;
-	}
+        if (num_failed != NULL)
+                *num_failed = failed;
 
-	// Draw a concatenated image
-	if (im_concat(&left_padded, &right_padded, 0, concat_arg)) {
-                SIFT3D_ERR("draw_matches: Could not concatenate the "
-                        "images \n");
-                goto draw_matches_quit;
-        }
+        return ret;
+}
 
-        // Optionally draw the keypoints
-        if (keys != NULL) { 
+/* Initialize a SIFT3D_Stats struct for first use, with all statistics zero 
+ * and no callback. */
+void init_SIFT3D_Stats(SIFT3D_Stats *const stats) {
+        reset_SIFT3D_Stats(stats);
+        stats->callback = NULL;
+        stats->callback_arg = NULL;
+}
 
-                // Convert inputs to double
-                if (convert_Mat_rm(keys_right, &keys_right_draw, 
-			SIFT3D_DOUBLE) ||
-                        convert_Mat_rm(keys_left, &keys_left_draw, 
-				SIFT3D_DOUBLE))
-                        goto draw_matches_quit;
-       
-                // Pad the x-coordinate 
-                for (i = 0; i < keys_right->num_rows; i++) {
-                        SIFT3D_MAT_RM_GET(&keys_right_draw, i, 0, double) += 
-                                right_pad; 
-                }
+/* Set all statistics of a SIFT3D_Stats struct to zero, keeping the 
+ * callback. This must not be called concurrently with functions which 
+ * record to stats. */
+void reset_SIFT3D_Stats(SIFT3D_Stats *const stats) {
+        memset(stats->stages, 0, sizeof(stats->stages));
+}
 
-                // Concatenate the points
-                if (concat_Mat_rm(&keys_left_draw, &keys_right_draw,
-                        &keys_draw, 0))
-                        goto draw_matches_quit;
+/* Set the function called after each stage is recorded in stats, with arg 
+ * as its first argument. Use NULL to disable the callback. See 
+ * SIFT3D_stats_fn. */
+void set_callback_SIFT3D_Stats(SIFT3D_Stats *const stats, 
+        SIFT3D_stats_fn callback, void *const arg) {
+        stats->callback = callback;
+        stats->callback_arg = arg;
+}
 
-                // Draw the points
-                if (draw_points(&keys_draw, SIFT3D_IM_GET_DIMS(concat_arg), 
-                        1, keys))
-                        goto draw_matches_quit;
-        }
+/* Set the struct where the stages run by sift3d are recorded. As with 
+ * set_cache_SIFT3D, stats is not copied, it is shared with the copies made 
+ * by copy_SIFT3D, and it must remain valid until it is replaced or sift3d is
+ * cleaned up. Use NULL to disable profiling, which is the default, and
+ * costs nothing beyond a pointer check per stage. */
+void set_stats_SIFT3D(SIFT3D *const sift3d, SIFT3D_Stats *const stats) {
+        sift3d->stats = stats;
+}
 
-	// Optionally draw the lines 
-        if (lines != NULL) {
+/* Returns the name of a stage, for reporting. */
+const char *SIFT3D_stage_name(const SIFT3D_stage stage) {
+        return (int) stage >= 0 && stage < SIFT3D_NUM_STAGES ? 
+                stage_names[stage] : "unknown";
+}
 
-                // Convert input to double
-                if (convert_Mat_rm(match_right, &match_right_draw, 
-			SIFT3D_DOUBLE))
-                        goto draw_matches_quit;
+/* Record a call of a stage in stats, then run its callback, if any. This 
+ * is thread-safe, and does nothing if stats is NULL.
+ *
+ * Parameters:
+ *   stats - The statistics, or NULL.
+ *   stage - The stage which was run.
+ *   start - The wall time when the stage began, from SIFT3D_STATS_START.
+ *   count, aux - The results of the stage, see SIFT3D_stage.
+ *   bytes - The size of the output of the stage, see SIFT3D_stage. */
+void record_SIFT3D_Stats(SIFT3D_Stats *const stats, const SIFT3D_stage stage,
+        const double start, const size_t count, const size_t aux, 
+        const size_t bytes) {
+
+        double seconds;
+
+        if (stats == NULL)
+                return;
+
+        seconds = SIFT3D_wall_time() - start;
+
+#pragma omp critical (SIFT3D_stats)
+{
+        SIFT3D_Stage_stats *const st = stats->stages + stage;
+
+        st->seconds += seconds;
+        st->last_seconds = seconds;
+        st->calls++;
+        st->count = count;
+        st->aux = aux;
+        st->total_count += count;
+        st->peak_bytes = SIFT3D_MAX(st->peak_bytes, bytes);
+
+        if (stats->callback != NULL)
+                stats->callback(stats->callback_arg, stage, stats);
+}
+}
 
-                // Pad the x-coordinate 
-                for (i = 0; i < match_right->num_rows; i++) {
-                        SIFT3D_MAT_RM_GET(&match_right_draw, i, 0, double) += 
-                                right_pad;
-                }
+/* Helper function to compute the bytes allocated for the levels of a 
+ * pyramid. */
+static size_t Pyramid_bytes(const Pyramid *const pyr) {
 
-                // Draw the lines
-                if (draw_lines(match_left, &match_right_draw, 
-                        SIFT3D_IM_GET_DIMS(concat_arg), lines))
-                        goto draw_matches_quit;
-        }
+        size_t bytes;
+        int o, s;
 
-        // Clean up
-        im_free(&concat_temp);
-        im_free(&left_padded);
-        im_free(&right_padded); 
-        cleanup_Mat_rm(&keys_right_draw); 
-        cleanup_Mat_rm(&keys_left_draw); 
-        cleanup_Mat_rm(&keys_draw); 
-        cleanup_Mat_rm(&match_right_draw); 
-	return SIFT3D_SUCCESS;
+        if (pyr->levels == NULL)
+                return 0;
 
-draw_matches_quit:
-        im_free(&concat_temp);
-        im_free(&left_padded);
-        im_free(&right_padded); 
-        cleanup_Mat_rm(&keys_right_draw);
-        cleanup_Mat_rm(&keys_left_draw); 
-        cleanup_Mat_rm(&keys_draw); 
-        cleanup_Mat_rm(&match_right_draw);
-        return SIFT3D_FAILURE;
+        bytes = 0;
+        SIFT3D_PYR_LOOP_START(pyr, o, s)
+
+                const Image *const level = SIFT3D_PYR_IM_GET(pyr, o, s);
+
+                if (level->data != NULL)
+                        bytes += SIFT3D_MAX(level->size, level->capacity) * 
+                                im_type_get_size(level->type);
+        SIFT3D_PYR_LOOP_END
+
+        return bytes;
 }
 
-/* Write a Keypoint_store to a text file. The keypoints are stored in a matrix
- * (.csv, .csv.gz), where each keypoint is a row. The elements of each row are
- * as follows:
- *
- * x y z o s ori11 ori12 ... orinn
- *
- * x - the x-coordinate
- * y - the y-coordinate
- * z - the z-coordinate
- * o - the pyramid octave. To convert to image coordinates, multiply x,y,z by 
- *      pow(2, o)
- * s - the scale coordinate
- * ori(ij) - the ith row, jth column of the orientation matrix */
-int write_Keypoint_store(const char *path, const Keypoint_store *const kp) {
+/* Helper function to release the gradient cache of a SIFT3D struct. */
+static void free_grads_SIFT3D(SIFT3D *const sift3d) {
 
-        Mat_rm mat;
-	int i, i_R, j_R;
+        int i;
 
-        // Keypoint data format constants
-        const int kp_x = 0; // column of x-coordinate
-        const int kp_y = 1; // column of y-coordinate
-        const int kp_z = 2; // column of z-coordinate
-        const int kp_o = 3; // column of octave index
-        const int kp_s = 4; // column of s-coordinate
-        const int kp_ori = 5; // first column of the orientation matrix
-        const int ori_numel = IM_NDIMS * IM_NDIMS; // Number of orientation 
-                // elements
-        const int num_rows = kp->slab.num;
-        const int num_cols = kp_ori + ori_numel;
+        for (i = 0; i < sift3d->num_grads; i++) {
+                im_free(sift3d->grads + i);
+        }
+        if (sift3d->grads != NULL)
+                free(sift3d->grads);
+        if (sift3d->grads_valid != NULL)
+                free(sift3d->grads_valid);
+        sift3d->grads = NULL;
+        sift3d->grads_valid = NULL;
+        sift3d->num_grads = 0;
+}
 
-        // Initialize the matrix
-        if (init_Mat_rm(&mat, num_rows, num_cols, SIFT3D_DOUBLE, 
-		SIFT3D_FALSE))
-                return SIFT3D_FAILURE;
-       
-        // Write the keypoints 
-        for (i = 0; i < num_rows; i++) {
+/* Helper function to fill the gradient cache for each level of sift3d->gpyr 
+ * holding a keypoint of kp, as in set_grad_cache_SIFT3D. Levels which are 
+ * already valid are not recomputed. Does nothing if the cache is disabled. */
+static int prepare_grads_SIFT3D(SIFT3D *const sift3d, 
+        const Keypoint_store *const kp) {
 
-                const Keypoint *const key = kp->buf + i;
-                const Mat_rm *const R = &key->R;
+        int i, x, y, z;
 
-                // Write the coordinates 
-                SIFT3D_MAT_RM_GET(&mat, i, kp_x, double) = key->xd;
-                SIFT3D_MAT_RM_GET(&mat, i, kp_y, double) = key->yd; 
-                SIFT3D_MAT_RM_GET(&mat, i, kp_z, double) = key->zd; 
-                SIFT3D_MAT_RM_GET(&mat, i, kp_o, double) = key->o; 
-                SIFT3D_MAT_RM_GET(&mat, i, kp_s, double) = key->sd;
+        const Pyramid *const gpyr = &sift3d->gpyr;
+        const int num_levels = gpyr->num_octaves * gpyr->num_levels;
 
-                // Write the orientation matrix
-                SIFT3D_MAT_RM_LOOP_START(R, i_R, j_R)
+        if (!sift3d->grad_cache)
+                return SIFT3D_SUCCESS;
 
-                        const int kp_idx = kp_ori + 
-                                SIFT3D_MAT_RM_GET_IDX(R, i_R, j_R);
-        
-                        SIFT3D_MAT_RM_GET(&mat, i, kp_idx, double) = 
-                                (double) SIFT3D_MAT_RM_GET(R, i_R, j_R, float);
+        // Reallocate the cache if the pyramid geometry changed
+        if (sift3d->num_grads != num_levels) {
 
-                SIFT3D_MAT_RM_LOOP_END
+                free_grads_SIFT3D(sift3d);
+
+                if ((sift3d->grads = (Image *) malloc(num_levels * 
+                        sizeof(Image))) == NULL ||
+                    (sift3d->grads_valid = (unsigned char *) calloc(num_levels,
+                        sizeof(unsigned char))) == NULL) {
+                        SIFT3D_ERR("prepare_grads_SIFT3D: out of memory \n");
+                        free_grads_SIFT3D(sift3d);
+                        return SIFT3D_FAILURE;
+                }
+                for (i = 0; i < num_levels; i++) {
+                        init_im(sift3d->grads + i);
+                }
+                sift3d->num_grads = num_levels;
         }
 
-        // Write the matrix 
-        if (write_Mat_rm(path, &mat))
-                goto write_kp_quit;
+        // Compute each missing level which holds a keypoint
+        for (i = 0; i < kp->slab.num; i++) {
 
-        // Clean up
-        cleanup_Mat_rm(&mat);
+                const Keypoint *const key = kp->buf + i;
+                const Image *const level = 
+                        SIFT3D_PYR_IM_GET(gpyr, key->o, key->s);
+                const int idx = level - gpyr->levels;
+                Image *const grads = sift3d->grads + idx;
 
-        return SIFT3D_SUCCESS;
+                if (sift3d->grads_valid[idx])
+                        continue;
 
-write_kp_quit:
-        cleanup_Mat_rm(&mat);
-        return SIFT3D_FAILURE;
-}
+                // Allocate the gradient image. The sphere windows only read
+                // it away from the boundary.
+                if (im_copy_dims(level, grads))
+                        return SIFT3D_FAILURE;
+                grads->nc = IM_NDIMS;
+                im_default_stride(grads);
+                if (im_resize(grads))
+                        return SIFT3D_FAILURE;
 
-/* Write SIFT3D descriptors to a text file.
- * See SIFT3D_Descriptor_store_to_Mat_rm for the file format. */
-int write_SIFT3D_Descriptor_store(const char *path, 
-        const SIFT3D_Descriptor_store *const desc) {
+#pragma omp parallel for private(x) private(y) num_threads(SIFT3D_team_size())
+                SIFT3D_IM_LOOP_LIMITED_START(level, x, y, z, 1, level->nx - 2,
+                        1, level->ny - 2, 1, level->nz - 2)
 
-        Mat_rm mat;
+                        Cvec vd;
 
-        // Initialize the matrix
-        if (init_Mat_rm(&mat, 0, 0, SIFT3D_FLOAT, SIFT3D_FALSE))
-                return SIFT3D_FAILURE;
-     
-        // Write the data into the matrix 
-        if (SIFT3D_Descriptor_store_to_Mat_rm(desc, &mat))
-                goto write_desc_quit;
+                        IM_GET_GRAD_ISO(level, x, y, z, 0, &vd);
 
-        // Write the matrix to the file
-        if (write_Mat_rm(path, &mat))
-                goto write_desc_quit;
+                        SIFT3D_IM_GET_VOX(grads, x, y, z, 0) = vd.x;
+                        SIFT3D_IM_GET_VOX(grads, x, y, z, 1) = vd.y;
+                        SIFT3D_IM_GET_VOX(grads, x, y, z, 2) = vd.z;
 
-        // Clean up
-        cleanup_Mat_rm(&mat);
-        return SIFT3D_SUCCESS;
+                SIFT3D_IM_LOOP_END
 
-write_desc_quit:
-        cleanup_Mat_rm(&mat);
-        return SIFT3D_FAILURE;
+                sift3d->grads_valid[idx] = SIFT3D_TRUE;
+        }
+
+        return SIFT3D_SUCCESS;
 }
 
+/* Helper function to get the cached gradients of level (o, s) of 
+ * sift3d->gpyr, or NULL if they are not cached. */
+static const Image *get_grads_SIFT3D(const SIFT3D *const sift3d, 
+        const int o, const int s) {
+
+        const Pyramid *const gpyr = &sift3d->gpyr;
+        const int idx = SIFT3D_PYR_IM_GET(gpyr, o, s) - gpyr->levels;
+
+        return sift3d->grad_cache && idx < sift3d->num_grads && 
+                sift3d->grads_valid[idx] ? sift3d->grads + idx : NULL;
+}
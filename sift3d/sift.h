@@ -30,6 +30,51 @@ void init_SIFT3D_Descriptor_store(SIFT3D_Descriptor_store *const desc);
 
 void cleanup_SIFT3D_Descriptor_store(SIFT3D_Descriptor_store *const desc);
 
+void init_SIFT3D_Quant_store(SIFT3D_Quant_store *const store, 
+        const quant_type type);
+
+void cleanup_SIFT3D_Quant_store(SIFT3D_Quant_store *const store);
+
+int quantize_SIFT3D_Descriptor_store(const SIFT3D_Descriptor_store *const src,
+        SIFT3D_Quant_store *const dst);
+
+int dequantize_SIFT3D_Quant_store(const SIFT3D_Quant_store *const src,
+        SIFT3D_Descriptor_store *const dst);
+
+void init_SIFT3D_Descriptor_index(SIFT3D_Descriptor_index *const index);
+
+void cleanup_SIFT3D_Descriptor_index(SIFT3D_Descriptor_index *const index);
+
+int set_num_trees_SIFT3D_Descriptor_index(
+        SIFT3D_Descriptor_index *const index, const int num_trees);
+
+int set_checks_SIFT3D_Descriptor_index(SIFT3D_Descriptor_index *const index,
+        const int checks);
+
+int build_SIFT3D_Descriptor_index(SIFT3D_Descriptor_index *const index,
+        const SIFT3D_Descriptor_store *const store);
+
+void init_SIFT3D_Cache(SIFT3D_Cache *const cache);
+
+void cleanup_SIFT3D_Cache(SIFT3D_Cache *const cache);
+
+int set_capacity_SIFT3D_Cache(SIFT3D_Cache *const cache, const int capacity);
+
+int set_dir_SIFT3D_Cache(SIFT3D_Cache *const cache, const char *const dir);
+
+void init_SIFT3D_Stats(SIFT3D_Stats *const stats);
+
+void reset_SIFT3D_Stats(SIFT3D_Stats *const stats);
+
+void set_callback_SIFT3D_Stats(SIFT3D_Stats *const stats, 
+        SIFT3D_stats_fn callback, void *const arg);
+
+void record_SIFT3D_Stats(SIFT3D_Stats *const stats, const SIFT3D_stage stage,
+        const double start, const size_t count, const size_t aux, 
+        const size_t bytes);
+
+const char *SIFT3D_stage_name(const SIFT3D_stage stage);
+
 int set_peak_thresh_SIFT3D(SIFT3D *const sift3d,
                                 const double peak_thresh);
 
@@ -45,6 +90,25 @@ int set_sigma_n_SIFT3D(SIFT3D *const sift3d,
 int set_sigma0_SIFT3D(SIFT3D *const sift3d,
                                 const double sigma_n);
 
+int set_fused_SIFT3D(SIFT3D *const sift3d, const int fused);
+
+int set_pyr_type_SIFT3D(SIFT3D *const sift3d, const im_type type);
+
+int set_num_threads_SIFT3D(SIFT3D *const sift3d, const int num_threads);
+
+int set_backend_SIFT3D(SIFT3D *const sift3d, const SIFT3D_backend backend);
+
+void set_grad_cache_SIFT3D(SIFT3D *const sift3d, const int grad_cache);
+
+void set_mask_SIFT3D(SIFT3D *const sift3d, const Image *const mask);
+
+void set_cache_SIFT3D(SIFT3D *const sift3d, SIFT3D_Cache *const cache);
+
+void set_stats_SIFT3D(SIFT3D *const sift3d, SIFT3D_Stats *const stats);
+
+int reserve_SIFT3D(SIFT3D *const sift3d, const int nx, const int ny,
+        const int nz);
+
 int init_SIFT3D(SIFT3D *sift3d);
 
 int copy_SIFT3D(const SIFT3D *const src, SIFT3D *const dst);
@@ -68,6 +132,22 @@ int SIFT3D_extract_descriptors(SIFT3D *const sift3d,
         const Keypoint_store *const kp, 
         SIFT3D_Descriptor_store *const desc);
 
+int SIFT3D_extract_quant_descriptors(SIFT3D *const sift3d, 
+        const Keypoint_store *const kp, 
+        SIFT3D_Quant_store *const quant);
+
+int SIFT3D_extract_descriptors_cached(SIFT3D *const sift3d, 
+        const Image *const im, SIFT3D_Descriptor_store *const desc);
+
+int SIFT3D_extract_features_tiled(SIFT3D *const sift3d, const Image *const im,
+        const int tile_size, Keypoint_store *const kp, 
+        SIFT3D_Descriptor_store *const desc);
+
+int SIFT3D_extract_batch(const SIFT3D *const sift3d, 
+        const char *const *im_paths, const char *const *out_paths, 
+        const int num, const int num_workers, const size_t mem_limit,
+        int *const num_failed);
+
 int SIFT3D_extract_raw_descriptors(SIFT3D *const sift3d, 
         const Image *const im, const Keypoint_store *const kp, 
         SIFT3D_Descriptor_store *const desc);
@@ -75,10 +155,51 @@ int SIFT3D_extract_raw_descriptors(SIFT3D *const sift3d,
 int SIFT3D_extract_dense_descriptors(SIFT3D *const sift3d, 
         const Image *const in, Image *const desc);
 
+int SIFT3D_extract_dense_descriptors_stream(SIFT3D *const sift3d,
+        const Image *const in, const int slab_size, 
+        const SIFT3D_dense_sink sink, void *const arg);
+
+int SIFT3D_extract_dense_descriptors_file(SIFT3D *const sift3d,
+        const Image *const in, const int slab_size, const dense_type type,
+        const char *path);
+
 int SIFT3D_nn_match(const SIFT3D_Descriptor_store *const d1,
 		    const SIFT3D_Descriptor_store *const d2,
 		    const float nn_thresh, int **const matches);
 
+int SIFT3D_nn_match_ratio(const SIFT3D_Descriptor_store *const d1,
+		    const SIFT3D_Descriptor_store *const d2,
+		    const float nn_thresh, int **const matches, 
+                    float *const ratios);
+
+int SIFT3D_nn_match_bounded(const SIFT3D_Descriptor_store *const d1,
+        const SIFT3D_Descriptor_store *const d2, const void *const tform,
+        const double *const units, const double radius, 
+        const float nn_thresh, int **const matches);
+
+int SIFT3D_nn_match_bounded_ratio(const SIFT3D_Descriptor_store *const d1,
+        const SIFT3D_Descriptor_store *const d2, const void *const tform,
+        const double *const units, const double radius, 
+        const float nn_thresh, int **const matches, float *const ratios);
+
+void SIFT3D_set_match_simd(const int simd);
+
+int SIFT3D_set_match_backend(const SIFT3D_backend backend);
+
+const char *SIFT3D_get_match_kernel(void);
+
+int SIFT3D_nn_match_indexed(const SIFT3D_Descriptor_index *const index1,
+        const SIFT3D_Descriptor_index *const index2, const float nn_thresh, 
+        int **const matches);
+
+int SIFT3D_nn_match_indexed_ratio(const SIFT3D_Descriptor_index *const index1,
+        const SIFT3D_Descriptor_index *const index2, const float nn_thresh, 
+        int **const matches, float *const ratios);
+
+int SIFT3D_nn_match_quant(const SIFT3D_Quant_store *const q1,
+        const SIFT3D_Quant_store *const q2, const float nn_thresh, 
+        int **const matches);
+
 int Keypoint_store_to_Mat_rm(const Keypoint_store *const kp, Mat_rm *const mat);
 
 int SIFT3D_Descriptor_coords_to_Mat_rm(
@@ -97,6 +218,10 @@ int SIFT3D_matches_to_Mat_rm(SIFT3D_Descriptor_store *d1,
 			     Mat_rm *const match1, 
 			     Mat_rm *const match2);
 
+int SIFT3D_quant_matches_to_Mat_rm(const SIFT3D_Quant_store *const q1,
+        const SIFT3D_Quant_store *const q2, const int *const matches,
+        Mat_rm *const match1, Mat_rm *const match2);
+
 int draw_matches(const Image *const left, const Image *const right,
                  const Mat_rm *const keys_left, const Mat_rm *const keys_right,
 		 const Mat_rm *const match_left, const Mat_rm *const match_right,
@@ -107,6 +232,23 @@ int write_Keypoint_store(const char *path, const Keypoint_store *const kp);
 int write_SIFT3D_Descriptor_store(const char *path, 
         const SIFT3D_Descriptor_store *const desc);
 
+int write_SIFT3D_features(const char *path, const Keypoint_store *const kp, 
+        const SIFT3D_Descriptor_store *const desc);
+
+int write_SIFT3D_Quant_features(const char *path, 
+        const Keypoint_store *const kp, const SIFT3D_Quant_store *const quant);
+
+int read_SIFT3D_features(const char *path, Keypoint_store *const kp, 
+        SIFT3D_Descriptor_store *const desc);
+
+int map_SIFT3D_features(const char *path, File_map *const map,
+        Keypoint_store *const kp, SIFT3D_Descriptor_store *const desc);
+
+int map_SIFT3D_Quant_features(const char *path, File_map *const map,
+        Keypoint_store *const kp, SIFT3D_Quant_store *const quant);
+
+int read_SIFT3D_dense_descriptors(const char *path, Image *const desc);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,888 @@
+/* -----------------------------------------------------------------------------
+ * sift_cl.c
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2015-2016 Blaine Rister et al., see LICENSE for details.
+ * -----------------------------------------------------------------------------
+ * This file contains the host code of the OpenCL backend. The Gaussian and
+ * DoG pyramids are built and kept in device memory, and the keypoints and
+ * descriptors are computed there, so that only the final results are read
+ * back. The kernels are in kernels.cl, which is embedded in the library at
+ * build time.
+ * -----------------------------------------------------------------------------
+ */
+
+#define CL_TARGET_OPENCL_VERSION 120
+#define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+#include "sift_cl.h"
+#include "kernels_cl.h"
+
+/* This file cannot include imtypes.h, which replaces the OpenCL types with
+ * placeholders, so the return codes are repeated here. */
+#define SIFT3D_SUCCESS 0
+#define SIFT3D_FAILURE -1
+#define SIFT3D_ERR(...) fprintf(stderr, __VA_ARGS__)
+
+/* Initial capacity of the keypoint buffer */
+#define KEYS_CAP_DEFAULT 4096
+
+/* Set argument i of a kernel, accumulating errors in err */
+#define SET_ARG(kernel, i, val) \
+        (err |= clSetKernelArg(kernel, i, sizeof(val), &(val)))
+
+/* Geometry of a pyramid level. Must match the Level struct in kernels.cl. */
+typedef struct _Cl_level {
+        cl_ulong offset;
+        cl_int nx, ny, nz, pad;
+        cl_float ux, uy, uz, s;
+} Cl_level;
+
+/* A device buffer, which is reallocated only when it must grow */
+typedef struct _Cl_buf {
+        cl_mem mem;
+        size_t size;
+} Cl_buf;
+
+/* Device state */
+struct _SIFT3D_cl {
+
+        // Device and program
+        cl_context context;
+        cl_command_queue queue;
+        cl_program program;
+        cl_kernel conv_step, conv_gen, downsample_2x, dog, max_abs_rows,
+                max_reduce, detect_extrema, assign_orientations,
+                extract_descriptors;
+
+        // Device buffers
+        Cl_buf im, gpyr, dog_buf, tmp[2], row_max, dogmax, count, keys,
+                levels, taps, tri_v, tri_idx, desc;
+
+        // Layout of the pyramids in the current buffers
+        Cl_level *gpyr_levels, *dog_levels;
+        int first_octave, first_level, num_octaves, num_levels;
+
+        // Host copy of the keypoints
+        Cl_key *keys_host;
+        int keys_host_cap;
+
+        int desc_numel;
+};
+
+static int check_cl(const cl_int err, const char *const msg);
+static int reserve_buf(SIFT3D_cl *const cl, Cl_buf *const buf,
+                       const size_t size);
+static void release_buf(Cl_buf *const buf);
+static int get_device(cl_device_id *const device);
+static int run_kernel(SIFT3D_cl *const cl, cl_kernel kernel,
+                      const cl_uint dim, const size_t *const size);
+static int blur_level(SIFT3D_cl *const cl, const cl_mem src,
+        const cl_ulong src_off, const Dev_geom *const src_geom,
+        const cl_ulong dst_off, const cl_ulong taps_off, const int width);
+static int cmp_Cl_key(const void *a, const void *b);
+
+/* Report an OpenCL error. Returns SIFT3D_SUCCESS if err is CL_SUCCESS,
+ * SIFT3D_FAILURE otherwise. */
+static int check_cl(const cl_int err, const char *const msg) {
+
+        if (err == CL_SUCCESS)
+                return SIFT3D_SUCCESS;
+
+        SIFT3D_ERR("%s: OpenCL error %d \n", msg, (int) err);
+        return SIFT3D_FAILURE;
+}
+
+/* Ensure that buf holds at least size bytes. The contents are not preserved
+ * when the buffer grows. */
+static int reserve_buf(SIFT3D_cl *const cl, Cl_buf *const buf,
+                       const size_t size) {
+
+        cl_int err;
+
+        if (buf->mem != NULL && buf->size >= size)
+                return SIFT3D_SUCCESS;
+
+        release_buf(buf);
+        buf->mem = clCreateBuffer(cl->context, CL_MEM_READ_WRITE,
+                size > 0 ? size : 1, NULL, &err);
+        if (check_cl(err, "reserve_buf")) {
+                buf->mem = NULL;
+                return SIFT3D_FAILURE;
+        }
+        buf->size = size;
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Release a device buffer, if it was allocated. */
+static void release_buf(Cl_buf *const buf) {
+
+        if (buf->mem != NULL)
+                clReleaseMemObject(buf->mem);
+        buf->mem = NULL;
+        buf->size = 0;
+}
+
+/* Choose a device, preferring the first GPU of any platform. */
+static int get_device(cl_device_id *const device) {
+
+        cl_platform_id *platforms;
+        cl_uint num_platforms, num_devices, i;
+        int type;
+
+        const cl_device_type types[] = {CL_DEVICE_TYPE_GPU,
+                CL_DEVICE_TYPE_ALL};
+        const int num_types = sizeof(types) / sizeof(types[0]);
+
+        if (clGetPlatformIDs(0, NULL, &num_platforms) != CL_SUCCESS ||
+                num_platforms == 0) {
+                SIFT3D_ERR("get_device: no OpenCL platforms found \n");
+                return SIFT3D_FAILURE;
+        }
+
+        if ((platforms = (cl_platform_id *) malloc(num_platforms *
+                sizeof(cl_platform_id))) == NULL)
+                return SIFT3D_FAILURE;
+        if (check_cl(clGetPlatformIDs(num_platforms, platforms, NULL),
+                "get_device")) {
+                free(platforms);
+                return SIFT3D_FAILURE;
+        }
+
+        for (type = 0; type < num_types; type++) {
+                for (i = 0; i < num_platforms; i++) {
+                        if (clGetDeviceIDs(platforms[i], types[type], 1,
+                                device, &num_devices) == CL_SUCCESS &&
+                                num_devices > 0) {
+                                free(platforms);
+                                return SIFT3D_SUCCESS;
+                        }
+                }
+        }
+
+        free(platforms);
+        SIFT3D_ERR("get_device: no OpenCL devices found \n");
+        return SIFT3D_FAILURE;
+}
+
+/* Initialize the device state, compiling the kernels. On success, *cl must
+ * be freed with cleanup_SIFT3D_cl.
+ *
+ * Parameters:
+ *  -cl: The place to write the state.
+ *  -params: The program parameters, which are copied.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int init_SIFT3D_cl(SIFT3D_cl **const cl, const Cl_params *const params) {
+
+        SIFT3D_cl *state;
+        cl_device_id device;
+        cl_int err;
+
+        const char *src = kernels_cl_src;
+        const size_t tri_v_size = (size_t) params->num_tri * 9 *
+                sizeof(cl_float);
+        const size_t tri_idx_size = (size_t) params->num_tri * 3 *
+                sizeof(cl_int);
+
+        *cl = NULL;
+
+        if (get_device(&device))
+                return SIFT3D_FAILURE;
+
+        if ((state = (SIFT3D_cl *) calloc(1, sizeof(SIFT3D_cl))) == NULL)
+                return SIFT3D_FAILURE;
+        state->desc_numel = params->desc_numel;
+
+        // Create the context and queue
+        state->context = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
+        if (check_cl(err, "init_SIFT3D_cl: context"))
+                goto init_SIFT3D_cl_quit;
+        state->queue = clCreateCommandQueue(state->context, device, 0, &err);
+        if (check_cl(err, "init_SIFT3D_cl: command queue"))
+                goto init_SIFT3D_cl_quit;
+
+        // Compile the kernels
+        state->program = clCreateProgramWithSource(state->context, 1, &src,
+                NULL, &err);
+        if (check_cl(err, "init_SIFT3D_cl: program"))
+                goto init_SIFT3D_cl_quit;
+        if (clBuildProgram(state->program, 1, &device, params->options, NULL,
+                NULL) != CL_SUCCESS) {
+
+                char log[4096];
+
+                log[0] = '\0';
+                clGetProgramBuildInfo(state->program, device,
+                        CL_PROGRAM_BUILD_LOG, sizeof(log), log, NULL);
+                log[sizeof(log) - 1] = '\0';
+                SIFT3D_ERR("init_SIFT3D_cl: failed to compile the kernels: "
+                        "\n%s \n", log);
+                goto init_SIFT3D_cl_quit;
+        }
+
+#define CREATE_KERNEL(name) \
+        state->name = clCreateKernel(state->program, #name, &err); \
+        if (check_cl(err, "init_SIFT3D_cl: kernel " #name)) \
+                goto init_SIFT3D_cl_quit;
+
+        CREATE_KERNEL(conv_step)
+        CREATE_KERNEL(conv_gen)
+        CREATE_KERNEL(downsample_2x)
+        CREATE_KERNEL(dog)
+        CREATE_KERNEL(max_abs_rows)
+        CREATE_KERNEL(max_reduce)
+        CREATE_KERNEL(detect_extrema)
+        CREATE_KERNEL(assign_orientations)
+        CREATE_KERNEL(extract_descriptors)
+
+#undef CREATE_KERNEL
+
+        // Upload the mesh
+        if (reserve_buf(state, &state->tri_v, tri_v_size) ||
+                reserve_buf(state, &state->tri_idx, tri_idx_size) ||
+                check_cl(clEnqueueWriteBuffer(state->queue, state->tri_v.mem,
+                        CL_TRUE, 0, tri_v_size, params->tri_v, 0, NULL, NULL),
+                        "init_SIFT3D_cl: mesh") ||
+                check_cl(clEnqueueWriteBuffer(state->queue,
+                        state->tri_idx.mem, CL_TRUE, 0, tri_idx_size,
+                        params->tri_idx, 0, NULL, NULL),
+                        "init_SIFT3D_cl: mesh"))
+                goto init_SIFT3D_cl_quit;
+
+        *cl = state;
+        return SIFT3D_SUCCESS;
+
+init_SIFT3D_cl_quit:
+        cleanup_SIFT3D_cl(state);
+        return SIFT3D_FAILURE;
+}
+
+/* Release all resources of the device state. Does nothing if cl is NULL. */
+void cleanup_SIFT3D_cl(SIFT3D_cl *const cl) {
+
+        int i;
+
+        if (cl == NULL)
+                return;
+
+        release_buf(&cl->im);
+        release_buf(&cl->gpyr);
+        release_buf(&cl->dog_buf);
+        for (i = 0; i < 2; i++) {
+                release_buf(cl->tmp + i);
+        }
+        release_buf(&cl->row_max);
+        release_buf(&cl->dogmax);
+        release_buf(&cl->count);
+        release_buf(&cl->keys);
+        release_buf(&cl->levels);
+        release_buf(&cl->taps);
+        release_buf(&cl->tri_v);
+        release_buf(&cl->tri_idx);
+        release_buf(&cl->desc);
+
+#define RELEASE_KERNEL(name) \
+        if (cl->name != NULL) \
+                clReleaseKernel(cl->name);
+
+        RELEASE_KERNEL(conv_step)
+        RELEASE_KERNEL(conv_gen)
+        RELEASE_KERNEL(downsample_2x)
+        RELEASE_KERNEL(dog)
+        RELEASE_KERNEL(max_abs_rows)
+        RELEASE_KERNEL(max_reduce)
+        RELEASE_KERNEL(detect_extrema)
+        RELEASE_KERNEL(assign_orientations)
+        RELEASE_KERNEL(extract_descriptors)
+
+#undef RELEASE_KERNEL
+
+        if (cl->program != NULL)
+                clReleaseProgram(cl->program);
+        if (cl->queue != NULL)
+                clReleaseCommandQueue(cl->queue);
+        if (cl->context != NULL)
+                clReleaseContext(cl->context);
+
+        free(cl->gpyr_levels);
+        free(cl->dog_levels);
+        free(cl->keys_host);
+        free(cl);
+}
+
+/* Enqueue a kernel over a grid of the given size, skipping empty grids. */
+static int run_kernel(SIFT3D_cl *const cl, cl_kernel kernel,
+                      const cl_uint dim, const size_t *const size) {
+
+        cl_uint i;
+
+        for (i = 0; i < dim; i++) {
+                if (size[i] == 0)
+                        return SIFT3D_SUCCESS;
+        }
+
+        return check_cl(clEnqueueNDRangeKernel(cl->queue, kernel, dim, NULL,
+                size, NULL, 0, NULL, NULL), "run_kernel");
+}
+
+/* Blur an image into a level of the Gaussian pyramid with a separable
+ * filter, as apply_Sep_FIR_filter_temp with unit 1. Each dimension is
+ * convolved directly if the taps fall on whole voxels, or with resampling
+ * otherwise, ping-ponging through the temporary buffers.
+ *
+ * Parameters:
+ *  -src, src_off: The input buffer, and the offset of the image in it.
+ *  -src_geom: The geometry of the input, which is also that of the output.
+ *  -dst_off: The offset of the output in the Gaussian pyramid buffer.
+ *  -taps_off, width: The offset and number of filter taps. */
+static int blur_level(SIFT3D_cl *const cl, const cl_mem src,
+        const cl_ulong src_off, const Dev_geom *const src_geom,
+        const cl_ulong dst_off, const cl_ulong taps_off, const int width) {
+
+        cl_int err;
+        int dim;
+
+        const double units[] = {src_geom->ux, src_geom->uy, src_geom->uz};
+        const cl_int nx = src_geom->nx;
+        const cl_int ny = src_geom->ny;
+        const cl_int nz = src_geom->nz;
+        const cl_int width_arg = width;
+        const size_t size[] = {(size_t) nx, (size_t) ny, (size_t) nz};
+        const cl_ulong zero = 0;
+        const double step_eps = 1E-5;
+
+        for (dim = 0; dim < 3; dim++) {
+
+                cl_kernel kernel;
+                cl_mem pass_src, pass_dst;
+                cl_ulong pass_src_off, pass_dst_off;
+
+                const cl_int dim_arg = dim;
+                const double unit_factor = 1.0 / units[dim];
+                const int step = (int) floor(unit_factor + 0.5);
+
+                pass_src = dim == 0 ? src : cl->tmp[dim - 1].mem;
+                pass_src_off = dim == 0 ? src_off : zero;
+                pass_dst = dim == 2 ? cl->gpyr.mem : cl->tmp[dim].mem;
+                pass_dst_off = dim == 2 ? dst_off : zero;
+
+                // Choose the kernel, as get_conv_step
+                err = CL_SUCCESS;
+                if (step >= 1 && fabs(unit_factor - step) < step_eps) {
+                        const cl_int step_arg = step;
+                        kernel = cl->conv_step;
+                        SET_ARG(kernel, 11, step_arg);
+                } else {
+                        const cl_float unit_factor_arg = (cl_float) unit_factor;
+                        kernel = cl->conv_gen;
+                        SET_ARG(kernel, 11, unit_factor_arg);
+                }
+                SET_ARG(kernel, 0, pass_src);
+                SET_ARG(kernel, 1, pass_src_off);
+                SET_ARG(kernel, 2, pass_dst);
+                SET_ARG(kernel, 3, pass_dst_off);
+                SET_ARG(kernel, 4, nx);
+                SET_ARG(kernel, 5, ny);
+                SET_ARG(kernel, 6, nz);
+                SET_ARG(kernel, 7, dim_arg);
+                SET_ARG(kernel, 8, cl->taps.mem);
+                SET_ARG(kernel, 9, taps_off);
+                SET_ARG(kernel, 10, width_arg);
+                if (check_cl(err, "blur_level") ||
+                        run_kernel(cl, kernel, 3, size))
+                        return SIFT3D_FAILURE;
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Build the Gaussian and DoG pyramids of an image on the device, along with
+ * the maximum absolute value of each DoG level. The results stay in device
+ * memory. The buffers of the previous image are reused if they are large
+ * enough.
+ *
+ * Parameters:
+ *  -gpyr: The layout of the Gaussian pyramid. The DoG pyramid has the same
+ *      layout, with one level fewer per octave.
+ *  -im: The input image, with the dimensions given by gpyr->im. The first
+ *      level of the pyramid must have the same dimensions.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int build_pyramids_cl(SIFT3D_cl *const cl, const Dev_gpyr *const gpyr,
+        const float *const im) {
+
+        cl_ulong *taps_off;
+        size_t gpyr_numel, dog_numel, max_numel, max_rows, taps_numel;
+        cl_int err;
+        int i, o, s;
+
+        const int num_levels = gpyr->num_levels;
+        const int num_dog_levels = num_levels - 1;
+        const int num_gpyr_total = gpyr->num_octaves * num_levels;
+        const int num_dog_total = gpyr->num_octaves * num_dog_levels;
+        const size_t im_numel = (size_t) gpyr->im.nx * gpyr->im.ny *
+                gpyr->im.nz;
+
+        // Verify inputs
+        if (gpyr->num_octaves < 1 || num_levels < 2 ||
+                gpyr->levels[0].nx != gpyr->im.nx ||
+                gpyr->levels[0].ny != gpyr->im.ny ||
+                gpyr->levels[0].nz != gpyr->im.nz) {
+                SIFT3D_ERR("build_pyramids_cl: unsupported pyramid \n");
+                return SIFT3D_FAILURE;
+        }
+
+        // Save the layout
+        free(cl->gpyr_levels);
+        free(cl->dog_levels);
+        cl->gpyr_levels = (Cl_level *) calloc(num_gpyr_total,
+                sizeof(Cl_level));
+        cl->dog_levels = (Cl_level *) calloc(num_dog_total, sizeof(Cl_level));
+        taps_off = (cl_ulong *) calloc(num_gpyr_total, sizeof(cl_ulong));
+        if (cl->gpyr_levels == NULL || cl->dog_levels == NULL ||
+                taps_off == NULL)
+                goto build_pyramids_cl_quit;
+        cl->first_octave = gpyr->first_octave;
+        cl->first_level = gpyr->first_level;
+        cl->num_octaves = gpyr->num_octaves;
+        cl->num_levels = num_levels;
+
+        // Compute the offsets of each level, and of its filter taps
+        gpyr_numel = dog_numel = max_numel = max_rows = taps_numel = 0;
+        for (i = 0; i < num_gpyr_total; i++) {
+
+                Cl_level *const lev = cl->gpyr_levels + i;
+                const Dev_geom *const geom = gpyr->levels + i;
+                const size_t numel = (size_t) geom->nx * geom->ny * geom->nz;
+                const size_t rows = (size_t) geom->ny * geom->nz;
+
+                lev->offset = gpyr_numel;
+                lev->nx = geom->nx;
+                lev->ny = geom->ny;
+                lev->nz = geom->nz;
+                lev->ux = (cl_float) geom->ux;
+                lev->uy = (cl_float) geom->uy;
+                lev->uz = (cl_float) geom->uz;
+                lev->s = (cl_float) geom->s;
+                gpyr_numel += numel;
+                max_numel = numel > max_numel ? numel : max_numel;
+                max_rows = rows > max_rows ? rows : max_rows;
+
+                // The DoG level shares the geometry of the Gaussian level
+                if (i % num_levels < num_dog_levels) {
+                        Cl_level *const dog_lev = cl->dog_levels +
+                                i / num_levels * num_dog_levels +
+                                i % num_levels;
+                        *dog_lev = *lev;
+                        dog_lev->offset = dog_numel;
+                        dog_numel += numel;
+                }
+
+                taps_off[i] = taps_numel;
+                if (gpyr->kernels[i] != NULL)
+                        taps_numel += gpyr->widths[i];
+        }
+
+        // Allocate the buffers
+        if (reserve_buf(cl, &cl->im, im_numel * sizeof(cl_float)) ||
+                reserve_buf(cl, &cl->gpyr, gpyr_numel * sizeof(cl_float)) ||
+                reserve_buf(cl, &cl->dog_buf, dog_numel * sizeof(cl_float)) ||
+                reserve_buf(cl, cl->tmp, max_numel * sizeof(cl_float)) ||
+                reserve_buf(cl, cl->tmp + 1, max_numel * sizeof(cl_float)) ||
+                reserve_buf(cl, &cl->row_max, max_rows * sizeof(cl_float)) ||
+                reserve_buf(cl, &cl->dogmax, num_dog_total *
+                        sizeof(cl_float)) ||
+                reserve_buf(cl, &cl->levels, num_gpyr_total *
+                        sizeof(Cl_level)) ||
+                reserve_buf(cl, &cl->taps, taps_numel * sizeof(cl_float)))
+                goto build_pyramids_cl_quit;
+
+        // Upload the image, the layout and the filters
+        err = clEnqueueWriteBuffer(cl->queue, cl->im.mem, CL_TRUE, 0,
+                im_numel * sizeof(cl_float), im, 0, NULL, NULL);
+        err |= clEnqueueWriteBuffer(cl->queue, cl->levels.mem, CL_TRUE, 0,
+                num_gpyr_total * sizeof(Cl_level), cl->gpyr_levels, 0, NULL,
+                NULL);
+        for (i = 0; i < num_gpyr_total; i++) {
+                if (gpyr->kernels[i] == NULL)
+                        continue;
+                err |= clEnqueueWriteBuffer(cl->queue, cl->taps.mem, CL_TRUE,
+                        taps_off[i] * sizeof(cl_float),
+                        gpyr->widths[i] * sizeof(cl_float), gpyr->kernels[i],
+                        0, NULL, NULL);
+        }
+        if (check_cl(err, "build_pyramids_cl: upload"))
+                goto build_pyramids_cl_quit;
+
+        // Build the Gaussian pyramid
+        for (o = 0; o < gpyr->num_octaves; o++) {
+        for (s = 0; s < num_levels; s++) {
+
+                const int idx = o * num_levels + s;
+                const Cl_level *const lev = cl->gpyr_levels + idx;
+
+                // Blur the input image
+                if (idx == 0) {
+                        if (blur_level(cl, cl->im.mem, 0, &gpyr->im,
+                                lev->offset, taps_off[idx], gpyr->widths[idx]))
+                                goto build_pyramids_cl_quit;
+                        continue;
+                }
+
+                // Downsample the previous octave
+                if (s == 0) {
+
+                        const Cl_level *const prev = cl->gpyr_levels +
+                                (o - 1) * num_levels + gpyr->downsample_level;
+                        const size_t size[] = {(size_t) lev->nx,
+                                (size_t) lev->ny, (size_t) lev->nz};
+
+                        err = CL_SUCCESS;
+                        SET_ARG(cl->downsample_2x, 0, cl->gpyr.mem);
+                        SET_ARG(cl->downsample_2x, 1, prev->offset);
+                        SET_ARG(cl->downsample_2x, 2, prev->nx);
+                        SET_ARG(cl->downsample_2x, 3, prev->ny);
+                        SET_ARG(cl->downsample_2x, 4, cl->gpyr.mem);
+                        SET_ARG(cl->downsample_2x, 5, lev->offset);
+                        SET_ARG(cl->downsample_2x, 6, lev->nx);
+                        SET_ARG(cl->downsample_2x, 7, lev->ny);
+                        SET_ARG(cl->downsample_2x, 8, lev->nz);
+                        if (check_cl(err, "build_pyramids_cl: downsample") ||
+                                run_kernel(cl, cl->downsample_2x, 3, size))
+                                goto build_pyramids_cl_quit;
+                        continue;
+                }
+
+                // Blur the previous level
+                if (blur_level(cl, cl->gpyr.mem, lev[-1].offset,
+                        gpyr->levels + idx - 1, lev->offset, taps_off[idx],
+                        gpyr->widths[idx]))
+                        goto build_pyramids_cl_quit;
+        }}
+
+        // Build the DoG pyramid, and find the maximum of each level
+        for (o = 0; o < gpyr->num_octaves; o++) {
+        for (s = 0; s < num_dog_levels; s++) {
+
+                const int idx = o * num_dog_levels + s;
+                const Cl_level *const cur = cl->gpyr_levels +
+                        o * num_levels + s;
+                const Cl_level *const dog_lev = cl->dog_levels + idx;
+                const cl_ulong numel = (cl_ulong) dog_lev->nx * dog_lev->ny *
+                        dog_lev->nz;
+                const cl_int num_rows = dog_lev->ny * dog_lev->nz;
+                const cl_int idx_arg = idx;
+                const size_t dog_size = (size_t) numel;
+                const size_t rows_size = (size_t) num_rows;
+                const size_t one = 1;
+
+                err = CL_SUCCESS;
+                SET_ARG(cl->dog, 0, cl->gpyr.mem);
+                SET_ARG(cl->dog, 1, cur[0].offset);
+                SET_ARG(cl->dog, 2, cur[1].offset);
+                SET_ARG(cl->dog, 3, cl->dog_buf.mem);
+                SET_ARG(cl->dog, 4, dog_lev->offset);
+                SET_ARG(cl->dog, 5, numel);
+                SET_ARG(cl->max_abs_rows, 0, cl->dog_buf.mem);
+                SET_ARG(cl->max_abs_rows, 1, dog_lev->offset);
+                SET_ARG(cl->max_abs_rows, 2, dog_lev->nx);
+                SET_ARG(cl->max_abs_rows, 3, num_rows);
+                SET_ARG(cl->max_abs_rows, 4, cl->row_max.mem);
+                SET_ARG(cl->max_reduce, 0, cl->row_max.mem);
+                SET_ARG(cl->max_reduce, 1, num_rows);
+                SET_ARG(cl->max_reduce, 2, cl->dogmax.mem);
+                SET_ARG(cl->max_reduce, 3, idx_arg);
+                if (check_cl(err, "build_pyramids_cl: DoG") ||
+                        run_kernel(cl, cl->dog, 1, &dog_size) ||
+                        run_kernel(cl, cl->max_abs_rows, 1, &rows_size) ||
+                        run_kernel(cl, cl->max_reduce, 1, &one))
+                        goto build_pyramids_cl_quit;
+        }}
+
+        free(taps_off);
+        return SIFT3D_SUCCESS;
+
+build_pyramids_cl_quit:
+        free(taps_off);
+        return SIFT3D_FAILURE;
+}
+
+/* Order keypoints by octave, level, and position, as detect_extrema. */
+static int cmp_Cl_key(const void *a, const void *b) {
+
+        const Cl_key *const ka = (const Cl_key *) a;
+        const Cl_key *const kb = (const Cl_key *) b;
+
+        if (ka->o != kb->o)
+                return ka->o < kb->o ? -1 : 1;
+        if (ka->s != kb->s)
+                return ka->s < kb->s ? -1 : 1;
+        if (ka->zd != kb->zd)
+                return ka->zd < kb->zd ? -1 : 1;
+        if (ka->yd != kb->yd)
+                return ka->yd < kb->yd ? -1 : 1;
+        if (ka->xd != kb->xd)
+                return ka->xd < kb->xd ? -1 : 1;
+
+        return 0;
+}
+
+/* Detect keypoints in the pyramids built by build_pyramids_cl, and assign
+ * their orientations. Only the accepted keypoints are read back.
+ *
+ * Parameters:
+ *  -peak_thresh, corner_thresh: The SIFT3D thresholds.
+ *  -ori_sig_fctr: The ratio of the orientation window parameter to the
+ *      keypoint scale.
+ *  -keys: Set to an array of the keypoints, in the order of detect_extrema.
+ *      The array belongs to cl, and is valid until the next call.
+ *  -num: Set to the number of keypoints.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int detect_keypoints_cl(SIFT3D_cl *const cl, const float peak_thresh,
+        const float ori_sig_fctr, const float corner_thresh,
+        Cl_key **const keys, int *const num) {
+
+        cl_int count, cap, err, num_arg;
+        int i, o, s, num_accepted;
+
+        const int num_levels = cl->num_levels;
+        const int num_dog_levels = num_levels - 1;
+        const cl_int zero = 0;
+
+        *keys = NULL;
+        *num = 0;
+
+        // Verify inputs
+        if (num_dog_levels < 3) {
+                SIFT3D_ERR("detect_keypoints_cl: Requires at least 3 levels "
+                        "per octave, provided only %d \n", num_dog_levels);
+                return SIFT3D_FAILURE;
+        }
+
+        cap = cl->keys.size / sizeof(Cl_key);
+        if (cap < KEYS_CAP_DEFAULT)
+                cap = KEYS_CAP_DEFAULT;
+        if (reserve_buf(cl, &cl->count, sizeof(cl_int)))
+                return SIFT3D_FAILURE;
+
+        // Find the extrema, growing the buffer and trying again on overflow
+        while (1) {
+
+                if (reserve_buf(cl, &cl->keys, cap * sizeof(Cl_key)) ||
+                        check_cl(clEnqueueWriteBuffer(cl->queue,
+                                cl->count.mem, CL_TRUE, 0, sizeof(cl_int),
+                                &zero, 0, NULL, NULL),
+                                "detect_keypoints_cl"))
+                        return SIFT3D_FAILURE;
+
+                for (o = 0; o < cl->num_octaves; o++) {
+                for (s = 1; s < num_dog_levels - 1; s++) {
+
+                        const int dog_idx = o * num_dog_levels + s;
+                        const Cl_level *const cur = cl->dog_levels + dog_idx;
+                        const cl_int dog_idx_arg = dog_idx;
+                        const cl_int o_arg = o + cl->first_octave;
+                        const cl_int s_arg = s + cl->first_level;
+                        const cl_int level = o * num_levels + s;
+                        const size_t size[] = {
+                                cur->nx > 2 ? (size_t) cur->nx - 2 : 0,
+                                cur->ny > 2 ? (size_t) cur->ny - 2 : 0,
+                                cur->nz > 2 ? (size_t) cur->nz - 2 : 0};
+
+                        err = CL_SUCCESS;
+                        SET_ARG(cl->detect_extrema, 0, cl->dog_buf.mem);
+                        SET_ARG(cl->detect_extrema, 1, cur[-1].offset);
+                        SET_ARG(cl->detect_extrema, 2, cur[0].offset);
+                        SET_ARG(cl->detect_extrema, 3, cur[1].offset);
+                        SET_ARG(cl->detect_extrema, 4, cur->nx);
+                        SET_ARG(cl->detect_extrema, 5, cur->ny);
+                        SET_ARG(cl->detect_extrema, 6, cur->nz);
+                        SET_ARG(cl->detect_extrema, 7, cl->dogmax.mem);
+                        SET_ARG(cl->detect_extrema, 8, dog_idx_arg);
+                        SET_ARG(cl->detect_extrema, 9, peak_thresh);
+                        SET_ARG(cl->detect_extrema, 10, o_arg);
+                        SET_ARG(cl->detect_extrema, 11, s_arg);
+                        SET_ARG(cl->detect_extrema, 12, level);
+                        SET_ARG(cl->detect_extrema, 13, cur->s);
+                        SET_ARG(cl->detect_extrema, 14, cl->keys.mem);
+                        SET_ARG(cl->detect_extrema, 15, cl->count.mem);
+                        SET_ARG(cl->detect_extrema, 16, cap);
+                        if (check_cl(err, "detect_keypoints_cl: extrema") ||
+                                run_kernel(cl, cl->detect_extrema, 3, size))
+                                return SIFT3D_FAILURE;
+                }}
+
+                if (check_cl(clEnqueueReadBuffer(cl->queue, cl->count.mem,
+                        CL_TRUE, 0, sizeof(cl_int), &count, 0, NULL, NULL),
+                        "detect_keypoints_cl"))
+                        return SIFT3D_FAILURE;
+
+                if (count <= cap)
+                        break;
+                cap = count;
+        }
+
+        if (count == 0)
+                return SIFT3D_SUCCESS;
+
+        // Assign the orientations
+        {
+                const size_t size = (size_t) count;
+
+                num_arg = count;
+                err = CL_SUCCESS;
+                SET_ARG(cl->assign_orientations, 0, cl->gpyr.mem);
+                SET_ARG(cl->assign_orientations, 1, cl->levels.mem);
+                SET_ARG(cl->assign_orientations, 2, cl->keys.mem);
+                SET_ARG(cl->assign_orientations, 3, num_arg);
+                SET_ARG(cl->assign_orientations, 4, ori_sig_fctr);
+                SET_ARG(cl->assign_orientations, 5, corner_thresh);
+                if (check_cl(err, "detect_keypoints_cl: orientations") ||
+                        run_kernel(cl, cl->assign_orientations, 1, &size))
+                        return SIFT3D_FAILURE;
+        }
+
+        // Read back the keypoints
+        if (count > cl->keys_host_cap) {
+
+                Cl_key *keys_new;
+
+                if ((keys_new = (Cl_key *) realloc(cl->keys_host,
+                        count * sizeof(Cl_key))) == NULL)
+                        return SIFT3D_FAILURE;
+                cl->keys_host = keys_new;
+                cl->keys_host_cap = count;
+        }
+        if (check_cl(clEnqueueReadBuffer(cl->queue, cl->keys.mem, CL_TRUE, 0,
+                count * sizeof(Cl_key), cl->keys_host, 0, NULL, NULL),
+                "detect_keypoints_cl"))
+                return SIFT3D_FAILURE;
+
+        // Remove the rejected keypoints, and sort the rest
+        num_accepted = 0;
+        for (i = 0; i < count; i++) {
+                if (cl->keys_host[i].xd < 0.0f)
+                        continue;
+                cl->keys_host[num_accepted++] = cl->keys_host[i];
+        }
+        qsort(cl->keys_host, num_accepted, sizeof(Cl_key), cmp_Cl_key);
+
+        *keys = cl->keys_host;
+        *num = num_accepted;
+        return SIFT3D_SUCCESS;
+}
+
+/* Extract descriptors from the Gaussian pyramid built by build_pyramids_cl.
+ *
+ * Parameters:
+ *  -keys: The keypoints, with level set to their index in the Gaussian
+ *      pyramid, counting from the first level of the first octave.
+ *  -num: The number of keypoints.
+ *  -desc: The output, which must hold num * desc_numel elements, where
+ *      desc_numel was given to init_SIFT3D_cl.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int extract_descriptors_cl(SIFT3D_cl *const cl, const Cl_key *const keys,
+        const int num, float *const desc) {
+
+        cl_int err, num_arg;
+        int i;
+
+        const int num_levels_total = cl->num_octaves * cl->num_levels;
+        const size_t keys_size = (size_t) num * sizeof(Cl_key);
+        const size_t desc_size = (size_t) num * cl->desc_numel *
+                sizeof(cl_float);
+        const size_t size = (size_t) num;
+
+        if (num < 1)
+                return SIFT3D_SUCCESS;
+
+        // Verify inputs
+        for (i = 0; i < num; i++) {
+
+                const Cl_key *const key = keys + i;
+
+                if (key->level < 0 || key->level >= num_levels_total) {
+                        SIFT3D_ERR("extract_descriptors_cl: keypoint %d is "
+                                "not in the pyramid \n", i);
+                        return SIFT3D_FAILURE;
+                }
+        }
+
+        // Upload the keypoints
+        if (reserve_buf(cl, &cl->keys, keys_size) ||
+                reserve_buf(cl, &cl->desc, desc_size) ||
+                check_cl(clEnqueueWriteBuffer(cl->queue, cl->keys.mem,
+                        CL_TRUE, 0, keys_size, keys, 0, NULL, NULL),
+                        "extract_descriptors_cl"))
+                return SIFT3D_FAILURE;
+
+        // Extract the descriptors
+        num_arg = num;
+        err = CL_SUCCESS;
+        SET_ARG(cl->extract_descriptors, 0, cl->gpyr.mem);
+        SET_ARG(cl->extract_descriptors, 1, cl->levels.mem);
+        SET_ARG(cl->extract_descriptors, 2, cl->keys.mem);
+        SET_ARG(cl->extract_descriptors, 3, num_arg);
+        SET_ARG(cl->extract_descriptors, 4, cl->tri_v.mem);
+        SET_ARG(cl->extract_descriptors, 5, cl->tri_idx.mem);
+        SET_ARG(cl->extract_descriptors, 6, cl->desc.mem);
+        if (check_cl(err, "extract_descriptors_cl") ||
+                run_kernel(cl, cl->extract_descriptors, 1, &size))
+                return SIFT3D_FAILURE;
+
+        // Read back the results
+        return check_cl(clEnqueueReadBuffer(cl->queue, cl->desc.mem, CL_TRUE,
+                0, desc_size, desc, 0, NULL, NULL), "extract_descriptors_cl");
+}
+
+/* Read back the pyramids built by build_pyramids_cl.
+ *
+ * Parameters:
+ *  -gpyr: The data of each Gaussian level, in the order of Dev_gpyr.levels.
+ *  -dog: The data of each DoG level, or NULL to skip the DoG pyramid.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int read_pyramids_cl(SIFT3D_cl *const cl, float *const *const gpyr,
+        float *const *const dog) {
+
+        cl_int err;
+        int i;
+
+        const int num_gpyr_total = cl->num_octaves * cl->num_levels;
+        const int num_dog_total = cl->num_octaves * (cl->num_levels - 1);
+
+        err = CL_SUCCESS;
+        for (i = 0; i < num_gpyr_total; i++) {
+
+                const Cl_level *const lev = cl->gpyr_levels + i;
+
+                err |= clEnqueueReadBuffer(cl->queue, cl->gpyr.mem, CL_FALSE,
+                        lev->offset * sizeof(cl_float), (size_t) lev->nx *
+                        lev->ny * lev->nz * sizeof(cl_float), gpyr[i], 0,
+                        NULL, NULL);
+        }
+        for (i = 0; dog != NULL && i < num_dog_total; i++) {
+
+                const Cl_level *const lev = cl->dog_levels + i;
+
+                err |= clEnqueueReadBuffer(cl->queue, cl->dog_buf.mem,
+                        CL_FALSE, lev->offset * sizeof(cl_float),
+                        (size_t) lev->nx * lev->ny * lev->nz *
+                        sizeof(cl_float), dog[i], 0, NULL, NULL);
+        }
+        err |= clFinish(cl->queue);
+
+        return check_cl(err, "read_pyramids_cl");
+}
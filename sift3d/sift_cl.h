@@ -0,0 +1,61 @@
+/* -----------------------------------------------------------------------------
+ * sift_cl.h
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2015-2016 Blaine Rister et al., see LICENSE for details.
+ * -----------------------------------------------------------------------------
+ * Internal header for the OpenCL backend, see sift_cl.c. This header uses
+ * only standard C types, so that it can be included alongside imtypes.h,
+ * which defines placeholders for the OpenCL types.
+ * -----------------------------------------------------------------------------
+ */
+
+#ifndef _SIFT_CL_H
+#define _SIFT_CL_H
+
+#include "sift_dev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Opaque device state */
+typedef struct _SIFT3D_cl SIFT3D_cl;
+
+/* A keypoint. Must match the Key struct in kernels.cl. */
+typedef struct _Cl_key {
+        float xd, yd, zd, sd;   // Position, in level voxels, and scale
+        int o, s, level, pad;   // Pyramid indices, and absolute level index
+        float R[9];             // Rotation matrix, in row-major order
+} Cl_key;
+
+/* Parameters of the device program */
+typedef struct _Cl_params {
+        const char *options;    // Compiler options defining the constants
+        const float *tri_v;     // Vertices of each triangle, [num_tri x 9]
+        const int *tri_idx;     // Bin of each vertex, [num_tri x 3]
+        int num_tri;            // Number of triangles in the mesh
+        int desc_numel;         // Number of elements in a descriptor
+} Cl_params;
+
+int init_SIFT3D_cl(SIFT3D_cl **const cl, const Cl_params *const params);
+
+void cleanup_SIFT3D_cl(SIFT3D_cl *const cl);
+
+int build_pyramids_cl(SIFT3D_cl *const cl, const Dev_gpyr *const gpyr,
+        const float *const im);
+
+int detect_keypoints_cl(SIFT3D_cl *const cl, const float peak_thresh,
+        const float ori_sig_fctr, const float corner_thresh,
+        Cl_key **const keys, int *const num);
+
+int extract_descriptors_cl(SIFT3D_cl *const cl, const Cl_key *const keys,
+        const int num, float *const desc);
+
+int read_pyramids_cl(SIFT3D_cl *const cl, float *const *const gpyr,
+        float *const *const dog);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,792 @@
+/* -----------------------------------------------------------------------------
+ * sift_cuda.cu
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2015-2016 Blaine Rister et al., see LICENSE for details.
+ * -----------------------------------------------------------------------------
+ * This file contains the CUDA backend. The Gaussian and DoG pyramids are
+ * built on the device and read back for keypoint detection on the host.
+ * Descriptor matching computes the matrix of squared distances as
+ * |a|^2 + |b|^2 - 2 a.b, where the dot products are a single matrix
+ * product, so that exhaustive matching runs at the speed of the GEMM.
+ * -----------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <cuda_runtime.h>
+#include <cublas_v2.h>
+#include "sift_cuda.h"
+
+/* This file is compiled as CUDA C++, apart from the library headers, so the
+ * return codes are repeated here. */
+#define SIFT3D_SUCCESS 0
+#define SIFT3D_FAILURE -1
+#define SIFT3D_ERR(...) fprintf(stderr, __VA_ARGS__)
+
+/* Thread block dimensions of the image kernels */
+#define BLOCK_X 32
+#define BLOCK_Y 4
+#define BLOCK_Z 2
+
+/* Number of threads searching each row of the distance matrix */
+#define KNN_BLOCK 256
+
+/* Maximum number of elements in a tile of the distance matrix */
+#define KNN_TILE_NUMEL ((size_t) 1 << 26)
+
+/* Get the index of voxel (x, y, z) of an image starting at off */
+#define VOX_IDX(off, nx, ny, x, y, z) \
+        ((off) + (size_t) (x) + (size_t) (nx) * ((size_t) (y) + \
+        (size_t) (ny) * (size_t) (z)))
+
+/* A device buffer, which is reallocated only when it must grow */
+typedef struct _Cuda_buf {
+        void *ptr;
+        size_t size;
+} Cuda_buf;
+
+/* Geometry of a pyramid level */
+typedef struct _Cuda_level {
+        size_t offset;
+        int nx, ny, nz;
+} Cuda_level;
+
+/* Device state */
+struct _SIFT3D_cuda {
+
+        cublasHandle_t blas;
+
+        // Pyramid buffers
+        Cuda_buf im, gpyr, dog, tmp[2], taps;
+
+        // Matching buffers
+        Cuda_buf query, ref, ref_norm, dots, idx;
+};
+
+static int check_cuda(const cudaError_t err, const char *const msg);
+static int check_cublas(const cublasStatus_t status, const char *const msg);
+static int reserve_buf(Cuda_buf *const buf, const size_t size);
+static void release_buf(Cuda_buf *const buf);
+static dim3 get_grid(const int nx, const int ny, const int nz);
+static int blur_level(SIFT3D_cuda *const cuda, const float *const src,
+        const Dev_geom *const src_geom, float *const dst,
+        const float *const taps, const int width);
+
+/* Mirror an index into the range [0, n - 1], as mirror_idx in imutil.c. */
+__device__ static int mirror_idx(int i, const int n) {
+
+        const int period = 2 * (n - 1);
+
+        if (n < 2)
+                return 0;
+
+        i %= period;
+        if (i < 0)
+                i += period;
+
+        return i < n ? i : period - i;
+}
+
+/* Convolve dimension dim of an image with a filter whose taps are step
+ * voxels apart, mirroring the boundaries, as convolve_sep_fast in
+ * imutil.c. */
+__global__ static void conv_step(const float *const src, float *const dst,
+        const int nx, const int ny, const int nz, const int dim,
+        const float *const taps, const int width, const int step) {
+
+        int c[3];
+        float acc;
+        int j;
+
+        const int x = blockIdx.x * blockDim.x + threadIdx.x;
+        const int y = blockIdx.y * blockDim.y + threadIdx.y;
+        const int z = blockIdx.z * blockDim.z + threadIdx.z;
+        const int n[3] = {nx, ny, nz};
+        const int half_width = width / 2;
+
+        if (x >= nx || y >= ny || z >= nz)
+                return;
+
+        acc = 0.0f;
+        for (j = 0; j < width; j++) {
+                c[0] = x;
+                c[1] = y;
+                c[2] = z;
+                c[dim] = mirror_idx(c[dim] + (half_width - j) * step, n[dim]);
+                acc += taps[j] * src[VOX_IDX(0, nx, ny, c[0], c[1], c[2])];
+        }
+
+        dst[VOX_IDX(0, nx, ny, x, y, z)] = acc;
+}
+
+/* Sample src at base + off in dimension dim, with linear interpolation, as
+ * the SAMP_AND_ACC macro in imutil.c. */
+__device__ static float conv_sample(const float *const src,
+        const int *const n, const int *const base, const int dim,
+        const float off) {
+
+        int lo[3], hi[3];
+        float off_lo, frac;
+        int i;
+
+        for (i = 0; i < 3; i++) {
+                lo[i] = base[i];
+        }
+
+        off_lo = floorf(off);
+        if (lo[dim] + (int) off_lo < 0)
+                off_lo = (float) -lo[dim];
+        frac = off - off_lo;
+        lo[dim] += (int) off_lo;
+
+        // The upper sample has no weight at the last voxel
+        for (i = 0; i < 3; i++) {
+                hi[i] = lo[i];
+        }
+        hi[dim] = lo[dim] + 1 < n[dim] ? lo[dim] + 1 : lo[dim];
+
+        return (1.0f - frac) * src[VOX_IDX(0, n[0], n[1], lo[0], lo[1],
+                lo[2])] + frac * src[VOX_IDX(0, n[0], n[1], hi[0], hi[1],
+                hi[2])];
+}
+
+/* Convolve dimension dim of an image with a filter whose taps are
+ * unit_factor voxels apart, resampling with linear interpolation, as
+ * convolve_sep_gen in imutil.c. */
+__global__ static void conv_gen(const float *const src, float *const dst,
+        const int nx, const int ny, const int nz, const int dim,
+        const float *const taps, const int width, const float unit_factor) {
+
+        int base[3];
+        float acc;
+        int d;
+
+        const int x = blockIdx.x * blockDim.x + threadIdx.x;
+        const int y = blockIdx.y * blockDim.y + threadIdx.y;
+        const int z = blockIdx.z * blockDim.z + threadIdx.z;
+        const int n[3] = {nx, ny, nz};
+        const int coords[3] = {x, y, z};
+        const int half_width = width / 2;
+        const int unit_half_width = (int) ceilf(half_width * unit_factor);
+        const int start = unit_half_width;
+        const int end = n[dim] - 1 - unit_half_width - 1;
+        const int dim_end = n[dim] - 1;
+        const float conv_eps = 0.1f;
+
+        if (x >= nx || y >= ny || z >= nz)
+                return;
+
+        acc = 0.0f;
+        for (d = -half_width; d <= half_width; d++) {
+
+                float off;
+
+                const float tap = taps[d + half_width];
+                const float step = d * unit_factor;
+                const float coord = (float) coords[dim] - step;
+                const float end_dist = (float) (coords[dim] - dim_end) - step;
+
+                base[0] = x;
+                base[1] = y;
+                base[2] = z;
+
+                // Mirror the coordinates of the boundary voxels
+                if (coords[dim] >= start && coords[dim] <= end) {
+                        off = -step;
+                } else if ((int) coord < 0) {
+                        base[dim] = 0;
+                        off = -coord;
+                } else if (end_dist >= 0.0f) {
+                        base[dim] = dim_end;
+                        off = -end_dist - conv_eps;
+                } else {
+                        off = -step;
+                }
+
+                acc += tap * conv_sample(src, n, base, dim, off);
+        }
+
+        dst[VOX_IDX(0, nx, ny, x, y, z)] = acc;
+}
+
+/* Downsample an image by a factor of 2 in each dimension, as
+ * im_downsample_2x in imutil.c. */
+__global__ static void downsample_2x(const float *const src,
+        const int src_nx, const int src_ny, float *const dst, const int nx,
+        const int ny, const int nz) {
+
+        const int x = blockIdx.x * blockDim.x + threadIdx.x;
+        const int y = blockIdx.y * blockDim.y + threadIdx.y;
+        const int z = blockIdx.z * blockDim.z + threadIdx.z;
+
+        if (x >= nx || y >= ny || z >= nz)
+                return;
+
+        dst[VOX_IDX(0, nx, ny, x, y, z)] =
+                src[VOX_IDX(0, src_nx, src_ny, x << 1, y << 1, z << 1)];
+}
+
+/* Compute a DoG level as the difference of two Gaussian levels. */
+__global__ static void dog_diff(const float *const cur,
+        const float *const next, float *const dog, const size_t numel) {
+
+        const size_t i = (size_t) blockIdx.x * blockDim.x + threadIdx.x;
+
+        if (i >= numel)
+                return;
+
+        dog[i] = cur[i] - next[i];
+}
+
+/* Compute the squared L2 norm of each row of a matrix. */
+__global__ static void sq_norms(const float *const x, const int num_rows,
+        const int numel, float *const norms) {
+
+        float acc;
+        int j;
+
+        const int row = blockIdx.x * blockDim.x + threadIdx.x;
+
+        if (row >= num_rows)
+                return;
+
+        acc = 0.0f;
+        for (j = 0; j < numel; j++) {
+                const float val = x[(size_t) row * numel + j];
+                acc += val * val;
+        }
+
+        norms[row] = acc;
+}
+
+/* Insert (d, j) in a list of the k smallest distances, sorted in
+ * increasing order. Ties keep the earlier entry first. */
+__device__ static void knn_insert(float *const dist, int *const idx,
+        const int k, const float d, const int j) {
+
+        int i;
+
+        if (!(d < dist[k - 1]))
+                return;
+
+        for (i = k - 1; i > 0 && d < dist[i - 1]; i--) {
+                dist[i] = dist[i - 1];
+                idx[i] = idx[i - 1];
+        }
+        dist[i] = d;
+        idx[i] = j;
+}
+
+/* Find the k nearest references of each query in a tile of the distance
+ * matrix, given the dot products of the queries and references, and the
+ * squared norms of the references. The norm of the query is the same for
+ * every reference, so it is omitted. Each block searches one row, merging
+ * the lists of its threads in a tree. Missing neighbors have index -1. The
+ * order of tied neighbors is unspecified. */
+__global__ static void knn_rows(const float *const dots, const int num_ref,
+        const float *const ref_norm, const int k, int *const idx) {
+
+        __shared__ float s_dist[KNN_BLOCK * CUDA_KNN_MAX];
+        __shared__ int s_idx[KNN_BLOCK * CUDA_KNN_MAX];
+        int i, j, stride;
+
+        const int row = blockIdx.x;
+        const int tid = threadIdx.x;
+        const float *const row_dots = dots + (size_t) row * num_ref;
+        float *const dist = s_dist + tid * CUDA_KNN_MAX;
+        int *const nbrs = s_idx + tid * CUDA_KNN_MAX;
+
+        // Search a strided subset of the references
+        for (i = 0; i < k; i++) {
+                dist[i] = FLT_MAX;
+                nbrs[i] = -1;
+        }
+        for (j = tid; j < num_ref; j += blockDim.x) {
+                knn_insert(dist, nbrs, k, ref_norm[j] - 2.0f * row_dots[j],
+                        j);
+        }
+        __syncthreads();
+
+        // Merge the lists
+        for (stride = blockDim.x / 2; stride > 0; stride /= 2) {
+                if (tid < stride) {
+
+                        const float *const other_dist = dist +
+                                stride * CUDA_KNN_MAX;
+                        const int *const other_nbrs = nbrs +
+                                stride * CUDA_KNN_MAX;
+
+                        for (i = 0; i < k && other_nbrs[i] >= 0; i++) {
+                                knn_insert(dist, nbrs, k, other_dist[i],
+                                        other_nbrs[i]);
+                        }
+                }
+                __syncthreads();
+        }
+
+        // Write the merged list of the first thread
+        if (tid < k)
+                idx[(size_t) row * k + tid] = s_idx[tid];
+}
+
+/* Report a CUDA error. Returns SIFT3D_SUCCESS if err is cudaSuccess,
+ * SIFT3D_FAILURE otherwise. */
+static int check_cuda(const cudaError_t err, const char *const msg) {
+
+        if (err == cudaSuccess)
+                return SIFT3D_SUCCESS;
+
+        SIFT3D_ERR("%s: CUDA error: %s \n", msg, cudaGetErrorString(err));
+        return SIFT3D_FAILURE;
+}
+
+/* As check_cuda, for cuBLAS. */
+static int check_cublas(const cublasStatus_t status, const char *const msg) {
+
+        if (status == CUBLAS_STATUS_SUCCESS)
+                return SIFT3D_SUCCESS;
+
+        SIFT3D_ERR("%s: cuBLAS error %d \n", msg, (int) status);
+        return SIFT3D_FAILURE;
+}
+
+/* Ensure that buf holds at least size bytes. The contents are not preserved
+ * when the buffer grows. */
+static int reserve_buf(Cuda_buf *const buf, const size_t size) {
+
+        if (buf->ptr != NULL && buf->size >= size)
+                return SIFT3D_SUCCESS;
+
+        release_buf(buf);
+        if (check_cuda(cudaMalloc(&buf->ptr, size > 0 ? size : 1),
+                "reserve_buf")) {
+                buf->ptr = NULL;
+                return SIFT3D_FAILURE;
+        }
+        buf->size = size;
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Release a device buffer, if it was allocated. */
+static void release_buf(Cuda_buf *const buf) {
+
+        if (buf->ptr != NULL)
+                cudaFree(buf->ptr);
+        buf->ptr = NULL;
+        buf->size = 0;
+}
+
+/* Get the grid of blocks covering an image. */
+static dim3 get_grid(const int nx, const int ny, const int nz) {
+        return dim3((nx + BLOCK_X - 1) / BLOCK_X, (ny + BLOCK_Y - 1) / BLOCK_Y,
+                (nz + BLOCK_Z - 1) / BLOCK_Z);
+}
+
+/* Initialize the device state, using the current CUDA device.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int init_SIFT3D_cuda(SIFT3D_cuda **const cuda) {
+
+        SIFT3D_cuda *state;
+        int num_devices;
+
+        *cuda = NULL;
+
+        if (check_cuda(cudaGetDeviceCount(&num_devices),
+                "init_SIFT3D_cuda"))
+                return SIFT3D_FAILURE;
+        if (num_devices < 1) {
+                SIFT3D_ERR("init_SIFT3D_cuda: no CUDA devices found \n");
+                return SIFT3D_FAILURE;
+        }
+
+        if ((state = (SIFT3D_cuda *) calloc(1, sizeof(SIFT3D_cuda))) == NULL)
+                return SIFT3D_FAILURE;
+
+        if (check_cublas(cublasCreate(&state->blas), "init_SIFT3D_cuda")) {
+                free(state);
+                return SIFT3D_FAILURE;
+        }
+
+#if CUDART_VERSION >= 11000
+        // Allow tensor cores. The neighbors are re-ranked on the host, so
+        // the reduced precision only affects which candidates are kept.
+        cublasSetMathMode(state->blas, CUBLAS_TF32_TENSOR_OP_MATH);
+#endif
+
+        *cuda = state;
+        return SIFT3D_SUCCESS;
+}
+
+/* Release all resources of the device state. Does nothing if cuda is
+ * NULL. */
+void cleanup_SIFT3D_cuda(SIFT3D_cuda *const cuda) {
+
+        int i;
+
+        if (cuda == NULL)
+                return;
+
+        release_buf(&cuda->im);
+        release_buf(&cuda->gpyr);
+        release_buf(&cuda->dog);
+        for (i = 0; i < 2; i++) {
+                release_buf(cuda->tmp + i);
+        }
+        release_buf(&cuda->taps);
+        release_buf(&cuda->query);
+        release_buf(&cuda->ref);
+        release_buf(&cuda->ref_norm);
+        release_buf(&cuda->dots);
+        release_buf(&cuda->idx);
+
+        cublasDestroy(cuda->blas);
+        free(cuda);
+}
+
+/* Blur an image into a level of the Gaussian pyramid with a separable
+ * filter, as apply_Sep_FIR_filter_temp with unit 1. Each dimension is
+ * convolved directly if the taps fall on whole voxels, or with resampling
+ * otherwise, ping-ponging through the temporary buffers.
+ *
+ * Parameters:
+ *  -src: The input image.
+ *  -src_geom: The geometry of the input, which is also that of the output.
+ *  -dst: The output image.
+ *  -taps, width: The filter taps on the device, and their number. */
+static int blur_level(SIFT3D_cuda *const cuda, const float *const src,
+        const Dev_geom *const src_geom, float *const dst,
+        const float *const taps, const int width) {
+
+        int dim;
+
+        const double units[] = {src_geom->ux, src_geom->uy, src_geom->uz};
+        const int nx = src_geom->nx;
+        const int ny = src_geom->ny;
+        const int nz = src_geom->nz;
+        const dim3 grid = get_grid(nx, ny, nz);
+        const dim3 block(BLOCK_X, BLOCK_Y, BLOCK_Z);
+        const double step_eps = 1E-5;
+
+        for (dim = 0; dim < 3; dim++) {
+
+                const double unit_factor = 1.0 / units[dim];
+                const int step = (int) floor(unit_factor + 0.5);
+                const float *const pass_src = dim == 0 ? src :
+                        (const float *) cuda->tmp[dim - 1].ptr;
+                float *const pass_dst = dim == 2 ? dst :
+                        (float *) cuda->tmp[dim].ptr;
+
+                // Choose the kernel, as get_conv_step
+                if (step >= 1 && fabs(unit_factor - step) < step_eps) {
+                        conv_step<<<grid, block>>>(pass_src, pass_dst, nx, ny,
+                                nz, dim, taps, width, step);
+                } else {
+                        conv_gen<<<grid, block>>>(pass_src, pass_dst, nx, ny,
+                                nz, dim, taps, width, (float) unit_factor);
+                }
+                if (check_cuda(cudaGetLastError(), "blur_level"))
+                        return SIFT3D_FAILURE;
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Build the Gaussian and DoG pyramids of an image on the device, and read
+ * them back. The buffers of the previous image are reused if they are large
+ * enough.
+ *
+ * Parameters:
+ *  -gpyr: The layout of the Gaussian pyramid. The DoG pyramid has the same
+ *      layout, with one level fewer per octave.
+ *  -im: The input image, with the dimensions given by gpyr->im. The first
+ *      level of the pyramid must have the same dimensions.
+ *  -gpyr_data: The data of each Gaussian level, in the order of
+ *      Dev_gpyr.levels.
+ *  -dog_data: The data of each DoG level, in the same order. If NULL, the
+ *      DoG pyramid is not read.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int build_pyramids_cuda(SIFT3D_cuda *const cuda, const Dev_gpyr *const gpyr,
+        const float *const im, float *const *const gpyr_data,
+        float *const *const dog_data) {
+
+        Cuda_level *levels;
+        size_t *taps_off;
+        size_t gpyr_numel, dog_numel, max_numel, taps_numel;
+        float *gpyr_dev, *dog_dev, *taps_dev;
+        int i, o, s;
+
+        const int num_levels = gpyr->num_levels;
+        const int num_dog_levels = num_levels - 1;
+        const int num_gpyr_total = gpyr->num_octaves * num_levels;
+        const size_t im_numel = (size_t) gpyr->im.nx * gpyr->im.ny *
+                gpyr->im.nz;
+        const dim3 block(BLOCK_X, BLOCK_Y, BLOCK_Z);
+        const int dog_block = BLOCK_X * BLOCK_Y * BLOCK_Z;
+
+        // Verify inputs
+        if (gpyr->num_octaves < 1 || num_levels < 2 ||
+                gpyr->levels[0].nx != gpyr->im.nx ||
+                gpyr->levels[0].ny != gpyr->im.ny ||
+                gpyr->levels[0].nz != gpyr->im.nz) {
+                SIFT3D_ERR("build_pyramids_cuda: unsupported pyramid \n");
+                return SIFT3D_FAILURE;
+        }
+
+        levels = (Cuda_level *) calloc(num_gpyr_total, sizeof(Cuda_level));
+        taps_off = (size_t *) calloc(num_gpyr_total, sizeof(size_t));
+        if (levels == NULL || taps_off == NULL)
+                goto build_pyramids_cuda_quit;
+
+        // Compute the offsets of each level, and of its filter taps
+        gpyr_numel = dog_numel = max_numel = taps_numel = 0;
+        for (i = 0; i < num_gpyr_total; i++) {
+
+                Cuda_level *const lev = levels + i;
+                const Dev_geom *const geom = gpyr->levels + i;
+                const size_t numel = (size_t) geom->nx * geom->ny * geom->nz;
+
+                lev->offset = gpyr_numel;
+                lev->nx = geom->nx;
+                lev->ny = geom->ny;
+                lev->nz = geom->nz;
+                gpyr_numel += numel;
+                max_numel = numel > max_numel ? numel : max_numel;
+                if (i % num_levels < num_dog_levels)
+                        dog_numel += numel;
+
+                taps_off[i] = taps_numel;
+                if (gpyr->kernels[i] != NULL)
+                        taps_numel += gpyr->widths[i];
+        }
+
+        // Allocate the buffers
+        if (reserve_buf(&cuda->im, im_numel * sizeof(float)) ||
+                reserve_buf(&cuda->gpyr, gpyr_numel * sizeof(float)) ||
+                reserve_buf(&cuda->dog, dog_numel * sizeof(float)) ||
+                reserve_buf(cuda->tmp, max_numel * sizeof(float)) ||
+                reserve_buf(cuda->tmp + 1, max_numel * sizeof(float)) ||
+                reserve_buf(&cuda->taps, taps_numel * sizeof(float)))
+                goto build_pyramids_cuda_quit;
+        gpyr_dev = (float *) cuda->gpyr.ptr;
+        dog_dev = (float *) cuda->dog.ptr;
+        taps_dev = (float *) cuda->taps.ptr;
+
+        // Upload the image and the filters
+        if (check_cuda(cudaMemcpy(cuda->im.ptr, im, im_numel * sizeof(float),
+                cudaMemcpyHostToDevice), "build_pyramids_cuda: upload"))
+                goto build_pyramids_cuda_quit;
+        for (i = 0; i < num_gpyr_total; i++) {
+                if (gpyr->kernels[i] == NULL)
+                        continue;
+                if (check_cuda(cudaMemcpy(taps_dev + taps_off[i],
+                        gpyr->kernels[i], gpyr->widths[i] * sizeof(float),
+                        cudaMemcpyHostToDevice),
+                        "build_pyramids_cuda: upload"))
+                        goto build_pyramids_cuda_quit;
+        }
+
+        // Build the Gaussian pyramid
+        for (o = 0; o < gpyr->num_octaves; o++) {
+        for (s = 0; s < num_levels; s++) {
+
+                const int idx = o * num_levels + s;
+                const Cuda_level *const lev = levels + idx;
+
+                // Blur the input image
+                if (idx == 0) {
+                        if (blur_level(cuda, (const float *) cuda->im.ptr,
+                                &gpyr->im, gpyr_dev + lev->offset,
+                                taps_dev + taps_off[idx], gpyr->widths[idx]))
+                                goto build_pyramids_cuda_quit;
+                        continue;
+                }
+
+                // Downsample the previous octave
+                if (s == 0) {
+
+                        const Cuda_level *const prev = levels +
+                                (o - 1) * num_levels + gpyr->downsample_level;
+
+                        downsample_2x<<<get_grid(lev->nx, lev->ny, lev->nz),
+                                block>>>(gpyr_dev + prev->offset, prev->nx,
+                                prev->ny, gpyr_dev + lev->offset, lev->nx,
+                                lev->ny, lev->nz);
+                        if (check_cuda(cudaGetLastError(),
+                                "build_pyramids_cuda: downsample"))
+                                goto build_pyramids_cuda_quit;
+                        continue;
+                }
+
+                // Blur the previous level
+                if (blur_level(cuda, gpyr_dev + lev[-1].offset,
+                        gpyr->levels + idx - 1, gpyr_dev + lev->offset,
+                        taps_dev + taps_off[idx], gpyr->widths[idx]))
+                        goto build_pyramids_cuda_quit;
+        }}
+
+        // Build the DoG pyramid
+        dog_numel = 0;
+        for (o = 0; o < gpyr->num_octaves; o++) {
+        for (s = 0; s < num_dog_levels; s++) {
+
+                const Cuda_level *const cur = levels + o * num_levels + s;
+                const size_t numel = (size_t) cur->nx * cur->ny * cur->nz;
+                const unsigned int num_blocks = (unsigned int)
+                        ((numel + dog_block - 1) / dog_block);
+
+                if (numel > 0) {
+                        dog_diff<<<num_blocks, dog_block>>>(gpyr_dev +
+                                cur[0].offset, gpyr_dev + cur[1].offset,
+                                dog_dev + dog_numel, numel);
+                        if (check_cuda(cudaGetLastError(),
+                                "build_pyramids_cuda: DoG"))
+                                goto build_pyramids_cuda_quit;
+                }
+                dog_numel += numel;
+        }}
+
+        // Read the results
+        dog_numel = 0;
+        for (i = 0; i < num_gpyr_total; i++) {
+
+                const Cuda_level *const lev = levels + i;
+                const size_t size = (size_t) lev->nx * lev->ny * lev->nz *
+                        sizeof(float);
+
+                if (check_cuda(cudaMemcpy(gpyr_data[i], gpyr_dev + lev->offset,
+                        size, cudaMemcpyDeviceToHost),
+                        "build_pyramids_cuda: read"))
+                        goto build_pyramids_cuda_quit;
+
+                if (i % num_levels >= num_dog_levels)
+                        continue;
+                if (dog_data != NULL && check_cuda(cudaMemcpy(
+                        dog_data[i / num_levels * num_dog_levels +
+                        i % num_levels], dog_dev + dog_numel, size,
+                        cudaMemcpyDeviceToHost), "build_pyramids_cuda: read"))
+                        goto build_pyramids_cuda_quit;
+                dog_numel += size / sizeof(float);
+        }
+
+        free(levels);
+        free(taps_off);
+        return SIFT3D_SUCCESS;
+
+build_pyramids_cuda_quit:
+        free(levels);
+        free(taps_off);
+        return SIFT3D_FAILURE;
+}
+
+/* Find the k nearest neighbors of each query vector among the reference
+ * vectors, by squared Euclidean distance. The distance matrix is computed
+ * in tiles of rows, each as a single matrix product. The neighbors are
+ * found in single precision, or lower if tensor cores are available, so
+ * near ties may be ordered differently than in exact arithmetic. The caller
+ * should choose k large enough to re-rank the neighbors exactly.
+ *
+ * Parameters:
+ *  -query: The query vectors, [num_query x numel], in row-major order.
+ *  -ref: The reference vectors, [num_ref x numel], in row-major order.
+ *  -k: The number of neighbors, at most CUDA_KNN_MAX.
+ *  -idx: An array of [num_query x k] elements. On return, row i holds the
+ *      indices of the neighbors of query i in increasing order of distance,
+ *      or -1 if num_ref < k.
+ *
+ * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
+int knn_cuda(SIFT3D_cuda *const cuda, const float *const query,
+        const int num_query, const float *const ref, const int num_ref,
+        const int numel, const int k, int *const idx) {
+
+        size_t tile_rows;
+        float *query_dev, *ref_dev, *ref_norm, *dots;
+        int *idx_dev;
+        int row;
+
+        const float one = 1.0f;
+        const float zero = 0.0f;
+        const int norm_block = 256;
+
+        // Verify inputs
+        if (k < 1 || k > CUDA_KNN_MAX || numel < 1 || num_query < 0 ||
+                num_ref < 0) {
+                SIFT3D_ERR("knn_cuda: invalid arguments \n");
+                return SIFT3D_FAILURE;
+        }
+        if (num_query == 0)
+                return SIFT3D_SUCCESS;
+        if (num_ref == 0) {
+                for (row = 0; row < num_query * k; row++) {
+                        idx[row] = -1;
+                }
+                return SIFT3D_SUCCESS;
+        }
+
+        // Choose the tile size
+        tile_rows = KNN_TILE_NUMEL / (size_t) num_ref;
+        tile_rows = tile_rows < 1 ? 1 : tile_rows;
+        tile_rows = tile_rows > (size_t) num_query ? (size_t) num_query :
+                tile_rows;
+
+        // Allocate the buffers
+        if (reserve_buf(&cuda->query, (size_t) num_query * numel *
+                        sizeof(float)) ||
+                reserve_buf(&cuda->ref, (size_t) num_ref * numel *
+                        sizeof(float)) ||
+                reserve_buf(&cuda->ref_norm, (size_t) num_ref *
+                        sizeof(float)) ||
+                reserve_buf(&cuda->dots, tile_rows * num_ref *
+                        sizeof(float)) ||
+                reserve_buf(&cuda->idx, (size_t) num_query * k * sizeof(int)))
+                return SIFT3D_FAILURE;
+        query_dev = (float *) cuda->query.ptr;
+        ref_dev = (float *) cuda->ref.ptr;
+        ref_norm = (float *) cuda->ref_norm.ptr;
+        dots = (float *) cuda->dots.ptr;
+        idx_dev = (int *) cuda->idx.ptr;
+
+        // Upload the vectors
+        if (check_cuda(cudaMemcpy(query_dev, query, (size_t) num_query *
+                        numel * sizeof(float), cudaMemcpyHostToDevice),
+                        "knn_cuda: upload") ||
+                check_cuda(cudaMemcpy(ref_dev, ref, (size_t) num_ref *
+                        numel * sizeof(float), cudaMemcpyHostToDevice),
+                        "knn_cuda: upload"))
+                return SIFT3D_FAILURE;
+
+        // Compute the norms of the references
+        sq_norms<<<(num_ref + norm_block - 1) / norm_block, norm_block>>>(
+                ref_dev, num_ref, numel, ref_norm);
+        if (check_cuda(cudaGetLastError(), "knn_cuda: norms"))
+                return SIFT3D_FAILURE;
+
+        // Search each tile of rows
+        for (row = 0; row < num_query; row += (int) tile_rows) {
+
+                const int rows = num_query - row < (int) tile_rows ?
+                        num_query - row : (int) tile_rows;
+
+                // The row-major [rows x num_ref] matrix of dot products is the
+                // column-major product of ref and the transposed queries
+                if (check_cublas(cublasSgemm(cuda->blas, CUBLAS_OP_T,
+                        CUBLAS_OP_N, num_ref, rows, numel, &one, ref_dev,
+                        numel, query_dev + (size_t) row * numel, numel, &zero,
+                        dots, num_ref), "knn_cuda: dot products"))
+                        return SIFT3D_FAILURE;
+
+                knn_rows<<<rows, KNN_BLOCK>>>(dots, num_ref, ref_norm, k,
+                        idx_dev + (size_t) row * k);
+                if (check_cuda(cudaGetLastError(), "knn_cuda: search"))
+                        return SIFT3D_FAILURE;
+        }
+
+        // Read the results
+        return check_cuda(cudaMemcpy(idx, idx_dev, (size_t) num_query * k *
+                sizeof(int), cudaMemcpyDeviceToHost), "knn_cuda: read");
+}
@@ -0,0 +1,41 @@
+/* -----------------------------------------------------------------------------
+ * sift_cuda.h
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2015-2016 Blaine Rister et al., see LICENSE for details.
+ * -----------------------------------------------------------------------------
+ * Internal header for the CUDA backend, see sift_cuda.cu.
+ * -----------------------------------------------------------------------------
+ */
+
+#ifndef _SIFT_CUDA_H
+#define _SIFT_CUDA_H
+
+#include "sift_dev.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Opaque device state */
+typedef struct _SIFT3D_cuda SIFT3D_cuda;
+
+/* Maximum number of neighbors returned by knn_cuda */
+#define CUDA_KNN_MAX 8
+
+int init_SIFT3D_cuda(SIFT3D_cuda **const cuda);
+
+void cleanup_SIFT3D_cuda(SIFT3D_cuda *const cuda);
+
+int build_pyramids_cuda(SIFT3D_cuda *const cuda, const Dev_gpyr *const gpyr,
+        const float *const im, float *const *const gpyr_data,
+        float *const *const dog_data);
+
+int knn_cuda(SIFT3D_cuda *const cuda, const float *const query,
+        const int num_query, const float *const ref, const int num_ref,
+        const int numel, const int k, int *const idx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,47 @@
+/* -----------------------------------------------------------------------------
+ * sift_dev.h
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2015-2016 Blaine Rister et al., see LICENSE for details.
+ * -----------------------------------------------------------------------------
+ * Internal header describing the scale-space pyramid to the device backends,
+ * see sift_cl.c and sift_cuda.cu. This header uses only standard C types, 
+ * so that it can be included alongside imtypes.h, which defines 
+ * placeholders for the OpenCL types.
+ * -----------------------------------------------------------------------------
+ */
+
+#ifndef _SIFT_DEV_H
+#define _SIFT_DEV_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Geometry of an image */
+typedef struct _Dev_geom {
+        int nx, ny, nz;         // Dimensions
+        double ux, uy, uz;      // Units
+        double s;               // Scale parameter
+} Dev_geom;
+
+/* Description of the scale-space pyramid. Levels are stored in octave-major
+ * order, as in a Pyramid. */
+typedef struct _Dev_gpyr {
+        Dev_geom im;                    // Input image
+        const Dev_geom *levels;         // Geometry of each level
+        const float *const *kernels;    // Filter taps of each level. The
+                                        // first level of each octave
+                                        // after the first, which is
+                                        // downsampled, has NULL.
+        const int *widths;              // Number of taps of each level
+        int first_octave, first_level, num_octaves, num_levels;
+        int downsample_level;           // Relative index of the level from
+                                        // which the next octave is
+                                        // downsampled
+} Dev_gpyr;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
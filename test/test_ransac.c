@@ -0,0 +1,172 @@
+/* -----------------------------------------------------------------------------
+ * test_ransac.c
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2015-2016 Blaine Rister et al., see LICENSE for details.
+ * -----------------------------------------------------------------------------
+ * Test that find_tform_ransac gives the same results with any number of 
+ * threads, with and without early termination.
+ * -----------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "immacros.h"
+#include "imutil.h"
+
+/* Number of matched points, and the fraction of them which are outliers */
+#define NUM_PTS 2000
+#define OUTLIER_RATIO 0.6
+
+/* Number of threads for the parallel runs */
+#define NUM_THREADS 4
+
+/* Seed of the RANSAC generators */
+#define SEED 12345
+
+/* Results of a single RANSAC run */
+typedef struct _Result {
+        double A[IM_NDIMS * (IM_NDIMS + 1)]; // The transformation matrix
+        int num_iter; // The number of iterations run
+        int num_inliers; // The size of the consensus set
+} Result;
+
+/* Returns a uniform random number in [0, 1] */
+static double rand_unif(void) {
+        return (double) rand() / RAND_MAX;
+}
+
+/* Make the matched points. The inliers are related by a fixed affine 
+ * transformation, plus some noise, while the outliers are random. */
+static int make_points(Mat_rm *const src, Mat_rm *const ref) {
+
+        int i, j, k;
+
+        const double A[IM_NDIMS][IM_NDIMS + 1] = {
+                {0.95, 0.10, -0.05, 4.0},
+                {-0.08, 1.02, 0.03, -2.5},
+                {0.04, -0.06, 0.98, 1.5}
+        };
+
+        if (init_Mat_rm(src, NUM_PTS, IM_NDIMS, SIFT3D_DOUBLE, SIFT3D_FALSE) ||
+                init_Mat_rm(ref, NUM_PTS, IM_NDIMS, SIFT3D_DOUBLE, 
+                        SIFT3D_FALSE))
+                return SIFT3D_FAILURE;
+
+        srand(1);
+        for (i = 0; i < NUM_PTS; i++) {
+
+                const int outlier = rand_unif() < OUTLIER_RATIO;
+
+                for (j = 0; j < IM_NDIMS; j++) {
+                        SIFT3D_MAT_RM_GET(ref, i, j, double) = 
+                                100.0 * rand_unif();
+                }
+
+                for (j = 0; j < IM_NDIMS; j++) {
+
+                        double x = A[j][IM_NDIMS];
+
+                        for (k = 0; k < IM_NDIMS; k++) {
+                                x += A[j][k] * 
+                                        SIFT3D_MAT_RM_GET(ref, i, k, double);
+                        }
+
+                        SIFT3D_MAT_RM_GET(src, i, j, double) = outlier ? 
+                                100.0 * rand_unif() : x + rand_unif() - 0.5;
+                }
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Run RANSAC with the given confidence and number of threads */
+static int run(const Mat_rm *const src, const Mat_rm *const ref, 
+               const double confidence, const int num_threads, 
+               Result *const result) {
+
+        Ransac ran;
+        Affine aff;
+        int i, j, ret;
+
+        init_Ransac(&ran);
+        if (set_confidence_Ransac(&ran, confidence) ||
+                SIFT3D_set_num_threads(num_threads) ||
+                init_Affine(&aff, IM_NDIMS))
+                return SIFT3D_FAILURE;
+
+        ret = find_tform_ransac_report(&ran, src, ref, SEED, &aff, 
+                &result->num_iter, &result->num_inliers);
+
+        SIFT3D_MAT_RM_LOOP_START(&aff.A, i, j)
+                result->A[i * (IM_NDIMS + 1) + j] = 
+                        SIFT3D_MAT_RM_GET(&aff.A, i, j, double);
+        SIFT3D_MAT_RM_LOOP_END
+
+        cleanup_tform(&aff);
+        return ret;
+}
+
+/* Returns true if the results are identical */
+static int results_equal(const Result *const a, const Result *const b) {
+
+        int i;
+
+        if (a->num_iter != b->num_iter || a->num_inliers != b->num_inliers)
+                return SIFT3D_FALSE;
+
+        for (i = 0; i < IM_NDIMS * (IM_NDIMS + 1); i++) {
+                if (a->A[i] != b->A[i])
+                        return SIFT3D_FALSE;
+        }
+
+        return SIFT3D_TRUE;
+}
+
+int main(void) {
+
+        Mat_rm src, ref;
+        Result serial, parallel;
+        int i;
+
+        const double confidences[] = {0.0, SIFT3D_confidence_default};
+        const int num_confidences = sizeof(confidences) / sizeof(double);
+        int ret = 0;
+
+        if (make_points(&src, &ref))
+                return 1;
+
+        for (i = 0; i < num_confidences; i++) {
+
+                const double confidence = confidences[i];
+
+                if (run(&src, &ref, confidence, 1, &serial) ||
+                        run(&src, &ref, confidence, NUM_THREADS, &parallel)) {
+                        fprintf(stderr, "test_ransac: RANSAC failed \n");
+                        ret = 1;
+                        break;
+                }
+
+                printf("confidence %g: %d iterations, %d inliers \n", 
+                        confidence, serial.num_iter, serial.num_inliers);
+
+                if (!results_equal(&serial, &parallel)) {
+                        fprintf(stderr, "test_ransac: confidence %g: the "
+                                "results of 1 and %d threads differ \n", 
+                                confidence, NUM_THREADS);
+                        ret = 1;
+                }
+
+                // Check that early termination was tested
+                if (confidence > 0.0 && 
+                        serial.num_iter >= SIFT3D_num_iter_default) {
+                        fprintf(stderr, "test_ransac: confidence %g did not "
+                                "stop early \n", confidence);
+                        ret = 1;
+                }
+        }
+
+        cleanup_Mat_rm(&src);
+        cleanup_Mat_rm(&ref);
+
+        return ret;
+}
@@ -0,0 +1,201 @@
+/* -----------------------------------------------------------------------------
+ * test_reg_group.c
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2015-2016 Blaine Rister et al., see LICENSE for details.
+ * -----------------------------------------------------------------------------
+ * Test that register_SIFT3D_group gives the same transformations as 
+ * sequential calls to register_SIFT3D after the same srand(), with any number
+ * of threads.
+ * -----------------------------------------------------------------------------
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "immacros.h"
+#include "imutil.h"
+#include "sift.h"
+#include "reg.h"
+
+/* Size of the volumes, and the number of blobs in each */
+#define NX 48
+#define NUM_BLOBS 60
+
+/* Number of source images */
+#define NUM_SRC 3
+
+/* Number of threads for the parallel runs */
+#define NUM_THREADS 4
+
+/* Seed passed to srand() before each registration */
+#define SEED 7
+
+/* Number of entries in an affine transformation matrix */
+#define NUM_A (IM_NDIMS * (IM_NDIMS + 1))
+
+/* Make a volume of random Gaussian blobs, shifted by shift voxels in x */
+static int make_blobs(Image *const im, const double shift) {
+
+        double pos[NUM_BLOBS][IM_NDIMS], sigma[NUM_BLOBS];
+        int x, y, z, i;
+
+        init_im(im);
+        im->nx = im->ny = im->nz = NX;
+        im->nc = 1;
+        im_default_stride(im);
+        if (im_resize(im))
+                return SIFT3D_FAILURE;
+
+        srand(1);
+        for (i = 0; i < NUM_BLOBS; i++) {
+                pos[i][0] = rand() % NX + shift;
+                pos[i][1] = rand() % NX;
+                pos[i][2] = rand() % NX;
+                sigma[i] = 1.5 + 3.0 * rand() / RAND_MAX;
+        }
+
+        SIFT3D_IM_LOOP_START(im, x, y, z)
+
+                double val = 0.0;
+
+                for (i = 0; i < NUM_BLOBS; i++) {
+                        const double dx = x - pos[i][0];
+                        const double dy = y - pos[i][1];
+                        const double dz = z - pos[i][2];
+                        val += exp(-(dx * dx + dy * dy + dz * dz) / 
+                                (2.0 * sigma[i] * sigma[i]));
+                }
+
+                SIFT3D_IM_GET_VOX(im, x, y, z, 0) = (float) val;
+        SIFT3D_IM_LOOP_END
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Copy the matrix of an affine transformation */
+static void get_A(const Affine *const aff, double *const A) {
+
+        int i, j;
+
+        SIFT3D_MAT_RM_LOOP_START(&aff->A, i, j)
+                A[i * (IM_NDIMS + 1) + j] = 
+                        SIFT3D_MAT_RM_GET(&aff->A, i, j, double);
+        SIFT3D_MAT_RM_LOOP_END
+}
+
+/* Register the sources one at a time, and as a group with each number of
+ * threads, returning SIFT3D_SUCCESS if all of the results are identical. */
+static int check_group(Reg_SIFT3D *const reg, const Image *const srcs, 
+                       SIFT3D_Descriptor_store *const descs) {
+
+        Affine affs[NUM_SRC];
+        const SIFT3D_Descriptor_store *desc_ptrs[NUM_SRC];
+        void *tforms[NUM_SRC];
+        double units[NUM_SRC * IM_NDIMS];
+        double A_seq[NUM_SRC][NUM_A], A_group[NUM_SRC][NUM_A];
+        int i, j, k;
+
+        const int threads[] = {1, NUM_THREADS};
+        const int num_threads = sizeof(threads) / sizeof(int);
+        int ret = SIFT3D_SUCCESS;
+
+        for (i = 0; i < NUM_SRC; i++) {
+                if (init_Affine(affs + i, IM_NDIMS))
+                        return SIFT3D_FAILURE;
+                tforms[i] = affs + i;
+                desc_ptrs[i] = descs + i;
+                memcpy(units + i * IM_NDIMS, SIFT3D_IM_GET_UNITS(srcs + i),
+                        IM_NDIMS * sizeof(double));
+        }
+
+        // Register the sources one at a time
+        srand(SEED);
+        for (i = 0; i < NUM_SRC; i++) {
+                if (set_src_Reg_SIFT3D(reg, srcs + i) || 
+                        register_SIFT3D(reg, affs + i)) {
+                        fprintf(stderr, "test_reg_group: failed to register "
+                                "source %d \n", i);
+                        ret = SIFT3D_FAILURE;
+                        goto check_group_quit;
+                }
+                get_A(affs + i, A_seq[i]);
+        }
+
+        // Register them as a group, and compare
+        for (k = 0; k < num_threads; k++) {
+
+                SIFT3D_set_num_threads(threads[k]);
+                srand(SEED);
+                if (register_SIFT3D_group(reg, desc_ptrs, units, NUM_SRC, 
+                        tforms, NULL)) {
+                        fprintf(stderr, "test_reg_group: failed to register "
+                                "the group \n");
+                        ret = SIFT3D_FAILURE;
+                        break;
+                }
+
+                for (i = 0; i < NUM_SRC; i++) {
+                        get_A(affs + i, A_group[i]);
+                        for (j = 0; j < NUM_A; j++) {
+                                if (A_group[i][j] == A_seq[i][j])
+                                        continue;
+                                fprintf(stderr, "test_reg_group: source %d "
+                                        "differs from register_SIFT3D with %d "
+                                        "threads \n", i, threads[k]);
+                                ret = SIFT3D_FAILURE;
+                                break;
+                        }
+                }
+        }
+        SIFT3D_set_num_threads(0);
+
+check_group_quit:
+        for (i = 0; i < NUM_SRC; i++) {
+                cleanup_tform(affs + i);
+        }
+
+        return ret;
+}
+
+int main(void) {
+
+        Image ref, srcs[NUM_SRC];
+        SIFT3D_Descriptor_store descs[NUM_SRC];
+        Reg_SIFT3D reg;
+        int i;
+
+        int ret = 1;
+
+        // Make the images, and extract the source descriptors as 
+        // set_src_Reg_SIFT3D does
+        if (make_blobs(&ref, 0.0) || init_Reg_SIFT3D(&reg))
+                return 1;
+        for (i = 0; i < NUM_SRC; i++) {
+                init_SIFT3D_Descriptor_store(descs + i);
+                if (make_blobs(srcs + i, 1.0 + i) ||
+                        SIFT3D_extract_descriptors_cached(&reg.sift3d, 
+                                srcs + i, descs + i))
+                        goto main_quit;
+        }
+        if (set_ref_Reg_SIFT3D(&reg, &ref))
+                goto main_quit;
+
+        // Test exhaustive matching, then the indices
+        if (check_group(&reg, srcs, descs) ||
+                set_nn_checks_Reg_SIFT3D(&reg, 32) ||
+                check_group(&reg, srcs, descs))
+                goto main_quit;
+
+        ret = 0;
+
+main_quit:
+        im_free(&ref);
+        for (i = 0; i < NUM_SRC; i++) {
+                im_free(srcs + i);
+                cleanup_SIFT3D_Descriptor_store(descs + i);
+        }
+        cleanup_Reg_SIFT3D(&reg);
+
+        return ret;
+}
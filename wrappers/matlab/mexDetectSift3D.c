@@ -18,11 +18,12 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
         const mxArray *mxIm, *mxUnits, *mxOpts;
         Image im;
         Keypoint_store kp;
+        int imShared;
         const char *errName, *errMsg;
 
 /* Clean up and print an error */
 #define CLEAN_AND_QUIT(name, msg, expected) { \
-                im_free(&im); \
+                mxImFree(&im, imShared); \
                 cleanup_Keypoint_store(&kp); \
                 if (expected) { \
                         err_msg(name, msg); \
@@ -44,17 +45,18 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
         mxUnits = prhs[1];
         mxOpts = prhs[2];
 
+        // Initialize intermediates
+        init_Keypoint_store(&kp);
+        init_im(&im);
+        imShared = SIFT3D_FALSE;
+
         // Set the options
         if (mex_set_opts_SIFT3D(mxOpts))
                 CLEAN_AND_QUIT("main:setOpts", "Failed to set the options.", 
                         SIFT3D_FALSE);
 
-        // Initialize intermediates
-        init_Keypoint_store(&kp);
-        init_im(&im);
-
-        // Copy the transposed image
-        if (mx2imWithUnits(mxIm, mxUnits, &im))
+        // Convert the image, sharing its data if possible
+        if (mx2imSharedWithUnits(mxIm, mxUnits, &im, &imShared))
                 CLEAN_AND_QUIT("main:copyIm", "Failed to convert the input "
                         "image", SIFT3D_TRUE);
 
@@ -69,7 +71,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
                         "keypoints to structs", SIFT3D_FALSE);
 
         // Clean up
-        im_free(&im);
+        mxImFree(&im, imShared);
         cleanup_Keypoint_store(&kp);
 
 #undef CLEAN_AND_QUIT
@@ -26,11 +26,11 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
         Image im;
         Keypoint_store kp;
         SIFT3D_Descriptor_store desc;
-        int i;
+        int i, imShared;
 
 /* Clean up and print an error */
 #define CLEAN_AND_QUIT(name, msg, expected) { \
-                im_free(&im); \
+                mxImFree(&im, imShared); \
                 cleanup_Keypoint_store(&kp); \
                 cleanup_SIFT3D_Descriptor_store(&desc); \
                 if (expected) { \
@@ -55,6 +55,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 
         // Initialize intermediates
         init_im(&im); 
+        imShared = SIFT3D_FALSE;
         init_Keypoint_store(&kp);
         init_SIFT3D_Descriptor_store(&desc);
 
@@ -66,8 +67,9 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
         // Process the image and extract descriptors
         if (!mxIsEmpty(mxIm)) {
 
-                // Convert the input to an Image struct
-                if (mx2imWithUnits(mxIm, mxUnits, &im))
+                // Convert the input to an Image struct, sharing its data if
+                // possible
+                if (mx2imSharedWithUnits(mxIm, mxUnits, &im, &imShared))
                         CLEAN_AND_QUIT("main:convertIm", 
                                         "Failed to convert image", 
                                         SIFT3D_TRUE);
@@ -101,7 +103,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
                         "Failed to convert descriptors", SIFT3D_FALSE);
 
         // Clean up
-        im_free(&im);
+        mxImFree(&im, imShared);
         cleanup_Keypoint_store(&kp);
         cleanup_SIFT3D_Descriptor_store(&desc);
 
@@ -17,10 +17,11 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
         Image im;
         const mxArray *mxPath, *mxIm, *mxUnits;
         const char *path;
+        int imShared;
 
 /* Clean up and print an error */
 #define CLEAN_AND_QUIT(name, msg, expected) { \
-                im_free(&im); \
+                mxImFree(&im, imShared); \
                 if (expected) { \
                         err_msg(name, msg); \
                 } else { \
@@ -43,14 +44,16 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 
         // Initialize intermediates
         init_im(&im);
+        imShared = SIFT3D_FALSE;
 
         // Get the path string
         if ((path = mxArrayToString(mxPath)) == NULL)
                 CLEAN_AND_QUIT("main:getPath", "Failed to convert the input "
                         "to a string", SIFT3D_FALSE);
 
-        // Convert the image to the internal format
-        if (mx2imWithUnits(mxIm, mxUnits, &im))
+        // Convert the image to the internal format, sharing its data if
+        // possible
+        if (mx2imSharedWithUnits(mxIm, mxUnits, &im, &imShared))
                 CLEAN_AND_QUIT("main:mx2im", "Failed to convert the input "
                         "image to the internal format", SIFT3D_TRUE);
 
@@ -70,7 +73,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
         }
 
         // Clean up
-        im_free(&im);
+        mxImFree(&im, imShared);
 
 #undef CLEAN_AND_QUIT
 }
@@ -20,10 +20,11 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
         Keypoint_store kp;
         const char *errName, *errMsg;
         double *conf;
+        int imShared;
 
 /* Clean up and print an error */
 #define CLEAN_AND_QUIT(name, msg, expected) { \
-                im_free(&im); \
+                mxImFree(&im, imShared); \
                 cleanup_Keypoint_store(&kp); \
                 if (expected) { \
                         err_msg(name, msg); \
@@ -47,6 +48,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 
         // Initialize intermediates
         init_im(&im);
+        imShared = SIFT3D_FALSE;
         init_Keypoint_store(&kp);
 
         // Convert the keypoints 
@@ -54,8 +56,8 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
                 CLEAN_AND_QUIT("main:convertKey", "failed to convert the "
                         "input keypoints", SIFT3D_TRUE);
 
-        // Convert the image
-        if (mx2imWithUnits(mxIm, mxUnits, &im))
+        // Convert the image, sharing its data if possible
+        if (mx2imSharedWithUnits(mxIm, mxUnits, &im, &imShared))
                 CLEAN_AND_QUIT("main:copyIm", "Failed to convert the input "
                         "image", SIFT3D_TRUE);
 
@@ -76,7 +78,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
                         SIFT3D_FALSE);
 
         // Clean up
-        im_free(&im);
+        mxImFree(&im, imShared);
         cleanup_Keypoint_store(&kp);
 
 #undef CLEAN_AND_QUIT
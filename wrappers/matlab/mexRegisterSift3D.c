@@ -21,12 +21,12 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
         Image src, ref;
         Affine aff;
         Mat_rm match_src, match_ref;
-        int ret;
+        int ret, srcShared, refShared;
 
 /* Clean up and print an error */
 #define CLEAN_AND_QUIT(name, msg, expected) { \
-                im_free(&src); \
-                im_free(&ref); \
+                mxImFree(&src, srcShared); \
+                mxImFree(&ref, refShared); \
                 cleanup_tform(&aff); \
                 cleanup_Mat_rm(&match_src); \
                 cleanup_Mat_rm(&match_ref); \
@@ -66,12 +66,13 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
                 err_msgu("main:init", "Failed to initialize intermediates");
         init_im(&src);
         init_im(&ref);
+        srcShared = refShared = SIFT3D_FALSE;
 
-        // Convert the inputs to images
-        if (mx2imWithUnits(mxSrc, mxSrcUnits, &src))
+        // Convert the inputs to images, sharing their data if possible
+        if (mx2imSharedWithUnits(mxSrc, mxSrcUnits, &src, &srcShared))
                 CLEAN_AND_QUIT("main:convertSrc", "Failed to convert the "
                         "source image.", SIFT3D_TRUE);
-        if (mx2imWithUnits(mxRef, mxRefUnits, &ref))
+        if (mx2imSharedWithUnits(mxRef, mxRefUnits, &ref, &refShared))
                 CLEAN_AND_QUIT("main:convertRef", "Failed to convert the "
                         "reference image.", SIFT3D_TRUE);
 
@@ -113,8 +114,8 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
                         "outputs.", SIFT3D_FALSE);
 
         // Clean up
-        im_free(&src);
-        im_free(&ref); 
+        mxImFree(&src, srcShared);
+        mxImFree(&ref, refShared); 
         cleanup_tform(&aff); 
         cleanup_Mat_rm(&match_src); 
         cleanup_Mat_rm(&match_ref); 
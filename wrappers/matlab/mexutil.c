@@ -43,8 +43,18 @@ const char *fieldNames[] = {
 const mwSize kpNDims = 1;
 const int kpNFields = sizeof(fieldNames) / sizeof(char *);
 
+/* Options of the SIFT3D struct which can be set from Matlab */
+typedef struct _Mex_opts {
+        double peak_thresh;
+        double corner_thresh;
+        double sigma_n;
+        double sigma0;
+        int num_kp_levels;
+} Mex_opts;
+
 /* Global state */
 Reg_SIFT3D reg;
+Mex_opts opts_default; // The options of a newly-initialized SIFT3D struct
 
 /* Error message tag */
 const char *tag = "sift3D";
@@ -52,11 +62,22 @@ const char *tag = "sift3D";
 /* Static helper functions */
 static void init(void) __attribute__((constructor));
 static void fini(void) __attribute__((destructor));
+static int mxGetImDims(const mxArray *const mx, Image *const im);
 
 /* Library initialization */
 static void init(void) {
+
+        const SIFT3D *const sift3d = &reg.sift3d;
+
         if (init_Reg_SIFT3D(&reg))
                 err_msgu("main:initSift", "Failed to initialize SIFT3D");
+
+        // Save the default options
+        opts_default.peak_thresh = sift3d->peak_thresh;
+        opts_default.corner_thresh = sift3d->corner_thresh;
+        opts_default.sigma_n = sift3d->gpyr.sigma_n;
+        opts_default.sigma0 = sift3d->gpyr.sigma0;
+        opts_default.num_kp_levels = sift3d->gpyr.num_kp_levels;
 }
 
 /* Library cleanup */
@@ -107,6 +128,7 @@ mxArray *im2mx(const Image *const im) {
         mwSize dims[MX_IM_NDIMS]; 
         mxArray *mx; 
         double *mxData; 
+        mwIndex idx;
         int i, x, y, z, c;
 
         // Initialize the dimensions
@@ -124,13 +146,13 @@ mxArray *im2mx(const Image *const im) {
         if ((mxData = mxGetData(mx)) == NULL)
                 return NULL;
 
-        // Transpose and copy the data
-        SIFT3D_IM_LOOP_START_C(im, x, y, z, c)
-
-                const mwIndex idx = mxImGetIdx(mx, x, y, z, c); 
-                mxData[idx] = (double) SIFT3D_IM_GET_VOX(im, x, y, z, c);
-
-        SIFT3D_IM_LOOP_END_C
+        // Transpose and copy the data, in the column-major order of mx
+        idx = 0;
+        for (c = 0; c < im->nc; c++) {
+        SIFT3D_IM_LOOP_START(im, x, y, z)
+                mxData[idx++] = (double) SIFT3D_IM_GET_VOX(im, x, y, z, c);
+        SIFT3D_IM_LOOP_END
+        }
 
         return mx;
 }
@@ -139,10 +161,41 @@ mxArray *im2mx(const Image *const im) {
  * dimensions and be of type single (float). */
 int mx2im(const mxArray *const mx, Image *const im) {
 
-        const mwSize *mxDims;
         float *mxData;
+        mwIndex idx;
+        int x, y, z, c;
+
+        // Get the dimensions
+        if (mxGetImDims(mx, im))
+                return SIFT3D_FAILURE;
+
+        // Resize the output                
+        if (im_resize(im))
+                return SIFT3D_FAILURE;
+
+        // Get the data
+        if ((mxData = mxGetData(mx)) == NULL)
+                return SIFT3D_FAILURE;
+
+        // Transpose and copy the data, in the column-major order of mx
+        idx = 0;
+        for (c = 0; c < im->nc; c++) {
+        SIFT3D_IM_LOOP_START(im, x, y, z)
+                SIFT3D_IM_GET_VOX(im, x, y, z, c) = mxData[idx++];
+        SIFT3D_IM_LOOP_END
+        }
+
+        return SIFT3D_SUCCESS;
+}
+
+/* Helper function to set the dimensions, number of channels and default 
+ * strides of im from those of mx, which must have at most IM_NDIMS + 1 
+ * dimensions and be of type single (float). The data of im is unchanged. */
+static int mxGetImDims(const mxArray *const mx, Image *const im) {
+
+        const mwSize *mxDims;
         mwIndex mxNDims;
-        int i, x, y, z, c, mxNSpaceDims;
+        int i, mxNSpaceDims;
 
         // Verify inputs
         mxNDims = (int) mxGetNumberOfDimensions(mx);
@@ -162,29 +215,60 @@ int mx2im(const mxArray *const mx, Image *const im) {
         } 
 
         // Copy the number of channels, defaulting to 1
-        im->nc = mxNDims == MX_IM_NDIMS ? (int) mxDims[MX_IM_NDIMS] : 1;
+        im->nc = mxNDims == MX_IM_NDIMS ? (int) mxDims[IM_NDIMS] : 1;
 
-        // Resize the output                
         im_default_stride(im);
-        if (im_resize(im))
+        return SIFT3D_SUCCESS;
+}
+
+/* As mx2im, but without copying the data if possible. A single-channel 
+ * array is stored in the column-major order of Matlab, which is the same as
+ * the default strides of an Image. In that case, im is set to point to the
+ * data of mx, and shared is set to SIFT3D_TRUE. Otherwise, the data is 
+ * copied, as in mx2im, and shared is set to SIFT3D_FALSE.
+ *
+ * A shared image is read-only, and is only valid for the lifetime of mx. Do
+ * not resize it. Release it with mxImFree, rather than im_free. */
+int mx2imShared(const mxArray *const mx, Image *const im, int *const shared) {
+
+        float *mxData;
+
+        *shared = SIFT3D_FALSE;
+
+        // Get the dimensions
+        if (mxGetImDims(mx, im))
                 return SIFT3D_FAILURE;
 
+        // Copy multi-channel images, which are stored channel-last
+        if (im->nc != 1)
+                return mx2im(mx, im);
+
         // Get the data
         if ((mxData = mxGetData(mx)) == NULL)
                 return SIFT3D_FAILURE;
 
-        // Transpose and copy the data
-        SIFT3D_IM_LOOP_START_C(im, x, y, z, c)
+        // Point to the data of mx
+        im_free(im);
+        im->data = mxData;
+        im->size = (size_t) im->nx * im->ny * im->nz;
+        im->capacity = 0;
+        im->cl_valid = SIFT3D_FALSE;
+        *shared = SIFT3D_TRUE;
 
-                mwIndex idx;
-
-                idx = mxImGetIdx(mx, x, y, z, c);
+        return SIFT3D_SUCCESS;
+}
 
-                SIFT3D_IM_GET_VOX(im, x, y, z, c) = mxData[idx];
+/* Release an image from mx2imShared. If shared is SIFT3D_TRUE, the data
+ * belongs to an mxArray, and is not freed. */
+void mxImFree(Image *const im, const int shared) {
 
-        SIFT3D_IM_LOOP_END_C
+        if (shared) {
+                im->data = NULL;
+                im->size = 0;
+                return;
+        }
 
-        return SIFT3D_SUCCESS;
+        im_free(im);
 }
 
 /* Returns an mxArray representing the units of image im.
@@ -273,6 +357,12 @@ int mx2imWithUnits(const mxArray *const data, const mxArray *const units,
         return mx2im(data, im) || mx2units(units, im);
 }
 
+/* Wrapper around mx2imShared and mx2units. */
+int mx2imSharedWithUnits(const mxArray *const data, 
+        const mxArray *const units, Image *const im, int *const shared) {
+        return mx2imShared(data, im, shared) || mx2units(units, im);
+}
+
 /* Convert a Mat_rm struct to an mxArray. Returns the array, or NULL on
  * failure. The returned array has type double, regardless of the input array
  * type. 
@@ -298,11 +388,8 @@ mxArray *mat2mx(const Mat_rm *const mat) {
 #define TRANSPOSE_AND_COPY(type) \
         SIFT3D_MAT_RM_LOOP_START(mat, i, j) \
         \
-                mwIndex idx; \
+                const mwIndex idx = (mwIndex) i + (mwIndex) j * rows; \
         \
-                const mwIndex subs[] = {i, j}; \
-        \
-                idx = mxCalcSingleSubscript(mx, 2, subs); \
                 mxData[idx] = (double) SIFT3D_MAT_RM_GET(mat, i, j, type); \
         \
         SIFT3D_MAT_RM_LOOP_END
@@ -354,11 +441,9 @@ int mx2mat(const mxArray *const mx, Mat_rm *const mat) {
 #define COPY_DATA(type) \
         SIFT3D_MAT_RM_LOOP_START(mat, i, j) \
 \
-                mwIndex idx; \
-\
-                const mwIndex subs[] = {i, j}; \
+                const mwIndex idx = (mwIndex) i + (mwIndex) j * \
+                        mat->num_rows; \
 \
-                idx = mxCalcSingleSubscript(mx, 2, subs); \
                 SIFT3D_MAT_RM_GET(mat, i, j, type) = (type) data[idx]; \
 \
         SIFT3D_MAT_RM_LOOP_END
@@ -580,28 +665,54 @@ int mx2kp(const mxArray *const mx, Keypoint_store *const kp) {
 mxArray *desc2mx(const SIFT3D_Descriptor_store *const desc) {
 
         mxArray *mx;
-        Mat_rm mat;
+        double *mxData;
+        size_t i;
+        int j, k;
 
-        // Initialize intermediates
-        if (init_Mat_rm(&mat, 0, 0, SIFT3D_FLOAT, SIFT3D_FALSE))
+        const mwSize rows = (mwSize) desc->num;
+        const mwSize cols = IM_NDIMS + DESC_NUMEL;
+
+        // Verify inputs
+        if (desc->num < 1) {
+                SIFT3D_ERR("desc2mx: invalid number of descriptors: %d \n",
+                        (int) desc->num);
                 return NULL;
+        }
 
-        // Convert desc to a matrix
-        if (SIFT3D_Descriptor_store_to_Mat_rm(desc, &mat))
-                goto desc2mx_quit;
+        // Create an array
+        if ((mx = mxCreateDoubleMatrix(rows, cols, mxREAL)) == NULL)
+                return NULL;
 
-        // Convert the matrix to an mxArray
-        if ((mx = mat2mx(&mat)) == NULL)
-                goto desc2mx_quit;
+        // Get the data
+        if ((mxData = mxGetData(mx)) == NULL) {
+                mxDestroyArray(mx);
+                return NULL;
+        }
 
-        // Clean up
-        cleanup_Mat_rm(&mat);
+        // Copy each descriptor directly to a row of the array, with the
+        // precision of SIFT3D_Descriptor_store_to_Mat_rm
+        for (i = 0; i < desc->num; i++) {
 
-        return mx;
+                const SIFT3D_Descriptor *const d = desc->buf + i;
+                double *const row = mxData + i;
 
-desc2mx_quit:
-        cleanup_Mat_rm(&mat);
-        return NULL;
+                row[0] = (double) (float) d->xd;
+                row[rows] = (double) (float) d->yd;
+                row[2 * rows] = (double) (float) d->zd;
+
+                for (j = 0; j < DESC_NUM_TOTAL_HIST; j++) {
+
+                        const Hist *const hist = d->hists + j;
+                        double *const el = row + (IM_NDIMS + j * HIST_NUMEL) *
+                                rows;
+
+                        for (k = 0; k < HIST_NUMEL; k++) {
+                                el[k * rows] = (double) hist->bins[k];
+                        }
+                }
+        }
+
+        return mx;
 } 
 
 /* Converts a pair of mxArrays to a SIFT3D_Descriptor_store. */
@@ -710,9 +821,11 @@ int mexHaveGpyr(void) {
  * Returns SIFT3D_SUCCESS on success, SIFT3D_FAILURE otherwise. */
 int mex_set_opts_SIFT3D(const mxArray *const mx) {
 
-        SIFT3D sift3d;
-        const mxArray *mxFirstOctave, *mxPeakThresh, *mxCornerThresh, 
-                *mxNumKpLevels, *mxSigmaN, *mxSigma0;
+        Mex_opts opts;
+        const mxArray *mxPeakThresh, *mxCornerThresh, *mxNumKpLevels, 
+                *mxSigmaN, *mxSigma0;
+
+        SIFT3D *const sift3d = &reg.sift3d;
 
         // Verify inputs
         if (mxIsEmpty(mx) || !mxIsStruct(mx))
@@ -726,40 +839,38 @@ int mex_set_opts_SIFT3D(const mxArray *const mx) {
                 (mxSigma0 = mxGetField(mx, 0, "sigma0")) == NULL)
                 return SIFT3D_FAILURE;
 
-        // Initialize intermediates
-        if (init_SIFT3D(&sift3d))
-                return SIFT3D_FAILURE;
-
-        // Set the non-empty options in our new SIFT3D struct
-        if (!mxIsEmpty(mxPeakThresh) && 
-                set_peak_thresh_SIFT3D(&sift3d, mxGetScalar(mxPeakThresh)))
-                goto mex_set_opts_SIFT3D_quit;
-        if (!mxIsEmpty(mxCornerThresh) &&
-                set_corner_thresh_SIFT3D(&sift3d, mxGetScalar(mxCornerThresh)))
-                goto mex_set_opts_SIFT3D_quit;
-        if (!mxIsEmpty(mxNumKpLevels) &&
-                set_num_kp_levels_SIFT3D(&sift3d, 
-                (int) mxGetScalar(mxNumKpLevels)))
-                goto mex_set_opts_SIFT3D_quit;
-        if (!mxIsEmpty(mxSigmaN) &&
-                set_sigma_n_SIFT3D(&sift3d, mxGetScalar(mxSigmaN)))
-                goto mex_set_opts_SIFT3D_quit;
-        if (!mxIsEmpty(mxSigma0) &&
-                set_sigma0_SIFT3D(&sift3d, mxGetScalar(mxSigma0)))
-                goto mex_set_opts_SIFT3D_quit;
-
-        // Set the options in the Reg_SIFT3D struct
-        if (set_SIFT3D_Reg_SIFT3D(&reg, &sift3d))
-                goto mex_set_opts_SIFT3D_quit;
-
-        // Clean up
-        cleanup_SIFT3D(&sift3d);
+        // Get the non-empty options
+        opts = opts_default;
+        if (!mxIsEmpty(mxPeakThresh))
+                opts.peak_thresh = mxGetScalar(mxPeakThresh);
+        if (!mxIsEmpty(mxCornerThresh))
+                opts.corner_thresh = mxGetScalar(mxCornerThresh);
+        if (!mxIsEmpty(mxNumKpLevels))
+                opts.num_kp_levels = (int) mxGetScalar(mxNumKpLevels);
+        if (!mxIsEmpty(mxSigmaN))
+                opts.sigma_n = mxGetScalar(mxSigmaN);
+        if (!mxIsEmpty(mxSigma0))
+                opts.sigma0 = mxGetScalar(mxSigma0);
+
+        // Set only the options which have changed, so the persistent SIFT3D 
+        // struct keeps its memory and device state across calls
+        if (opts.peak_thresh != sift3d->peak_thresh &&
+                set_peak_thresh_SIFT3D(sift3d, opts.peak_thresh))
+                return SIFT3D_FAILURE;
+        if (opts.corner_thresh != sift3d->corner_thresh &&
+                set_corner_thresh_SIFT3D(sift3d, opts.corner_thresh))
+                return SIFT3D_FAILURE;
+        if (opts.num_kp_levels != sift3d->gpyr.num_kp_levels &&
+                set_num_kp_levels_SIFT3D(sift3d, opts.num_kp_levels))
+                return SIFT3D_FAILURE;
+        if (opts.sigma_n != sift3d->gpyr.sigma_n &&
+                set_sigma_n_SIFT3D(sift3d, opts.sigma_n))
+                return SIFT3D_FAILURE;
+        if (opts.sigma0 != sift3d->gpyr.sigma0 &&
+                set_sigma0_SIFT3D(sift3d, opts.sigma0))
+                return SIFT3D_FAILURE;
 
         return SIFT3D_SUCCESS;
-
-mex_set_opts_SIFT3D_quit:
-        cleanup_SIFT3D(&sift3d);
-        return SIFT3D_FAILURE;
 }
 
 /* Wrapper to set the options for the Reg_SIFT3D struct. The argument mx shall
@@ -31,6 +31,10 @@ mxArray *im2mx(const Image *const im);
 
 int mx2im(const mxArray *const mx, Image *const im);
 
+int mx2imShared(const mxArray *const mx, Image *const im, int *const shared);
+
+void mxImFree(Image *const im, const int shared);
+
 mxArray *units2mx(const Image *const im);
 
 int mx2units(const mxArray *const mx, Image *const im);
@@ -38,6 +42,9 @@ int mx2units(const mxArray *const mx, Image *const im);
 int mx2imWithUnits(const mxArray *const data, const mxArray *const units,
         Image *const im);
 
+int mx2imSharedWithUnits(const mxArray *const data, 
+        const mxArray *const units, Image *const im, int *const shared);
+
 mxArray *mat2mx(const Mat_rm *const mat);
 
 int mx2mat(const mxArray *const mx, Mat_rm *const mat);